@@ -1154,11 +1154,17 @@ bool FSVolume::UpdateMRIFromImage( vtkImageData* rasImage, bool resampleToOrigin
   else
   {
     global_progress_range[1] = nstart+(nend-nstart)/3;
+    // copy a row at a time: rows are contiguous in every layout, but the
+    // slices of a bricked volume are not (its bytes_per_slice is 0)
+    size_t nRowBytes = mri->width * MRIsizeof( mri->type );
     for ( int k = 0; k < mri->depth; k++ )
     {
-      void* ptr = rasImage->GetScalarPointer( 0, 0, k );
-      BUFTYPE* buf = &MRIseq_vox( mri, 0, 0, k, 0);
-      memcpy( buf, ptr, mri->bytes_per_slice );
+      for ( int j = 0; j < mri->height; j++ )
+      {
+        void* ptr = rasImage->GetScalarPointer( 0, j, k );
+        BUFTYPE* buf = &MRIseq_vox( mri, 0, j, k, 0);
+        memcpy( buf, ptr, nRowBytes );
+      }
 
       if ( mri->depth >= 5 && k%(mri->depth/5) == 0 )
       {
@@ -0,0 +1,72 @@
+/**
+ * @file  bgzf.h
+ * @brief multithreaded block-gzip (BGZF) file i/o
+ *
+ * A BGZF file is a series of independent gzip members, each holding at
+ * most 64k of uncompressed data and recording its compressed size in a
+ * "BC" extra field (the layout used by BAM/tabix). Any gzip reader,
+ * including zlib's gzread() and znzlib, reads it as one stream, but
+ * because the members are independent they can be deflated and
+ * inflated in parallel. znzopen() reads existing BGZF files with it
+ * whenever more than one thread is available. New compressed files
+ * (.mgz, .nii.gz, ...) are still written as plain gzip unless BGZF
+ * writing is turned on with FS_GZIP_BGZF or BGZFsetWrite(1).
+ *
+ * Knobs: FS_GZIP_BGZF, FS_GZIP_THREADS (1 = plain single-threaded
+ * zlib) and FS_GZIP_LEVEL (0-9), or BGZFsetWrite()/BGZFsetThreads()/
+ * BGZFsetLevel(). A level digit in the znzopen() mode ("wb9")
+ * overrides the default level.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#ifndef BGZF_H
+#define BGZF_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+#define BGZF_BLOCK_SIZE      0xff00   // uncompressed bytes per member
+#define BGZF_MAX_BLOCK_SIZE  0x10000  // limit on a whole member (BSIZE+1)
+
+typedef struct BGZF_FILE BGZF_FILE ;
+
+int        BGZFsetThreads(int nthreads) ;
+int        BGZFgetThreads(void) ;
+int        BGZFsetLevel(int level) ;
+int        BGZFgetLevel(void) ;
+int        BGZFsetWrite(int on) ;
+int        BGZFgetWrite(void) ;
+int        BGZFisBlocked(const char *path) ;
+int        BGZFuseFor(const char *path, const char *mode) ;
+
+BGZF_FILE  *BGZFopen(const char *path, const char *mode) ;
+int        BGZFclose(BGZF_FILE *bfp) ;
+size_t     BGZFread(BGZF_FILE *bfp, void *buf, size_t len) ;
+size_t     BGZFwrite(BGZF_FILE *bfp, const void *buf, size_t len) ;
+long       BGZFseek(BGZF_FILE *bfp, long offset, int whence) ;
+long       BGZFtell(BGZF_FILE *bfp) ;
+int        BGZFflush(BGZF_FILE *bfp) ;
+int        BGZFeof(BGZF_FILE *bfp) ;
+int        BGZFgetc(BGZF_FILE *bfp) ;
+int        BGZFputc(BGZF_FILE *bfp, int c) ;
+char       *BGZFgets(BGZF_FILE *bfp, char *str, int size) ;
+
+#if defined(__cplusplus)
+};
+#endif
+
+#endif
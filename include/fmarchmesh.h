@@ -52,6 +52,8 @@ MyVector;
 
 /* function declarations */
 float *FastMarchMesh(MRI_SURFACE *mesh, int *contour, int numinitvert, float thred);
+float ReCompute(int vIDc, int vIDa, int vIDb, MRI_SURFACE *mesh, float *T, unsigned char *label);
+float ComputeTInAcute(float,float,float,float,float);
 
 
 #endif
@@ -121,6 +121,8 @@ typedef struct
   short   n_just_priors ;
   int     ntraining ;
   char    regularized ;
+  float   *inv_covars ;   /* ninputs x ninputs inverse, set by GCAcacheDensities */
+  double  log_sqrt_det ;  /* log(sqrt(det(covars))), valid iff inv_covars */
 }
 GC1D, GAUSSIAN_CLASSIFIER_1D ;
 
@@ -200,6 +202,8 @@ typedef struct
   int          total_training ;
   int          max_label ;
   COLOR_TABLE  *ct ;
+  void         *flat ;  // non-NULL if nodes/priors live in a .gcaf mapping
+  float        *density_cache ; // backing store for GC1D inv_covars
 }
 GAUSSIAN_CLASSIFIER_ARRAY, GCA ;
 
@@ -468,6 +472,10 @@ MATRIX *load_covariance_matrix( const GC1D *gc,
 				MATRIX *m_cov, const int ninputs);
 MATRIX *load_inverse_covariance_matrix(GC1D *gc, MATRIX *m_cov, int ninputs) ;
 double covariance_determinant( const GC1D *gc, const int ninputs );
+/* per-GC1D inverse covariance/log-determinant cache used by the labeling
+   loops. Must be freed before any covariance is modified. */
+int    GCAcacheDensities(GCA *gca) ;
+int    GCAfreeDensityCache(GCA *gca) ;
 void load_vals( const MRI *mri_inputs,
 		float x, float y, float z,
 		float *vals, int ninputs ) ;
@@ -606,6 +614,19 @@ double gm_prior(GCA *gca, MRI *mri, TRANSFORM *transform, int x, int y, int z) ;
 MRI *GCAsampleToVol(MRI *mri, GCA *gca, TRANSFORM *transform, MRI **seg, MRI *out);
 MRI *GCAsampleToVolWMSAprob(MRI *mri, GCA *gca, TRANSFORM *transform, MRI *out);
 
+/* flat, mmap-able atlas format (gcaflat.c). GCAread() recognizes these
+   files by their magic number and GCAwrite() writes one when the name
+   ends in .gcaf */
+#define GCA_FLAT_MAGIC      "FSGCAF\n"
+#define GCA_FLAT_VERSION    1
+#define GCA_FLAT_EXTENSION  ".gcaf"
+int  GCAisFlatFile(const char *fname) ;
+int  GCAflatSidecar(const char *fname, char *flat_fname) ;
+GCA  *GCAreadFlat(const char *fname) ;
+int  GCAwriteFlat(GCA *gca, const char *fname) ;
+int  GCAunmap(GCA *gca) ;
+int  GCAreleaseFlat(GCA *gca) ;
+
 #if defined(__cplusplus)
 };
 #endif
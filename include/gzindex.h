@@ -0,0 +1,77 @@
+/**
+ * @file  gzindex.h
+ * @brief random access into gzip files through a seek index
+ *
+ * A seek index records deflate restart points (compressed and
+ * uncompressed offsets plus the 32k window preceding each point) taken
+ * during one full decompression pass. Data at any uncompressed offset
+ * can then be decoded starting from the nearest preceding point instead
+ * of from the start of the file. Files of concatenated gzip members
+ * (e.g. BGZF, see bgzf.h) are indexed across member boundaries.
+ * Indices are cached in a sidecar file
+ * (<file>.gzidx) keyed on the size and mtime of the gzip file.
+ * Adapted from zran.c in the zlib distribution (Mark Adler).
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#ifndef GZINDEX_H
+#define GZINDEX_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define GZI_WINSIZE        32768          // deflate window
+#define GZI_DEFAULT_SPAN   (2*1024*1024)  // uncompressed bytes between points
+
+typedef struct
+{
+  off_t          out ;                    // uncompressed offset of point
+  off_t          in ;                     // compressed offset of point
+  int            bits ;                   // bits of the byte before in
+  unsigned char  window[GZI_WINSIZE] ;    // preceding uncompressed data
+} GZI_POINT ;
+
+typedef struct
+{
+  int        npoints ;
+  GZI_POINT  *points ;
+  off_t      total_out ;    // uncompressed length of the file
+  off_t      file_size ;    // size of the gzip file when indexed
+  long       file_mtime ;   // mtime of the gzip file when indexed
+} GZ_INDEX ;
+
+typedef struct GZI_READER GZI_READER ;
+
+GZ_INDEX   *GZIbuild(const char *fname, off_t span) ;
+int        GZIwrite(GZ_INDEX *gzi, const char *idx_fname) ;
+GZ_INDEX   *GZIread(const char *idx_fname) ;
+GZ_INDEX   *GZIload(const char *fname, int build) ;
+int        GZIisCurrent(GZ_INDEX *gzi, const char *fname) ;
+int        GZIfree(GZ_INDEX **pgzi) ;
+
+GZI_READER *GZIopenReader(GZ_INDEX *gzi, const char *fname, off_t offset) ;
+size_t     GZIreaderRead(GZI_READER *gzr, void *buf, size_t len) ;
+int        GZIcloseReader(GZI_READER **pgzr) ;
+size_t     GZIextract(GZ_INDEX *gzi, const char *fname, off_t offset,
+                      void *buf, size_t len) ;
+
+#if defined(__cplusplus)
+};
+#endif
+
+#endif
@@ -135,6 +135,7 @@ LABEL   *MaskSurfLabel(LABEL *lbl,
 
 int     LabelErode(LABEL *area, MRI_SURFACE *mris, int num_times);
 int     LabelDilate(LABEL *area, MRI_SURFACE *mris, int num_times);
+int     LabelDilateGeodesic(LABEL *area, MRI_SURFACE *mris, float dist);
 
 int   LabelSetStat(LABEL *area, float stat) ;
 int   LabelCopyStatsToSurface(LABEL *area, MRI_SURFACE *mris, int which) ;
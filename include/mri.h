@@ -246,6 +246,15 @@ typedef struct
   size_t    bytes_per_slice; // # bytes per slice
   size_t    bytes_per_vol; // # bytes per volume/timepoint
   size_t    bytes_total; // # total number of pixel bytes in the struct
+  // "Bricked" layout (only when ischunked): rows of the chunk are stored
+  // in brick_size x brick_size tiles of (row,slice) so that neighbors in
+  // y and z are close in memory. Each row is still contiguous, so
+  // slices[z][y] and the MRIvox() family work unchanged. 0 = linear chunk.
+  int    brick_size;
+  // If non-NULL, chunk points into a file mapping (see mghRead()) that
+  // starts at mmap_base and is mmap_bytes long. MRIfree() unmaps it.
+  void   *mmap_base;
+  size_t mmap_bytes;
   COLOR_TABLE *ct ;
   MRI_FRAME   *frames ;
 }
@@ -386,6 +395,13 @@ int   MRIsetResolution(MRI *mri, float xres, float yres, float zres) ;
 int   MRIsetTransform(MRI *mri,   General_transform *transform) ;
 MRI * MRIallocChunk(int width, int height, int depth, int type, int nframes);
 int   MRIchunk(MRI **pmri);
+#define MRI_DEFAULT_BRICK_SIZE 8
+MRI * MRIallocBricked(int width, int height, int depth, int type, int nframes,
+                      int brick_size);
+int   MRIbrick(MRI **pmri, int brick_size);
+MRI * MRIallocChunkMapped(int width, int height, int depth, int type,
+                          int nframes, void *mmap_base, size_t mmap_bytes,
+                          size_t offset);
 
 
 /* correlation routines */
@@ -683,6 +699,16 @@ MRI   *MRImin(MRI *mri1, MRI *mri2, MRI *mri_min);
 MRI   *MRIminmax(MRI *mri_src, MRI *mri_dst, MRI *mri_dir, int wsize) ;
 MRI   *MRIgaussian1d(float sigma, int max_len) ;
 MRI   *MRIconvolveGaussian(MRI *mri_src, MRI *mri_dst, MRI *mri_gaussian) ;
+// separable float-row engine behind MRIconvolveGaussian (mriconvolve.c)
+MRI   *MRIconvolveGaussianSeparable(MRI *mri_src, MRI *mri_dst,
+                                    float *kernel, int klen) ;
+MRI   *MRIconvolveGaussianIIR(MRI *mri_src, MRI *mri_dst, float sigma) ;
+int   MRIconvolveFloat1d(const float *src, float *dst, int width, int height,
+                         int depth, const float *k, int len, int axis) ;
+void  MRIconvolveRowAxpy(float *out, const float *in, float k, int n) ;
+int   MRIframeToFloat(MRI *mri, int frame, float *buf) ;
+int   MRIfloatToFrame(float *buf, MRI *mri, int frame) ;
+float MRIkernelSigma(float *kernel, int klen) ;
 MRI   *MRIgaussianSmooth(MRI *src, double std, int norm, MRI *targ);
 MRI   *MRImaskedGaussianSmooth(MRI *src, MRI *binmask, double std, MRI *targ);
 MRI   *MRIconvolveGaussianMeanAndStdByte(MRI *mri_src, MRI *mri_dst,
@@ -1044,6 +1070,19 @@ int MRIvol2Vol(MRI *src, MRI *targ, MATRIX *Vt2s,
 int MRIvol2VolR(MRI *src, MRI *targ, MATRIX *Vt2s,
                int InterpCode, float param, MATRIX* RRot);
 
+// row-walking resampling engine behind MRIlinearTransformInterp(),
+// MRIvol2Vol() and MRIresampleFill() (mriresample.c). The mode selects
+// whose border handling and arithmetic to reproduce.
+#define RESAMPLE_LIKE_TRANSFORM  0  // MRIlinearTransformInterp()
+#define RESAMPLE_LIKE_VOL2VOL    1  // MRIvol2Vol(), skips voxels outside src
+#define RESAMPLE_LIKE_FILL       2  // MRIresampleFill(), zero padded
+#define RESAMPLE_INCREMENTAL     0x01 // double row coordinates, not bit-exact
+#define RESAMPLE_PROGRESS        0x02 // call exec_progress_callback()
+int MRIresampleAffine(MRI *src, MRI *dst, MATRIX *Vd2s, int InterpCode,
+                      int mode, int flags);
+int MRIresampleAffineSupported(const MRI *src, const MRI *dst,
+                               int InterpCode, int mode);
+
 MRI *MRIresampleFill(MRI *src, MRI *template_vol,
                      int resample_type, float fill_val) ;
 MRI *MRIreplaceList(MRI *seg, int *srclist, int *targlist, int nlist, MRI *mask, MRI *out);
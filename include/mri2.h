@@ -120,6 +120,7 @@ int MRIsegStats(MRI *seg, int segid, MRI *mri,int frame,
 int MRIsegStatsRobust(MRI *seg, int segid, MRI *mri,int frame,
 		      float *min, float *max, float *range,
 		      float *mean, float *std, float Pct);
+int MRIsegCount(MRI *seg, int id, int frame);
 
 MRI *MRImask_with_T2_and_aparc_aseg(MRI *mri_src, MRI *mri_dst, MRI *mri_T2, MRI *mri_aparc_aseg, float T2_thresh, int mm_from_exterior) ;
 int *MRIsegmentationList(MRI *seg, int *pListLength);
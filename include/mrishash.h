@@ -107,6 +107,13 @@ typedef struct _mht
   struct _mht       *mhts[MAX_SURFACES] ; // for MRI_SURFACE_ARRAYs
   MRI_SURFACE       *mris[MAX_SURFACES] ;
   int                ntables ;
+  // MHTfill* build every bucket and bin in these two contiguous pools
+  // (CSR style: each bucket's bins are a slice of bin_pool). Buckets
+  // that outgrow their slice through MHTaddAllFaces are moved to their
+  // own allocation.
+  MRIS_HASH_BUCKET  *bucket_pool ;
+  MRIS_HASH_BIN     *bin_pool ;
+  int                nbins_pool ;
 } MRIS_HASH_TABLE, MHT ;
 
 //------------------------------------------------
@@ -198,6 +205,29 @@ VERTEX *MHTfindClosestVertexInTable(MRIS_HASH_TABLE *mht,
                                     MRI_SURFACE *mris,
                                     float x, float y, float z, int do_global_search) ;
 
+//------- batched queries (vertex tables) ------------
+// Query many points at once, in parallel. xyz holds npoints x,y,z
+// triples; pass xyz=NULL to query every vertex of mris itself (using
+// the table's which_vertices coords; each vertex then finds itself at
+// distance 0). These only read the table, so any number of threads may
+// query one table concurrently as long as nobody modifies it.
+
+// k nearest vertices within max_dist of each point, nearest first:
+// vnos/dists are npoints*k, unfilled entries are -1.
+int MHTfindKNearestVertices(MRIS_HASH_TABLE *mht,
+                            MRI_SURFACE *mris,
+                            int npoints, const float *xyz,
+                            int k, double max_dist,
+                            int *vnos, float *dists) ;
+// All vertices within radius of each point, in CSR form: the hits of
+// point i are (*pvnos)[(*poffsets)[i]] .. (*pvnos)[(*poffsets)[i+1]-1].
+// Both arrays are allocated here and must be freed by the caller.
+int MHTfindVerticesWithinRadius(MRIS_HASH_TABLE *mht,
+                                MRI_SURFACE *mris,
+                                int npoints, const float *xyz,
+                                double radius,
+                                int **poffsets, int **pvnos) ;
+
 //------------------------------------------------
 //  Utility
 //------------------------------------------------
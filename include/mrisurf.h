@@ -208,6 +208,60 @@ STRIP;
 
 #include "transform.h" // TRANSFORM, LTA
 
+/*
+  Flat face geometry kept by MRISsoaComputeMetricProperties() so that
+  an update can be limited to the faces around moved vertices.
+*/
+typedef struct
+{
+  int    nvertices, nfaces ;
+  int    valid ;                // 0 until the next update is a full one
+  int    status ;               // mris->status it was computed for
+  int    fix_vertex_area ;      //   and MRISgetFixVertexAreaValue()
+  int    *fv ;                  // 3 vertices per face
+  char   *fripflag ;
+  float  *farea ;
+  float  *fnormal ;             // 3 per face, unit normal
+  float  *fcorner ;             // 9 per face, vertex normal term per corner
+  int    *vf_start ;            // nvertices+1: faces of vno in v->f order
+  int    *vf ;                  //   are vf[vf_start[vno]..], as 4*fno+corner
+  float  *x, *y, *z ;           // positions it was computed from
+  char   *ripflag ;
+  int    *vtotal ;
+  float  **dist ;               // v->dist it was written to
+  unsigned char *vflags, *fflags ;
+  int    *list ;                // scratch, max(nvertices, nfaces) long
+}
+MRIS_SOA_METRIC ;
+
+/*
+  Struct-of-arrays copy of the per-vertex fields the hot surface
+  kernels read, plus the 1-ring neighbor lists in CSR form (the
+  neighbors of vno are nbrs[nbr_start[vno]..nbr_start[vno+1]-1], in
+  v->v order). The VERTEX array stays authoritative; see mrisurfsoa.c.
+*/
+typedef struct
+{
+  int    nvertices ;
+  float  *x, *y, *z ;
+  float  *origx, *origy, *origz ;
+  float  *nx, *ny, *nz ;
+  float  *dx, *dy, *dz ;
+  float  *tdx, *tdy, *tdz ;     // scratch for averaging
+  float  *curv ;
+  float  *area, *origarea ;
+  char   *ripflag ;
+  char   *border ;
+  char   *neg ;
+  int    *nbr_start ;           // nvertices+1 long
+  int    *nbrs ;
+  int    max_nbrs ;             // allocated length of nbrs
+  void   *block ;
+  MRIS_SOA_METRIC *metric ;     // NULL until metric properties are computed
+  int    metric_incremental ;   // only recompute around moved vertices
+}
+MRIS_SOA ;
+
 typedef struct
 {
   int          nvertices ;      /* # of vertices on surface */
@@ -302,6 +356,7 @@ typedef struct
   MATRIX *m_sras2vox ;             // for converting surface ras to voxel 
   MRI    *mri_sras2vox ;           // volume that the above matrix is for
   void   *mht ;
+  MRIS_SOA *soa ;                  // optional SoA mirror of the vertices
 }
 MRI_SURFACE, MRIS ;
 
@@ -749,6 +804,56 @@ int          MRISreadAnnotationIntoArray(const char *fname,
 int          MRISreadCTABFromAnnotationIfPresent(const char *fname,
                                                  COLOR_TABLE** out_table);
 int          MRISisCTABPresentInAnnotation(const char *fname, int* present);
+
+/*
+  Columnar container of named per-vertex arrays for one hemisphere, see
+  mrisvpack.c. The readers above accept "<pack>:<name>" and fall back
+  to <dir>/<hemi>.vpack or <dir>/../surf/<hemi>.vpack when a file such
+  as label/lh.aparc.annot does not exist (column "aparc.annot").
+*/
+#define MRIS_VPACK_EXTENSION  ".vpack"
+#define MRIS_VPACK_NAME_LEN   64
+#define MRIS_VPACK_FLOAT      1      // nvertices floats
+#define MRIS_VPACK_INT        2      // nvertices ints
+#define MRIS_VPACK_BYTES      3      // opaque, eg an annotation colortable
+
+typedef struct
+{
+  char      name[MRIS_VPACK_NAME_LEN] ;
+  int       type ;
+  int       pad ;
+  long long offset ;            // from the start of the file
+  long long nbytes ;
+}
+MRIS_VPACK_COLUMN ;
+
+typedef struct
+{
+  char              *fname ;
+  int               nvertices ;
+  int               ncolumns ;
+  int               max_columns ;
+  MRIS_VPACK_COLUMN *columns ;  // sorted by name once read
+  void              **data ;    // column data while building, else NULL
+  void              *base ;     // the file when read
+  size_t            bytes ;
+  int               mapped ;    // base is an mmap, not a malloc
+}
+MRIS_VPACK ;
+
+MRIS_VPACK *MRISvpackAlloc(int nvertices) ;
+int MRISvpackFree(MRIS_VPACK **pvp) ;
+int MRISvpackAddColumn(MRIS_VPACK *vp, const char *name, int type,
+                       const void *data, long long nbytes) ;
+int MRISvpackWrite(MRIS_VPACK *vp, const char *fname) ;
+MRIS_VPACK *MRISvpackRead(const char *fname) ;
+const MRIS_VPACK_COLUMN *MRISvpackFindColumn(const MRIS_VPACK *vp,
+                                             const char *name) ;
+const void *MRISvpackColumnData(const MRIS_VPACK *vp,
+                                const MRIS_VPACK_COLUMN *col) ;
+int MRISvpackOverlayName(const char *fname, char *pack_fname, char *name) ;
+int MRISvpackReadOverlay(const char *fname, const char *suffix, int type,
+                         void **pdata, long long *pnbytes) ;
 int          MRISreadValuesBak(MRI_SURFACE *mris,const  char *fname) ;
 int          MRISreadImagValues(MRI_SURFACE *mris,const  char *fname) ;
 int          MRIScopyImagValuesToValues(MRI_SURFACE *mris) ;
@@ -1046,6 +1151,9 @@ MRI_SP       *MRISPalloc(float scale, int nfuncs) ;
 int          MRISPfree(MRI_SP **pmrisp) ;
 MRI_SP       *MRISPread(char *fname) ;
 int          MRISPwrite(MRI_SP *mrisp, char *fname) ;
+MRI_SP       *MRISPblurCached(MRI_SP *mrisp_src, float sigma, int fno,
+                              int nframes) ;
+int          MRISPsetCacheDir(const char *dir) ;
 
 int          MRISwriteArea(MRI_SURFACE *mris,const  char *sname) ;
 int          MRISwriteMarked(MRI_SURFACE *mris,const  char *sname) ;
@@ -1641,6 +1749,42 @@ MRI *MRISsmoothMRI(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask, MRI *Ta
 MRI *MRISsmoothMRIFast(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask,  MRI *Targ);
 MRI *MRISsmoothMRIFastD(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask,  MRI *Targ);
 int MRISsmoothMRIFastCheck(int nSmoothSteps);
+
+/*
+  Sparse (CSR) operator on per-vertex data, see mriscsr.c. Row r sums
+  the columns col[row_start[r]..row_start[r+1]-1], either averaging
+  them (w == NULL) or weighting them by w and dividing by den[r] (if
+  den is not NULL). Data is vertex-major, frames as columns.
+*/
+typedef struct
+{
+  int    nrows, ncols, nnz ;
+  int    *row_start ;           // nrows+1 long
+  int    *col ;
+  float  *w ;                   // NULL for an unweighted average
+  double *den ;                 // optional per-row divisor
+  int    nsteps ;               // smoothing steps folded in, 0 if none
+  unsigned long long key ;      // identifies what it was built from
+}
+MRIS_CSR ;
+
+MRIS_CSR *MRIScsrAlloc(int nrows, int ncols, int nnz, int weighted) ;
+int MRIScsrFree(MRIS_CSR **pcsr) ;
+#define MRIS_CSR_HASH_INIT 0xcbf29ce484222325ULL
+unsigned long long MRIScsrHashBytes(unsigned long long h, const void *buf,
+                                    size_t nbytes) ;
+unsigned long long MRIScsrHash(const MRIS_CSR *csr) ;
+MRIS_CSR *MRIScsrSmoothOp(MRIS *mris, MRI *IncMask) ;
+int MRIScsrApply(const MRIS_CSR *csr, const float *x, float *y, int nframes) ;
+float *MRIScsrApplySteps(const MRIS_CSR *csr, float *x, float *tmp,
+                         int nframes, int nsteps) ;
+MRIS_CSR *MRIScsrMultiply(const MRIS_CSR *a, const MRIS_CSR *b, long max_nnz) ;
+MRIS_CSR *MRIScsrPower(const MRIS_CSR *csr, int n, long max_nnz) ;
+int MRIScsrWrite(const MRIS_CSR *csr, const char *fname) ;
+MRIS_CSR *MRIScsrRead(const char *fname) ;
+MRI *MRIScsrApplyMRI(const MRIS_CSR *csr, MRI *src, MRI *dst) ;
+MRI *MRISsmoothMRICSR(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask,
+                      MRI *Targ) ;
 int MRISsmoothMRIFastFrame(MRIS *Surf, MRI *Src, int frame, int nSmoothSteps, MRI *IncMask);
 
 
@@ -1709,6 +1853,99 @@ void MRISsetVolumeForSurface(MRI_SURFACE *mris, MRI *srcMri);
 
 MRI *MRISremoveRippedFromMask(MRIS *surf, MRI *mask, MRI *outmask);
 int MRISremoveIntersections(MRI_SURFACE *mris) ;
+
+/*
+  Bounding volume hierarchy over the faces of a surface, see mrisbvh.c.
+  Built once per topology and refit when vertices move.
+*/
+typedef struct
+{
+  float  box[6] ;               // xmin, ymin, zmin, xmax, ymax, zmax
+  int    start ;                // leaf: first face in fnos, else 1st child
+  int    count ;                // leaf: # of faces, 0 for interior nodes
+}
+MRIS_BVH_NODE ;
+
+typedef struct
+{
+  int           nvertices ;     // size of the surface it was built for
+  int           nfaces ;
+  int           which ;         // vertex set, eg CURRENT_VERTICES
+  int           nnodes ;
+  MRIS_BVH_NODE *nodes ;        // root is nodes[0], children follow parents
+  int           *parent ;       // parent of each node, -1 for the root
+  unsigned char *dirty ;        // nodes waiting for a refit
+  int           *fnos ;         // faces in leaf order
+  int           *leaf ;         // leaf holding each face
+  float         *box ;          // 6 per face, as in MRIS_BVH_NODE
+  float         *xyz ;          // coords of the vertex set at the last refit
+}
+MRIS_BVH ;
+
+MRIS_BVH *MRISbvhBuild(MRI_SURFACE *mris, int which) ;
+int MRISbvhFree(MRIS_BVH **pbvh) ;
+int MRISbvhRefit(MRIS_BVH *bvh, MRI_SURFACE *mris) ;
+int MRISbvhRefitVertices(MRIS_BVH *bvh, MRI_SURFACE *mris,
+                         const int *vnos, int nvnos) ;
+int MRISbvhDoesFaceIntersect(const MRIS_BVH *bvh, MRI_SURFACE *mris, int fno) ;
+int MRISbvhIntersectingFaces(const MRIS_BVH *bvh, MRI_SURFACE *mris,
+                             int *fnos) ;
+
+/*
+  Geodesic distances on a surface, see mrisgeodesic.c. An MRIS_GEODESIC
+  is the workspace for one query at a time; keep one per thread and reuse
+  it, a query only touches the vertices it reaches.
+*/
+#define GEODESIC_DIJKSTRA     0         // shortest paths along the edges
+#define GEODESIC_FAST_MARCH   1         // fast marching across the faces
+#define GEODESIC_UNREACHED    1e9f      // dist of vertices not reached
+
+// cost of the edge from vno to vno_nbr, < 0 if it can't be taken
+typedef float (*GEODESIC_EDGE_COST)(void *parm, int vno, int vno_nbr) ;
+
+typedef struct
+{
+  int           nvertices ;
+  int           method ;        // GEODESIC_DIJKSTRA or GEODESIC_FAST_MARCH
+  GEODESIC_EDGE_COST cost ;     // if set, Dijkstra with these edge costs
+  void          *cost_parm ;
+  float         *dist ;         // from the nearest source, exact if settled
+  int           *pred ;         // vertex each one was reached from, or -1
+  unsigned char *label ;        // ALIVE (settled), NBAND or 0 (fmarchmesh.h)
+  unsigned char *target ;
+  int           *heap_index ;   // backpointers into heap
+  void          *heap ;         // Xheap (heap.h)
+  int           *settled ;      // vertices in the order they were settled
+  int           nsettled ;
+  int           *touched ;      // every vertex the last query set dist of
+  int           ntouched ;
+}
+MRIS_GEODESIC ;
+
+// result of a bulk neighborhood query
+typedef struct
+{
+  int           nvnos ;
+  int           *vnos ;         // query vertices
+  int           *start ;        // nbrs of vnos[i] are [start[i],start[i+1])
+  int           *nbrs ;         // by increasing distance, without vnos[i]
+  float         *dist ;
+}
+MRIS_GEODESIC_NBHD ;
+
+MRIS_GEODESIC *MRISgeodesicAlloc(MRI_SURFACE *mris, int method) ;
+int MRISgeodesicFree(MRIS_GEODESIC **pgeo) ;
+int MRISgeodesicRun(MRIS_GEODESIC *geo, MRI_SURFACE *mris,
+                    const int *sources, int nsources, float max_dist,
+                    const int *targets, int ntargets) ;
+float *MRISgeodesicDistances(MRI_SURFACE *mris, const int *sources,
+                             int nsources, float max_dist, int method,
+                             float *dist) ;
+MRIS_GEODESIC_NBHD *MRISgeodesicNeighborhoods(MRI_SURFACE *mris,
+                                              const int *vnos, int nvnos,
+                                              float radius, int method) ;
+int MRISgeodesicFreeNeighborhoods(MRIS_GEODESIC_NBHD **pnbhd) ;
+int MRISsetGeodesicSampling(int method) ;
 int MRIScopyMarkedToMarked2(MRI_SURFACE *mris) ;
 int MRIScopyMarked2ToMarked(MRI_SURFACE *mris) ;
 int MRIScopyMarkedToMarked3(MRI_SURFACE *mris) ;
@@ -1805,6 +2042,17 @@ int MRISaverageGradients(MRI_SURFACE *mris, int num_avgs) ;
 int MRISaverageGradientsFast(MRI_SURFACE *mris, int num_avgs);
 int MRISaverageGradientsFastCheck(int num_avgs);
 
+// struct-of-arrays vertex mirror (mrisurfsoa.c)
+MRIS_SOA *MRISallocSoA(MRI_SURFACE *mris) ;
+int MRISfreeSoA(MRI_SURFACE *mris) ;
+int MRISverticesToSoA(const MRI_SURFACE *mris, MRIS_SOA *soa) ;
+int MRISsoaToVertices(const MRIS_SOA *soa, MRI_SURFACE *mris) ;
+int MRISsoaUpdatePositions(const MRI_SURFACE *mris, MRIS_SOA *soa) ;
+int MRISsoaUpdateTopology(const MRI_SURFACE *mris, MRIS_SOA *soa) ;
+int MRISsoaAverageGradients(MRI_SURFACE *mris, int num_avgs) ;
+int MRISsoaSpringTerm(MRI_SURFACE *mris, double l_spring, float dist_scale) ;
+int MRISsoaComputeMetricProperties(MRI_SURFACE *mris, int incremental) ;
+
 int MRISnormalTermWithGaussianCurvature(MRI_SURFACE *mris,double l_lambda) ;
 int MRISnormalSpringTermWithGaussianCurvature(MRI_SURFACE *mris,
                                               double gaussian_norm,
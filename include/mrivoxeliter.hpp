@@ -0,0 +1,348 @@
+/**
+ * @file  mrivoxeliter.hpp
+ * @brief Type-specialized voxel iteration over MRI structures
+ *
+ * MRIgetVoxVal()/MRIsetVoxVal() switch on mri->type for every voxel.
+ * The templates here switch once per volume (MRIdispatchType) and then
+ * walk typed row pointers, handing each voxel value to a functor.
+ *
+ * A dispatch functor provides a member template apply<T>() (or
+ * apply<T1,T2>() for MRIdispatchType2) which is instantiated for the
+ * C type of each supported MRI type (uchar, short, int, long, float).
+ * Inside apply() the visitors below can be used with that type.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#ifndef MRI_VOXEL_ITER_HPP
+#define MRI_VOXEL_ITER_HPP
+
+#include <limits.h>
+
+#include "mri.h"
+#include "error.h"
+#include "macros.h"
+#include "utils.h"
+
+namespace Freesurfer
+{
+
+// ======================================================
+// Typed voxel access
+
+//! Typed pointer to row y of slice z in frame f
+template<typename T>
+inline T* MRItypedRow( const MRI *mri, const int y, const int z, const int f )
+{
+  return( (T*)mri->slices[z + f*mri->depth][y] );
+}
+
+//! Converts a float to voxel type T with the same clipping and rounding as MRIsetVoxVal
+template<typename T>
+inline T MRIvoxelFromFloat( float val );
+
+template<>
+inline unsigned char MRIvoxelFromFloat<unsigned char>( float val )
+{
+  if( val < 0 ) val = 0;
+  if( val > UCHAR_MAX ) val = UCHAR_MAX;
+  return( (unsigned char)nint(val) );
+}
+
+template<>
+inline short MRIvoxelFromFloat<short>( float val )
+{
+  if( val < SHRT_MIN ) val = SHRT_MIN;
+  if( val > SHRT_MAX ) val = SHRT_MAX;
+  return( (short)nint(val) );
+}
+
+template<>
+inline int MRIvoxelFromFloat<int>( float val )
+{
+  if( val < INT_MIN ) val = INT_MIN;
+  if( val > INT_MAX ) val = INT_MAX;
+  return( nint(val) );
+}
+
+template<>
+inline long MRIvoxelFromFloat<long>( float val )
+{
+  if( val < INT_MIN ) val = INT_MIN;
+  if( val > INT_MAX ) val = INT_MAX;
+  return( (long)nint(val) );
+}
+
+template<>
+inline float MRIvoxelFromFloat<float>( float val )
+{
+  return( val );
+}
+
+// ======================================================
+// Type dispatch
+
+//! Calls f.apply<T>() with T the C type of mri->type
+template<typename F>
+void MRIdispatchType( const MRI *mri, F& f )
+{
+  switch( mri->type )
+  {
+  case MRI_UCHAR:
+    f.template apply<unsigned char>();
+    break;
+  case MRI_SHORT:
+    f.template apply<short>();
+    break;
+  case MRI_INT:
+    f.template apply<int>();
+    break;
+  case MRI_LONG:
+    f.template apply<long>();
+    break;
+  case MRI_FLOAT:
+    f.template apply<float>();
+    break;
+  default:
+    ErrorExit( ERROR_UNSUPPORTED,
+               "MRIdispatchType: unsupported MRI type %d", mri->type );
+  }
+}
+
+//! Helper for MRIdispatchType2 once the first type is known
+template<typename F, typename T1>
+class MRIdispatchSecond
+{
+public:
+  MRIdispatchSecond( F& _f ) : f(_f) {};
+
+  template<typename T2>
+  void apply( void )
+  {
+    f.template apply<T1,T2>();
+  }
+
+private:
+  F& f;
+};
+
+//! Helper for MRIdispatchType2 to resolve the first type
+template<typename F>
+class MRIdispatchFirst
+{
+public:
+  MRIdispatchFirst( F& _f, const MRI *_mri2 ) : f(_f), mri2(_mri2) {};
+
+  template<typename T1>
+  void apply( void )
+  {
+    MRIdispatchSecond<F,T1> second( f );
+    MRIdispatchType( mri2, second );
+  }
+
+private:
+  F& f;
+  const MRI *mri2;
+};
+
+//! Calls f.apply<T1,T2>() with the C types of mri1->type and mri2->type
+template<typename F>
+void MRIdispatchType2( const MRI *mri1, const MRI *mri2, F& f )
+{
+  MRIdispatchFirst<F> first( f, mri2 );
+  MRIdispatchType( mri1, first );
+}
+
+// ======================================================
+// Visitors. These must be called with T matching mri->type
+
+//! Calls v(val) for every voxel in the given frame
+template<typename T, typename V>
+void MRIvisitVoxels( const MRI *mri, const int frame, V& v )
+{
+  for( int z=0; z<mri->depth; z++ )
+  {
+    for( int y=0; y<mri->height; y++ )
+    {
+      const T *p = MRItypedRow<T>( mri, y, z, frame );
+      for( int x=0; x<mri->width; x++ )
+      {
+        v( p[x] );
+      }
+    }
+  }
+}
+
+//! Calls v(val) for every voxel of the region (clipped to the volume)
+template<typename T, typename V>
+void MRIvisitRegion( const MRI *mri, const MRI_REGION *region,
+                     const int frame, V& v )
+{
+  const int x0 = MAX( region->x, 0 );
+  const int y0 = MAX( region->y, 0 );
+  const int z0 = MAX( region->z, 0 );
+  const int x1 = MIN( region->x + region->dx, mri->width );
+  const int y1 = MIN( region->y + region->dy, mri->height );
+  const int z1 = MIN( region->z + region->dz, mri->depth );
+
+  for( int z=z0; z<z1; z++ )
+  {
+    for( int y=y0; y<y1; y++ )
+    {
+      const T *p = MRItypedRow<T>( mri, y, z, frame );
+      for( int x=x0; x<x1; x++ )
+      {
+        v( p[x] );
+      }
+    }
+  }
+}
+
+//! Predicate for MRIvisitInMask: mask voxel is non-zero
+class MRImaskNonZero
+{
+public:
+  template<typename M>
+  inline bool operator()( const M m ) const
+  {
+    return( m != 0 );
+  }
+};
+
+//! Predicate for MRIvisitInMask: (int) of the mask voxel equals label
+class MRImaskIsLabel
+{
+public:
+  MRImaskIsLabel( const int _label ) : label(_label) {};
+
+  template<typename M>
+  inline bool operator()( const M m ) const
+  {
+    return( (int)(float)m == label );
+  }
+
+private:
+  const int label;
+};
+
+//! Predicate for MRIvisitInMask: nint() of the mask voxel equals label
+class MRImaskIsLabelRounded
+{
+public:
+  MRImaskIsLabelRounded( const int _label ) : label(_label) {};
+
+  template<typename M>
+  inline bool operator()( const M m ) const
+  {
+    return( nint((float)m) == label );
+  }
+
+private:
+  const int label;
+};
+
+//! Calls v(val) for every voxel of mri where pred(mask voxel) is true
+template<typename T, typename M, typename P, typename V>
+void MRIvisitInMask( const MRI *mri, const int frame,
+                     const MRI *mask, const int maskFrame,
+                     const P& pred, V& v )
+{
+  for( int z=0; z<mri->depth; z++ )
+  {
+    for( int y=0; y<mri->height; y++ )
+    {
+      const T *p = MRItypedRow<T>( mri, y, z, frame );
+      const M *m = MRItypedRow<M>( mask, y, z, maskFrame );
+      for( int x=0; x<mri->width; x++ )
+      {
+        if( pred( m[x] ) )
+        {
+          v( p[x] );
+        }
+      }
+    }
+  }
+}
+
+//! As MRIvisitInMask, but in the x,y,z order (z fastest) of the
+//! MRIgetVoxVal() loops it replaces, so sums come out the same
+template<typename T, typename M, typename P, typename V>
+void MRIvisitInMaskXYZ( const MRI *mri, const int frame,
+                        const MRI *mask, const int maskFrame,
+                        const P& pred, V& v )
+{
+  for( int x=0; x<mri->width; x++ )
+  {
+    for( int y=0; y<mri->height; y++ )
+    {
+      for( int z=0; z<mri->depth; z++ )
+      {
+        if( pred( MRItypedRow<M>( mask, y, z, maskFrame )[x] ) )
+        {
+          v( MRItypedRow<T>( mri, y, z, frame )[x] );
+        }
+      }
+    }
+  }
+}
+
+//! Calls v(val1, val2) for corresponding voxels of two volumes
+template<typename T1, typename T2, typename V>
+void MRIzipVoxels( const MRI *mri1, const int frame1,
+                   MRI *mri2, const int frame2, V& v )
+{
+  for( int z=0; z<mri1->depth; z++ )
+  {
+    for( int y=0; y<mri1->height; y++ )
+    {
+      const T1 *p1 = MRItypedRow<T1>( mri1, y, z, frame1 );
+      T2 *p2 = MRItypedRow<T2>( mri2, y, z, frame2 );
+      for( int x=0; x<mri1->width; x++ )
+      {
+        v( p1[x], p2[x] );
+      }
+    }
+  }
+}
+
+//! Sets dst = MRIvoxelFromFloat(op(src)) for all voxels of all frames
+/*!
+  The slices are processed in parallel when OpenMP is available,
+  so op must not carry mutable state.
+*/
+template<typename T1, typename T2, typename Op>
+void MRItransformVoxels( const MRI *src, MRI *dst, const Op& op )
+{
+  for( int f=0; f<src->nframes; f++ )
+  {
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for( int z=0; z<src->depth; z++ )
+    {
+      for( int y=0; y<src->height; y++ )
+      {
+        const T1 *ps = MRItypedRow<T1>( src, y, z, f );
+        T2 *pd = MRItypedRow<T2>( dst, y, z, f );
+        for( int x=0; x<src->width; x++ )
+        {
+          pd[x] = MRIvoxelFromFloat<T2>( op( (float)ps[x] ) );
+        }
+      }
+    }
+  }
+}
+
+}
+
+#endif
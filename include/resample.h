@@ -115,6 +115,13 @@ MRI *vol2surf_linear(MRI *SrcVol,
 
 MRI *MRISapplyReg(MRI *SrcSurfVals, MRI_SURFACE **SurfReg, int nsurfs,
 		  int ReverseMapFlag, int DoJac, int UseHash);
+MRIS_CSR *MRISapplyRegMap(MRI_SURFACE **SurfReg, int nsurfs,
+			  int ReverseMapFlag, int DoJac, int UseHash);
+unsigned long long MRISapplyRegKey(MRI_SURFACE **SurfReg, int nsurfs,
+				   int ReverseMapFlag, int DoJac);
+MRIS_CSR *MRISapplyRegMapCached(MRI_SURFACE **SurfReg, int nsurfs,
+				int ReverseMapFlag, int DoJac, int UseHash,
+				const char *mapfile);
 MRI *surf2surf_nnfr(MRI *SrcSurfVals, MRI_SURFACE *SrcSurfReg,
                     MRI_SURFACE *TrgSurfReg, MRI **SrcHits,
                     MRI **SrcDist, MRI **TrgHits, MRI **TrgDist,
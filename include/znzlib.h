@@ -84,6 +84,7 @@ extern "C"
     FILE* nzfptr;
 #ifdef HAVE_ZLIB
     gzFile zfptr;
+    struct BGZF_FILE *bgzfptr; /* multithreaded block gzip, see bgzf.h */
 #endif
   } ;
 
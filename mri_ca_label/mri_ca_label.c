@@ -225,6 +225,7 @@ MRI *insert_wm_segmentation( MRI *mri_labeled, MRI *mri_wm,
 int MRItoUCHAR(MRI **pmri);
 extern char *gca_write_fname ;
 extern int gca_write_iterations ;
+extern int gca_red_black ;
 
 //static int expand_flag = TRUE ;
 static int expand_flag = FALSE ;
@@ -1765,6 +1766,22 @@ get_option(int argc, char *argv[])
     printf("using FLASH forward model and tissue parms in %s to predict"
            " intensity values...\n", tissue_parms_fname) ;
   }
+  else if (!stricmp(option, "threads") || !stricmp(option, "nthreads"))
+  {
+    int nthreads = atoi(argv[2]) ;
+    nargs = 1 ;
+#ifdef HAVE_OPENMP
+    omp_set_num_threads(nthreads) ;
+    printf("using %d threads\n", nthreads) ;
+#else
+    printf("not compiled with OpenMP, ignoring -threads %d\n", nthreads) ;
+#endif
+  }
+  else if (!stricmp(option, "redblack"))
+  {
+    gca_red_black = 1 ;
+    printf("using red-black ordering for the Gibbs passes\n") ;
+  }
   else if (!stricmp(option, "renormalize"))
   {
     renormalize_wsize = atoi(argv[2]) ;
@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
@@ -110,6 +111,9 @@ typedef struct {
   double SatPct;
   int MovOOBFlag;
   char *rusagefile;
+  int DoPyramid;
+  int DoDFP;
+  double dfptol;
 } CMDARGS;
 
 CMDARGS *cmdargs;
@@ -160,21 +164,43 @@ typedef struct {
   FILE *fplogcost;
   int MovOOBFlag;
   int debug;
+  int DoPyramid, preprocsep;
+  int DoDFP;
+  double dfptol;
+  // Reference side of the joint histogram, cached for samplesep
+  int samplesep;
+  long nsamples, nsamplesalloc;
+  double *samplec, *sampler, *samples;
+  unsigned char *sampleivg;
+  // Per-thread joint histograms, allocated once
+  int nthreads;
+  double **HH;
+  double grad[12], dfpmin[12];
 } COREG;
 
 double COREGcost(COREG *coreg);
+double COREGcostGrad(COREG *coreg, double *grad);
+int COREGhistGrad(COREG *coreg, double **H, int Hrows, int Hcols, double *g1, int ng1,
+		  double *g2, int ng2, double Hsum, double *grad);
 float COREGcostPowell(float *pPowel) ;
 int COREGMinPowell();
+float COREGcostDFP(float *p);
+void COREGgradDFP(float *p, float *g);
+int COREGMinDFP();
 float MRIgetPercentile(MRI *mri, double Pct, int frame);
 int COREGfwhm(MRI *mri, double sep, double fwhm[3]);
-int COREGpreproc(COREG *coreg);
+int COREGpreproc(COREG *coreg, int sep);
 LTA *LTAcreate(MRI *src, MRI *dst, MATRIX *T, int type);
 int COREGhist(COREG *coreg);
+int COREGsamples(COREG *coreg);
 long COREGvolIndex(int ncols, int nrows, int nslices, int c, int r, int s);
 double COREGsamp(unsigned char *f, const double c, const double r, const double s, 
 		  const int ncols, const int nrows, const int nslices);
+int COREGsampGrad(unsigned char *f, const double c, const double r, const double s, 
+		  const int ncols, const int nrows, const int nslices, double g[3]);
 double NMICost(double **H, int cols, int rows);
 MATRIX *COREGmatrix(double *p0, int np, MATRIX *M);
+int COREGmatrixGrad(double *p0, int np, MATRIX **dM);
 double *COREGparams9(MATRIX *M9, double *p);
 int COREGprint(FILE *fp, COREG *coreg);
 MRI *MRIconformNoScale(MRI *mri, MRI *mric);
@@ -217,6 +243,9 @@ int main(int argc, char *argv[]) {
   cmdargs->SatPct = 99.99;
   cmdargs->MovOOBFlag = 0;
   cmdargs->rusagefile = "";
+  cmdargs->DoPyramid = 0;
+  cmdargs->DoDFP = 0;
+  cmdargs->dfptol = 1e-4;
 
   nargs = handle_version_option (argc, argv, vcid, "$Name:  $");
   if (nargs && argc - nargs == 1) exit (0);
@@ -343,6 +372,9 @@ int main(int argc, char *argv[]) {
   coreg->DoSmoothing = cmdargs->DoSmoothing;
   coreg->MovOOBFlag = cmdargs->MovOOBFlag;
   coreg->debug = debug;
+  coreg->DoPyramid = cmdargs->DoPyramid;
+  coreg->DoDFP = cmdargs->DoDFP;
+  coreg->dfptol = cmdargs->dfptol;
 
   if(coreg->DoCoordDither){
     // Creating a dither volume is needed for thread safety
@@ -380,7 +412,7 @@ int main(int argc, char *argv[]) {
 
   COREGprint(stdout, coreg);
 
-  COREGpreproc(coreg);
+  COREGpreproc(coreg, coreg->sepmin);
 
   if(cmdargs->logcost){
     coreg->fplogcost = fopen(cmdargs->logcost,"w");
@@ -408,9 +440,12 @@ int main(int argc, char *argv[]) {
   for(n=0; n < coreg->nsep; n++){
     coreg->sep = coreg->seplist[n];
     printf("sep = %d -----------------------------------\n",coreg->sep);
+    // Pyramid: smooth for this separation instead of the finest one
+    if(coreg->DoPyramid && coreg->preprocsep != coreg->sep) COREGpreproc(coreg, coreg->sep);
     if(n==0 && cmdargs->DoBF) COREGoptBruteForce(coreg, cmdargs->BFLim, 1, cmdargs->BFNSamp);
     coreg->startmin = 1;
-    COREGMinPowell();
+    if(coreg->DoDFP) COREGMinDFP();
+    else             COREGMinPowell();
   }
   if(coreg->fplogcost) fclose(coreg->fplogcost);
 
@@ -493,6 +528,10 @@ static int parse_commandline(int argc, char **argv) {
     else if (!strcasecmp(option, "--no-bf"))  cmdargs->DoBF = 0;
     else if (!strcasecmp(option, "--mov-oob"))  cmdargs->MovOOBFlag = 1;
     else if (!strcasecmp(option, "--no-mov-oob"))  cmdargs->MovOOBFlag = 0;
+    else if (!strcasecmp(option, "--pyramid"))  cmdargs->DoPyramid = 1;
+    else if (!strcasecmp(option, "--no-pyramid"))  cmdargs->DoPyramid = 0;
+    else if (!strcasecmp(option, "--dfp"))  cmdargs->DoDFP = 1;
+    else if (!strcasecmp(option, "--powell"))  cmdargs->DoDFP = 0;
 
     else if (!strcasecmp(option, "--rusage")) {
       if(nargc < 1) CMDargNErr(option,1);
@@ -623,6 +662,12 @@ static int parse_commandline(int argc, char **argv) {
       sscanf(pargv[0],"%lf",&cmdargs->linmintol);
       nargsused = 1;
     } 
+    else if (!strcasecmp(option, "--dfp-tol")) {
+      if(nargc < 1) CMDargNErr(option,1);
+      sscanf(pargv[0],"%lf",&cmdargs->dfptol);
+      cmdargs->DoDFP = 1;
+      nargsused = 1;
+    } 
     else if (!strcasecmp(option, "--sep")) {
       if(nargc < 1) CMDargNErr(option,1);
       sscanf(pargv[0],"%d",&cmdargs->seplist[cmdargs->nsep]);
@@ -743,6 +788,9 @@ static void print_usage(void) {
   printf("   --ref-fwhm fwhm : apply smoothing to ref\n");
   printf("   --mov-oob : count mov voxels that are out-of-bounds as 0\n");
   printf("   --no-mov-oob : do not count mov voxels that are out-of-bounds as 0 (default)\n");
+  printf("   --pyramid : smooth for each separation instead of only for the smallest\n");
+  printf("   --dfp : minimize with quasi-Newton (lbfgs) and the analytic gradient instead of powell\n");
+  printf("   --dfp-tol tol : gradient tolerance for --dfp, default is %5.3le\n",cmdargs->dfptol);
   printf("   --mat2par reg.lta : extract parameters out of registration\n");
   printf("\n");
   printf("   --debug     turn on debugging\n");
@@ -820,6 +868,8 @@ static void dump_options(FILE *fp) {
   fprintf(fp,"SmoothRef %d\n",cmdargs->SmoothRef);
   fprintf(fp,"SatPct    %lf\n",cmdargs->SatPct);
   fprintf(fp,"MovOOB %d\n",cmdargs->MovOOBFlag);
+  fprintf(fp,"Pyramid %d\n",cmdargs->DoPyramid);
+  fprintf(fp,"DFP %d\n",cmdargs->DoDFP);
   return;
 }
 
@@ -871,15 +921,133 @@ double COREGsamp(unsigned char *f, const double c, const double r, const double
 }
 
 
+/*!
+  \fn int COREGsampGrad(unsigned char *f, const double c, const double r, const double s, 
+                       const int ncols, const int nrows, const int nslices, double g[3])
+  \brief Gradient of the trilinear interpolation of COREGsamp() with
+  respect to c, r, and s. On a grid line the upper neighbor is used.
+ */
+int COREGsampGrad(unsigned char *f, const double c, const double r, const double s, 
+		  const int ncols, const int nrows, const int nslices, double g[3])
+{
+  int cm,rm,sm,cp,rp,sp;
+  double cd,rd,sd;
+  double f000,f001,f010,f011,f100,f101,f110,f111;
+
+  cm = floor(c);
+  rm = floor(r);
+  sm = floor(s);
+
+  cp = MIN(cm+1,ncols-1);
+  rp = MIN(rm+1,nrows-1);
+  sp = MIN(sm+1,nslices-1);
+
+  cd = c - cm ;
+  rd = r - rm ;
+  sd = s - sm ;
+
+  f000 = f[COREGvolIndex(ncols,nrows,nslices, cm, rm, sm)];
+  f001 = f[COREGvolIndex(ncols,nrows,nslices, cm, rm, sp)];
+  f010 = f[COREGvolIndex(ncols,nrows,nslices, cm, rp, sm)];
+  f011 = f[COREGvolIndex(ncols,nrows,nslices, cm, rp, sp)];
+  f100 = f[COREGvolIndex(ncols,nrows,nslices, cp, rm, sm)];
+  f101 = f[COREGvolIndex(ncols,nrows,nslices, cp, rm, sp)];
+  f110 = f[COREGvolIndex(ncols,nrows,nslices, cp, rp, sm)];
+  f111 = f[COREGvolIndex(ncols,nrows,nslices, cp, rp, sp)];
+
+  g[0] = (1-rd)*(1-sd)*(f100-f000) + (1-rd)*sd*(f101-f001) +
+    rd*(1-sd)*(f110-f010) + rd*sd*(f111-f011);
+  g[1] = (1-cd)*(1-sd)*(f010-f000) + (1-cd)*sd*(f011-f001) +
+    cd*(1-sd)*(f110-f100) + cd*sd*(f111-f101);
+  g[2] = (1-cd)*(1-rd)*(f001-f000) + (1-cd)*rd*(f011-f010) +
+    cd*(1-rd)*(f101-f100) + cd*rd*(f111-f110);
+
+  return(0);
+}
+
+/*!
+  \fn int COREGsamples(COREG *coreg)
+  \brief Caches the reference side of the joint histogram for the
+  current separation: the (dithered) sample location in the ref and
+  the ref histogram bin there. Neither depends on the parameters, so
+  each cost evaluation only has to sample the mov. The samples are in
+  the same order as the loops in COREGhist() used to visit them.
+ */
+int COREGsamples(COREG *coreg)
+{
+  int nc, nr, ns, cref;
+  long nsamples;
+
+  nc = (coreg->ref->width  + coreg->sep - 1)/coreg->sep;
+  nr = (coreg->ref->height + coreg->sep - 1)/coreg->sep;
+  ns = (coreg->ref->depth  + coreg->sep - 1)/coreg->sep;
+  nsamples = (long)nc*nr*ns;
+  if(nsamples > coreg->nsamplesalloc){
+    free(coreg->samplec);
+    free(coreg->sampler);
+    free(coreg->samples);
+    free(coreg->sampleivg);
+    coreg->samplec = (double *)calloc(sizeof(double),nsamples);
+    coreg->sampler = (double *)calloc(sizeof(double),nsamples);
+    coreg->samples = (double *)calloc(sizeof(double),nsamples);
+    coreg->sampleivg = (unsigned char *)calloc(sizeof(unsigned char),nsamples);
+    coreg->nsamplesalloc = nsamples;
+  }
+
+  #ifdef _OPENMP
+  #pragma omp parallel for
+  #endif
+  for(cref=0; cref < coreg->ref->width; cref += coreg->sep){
+    int rref,sref;
+    long n;
+    double dcref,drref,dsref,vg;
+
+    n = (long)(cref/coreg->sep)*nr*ns;
+    for(rref=0; rref < coreg->ref->height; rref += coreg->sep){
+      for(sref=0; sref < coreg->ref->depth; sref += coreg->sep){
+	dcref  = cref;
+	drref  = rref;
+	dsref  = sref;
+
+	if(coreg->DoCoordDither){
+	  // dither is uniform(0,1), scale by separation to sample entire vol
+	  dcref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,0);
+	  drref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,1);
+	  dsref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,2);
+	  if(dcref > coreg->ref->width-1)  dcref = coreg->ref->width-1;
+	  if(drref > coreg->ref->height-1) drref = coreg->ref->height-1;
+	  if(dsref > coreg->ref->depth-1)  dsref = coreg->ref->depth-1;
+	}
+
+	vg = COREGsamp(coreg->g, dcref, drref, dsref, coreg->ref->width,coreg->ref->height,coreg->ref->depth);
+
+	coreg->samplec[n] = dcref;
+	coreg->sampler[n] = drref;
+	coreg->samples[n] = dsref;
+	coreg->sampleivg[n] = floor(vg+0.5);
+	n++;
+      }
+    }
+  }
+
+  coreg->nsamples = nsamples;
+  coreg->samplesep = coreg->sep;
+  return(0);
+}
+
 /*!
   \fn int COREGhist(COREG *coreg)
-  \brief Compute joint histogram. Somewhat based on spm_hist2.c
+  \brief Compute joint histogram. Somewhat based on spm_hist2.c.
+  Each thread fills its own histogram over the cached ref samples
+  and the threads are summed at the end.
  */
 int COREGhist(COREG *coreg)
 {
-  int n,c,r,cref,k,nthreads;
+  int n,c,r,k;
   long nhits;
-  double V2V[16],**HH;
+  double V2V[16];
+
+  if(coreg->samplesep != coreg->sep) COREGsamples(coreg);
 
   // Pack vox2voxl matrix into an array for speed
   V2V[0] = coreg->V2V->rptr[1][1];
@@ -899,84 +1067,71 @@ int COREGhist(COREG *coreg)
   V2V[14] = coreg->V2V->rptr[3][4];
   V2V[15] = 0;
 
-  nthreads = 1;
-  #ifdef _OPENMP
-  nthreads = omp_get_max_threads();
-  #endif
-  HH = (double **)calloc(sizeof(double*),nthreads);
-  for(n=0; n < nthreads; n++) 
-    HH[n] = (double *)calloc(sizeof(double),256*256);
+  if(coreg->HH == NULL){
+    coreg->nthreads = 1;
+    #ifdef _OPENMP
+    coreg->nthreads = omp_get_max_threads();
+    #endif
+    coreg->HH = (double **)calloc(sizeof(double*),coreg->nthreads);
+    for(n=0; n < coreg->nthreads; n++) 
+      coreg->HH[n] = (double *)calloc(sizeof(double),256*256);
+  }
 
   nhits = 0;
   #ifdef _OPENMP
-  #pragma omp parallel for reduction(+:nhits)
+  #pragma omp parallel num_threads(coreg->nthreads) reduction(+:nhits)
   #endif
-  for(cref=0; cref < coreg->ref->width; cref += coreg->sep){
-    int rref,sref;
-    double dcref,drref,dsref;
+  {
+    long m;
     double dcmov,drmov,dsmov;
-    double vf, vg;
+    double vf;
     int   ivf, ivg, oob;
     double *H;
-    int threadno = 1;
-    //int iran;
+    int threadno = 0;
 
     #ifdef _OPENMP
     threadno = omp_get_thread_num(); 
     #endif
-    H = HH[threadno];
-
-    for(rref=0; rref < coreg->ref->height; rref += coreg->sep){
-      for(sref=0; sref < coreg->ref->depth; sref += coreg->sep){
-	dcref  = cref;
-	drref  = rref;
-	dsref  = sref;
-
-	if(coreg->DoCoordDither){
-	  // dither is uniform(0,1), scale by separation to sample entire vol
-	  dcref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,0);
-	  drref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,1);
-	  dsref += coreg->sep*MRIgetVoxVal(coreg->cdither,cref,rref,sref,2);
-	  if(dcref > coreg->ref->width-1)  dcref = coreg->ref->width-1;
-	  if(drref > coreg->ref->height-1) drref = coreg->ref->height-1;
-	  if(dsref > coreg->ref->depth-1)  dsref = coreg->ref->depth-1;
-	}
-
-	dcmov  = V2V[0]*dcref + V2V[4]*drref + V2V[ 8]*dsref +  V2V[12];
-	drmov  = V2V[1]*dcref + V2V[5]*drref + V2V[ 9]*dsref +  V2V[13];
-	dsmov  = V2V[2]*dcref + V2V[6]*drref + V2V[10]*dsref +  V2V[14];
-
-	oob = 0;
-	if(dcmov < 0 || dcmov > coreg->mov->width-1)  oob = 1;
-	if(drmov < 0 || drmov > coreg->mov->height-1) oob = 1;
-	if(dsmov < 0 || dsmov > coreg->mov->depth-1)  oob = 1;
-	if(!oob) {
-	  vf = COREGsamp(coreg->f, dcmov, drmov, dsmov, coreg->mov->width,coreg->mov->height,coreg->mov->depth);
-	  nhits ++;
-	}
-	else {
-	  if(coreg->MovOOBFlag) vf = 0;
-	  else continue;
-	}
-
+    H = coreg->HH[threadno];
+    memset(H,0,sizeof(double)*256*256);
 
-	vg = COREGsamp(coreg->g, dcref, drref, dsref, coreg->ref->width,coreg->ref->height,coreg->ref->depth);
-
-	ivf = floor(vf);
-	ivg = floor(vg+0.5);
-	H[ivf+ivg*256] += (1-(vf-ivf));
-	if(ivf<255) H[ivf+1+ivg*256] += (vf-ivf);
+    #ifdef _OPENMP
+    #pragma omp for
+    #endif
+    for(m=0; m < coreg->nsamples; m++){
+      dcmov  = V2V[0]*coreg->samplec[m] + V2V[4]*coreg->sampler[m] + V2V[ 8]*coreg->samples[m] +  V2V[12];
+      drmov  = V2V[1]*coreg->samplec[m] + V2V[5]*coreg->sampler[m] + V2V[ 9]*coreg->samples[m] +  V2V[13];
+      dsmov  = V2V[2]*coreg->samplec[m] + V2V[6]*coreg->sampler[m] + V2V[10]*coreg->samples[m] +  V2V[14];
+
+      oob = 0;
+      if(dcmov < 0 || dcmov > coreg->mov->width-1)  oob = 1;
+      if(drmov < 0 || drmov > coreg->mov->height-1) oob = 1;
+      if(dsmov < 0 || dsmov > coreg->mov->depth-1)  oob = 1;
+      if(!oob) {
+	vf = COREGsamp(coreg->f, dcmov, drmov, dsmov, coreg->mov->width,coreg->mov->height,coreg->mov->depth);
+	nhits ++;
       }
+      else {
+	if(coreg->MovOOBFlag) vf = 0;
+	else continue;
+      }
+
+      ivf = floor(vf);
+      ivg = coreg->sampleivg[m];
+      H[ivf+ivg*256] += (1-(vf-ivf));
+      if(ivf<255) H[ivf+1+ivg*256] += (vf-ivf);
     }
   }
 
   // Collect the threads
+  #ifdef _OPENMP
+  #pragma omp parallel for
+  #endif
   for(k=0; k < 256*256; k++){
+    int t;
     coreg->H01d[k] = 0;
-    for(n=0; n < nthreads; n++) coreg->H01d[k] += HH[n][k];
+    for(t=0; t < coreg->nthreads; t++) coreg->H01d[k] += coreg->HH[t][k];
   }
-  for(n=0; n < nthreads; n++) free(HH[n]);
-  free(HH); HH=NULL;
 
   // Repackage Histogram into a 2D array
   if(!coreg->H0) coreg->H0 = AllocDoubleMatrix(256,256);
@@ -1374,6 +1529,94 @@ MATRIX *COREGmatrix(double *p0, int np, MATRIX *M)
   return(M);
 }
 
+/*!
+  \fn int COREGmatrixGrad(double *p0, int np, MATRIX **dM)
+  \brief Computes the derivative of the COREGmatrix() RAS-to-RAS
+  matrix with respect to each of the np parameters, dM[n] = dM/dp[n].
+  The factor that depends on p[n] is replaced by its derivative.
+  Angles are in degrees, so the rotation derivatives are per degree.
+  dM[n] is allocated if NULL.
+ */
+int COREGmatrixGrad(double *p0, int np, MATRIX **dM)
+{
+  MATRIX *F[6], *dF;
+  double p[12], a, d2r = M_PI/180;
+  int n, k, nthf;
+
+  for(n=0; n<12; n++) p[n] = 0;
+  p[6] = p[7] = p[8] = 1; // scaling
+  for(n=0; n<np; n++) p[n] = p0[n];
+
+  // The factors of M = T*R1*R2*R3*ZZ*S, as in COREGmatrix()
+  for(k=0; k < 6; k++) F[k] = MatrixIdentity(4,NULL);
+  F[0]->rptr[1][4] = p[0];
+  F[0]->rptr[2][4] = p[1];
+  F[0]->rptr[3][4] = p[2];
+
+  F[1]->rptr[2][2] = cos(p[3]*d2r);
+  F[1]->rptr[2][3] = sin(p[3]*d2r);
+  F[1]->rptr[3][2] = -sin(p[3]*d2r);
+  F[1]->rptr[3][3] = cos(p[3]*d2r);
+
+  F[2]->rptr[1][1] = cos(p[4]*d2r);
+  F[2]->rptr[1][3] = sin(p[4]*d2r);
+  F[2]->rptr[3][1] = -sin(p[4]*d2r);
+  F[2]->rptr[3][3] = cos(p[4]*d2r);
+
+  F[3]->rptr[1][1] = cos(p[5]*d2r);
+  F[3]->rptr[1][2] = sin(p[5]*d2r);
+  F[3]->rptr[2][1] = -sin(p[5]*d2r);
+  F[3]->rptr[2][2] = cos(p[5]*d2r);
+
+  F[4]->rptr[1][1] = p[6];
+  F[4]->rptr[2][2] = p[7];
+  F[4]->rptr[3][3] = p[8];
+
+  F[5]->rptr[1][2] = p[9];
+  F[5]->rptr[1][3] = p[10];
+  F[5]->rptr[2][3] = p[11];
+
+  dF = MatrixAlloc(4,4,MATRIX_REAL);
+  for(n=0; n < np; n++){
+    MatrixClear(dF);
+    if(n < 3){
+      // translation
+      nthf = 0;
+      dF->rptr[n+1][4] = 1;
+    }
+    else if(n < 6){
+      // rotation, (i,j) is the plane of the rotation
+      int i = 2, j = 3;
+      if(n == 4) i = 1;
+      if(n == 5) {i = 1; j = 2;}
+      nthf = n-2;
+      a = p[n]*d2r;
+      dF->rptr[i][i] = -sin(a)*d2r;
+      dF->rptr[i][j] =  cos(a)*d2r;
+      dF->rptr[j][i] = -cos(a)*d2r;
+      dF->rptr[j][j] = -sin(a)*d2r;
+    }
+    else if(n < 9){
+      // scale
+      nthf = 4;
+      dF->rptr[n-5][n-5] = 1;
+    }
+    else {
+      // shear
+      nthf = 5;
+      if(n ==  9) dF->rptr[1][2] = 1;
+      if(n == 10) dF->rptr[1][3] = 1;
+      if(n == 11) dF->rptr[2][3] = 1;
+    }
+    dM[n] = MatrixCopy(nthf == 0 ? dF : F[0], dM[n]);
+    for(k=1; k < 6; k++) MatrixMultiplyD(dM[n], k == nthf ? dF : F[k], dM[n]);
+  }
+
+  for(k=0; k < 6; k++) MatrixFree(&F[k]);
+  MatrixFree(&dF);
+  return(0);
+}
+
 /*!
   \fn double *COREGparams9(MATRIX *M9, double *p)
   \brief Extracts parameter from a 9 dof transformation matrix.
@@ -1416,6 +1659,17 @@ double *COREGparams9(MATRIX *M9, double *p)
 
 
 double COREGcost(COREG *coreg)
+{
+  return(COREGcostGrad(coreg, NULL));
+}
+
+/*!
+  \fn double COREGcostGrad(COREG *coreg, double *grad)
+  \brief Computes the NMI cost at coreg->params and, if grad is
+  non-NULL, its gradient with respect to each of the nparams
+  parameters at the same time (see COREGhistGrad()).
+ */
+double COREGcostGrad(COREG *coreg, double *grad)
 {
   double **H1,**H;
   double *g1, *g2, sum, std1, std2;
@@ -1471,6 +1725,7 @@ double COREGcost(COREG *coreg)
   for(c=0; c < Hcols; c++) for(r=0; r < Hrows; r++) H[r][c] /= sum;
 
   coreg->cost = NMICost(H, Hcols, Hrows);
+  if(grad) COREGhistGrad(coreg, H, Hrows, Hcols, g1, ng1, g2, ng2, sum, grad);
 
   FreeDoubleMatrix(H1,H1rows,H1cols); H1=NULL;
   FreeDoubleMatrix(H,Hrows,Hcols);    H=NULL;
@@ -1491,6 +1746,137 @@ double COREGcost(COREG *coreg)
 }
 
 
+/*!
+  \fn int COREGhistGrad(COREG *coreg, double **H, int Hrows, int Hcols, double *g1, int ng1,
+		  double *g2, int ng2, double Hsum, double *grad)
+  \brief Analytic gradient of the NMI cost with respect to the parameters.
+  H is the normalized, smoothed histogram, Hsum the sum it was
+  normalized by, and g1/g2 the smoothing kernels, all from
+  COREGcostGrad(). The derivative of the cost with respect to the
+  histogram is pulled back through the normalization and the smoothing
+  to the raw 256x256 histogram. Each sample moves its partial volume
+  weight between bins ivf and ivf+1 as vf changes, and vf changes with
+  the parameters through the gradient of the mov and the derivative of
+  the vox2vox matrix. Samples moving in or out of the mov are not
+  differentiable and are ignored.
+ */
+int COREGhistGrad(COREG *coreg, double **H, int Hrows, int Hcols, double *g1, int ng1,
+		  double *g2, int ng2, double Hsum, double *grad)
+{
+  double *s1, *s2, s1sum, s2sum, den, mean, **dH, **dH1, **dH0, **AA, A[12];
+  int ns1, ns2, r, c, n, k, i, j;
+  MATRIX *Rref, *Rmov, *iRmov, *dM[12], *D[12];
+
+  // d(cost)/d(H), where cost = -(s1sum+s2sum)/(den+eps) as in NMICost()
+  s1 = SumVectorDoubleMatrix(H, Hrows, Hcols, 1, NULL, &ns1);
+  s2 = SumVectorDoubleMatrix(H, Hrows, Hcols, 2, NULL, &ns2);
+  den = 0;
+  for(c=0; c < Hcols; c++) for(r=0; r < Hrows; r++) den += (H[r][c]*log2(H[r][c]));
+  s1sum = 0;
+  for(n=0; n < ns1; n++) s1sum += (s1[n]*log2(s1[n]));
+  s2sum = 0;
+  for(n=0; n < ns2; n++) s2sum += (s2[n]*log2(s2[n]));
+  den += FLT_EPSILON;
+
+  dH = AllocDoubleMatrix(Hrows,Hcols);
+  mean = 0;
+  for(r=0; r < Hrows; r++){
+    for(c=0; c < Hcols; c++){
+      dH[r][c] = -((log2(s1[r]) + log2(s2[c]) + 2/M_LN2)*den -
+		   (s1sum+s2sum)*(log2(H[r][c]) + 1/M_LN2))/(den*den);
+      mean += H[r][c]*dH[r][c];
+    }
+  }
+  // Through the normalization by the sum
+  for(r=0; r < Hrows; r++) for(c=0; c < Hcols; c++) dH[r][c] = (dH[r][c]-mean)/Hsum;
+
+  // Through the smoothing, the transpose of the convolution is a correlation
+  dH1 = AllocDoubleMatrix(Hrows,256);
+  for(r=0; r < Hrows; r++)
+    for(c=0; c < 256; c++)
+      for(j=0; j < ng2; j++) dH1[r][c] += dH[r][c+j]*g2[j];
+  dH0 = AllocDoubleMatrix(256,256);
+  for(r=0; r < 256; r++)
+    for(c=0; c < 256; c++)
+      for(i=0; i < ng1; i++) dH0[r][c] += dH1[r+i][c]*g1[i];
+
+  // A = sum over samples of d(cost)/d(movvox) times [refvox 1]'
+  AA = AllocDoubleMatrix(coreg->nthreads,12);
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(coreg->nthreads)
+  #endif
+  {
+    long m;
+    int ivf, ivg, ii, jj, threadno = 0;
+    double V2V[12], dcmov, drmov, dsmov, vf, dcdvf, gf[3], x[4], *At;
+
+    #ifdef _OPENMP
+    threadno = omp_get_thread_num(); 
+    #endif
+    At = AA[threadno];
+    for(ii=0; ii < 3; ii++)
+      for(jj=0; jj < 4; jj++) V2V[ii*4+jj] = coreg->V2V->rptr[ii+1][jj+1];
+
+    #ifdef _OPENMP
+    #pragma omp for
+    #endif
+    for(m=0; m < coreg->nsamples; m++){
+      x[0] = coreg->samplec[m];
+      x[1] = coreg->sampler[m];
+      x[2] = coreg->samples[m];
+      x[3] = 1;
+      dcmov  = V2V[0]*x[0] + V2V[1]*x[1] + V2V[ 2]*x[2] + V2V[ 3];
+      drmov  = V2V[4]*x[0] + V2V[5]*x[1] + V2V[ 6]*x[2] + V2V[ 7];
+      dsmov  = V2V[8]*x[0] + V2V[9]*x[1] + V2V[10]*x[2] + V2V[11];
+      if(dcmov < 0 || dcmov > coreg->mov->width-1)  continue;
+      if(drmov < 0 || drmov > coreg->mov->height-1) continue;
+      if(dsmov < 0 || dsmov > coreg->mov->depth-1)  continue;
+
+      vf = COREGsamp(coreg->f, dcmov, drmov, dsmov, coreg->mov->width,coreg->mov->height,coreg->mov->depth);
+      ivf = floor(vf);
+      ivg = coreg->sampleivg[m];
+      dcdvf = -dH0[ivf][ivg];
+      if(ivf<255) dcdvf += dH0[ivf+1][ivg];
+      if(dcdvf == 0) continue;
+
+      COREGsampGrad(coreg->f, dcmov, drmov, dsmov, coreg->mov->width,coreg->mov->height,coreg->mov->depth, gf);
+      for(ii=0; ii < 3; ii++)
+	for(jj=0; jj < 4; jj++) At[ii*4+jj] += dcdvf*gf[ii]*x[jj];
+    }
+  }
+  for(k=0; k < 12; k++){
+    A[k] = 0;
+    for(n=0; n < coreg->nthreads; n++) A[k] += AA[n][k];
+  }
+
+  // d(movvox)/dp = inv(Rmov) * dM/dp * Rref, same as MRIgetVoxelToVoxelXformBase()
+  Rref = MRIxfmCRS2XYZ(coreg->ref, 0);
+  Rmov = MRIxfmCRS2XYZ(coreg->mov, 0);
+  iRmov = MatrixInverse(Rmov,NULL);
+  for(n=0; n < coreg->nparams; n++) dM[n] = NULL;
+  COREGmatrixGrad(coreg->params, coreg->nparams, dM);
+  for(n=0; n < coreg->nparams; n++){
+    D[n] = MatrixMultiplyD(iRmov, dM[n], NULL);
+    MatrixMultiplyD(D[n], Rref, D[n]);
+    grad[n] = 0;
+    for(i=0; i < 3; i++)
+      for(j=0; j < 4; j++) grad[n] += D[n]->rptr[i+1][j+1]*A[i*4+j];
+    MatrixFree(&dM[n]);
+    MatrixFree(&D[n]);
+  }
+
+  MatrixFree(&Rref);
+  MatrixFree(&Rmov);
+  MatrixFree(&iRmov);
+  FreeDoubleMatrix(AA,coreg->nthreads,12);
+  FreeDoubleMatrix(dH0,256,256);
+  FreeDoubleMatrix(dH1,Hrows,256);
+  FreeDoubleMatrix(dH,Hrows,Hcols);
+  free(s1);
+  free(s2);
+  return(0);
+}
+
 /*--------------------------------------------------------------------------*/
 float COREGcostPowell(float *pPowel) 
 {
@@ -1587,16 +1973,125 @@ int COREGMinPowell()
   return(NO_ERROR) ;
 }
 
-int COREGpreproc(COREG *coreg)
+/*---------------------------------------------------------*/
+/* The quasi-Newton search works on scaled parameters so that a unit
+   step is comparable for all of them: 1mm, 1deg, 1% scale and shear */
+static double COREGdfpScale(int n)
+{
+  if(n < 6) return(1.0);
+  return(0.01);
+}
+static float dfpp[13];
+static int dfpvalid = 0;
+
+/*--------------------------------------------------------------------------*/
+float COREGcostDFP(float *p) 
+{
+  extern COREG *coreg;
+  int n,newmin;
+  float curcost;
+  static float initcost=-1,mincost=-1;
+
+  for(n=0; n < coreg->nparams; n++) coreg->params[n] = p[n+1]*COREGdfpScale(n);
+
+  // compute cost and gradient together, the gradient is asked for next
+  curcost = COREGcostGrad(coreg, coreg->grad);
+  for(n=0; n < coreg->nparams; n++) dfpp[n+1] = p[n+1];
+  dfpvalid = 1;
+
+  newmin = 0;
+  if(coreg->startmin) {
+    newmin = 1;
+    initcost = curcost;
+    mincost = curcost;
+    for(n=0; n<coreg->nparams; n++) coreg->dfpmin[n] = coreg->params[n];
+    printf("InitialCost %20.10lf \n",initcost);
+    coreg->startmin = 0;
+  }
+
+  if(mincost > curcost) {
+    newmin = 1;
+    mincost = curcost;
+    for(n=0; n<coreg->nparams; n++) coreg->dfpmin[n] = coreg->params[n];
+  }
+
+  if(newmin){
+    printf("#@# %2d %4d  ",coreg->sep,coreg->nCostEvaluations);
+    for(n=0; n<coreg->nparams; n++) printf("%7.5f ",coreg->dfpmin[n]);
+    printf("  %9.7f\n",mincost);
+    fflush(stdout);
+  }
+
+  return((float)curcost);
+}
+
+/*--------------------------------------------------------------------------*/
+void COREGgradDFP(float *p, float *g)
+{
+  extern COREG *coreg;
+  int n;
+
+  for(n=0; n < coreg->nparams; n++) if(!dfpvalid || dfpp[n+1] != p[n+1]) break;
+  if(n < coreg->nparams) COREGcostDFP(p);
+  for(n=0; n < coreg->nparams; n++) g[n+1] = coreg->grad[n]*COREGdfpScale(n);
+}
+
+/*---------------------------------------------------------*/
+int COREGMinDFP()
+{
+  extern COREG *coreg;
+  float *p, fret;
+  int    n,dof,iter=0;
+  struct timeb timer;
+
+  TimerStart(&timer);
+  dof = coreg->nparams;
+
+  printf("\n\n---------------------------------\n");
+  printf("Init DFP Params dof = %d\n",dof);
+  p = vector(1, dof) ;
+  for(n=0; n < dof; n++) p[n+1] = coreg->params[n]/COREGdfpScale(n);
+
+  dfpvalid = 0;
+  fret = COREGcostDFP(p);
+  printf("Starting OpenDFPMin(), sep = %d\n",coreg->sep);
+  OpenDFPMin(p, dof, coreg->dfptol, &iter, &fret, 
+	     COREGcostDFP, COREGgradDFP, NULL, NULL, NULL);
+  coreg->niters = iter;
+  printf("DFP done niters total = %d\n",coreg->niters);
+  printf("OptTimeSec %4.1f sec\n",TimerStop(&timer)/1000.0);
+  printf("OptTimeMin %5.2f min\n",(TimerStop(&timer)/1000.0)/60);
+  printf("nEvals %d\n",coreg->nCostEvaluations);
+  fflush(stdout);
+
+  // The line search can give up on a noisy cost, so keep the best seen
+  printf("Final parameters ");
+  for(n=0; n < coreg->nparams; n++){
+    coreg->params[n] = coreg->dfpmin[n];
+    printf("%12.8f ",coreg->params[n]);
+  }
+  printf("\n");
+
+  COREGcost(coreg);
+  printf("Final cost %20.15lf\n ",coreg->cost);
+
+  free_vector(p, 1, dof);
+  printf("\n\n---------------------------------\n");
+  return(NO_ERROR) ;
+}
+
+int COREGpreproc(COREG *coreg, int sep)
 {
   int n, DoSmooth;
   MRI *mritmp;
 
+  printf("COREGpreproc() smoothing for sep = %d\n",sep);
+
   // Rescale and maybe smooth the moveable
   coreg->movsat = MRIgetPercentile(coreg->mov, coreg->SatPct, 0);
   printf("movsat = %6.4lf\n",coreg->movsat);
   mritmp = MRIrescaleToUChar(coreg->mov,NULL,coreg->movsat);
-  COREGfwhm(coreg->mov, coreg->sepmin, coreg->movfwhm);
+  COREGfwhm(coreg->mov, sep, coreg->movfwhm);
   DoSmooth = 0;
   for(n=0; n < 3; n++){
     coreg->movgstd[n] = coreg->movfwhm[n]/sqrt(log(256.0));
@@ -1616,7 +2111,7 @@ int COREGpreproc(COREG *coreg)
   coreg->refsat = MRIgetPercentile(coreg->ref, coreg->SatPct, 0);
   printf("refsat = %6.4lf\n",coreg->refsat);
   mritmp = MRIrescaleToUChar(coreg->ref,NULL,coreg->refsat);
-  COREGfwhm(coreg->ref, coreg->sepmin, coreg->reffwhm);
+  COREGfwhm(coreg->ref, sep, coreg->reffwhm);
   DoSmooth = 0;
   for(n=0; n < 3; n++){
     coreg->refgstd[n] = coreg->reffwhm[n]/sqrt(log(256.0));
@@ -1633,6 +2128,10 @@ int COREGpreproc(COREG *coreg)
   MRIfree(&mritmp);
   fflush(stdout);
 
+  // The cached ref samples came from the old g
+  coreg->samplesep = 0;
+  coreg->preprocsep = sep;
+
   printf("COREGpreproc() done\n");
 
   return(0);
@@ -1703,6 +2202,8 @@ int COREGprint(FILE *fp, COREG *coreg)
   fprintf(fp,"linmintol %5.3le\n",coreg->linmintol);
   fprintf(fp,"SatPct %lf\n",coreg->SatPct);
   fprintf(fp,"Hist FWHM %lf %lf\n",coreg->histfwhm[0],coreg->histfwhm[1]);
+  fprintf(fp,"DoPyramid %d\n",coreg->DoPyramid);
+  fprintf(fp,"DoDFP %d\n",coreg->DoDFP);
 #ifdef _OPENMP
   fprintf(fp,"nthreads %d\n",omp_get_max_threads());
 #else
@@ -0,0 +1,262 @@
+/**
+ * @file  mri_gca_convert.c
+ * @brief convert a GCA atlas between the legacy and flat (.gcaf) formats
+ *
+ * The output format is chosen from the output name: .gcaf writes the
+ * flat, mmap-able format read in place by GCAread(), anything else the
+ * legacy .gca/.gcz format. With -verify the output is read back and
+ * compared with the input, node by node and prior by prior.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "macros.h"
+#include "error.h"
+#include "diag.h"
+#include "proto.h"
+#include "timer.h"
+#include "version.h"
+#include "gca.h"
+
+static char vcid[] = "$Id$";
+
+int main(int argc, char *argv[]) ;
+
+static int  get_option(int argc, char *argv[]) ;
+static void print_usage(void) ;
+static void print_help(void) ;
+static void print_version(void) ;
+static int  compare_gcas(GCA *gca1, GCA *gca2) ;
+
+const char *Progname ;
+
+static int verify = 0 ;
+
+int
+main(int argc, char *argv[])
+{
+  char         *in_name, *out_name ;
+  int          nargs, msec, ndiffs ;
+  GCA          *gca, *gca_out ;
+  struct timeb start ;
+
+  nargs = handle_version_option (argc, argv, "$Id$", "$Name:  $");
+  if (nargs && argc - nargs == 1)
+    exit (0);
+  argc -= nargs;
+
+  Progname = argv[0] ;
+  ErrorInit(NULL, NULL, NULL) ;
+  DiagInit(NULL, NULL, NULL) ;
+
+  for ( ; argc > 1 && ISOPTION(*argv[1]) ; argc--, argv++)
+  {
+    nargs = get_option(argc, argv) ;
+    argc -= nargs ;
+    argv += nargs ;
+  }
+
+  if (argc < 3)
+    print_help() ;
+
+  in_name = argv[1] ;
+  out_name = argv[2] ;
+
+  printf("reading gca from %s...\n", in_name) ;
+  TimerStart(&start) ;
+  gca = GCAread(in_name) ;
+  if (!gca)
+    ErrorExit(ERROR_NOFILE, "%s: could not read gca file %s",
+              Progname, in_name) ;
+  msec = TimerStop(&start) ;
+  printf("read in %2.2f sec\n", msec/1000.0) ;
+
+  printf("writing gca to %s...\n", out_name) ;
+  if (GCAwrite(gca, out_name) != NO_ERROR)
+    ErrorExit(Gerror, "%s: could not write gca to %s", Progname, out_name) ;
+
+  if (verify)
+  {
+    TimerStart(&start) ;
+    gca_out = GCAread(out_name) ;
+    if (!gca_out)
+      ErrorExit(ERROR_NOFILE, "%s: could not read back %s",
+                Progname, out_name) ;
+    msec = TimerStop(&start) ;
+    printf("read back in %2.2f sec\n", msec/1000.0) ;
+    ndiffs = compare_gcas(gca, gca_out) ;
+    GCAfree(&gca_out) ;
+    if (ndiffs)
+      ErrorExit(ERROR_BADFILE, "%s: %d differences between %s and %s",
+                Progname, ndiffs, in_name, out_name) ;
+    printf("%s and %s are identical\n", in_name, out_name) ;
+  }
+
+  GCAfree(&gca) ;
+  exit(0) ;
+  return(0) ;
+}
+
+static int
+compare_gcas(GCA *gca1, GCA *gca2)
+{
+  int       x, y, z, n, i, j, r, ncovars, ndiffs = 0 ;
+  GCA_NODE  *gcan1, *gcan2 ;
+  GCA_PRIOR *gcap1, *gcap2 ;
+  GC1D      *gc1, *gc2 ;
+
+  if (gca1->ninputs != gca2->ninputs ||
+      gca1->node_width != gca2->node_width ||
+      gca1->node_height != gca2->node_height ||
+      gca1->node_depth != gca2->node_depth ||
+      gca1->prior_width != gca2->prior_width ||
+      gca1->prior_height != gca2->prior_height ||
+      gca1->prior_depth != gca2->prior_depth ||
+      gca1->flags != gca2->flags)
+  {
+    printf("gca geometry differs\n") ;
+    return(1) ;
+  }
+  ncovars = gca1->ninputs*(gca1->ninputs+1)/2 ;
+
+  for (x = 0 ; x < gca1->node_width ; x++)
+    for (y = 0 ; y < gca1->node_height ; y++)
+      for (z = 0 ; z < gca1->node_depth ; z++)
+      {
+        gcan1 = &gca1->nodes[x][y][z] ;
+        gcan2 = &gca2->nodes[x][y][z] ;
+        if (gcan1->nlabels != gcan2->nlabels ||
+            gcan1->total_training != gcan2->total_training)
+        {
+          if (ndiffs++ == 0)
+            printf("node (%d, %d, %d) differs\n", x, y, z) ;
+          continue ;
+        }
+        for (n = 0 ; n < gcan1->nlabels ; n++)
+        {
+          gc1 = &gcan1->gcs[n] ;
+          gc2 = &gcan2->gcs[n] ;
+          if (gcan1->labels[n] != gcan2->labels[n])
+            ndiffs++ ;
+          for (r = 0 ; r < gca1->ninputs ; r++)
+            if (gc1->means[r] != gc2->means[r])
+              ndiffs++ ;
+          for (r = 0 ; r < ncovars ; r++)
+            if (gc1->covars[r] != gc2->covars[r])
+              ndiffs++ ;
+          if (gca1->flags & GCA_NO_MRF)
+            continue ;
+          for (i = 0 ; i < GIBBS_NEIGHBORS ; i++)
+          {
+            if (gc1->nlabels[i] != gc2->nlabels[i])
+            {
+              ndiffs++ ;
+              continue ;
+            }
+            for (j = 0 ; j < gc1->nlabels[i] ; j++)
+              if (gc1->labels[i][j] != gc2->labels[i][j] ||
+                  gc1->label_priors[i][j] != gc2->label_priors[i][j])
+                ndiffs++ ;
+          }
+        }
+      }
+
+  for (x = 0 ; x < gca1->prior_width ; x++)
+    for (y = 0 ; y < gca1->prior_height ; y++)
+      for (z = 0 ; z < gca1->prior_depth ; z++)
+      {
+        gcap1 = &gca1->priors[x][y][z] ;
+        gcap2 = &gca2->priors[x][y][z] ;
+        if (gcap1->nlabels != gcap2->nlabels ||
+            gcap1->total_training != gcap2->total_training)
+        {
+          if (ndiffs++ == 0)
+            printf("prior (%d, %d, %d) differs\n", x, y, z) ;
+          continue ;
+        }
+        for (n = 0 ; n < gcap1->nlabels ; n++)
+          if (gcap1->labels[n] != gcap2->labels[n] ||
+              gcap1->priors[n] != gcap2->priors[n])
+            ndiffs++ ;
+      }
+  return(ndiffs) ;
+}
+
+static int
+get_option(int argc, char *argv[])
+{
+  int  nargs = 0 ;
+  char *option ;
+
+  option = argv[1] + 1 ;            /* past '-' */
+  if (!stricmp(option, "-help"))
+    print_help() ;
+  else if (!stricmp(option, "-version"))
+    print_version() ;
+  else if (!stricmp(option, "verify"))
+  {
+    verify = 1 ;
+    printf("verifying output against input\n") ;
+  }
+  else switch (toupper(*option))
+    {
+    case '?':
+    case 'U':
+      print_usage() ;
+      exit(1) ;
+      break ;
+    default:
+      fprintf(stderr, "unknown option %s\n", argv[1]) ;
+      exit(1) ;
+      break ;
+    }
+
+  return(nargs) ;
+}
+
+static void
+print_usage(void)
+{
+  fprintf(stderr,
+          "usage: %s [options] <input gca> <output gca>\n",
+          Progname) ;
+}
+
+static void
+print_help(void)
+{
+  print_usage() ;
+  fprintf(stderr,
+          "\nConverts a GCA atlas between formats, chosen by the output "
+          "name:\n"
+          "  foo.gcaf       flat format, mapped in place by GCAread()\n"
+          "  foo.gca/.gcz   legacy format\n"
+          "Setting FS_GCA_PREFER_FLAT makes GCAread(foo.gca) use an "
+          "up-to-date foo.gcaf\nnext to it.\n"
+          "\noptions:\n"
+          "  -verify        read the output back and compare it to the "
+          "input\n") ;
+  exit(1) ;
+}
+
+static void
+print_version(void)
+{
+  fprintf(stderr, "%s\n", vcid) ;
+  exit(1) ;
+}
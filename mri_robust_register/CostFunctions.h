@@ -266,7 +266,7 @@ inline MRIiterator::MRIiterator(MRI * i) :
 inline void MRIiterator::begin()
 // set pos to first element
 {
-  if (img->ischunked)
+  if (img->ischunked && !img->brick_size)
   {
     pos = (unsigned char*) img->chunk;
     end = (unsigned char*) img->chunk + img->bytes_total;
@@ -38,15 +38,21 @@
 #include "MyMRI.h"
 
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <unistd.h>
 #include <vnl/vnl_inverse.h>
 #include <vnl/vnl_matrix.h>
 #include <vnl/vnl_matrix_fixed.h>
 #include <vnl/algo/vnl_svd.h>
 #include <vnl/algo/vnl_determinant.h>
 
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
 // all other software are all in "C"
 #ifdef __cplusplus
 extern "C"
@@ -393,6 +399,110 @@ void MultiRegistration::initRegistration(RegRobust & R)
 //   R.setTarget(P.mri_mean,P.fixvoxel,P.keeptype);
 }
 
+// number of voxels after making the image isotropic (at most, as
+// Registration uses the larger of the smallest voxel sides of both)
+static double getIsoVoxels(MRI * mri)
+{
+  double vs = fabs(mri->xsize);
+  if (fabs(mri->ysize) < vs)
+    vs = fabs(mri->ysize);
+  if (mri->depth > 1 && fabs(mri->zsize) < vs)
+    vs = fabs(mri->zsize);
+  double n = (mri->width * fabs(mri->xsize) / vs)
+      * (mri->height * fabs(mri->ysize) / vs);
+  if (mri->depth > 1)
+    n *= mri->depth * fabs(mri->zsize) / vs;
+  return n;
+}
+
+/*!
+ \brief Computes how many registrations (to mri_target) can run in parallel
+ \param nreg  number of registrations
+ \param mri_target  common target of the registrations
+ Bounded by the OpenMP threads and by the memory budget: FS_TEMPLATE_MAXMEM
+ (in MB) if set, else half the physical memory.
+ */
+int MultiRegistration::getRegistrationThreads(int nreg, MRI * mri_target)
+{
+  int nthreads = 1;
+#ifdef HAVE_OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  if (nthreads > nreg)
+    nthreads = nreg;
+  if (nthreads <= 1)
+    return 1;
+
+  // peak of one registration at the highest resolution: resampled source
+  // and target, source pyramid, both warped images, gradients, temporal
+  // difference, weights and indexing (about 12 float images)
+  double nvox = getIsoVoxels(mri_target);
+  for (unsigned int i = 0; i < mri_mov.size(); i++)
+  {
+    double n = getIsoVoxels(mri_mov[i]);
+    if (n > nvox)
+      nvox = n;
+  }
+  double regmb = 12.0 * sizeof(float) * nvox / (1024.0 * 1024.0);
+
+  double maxmb = -1;
+  char * mem = getenv("FS_TEMPLATE_MAXMEM");
+  if (mem)
+    maxmb = atof(mem);
+  else
+  {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long psize = sysconf(_SC_PAGE_SIZE);
+    if (pages > 0 && psize > 0)
+      maxmb = 0.5 * pages * (psize / (1024.0 * 1024.0));
+  }
+  if (maxmb > 0 && regmb * nthreads > maxmb)
+  {
+    nthreads = (int) (maxmb / regmb);
+    if (nthreads < 1)
+      nthreads = 1;
+  }
+
+  cout << " - running " << nthreads << " registrations in parallel ( ~"
+      << (int) regmb << " MB each )" << endl;
+  return nthreads;
+}
+
+/*!
+ \brief Sets the Gaussian pyramid of the target in R (read only)
+ \param R  Registration with source and target already set
+ All registrations of a loop have the same target, so its pyramid is built
+ only once (for each set of pyramid limits) instead of inside each
+ registration. Call freeSharedGPT once all these registrations are done.
+ */
+void MultiRegistration::shareGPT(Registration & R)
+{
+  vector<double> key = R.getGPTKey();
+#ifdef HAVE_OPENMP
+#pragma omp critical (sharedgpt)
+#endif
+  {
+    unsigned int k = 0;
+    while (k < gptkeys.size() && gptkeys[k] != key)
+      k++;
+    if (k == gptkeys.size())
+    {
+      gpts.push_back(R.buildGPT());
+      gptkeys.push_back(key);
+    }
+    R.setSharedGPT(gpts[k]);
+  }
+}
+
+void MultiRegistration::freeSharedGPT()
+{
+  for (unsigned int k = 0; k < gpts.size(); k++)
+    for (unsigned int l = 0; l < gpts[k].size(); l++)
+      MRIfree(&gpts[k][l]);
+  gpts.clear();
+  gptkeys.clear();
+}
+
 /*!
  \fn void mapAndAverageMov(int itdebug)
  \brief  maps movables to template using lta's, adjusts intensities (if iscale) and creates average (mean,median)
@@ -598,9 +708,13 @@ bool MultiRegistration::computeTemplate(int itmax, double eps, int iterate,
       cout << "  noxformits = " << noxformits[itcount - 1] << endl;
 
     // register all inputs to mean
+    // (each TP only writes its own results, so the order does not matter;
+    // RegistrationStep reduces in slice order, so a registration gives
+    // the same result whether it runs on one thread or on many)
     vector<double> dists(nin, 1000); // should be larger than maxchange!
 #ifdef HAVE_OPENMP
-#pragma omp parallel for schedule(static,1)
+    int nthreads = getRegistrationThreads(nin, mri_mean);
+#pragma omp parallel for schedule(dynamic,1) num_threads(nthreads)
 #endif
     for (int i = 0; i < nin; i++)
     {
@@ -616,6 +730,8 @@ bool MultiRegistration::computeTemplate(int itmax, double eps, int iterate,
 //      R.setTarget(mri_mean, fixvoxel, keeptype); // gaussian pyramid will be constructed for
 //                                                 // each Rv[i], could be optimized
       R.setSourceAndTarget(mri_mov[i],mri_mean,keeptype);
+      if (satit || !(nomulti || iscaleonly))
+        shareGPT(R); // pyramid of mean is built only once
 
       ostringstream oss;
       oss << outdir << "tp" << i + 1 << "_to_template-it" << itcount;
@@ -655,9 +771,6 @@ bool MultiRegistration::computeTemplate(int itmax, double eps, int iterate,
       if (satit)
         R.findSaturation();
 
-#ifdef HAVE_OPENMP
-#pragma omp critical
-#endif 
       if (nomulti || iscaleonly)
       {
         cout << " - running high-res registration on TP " << i + 1 << "..." << endl;
@@ -707,12 +820,14 @@ bool MultiRegistration::computeTemplate(int itmax, double eps, int iterate,
             MyMatrix::AffineTransDistSq(lastlta->xforms[0].m_L,
                 ltas[i]->xforms[0].m_L));
         LTAfree(&lastlta);
-        if (dists[i] > maxchange)
-          maxchange = dists[i];
 #ifdef HAVE_OPENMP
 #pragma omp critical
 #endif  
-        cout << "   tp " << i + 1 << " distance: " << dists[i] << endl;
+        {
+          if (dists[i] > maxchange)
+            maxchange = dists[i];
+          cout << "   tp " << i + 1 << " distance: " << dists[i] << endl;
+        }
       }
 
       // create warps: warp mov to mean
@@ -840,6 +955,7 @@ bool MultiRegistration::computeTemplate(int itmax, double eps, int iterate,
       }
 
     } // for loop end (all timepoints)
+    freeSharedGPT();
 
     // if we did not have initial transforms
     // allow for more iterations on different resolutions
@@ -1320,8 +1436,12 @@ bool MultiRegistration::initialXforms(int tpi, bool fixtp, int maxres,
   //Md[0].first = MatrixIdentity(4,NULL);
   Md[0].first.set_identity();
   Md[0].second = 1.0;
+  // summed up in order after the loop (same result for any thread count)
+  vector<vnl_vector_fixed<double, 4> > centroids(nin,
+      vnl_vector_fixed<double, 4>(0.0));
 #ifdef HAVE_OPENMP
-#pragma omp parallel for schedule(static,1)
+  int nthreads = getRegistrationThreads(nin - 1, mri_mov[tpi]);
+#pragma omp parallel for schedule(dynamic,1) num_threads(nthreads)
 #endif
   for (int i = 1; i < nin; i++)
   {
@@ -1347,6 +1467,8 @@ bool MultiRegistration::initialXforms(int tpi, bool fixtp, int maxres,
     if (debug) R.setVerbose(1);
     else R.setVerbose(0);
     R.setSourceAndTarget(mri_mov[j], mri_mov[tpi], keeptype);
+    if (satit || !nomulti)
+      shareGPT(R); // pyramid of tpi is built only once
     R.setName(oss.str());
 
     // compute Alignment (maxres,iterate,epsit) are passed above
@@ -1382,13 +1504,12 @@ bool MultiRegistration::initialXforms(int tpi, bool fixtp, int maxres,
       vnl_matlab_print(vcl_cout,R.getCentroidSinT(),"CentroidSinT",vnl_matlab_print_format_long);
       std::cout << std::endl;
     }
-#ifdef HAVE_OPENMP
-#pragma omp critical
-#endif  
-    {
-      centroid += centroid_temp;
-    }
+    centroids[i] = centroid_temp;
   } // end for loop (initial registration to inittp)
+  freeSharedGPT();
+
+  for (int i = 1; i < nin; i++)
+    centroid += centroids[i];
 
   centroid = (1.0 / nin) * centroid;
   if (debug)
@@ -297,6 +297,13 @@ private:
 
   void initRegistration(RegRobust & R);
 
+  //! Number of registrations to run at the same time (bounded by threads and memory)
+  int getRegistrationThreads(int nreg, MRI * mri_target);
+  //! Pass shared Gaussian pyramid of the (common) target to R, build it if first
+  void shareGPT(Registration & R);
+  //! Free the shared target pyramids (after all registrations are done)
+  void freeSharedGPT();
+
   vnl_matrix_fixed<double, 3, 3> getAverageCosines();
   MRI * createTemplateGeo();
 
@@ -336,6 +343,10 @@ private:
   std::vector<double> intensities;
   MRI * mri_mean;
 
+  // target pyramids shared by the registrations of one loop (and their keys)
+  std::vector<std::vector<MRI*> > gpts;
+  std::vector<std::vector<double> > gptkeys;
+
 };
 
 #endif
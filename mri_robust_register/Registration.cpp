@@ -71,8 +71,7 @@ Registration::~Registration()
 //  if (mri_hweights) MRIfree(&mri_hweights);
   if (gpS.size() > 0)
     freeGaussianPyramid(gpS);
-  if (gpT.size() > 0)
-    freeGaussianPyramid(gpT);
+  freeGPT();
   if (trans)
     delete trans;
   //std::cout << " Done " << std::endl;
@@ -2977,6 +2976,50 @@ pair<int, int> Registration::getGPLimits(MRI *mriS, MRI *mriT, int min, int max)
 
 }
 
+/** Same limits as used in computeMultiresRegistration and findSaturation
+ for the current (resampled) source and target.
+ */
+pair<int, int> Registration::getGPLimits()
+{
+  int MINS = 16;
+  if (minsize > MINS)
+    MINS = minsize; // use minsize, but at least 16
+  return getGPLimits(mri_source, mri_target, MINS, maxsize);
+}
+
+/** The returned pyramid is not kept, caller needs to free it (or pass it
+ to setSharedGPT of registrations to the same target).
+ */
+vector<MRI*> Registration::buildGPT()
+{
+  return buildGPLimits(mri_target, getGPLimits());
+}
+
+/** The target pyramid only depends on the resampled target image and
+ the pyramid limits. Two registrations with the same input target (and
+ equal keys) will build the identical pyramid, so one can be shared.
+ */
+vector<double> Registration::getGPTKey()
+{
+  assert(mri_target);
+  pair<int, int> limits = getGPLimits();
+  vector<double> key;
+  key.push_back(limits.first);
+  key.push_back(limits.second);
+  key.push_back(mri_target->type);
+  key.push_back(mri_target->width);
+  key.push_back(mri_target->height);
+  key.push_back(mri_target->depth);
+  key.push_back(mri_target->xsize);
+  key.push_back(mri_target->ysize);
+  key.push_back(mri_target->zsize);
+  key.push_back(mri_target->outside_val);
+  for (unsigned int r = 0; r < Rtrg.rows(); r++)
+    for (unsigned int c = 0; c < Rtrg.cols(); c++)
+      key.push_back(Rtrg[r][c]);
+  return key;
+}
+
 /** Here limits is the min and max iterations (subdivision level),
  meaning:  start highest resolution after min steps
  don't do more than max steps.
@@ -3929,8 +3972,7 @@ void Registration::setSourceAndTarget(MRI * s, MRI * t, bool keeptype)
   if (gpS.size() > 0)
     freeGaussianPyramid(gpS);
   centroidS.clear();
-  if (gpT.size() > 0)
-    freeGaussianPyramid(gpT);
+  freeGPT();
   centroidT.clear();
 
   // initialize the correct registration type:
@@ -3994,8 +4036,7 @@ void Registration::setTarget(MRI * t, bool conform, bool keeptype)
     MRIwrite(mri_target, n.c_str());
   }
 
-  if (gpT.size() > 0)
-    freeGaussianPyramid(gpT);
+  freeGPT();
   centroidT.clear();
   //cout << "mri_target" << mri_target << endl;
 
@@ -77,7 +77,8 @@ public:
           debug(0), verbose(1),initorient(false), inittransform(true), initscaling(false),
           highit(-1), mri_source(NULL), mri_target(NULL), iscaleinit(1.0),
           iscalefinal(1.0), doubleprec(false), symmetry(true),
-          sampletype(SAMPLE_TRILINEAR), resample(false), costfun(ROB), converged(false)
+          sampletype(SAMPLE_TRILINEAR), resample(false), costfun(ROB), converged(false),
+          gpTshared(false)
   {
   }
 
@@ -94,10 +95,26 @@ public:
     freeGaussianPyramid(gpS);
   }
 
-  //! Free Gaussian pyramid for target image
+  //! Free Gaussian pyramid for target image (only drop it, if it is shared)
   void freeGPT()
   {
-    freeGaussianPyramid(gpT);
+    if (gpTshared)
+      gpT.clear();
+    else
+      freeGaussianPyramid(gpT);
+    gpTshared = false;
+  }
+
+  //! Build Gaussian pyramid for target image (caller owns it, see setSharedGPT)
+  std::vector<MRI*> buildGPT();
+  //! Identifies resampled target and pyramid limits (equal keys give equal pyramids)
+  std::vector<double> getGPTKey();
+  //! Use Gaussian pyramid for target image that is owned (and freed) elsewhere
+  void setSharedGPT(const std::vector<MRI*>& gp)
+  {
+    freeGPT();
+    gpT = gp;
+    gpTshared = true;
   }
 
   //! Allow only translation
@@ -392,6 +409,8 @@ protected:
 
   //! Compute levels for gaussian pyramid based on both input images
   std::pair<int, int> getGPLimits(MRI *mriS, MRI *mriT, int min, int max);
+  //! Compute levels for gaussian pyramid of source and target (using minsize and maxsize)
+  std::pair<int, int> getGPLimits();
   //! Build Gaussian pyramid based on min and max image size
   std::vector<MRI*> buildGaussianPyramid(MRI * mri_in, int min = 16, int max =
       -1);
@@ -450,6 +469,9 @@ protected:
 
   bool converged;
 
+  // gpT is owned by someone else (see setSharedGPT)
+  bool gpTshared;
+
 private:
 
   // construct Ab and R:
@@ -46,9 +46,11 @@ extern "C"
 #include <vnl/vnl_vector.h>
 #include <vnl/vnl_matrix.h>
 #include <vnl/vnl_matrix_fixed.h>
+#include <vnl/algo/vnl_svd.h>
 #include "MyMRI.h"
 #include "MyMatrix.h"
 #include "Regression.h"
+#include "RobustGaussian.h"
 #include "Quaternion.h"
 #include "Transformation.h"
 #include "RegRobust.h"
@@ -63,8 +65,12 @@ public:
       sat(R.sat), iscale(R.iscale), transonly(R.transonly), rigid(R.rigid), isoscale(
           R.isoscale), trans(R.trans), costfun(R.costfun), rtype(1), subsamplesize(
           R.subsamplesize), debug(R.debug), verbose(R.verbose), floatsvd(false), iscalefinal(
-          R.iscalefinal), mri_weights(NULL), mri_indexing(NULL)
+          R.iscalefinal), mri_weights(NULL), mri_indexing(NULL), is2d(false), mri_fx(
+          NULL), mri_fy(NULL), mri_fz(NULL), mri_ft(NULL), mri_SmT(NULL), mri_rows(
+          NULL), eps(0.00001)
   {
+    // FS_ROBUST_DENSE: solve with the dense A (as before) instead of streaming the rows
+    densesolve = (getenv("FS_ROBUST_DENSE") != NULL);
   }
 
   //! Destructor to cleanup index image and weights
@@ -74,6 +80,7 @@ public:
       MRIfree(&mri_indexing);
     if (mri_weights)
       MRIfree(&mri_weights);
+    freeAb();
   }
 
   //! Compute a single registration step
@@ -127,6 +134,26 @@ protected:
 
   vnl_matrix<T> constructR(const vnl_vector<T> & p);
 
+  vnl_vector<T> getDenseEst(MRI * mriS, MRI* mriT, vnl_vector<T>& w);
+  long int prepareAb(MRI *mriS, MRI *mriT);
+  void freeAb();
+  bool getGradientBasis(vnl_matrix<double>& G);
+  inline void getRowMoments(int x, int y, int z, int f, double *u) const;
+  static inline double getTukeyWeight(double r, double sigma, double sat);
+  void accumulateNormalEquations(const T * r, double sigma, double sat,
+      const vnl_matrix<double>& G, vnl_matrix<double>& M,
+      vnl_vector<double>& v);
+  double computeResiduals(T * r, double sigma, double sat,
+      const vnl_vector<double>& q);
+  void computeWeights(T * w, double sigma, double sat,
+      const vnl_vector<double>& q);
+  static double getSigmaMAD(const T * r, T * tmp, long int n);
+  static vnl_vector<double> solveNormalEquations(const vnl_matrix<double>& M,
+      const vnl_vector<double>& v);
+  //! Robust estimate streaming the rows of A into the normal equations (no dense A)
+  vnl_vector<T> getRobustEstStream(vnl_vector<T>& w, long int n,
+      const vnl_matrix<double>& G, double sat);
+
 private:
 // in:
 
@@ -142,6 +169,7 @@ private:
   int debug;
   int verbose;
   bool floatsvd; // should be removed
+  bool densesolve; // build A and b (instead of streaming the rows)
   double iscalefinal; // from the last step, used in constructAB
 
 // out:
@@ -157,6 +185,14 @@ private:
   MRI * mri_indexing;
   vnl_vector<T> pvec;
 
+  // rows of A and b (from prepareAb):
+  bool is2d;
+  MRI *mri_fx, *mri_fy, *mri_fz, *mri_ft; // derivatives (subsampled)
+  MRI *mri_SmT; // b
+  MRI *mri_rows; // marks the rows on the subsampled grid
+  std::vector<long int> zrows; // first row of each slice
+  double eps; // zero threshold (fz of 2d rows is eps/2)
+
 };
 
 /** Computes Registration Single Step
@@ -175,74 +211,30 @@ std::pair<vnl_matrix_fixed<double, 4, 4>, double> RegistrationStep<T>::computeRe
     exit(1);
   }
 
-  vnl_matrix<T> A;
-  vnl_vector<T> b;
-
-  if (rigid && rtype == 2)
-  {
-    if (verbose > 1)
-      std::cout << "rigid and rtype 2 !" << std::endl;
-    assert(rtype !=2);
-
-    // compute non rigid A
-    rigid = false;
-    constructAb(mriS, mriT, A, b);
-    rigid = true;
-    // now restrict A  (= A R(lastp) )
-    vnl_matrix<T> R;
-    if (pvec.size() > 0)
-      R = constructR(pvec); // construct from last param estimate
-    else // construct from identity:
-    {
-      int l = 6;
-      if (!rigid)
-        l = 12;
-      if (iscale)
-        l++;
-      vnl_vector<T> tempp(l, 0.0);
-      R = constructR(tempp);
-      //MatrixPrintFmt(stdout,"% 2.8f",R);exit(1);
-    }
-    A = A * R.transpose();
-  }
-  else
-  {
-    //std::cout << "Rtype  " << rtype << std::endl;
-
-    constructAb(mriS, mriT, A, b);
-  }
-
-  if (verbose > 1)
-    std::cout << "   - checking A and b for nan ..." << std::flush;
-  if (!A.is_finite() || !b.is_finite())
-  {
-    std::cerr << " A or b constain NAN or infinity values!!" << std::endl;
-    exit(1);
-  }
-
-  if (verbose > 1)
-    std::cout << "  DONE" << std::endl;
-
-  Regression<T> R(A, b);
-  R.setVerbose(verbose);
-  R.setFloatSvd(floatsvd);
-  if (costfun == Registration::ROB)
+  vnl_vector<T> w;
+  vnl_matrix<double> G;
+  if (costfun == Registration::ROB && !(rigid && rtype == 2) && !densesolve
+      && getGradientBasis(G))
   {
-    vnl_vector<T> w;
+    // stream the rows into the normal equations, A is never stored
+    long int n = prepareAb(mriS, mriT);
     if (verbose > 1)
-      std::cout << "   - compute robust estimate ( sat " << sat << " )..."
+      std::cout << "   - compute robust estimate ( sat " << sat << " , "
+          << 2.0 * n * sizeof(T) / (1024.0 * 1024.0) << "Mb mem )..."
           << std::flush;
     if (sat < 0)
-      pvec = R.getRobustEstW(w);
+      pvec = getRobustEstStream(w, n, G, SATr);
     else
-      pvec = R.getRobustEstW(w, sat);
-
-    A.clear();
-    b.clear();
-
+      pvec = getRobustEstStream(w, n, G, sat);
+    freeAb();
     if (verbose > 1)
       std::cout << "  DONE" << std::endl;
+  }
+  else
+    pvec = getDenseEst(mriS, mriT, w);
 
+  if (costfun == Registration::ROB)
+  {
 //    std::cout << " pvec  : "<< std::endl;
 //    std::cout.precision(16);
 //    for (unsigned int iii=0;iii<pvec.size(); iii++)
@@ -336,23 +328,8 @@ std::pair<vnl_matrix_fixed<double, 4, 4>, double> RegistrationStep<T>::computeRe
 //    }
 
   }
-  else
-  {
-    if (verbose > 1)
-      std::cout << "   - compute least squares estimate ..." << std::flush;
-    pvec = R.getLSEst();
-
-    A.clear();
-    b.clear();
-    if (verbose > 1)
-      std::cout << "  DONE" << std::endl;
-    // no weights in this case
-    if (mri_weights)
-      MRIfree(&mri_weights);
-  }
-
-//  zeroweights = R.getLastZeroWeightPercent();
-  zeroweights = R.getLastWeightPercent(); // does not need pointers A and B to be valid
+  else if (mri_weights) // no weights in this case
+    MRIfree(&mri_weights);
 
 //  R.plotPartialSat(name);
 
@@ -373,16 +350,110 @@ std::pair<vnl_matrix_fixed<double, 4, 4>, double> RegistrationStep<T>::computeRe
   return Md;
 }
 
-/** Constructs matrix A and vector b for robust regression
-   (see Reuter et. al, Neuroimage 2010)
+/** Computes the estimate (robust or least squares) with the dense A and b
+ (constructAb and Regression), returns the parameters and the sqrt weights w.
  */
 template<class T>
-void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
-    vnl_vector<T>&b)
+vnl_vector<T> RegistrationStep<T>::getDenseEst(MRI * mriS, MRI* mriT,
+    vnl_vector<T>& w)
 {
+  vnl_matrix<T> A;
+  vnl_vector<T> b;
+
+  if (rigid && rtype == 2)
+  {
+    if (verbose > 1)
+      std::cout << "rigid and rtype 2 !" << std::endl;
+    assert(rtype !=2);
+
+    // compute non rigid A
+    rigid = false;
+    constructAb(mriS, mriT, A, b);
+    rigid = true;
+    // now restrict A  (= A R(lastp) )
+    vnl_matrix<T> R;
+    if (pvec.size() > 0)
+      R = constructR(pvec); // construct from last param estimate
+    else // construct from identity:
+    {
+      int l = 6;
+      if (!rigid)
+        l = 12;
+      if (iscale)
+        l++;
+      vnl_vector<T> tempp(l, 0.0);
+      R = constructR(tempp);
+      //MatrixPrintFmt(stdout,"% 2.8f",R);exit(1);
+    }
+    A = A * R.transpose();
+  }
+  else
+  {
+    //std::cout << "Rtype  " << rtype << std::endl;
+
+    constructAb(mriS, mriT, A, b);
+  }
 
   if (verbose > 1)
-    std::cout << "   - constructAb: " << std::endl;
+    std::cout << "   - checking A and b for nan ..." << std::flush;
+  if (!A.is_finite() || !b.is_finite())
+  {
+    std::cerr << " A or b constain NAN or infinity values!!" << std::endl;
+    exit(1);
+  }
+
+  if (verbose > 1)
+    std::cout << "  DONE" << std::endl;
+
+  Regression<T> R(A, b);
+  R.setVerbose(verbose);
+  R.setFloatSvd(floatsvd);
+  if (costfun == Registration::ROB)
+  {
+    if (verbose > 1)
+      std::cout << "   - compute robust estimate ( sat " << sat << " )..."
+          << std::flush;
+    if (sat < 0)
+      pvec = R.getRobustEstW(w);
+    else
+      pvec = R.getRobustEstW(w, sat);
+
+    A.clear();
+    b.clear();
+
+    if (verbose > 1)
+      std::cout << "  DONE" << std::endl;
+
+  }
+  else
+  {
+    if (verbose > 1)
+      std::cout << "   - compute least squares estimate ..." << std::flush;
+    pvec = R.getLSEst();
+
+    A.clear();
+    b.clear();
+    if (verbose > 1)
+      std::cout << "  DONE" << std::endl;
+  }
+
+//  zeroweights = R.getLastZeroWeightPercent();
+  zeroweights = R.getLastWeightPercent(); // does not need pointers A and B to be valid
+
+  return pvec;
+}
+
+/** Prepares the rows of the robust regression A p = b
+   (see Reuter et. al, Neuroimage 2010):
+   computes the derivative images, the indexing image and a mask of the
+   valid rows on the (possibly subsampled) grid. The rows themselves are
+   assembled from these images, either into a dense matrix (constructAb)
+   or on the fly (getRobustEstStream). Returns the number of rows.
+   Call freeAb to release the images.
+ */
+template<class T>
+long int RegistrationStep<T>::prepareAb(MRI *mriS, MRI *mriT)
+{
 
   if (mriS->nframes == 0) mriS->nframes = 1;
   if (mriT->nframes == 0) mriT->nframes = 1;
@@ -395,7 +466,7 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
   assert(mriS->nframes == mriT->nframes);
   assert(mriS->type == mriT->type);
 
-  bool is2d = false;
+  is2d = false;
   //cout << "Sd: " << mriS->depth << " Td: " << mriT->depth << endl;
   if (mriS->depth == 1 || mriT->depth == 1)
   {
@@ -520,12 +591,13 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
 //cout << " size src: " << mriS->width << " , " << mriS->height << " , " << mriS->depth << std::endl;
 
   // compute 'counti': the number of rows needed (zero elements need to be removed)
+  // and mark the rows (index image and row mask on the subsampled grid)
   int n = fx->width * fx->height * fx->depth * fx->nframes;
   if (verbose > 1)
     std::cout << "     -- size " << fx->width << " x " << fx->height << " x "
         << fx->depth << " x " << fx->nframes << " = " << n << std::flush;
   long int counti = 0;
-  double eps = 0.00001;
+  eps = 0.00001;
   double oepss = eps+mriS->outside_val/255.0;
   double oepst = eps+mriT->outside_val/255.0;
   int fxd = fx->depth;
@@ -538,7 +610,16 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
   float fzval = eps/2.0;
   int dx, dy, dz;
   int randpos = 0;
+  if (mri_rows)
+    MRIfree(&mri_rows);
+  mri_rows = MRIallocSequence(fxw, fxh, fxd, MRI_UCHAR, fxf);
+  if (mri_rows == NULL)
+    ErrorExit(ERROR_NO_MEMORY,
+        "Registration::constructAB could not allocate memory for mri_rows");
+  zrows.assign(fxd + 1, 0);
   for (z = fxstart; z < fxd; z++)
+  {
+    zrows[z] = counti;
     for (x = fxstart; x < fxw; x++)
       for (y = fxstart; y < fxh; y++)
       {
@@ -560,24 +641,32 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
             zp1 = 2*z+dz;
           }
         }
-        else 
+        else
         {
           xp1 = x;
           yp1 = y;
-          zp1 = z; 
+          zp1 = z;
         }
         assert(xp1 < mriS->width);
         assert(yp1 < mriS->height);
         assert(zp1 < mriS->depth);
-//        if ( MRIgetVoxVal(mriS,xp1,yp1,zp1,0) == mriS->outside_val || MRIgetVoxVal(mriT,xp1,yp1,zp1,0) == mriT->outside_val )
-        if ( fabs(MRIgetVoxVal(mriS,xp1,yp1,zp1,0)- mriS->outside_val) <= oepss || fabs(MRIgetVoxVal(mriT,xp1,yp1,zp1,0)- mriT->outside_val)<=oepst )
+        const float & mriSval = MRIgetVoxVal(mriS,xp1,yp1,zp1,0);
+        const float & mriTval = MRIgetVoxVal(mriT,xp1,yp1,zp1,0);
+
+//        if ( mriSval == mriS->outside_val || mriTval == mriT->outside_val )
+        if ( fabs(mriSval- mriS->outside_val) <= oepss || fabs(mriTval- mriT->outside_val)<=oepst )
         {
           //std::cout << "voxel outside (" << xp1 << " " << yp1 << " " << zp1 << " )  mriS: " <<MRIFvox(mriS,xp1,yp1,zp1) << "  mriT: " << MRIFvox(mriT,xp1,yp1,zp1)  << "  ovalS: " << mriS->outside_val << "  ovalT: " << mriT->outside_val<< std::endl;
+          int outval = -4;
+          if (fabs(mriSval - mriS->outside_val)<=oepss && fabs(mriTval- mriT->outside_val) <= oepst )
+            outval = -5;
+          for (f=0;f<fxf;f++)
+            MRILseq_vox(mri_indexing, xp1, yp1, zp1,f) = outval;
           ocount+=fxf; // will be outside in all frames then
           continue;
         }
 
-        // nan and zero values will also be skipped 
+        // nan and zero values will also be skipped
         for (f=0;f<fxf;f++)
         {
           const float & ftval = MRIFseq_vox(ft, x, y, z, f);
@@ -585,23 +674,29 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
           const float & fyval = MRIFseq_vox(fy, x, y, z, f);
           if (!is2d)
             fzval = MRIFseq_vox(fz, x, y, z, f) ;
-                
+
           if (isnan(fxval) || isnan(fyval) || isnan(fzval) || isnan(ftval) )
           {
             //if (verbose > 0) std::cout << " found a nan value!!!" << std::endl;
+            MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = -2;
             ncount++;
             continue;
           }
           if (fabs(fxval) < eps  && fabs(fyval) < eps && fabs(fzval) < eps )
           {
             //if (verbose > 0) std::cout << " found a zero element !!!" << std::endl;
+            MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = -1;
             zcount++;
             continue;
           }
-          counti++; // found another good voxel
+          MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = counti;
+          MRIseq_vox(mri_rows, x, y, z, f) = 1;
+          counti++; // found another good voxel (start with 0)
          }
        }
-      
+  }
+  zrows[fxd] = counti;
+
   if (verbose > 1 && n > counti)
     std::cout << "  need only: " << counti << std::endl;
 
@@ -638,6 +733,48 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
     cout << "     -- nans: " << ncount << " zeros: " << zcount << " outside: "
         << ocount << endl;
 
+  mri_fx = fx;
+  mri_fy = fy;
+  mri_fz = fz;
+  mri_ft = ft;
+  mri_SmT = SmT;
+
+  return counti;
+}
+
+/** Frees the images created by prepareAb (keeps the indexing image).
+ */
+template<class T>
+void RegistrationStep<T>::freeAb()
+{
+  if (mri_fx)
+    MRIfree(&mri_fx);
+  if (mri_fy)
+    MRIfree(&mri_fy);
+  if (mri_fz)
+    MRIfree(&mri_fz);
+  if (mri_ft)
+    MRIfree(&mri_ft);
+  if (mri_SmT)
+    MRIfree(&mri_SmT);
+  if (mri_rows)
+    MRIfree(&mri_rows);
+  zrows.clear();
+}
+
+/** Constructs matrix A and vector b for robust regression
+   (see Reuter et. al, Neuroimage 2010)
+ */
+template<class T>
+void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
+    vnl_vector<T>&b)
+{
+
+  if (verbose > 1)
+    std::cout << "   - constructAb: " << std::endl;
+
+  long int counti = prepareAb(mriS, mriT);
+
   // allocate the space for A and B
   int pnum = trans->getDOF();
   if (iscale)
@@ -681,85 +818,25 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
 //        std::cout << "Press a key to continue iterations: ";
 //        std::cin  >> ch;
 
-  // Loop and construct A and b
+  // Loop over the rows marked in prepareAb and construct A and b
   long int count = 0;
-  ocount = 0;
-  randpos = 0;
-  fzval = eps/2.0;
+  int z, y, x, f;
+  float fzval = eps/2.0;
 
-  for (z = fxstart; z < fxd; z++)
-    for (x = fxstart; x < fxw; x++)
-      for (y = fxstart; y < fxh; y++)
-      {
-        // check if position is outside either source or target:
-        if (dosubsample)
-        {
-          // dx,dy and dz need to agree with the subsampling above
-          dx = (int)(2.0*MyMRI::getRand(randpos));
-          randpos++;
-          dy = (int)(2.0*MyMRI::getRand(randpos));
-          randpos++;
-          xp1 = 2*x+dx;
-          yp1 = 2*y+dy;
-          if (is2d) zp1 = z;
-          else
-          {
-            dz = (int)(2.0*MyMRI::getRand(randpos));
-            randpos++;
-            zp1 = 2*z+dz;
-          }
-        }
-        else // if not subsampled
-        {
-          xp1 = x;
-          yp1 = y;
-          zp1 = z;
-        }
-        assert(xp1 < mriS->width);
-        assert(yp1 < mriS->height);
-        assert(zp1 < mriS->depth);
-        const float & mriSval = MRIgetVoxVal(mriS,xp1,yp1,zp1,0);
-        const float & mriTval = MRIgetVoxVal(mriT,xp1,yp1,zp1,0);
-        
-//        if ( mriSval == mriS->outside_val || mriTval == mriT->outside_val )
-        if ( fabs(mriSval- mriS->outside_val) <= oepss || fabs(mriTval- mriT->outside_val)<=oepst )
-        {
-          //std::cout << "voxel outside (" << xp1 << " " << yp1 << " " << zp1 << " )  mriS: " <<MRIFvox(mriS,xp1,yp1,zp1) << "  mriT: " << MRIFvox(mriT,xp1,yp1,zp1)  << "  ovalS: " << mriS->outside_val << "  ovalT: " << mriT->outside_val<< std::endl;
-          int outval = -4;
-          if (fabs(mriSval - mriS->outside_val)<=oepss && fabs(mriTval- mriT->outside_val) <= oepst )
-            outval = -5;
-          for (f=0;f<fxf;f++)
-            MRILseq_vox(mri_indexing, xp1, yp1, zp1,f) = outval;
-          ocount+=fxf;
-          //cout << " " << ocount << flush;
-          continue;
-        }
-        
-        // loop through all frames
-        for (f=0; f<fxf; f++)
+  for (z = 0; z < mri_rows->depth; z++)
+    for (x = 0; x < mri_rows->width; x++)
+      for (y = 0; y < mri_rows->height; y++)
+        for (f = 0; f < mri_rows->nframes; f++)
         {
-          const float & ftval = MRIFseq_vox(ft, x, y, z, f);
-          const float & fxval = MRIFseq_vox(fx, x, y, z, f);
-          const float & fyval = MRIFseq_vox(fy, x, y, z, f);
-          if (!is2d) fzval = MRIFseq_vox(fz, x, y, z, f);
-          
-          // skip nans or zeros
-          if (isnan(fxval) || isnan(fyval) || isnan(fzval) || isnan(ftval) )
-          {
-            //if (verbose > 0) std::cout << " found a nan value!!!" << std::endl;
-            MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = -2;
-            continue;
-          }
-          if (fabs(fxval) < eps && fabs(fyval) < eps && fabs(fzval) < eps )
-          {
-            //if (verbose > 0) std::cout << " found a zero element !!!" << std::endl;
-            MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = -1;
+          if (!MRIseq_vox(mri_rows, x, y, z, f))
             continue;
-          }
 
-          assert(counti > count);
+          const float & ftval = MRIFseq_vox(mri_ft, x, y, z, f);
+          const float & fxval = MRIFseq_vox(mri_fx, x, y, z, f);
+          const float & fyval = MRIFseq_vox(mri_fy, x, y, z, f);
+          if (!is2d) fzval = MRIFseq_vox(mri_fz, x, y, z, f);
 
-          MRILseq_vox(mri_indexing, xp1, yp1, zp1, f) = count;
+          assert(counti > count);
 
           //cout << "x: " << x << " y: " << y << " z: " << z << " count: "<< count << std::endl;
           //cout << " " << count << " mrifx: " << MRIFvox(mri_fx, x, y, z) << " mrifx int: " << (int)MRIvox(mri_fx,x,y,z) <<endl;
@@ -895,31 +972,446 @@ void RegistrationStep<T>::constructAb(MRI *mriS, MRI *mriT, vnl_matrix<T>& A,
           if (iscale) A[count][dof] = ftval;
 
           // A p = b = IS - IT
-          b[count] = MRIFseq_vox(SmT, x, y, z, f);
+          b[count] = MRIFseq_vox(mri_SmT, x, y, z, f);
 
           count++;// start with 0 above
 
         }
-      }
-        //cout << " ocount : " << ocount << endl;    
-        //cout << " counti: " << counti << " count : " << count<< endl;    
+        //cout << " counti: " << counti << " count : " << count<< endl;
   assert(counti == count);
 
-//   vnl_matlab_print(vcl_cerr,A,"A",vnl_matlab_print_format_long);std::cerr << std::endl;    
-//   vnl_matlab_print(vcl_cerr,b,"b",vnl_matlab_print_format_long);std::cerr << std::endl;    
+//   vnl_matlab_print(vcl_cerr,A,"A",vnl_matlab_print_format_long);std::cerr << std::endl;
+//   vnl_matlab_print(vcl_cerr,b,"b",vnl_matlab_print_format_long);std::cerr << std::endl;
 
-  // free remaining MRI    
-  MRIfree(&fx);
-  MRIfree(&fy);
-  if (fz)
-    MRIfree(&fz);
-  MRIfree(&ft);
-  MRIfree(&SmT);
+  // free remaining MRI
+  freeAb();
 //MRIwrite(mri_indexing,"mriindexing2.mgz");
 //exit(1);
   return;
 }
 
+/** Expresses the rows of A in terms of the image gradient moments
+ u = (fx x, fx y, fx z, fx, fy x, ... , fz z, fz [, ft]) so that a row is G u.
+ This holds for all our linear transformation models, as their gradient
+ is linear in (fx,fy,fz) and affine in the position (x,y,z). G is probed
+ from trans->getGradient and checked at a test point. Returns false if the
+ transformation model does not fit (then the dense A has to be used).
+ */
+template<class T>
+bool RegistrationStep<T>::getGradientBasis(vnl_matrix<double>& G)
+{
+  unsigned int dof = trans->getDOF();
+  int pnum = dof;
+  int nm = 12;
+  if (iscale)
+  {
+    pnum++;
+    nm++;
+  }
+  G.set_size(pnum, nm);
+  G.fill(0.0);
+
+  const unsigned int zero = 0;
+  const unsigned int unit[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+  unsigned int i;
+  for (int k = 0; k < 3; k++)
+  {
+    float fv[3] = { 0.0, 0.0, 0.0 };
+    fv[k] = 1.0;
+    vnl_vector<double> g0 = trans->getGradient(zero, fv[0], zero, fv[1], zero,
+        fv[2]);
+    if (g0.size() != dof)
+      return false;
+    for (int j = 0; j < 3; j++)
+    {
+      vnl_vector<double> g = trans->getGradient(unit[j][0], fv[0], unit[j][1],
+          fv[1], unit[j][2], fv[2]);
+      for (i = 0; i < dof; i++)
+        G[i][4 * k + j] = g[i] - g0[i];
+    }
+    for (i = 0; i < dof; i++)
+      G[i][4 * k + 3] = g0[i];
+  }
+  if (iscale)
+    G[dof][12] = 1.0;
+
+  // check the model at some position
+  const unsigned int xt = 37, yt = 11, zt = 23;
+  const float fxt = 0.7, fyt = -1.3, fzt = 0.4;
+  vnl_vector<double> g = trans->getGradient(xt, fxt, yt, fyt, zt, fzt);
+  double u[12] = { fxt * xt, fxt * yt, fxt * zt, fxt, fyt * xt, fyt * yt, fyt
+      * zt, fyt, fzt * xt, fzt * yt, fzt * zt, fzt };
+  for (i = 0; i < dof; i++)
+  {
+    double gi = 0.0;
+    for (int j = 0; j < 12; j++)
+      gi += G[i][j] * u[j];
+    if (fabs(gi - g[i]) > 1e-4 * (1.0 + fabs(g[i])))
+      return false;
+  }
+  return true;
+}
+
+/** Computes the moments u of a row (see getGradientBasis).
+ */
+template<class T>
+inline void RegistrationStep<T>::getRowMoments(int x, int y, int z, int f,
+    double *u) const
+{
+  double fxval = MRIFseq_vox(mri_fx, x, y, z, f);
+  double fyval = MRIFseq_vox(mri_fy, x, y, z, f);
+  double fzval = eps / 2.0;
+  if (!is2d)
+    fzval = MRIFseq_vox(mri_fz, x, y, z, f);
+  u[0] = fxval * x;
+  u[1] = fxval * y;
+  u[2] = fxval * z;
+  u[3] = fxval;
+  u[4] = fyval * x;
+  u[5] = fyval * y;
+  u[6] = fyval * z;
+  u[7] = fyval;
+  u[8] = fzval * x;
+  u[9] = fzval * y;
+  u[10] = fzval * z;
+  u[11] = fzval;
+  if (iscale)
+    u[12] = MRIFseq_vox(mri_ft, x, y, z, f);
+}
+
+/** Squared Tukey biweight of the residual r (normalized by sigma).
+ Sigma <= 0 means unit weights.
+ */
+template<class T>
+inline double RegistrationStep<T>::getTukeyWeight(double r, double sigma,
+    double sat)
+{
+  if (sigma <= 0.0)
+    return 1.0;
+  double t = r / (sigma * sat);
+  if (fabs(t) >= 1.0)
+    return 0.0;
+  t = 1.0 - t * t;
+  return t * t;
+}
+
+/** Folds all rows into the normal equations in moment space
+ M = sum w u u^T and v = sum w b u (with Tukey weights w computed from the
+ residuals r), then maps them to the parameters (G M G^T and G v).
+ One pass over the images, partial sums are kept per slice and added
+ in slice order, so the result does not depend on the number of threads.
+ */
+template<class T>
+void RegistrationStep<T>::accumulateNormalEquations(const T * r, double sigma,
+    double sat, const vnl_matrix<double>& G, vnl_matrix<double>& M,
+    vnl_vector<double>& v)
+{
+  const int nm = G.cols();
+  const int stride = nm * nm + nm;
+  std::vector<double> partial(mri_rows->depth * stride, 0.0);
+
+  int z;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    double * Mt = &partial[z * stride];
+    double * vt = Mt + nm * nm;
+    double u[13];
+    long int row = zrows[z];
+    int x, y, f, i, j;
+    for (x = 0; x < mri_rows->width; x++)
+      for (y = 0; y < mri_rows->height; y++)
+        for (f = 0; f < mri_rows->nframes; f++)
+        {
+          if (!MRIseq_vox(mri_rows, x, y, z, f))
+            continue;
+          double wi = getTukeyWeight(r[row], sigma, sat);
+          row++;
+          if (wi == 0.0)
+            continue;
+          getRowMoments(x, y, z, f, u);
+          double bi = wi * MRIFseq_vox(mri_SmT, x, y, z, f);
+          for (i = 0; i < nm; i++)
+          {
+            double wu = wi * u[i];
+            vt[i] += bi * u[i];
+            for (j = i; j < nm; j++)
+              Mt[i * nm + j] += wu * u[j];
+          }
+        }
+  }
+
+  // sum partials (in slice order) and fill lower triangle
+  vnl_matrix<double> Mm(nm, nm, 0.0);
+  vnl_vector<double> vm(nm, 0.0);
+  int i, j;
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    const double * Mt = &partial[z * stride];
+    for (i = 0; i < nm; i++)
+    {
+      vm[i] += Mt[nm * nm + i];
+      for (j = i; j < nm; j++)
+        Mm[i][j] += Mt[i * nm + j];
+    }
+  }
+  for (i = 0; i < nm; i++)
+    for (j = 0; j < i; j++)
+      Mm[i][j] = Mm[j][i];
+
+  M = G * Mm * G.transpose();
+  v = G * vm;
+}
+
+/** Computes the residuals r = b - A p (with q = G^T p) in place and returns
+ the error sum(w r^2) / sum(w), where the weights w are computed from the
+ previous residuals stored in r (and sigma).
+ */
+template<class T>
+double RegistrationStep<T>::computeResiduals(T * r, double sigma, double sat,
+    const vnl_vector<double>& q)
+{
+  const int nm = q.size();
+  std::vector<double> partial(2 * mri_rows->depth, 0.0);
+
+  int z;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    double u[13];
+    double sw = 0.0, swr = 0.0;
+    long int row = zrows[z];
+    int x, y, f, i;
+    for (x = 0; x < mri_rows->width; x++)
+      for (y = 0; y < mri_rows->height; y++)
+        for (f = 0; f < mri_rows->nframes; f++)
+        {
+          if (!MRIseq_vox(mri_rows, x, y, z, f))
+            continue;
+          double wi = 1.0;
+          if (sigma > 0.0)
+            wi = getTukeyWeight(r[row], sigma, sat);
+          getRowMoments(x, y, z, f, u);
+          double ri = MRIFseq_vox(mri_SmT, x, y, z, f);
+          for (i = 0; i < nm; i++)
+            ri -= u[i] * q[i];
+          r[row] = (T) ri;
+          ri = r[row];
+          sw += wi;
+          swr += wi * ri * ri;
+          row++;
+        }
+    partial[2 * z] = sw;
+    partial[2 * z + 1] = swr;
+  }
+
+  // sum in slice order (independent of the number of threads)
+  double sw = 0.0, swr = 0.0;
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    sw += partial[2 * z];
+    swr += partial[2 * z + 1];
+  }
+  return swr / sw;
+}
+
+/** Computes the residuals of A p (with q = G^T p) and replaces them in w by
+ the sqrt of their Tukey weights. Also sets the weight statistics (zeroweights).
+ */
+template<class T>
+void RegistrationStep<T>::computeWeights(T * w, double sigma, double sat,
+    const vnl_vector<double>& q)
+{
+  const int nm = q.size();
+  std::vector<double> partial(3 * mri_rows->depth, 0.0);
+
+  int z;
+#ifdef HAVE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    double u[13];
+    double dd = 0.0, ddcount = 0.0, zcount = 0.0;
+    long int row = zrows[z];
+    int x, y, f, i;
+    for (x = 0; x < mri_rows->width; x++)
+      for (y = 0; y < mri_rows->height; y++)
+        for (f = 0; f < mri_rows->nframes; f++)
+        {
+          if (!MRIseq_vox(mri_rows, x, y, z, f))
+            continue;
+          getRowMoments(x, y, z, f, u);
+          double bi = MRIFseq_vox(mri_SmT, x, y, z, f);
+          double ri = bi;
+          for (i = 0; i < nm; i++)
+            ri -= u[i] * q[i];
+          T val = (T) sqrt(getTukeyWeight((T) ri, sigma, sat));
+          w[row] = val;
+          if (fabs(bi) > 0.00001)
+          {
+            dd += val;
+            ddcount++;
+            if (val < 0.1)
+              zcount++;
+          }
+          row++;
+        }
+    partial[3 * z] = dd;
+    partial[3 * z + 1] = ddcount;
+    partial[3 * z + 2] = zcount;
+  }
+
+  // sum in slice order (independent of the number of threads)
+  double dd = 0.0, ddcount = 0.0, zcount = 0.0;
+  for (z = 0; z < mri_rows->depth; z++)
+  {
+    dd += partial[3 * z];
+    ddcount += partial[3 * z + 1];
+    zcount += partial[3 * z + 2];
+  }
+  dd /= ddcount;
+  if (verbose > 1)
+    cout << "          weights average: " << dd << "  zero: "
+        << zcount / ddcount << flush;
+  zeroweights = dd;
+}
+
+/** Robust estimate for sigma (using median absolute deviation)
+ of the n residuals in r, uses tmp as scratch space.
+ */
+template<class T>
+double RegistrationStep<T>::getSigmaMAD(const T * r, T * tmp, long int n)
+{
+  long int i;
+  for (i = 0; i < n; i++)
+    tmp[i] = r[i];
+  T med = RobustGaussian<T>::median(tmp, (int) n);
+  for (i = 0; i < n; i++)
+    tmp[i] = fabs(r[i] - med);
+  return 1.4826 * RobustGaussian<T>::median(tmp, (int) n);
+}
+
+/** Solves the (symmetric) normal equations M p = v,
+ with Jacobi scaling for better conditioning.
+ */
+template<class T>
+vnl_vector<double> RegistrationStep<T>::solveNormalEquations(
+    const vnl_matrix<double>& M, const vnl_vector<double>& v)
+{
+  unsigned int n = v.size();
+  unsigned int i, j;
+  vnl_vector<double> d(n, 1.0);
+  for (i = 0; i < n; i++)
+    if (M[i][i] > 0.0)
+      d[i] = 1.0 / sqrt(M[i][i]);
+  vnl_matrix<double> Ms(n, n);
+  vnl_vector<double> vs(n);
+  for (i = 0; i < n; i++)
+  {
+    vs[i] = d[i] * v[i];
+    for (j = 0; j < n; j++)
+      Ms[i][j] = d[i] * M[i][j] * d[j];
+  }
+  vnl_svd<double> svd(Ms);
+  vnl_vector<double> p = svd.solve(vs);
+  for (i = 0; i < n; i++)
+    p[i] *= d[i];
+  return p;
+}
+
+/** Solves the robust regression A p = b without ever storing A:
+ the same iteratively reweighted least squares (Tukey's biweight) as in
+ Regression<T>::getRobustEstWAB, but each iteration only streams the rows
+ (from the images of prepareAb) into the small normal equations
+ A^T W A p = A^T W b with the weights computed on the fly.
+ Only the residuals are kept per row (needed for sigma), they are
+ replaced by the sqrt of the final weights in w.
+ */
+template<class T>
+vnl_vector<T> RegistrationStep<T>::getRobustEstStream(vnl_vector<T>& w,
+    long int n, const vnl_matrix<double>& G, double sat)
+{
+  // constants (as in Regression)
+  int MAXIT = 20;
+  double EPS = 2e-12;
+
+  std::vector<double> err(MAXIT + 1);
+  err[0] = std::numeric_limits<double>::infinity();
+  err[1] = 1e20;
+  // parameters and sigma of each step (to be able to go back one step)
+  std::vector<vnl_vector<double> > ps(MAXIT + 1,
+      vnl_vector<double>(G.rows(), 0.0));
+  std::vector<double> sigmas(MAXIT + 1, 0.0);
+
+  vnl_matrix<double> M;
+  vnl_vector<double> v;
+  vnl_vector<double> q(G.cols(), 0.0);
+  vnl_vector<T> tmp;
+  bool OK = w.set_size(n);
+  OK = OK && tmp.set_size(n);
+  if (!OK)
+    ErrorExit(ERROR_NO_MEMORY,
+        "RegistrationStep::getRobustEstStream could not allocate memory for residuals");
+
+  // residuals for p = 0 are b
+  computeResiduals(w.data_block(), 0.0, sat, q);
+
+  int count = 0;
+  int incr = 0;
+  // iteration until we increase the error, we reach maxit or we have no error
+  do
+  {
+    count++; //first = 1
+
+    double sigma = getSigmaMAD(w.data_block(), tmp.data_block(), n);
+    if (sigma < EPS) // e.g. if images are identical, use unit weights
+    {
+      if (count == 1)
+        cout << "  Sigma too small: " << sigma << " (identical images?)"
+            << endl;
+      sigma = 0.0;
+    }
+    sigmas[count] = sigma;
+
+    // compute weighted least squares
+    accumulateNormalEquations(w.data_block(), sigma, sat, G, M, v);
+    if (!M.is_finite() || !v.is_finite())
+    {
+      std::cerr << " A or b constain NAN or infinity values!!" << std::endl;
+      exit(1);
+    }
+    ps[count] = solveNormalEquations(M, v);
+
+    // compute new residuals and total error
+    q = G.transpose() * ps[count];
+    err[count] = computeResiduals(w.data_block(), sigma, sat, q);
+    //cout << "err [ " << count << " ] = " << err[count] << endl;
+    if (err[count - 1] <= err[count])
+      incr++;
+  } while (incr < 1 && count < MAXIT && err[count] > EPS);
+
+  // take previous values if last step made the error increase
+  int k = count;
+  if (err[count] > err[count - 1])
+    k = count - 1;
+  if (verbose > 1)
+    cout << "     Step: " << k - 1 << " ERR: " << err[k] << endl;
+
+  // weights of step k were computed from the residuals of step k-1
+  q = G.transpose() * ps[k - 1];
+  computeWeights(w.data_block(), sigmas[k], sat, q);
+
+  vnl_vector<T> p(ps[k].size());
+  for (unsigned int i = 0; i < p.size(); i++)
+    p[i] = (T) ps[k][i];
+  return p;
+}
+
 // template <class T>
 // pair < vnl_matrix_fixed <double,4,4 >, double > RegistrationStep<T>::convertP2Md(const vnl_vector < T >& p, bool iscale, int rtype)
 // // rtype : use restriction (if 2) or rigid from robust paper
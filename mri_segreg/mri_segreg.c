@@ -101,6 +101,13 @@
 
   --tol1d tol1d : tolerance on powell 1d minimizations
 
+  --dfp : minimize with quasi-Newton (lbfgs) and the analytic gradient
+  --dfp-tol tol : gradient tolerance for --dfp (default 1e-5)
+  --coarse nsub : first optimize on every nsub-th vertex (default 10 with --dfp)
+  --no-coarse : do not do the coarse pass
+  --legacy-cost : compute the cost with MRIvol2surfVSM()
+  --threads nthreads
+
   --1dmin : use brute force 1D minimizations instead of powell
   --n1dmin n1dmin : number of 1d minimization (default = 3)
 
@@ -178,6 +185,11 @@
 #include "annotation.h"
 #include "transform.h"
 #include "label.h"
+#include "affine.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef X
 #undef X
@@ -185,12 +197,21 @@
 
 int MRISbbrSurfs(char *subject);
 
+MATRIX *SegRegMatrix(MATRIX *R0, double *p, int dof, MATRIX *R);
+int SegRegMatrixGrad(MATRIX *R0, double *p, int dof, MATRIX **dR);
 double *GetSurfCosts(MRI *mov, MRI *notused, MATRIX *R0, MATRIX *R,
 		     double *p, int dof, double *costs);
+void BBRsamplesInvalidate(void);
+double *GetSurfCostsGrad(MRI *mov, MATRIX *R0, MATRIX *R,
+			 double *p, int dof, double *costs, double *grad);
 int MinPowell(MRI *mov, MRI *notused, MATRIX *R, double *params,
 	      int dof, double ftol, double linmintol, int nmaxiters,
 	      char *costfile, double *costs, int *niters);
+int MinDFP(MRI *mov, MATRIX *R, double *params, int dof, double tol,
+	   double *costs, int *niters);
 float compute_powell_cost(float *p) ;
+float compute_dfp_cost(float *p) ;
+void compute_dfp_grad(float *p, float *g) ;
 double RelativeSurfCost(MRI *mov, MATRIX *R0);
 
 char *costfile_powell = NULL;
@@ -211,6 +232,8 @@ static int  singledash(char *flag);
 static int istringnmatch(char *str1, char *str2, int n);
 double VertexCost(double vctx, double vwm, double slope, 
 		  double center, double sign, double *pct);
+double VertexCostGrad(double vctx, double vwm, double slope, 
+		      double center, double sign, double *pct, double *dcdd);
 
 
 int main(int argc, char *argv[]) ;
@@ -345,6 +368,11 @@ char *RelCostFile = NULL;
 char *ParamFile = NULL;
 int InitSurfCostOnly=0;
 
+int DoDFP = 0;           // quasi-Newton with the analytic gradient
+double DFPTol = 1e-5;
+int nsubsampcoarse = -1; // coarse vertex subset pass, -1 = only with --dfp
+int LegacyCost = 0;      // always use MRIvol2surfVSM() for the cost
+
 /*---------------------------------------------------------------*/
 int main(int argc, char **argv) {
   char cmdline[CMD_LINE_LEN] ;
@@ -681,6 +709,7 @@ int main(int argc, char **argv) {
       LabelRipRestOfSurface(mask_label, lhwm) ;
     else if (UseRH && mask_label)
       LabelRipRestOfSurface(mask_label, rhwm) ;
+    BBRsamplesInvalidate(); // ripflags may have changed
     if(PreOptFile) fpPreOpt = fopen(PreOptFile,"w");
     for(tx = PreOptMinTrans; tx <= PreOptMaxTrans; tx += PreOptDeltaTrans){
       for(ty = PreOptMinTrans; ty <= PreOptMaxTrans; ty += PreOptDeltaTrans){
@@ -753,9 +782,27 @@ int main(int argc, char **argv) {
   }
 
   TimerStart(&mytimer) ;
-  printf("Starting Powell Minimization\n");
-  MinPowell(mov, NULL, R, p, dof, TolPowell, LinMinTolPowell,
-	    nMaxItersPowell,SegRegCostFile, costs, &nth);
+  if(nsubsampcoarse < 0) nsubsampcoarse = DoDFP ? 10 : 0;
+  if(nsubsampcoarse > nsubsamp){
+    // Get close on a subset of the vertices, then refine on all of them
+    printf("Coarse pass with nsubsamp = %d\n",nsubsampcoarse);
+    nsubsampsave = nsubsamp;
+    nsubsamp = nsubsampcoarse;
+    if(DoDFP) MinDFP(mov, R, p, dof, DFPTol, costs, &nth);
+    else MinPowell(mov, NULL, R, p, dof, TolPowell, LinMinTolPowell,
+		   nMaxItersPowell,SegRegCostFile, costs, &nth);
+    nsubsamp = nsubsampsave;
+    printf("Coarse pass done, refining with nsubsamp = %d\n",nsubsamp);
+  }
+  if(DoDFP){
+    printf("Starting DFP Minimization\n");
+    MinDFP(mov, R, p, dof, DFPTol, costs, &nth);
+  }
+  else {
+    printf("Starting Powell Minimization\n");
+    MinPowell(mov, NULL, R, p, dof, TolPowell, LinMinTolPowell,
+	      nMaxItersPowell,SegRegCostFile, costs, &nth);
+  }
   secCostTime = TimerStop(&mytimer)/1000.0 ;
 
   // Compute relative final cost 
@@ -1048,6 +1095,30 @@ static int parse_commandline(int argc, char **argv) {
     else if (!strcasecmp(option, "--abs"))       DoAbs = 1;
     else if (!strcasecmp(option, "--no-abs"))    DoAbs = 0;
     else if (!strcasecmp(option, "--no-cortex-label")) UseCortexLabel = 0;
+    else if (!strcasecmp(option, "--dfp"))      DoDFP = 1;
+    else if (!strcasecmp(option, "--powell"))   DoDFP = 0;
+    else if (!strcasecmp(option, "--no-coarse")) nsubsampcoarse = 0;
+    else if (!strcasecmp(option, "--legacy-cost")) LegacyCost = 1;
+    else if (!strcasecmp(option, "--dfp-tol")){
+      if(nargc < 1) argnerr(option,1);
+      sscanf(pargv[0],"%lf",&DFPTol);
+      DoDFP = 1;
+      nargsused = 1;
+    }
+    else if (!strcasecmp(option, "--coarse")){
+      if(nargc < 1) argnerr(option,1);
+      sscanf(pargv[0],"%d",&nsubsampcoarse);
+      nargsused = 1;
+    }
+    else if (!strcasecmp(option, "--threads") || !strcasecmp(option, "--nthreads")){
+      int nthreads;
+      if(nargc < 1) argnerr(option,1);
+      sscanf(pargv[0],"%d",&nthreads);
+      #ifdef _OPENMP
+      omp_set_num_threads(nthreads);
+      #endif
+      nargsused = 1;
+    }
     else if (!strcasecmp(option, "--brute_trans")){
       if (nargc < 3) argnerr(option,3);
       nargsused = 3;
@@ -1638,6 +1709,13 @@ printf("       This is the fraction of the cost that the difference in \n");
 printf("       successive costs must drop below to stop the optimization.  \n");
 printf("  --tol1d tol1d : tolerance on powell 1d minimizations\n");
 printf("\n");
+printf("  --dfp : minimize with quasi-Newton (lbfgs) and the analytic gradient instead of powell\n");
+printf("  --dfp-tol tol : gradient tolerance for --dfp (default %g)\n",DFPTol);
+printf("  --coarse nsub : first optimize on every nsub-th vertex (default 10 with --dfp, else off)\n");
+printf("  --no-coarse : do not do the coarse pass\n");
+printf("  --legacy-cost : compute the cost with MRIvol2surfVSM() instead of the sample cache\n");
+printf("  --threads nthreads\n");
+printf("\n");
 printf("  --1dmin : use brute force 1D minimizations instead of powell\n");
 printf("  --n1dmin n1dmin : number of 1d minimization (default = 3)\n");
 printf("\n");
@@ -1694,6 +1772,11 @@ static void check_options(void)
     exit(1);
   }
 
+  if(DoDFP && (interpcode != SAMPLE_TRILINEAR || vsmfile || LegacyCost)){
+    printf("ERROR: --dfp needs trilinear interpolation, no --vsm and no --legacy-cost\n");
+    exit(1);
+  }
+
   if(sumfile == NULL) {
     sprintf(tmpstr,"%s.sum",outregfile);
     sumfile = strcpyalloc(tmpstr);
@@ -1745,6 +1828,10 @@ static void dump_options(FILE *fp)
   fprintf(fp,"TolPowell %lf\n",TolPowell);
   fprintf(fp,"nMaxItersPowell %d\n",nMaxItersPowell);
   fprintf(fp,"n1dmin  %d\n",n1dmin);
+  fprintf(fp,"DoDFP %d\n",DoDFP);
+  if(DoDFP) fprintf(fp,"DFPTol %lf\n",DFPTol);
+  fprintf(fp,"nsubsampcoarse %d\n",nsubsampcoarse);
+  fprintf(fp,"LegacyCost %d\n",LegacyCost);
   if(interpcode == SAMPLE_SINC) fprintf(fp,"sinc hw  %d\n",sinchw);
   fprintf(fp,"Profile   %d\n",DoProfile);
   fprintf(fp,"Gdiag_no  %d\n",Gdiag_no);
@@ -1825,39 +1912,36 @@ static int istringnmatch(char *str1, char *str2, int n) {
   return(0);
 }
 
-/*---------------------------------------------------------*/
-float compute_powell_cost(float *p) 
+/*---------------------------------------------------------
+  ReportSurfCost() - bookkeeping shared by the powell and dfp
+  cost functions: logs the evaluation to costfile_powell, prints
+  and saves the reg when there is a new optimum, and counts the
+  evaluation. Returns 1 if this is a new optimum.
+  ---------------------------------------------------------*/
+static double CostOpt = -1, CostPrev = -1;
+static int ReportSurfCost(double *pp, MATRIX *R, double *costs)
 {
-  extern MRI *mov;
   extern char *costfile_powell;
   extern int nCostEvaluations;
   extern int dof;
-  static MATRIX *R = NULL;
-  static double copt = -1;
-  static double cprev = -1;
-  double costs[8], pp[12], cdelta;
-  int n, newopt;
+  double cdelta;
+  int newopt;
   FILE *fp;
 
-  if(R==NULL) R = MatrixAlloc(4,4,MATRIX_REAL);
-  for(n=0; n < dof; n++) pp[n] = p[n+1];
-  
-  GetSurfCosts(mov, NULL, R0, R, pp, dof, costs);
-
   // This is for a fast check on convergence
   //costs[7] = 0;
   //for(n=0; n < 6; n++) costs[7] += ((pp[n]-n)*(pp[n]-n)+1);
 
-  if(copt == -1) copt = costs[7];
+  if(CostOpt == -1) CostOpt = costs[7];
   newopt = 0;
-  if(copt > costs[7]){
-    copt = costs[7];
+  if(CostOpt > costs[7]){
+    CostOpt = costs[7];
     newopt = 1;
   }
 
   cdelta = 0;
-  if(cprev < 0) cprev = costs[7];
-  cdelta = 0.5*fabs(costs[7]-cprev)/(costs[7]+cprev);
+  if(CostPrev < 0) CostPrev = costs[7];
+  cdelta = 0.5*fabs(costs[7]-CostPrev)/(costs[7]+CostPrev);
 
   if(costfile_powell != NULL){
     // write costs to file
@@ -1868,12 +1952,12 @@ float compute_powell_cost(float *p)
     fprintf(fp,"%6.3lf %6.3lf %6.3lf ",pp[3],pp[4],pp[5]);
     if(dof > 6) fprintf(fp,"sc: %4.3lf %4.3lf %4.3lf ",pp[6],pp[7],pp[8]);
     if(dof > 9) fprintf(fp,"sh: %6.3lf %6.3lf %6.3lf ",pp[9],pp[10],pp[11]);
-    fprintf(fp,"  %8.5lf %8.5lf %7d\n",costs[7],copt,(int)costs[0]);
+    fprintf(fp,"  %8.5lf %8.5lf %7d\n",costs[7],CostOpt,(int)costs[0]);
     //fprintf(fp,"%7d %10.4lf %8.4lf ",
 	//    (int)costs[0],costs[1],costs[2]); // WM  n mean std
     //fprintf(fp,"%10.4lf %10.4lf %8.4lf ",
 	//    costs[3],costs[4],costs[5]); // CTX n mean std
-    //fprintf(fp,"%8.4lf %12.10lf   %12.10lf ",costs[6],costs[7],copt); // t, cost=1/t
+    //fprintf(fp,"%8.4lf %12.10lf   %12.10lf ",costs[6],costs[7],CostOpt); // t, cost=1/t
     //fprintf(fp,"\n");
     fclose(fp);
   }
@@ -1895,9 +1979,27 @@ float compute_powell_cost(float *p)
   }
 
   nCostEvaluations++;
-  cprev = costs[7];
+  CostPrev = costs[7];
+  return(newopt);
+}
+
+/*---------------------------------------------------------*/
+float compute_powell_cost(float *p) 
+{
+  extern MRI *mov;
+  extern int dof;
+  static MATRIX *R = NULL;
+  double costs[8], pp[12];
+  int n;
+
+  if(R==NULL) R = MatrixAlloc(4,4,MATRIX_REAL);
+  for(n=0; n < dof; n++) pp[n] = p[n+1];
+  
+  GetSurfCosts(mov, NULL, R0, R, pp, dof, costs);
+  ReportSurfCost(pp, R, costs);
   return((float)costs[7]);
 }
+
 /*---------------------------------------------------------------
   MRISbbrSurfs() - creates surfaces used with BBR by projecting
   white in and out. Can also create B0 mask.
@@ -2112,32 +2214,41 @@ double VertexCost(double vctx, double vwm, double slope,
   return(c);
 }
 
-/*-------------------------------------------------------*/
-double *GetSurfCosts(MRI *mov, MRI *notused, MATRIX *R0, MATRIX *R,
-		     double *p, int dof, double *costs)
+/*------------------------------------------------------
+  VertexCostGrad() - same as VertexCost() but also returns the
+  derivative of the cost wrt the percent contrast.
+  --------------------------------------------------------*/
+double VertexCostGrad(double vctx, double vwm, double slope,
+		      double center, double sign, double *pct,
+		      double *dcdd)
 {
-  static MRI *vlhwm=NULL, *vlhctx=NULL, *vrhwm=NULL, *vrhctx=NULL;
-  extern MRI *lhcost, *rhcost;
-  extern MRI *lhcon, *rhcon;
-  extern char *lhcostfile, *rhcostfile;
-  extern char *lhconfile, *rhconfile;
-  extern int UseMask, UseLH, UseRH;
-  extern MRI *lhsegmask, *rhsegmask;
-  extern MRI *lhCortexLabel, *rhCortexLabel;
-  extern MRIS *lhwm, *rhwm, *lhctx, *rhctx;
-  extern int PenaltySign;
-  extern double PenaltySlope;
-  extern int nsubsamp;
-  extern int interpcode;
-  double angles[3],d,dsum,dsum2,dstd,dmean,vwm,vctx,c,csum,csum2,cstd,cmean,val;
-  MATRIX *Mrot=NULL, *Mtrans=NULL, *Mscale=NULL, *Mshear=NULL;
-  int nhits,n;
-  //FILE *fp;
-
-  if(R==NULL){
-    printf("ERROR: GetSurfCosts(): R cannot be NULL\n");
-    return(NULL);
+  double d,a=0,c,dadd=0;
+  d = 100*(vctx-vwm)/((vctx+vwm)/2.0); // percent contrast
+  if(sign ==  0) {
+    a = -fabs(slope*(d-center));
+    dadd = (slope*(d-center) > 0) ? -slope : +slope;
   }
+  if(sign == -1) {a = -(slope*(d-center)); dadd = -slope;}
+  if(sign == +1) {a = +(slope*(d-center)); dadd = +slope;}
+  if(sign == -2){
+    if(d >= 0) {a = -(slope*(d-center)); dadd = -slope;}
+    else       {a = 0; dadd = 0;}
+  }
+  c = 1+tanh(a);
+  *pct = d;
+  *dcdd = (1-tanh(a)*tanh(a))*dadd;
+  return(c);
+}
+
+/*-------------------------------------------------------
+  SegRegMatrix() - computes the registration at parameters p,
+  R = Mshear*Mscale*Mtrans*Mrot*R0. Translations are in mm and
+  angles in degrees. R is allocated if NULL.
+  -------------------------------------------------------*/
+MATRIX *SegRegMatrix(MATRIX *R0, double *p, int dof, MATRIX *R)
+{
+  double angles[3];
+  MATRIX *Mrot=NULL, *Mtrans=NULL, *Mscale=NULL, *Mshear=NULL;
 
   Mtrans = MatrixIdentity(4,NULL);
   if(dof > 0){
@@ -2177,6 +2288,481 @@ double *GetSurfCosts(MRI *mov, MRI *notused, MATRIX *R0, MATRIX *R,
   MatrixFree(&Mscale);
   MatrixFree(&Mshear);
 
+  return(R);
+}
+
+/*-------------------------------------------------------
+  SegRegMatrixGrad() - derivative of SegRegMatrix() wrt each of the
+  dof parameters, dR[n] = dR/dp[n]. The factor of
+  R = Mshear*Mscale*Mtrans*Rz*Ry*Rx*R0 that depends on p[n] is
+  replaced by its derivative. Rotations are per degree. dR[n] is
+  allocated if NULL.
+  -------------------------------------------------------*/
+int SegRegMatrixGrad(MATRIX *R0, double *p0, int dof, MATRIX **dR)
+{
+  MATRIX *F[7], *dF;
+  double p[12], a, d2r = M_PI/180;
+  int n, k, nthf;
+
+  for(n=0; n<12; n++) p[n] = 0;
+  p[6] = p[7] = p[8] = 1;
+  for(n=0; n<dof; n++) p[n] = p0[n];
+
+  for(k=0; k < 6; k++) F[k] = MatrixIdentity(4,NULL);
+  F[6] = R0;
+  F[0]->rptr[1][2] = p[9];
+  F[0]->rptr[1][3] = p[10];
+  F[0]->rptr[2][3] = p[11];
+
+  F[1]->rptr[1][1] = p[6];
+  F[1]->rptr[2][2] = p[7];
+  F[1]->rptr[3][3] = p[8];
+
+  F[2]->rptr[1][4] = p[0];
+  F[2]->rptr[2][4] = p[1];
+  F[2]->rptr[3][4] = p[2];
+
+  // Same as MRIangles2RotMat(), Rz*Ry*Rx
+  F[3]->rptr[1][1] = cos(p[5]*d2r);
+  F[3]->rptr[1][2] = -sin(p[5]*d2r);
+  F[3]->rptr[2][1] = sin(p[5]*d2r);
+  F[3]->rptr[2][2] = cos(p[5]*d2r);
+
+  F[4]->rptr[1][1] = cos(p[4]*d2r);
+  F[4]->rptr[1][3] = sin(p[4]*d2r);
+  F[4]->rptr[3][1] = -sin(p[4]*d2r);
+  F[4]->rptr[3][3] = cos(p[4]*d2r);
+
+  F[5]->rptr[2][2] = cos(p[3]*d2r);
+  F[5]->rptr[2][3] = -sin(p[3]*d2r);
+  F[5]->rptr[3][2] = sin(p[3]*d2r);
+  F[5]->rptr[3][3] = cos(p[3]*d2r);
+
+  dF = MatrixAlloc(4,4,MATRIX_REAL);
+  for(n=0; n < dof; n++){
+    MatrixClear(dF);
+    if(n < 3){
+      // translation
+      nthf = 2;
+      dF->rptr[n+1][4] = 1;
+    }
+    else if(n < 6){
+      // rotation in the (i,j) plane, +sin at (j,i)
+      int i = 2, j = 3;
+      if(n == 4) {i = 3; j = 1;}
+      if(n == 5) {i = 1; j = 2;}
+      nthf = 8-n;
+      a = p[n]*d2r;
+      dF->rptr[i][i] = -sin(a)*d2r;
+      dF->rptr[i][j] = -cos(a)*d2r;
+      dF->rptr[j][i] =  cos(a)*d2r;
+      dF->rptr[j][j] = -sin(a)*d2r;
+    }
+    else if(n < 9){
+      // scale
+      nthf = 1;
+      dF->rptr[n-5][n-5] = 1;
+    }
+    else {
+      // shear
+      nthf = 0;
+      if(n ==  9) dF->rptr[1][2] = 1;
+      if(n == 10) dF->rptr[1][3] = 1;
+      if(n == 11) dF->rptr[2][3] = 1;
+    }
+    dR[n] = MatrixCopy(nthf == 0 ? dF : F[0], dR[n]);
+    for(k=1; k < 7; k++) MatrixMultiplyD(dR[n], k == nthf ? dF : F[k], dR[n]);
+  }
+
+  for(k=0; k < 6; k++) MatrixFree(&F[k]);
+  MatrixFree(&dF);
+  return(0);
+}
+
+/*---------------------------------------------------------------
+  BBR sample cache. The wm and ctx points of every vertex that
+  GetSurfCosts() visits at a given nsubsamp are packed into flat
+  float arrays, padded to a multiple of 4, so that a whole block
+  can be transformed with SIMD and the blocks sampled in parallel.
+  Only the vertex selection is cached; the points are transformed
+  to mov voxels on each evaluation.
+  ---------------------------------------------------------------*/
+#define BBR_BLOCK 256
+typedef struct {
+  int nsubsamp;              // subsampling the cache is for, <0 = invalid
+  int nsamples;
+  float *wmx, *wmy, *wmz;    // wm points (anat tkreg RAS)
+  float *ctxx, *ctxy, *ctxz; // ctx points
+  float *targ;               // target contrast, NULL if not used
+  MRI *mov, *fmov;           // mov and its float version
+  double *tsums;             // per-thread sums, BBR_NSUMS each
+} BBRSAMPLES;
+#define BBR_NSUMS 24
+static BBRSAMPLES bbrs = {-1, 0, NULL,NULL,NULL, NULL,NULL,NULL, NULL,
+			  NULL,NULL, NULL};
+
+void BBRsamplesInvalidate(void)
+{
+  bbrs.nsubsamp = -1;
+}
+
+/*---------------------------------------------------------------
+  BBRkernelOK() - returns 1 if the sample cache can compute the
+  cost for the current options. Per-vertex cost and contrast
+  output, B0 shift maps, label masks and interpolation other than
+  nearest and trilinear go through MRIvol2surfVSM().
+  ---------------------------------------------------------------*/
+static int BBRkernelOK(void)
+{
+  if(LegacyCost || vsm || UseLabel) return(0);
+  if(interpcode != SAMPLE_TRILINEAR && interpcode != SAMPLE_NEAREST) return(0);
+  if(lhcostfile || lhcost0file || lhconfile) return(0);
+  if(rhcostfile || rhcost0file || rhconfile) return(0);
+  return(1);
+}
+
+/*---------------------------------------------------------------
+  BBRsamplesBuild() - fills the cache with the vertices that pass
+  the same tests as in GetSurfCosts() (ripflag, cortex label,
+  B0 mask) for every nsub-th vertex.
+  ---------------------------------------------------------------*/
+static int BBRsamplesBuild(int nsub)
+{
+  MRIS *wm, *ctx;
+  MRI *cortex, *segmask, *targcon;
+  int h, n, k, nmax;
+
+  nmax = 0;
+  if(UseLH) nmax += lhwm->nvertices/nsub + 1;
+  if(UseRH) nmax += rhwm->nvertices/nsub + 1;
+  nmax = 4*((nmax+3)/4);
+
+  free(bbrs.wmx); free(bbrs.wmy); free(bbrs.wmz);
+  free(bbrs.ctxx); free(bbrs.ctxy); free(bbrs.ctxz);
+  free(bbrs.targ);
+  bbrs.wmx  = (float *) calloc(nmax,sizeof(float));
+  bbrs.wmy  = (float *) calloc(nmax,sizeof(float));
+  bbrs.wmz  = (float *) calloc(nmax,sizeof(float));
+  bbrs.ctxx = (float *) calloc(nmax,sizeof(float));
+  bbrs.ctxy = (float *) calloc(nmax,sizeof(float));
+  bbrs.ctxz = (float *) calloc(nmax,sizeof(float));
+  bbrs.targ = NULL;
+  if(TargConLH || TargConRH) bbrs.targ = (float *) calloc(nmax,sizeof(float));
+
+  k = 0;
+  for(h=0; h < 2; h++){
+    if(h == 0 && !UseLH) continue;
+    if(h == 1 && !UseRH) continue;
+    wm      = h == 0 ? lhwm : rhwm;
+    ctx     = h == 0 ? lhctx : rhctx;
+    cortex  = h == 0 ? lhCortexLabel : rhCortexLabel;
+    segmask = h == 0 ? lhsegmask : rhsegmask;
+    targcon = h == 0 ? TargConLH : TargConRH;
+    for(n = 0; n < wm->nvertices; n += nsub){
+      if(wm->vertices[n].ripflag != 0 || ctx->vertices[n].ripflag != 0) continue;
+      if(cortex && MRIgetVoxVal(cortex,n,0,0,0) < 0.5) continue;
+      if(UseMask && MRIgetVoxVal(segmask,n,0,0,0) < 0.5) continue;
+      bbrs.wmx[k]  = wm->vertices[n].x;
+      bbrs.wmy[k]  = wm->vertices[n].y;
+      bbrs.wmz[k]  = wm->vertices[n].z;
+      bbrs.ctxx[k] = ctx->vertices[n].x;
+      bbrs.ctxy[k] = ctx->vertices[n].y;
+      bbrs.ctxz[k] = ctx->vertices[n].z;
+      if(bbrs.targ && targcon) bbrs.targ[k] = MRIgetVoxVal(targcon,n,0,0,0);
+      k++;
+    }
+  }
+  bbrs.nsamples = k;
+  bbrs.nsubsamp = nsub;
+  if(Gdiag_no > 0) printf("BBRsamplesBuild(): nsubsamp %d, %d samples\n",nsub,k);
+  return(0);
+}
+
+/*---------------------------------------------------------------
+  BBRtransform() - transforms n points (n a multiple of 4) by the
+  3x4 row-major matrix a into col, row, slice. Four points at a time
+  with SSE when available. The operations are done in the same order
+  as AffineMV() so the voxel coordinates match MRIvol2surfVSM().
+  ---------------------------------------------------------------*/
+static void BBRtransform(const float *a, const float *x, const float *y,
+			 const float *z, int n, float *c, float *r, float *s)
+{
+  int k;
+#ifdef AFFINE_MATRIX_USE_SSE
+  __m128 A[12], vx, vy, vz;
+  for(k=0; k < 12; k++) A[k] = _mm_set1_ps(a[k]);
+  for(k=0; k < n; k += 4){
+    vx = _mm_loadu_ps(x+k);
+    vy = _mm_loadu_ps(y+k);
+    vz = _mm_loadu_ps(z+k);
+    _mm_storeu_ps(c+k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(A[0],vx),
+      _mm_mul_ps(A[1],vy)), _mm_mul_ps(A[2],vz)), A[3]));
+    _mm_storeu_ps(r+k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(A[4],vx),
+      _mm_mul_ps(A[5],vy)), _mm_mul_ps(A[6],vz)), A[7]));
+    _mm_storeu_ps(s+k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(A[8],vx),
+      _mm_mul_ps(A[9],vy)), _mm_mul_ps(A[10],vz)), A[11]));
+  }
+#else
+  for(k=0; k < n; k++){
+    c[k] = a[0]*x[k] + a[1]*y[k] + a[2]*z[k]  + a[3];
+    r[k] = a[4]*x[k] + a[5]*y[k] + a[6]*z[k]  + a[7];
+    s[k] = a[8]*x[k] + a[9]*y[k] + a[10]*z[k] + a[11];
+  }
+#endif
+}
+
+/*---------------------------------------------------------------
+  BBRsample() - samples the float volume at voxel (fcol,frow,fslc)
+  the way MRIvol2surfVSM() does: 0 is returned if the nearest voxel
+  is outside the volume, otherwise *val gets the nearest or
+  trilinear (as MRIsampleSeqVolume()) value. If g is non-NULL, it
+  gets the gradient of the trilinear value wrt col, row, slice.
+  ---------------------------------------------------------------*/
+static int BBRsample(const MRI *mri, int interp, float fcol, float frow,
+		     float fslc, float *val, double *g)
+{
+  int icol, irow, islc, xm, xp, ym, yp, zm, zp;
+  double x, y, z, xmd, ymd, zmd, xpd, ypd, zpd;
+  double v000, v001, v010, v011, v100, v101, v110, v111;
+
+  icol = nint(fcol);
+  irow = nint(frow);
+  islc = nint(fslc);
+  if (irow < 0 || irow >= mri->height ||
+      icol < 0 || icol >= mri->width  ||
+      islc < 0 || islc >= mri->depth ) return(0);
+
+  if(interp == SAMPLE_NEAREST){
+    *val = MRIFvox(mri,icol,irow,islc);
+    if(g) g[0] = g[1] = g[2] = 0;
+    return(1);
+  }
+
+  x = fcol; y = frow; z = fslc;
+  if (x >= mri->width)  x = mri->width - 1.0 ;
+  if (y >= mri->height) y = mri->height - 1.0 ;
+  if (z >= mri->depth)  z = mri->depth - 1.0 ;
+  if (x < 0.0) x = 0.0 ;
+  if (y < 0.0) y = 0.0 ;
+  if (z < 0.0) z = 0.0 ;
+  xm = (int)x; xp = MIN(mri->width-1,  xm+1);
+  ym = (int)y; yp = MIN(mri->height-1, ym+1);
+  zm = (int)z; zp = MIN(mri->depth-1,  zm+1);
+  xmd = x - (float)xm ;
+  ymd = y - (float)ym ;
+  zmd = z - (float)zm ;
+  xpd = (1.0f - xmd) ;
+  ypd = (1.0f - ymd) ;
+  zpd = (1.0f - zmd) ;
+
+  v000 = MRIFvox(mri,xm,ym,zm); v001 = MRIFvox(mri,xm,ym,zp);
+  v010 = MRIFvox(mri,xm,yp,zm); v011 = MRIFvox(mri,xm,yp,zp);
+  v100 = MRIFvox(mri,xp,ym,zm); v101 = MRIFvox(mri,xp,ym,zp);
+  v110 = MRIFvox(mri,xp,yp,zm); v111 = MRIFvox(mri,xp,yp,zp);
+  *val =
+    xpd * ypd * zpd * v000 + xpd * ypd * zmd * v001 +
+    xpd * ymd * zpd * v010 + xpd * ymd * zmd * v011 +
+    xmd * ypd * zpd * v100 + xmd * ypd * zmd * v101 +
+    xmd * ymd * zpd * v110 + xmd * ymd * zmd * v111 ;
+  if(g){
+    g[0] = ypd*zpd*(v100-v000) + ypd*zmd*(v101-v001) +
+           ymd*zpd*(v110-v010) + ymd*zmd*(v111-v011);
+    g[1] = xpd*zpd*(v010-v000) + xpd*zmd*(v011-v001) +
+           xmd*zpd*(v110-v100) + xmd*zmd*(v111-v101);
+    g[2] = xpd*ypd*(v001-v000) + xpd*ymd*(v011-v010) +
+           xmd*ypd*(v101-v100) + xmd*ymd*(v111-v110);
+  }
+  return(1);
+}
+
+/*---------------------------------------------------------------
+  BBRsurfCosts() - computes the same costs[] as GetSurfCosts() for
+  the registration R from the sample cache. Blocks of samples are
+  transformed and sampled in parallel. If G is non-NULL, it gets
+  the derivative of the cost (costs[7]) wrt the 3x4 surface-RAS
+  to mov-voxel matrix, row major.
+  ---------------------------------------------------------------*/
+static double *BBRsurfCosts(MRI *mov, MATRIX *R, double *costs, double *G)
+{
+  MATRIX *ras2vox, *vox2ras;
+  float a[12];
+  double S[BBR_NSUMS], dsum, dsum2, csum, nhits;
+  int nthreads, nblocks, n, t, r, c;
+
+  if(bbrs.nsubsamp != nsubsamp) BBRsamplesBuild(nsubsamp);
+  if(bbrs.mov != mov){
+    if(bbrs.fmov && bbrs.fmov != bbrs.mov) MRIfree(&bbrs.fmov);
+    if(mov->type == MRI_FLOAT) bbrs.fmov = mov;
+    else bbrs.fmov = MRIchangeType(mov,MRI_FLOAT,0,0,1);
+    bbrs.mov = mov;
+  }
+
+  // Surface RAS to mov voxel, computed as in MRIvol2surfVSM()
+  vox2ras = MRIxfmCRS2XYZtkreg(mov);
+  ras2vox = MatrixInverse(vox2ras,NULL);
+  MatrixMultiply(ras2vox,R,ras2vox);
+  for(r=0; r < 3; r++)
+    for(c=0; c < 4; c++) a[4*r+c] = ras2vox->rptr[r+1][c+1];
+  MatrixFree(&vox2ras);
+  MatrixFree(&ras2vox);
+
+  nthreads = 1;
+  #ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+  #endif
+  bbrs.tsums = (double *) realloc(bbrs.tsums,nthreads*BBR_NSUMS*sizeof(double));
+  memset(bbrs.tsums,0,nthreads*BBR_NSUMS*sizeof(double));
+  nblocks = (bbrs.nsamples + BBR_BLOCK - 1)/BBR_BLOCK;
+
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(nthreads) schedule(dynamic,4)
+  #endif
+  for(n=0; n < nblocks; n++){
+    float wc[BBR_BLOCK], wr[BBR_BLOCK], ws[BBR_BLOCK];
+    float cc[BBR_BLOCK], cr[BBR_BLOCK], cs[BBR_BLOCK];
+    float vwm, vctx;
+    double T[BBR_NSUMS], gwm[3], gctx[3], *pgwm, *pgctx;
+    double c, d, dcdd, dcdwm, dcdctx, *ts;
+    int k, n0, nb, m, threadno = 0;
+
+    #ifdef _OPENMP
+    threadno = omp_get_thread_num();
+    #endif
+    n0 = n*BBR_BLOCK;
+    nb = MIN(BBR_BLOCK, bbrs.nsamples-n0);
+    BBRtransform(a, bbrs.wmx+n0, bbrs.wmy+n0, bbrs.wmz+n0, 4*((nb+3)/4), wc, wr, ws);
+    BBRtransform(a, bbrs.ctxx+n0, bbrs.ctxy+n0, bbrs.ctxz+n0, 4*((nb+3)/4), cc, cr, cs);
+
+    pgwm  = G ? gwm : NULL;
+    pgctx = G ? gctx : NULL;
+    memset(T,0,sizeof(T));
+    for(k=0; k < nb; k++){
+      if(!BBRsample(bbrs.fmov, interpcode, wc[k], wr[k], ws[k], &vwm, pgwm)) continue;
+      if(vwm == 0.0) continue;
+      if(!BBRsample(bbrs.fmov, interpcode, cc[k], cr[k], cs[k], &vctx, pgctx)) continue;
+      if(vctx == 0.0) continue;
+      T[0] += 1;
+      T[1] += vwm;
+      T[2] += ((double)vwm*vwm);
+      T[3] += vctx;
+      T[4] += ((double)vctx*vctx);
+      if(G) c = VertexCostGrad(vctx, vwm, PenaltySlope, PenaltyCenter, PenaltySign, &d, &dcdd);
+      else  c = VertexCost(vctx, vwm, PenaltySlope, PenaltyCenter, PenaltySign, &d);
+      if(bbrs.targ){
+	c = (d-bbrs.targ[n0+k])*(d-bbrs.targ[n0+k]);
+	dcdd = 2*(d-bbrs.targ[n0+k]);
+      }
+      T[5] += d;
+      T[6] += (d*d);
+      T[7] += c;
+      T[8] += (c*c);
+      if(G){
+	// d = 200*(vctx-vwm)/(vctx+vwm), chain through the sampled gradients
+	dcdctx = +dcdd*400*vwm /(((double)vctx+vwm)*((double)vctx+vwm));
+	dcdwm  = -dcdd*400*vctx/(((double)vctx+vwm)*((double)vctx+vwm));
+	for(m=0; m < 3; m++){
+	  T[ 9+4*m] += dcdwm*gwm[m]*bbrs.wmx[n0+k] + dcdctx*gctx[m]*bbrs.ctxx[n0+k];
+	  T[10+4*m] += dcdwm*gwm[m]*bbrs.wmy[n0+k] + dcdctx*gctx[m]*bbrs.ctxy[n0+k];
+	  T[11+4*m] += dcdwm*gwm[m]*bbrs.wmz[n0+k] + dcdctx*gctx[m]*bbrs.ctxz[n0+k];
+	  T[12+4*m] += dcdwm*gwm[m] + dcdctx*gctx[m];
+	}
+      }
+    }
+    ts = &bbrs.tsums[threadno*BBR_NSUMS];
+    for(k=0; k < BBR_NSUMS; k++) ts[k] += T[k];
+  }
+
+  memset(S,0,sizeof(S));
+  for(t=0; t < nthreads; t++)
+    for(n=0; n < BBR_NSUMS; n++) S[n] += bbrs.tsums[t*BBR_NSUMS+n];
+
+  nhits = S[0];
+  dsum = S[5]; dsum2 = S[6];
+  csum = S[7];
+  costs[0] = nhits;
+  costs[2] = sum2stddev(S[1],S[2],nhits); // wm std
+  costs[1] = S[1]/nhits; // wm mean
+  costs[3] = sum2stddev(dsum,dsum2,nhits); // std in percent contrast
+  costs[5] = sum2stddev(S[3],S[4],nhits); // ctx std
+  costs[4] = S[3]/nhits; // ctx mean
+  costs[6] = dsum/nhits; // percent contrast
+  costs[7] = csum/nhits;
+  if(nhits == 0) costs[7] = 10.0; 
+  if(G) for(n=0; n < 12; n++) G[n] = nhits > 0 ? S[9+n]/nhits : 0;
+
+  return(costs);
+}
+
+/*-------------------------------------------------------
+  GetSurfCostsGrad() - same as GetSurfCosts() but also computes
+  grad, the analytic derivative of the cost wrt the dof parameters.
+  Uses the sample cache, so needs BBRkernelOK() options and
+  trilinear interpolation (see check_options()).
+  -------------------------------------------------------*/
+double *GetSurfCostsGrad(MRI *mov, MATRIX *R0, MATRIX *R,
+			 double *p, int dof, double *costs, double *grad)
+{
+  static MATRIX *dR[12] = {NULL}, *invTmov = NULL, *D = NULL;
+  static MRI *Tmovsrc = NULL;
+  double G[12];
+  int n, r, c;
+
+  if(R==NULL){
+    printf("ERROR: GetSurfCostsGrad(): R cannot be NULL\n");
+    return(NULL);
+  }
+  SegRegMatrix(R0, p, dof, R);
+  BBRsurfCosts(mov, R, costs, G);
+
+  // dcost/dp[n] = sum over the 3x4 of inv(Tmov)*dR/dp[n] times G
+  if(Tmovsrc != mov){
+    MATRIX *Tmov = MRIxfmCRS2XYZtkreg(mov);
+    invTmov = MatrixInverse(Tmov,invTmov);
+    MatrixFree(&Tmov);
+    Tmovsrc = mov;
+  }
+  SegRegMatrixGrad(R0, p, dof, dR);
+  for(n=0; n < dof; n++){
+    D = MatrixMultiplyD(invTmov,dR[n],D);
+    grad[n] = 0;
+    for(r=0; r < 3; r++)
+      for(c=0; c < 4; c++) grad[n] += D->rptr[r+1][c+1]*G[4*r+c];
+  }
+
+  return(costs);
+}
+
+/*-------------------------------------------------------*/
+double *GetSurfCosts(MRI *mov, MRI *notused, MATRIX *R0, MATRIX *R,
+		     double *p, int dof, double *costs)
+{
+  static MRI *vlhwm=NULL, *vlhctx=NULL, *vrhwm=NULL, *vrhctx=NULL;
+  extern MRI *lhcost, *rhcost;
+  extern MRI *lhcon, *rhcon;
+  extern char *lhcostfile, *rhcostfile;
+  extern char *lhconfile, *rhconfile;
+  extern int UseMask, UseLH, UseRH;
+  extern MRI *lhsegmask, *rhsegmask;
+  extern MRI *lhCortexLabel, *rhCortexLabel;
+  extern MRIS *lhwm, *rhwm, *lhctx, *rhctx;
+  extern int PenaltySign;
+  extern double PenaltySlope;
+  extern int nsubsamp;
+  extern int interpcode;
+  double d,dsum,dsum2,dstd,dmean,vwm,vctx,c,csum,csum2,cstd,cmean,val;
+  int nhits,n;
+  //FILE *fp;
+
+  if(R==NULL){
+    printf("ERROR: GetSurfCosts(): R cannot be NULL\n");
+    return(NULL);
+  }
+
+  // R = Mshear*Mscale*Mtrans*Mrot*R0
+  SegRegMatrix(R0, p, dof, R);
+
+  if(BBRkernelOK()) return(BBRsurfCosts(mov, R, costs, NULL));
+
   //printf("Trans: %g %g %g\n",p[0],p[1],p[2]);
   //printf("Rot:   %g %g %g\n",p[3],p[4],p[5]);
   //printf("Scale: %g %g %g\n",p[6],p[7],p[8]);
@@ -2346,6 +2932,8 @@ int MinPowell(MRI *mov, MRI *notused, MATRIX *R, double *params,
   }
 
   R0 = MatrixCopy(R,NULL);
+  CostOpt = -1;
+  CostPrev = -1;
 
   OpenPowell2(pPowel, xi, dof, ftol, linmintol, nmaxiters, 
 	      niters, &fret, compute_powell_cost);
@@ -2359,6 +2947,91 @@ int MinPowell(MRI *mov, MRI *notused, MATRIX *R, double *params,
   return(NO_ERROR) ;
 }
 
+/*---------------------------------------------------------
+  The quasi-Newton search works on scaled parameters so that a unit
+  step is comparable for all of them: 1mm, 1deg, 1% scale and shear.
+  ---------------------------------------------------------*/
+static double DFPScale(int n)
+{
+  if(n < 6) return(1.0);
+  return(0.01);
+}
+static MATRIX *DFPR = NULL;
+static float dfpp[13];
+static double dfpgrad[12], dfpmin[12], dfpmincost;
+static int dfpvalid = 0;
+
+/*---------------------------------------------------------*/
+float compute_dfp_cost(float *p) 
+{
+  extern MRI *mov;
+  extern int dof;
+  double costs[8], pp[12];
+  int n;
+
+  if(DFPR==NULL) DFPR = MatrixAlloc(4,4,MATRIX_REAL);
+  for(n=0; n < dof; n++) pp[n] = p[n+1]*DFPScale(n);
+
+  // compute cost and gradient together, the gradient is asked for next
+  GetSurfCostsGrad(mov, R0, DFPR, pp, dof, costs, dfpgrad);
+  for(n=0; n < dof; n++) dfpp[n+1] = p[n+1];
+  dfpvalid = 1;
+
+  ReportSurfCost(pp, DFPR, costs);
+  if(dfpmincost < 0 || costs[7] < dfpmincost){
+    dfpmincost = costs[7];
+    for(n=0; n < dof; n++) dfpmin[n] = pp[n];
+  }
+  return((float)costs[7]);
+}
+
+/*---------------------------------------------------------*/
+void compute_dfp_grad(float *p, float *g) 
+{
+  extern int dof;
+  int n;
+
+  for(n=0; n < dof; n++) if(!dfpvalid || dfpp[n+1] != p[n+1]) break;
+  if(n < dof) compute_dfp_cost(p);
+  for(n=0; n < dof; n++) g[n+1] = dfpgrad[n]*DFPScale(n);
+}
+
+/*---------------------------------------------------------
+  MinDFP() - minimizes the cost with OpenDFPMin() using the
+  analytic gradient from GetSurfCostsGrad(). Same interface as
+  MinPowell(). The parameters are relative to the global R0.
+  ---------------------------------------------------------*/
+int MinDFP(MRI *mov, MATRIX *R, double *params, int dof, double tol,
+	   double *costs, int *niters)
+{
+  float *p, fret;
+  int n;
+
+  printf("Init DFP Params dof = %d\n",dof);
+  p = vector(1, dof) ;
+  for(n=0; n < dof; n++) {
+    p[n+1] = params[n]/DFPScale(n);
+    printf("%d %g\n",n,params[n]);
+  }
+
+  CostOpt = -1;
+  CostPrev = -1;
+  dfpvalid = 0;
+  dfpmincost = -1;
+  *niters = 0;
+  fret = compute_dfp_cost(p);
+  OpenDFPMin(p, dof, tol, niters, &fret,
+	     compute_dfp_cost, compute_dfp_grad, NULL, NULL, NULL);
+  printf("DFP done niters = %d\n",*niters);
+
+  // The line search can stop on a worse point, so keep the best seen
+  for(n=0; n < dof; n++) params[n] = dfpmin[n];
+  GetSurfCosts(mov, NULL, R0, R, params, dof, costs);
+
+  free_vector(p, 1, dof);
+  return(NO_ERROR) ;
+}
+
 /*-------------------------------------------------------*/
 double RelativeSurfCost(MRI *mov, MATRIX *R0)
 {
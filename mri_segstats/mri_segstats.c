@@ -97,7 +97,6 @@ static void dump_options(FILE *fp);
 static int  singledash(char *flag);
 
 
-int MRIsegCount(MRI *seg, int id, int frame);
 STATSUMENTRY *LoadStatSumFile(char *fname, int *nsegid);
 int DumpStatSumTable(STATSUMENTRY *StatSumTable, int nsegid);
 int CountEdits(char *subject, char *outfile);
@@ -2110,30 +2109,6 @@ static int singledash(char *flag)
   return(0);
 }
 
-/* ----------------------------------------------------------
-   MRIsegCount() - returns the number of times the given
-   segmentation id appears in the volume.
-   --------------------------------------------------------- */
-int MRIsegCount(MRI *seg, int id, int frame)
-{
-  int nhits, v, c,r,s;
-  nhits = 0;
-  for (c=0; c < seg->width; c++)
-  {
-    for (r=0; r < seg->height; r++)
-    {
-      for (s=0; s < seg->depth; s++)
-      {
-        v = (int) MRIgetVoxVal(seg,c,r,s,frame);
-        if (v == id)
-        {
-          nhits ++;
-        }
-      }
-    }
-  }
-  return(nhits);
-}
 /*------------------------------------------------------------*/
 STATSUMENTRY *LoadStatSumFile(char *fname, int *nsegid)
 {
@@ -153,6 +153,15 @@ OPTIONS
     target vertex. If a target vertex has multiple source vertices, then the
     source values are averaged together. It does not seem to make much difference.
 
+  --reg-map mapfile
+
+    Read the forward/reverse map between the two registration surfaces from
+    mapfile if it was made from the same surfaces and map method, otherwise
+    build it and save it there (implies --new). Mapping many measures between
+    the same pair then only searches once. A map made from other surfaces
+    is detected and rebuilt. Setting FS_SURFREG_MAP_CACHE to a directory does
+    the same for every --new run, naming the map by a hash of the surfaces.
+
   --fwhm-src fwhmsrc
   --fwhm-trg fwhmtrg (can also use --fwhm)
 
@@ -478,6 +487,7 @@ int ConvGaussian = 0;
 int UseDualHemi = 0; // Assume ?h.?h.surfreg file name, source only
 MRI *RegTarg = NULL;
 int UseOldSurf2Surf = 1;
+char *RegMapFile = NULL;
 char *PatchFile=NULL, *SurfTargName=NULL;
 int nPatchDil=0;
 struct utsname uts;
@@ -1025,7 +1035,16 @@ int main(int argc, char **argv)
       MRIS *SurfRegList[2];
       SurfRegList[0] = SrcSurfReg;
       SurfRegList[1] = TrgSurfReg;
-      TrgVals = MRISapplyReg(SrcVals, SurfRegList, 2, ReverseMapFlag,jac,UseHash);
+      if(RegMapFile){
+	MRIS_CSR *map;
+	map = MRISapplyRegMapCached(SurfRegList,2,ReverseMapFlag,jac,UseHash,RegMapFile);
+	if(map == NULL) exit(1);
+	TrgVals = MRIScsrApplyMRI(map, SrcVals, NULL);
+	MRIScsrFree(&map);
+      }
+      else
+	TrgVals = MRISapplyReg(SrcVals, SurfRegList, 2, ReverseMapFlag,jac,UseHash);
+      if(TrgVals == NULL) exit(1);
     }
 
   } else {
@@ -1262,6 +1281,12 @@ static int parse_commandline(int argc, char **argv)
     }
     else if (!strcasecmp(option, "--old"))UseOldSurf2Surf = 1;
     else if (!strcasecmp(option, "--new")) UseOldSurf2Surf = 0;
+    else if (!strcasecmp(option, "--reg-map")) {
+      if (nargc < 1) CMDargNErr(option,1);
+      RegMapFile = pargv[0];
+      UseOldSurf2Surf = 0;
+      nargsused = 1;
+    }
     else if (!strcasecmp(option, "--usehash")) {
       UseHash = 1;
     } else if (!strcasecmp(option, "--hash")) {
@@ -1773,6 +1798,7 @@ static void print_usage(void)
   printf("   --srcsurfreg source surface registration (sphere.reg)  \n");
   printf("   --trgsurfreg target surface registration (sphere.reg)  \n");
   printf("   --mapmethod  nnfr or nnf\n");
+  printf("   --reg-map    mapfile : reuse (or create) the vertex map in mapfile\n");
   printf("   --frame      save only nth frame (with --trg_type paint)\n");
   printf("   --fwhm-src fwhmsrc: smooth the source to fwhmsrc\n");
   printf("   --fwhm-trg fwhmtrg: smooth the target to fwhmtrg\n");
@@ -1931,6 +1957,15 @@ printf("    'holes'). If nnfr is chosen, then each hole is assigned to the close
 printf("    target vertex. If a target vertex has multiple source vertices, then the\n");
 printf("    source values are averaged together. It does not seem to make much difference.\n");
 printf("\n");
+printf("  --reg-map mapfile\n");
+printf("\n");
+printf("    Read the forward/reverse map between the two registration surfaces from\n");
+printf("    mapfile if it was made from the same surfaces and map method, otherwise\n");
+printf("    build it and save it there (implies --new). Mapping many measures between\n");
+printf("    the same pair then only searches once. A map made from other surfaces\n");
+printf("    is detected and rebuilt. Setting FS_SURFREG_MAP_CACHE to a directory does\n");
+printf("    the same for every --new run, naming the map by a hash of the surfaces.\n");
+printf("\n");
 printf("  --fwhm-src fwhmsrc\n");
 printf("  --fwhm-trg fwhmtrg (can also use --fwhm)\n");
 printf("\n");
@@ -97,6 +97,7 @@ int DoSynthOnes = 0;
 int SynthSeed = -1;
 char *AnnotFile = NULL;
 char *LabelFile = NULL;
+char *MapFile = NULL;
 LABEL *MRISmask2Label(MRIS *surf, MRI *mask, int frame, double thresh);
 
 /*---------------------------------------------------------------*/
@@ -177,7 +178,16 @@ int main(int argc, char *argv[]) {
   }
 
   // Apply registration to source
-  TrgVal = MRISapplyReg(SrcVal, SurfReg, nsurfs, ReverseMapFlag, DoJac, UseHash);
+  if(MapFile){
+    // Reuse (or create) the resampling map for this set of surfaces
+    MRIS_CSR *map;
+    map = MRISapplyRegMapCached(SurfReg, nsurfs, ReverseMapFlag, DoJac, UseHash, MapFile);
+    if(map == NULL) exit(1);
+    TrgVal = MRIScsrApplyMRI(map, SrcVal, NULL);
+    MRIScsrFree(&map);
+  }
+  else
+    TrgVal = MRISapplyReg(SrcVal, SurfReg, nsurfs, ReverseMapFlag, DoJac, UseHash);
   if(TrgVal == NULL) exit(1);
 
   // Save output
@@ -287,6 +297,11 @@ static int parse_commandline(int argc, char **argv) {
       nsurfs++;
       nargsused = 2;
     } 
+    else if (!strcasecmp(option, "--map")) {
+      if (nargc < 1) CMDargNErr(option,1);
+      MapFile = pargv[0];
+      nargsused = 1;
+    } 
     else {
       fprintf(stderr,"ERROR: Option %s unknown\n",option);
       if (CMDsingleDash(option))
@@ -320,6 +335,7 @@ static void print_usage(void) {
   printf("\n");
   printf("   --jac : use jacobian correction\n");
   printf("   --no-rev : do not do reverse mapping\n");
+  printf("   --map mapfile : read the resampling map from mapfile, or create it there\n");
   printf("   --randn : replace input with WGN\n");
   printf("   --ones  : replace input with ones\n");
   printf("\n");
@@ -392,6 +408,7 @@ static void dump_options(FILE *fp) {
   fprintf(fp,"nsurfs  %d\n",nsurfs);
   fprintf(fp,"jac  %d\n",DoJac);
   fprintf(fp,"revmap  %d\n",ReverseMapFlag);
+  if(MapFile) fprintf(fp,"mapfile  %s\n",MapFile);
   return;
 }
 
@@ -865,6 +865,11 @@ get_option(int argc, char *argv[])
     parms.complete_dist_mat = 1 ;
     fprintf(stderr, "using complete distance matrix\n") ;
   }
+  else if (!stricmp(option, "geodesic"))
+  {
+    MRISsetGeodesicSampling(GEODESIC_FAST_MARCH) ;
+    fprintf(stderr, "measuring sampled distances by fast marching\n") ;
+  }
   else if (!stricmp(option, "vnum") || (!stricmp(option, "distances")))
   {
     parms.nbhd_size = atof(argv[2]) ;
@@ -998,6 +1003,10 @@ print_help(void)
           " -distances <nbhd size> <# of vertices at each distance>\n\t"
           "specify size of neighborhood and number of vertices at each\n\t"
           "distance to be used in the optimization.\n") ;
+  fprintf(stderr,
+          " -geodesic\n\t"
+          "measure the sampled distances along the surface by fast marching\n\t"
+          "rather than from the rings of neighbors.\n") ;
   fprintf(stderr,
           " -dilate <# of dilations>\n\t"
           "specify the number of times to dilate the ripped edges to ensure a clean cut\n") ;
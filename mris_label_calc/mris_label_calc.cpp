@@ -67,6 +67,7 @@ void printUsage()
     cout << "      invert        inverse (NOT) of label on surface (input2)" << endl;
     cout << "      erode <n>     erode  label <n> times on surface (input2)" << endl;
     cout << "      dilate <n>    dilate label <n> times on surface (input2)" << endl;
+    cout << "      dilatemm <d>  add vertices within <d> mm of label along surface (input2)" << endl;
     cout << endl;
 }
 
@@ -186,6 +187,26 @@ int main(int argc, char *argv[])
 		  l1->subject_name[0]='\0';
 		  LabelWrite(l1,of.c_str());		  
 		}
+  }
+	else if (comm == "dilatemm")
+	{
+	  if (argc != 6)
+		{
+		   cerr << endl << "  Command 'dilatemm' needs 5 arguments:" << endl << endl;
+			 cerr << "> mris_label_calc dilatemm distance inlabel insurface outlabel" << endl << endl;
+			 exit(1);
+		}
+		float dist  = atof(argv[2]);
+    string if1  = argv[3];
+    string if2  = argv[4];
+	  string of   = argv[5];
+	  LABEL *l1   = LabelRead(NULL,if1.c_str());
+		MRIS *surf  = MRISread(if2.c_str());
+		if (LabelDilateGeodesic(l1,surf,dist) == NO_ERROR)
+		{
+		  l1->subject_name[0]='\0';
+		  LabelWrite(l1,of.c_str());		  
+		}
   }
 	else
 	{
@@ -0,0 +1,367 @@
+/**
+ * @file  mris_make_vpack.c
+ * @brief pack a subject's per-vertex overlays into one columnar file
+ *
+ * Collects every curvature-format file (lh.thickness, lh.sulc, ...) and
+ * single-frame surface overlay volume in surf/ and every annotation in
+ * label/ for one hemisphere of a subject and writes them as named
+ * columns of a .vpack file (see utils/mrisvpack.c). The usual readers
+ * find a measure in the pack when its file is not there, so the
+ * originals may be removed once the pack is made.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mri.h"
+#include "mrisurf.h"
+#include "mri_identify.h"
+#include "macros.h"
+#include "error.h"
+#include "diag.h"
+#include "proto.h"
+#include "utils.h"
+#include "fio.h"
+#include "timer.h"
+#include "version.h"
+
+int main(int argc, char *argv[]) ;
+static int get_option(int argc, char *argv[]) ;
+static void usage_exit(int code) ;
+static int is_curvature_file(const char *fname, int nvertices) ;
+static int is_overlay_volume(const char *fname, int nvertices) ;
+static int add_surf_dir(MRIS_VPACK *vp, const char *dir, const char *hemi,
+                        const char *out_fname) ;
+static int add_label_dir(MRIS_VPACK *vp, const char *dir, const char *hemi) ;
+
+char *Progname ;
+
+static char sdir[STRLEN] = "" ;
+static char surf_name[STRLEN] = "white" ;
+static char out_fname[STRLEN] = "" ;
+static int  verbose = 0 ;
+
+int
+main(int argc, char *argv[])
+{
+  char         *subject, *hemi, fname[STRLEN], *cp ;
+  int          nargs, msec, nsurf, nlabel ;
+  MRI_SURFACE  *mris ;
+  MRIS_VPACK   *vp ;
+  struct timeb start ;
+
+  /* rkt: check for and handle version tag */
+  nargs = handle_version_option (argc, argv, "$Id$", "$Name:  $");
+  if (nargs && argc - nargs == 1)
+    exit (0);
+  argc -= nargs;
+
+  Progname = argv[0] ;
+  ErrorInit(NULL, NULL, NULL) ;
+  DiagInit(NULL, NULL, NULL) ;
+  TimerStart(&start) ;
+
+  for ( ; argc > 1 && ISOPTION(*argv[1]) ; argc--, argv++)
+  {
+    nargs = get_option(argc, argv) ;
+    argc -= nargs ;
+    argv += nargs ;
+  }
+
+  if (argc < 3)
+    usage_exit(1) ;
+
+  if (!strlen(sdir))
+  {
+    cp = getenv("SUBJECTS_DIR") ;
+    if (!cp)
+      ErrorExit(ERROR_BADPARM,
+                "%s: SUBJECTS_DIR not defined in environment.\n", Progname) ;
+    strcpy(sdir, cp) ;
+  }
+  subject = argv[1] ;
+  hemi = argv[2] ;
+  if (strcmp(hemi, "lh") && strcmp(hemi, "rh"))
+    ErrorExit(ERROR_BADPARM, "%s: hemi must be lh or rh, not %s\n",
+              Progname, hemi) ;
+  if (!strlen(out_fname))
+    sprintf(out_fname, "%s/%s/surf/%s%s", sdir, subject, hemi,
+            MRIS_VPACK_EXTENSION) ;
+
+  sprintf(fname, "%s/%s/surf/%s.%s", sdir, subject, hemi, surf_name) ;
+  mris = MRISread(fname) ;
+  if (mris == NULL)
+    ErrorExit(ERROR_NOFILE, "%s: could not read surface %s\n",
+              Progname, fname) ;
+  vp = MRISvpackAlloc(mris->nvertices) ;
+
+  sprintf(fname, "%s/%s/surf", sdir, subject) ;
+  nsurf = add_surf_dir(vp, fname, hemi, out_fname) ;
+  sprintf(fname, "%s/%s/label", sdir, subject) ;
+  nlabel = add_label_dir(vp, fname, hemi) ;
+  if (vp->ncolumns == 0)
+    ErrorExit(ERROR_BADPARM, "%s: no %d vertex overlays found for %s %s\n",
+              Progname, mris->nvertices, subject, hemi) ;
+
+  printf("writing %d overlays and %d annotations to %s\n",
+         nsurf, nlabel, out_fname) ;
+  if (MRISvpackWrite(vp, out_fname) != NO_ERROR)
+    ErrorExit(Gerror, "%s: could not write %s", Progname, out_fname) ;
+  MRISvpackFree(&vp) ;
+  MRISfree(&mris) ;
+
+  msec = TimerStop(&start) ;
+  printf("%s took %2.2f sec\n", Progname, (float)msec/1000.0f) ;
+  exit(0) ;
+  return(0) ;
+}
+
+/*----------------------------------------------------------------------
+  is_curvature_file() - does fname hold exactly one value per vertex
+  in either curvature format
+----------------------------------------------------------------------*/
+static int
+is_curvature_file(const char *fname, int nvertices)
+{
+  FILE        *fp ;
+  struct stat st ;
+  int         magic, vnum, vals_per_vertex ;
+
+  if (stat(fname, &st) != 0 || !S_ISREG(st.st_mode))
+    return(0) ;
+  fp = fopen(fname, "r") ;
+  if (!fp)
+    return(0) ;
+  fread3(&magic, fp) ;
+  if (magic == NEW_VERSION_MAGIC_NUMBER)
+  {
+    vnum = freadInt(fp) ;
+    freadInt(fp) ;   // # of faces
+    vals_per_vertex = freadInt(fp) ;
+    fclose(fp) ;
+    return(vnum == nvertices && vals_per_vertex == 1 &&
+           st.st_size == 15 + 4*(off_t)nvertices) ;
+  }
+  fclose(fp) ;
+  return(magic == nvertices && st.st_size == 6 + 2*(off_t)nvertices) ;
+}
+
+/*----------------------------------------------------------------------
+  is_overlay_volume() - is fname an mgh/mgz with one frame of
+  nvertices voxels
+----------------------------------------------------------------------*/
+static int
+is_overlay_volume(const char *fname, int nvertices)
+{
+  MRI *mri ;
+  int ok ;
+
+  if (mri_identify(fname) != MRI_MGH_FILE)
+    return(0) ;
+  mri = MRIreadHeader(fname, MRI_MGH_FILE) ;
+  if (!mri)
+    return(0) ;
+  ok = mri->nframes == 1 &&
+       mri->width * mri->height * mri->depth == nvertices ;
+  MRIfree(&mri) ;
+  return(ok) ;
+}
+
+/*----------------------------------------------------------------------
+  add_surf_dir() - pack every <hemi>.* curvature or overlay in dir,
+  named without the hemisphere
+----------------------------------------------------------------------*/
+static int
+add_surf_dir(MRIS_VPACK *vp, const char *dir, const char *hemi,
+             const char *out_fname)
+{
+  DIR           *dp ;
+  struct dirent *de ;
+  char          fname[STRLEN] ;
+  float         *vals ;
+  int           n = 0 ;
+
+  if ((dp = opendir(dir)) == NULL)
+    ErrorReturn(0, (ERROR_NOFILE, "%s: could not open %s", Progname, dir)) ;
+  while ((de = readdir(dp)) != NULL)
+  {
+    if (strncmp(de->d_name, hemi, 2) || de->d_name[2] != '.' ||
+        strstr(de->d_name, MRIS_VPACK_EXTENSION) ||
+        strlen(de->d_name+3) >= MRIS_VPACK_NAME_LEN)
+      continue ;
+    sprintf(fname, "%s/%s", dir, de->d_name) ;
+    if (!strcmp(fname, out_fname))
+      continue ;
+    if (is_curvature_file(fname, vp->nvertices))
+    {
+      if (MRISreadCurvatureIntoArray(fname, vp->nvertices, &vals) != NO_ERROR)
+        continue ;
+    }
+    else if (is_overlay_volume(fname, vp->nvertices))
+    {
+      if (MRISreadValuesIntoArray(fname, vp->nvertices, &vals) != NO_ERROR)
+        continue ;
+    }
+    else
+    {
+      if (verbose)
+        printf("  skipping %s\n", fname) ;
+      continue ;
+    }
+    if (MRISvpackAddColumn(vp, de->d_name+3, MRIS_VPACK_FLOAT, vals,
+                           vp->nvertices*sizeof(float)) == NO_ERROR)
+    {
+      if (verbose)
+        printf("  %s\n", fname) ;
+      n++ ;
+    }
+    free(vals) ;
+  }
+  closedir(dp) ;
+  return(n) ;
+}
+
+/*----------------------------------------------------------------------
+  add_label_dir() - pack every <hemi>.*.annot in dir as an int column
+  plus its colortable tags as <name>.ctab
+----------------------------------------------------------------------*/
+static int
+add_label_dir(MRIS_VPACK *vp, const char *dir, const char *hemi)
+{
+  DIR           *dp ;
+  struct dirent *de ;
+  char          fname[STRLEN], name[STRLEN], *tags ;
+  int           *annots, num, n = 0, len ;
+  long          nbytes ;
+  FILE          *fp ;
+
+  if ((dp = opendir(dir)) == NULL)
+    return(0) ;   // no labels yet
+  while ((de = readdir(dp)) != NULL)
+  {
+    len = strlen(de->d_name) ;
+    if (strncmp(de->d_name, hemi, 2) || de->d_name[2] != '.' || len < 9 ||
+        strcmp(de->d_name+len-6, ".annot") ||
+        len-3+5 >= MRIS_VPACK_NAME_LEN)
+      continue ;
+    sprintf(fname, "%s/%s", dir, de->d_name) ;
+    if (MRISreadAnnotationIntoArray(fname, vp->nvertices, &annots) !=
+        NO_ERROR)
+      continue ;
+    if (MRISvpackAddColumn(vp, de->d_name+3, MRIS_VPACK_INT, annots,
+                           vp->nvertices*sizeof(int)) != NO_ERROR)
+    {
+      free(annots) ;
+      continue ;
+    }
+    free(annots) ;
+    n++ ;
+
+    // everything after the (vno, annot) pairs is the tag section
+    fp = fopen(fname, "r") ;
+    if (!fp)
+      continue ;
+    num = freadInt(fp) ;
+    fseek(fp, 0, SEEK_END) ;
+    nbytes = ftell(fp) - 4 - 8*(long)num ;
+    if (nbytes > 0 && fseek(fp, 4 + 8*(long)num, SEEK_SET) == 0)
+    {
+      tags = (char *)malloc(nbytes) ;
+      if (tags && fread(tags, 1, nbytes, fp) == (size_t)nbytes)
+      {
+        sprintf(name, "%s.ctab", de->d_name+3) ;
+        MRISvpackAddColumn(vp, name, MRIS_VPACK_BYTES, tags, nbytes) ;
+      }
+      free(tags) ;
+    }
+    fclose(fp) ;
+    if (verbose)
+      printf("  %s\n", fname) ;
+  }
+  closedir(dp) ;
+  return(n) ;
+}
+
+/*----------------------------------------------------------------------
+            Parameters:
+
+           Description:
+----------------------------------------------------------------------*/
+static int
+get_option(int argc, char *argv[])
+{
+  int  nargs = 0 ;
+  char *option ;
+
+  option = argv[1] + 1 ;            /* past '-' */
+  if (!stricmp(option, "SDIR"))
+  {
+    strcpy(sdir, argv[2]) ;
+    printf("using %s as SUBJECTS_DIR...\n", sdir) ;
+    nargs = 1 ;
+  }
+  else if (!stricmp(option, "surf"))
+  {
+    strcpy(surf_name, argv[2]) ;
+    printf("reading vertex count from %s surface\n", surf_name) ;
+    nargs = 1 ;
+  }
+  else switch (toupper(*option))
+  {
+  case 'O':
+    strcpy(out_fname, argv[2]) ;
+    nargs = 1 ;
+    break ;
+  case 'V':
+    verbose = 1 ;
+    break ;
+  case '?':
+  case 'U':
+    usage_exit(0) ;
+    break ;
+  default:
+    fprintf(stderr, "unknown option %s\n", argv[1]) ;
+    exit(1) ;
+    break ;
+  }
+
+  return(nargs) ;
+}
+/*----------------------------------------------------------------------
+            Parameters:
+
+           Description:
+----------------------------------------------------------------------*/
+static void
+usage_exit(int code)
+{
+  printf("usage: %s [options] <subject> <hemi>\n", Progname);
+  printf("\n"
+         "packs every per-vertex overlay of one hemisphere (curvature\n"
+         "format files and single-frame mgh/mgz in surf/, annotations in\n"
+         "label/) into $SUBJECTS_DIR/<subject>/surf/<hemi>.vpack\n") ;
+  printf("\tvalid options are:\n") ;
+  printf("\t-sdir <dir>   use <dir> as SUBJECTS_DIR\n") ;
+  printf("\t-surf <name>  surface giving the vertex count (default white)\n") ;
+  printf("\t-o <fname>    write the pack to <fname>\n") ;
+  printf("\t-v            list the files packed and skipped\n") ;
+  exit(code) ;
+}
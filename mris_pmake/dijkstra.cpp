@@ -129,29 +129,32 @@ mark(MRIS *surf, int vno, int m, bool b_overwrite) {
   return(NO_ERROR);
 } /* end mark() */
 
+// Edge costs for the geodesic engine come from the environment's
+// cost function (or overlay), exactly as the old list based search did.
+static float
+dijkstra_edgeCost(void *pv_env, int vno_c, int vno_n) {
+  return s_env_edgeCostFind(*(s_env*)pv_env, vno_c, vno_n);
+}
+
 int dijkstra(
     s_env&          st_env,
     float           af_maxAllowedCost,
     bool            ab_surfaceCostVoid)
 {
-    int             i, j;
-    int             vno_c   = -1;
-    int             vno_n   = -1;
-    int             vno_i, vno_f;
-    VERTEX          *v_c, *v_n;
-    float           cost, f_pathCost;
-    struct d_node   *dn, *dn_next;
+    int             i;
+    int             vno, vno_i, vno_f;
+    VERTEX          *v;
+    float           f_pathCost;
     int             rv;
-//    s_iterInfo      st_iterInfo;
     MRIS*           surf                = st_env.pMS_active;
-//    bool            b_relNextReference  = true;
 
-  // If we aren't going to preserve cost history in the environment, then we
-  // will by default always be able to write path costs
-  bool              b_canWriteCostVal   = !st_env.b_costHistoryPreserve;
+  // The search itself is MRISgeodesicRun() (utils/mrisgeodesic.c): a
+  // binary heap instead of a sorted list, so each step is O(log n)
+  // rather than a walk over every vertex in play. The workspace only
+  // touches the vertices a search reaches and is kept in the environment
+  // across calls, since ROI and ply runs call this once per labelled
+  // vertex.
   static int        calls               = 0;
-  int               marked              = 0;
-  int               totalLoops          = -1;
 
   /* --- sanity checks --- */
   vno_i  = st_env.startVertex;
@@ -167,11 +170,21 @@ int dijkstra(
     assert(!surf->vertices[vno_f].ripflag);
   }
 
+  if (!st_env.pgeo || st_env.pgeo->nvertices != surf->nvertices) {
+    MRISgeodesicFree(&st_env.pgeo);
+    st_env.pgeo = MRISgeodesicAlloc(surf, GEODESIC_DIJKSTRA);
+    if (!st_env.pgeo)
+      return(FALSE);
+  }
+  MRIS_GEODESIC*    pgeo                = st_env.pgeo;
+  pgeo->cost      = dijkstra_edgeCost;
+  pgeo->cost_parm = &st_env;
+
   /* --- initialize --- */
   for (i = 0; i < surf->nvertices; i++) {
     bool b_overwrite = true;
     if (mark(surf, i, DIJK_VIRGIN, b_overwrite) != NO_ERROR)
-      goto error;
+      return(FALSE);
     // Set all vertex values to -1 - only the very first time
     // that this function is called, or if explicitly
     // specified in the calling parameters.
@@ -181,93 +194,36 @@ int dijkstra(
 
   surf->vertices[vno_i].val = 0.0;
   surf->vertices[vno_i].old_undefval = vno_f;
-  if (mark(surf, vno_i, DIJK_IN_PLAY) != NO_ERROR)
-    goto error;
-
-  // If the start and end vertices are coincident in the problem environment,
-  // we should loop through at least once, and ignore the vno_c!=vno_f
-  // condition, otherwise the while() will terminate after one loop.
-  while ( vno_c!=vno_f || !totalLoops) {
-    totalLoops++;
-    if(totalLoops >= st_env.pMS_primary->nvertices-1) {
-      // If this condition is true, we have processed all available vertices
-      // in the mesh -- typically only occurs if the startVertex == endVertex
-      // and is used for 'autodijk' type calculations.
-      rv = TRUE;
-      goto clean;
-    }
-    
-    /* set vno_c (find min) */
-    if (d_list == NULL) {
-//      ErrorPrintf(ERROR_BADPARM, "dijkstra(): out of vertices");
-//      colprintf(st_env.lw, st_env.rw, "start:stop", "[ %d:%d ]\n",
-//                st_env.startVertex,
-//                st_env.endVertex);
-      goto error;
-    }
 
-    vno_c  = d_list->vno;
-    v_c  = &surf->vertices[vno_c];
-
-    /* mark it */
-    if (mark(surf, vno_c, DIJK_DONE) != NO_ERROR)
-      goto error;
-
-    /* update neighbors */
-    //cout << "neighbors = " << (int) v_c->num << endl;
-    for (j = 0; j < (int) v_c->vnum; j++) {
-      //cout << "neighbor = " << j << endl;
-      vno_n = v_c->v[j];
-      v_n  = &surf->vertices[vno_n];
-
-      //if(v_n->ripflag) continue;
-
-      if (v_n->marked == DIJK_DONE) continue; // for "circular" path searches
-
-//      cost = st_env.costFunc_do(st_env, &st_iterInfo, vno_c, j, 
-//          			b_relNextReference);
-      cost = s_env_edgeCostFind(st_env, vno_c, vno_n);
-      f_pathCost = v_c->val + cost;
-
-      // Break out of while if af_maxAllowedCost is violated.
-      if (af_maxAllowedCost && (f_pathCost > af_maxAllowedCost)) continue;
-
-      if ( (v_n->marked == DIJK_VIRGIN) || (f_pathCost < v_n->val) ) {
-        // The check in the <if> statement preserves pathCost values in the MRIS
-        // from previous calls to this function. This history is important
-        // in determing ply distances from a given target path. A pathCost
-        // is only written to a new vertex iff that vertex has never been
-        // visited, or if the cost is less than an older value.
-        if (st_env.b_costHistoryPreserve) {
-          b_canWriteCostVal = (f_pathCost<v_n->val||v_n->val==-1);
-        }
-        if (b_canWriteCostVal) {
-          marked++;
-          v_n->val   = f_pathCost;
-          v_n->old_undefval  = vno_c;
-          //cout << vno_c << "<---" << vno_n << endl;
-        }
-      }
-//     cout << "v->marked in dijkstra " << v_n->marked << endl;
-      if (v_n->marked == DIJK_VIRGIN)
-        if (mark(surf, vno_n, DIJK_IN_PLAY) != NO_ERROR) goto error;
+  // If the start and end vertices are coincident in the problem environment
+  // ('autodijk' type calculations) there is no target and the search covers
+  // every vertex within af_maxAllowedCost.
+  MRISgeodesicRun(pgeo, surf, &vno_i, 1, af_maxAllowedCost,
+                  &vno_f, vno_i != vno_f);
+
+  // Write the path costs back to the surface. A pathCost is only written
+  // to a vertex if the history is not being preserved, or if it is less
+  // than an older value. This history is important in determing ply
+  // distances from a given target path.
+  for (i = 0; i < pgeo->ntouched; i++) {
+    vno = pgeo->touched[i];
+    v   = &surf->vertices[vno];
+    v->marked = DIJK_IN_PLAY;
+    if (vno == vno_i) continue;
+    f_pathCost = pgeo->dist[vno];
+    if (!st_env.b_costHistoryPreserve || f_pathCost < v->val || v->val == -1) {
+      v->val          = f_pathCost;
+      v->old_undefval = pgeo->pred[vno];
     }
   }
-
-  rv = TRUE;
-  goto clean;
-
-error:
-  rv = FALSE;
-
-clean:
-  for (dn = d_list;dn != NULL;dn = dn_next) {
-    dn_next = dn->next;
-    free(dn);
-  }
-  d_list = NULL;
-
-  return(rv);
+  for (i = 0; i < pgeo->nsettled; i++)
+    surf->vertices[pgeo->settled[i]].marked = DIJK_DONE;
+
+  if (vno_i != vno_f)
+    rv = (surf->vertices[vno_f].marked == DIJK_DONE);
+  else
+    rv = (pgeo->nsettled >= st_env.pMS_primary->nvertices-1);
+  return(rv ? TRUE : FALSE);
 
 } /* end dijkstra() */
 
@@ -427,6 +427,7 @@ s_env_nullify(
     st_env.pMS_secondary            = NULL;
     st_env.pMS_primary              = NULL;
     st_env.pMS_auxillary            = NULL;
+    st_env.pgeo                     = NULL;
 
     st_env.b_useAbsCurvs            = false;
     st_env.b_surfacesKeepInSync     = false;
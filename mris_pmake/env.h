@@ -348,6 +348,10 @@ typedef struct _env {
                                             //+ ply distances from
                                             //+ existing path
 
+    MRIS_GEODESIC* pgeo;                    // dijkstra search workspace,
+                                            //+ kept across calls and
+                                            //+ freed on exit
+
     //
     // LEGACY CODE
     s_weights*    pSTw;                     // weight structure
@@ -163,6 +163,7 @@ main(
   }
 
   delete pCSSocketReceive;
+  MRISgeodesicFree(&st_env.pgeo);
   if (st_env.pcsm_syslog) {
     st_env.pcsm_syslog->timer(eSM_stop);
     SLOUT("Ready\n");
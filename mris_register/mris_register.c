@@ -1126,6 +1126,12 @@ get_option(int argc, char *argv[])
     parms.overlay_dir = strcpyalloc(argv[2]) ;
     nargs = 1 ;
   }
+  else if (!stricmp(option, "atlas_cache"))
+  {
+    MRISPsetCacheDir(argv[2]) ;
+    nargs = 1 ;
+    fprintf(stderr, "caching blurred atlas frames in %s\n", argv[2]) ;
+  }
   else switch (toupper(*option))
     {
     case 'M':
@@ -692,6 +692,11 @@ get_option(int argc, char *argv[])
     nargs = 1 ;
     fprintf(stderr, "nldist = %2.3f\n", parms.l_nldist) ;
   }
+  else if (!stricmp(option, "geodesic"))
+  {
+    MRISsetGeodesicSampling(GEODESIC_FAST_MARCH) ;
+    fprintf(stderr, "measuring sampled distances by fast marching\n") ;
+  }
   else if (!stricmp(option, "vnum") || !stricmp(option, "distances"))
   {
     parms.nbhd_size = atof(argv[2]) ;
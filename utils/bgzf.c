@@ -0,0 +1,681 @@
+/**
+ * @file  bgzf.c
+ * @brief multithreaded block-gzip (BGZF) file i/o
+ *
+ * See bgzf.h. Data is buffered in batches of members; a full batch is
+ * deflated (writing) or inflated (reading) with one member per OpenMP
+ * iteration, and the members are written/read sequentially.
+ *
+ * This is a backend of znzlib and, like it, only depends on zlib
+ * (gifti_tool links it without the rest of libutils).
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include "zlib.h"
+#endif
+
+#include "bgzf.h"
+
+#define BGZF_HEADER_SIZE   18
+#define BGZF_FOOTER_SIZE   8
+#define BGZF_BATCH_PER_THREAD 4
+
+#define BGZF_LEVEL_UNSET   -2
+
+// only written by BGZFsetThreads()/BGZFsetLevel(); while unset the
+// environment is consulted on every call (no lazy caching, so concurrent
+// first calls from several threads do not race)
+static int bgzf_nthreads = -1 ;
+static int bgzf_level = BGZF_LEVEL_UNSET ;
+static int bgzf_write = -1 ;
+
+// gzip member header with the 6 byte "BC" extra field; the last two
+// bytes get the member size - 1
+static const unsigned char bgzf_header[BGZF_HEADER_SIZE] =
+{
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0
+} ;
+
+// empty member marking a complete file
+static const unsigned char bgzf_eof[28] =
+{
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+  3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+} ;
+
+struct BGZF_FILE
+{
+  FILE          *fp ;
+  int           writing ;
+  int           level ;
+  int           nthreads ;
+  int           nbatch ;     // members per batch
+  unsigned char *ubuf ;      // uncompressed data of the batch
+  size_t        ulen ;       // valid bytes in ubuf (reading)
+  size_t        upos ;       // position in ubuf
+  long          ubase ;      // uncompressed offset of ubuf[0]
+  unsigned char *cbuf ;      // members of the batch, BGZF_MAX_BLOCK_SIZE apart
+  size_t        *clen ;      // size of each member
+  size_t        *hlen ;      // header size of each member
+  size_t        *uoff ;      // offset of each member's data in ubuf
+  int           eof ;
+  int           error ;
+} ;
+
+static unsigned
+bgzfGet16(const unsigned char *p)
+{
+  return(p[0] | (p[1] << 8)) ;
+}
+
+static unsigned long
+bgzfGet32(const unsigned char *p)
+{
+  return((unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+         ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24)) ;
+}
+
+static void
+bgzfPut32(unsigned char *p, unsigned long v)
+{
+  p[0] = v & 0xff ;
+  p[1] = (v >> 8) & 0xff ;
+  p[2] = (v >> 16) & 0xff ;
+  p[3] = (v >> 24) & 0xff ;
+}
+
+int
+BGZFsetThreads(int nthreads)
+{
+  bgzf_nthreads = nthreads < 1 ? 1 : nthreads ;
+  return(0) ;
+}
+
+int
+BGZFgetThreads(void)
+{
+  const char *cp ;
+  int        nthreads = 1 ;
+
+  if (bgzf_nthreads > 0)
+    return(bgzf_nthreads) ;
+  cp = getenv("FS_GZIP_THREADS") ;
+  if (cp)
+    nthreads = atoi(cp) ;
+  else
+  {
+#ifdef HAVE_OPENMP
+    nthreads = omp_get_max_threads() ;
+#endif
+  }
+  return(nthreads < 1 ? 1 : nthreads) ;
+}
+
+/*-----------------------------------------------------
+  BGZFsetWrite() - write new compressed files as BGZF
+  (on != 0) or with plain gzopen() (on == 0). The
+  default is plain gzip unless FS_GZIP_BGZF is set.
+  ------------------------------------------------------*/
+int
+BGZFsetWrite(int on)
+{
+  bgzf_write = on ? 1 : 0 ;
+  return(0) ;
+}
+
+int
+BGZFgetWrite(void)
+{
+  if (bgzf_write >= 0)
+    return(bgzf_write) ;
+  return(getenv("FS_GZIP_BGZF") != NULL) ;
+}
+
+int
+BGZFsetLevel(int level)
+{
+  if (level < -1 || level > 9)
+  {
+    fprintf(stderr, "** ERROR: BGZFsetLevel: level %d out of range\n", level) ;
+    return(-1) ;
+  }
+  bgzf_level = level ;
+  return(0) ;
+}
+
+int
+BGZFgetLevel(void)
+{
+  const char *cp ;
+  int        level ;
+
+  if (bgzf_level != BGZF_LEVEL_UNSET)
+    return(bgzf_level) ;
+  cp = getenv("FS_GZIP_LEVEL") ;
+  if (cp == NULL)
+    return(-1) ;   // zlib's default
+  level = atoi(cp) ;
+  if (level < -1 || level > 9)
+  {
+    fprintf(stderr, "** ERROR: BGZFgetLevel: FS_GZIP_LEVEL %d out of range\n",
+            level) ;
+    return(-1) ;
+  }
+  return(level) ;
+}
+
+/*-----------------------------------------------------
+  BGZFisBlocked() - returns 1 if the file starts with a
+  BGZF member (a gzip header with a "BC" extra field).
+  ------------------------------------------------------*/
+int
+BGZFisBlocked(const char *path)
+{
+  FILE          *fp ;
+  unsigned char hdr[BGZF_HEADER_SIZE] ;
+  int           n ;
+
+  fp = fopen(path, "rb") ;
+  if (fp == NULL)
+    return(0) ;
+  n = fread(hdr, 1, BGZF_HEADER_SIZE, fp) ;
+  fclose(fp) ;
+  return(n == BGZF_HEADER_SIZE && hdr[0] == 31 && hdr[1] == 139 &&
+         hdr[2] == 8 && (hdr[3] & 4) && bgzfGet16(hdr+10) == 6 &&
+         hdr[12] == 'B' && hdr[13] == 'C' && bgzfGet16(hdr+14) == 2) ;
+}
+
+/*-----------------------------------------------------
+  BGZFuseFor() - returns 1 if a compressed file opened
+  with this mode should go through BGZF when threads are
+  available: existing BGZF files, and new files only if
+  BGZF writing was asked for (BGZFgetWrite()).
+  ------------------------------------------------------*/
+int
+BGZFuseFor(const char *path, const char *mode)
+{
+#ifdef HAVE_ZLIB
+  if (BGZFgetThreads() <= 1 || strchr(mode, '+') || strchr(mode, 'a'))
+    return(0) ;
+  if (strchr(mode, 'w'))
+    return(BGZFgetWrite()) ;
+  if (strchr(mode, 'r'))
+    return(BGZFisBlocked(path)) ;
+#endif
+  return(0) ;
+}
+
+#ifdef HAVE_ZLIB
+
+/*-----------------------------------------------------
+  bgzfDeflateBlock() - compress len (<= BGZF_BLOCK_SIZE)
+  bytes of src into a complete member at dst. Returns
+  the member size or 0 on failure.
+  ------------------------------------------------------*/
+static size_t
+bgzfDeflateBlock(unsigned char *src, size_t len, unsigned char *dst,
+                 int level)
+{
+  z_stream strm ;
+  size_t   size ;
+  int      ret ;
+
+  memset(&strm, 0, sizeof(strm)) ;
+  if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return(0) ;
+  strm.next_in = src ;
+  strm.avail_in = len ;
+  strm.next_out = dst + BGZF_HEADER_SIZE ;
+  strm.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE ;
+  ret = deflate(&strm, Z_FINISH) ;
+  size = strm.total_out + BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE ;
+  deflateEnd(&strm) ;
+  if (ret != Z_STREAM_END)
+    return(level == 0 ? 0 : bgzfDeflateBlock(src, len, dst, 0)) ;
+
+  memcpy(dst, bgzf_header, BGZF_HEADER_SIZE) ;
+  dst[16] = (size-1) & 0xff ;
+  dst[17] = ((size-1) >> 8) & 0xff ;
+  bgzfPut32(dst + size - 8, crc32(crc32(0L, Z_NULL, 0), src, len)) ;
+  bgzfPut32(dst + size - 4, len) ;
+  return(size) ;
+}
+
+/*-----------------------------------------------------
+  bgzfInflateBlock() - decompress the member at src into
+  the ulen bytes at dst. Returns 0 or -1.
+  ------------------------------------------------------*/
+static int
+bgzfInflateBlock(unsigned char *src, size_t hlen, size_t clen,
+                 unsigned char *dst, size_t ulen)
+{
+  z_stream strm ;
+  int      ret ;
+
+  memset(&strm, 0, sizeof(strm)) ;
+  if (inflateInit2(&strm, -15) != Z_OK)
+    return(-1) ;
+  strm.next_in = src + hlen ;
+  strm.avail_in = clen - hlen - BGZF_FOOTER_SIZE ;
+  strm.next_out = dst ;
+  strm.avail_out = ulen ;
+  ret = inflate(&strm, Z_FINISH) ;
+  inflateEnd(&strm) ;
+  if (ret != Z_STREAM_END || strm.total_out != ulen)
+    return(-1) ;
+  if (crc32(crc32(0L, Z_NULL, 0), dst, ulen) !=
+      bgzfGet32(src + clen - BGZF_FOOTER_SIZE))
+    return(-1) ;
+  return(0) ;
+}
+
+/*-----------------------------------------------------
+  bgzfWriteBatch() - deflate the buffered data in
+  parallel and append the members to the file.
+  ------------------------------------------------------*/
+static int
+bgzfWriteBatch(BGZF_FILE *bfp)
+{
+  int i, nblocks, failed = 0 ;
+
+  if (bfp->upos == 0)
+    return(0) ;
+  nblocks = (bfp->upos + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for num_threads(bfp->nthreads) schedule(dynamic) reduction(+:failed)
+#endif
+  for (i = 0 ; i < nblocks ; i++)
+  {
+    size_t off = (size_t)i * BGZF_BLOCK_SIZE ;
+    size_t len = bfp->upos - off ;
+
+    if (len > BGZF_BLOCK_SIZE)
+      len = BGZF_BLOCK_SIZE ;
+    bfp->clen[i] = bgzfDeflateBlock(bfp->ubuf + off, len,
+                                    bfp->cbuf + (size_t)i*BGZF_MAX_BLOCK_SIZE,
+                                    bfp->level) ;
+    if (bfp->clen[i] == 0)
+      failed++ ;
+  }
+  if (failed)
+  {
+    bfp->error = 1 ;
+    fprintf(stderr, "** ERROR: bgzfWriteBatch: deflate failed\n") ;
+    return(-1) ;
+  }
+
+  for (i = 0 ; i < nblocks ; i++)
+    if (fwrite(bfp->cbuf + (size_t)i*BGZF_MAX_BLOCK_SIZE, 1, bfp->clen[i],
+               bfp->fp) != bfp->clen[i])
+    {
+      bfp->error = 1 ;
+      fprintf(stderr, "** ERROR: bgzfWriteBatch: write failed\n") ;
+      return(-1) ;
+    }
+  bfp->ubase += bfp->upos ;
+  bfp->upos = 0 ;
+  return(0) ;
+}
+
+/*-----------------------------------------------------
+  bgzfReadBatch() - read the next batch of members and
+  inflate them in parallel. Returns the number of members
+  read (0 at end of file) or -1 on error.
+  ------------------------------------------------------*/
+static int
+bgzfReadBatch(BGZF_FILE *bfp)
+{
+  int           i, nblocks, failed = 0 ;
+  size_t        xlen, pos, bsize, isize ;
+  unsigned char *blk ;
+
+  bfp->ubase += bfp->ulen ;
+  bfp->ulen = bfp->upos = 0 ;
+  if (bfp->eof || bfp->error)
+    return(bfp->error ? -1 : 0) ;
+
+  bfp->uoff[0] = 0 ;
+  for (nblocks = 0 ; nblocks < bfp->nbatch ; nblocks++)
+  {
+    blk = bfp->cbuf + (size_t)nblocks*BGZF_MAX_BLOCK_SIZE ;
+    i = fread(blk, 1, 12, bfp->fp) ;
+    if (i == 0)
+      break ;
+    if (i != 12 || blk[0] != 31 || blk[1] != 139 || blk[2] != 8 ||
+        !(blk[3] & 4))
+    {
+      bfp->error = 1 ;
+      fprintf(stderr, "** ERROR: bgzfReadBatch: not a BGZF member\n") ;
+      return(-1) ;
+    }
+    xlen = bgzfGet16(blk+10) ;
+    if (12 + xlen > BGZF_MAX_BLOCK_SIZE ||
+        fread(blk+12, 1, xlen, bfp->fp) != xlen)
+    {
+      bfp->error = 1 ;
+      fprintf(stderr, "** ERROR: bgzfReadBatch: truncated header\n") ;
+      return(-1) ;
+    }
+    for (bsize = 0, pos = 12 ; pos + 4 <= 12 + xlen ;
+         pos += 4 + bgzfGet16(blk+pos+2))
+      if (blk[pos] == 'B' && blk[pos+1] == 'C' && bgzfGet16(blk+pos+2) == 2)
+      {
+        bsize = bgzfGet16(blk+pos+4) + 1 ;
+        break ;
+      }
+    if (bsize < 12 + xlen + BGZF_FOOTER_SIZE ||
+        fread(blk+12+xlen, 1, bsize-12-xlen, bfp->fp) != bsize-12-xlen)
+    {
+      bfp->error = 1 ;
+      fprintf(stderr, "** ERROR: bgzfReadBatch: bad or truncated member\n") ;
+      return(-1) ;
+    }
+    isize = bgzfGet32(blk + bsize - 4) ;
+    if (isize > BGZF_MAX_BLOCK_SIZE)
+    {
+      bfp->error = 1 ;
+      fprintf(stderr, "** ERROR: bgzfReadBatch: member too large\n") ;
+      return(-1) ;
+    }
+    bfp->hlen[nblocks] = 12 + xlen ;
+    bfp->clen[nblocks] = bsize ;
+    bfp->uoff[nblocks+1] = bfp->uoff[nblocks] + isize ;
+  }
+  if (nblocks == 0)
+  {
+    bfp->eof = 1 ;
+    return(0) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for num_threads(bfp->nthreads) schedule(dynamic) reduction(+:failed)
+#endif
+  for (i = 0 ; i < nblocks ; i++)
+  {
+    if (bgzfInflateBlock(bfp->cbuf + (size_t)i*BGZF_MAX_BLOCK_SIZE,
+                         bfp->hlen[i], bfp->clen[i],
+                         bfp->ubuf + bfp->uoff[i],
+                         bfp->uoff[i+1] - bfp->uoff[i]) != 0)
+      failed++ ;
+  }
+  if (failed)
+  {
+    bfp->error = 1 ;
+    fprintf(stderr, "** ERROR: bgzfReadBatch: inflate/crc failed\n") ;
+    return(-1) ;
+  }
+  bfp->ulen = bfp->uoff[nblocks] ;
+  return(nblocks) ;
+}
+
+BGZF_FILE *
+BGZFopen(const char *path, const char *mode)
+{
+  BGZF_FILE  *bfp ;
+  const char *cp ;
+
+  bfp = (BGZF_FILE *)calloc(1, sizeof(BGZF_FILE)) ;
+  if (bfp == NULL)
+  {
+    fprintf(stderr, "** ERROR: BGZFopen: could not allocate file\n") ;
+    return(NULL) ;
+  }
+  bfp->writing = strchr(mode, 'w') != NULL ;
+  bfp->level = BGZFgetLevel() ;
+  for (cp = mode ; *cp ; cp++)
+    if (isdigit(*cp))
+      bfp->level = *cp - '0' ;
+  bfp->nthreads = BGZFgetThreads() ;
+  bfp->nbatch = BGZF_BATCH_PER_THREAD * bfp->nthreads ;
+
+  bfp->fp = fopen(path, bfp->writing ? "wb" : "rb") ;
+  if (bfp->fp == NULL)
+  {
+    free(bfp) ;
+    return(NULL) ;
+  }
+  bfp->ubuf = (unsigned char *)malloc((size_t)bfp->nbatch *
+                                      BGZF_MAX_BLOCK_SIZE) ;
+  bfp->cbuf = (unsigned char *)malloc((size_t)bfp->nbatch *
+                                      BGZF_MAX_BLOCK_SIZE) ;
+  bfp->clen = (size_t *)calloc(bfp->nbatch, sizeof(size_t)) ;
+  bfp->hlen = (size_t *)calloc(bfp->nbatch, sizeof(size_t)) ;
+  bfp->uoff = (size_t *)calloc(bfp->nbatch+1, sizeof(size_t)) ;
+  if (!bfp->ubuf || !bfp->cbuf || !bfp->clen || !bfp->hlen || !bfp->uoff)
+  {
+    fprintf(stderr, "** ERROR: BGZFopen(%s): could not allocate %d blocks\n",
+            path, bfp->nbatch) ;
+    BGZFclose(bfp) ;
+    return(NULL) ;
+  }
+  return(bfp) ;
+}
+
+int
+BGZFclose(BGZF_FILE *bfp)
+{
+  int ret = 0 ;
+
+  if (bfp == NULL)
+    return(0) ;
+  if (bfp->writing)
+  {
+    if (bgzfWriteBatch(bfp) != 0 ||
+        fwrite(bgzf_eof, 1, sizeof(bgzf_eof), bfp->fp) != sizeof(bgzf_eof))
+      ret = -1 ;
+  }
+  if (fclose(bfp->fp) != 0)
+    ret = -1 ;
+  free(bfp->ubuf) ;
+  free(bfp->cbuf) ;
+  free(bfp->clen) ;
+  free(bfp->hlen) ;
+  free(bfp->uoff) ;
+  free(bfp) ;
+  return(ret) ;
+}
+
+size_t
+BGZFread(BGZF_FILE *bfp, void *buf, size_t len)
+{
+  size_t n, nread = 0 ;
+
+  if (bfp->writing)
+    return(0) ;
+  while (nread < len)
+  {
+    if (bfp->upos >= bfp->ulen)
+    {
+      if (bgzfReadBatch(bfp) <= 0)
+        break ;
+      continue ;
+    }
+    n = bfp->ulen - bfp->upos ;
+    if (n > len - nread)
+      n = len - nread ;
+    memcpy((char *)buf + nread, bfp->ubuf + bfp->upos, n) ;
+    bfp->upos += n ;
+    nread += n ;
+  }
+  return(nread) ;
+}
+
+size_t
+BGZFwrite(BGZF_FILE *bfp, const void *buf, size_t len)
+{
+  size_t n, nwritten = 0, cap = (size_t)bfp->nbatch * BGZF_BLOCK_SIZE ;
+
+  if (!bfp->writing || bfp->error)
+    return(0) ;
+  while (nwritten < len)
+  {
+    n = cap - bfp->upos ;
+    if (n > len - nwritten)
+      n = len - nwritten ;
+    memcpy(bfp->ubuf + bfp->upos, (const char *)buf + nwritten, n) ;
+    bfp->upos += n ;
+    nwritten += n ;
+    if (bfp->upos == cap && bgzfWriteBatch(bfp) != 0)
+      break ;
+  }
+  return(nwritten) ;
+}
+
+long
+BGZFtell(BGZF_FILE *bfp)
+{
+  return(bfp->ubase + (long)bfp->upos) ;
+}
+
+/*-----------------------------------------------------
+  BGZFseek() - like gzseek(): SEEK_END is not supported
+  and a file being written can only seek forward (the gap
+  is filled with zeros). Backward seeks in a file being
+  read restart from the beginning unless the target is
+  in the current batch. Returns the new offset or -1.
+  ------------------------------------------------------*/
+long
+BGZFseek(BGZF_FILE *bfp, long offset, int whence)
+{
+  long target ;
+
+  if (whence == SEEK_SET)
+    target = offset ;
+  else if (whence == SEEK_CUR)
+    target = BGZFtell(bfp) + offset ;
+  else
+    return(-1) ;
+  if (target < 0)
+    return(-1) ;
+
+  if (bfp->writing)
+  {
+    unsigned char zeros[4096] ;
+    long          n ;
+
+    if (target < BGZFtell(bfp))
+      return(-1) ;
+    memset(zeros, 0, sizeof(zeros)) ;
+    while ((n = target - BGZFtell(bfp)) > 0)
+    {
+      if (n > (long)sizeof(zeros))
+        n = sizeof(zeros) ;
+      if (BGZFwrite(bfp, zeros, n) != (size_t)n)
+        return(-1) ;
+    }
+    return(target) ;
+  }
+
+  if (target < bfp->ubase)
+  {
+    rewind(bfp->fp) ;
+    bfp->ubase = 0 ;
+    bfp->ulen = bfp->upos = 0 ;
+    bfp->eof = 0 ;
+  }
+  while (target > bfp->ubase + (long)bfp->ulen)
+    if (bgzfReadBatch(bfp) <= 0)
+      return(-1) ;
+  bfp->upos = target - bfp->ubase ;
+  return(target) ;
+}
+
+int
+BGZFflush(BGZF_FILE *bfp)
+{
+  if (!bfp->writing)
+    return(0) ;
+  if (bgzfWriteBatch(bfp) != 0)
+    return(-1) ;
+  return(fflush(bfp->fp)) ;
+}
+
+int
+BGZFeof(BGZF_FILE *bfp)
+{
+  return(bfp->eof && bfp->upos >= bfp->ulen) ;
+}
+
+int
+BGZFgetc(BGZF_FILE *bfp)
+{
+  while (bfp->upos >= bfp->ulen)
+    if (bfp->writing || bgzfReadBatch(bfp) <= 0)
+      return(EOF) ;
+  return(bfp->ubuf[bfp->upos++]) ;
+}
+
+int
+BGZFputc(BGZF_FILE *bfp, int c)
+{
+  unsigned char uc = (unsigned char)c ;
+
+  if (BGZFwrite(bfp, &uc, 1) != 1)
+    return(EOF) ;
+  return(uc) ;
+}
+
+char *
+BGZFgets(BGZF_FILE *bfp, char *str, int size)
+{
+  int c, n = 0 ;
+
+  if (size <= 0)
+    return(NULL) ;
+  while (n < size-1)
+  {
+    c = BGZFgetc(bfp) ;
+    if (c == EOF)
+      break ;
+    str[n++] = c ;
+    if (c == '\n')
+      break ;
+  }
+  str[n] = 0 ;
+  return(n > 0 ? str : NULL) ;
+}
+
+#else
+
+BGZF_FILE *
+BGZFopen(const char *path, const char *mode)
+{
+  fprintf(stderr, "** ERROR: BGZFopen: built without zlib\n") ;
+  return(NULL) ;
+}
+
+int    BGZFclose(BGZF_FILE *bfp) { return(0) ; }
+size_t BGZFread(BGZF_FILE *bfp, void *buf, size_t len) { return(0) ; }
+size_t BGZFwrite(BGZF_FILE *bfp, const void *buf, size_t len) { return(0) ; }
+long   BGZFseek(BGZF_FILE *bfp, long offset, int whence) { return(-1) ; }
+long   BGZFtell(BGZF_FILE *bfp) { return(0) ; }
+int    BGZFflush(BGZF_FILE *bfp) { return(0) ; }
+int    BGZFeof(BGZF_FILE *bfp) { return(1) ; }
+int    BGZFgetc(BGZF_FILE *bfp) { return(EOF) ; }
+int    BGZFputc(BGZF_FILE *bfp, int c) { return(EOF) ; }
+char   *BGZFgets(BGZF_FILE *bfp, char *str, int size) { return(NULL) ; }
+
+#endif
@@ -29,15 +29,12 @@
  * Author: Xiao Han
  */
 
-/* The following function uses HEAP, which uses the LIST data structure */
+/* The marching in mrisgeodesic.c uses HEAP, which uses the LIST data structure */
 #include "macros.h"
 #include "mrisurf.h"
 #include "fmarchmesh.h"
 #define DEBUG 0
 
-float ReCompute(int vIDc, int vIDa, int vIDb, MRI_SURFACE *mesh, float *T, unsigned char *label);
-float ComputeTInAcute(float,float,float,float,float);
-
 float *FastMarchMesh(MRI_SURFACE *mesh, int *contour, int numinitvert, float thred)
 {
   /* Compute the geodesic distance of surface vertices to the initial contour*/
@@ -45,188 +42,35 @@ float *FastMarchMesh(MRI_SURFACE *mesh, int *contour, int numinitvert, float thr
      contour, i.e., vertices with zero distance. numinitvert is the size of
      contour.
      To save time, the distance computation stops when vertices with distance
-     less than thred are all computed
-  */
-  /* The program assumes that the neighborhood structure of the surface mesh
-     is already built, e.g., using function mrisFindNeighbors, which seems
-     to be always performed during surface-file-reading
-     Thus, the total number of neighors of vertex i is mesh->vertices[i].vnum,
-     and the j-th neighbor of i is mesh->vertices[i].v[j].
-     It also assumes the neighbors are stored in correct order, i.e.,
-     two consecutive neighbors j and j+1 form a face with vertex i.
-     Maybe a separate function need be written to make sure the neighborhood
-     construction is correct!
-     I think I may just use every face sharing the vertex directly, since the
-     current program assumes the mesh is closed and simple, which may not be
-     true. I think I need to use both, i.e., use face when need to compute
-     distance from each shared face, and use v->v when need to enumerate
-     every neighbors!
+     less than thred are all computed; the rest are set to INFINITY (the
+     large value of fmarchmesh.h, not HUGE_VAL).
+     The marching itself is done by the shared engine in mrisgeodesic.c,
+     which updates each vertex across its faces with ReCompute() below.
   */
-
-  float *T;  /* final distances of each vertex to the contour */
-  float tempvalue, newvalue;
-  unsigned char *label; /* "Alive" => 1; "Narrow Band" => 2; "Far Away" => 3; */
-  int *BackPointer;  /* backpointer to the narrowband heap */
-  Xheap H;           /* Narrrow band heap */
-  XheapElement he;
-  //  int heapindex;
-
-  FACE *face;
-
-  int i, j, k, index, VN, VId, neighVId, n0, n1;
+  float *T;
+  int i, VN;
 
   VN = mesh->nvertices; /* total number of surface vertices */
 
-  T = (float *) malloc(sizeof(float)*VN);
-
-  for (i=0; i<VN; i++)
-  {
-    T[i] = INFINITY;  /*All distance initialized to a large value */
-  }
-
   if (numinitvert <= 0)
   {
     printf("Warning, the initial contour is empty, no geodesic distance can be computed\n");
 
+    T = (float *) malloc(sizeof(float)*VN);
+    for (i=0; i<VN; i++)
+    {
+      T[i] = INFINITY;  /*All distance initialized to a large value */
+    }
     return T;
   }
 
-  label = (unsigned char *) malloc(sizeof(unsigned char)*VN);
-  BackPointer = (int *) malloc(sizeof(int)*VN);
-
-  /* Initialize heap structure */
-  H = xhInitEmpty();
-
-  /* Initialization for marching inwards and outwards simultaneously */
-  for (i=0; i<VN; i++)
-  {
-    label[i] = (unsigned char) FAWAY;  /*All points are labelled as FAR AWAY */
-  }
-
-  for (i=0; i<numinitvert; i++)
-  {
-    label[contour[i]] = (unsigned char) ALIVE; /* all vertices on contour are alive */
-    T[contour[i]] = 0; /* all vertices on contour have distance zero */
-  }
-
-  /* Initialize NarrowBand Heap */
-  for (i=0; i<VN; i++)
-  {
-    if (label[i] == (unsigned char)ALIVE)
-    {
-
-      /* put its neighbors into the NarrowBand */
-      if (DEBUG)
-        printf("mesh->vertices[i].vnum = %d\n", mesh->vertices[i].vnum);
-      for (j=0; j< mesh->vertices[i].vnum; j++)
-      {
-        neighVId = mesh->vertices[i].v[j];
-        if (DEBUG) printf("neighVId = %d\n", neighVId);
-        if (label[neighVId] == (unsigned char)FAWAY)
-        {
-          /* compute the distance to this point and add it to the heap */
-          label[neighVId] = (unsigned char)NBAND;
-          /* Check all possible triangles surrounding vertex neighVId1 */
-          /* Note: Only ALIVE points contribute to the distance computation */
-          newvalue = INFINITY;
-          /* Compute distance from each face the vertex shares */
-          /* k is the index of faces shared by the vertex neighVId */
-          if (DEBUG)
-            printf("mesh->vertices[neighVId].num = %d\n", mesh->vertices[neighVId].num);
-          for (k=0; k<mesh->vertices[neighVId].num; k++)
-          {
-            index = mesh->vertices[neighVId].n[k]; /* # of vertex with ID
-                                                           neighVId in the k-th face
-                                                           that it is in */
-            if (DEBUG)
-              printf("index = %d\n", index);
-            face = &mesh->faces[mesh->vertices[neighVId].f[k]]; /* ptr to the
-                                                            k-th face */
-            n0 = face->v[(index + VERTICES_PER_FACE -1)%VERTICES_PER_FACE];
-            n1 = face->v[(index + 1)%VERTICES_PER_FACE];
-            if (DEBUG) printf("no = %d, n1 = %d\n", n0, n1);
-            tempvalue = ReCompute(neighVId, n0, n1, mesh, T, label);
-            if (tempvalue < newvalue)  newvalue = tempvalue;
-          } /* end for-k */
-
-          T[neighVId] = newvalue;
-          xhInsert(newvalue, neighVId, &(BackPointer[neighVId]), H);
-
-        } /* end if */
-      } /* end for */
-    } /* end if */
-  } /* end for */
-
-  /* End of Initialization */
-
-  /* Begin Fast Marching to get the unsigned distance function inwords
-   * and outwards simultaneously
-   * since points inside and outside the contour won't interfere with
-   * each other
-   */
-  while (!xhIsEmpty(H))
-  { /* There are still points not yet accepted */
-    he = xhRemove(H); /* Label the point with smallest value among all
-                                         NarrowBand points as ALIVE */
-    VId = he.id;
-
-    T[VId] = he.value;
-    label[VId] = (unsigned char)ALIVE;
-
-    if (he.value > thred) break;
-
-    /* Update its neighbor */
-    /* Put FARAWAY neighbors into NarrowBand, Recompute values at
-     * NarrowBand neighbors,
-     * Keep ALIVE (Accepted) neighbor unchanged
-     */
-    for (i=0; i<mesh->vertices[VId].vnum; i++)
-    {
-      neighVId = mesh->vertices[VId].v[i];
-
-      /* Don't change ALIVE neighbors */
-      if (label[neighVId] != (unsigned char)ALIVE)
-      {
-        newvalue = INFINITY;
-
-        /* Compute distance from each face the vertex shares */
-        /* j is the index of faces shared by the vertex neighVId */
-        for (j=0; j<mesh->vertices[neighVId].num; j++)
-        {
-          face = &mesh->faces[mesh->vertices[neighVId].f[j]]; /* ptr to the
-                                                  j-th face */
-
-          index = mesh->vertices[neighVId].n[j]; /* index of the vertex
-                                                   (neighVId) in the j-th
-                                                   face that it belongs to */
-          /* Take the ID of the remaining two vertices of the j-th face */
-          n0 = face->v[(index + VERTICES_PER_FACE -1)%VERTICES_PER_FACE];
-          n1 = face->v[(index + 1)%VERTICES_PER_FACE];
-          tempvalue = ReCompute(neighVId, n0, n1, mesh, T, label);
-          if (tempvalue < newvalue)  newvalue = tempvalue;
-        } /* end for-j */
-
-        /* If it was a FARAWAY point, add it to the NarrowBand Heap;
-         * otherwise, just update its value
-         * using the backpointer
-         */
-        if (label[neighVId] == (unsigned char)NBAND)
-          xhChangeValue(BackPointer[neighVId],newvalue, H);
-        else
-        {
-          xhInsert(newvalue, neighVId, &(BackPointer[neighVId]), H);
-          label[neighVId] = (unsigned char)NBAND;
-        }
-
-      } /* end if ALIVE */
-    } /* end updating neighbors */
-
-  } /* end of marching loop */
-
-  free(label);
-  free(BackPointer);
-  xhDestroy(H);
+  T = MRISgeodesicDistances(mesh, contour, numinitvert, thred,
+                            GEODESIC_FAST_MARCH, NULL);
 
+  /* the engine leaves unreached vertices at GEODESIC_UNREACHED */
+  if (T)
+    for (i=0; i<VN; i++)
+      if (T[i] >= GEODESIC_UNREACHED) T[i] = INFINITY;
   return T;
 }
 
@@ -2181,6 +2181,8 @@ GCAfree(GCA **pgca)
   gca = *pgca ;
   *pgca = NULL ;
 
+  GCAfreeDensityCache(gca) ;
+  GCAreleaseFlat(gca) ;
   for (x = 0 ; x < gca->node_width ; x++)
   {
     for (y = 0 ; y < gca->node_height ; y++)
@@ -2761,6 +2763,10 @@ GCAwrite(GCA *gca, const char *fname)
   GC1D      *gc ;
   int gzipped = 0;
 
+  if (strstr(fname, GCA_FLAT_EXTENSION))
+  {
+    return(GCAwriteFlat(gca, fname)) ;
+  }
   if (strstr(fname, ".gcz"))
   {
     gzipped = 1;
@@ -2938,6 +2944,18 @@ GCAread(const char *fname)
   int       tag;
   int gzipped = 0;
   int tempZNZ;
+  char flat_fname[STRLEN] ;
+
+  /* flat atlases are mapped rather than parsed (see gcaflat.c) */
+  if (GCAisFlatFile(fname))
+  {
+    return(GCAreadFlat(fname)) ;
+  }
+  if (getenv("FS_GCA_PREFER_FLAT") && GCAflatSidecar(fname, flat_fname))
+  {
+    printf("reading %s in place of %s\n", flat_fname, fname) ;
+    return(GCAreadFlat(flat_fname)) ;
+  }
 
   if (strstr(fname, ".gcz"))
   {
@@ -3416,6 +3434,10 @@ GCAupdatePrior(GCA *gca, MRI *mri, int xn, int yn, int zn, int label)
                 (ERROR_BADPARM,
                  "GCAupdatePrior(%d, %d, %d, %d): label out of range",
                  xn, yn, zn, label)) ;
+  if (gca->flat)  // label arrays may be reallocated below
+  {
+    GCAunmap(gca) ;
+  }
 
   if (xn == Ggca_x && yn == Ggca_y && zn == Ggca_z)
   {
@@ -3567,6 +3589,10 @@ GCAupdateNode(GCA *gca, MRI *mri,
                 (ERROR_BADPARM,
                  "GCAupdateNode(%d, %d, %d, %d): label out of range",
                  xn, yn, zn, label)) ;
+  if (gca->flat)  // gcs may be reallocated below
+  {
+    GCAunmap(gca) ;
+  }
 
   if (xn == Ggca_x && yn == Ggca_y && zn == Ggca_z && label == Ggca_label)
   {
@@ -4077,10 +4103,8 @@ GCAcompleteCovarianceTraining(GCA *gca)
 MRI  *
 GCAlabel(MRI *mri_inputs, GCA *gca, MRI *mri_dst, TRANSFORM *transform)
 {
-  int       x, width, height, depth, num_pv, use_partial_volume_stuff ;
-#if INTERP_PRIOR
-  float     prior ;
-#endif
+  int       x, width, height, depth, num_pv, use_partial_volume_stuff,
+            cached ;
 
   use_partial_volume_stuff = (getenv("USE_PARTIAL_VOLUME_STUFF") != NULL);
   if (use_partial_volume_stuff)
@@ -4108,10 +4132,13 @@ GCAlabel(MRI *mri_inputs, GCA *gca, MRI *mri_dst, TRANSFORM *transform)
      classifiers statistics based on this voxel's intensity and label.
   */
   width = mri_inputs->width ; height = mri_inputs->height; depth = mri_inputs->depth ; num_pv = 0 ;
-//if 0
-//ifdef HAVE_OPENMP
-//pragma omp parallel for reduction(+: num_pv)
-//endif
+  // each voxel is labeled independently, so any thread count gives
+  // the same result
+  cached = (gca->density_cache == NULL) ;
+  GCAcacheDensities(gca) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for reduction(+: num_pv) schedule(dynamic, 1)
+#endif
   for (x = 0 ; x < width ; x++)
   {
     int y, z, n, label, max_n, xn, yn, zn ;
@@ -4119,6 +4146,9 @@ GCAlabel(MRI *mri_inputs, GCA *gca, MRI *mri_dst, TRANSFORM *transform)
     GCA_NODE  *gcan ;
     GCA_PRIOR *gcap ;
     GC1D      *gc, *max_gc ;
+#if INTERP_PRIOR
+    float     prior ;
+#endif
 
     for (y = 0 ; y < height ; y++)
     {
@@ -4285,6 +4315,10 @@ GCAlabel(MRI *mri_inputs, GCA *gca, MRI *mri_dst, TRANSFORM *transform)
     } // y loop
   } // x loop
 
+  if (cached)
+  {
+    GCAfreeDensityCache(gca) ;
+  }
   return(mri_dst) ;
 }
 
@@ -8073,6 +8107,10 @@ GCAupdateNodeGibbsPriors(GCA *gca, MRI*mri, int xn, int yn, int zn,
   GCA_NODE *gcan ;
   GC1D     *gc ;
 
+  if (gca->flat)  // neighbor label arrays may be reallocated below
+  {
+    GCAunmap(gca) ;
+  }
   gcan = &gca->nodes[xn][yn][zn] ;
 
   // look for this label
@@ -8649,6 +8687,134 @@ GCAanneal(MRI *mri_inputs, GCA *gca, MRI *mri_dst,TRANSFORM *transform,
 
 char *gca_write_fname = NULL ;
 int gca_write_iterations = 0 ;
+int gca_red_black = 0 ;
+
+/*-----------------------------------------------------
+  gcaGibbsRelabelVoxel() - one ICM update: give (x,y,z) the label
+  with the largest neighborhood Gibbs posterior. Only the voxel itself
+  is written, and only its 6-connected neighbors are read, so voxels
+  of the same red-black color can be updated concurrently. Returns 1
+  if the label changed.
+  ------------------------------------------------------*/
+static int
+gcaGibbsRelabelVoxel(GCA *gca, MRI *mri_inputs, MRI *mri_dst,
+                     MRI *mri_changed, MRI *mri_fixed, MRI *mri_probs,
+                     TRANSFORM *transform, int x, int y, int z,
+                     double prior_factor)
+{
+  int n, label, old_label ;
+  GCA_PRIOR *gcap ;
+  double   new_posterior, max_posterior ;
+
+  if (x == Ggca_x && y == Ggca_y && z == Ggca_z)
+    DiagBreak() ;
+
+  // if the label is fixed, don't do anything
+  if (mri_fixed && MRIgetVoxVal(mri_fixed, x, y, z,0))
+    return(0) ;
+
+  // if not marked, don't do anything
+  if (MRIgetVoxVal(mri_changed, x, y, z,0) == 0)
+    return(0) ;
+
+  /* find the node associated with this coordinate and classify */
+  gcap = getGCAP(gca, mri_inputs, transform, x, y, z) ;
+  // it is not in the right place
+  if (gcap==NULL)
+    return(0) ;
+
+  // only one label associated, don't do anything
+  if (gcap->nlabels == 1)
+    return(0) ;
+
+  // save the current label
+  label = old_label = nint(MRIgetVoxVal(mri_dst, x, y, z,0)) ;
+  // calculate neighborhood likelihood
+  max_posterior = GCAnbhdGibbsLogPosterior(gca, mri_dst,
+                  mri_inputs, x, y,z,transform,
+                  prior_factor);
+
+  // go through all labels at this point
+  for (n = 0 ; n < gcap->nlabels ; n++)
+  {
+    // skip the current label
+    if (gcap->labels[n] == old_label)
+      continue ;
+
+    // assign the new label
+    MRIsetVoxVal(mri_dst, x, y, z, 0,gcap->labels[n]) ;
+    // calculate neighborhood likelihood
+    new_posterior =
+      GCAnbhdGibbsLogPosterior(gca, mri_dst,
+                               mri_inputs, x, y,z,transform,
+                               prior_factor);
+    // if it is bigger than the old one, then replace the label
+    // and change max_posterior
+    if (new_posterior > max_posterior)
+    {
+      if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
+          (label == Ggca_label || old_label ==
+           Ggca_label || Ggca_label < 0))
+        fprintf(stdout,
+                "NbhdGibbsLogLikelihood at (%d, %d, %d):"
+                " old = %d (ll=%.2f) new = %d (ll=%.2f)\n",
+                x, y, z, old_label, max_posterior,
+                gcap->labels[n], new_posterior);
+
+      max_posterior = new_posterior ;
+      label = gcap->labels[n] ;
+    }
+  }
+
+  /*#ifndef __OPTIMIZE__*/
+  if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
+      (label == Ggca_label || old_label ==
+       Ggca_label || Ggca_label < 0))
+  {
+    int       xn, yn, zn ;
+    GCA_NODE *gcan ;
+
+    if (!GCAsourceVoxelToNode(gca, mri_inputs, transform,
+                              x, y, z, &xn, &yn, &zn))
+    {
+      gcan = &gca->nodes[xn][yn][zn] ;
+      printf("(%d, %d, %d): old label %s (%d), "
+             "new label %s (%d) (log(p)=%2.3f)\n",
+             x, y, z, cma_label_to_name(old_label), old_label,
+             cma_label_to_name(label), label, max_posterior) ;
+      dump_gcan(gca, gcan, stdout, 0, gcap) ;
+      if (label == Right_Caudate)
+      {
+        DiagBreak() ;
+      }
+    }
+  }
+  /*#endif*/
+
+  // mark whether the label changed
+  MRIsetVoxVal(mri_changed, x, y, z, 0, label != old_label) ;
+  // assign new label
+  MRIsetVoxVal(mri_dst, x, y, z, 0, label) ;
+  if (mri_probs)
+  {
+    MRIsetVoxVal(mri_probs, x, y, z, 0, -max_posterior) ;
+  }
+  return(label != old_label) ;
+}
+
+/*-----------------------------------------------------
+  gcaRedBlackScheduling() - whether the Gibbs ICM passes should use a
+  red-black (checkerboard) sweep instead of the original sequential
+  sweep. The sequential sweep depends on visiting order, so it can't
+  be run in parallel, but the red-black sweep gives different labels.
+  It is only used if asked for (gca_red_black, mri_ca_label -redblack,
+  or FS_GCA_RED_BLACK), whatever the number of threads.
+  ------------------------------------------------------*/
+static int
+gcaRedBlackScheduling(void)
+{
+  return(gca_red_black || getenv("FS_GCA_RED_BLACK") != NULL) ;
+}
 
 #if  0
 double MAX_PRIOR_FACTOR = 1.0 ;
@@ -8665,11 +8831,14 @@ GCAreclassifyUsingGibbsPriors(MRI *mri_inputs,
 			      double min_prior_factor, double max_prior_factor)
 {
   int      x, y, z, width, height, depth, iter,
-    nchanged, min_changed, index, nindices, fixed ;
+    nchanged, min_changed, index, nindices, fixed, red_black, cached ;
   short    *x_indices, *y_indices, *z_indices ;
   double   prior_factor, old_posterior, lcma = 0.0 ;
-  MRI      *mri_changed, *mri_probs /*, *mri_zero */ ;
+  MRI      *mri_changed, *mri_probs = NULL /*, *mri_zero */ ;
 
+  red_black = gcaRedBlackScheduling() ;
+  cached = (gca->density_cache == NULL) ;
+  GCAcacheDensities(gca) ;
   prior_factor = min_prior_factor ;
 // fixed is the label fixed volume, e.g. wm
   fixed = (mri_fixed != NULL) ;
@@ -8823,13 +8992,28 @@ GCAreclassifyUsingGibbsPriors(MRI *mri_inputs,
         printf("writing snapshot to %s...\n", fname) ;
         MRIwrite(mri_dst, fname) ;
       }
-      // probs has 0 to 255 values
-      mri_probs = GCAlabelProbabilities(mri_inputs, gca, NULL, transform) ;
-      // sorted according to ascending order of probs
-      MRIorderIndices(mri_probs, x_indices, y_indices, z_indices) ;
-      MRIfree(&mri_probs) ;
+      if (red_black)
+      {
+        // visiting order doesn't matter within a color
+        for (index = x = 0 ; x < width ; x++)
+          for (y = 0 ; y < height ; y++)
+            for (z = 0 ; z < depth ; z++, index++)
+            {
+              x_indices[index] = x ;
+              y_indices[index] = y ;
+              z_indices[index] = z ;
+            }
+      }
+      else
+      {
+        // probs has 0 to 255 values
+        mri_probs = GCAlabelProbabilities(mri_inputs, gca, NULL, transform) ;
+        // sorted according to ascending order of probs
+        MRIorderIndices(mri_probs, x_indices, y_indices, z_indices) ;
+        MRIfree(&mri_probs) ;
+      }
     }
-    else
+    else if (!red_black)
       // randomize the indices value ((0 -> width*height*depth)
       MRIcomputeVoxelPermutation(mri_inputs, x_indices, y_indices,
                                  z_indices) ;
@@ -8843,122 +9027,37 @@ GCAreclassifyUsingGibbsPriors(MRI *mri_inputs,
       MRIcopyHeader(mri_inputs, mri_probs) ;
     }
 
-#ifdef HAVE_OPENMP
-//pragma omp parallel for reduction(+: nchanged)
-#endif
-    for (index = 0 ; index < nindices ; index++)
+    if (red_black)
     {
-      int x, y, z, n, label, old_label ;
-      GCA_PRIOR *gcap ;
-      double   new_posterior, max_posterior ;
-      float    val ;
-  
-      x = x_indices[index] ; y = y_indices[index] ; z = z_indices[index] ;
-      if (x == Ggca_x && y == Ggca_y && z == Ggca_z)
-        DiagBreak() ;
-
-      // if the label is fixed, don't do anything
-      if (mri_fixed && MRIgetVoxVal(mri_fixed, x, y, z,0))
-        continue ;
+      int color ;
 
-      // if not marked, don't do anything
-      if (MRIgetVoxVal(mri_changed, x, y, z,0) == 0)
-        continue ;
-
-      // get the grey value
-      val = MRIgetVoxVal(mri_inputs, x, y, z, 0) ;
-
-      /* find the node associated with this coordinate and classify */
-      gcap = getGCAP(gca, mri_inputs, transform, x, y, z) ;
-      // it is not in the right place
-      if (gcap==NULL)
-        continue;
-
-      // only one label associated, don't do anything
-      if (gcap->nlabels == 1)
-        continue ;
-
-      // save the current label
-      label = old_label = nint(MRIgetVoxVal(mri_dst, x, y, z,0)) ;
-      // calculate neighborhood likelihood
-      max_posterior = GCAnbhdGibbsLogPosterior(gca, mri_dst,
-                      mri_inputs, x, y,z,transform,
-                      prior_factor);
-
-      // go through all labels at this point
-      for (n = 0 ; n < gcap->nlabels ; n++)
+      // update all voxels of one color, then the other. Voxels of the
+      // same color aren't 6-connected, so the result is independent of
+      // the number of threads and the visiting order.
+      for (color = 0 ; color < 2 ; color++)
       {
-        // skip the current label
-        if (gcap->labels[n] == old_label)
-          continue ;
-
-        // assign the new label
-        MRIsetVoxVal(mri_dst, x, y, z, 0,gcap->labels[n]) ;
-        // calculate neighborhood likelihood
-        new_posterior =
-          GCAnbhdGibbsLogPosterior(gca, mri_dst,
-                                   mri_inputs, x, y,z,transform,
-                                   prior_factor);
-        // if it is bigger than the old one, then replace the label
-        // and change max_posterior
-        if (new_posterior > max_posterior)
+#ifdef HAVE_OPENMP
+        #pragma omp parallel for reduction(+: nchanged) schedule(dynamic, 4096)
+#endif
+        for (index = 0 ; index < nindices ; index++)
         {
-          if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
-              (label == Ggca_label || old_label ==
-               Ggca_label || Ggca_label < 0))
-            fprintf(stdout,
-                    "NbhdGibbsLogLikelihood at (%d, %d, %d):"
-                    " old = %d (ll=%.2f) new = %d (ll=%.2f)\n",
-                    x, y, z, old_label, max_posterior,
-                    gcap->labels[n], new_posterior);
-
-          max_posterior = new_posterior ;
-          label = gcap->labels[n] ;
-        }
-      }
-
-      /*#ifndef __OPTIMIZE__*/
-      if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
-          (label == Ggca_label || old_label ==
-           Ggca_label || Ggca_label < 0))
-      {
-        int       xn, yn, zn ;
-        GCA_NODE *gcan ;
+          int x, y, z ;
 
-        if (!GCAsourceVoxelToNode(gca, mri_inputs, transform,
-                                  x, y, z, &xn, &yn, &zn))
-        {
-          gcan = &gca->nodes[xn][yn][zn] ;
-          printf("(%d, %d, %d): old label %s (%d), "
-                 "new label %s (%d) (log(p)=%2.3f)\n",
-                 x, y, z, cma_label_to_name(old_label), old_label,
-                 cma_label_to_name(label), label, max_posterior) ;
-          dump_gcan(gca, gcan, stdout, 0, gcap) ;
-          if (label == Right_Caudate)
-          {
-            DiagBreak() ;
-          }
+          x = x_indices[index] ; y = y_indices[index] ; z = z_indices[index] ;
+          if (((x+y+z) & 1) != color)
+            continue ;
+          nchanged += gcaGibbsRelabelVoxel(gca, mri_inputs, mri_dst,
+                                           mri_changed, mri_fixed, mri_probs,
+                                           transform, x, y, z, prior_factor) ;
         }
       }
-      /*#endif*/
-
-      // if label changed
-      if (label != old_label)
-      {
-        nchanged++ ;
-        // mark it as changed
-        MRIsetVoxVal(mri_changed, x, y, z, 0, 1) ;
-      }
-      else
-      {
-        MRIsetVoxVal(mri_changed, x, y, z, 0, 0) ;
-      }
-      // assign new label
-      MRIsetVoxVal(mri_dst, x, y, z, 0, label) ;
-      if (mri_probs)
-      {
-        MRIsetVoxVal(mri_probs, x, y, z, 0, -max_posterior) ;
-      }
+    }
+    else for (index = 0 ; index < nindices ; index++)
+    {
+      x = x_indices[index] ; y = y_indices[index] ; z = z_indices[index] ;
+      nchanged += gcaGibbsRelabelVoxel(gca, mri_inputs, mri_dst,
+                                       mri_changed, mri_fixed, mri_probs,
+                                       transform, x, y, z, prior_factor) ;
     }
     if (mri_probs)
     {
@@ -9224,6 +9323,10 @@ GCAreclassifyUsingGibbsPriors(MRI *mri_inputs,
   free(y_indices) ;
   free(z_indices) ;
   MRIfree(&mri_changed) ;
+  if (cached)
+  {
+    GCAfreeDensityCache(gca) ;
+  }
 
   return(mri_dst) ;
 }
@@ -9272,19 +9375,27 @@ double
 GCAgibbsImageLogPosterior(GCA *gca, MRI *mri_labels, MRI *mri_inputs,
                           TRANSFORM *transform, double prior_factor)
 {
-  int    x, width, depth, height ;
-  double total_log_posterior ;
+  int    x, width, depth, height, cached ;
+  double total_log_posterior, *x_log_posterior ;
 
   width = mri_labels->width ; height = mri_labels->height ; depth = mri_labels->depth ;
 
-  total_log_posterior = 0.0 ;
-//ifdef HAVE_OPENMP
-//pragma omp parallel for reduction(+: total_log_posterior)
-//endif
+  // sum each x slice separately and add the slices up in order, so the
+  // total doesn't depend on the number of threads
+  x_log_posterior = (double *)calloc(width, sizeof(double)) ;
+  if (!x_log_posterior)
+    ErrorExit(ERROR_NOMEMORY, "GCAgibbsImageLogPosterior: could not allocate sums") ;
+  cached = (gca->density_cache == NULL) ;
+  GCAcacheDensities(gca) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
   for (x = 0 ; x < width ; x++)
   {
     int    y, z ;
-    double log_posterior ;
+    double log_posterior, slice_log_posterior ;
+
+    slice_log_posterior = 0.0 ;
     for (y = 0 ; y < height ; y++)
     {
       for (z = 0 ; z < depth ; z++)
@@ -9298,13 +9409,19 @@ GCAgibbsImageLogPosterior(GCA *gca, MRI *mri_labels, MRI *mri_inputs,
         {
           DiagBreak() ;
         }
-        total_log_posterior += log_posterior ;
-        if (total_log_posterior > 1e10)
-        {
-          DiagBreak() ;
-        }
+        slice_log_posterior += log_posterior ;
       }
     }
+    x_log_posterior[x] = slice_log_posterior ;
+  }
+  for (total_log_posterior = 0.0, x = 0 ; x < width ; x++)
+  {
+    total_log_posterior += x_log_posterior[x] ;
+  }
+  free(x_log_posterior) ;
+  if (cached)
+  {
+    GCAfreeDensityCache(gca) ;
   }
   return(total_log_posterior) ;
 }
@@ -12331,7 +12448,8 @@ GCAmaxPosteriorBorders(GCA *gca, MRI *mri_inputs, MRI *mri_src,
                        MRI *mri_dst, TRANSFORM *transform,
                        int max_iter, float min_ratio)
 {
-  int      nchanged, x, y, z, width, height, depth, label, total_changed, i ;
+  int      nchanged, z, width, height, depth, total_changed, i, color,
+           cached ;
   MRI      *mri_tmp ;
 
   if (mri_src != mri_dst)
@@ -12345,55 +12463,69 @@ GCAmaxPosteriorBorders(GCA *gca, MRI *mri_inputs, MRI *mri_src,
   height = mri_src->height ;
   depth = mri_src->depth ;
 
+  cached = (gca->density_cache == NULL) ;
+  GCAcacheDensities(gca) ;
   for (total_changed = i = 0 ; i < max_iter ; i++)
   {
     nchanged = 0 ;
-    for (z = 0 ; z < depth ; z++)
+    // GCAmaxLikelihoodBorderLabel() temporarily relabels the voxel it is
+    // called on and reads its 6 neighbors, so process one red-black
+    // color at a time. New labels go into mri_tmp, so the result is the
+    // same as a sequential sweep.
+    for (color = 0 ; color < 2 ; color++)
     {
-      for (y = 0 ; y < height ; y++)
+#ifdef HAVE_OPENMP
+      #pragma omp parallel for reduction(+: nchanged) schedule(dynamic, 1)
+#endif
+      for (z = 0 ; z < depth ; z++)
       {
-        for (x = 0 ; x < width ; x++)
-        {
-          if (x == Ggca_x && y == Ggca_y && z == Ggca_z)
-          {
-            DiagBreak() ;
-          }
-          if (x == 99 && y == 129 && z == 127)
-          {
-            DiagBreak() ;  /* gray should be wm */
-          }
-          if (x == 98 && y == 124 && z == 127)
-          {
-            DiagBreak() ;  /* wm should be hippo */
-          }
+        int x, y, label ;
 
-          if (borderVoxel(mri_dst,x,y,z))
+        for (y = 0 ; y < height ; y++)
+        {
+          for (x = (y+z+color) & 1 ; x < width ; x += 2)
           {
-            label = GCAmaxLikelihoodBorderLabel(gca,
-                                                mri_inputs,
-                                                mri_dst,transform,
-                                                x, y, z, min_ratio) ;
-            if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
-                (label == Ggca_label
-                 || nint(MRIgetVoxVal(mri_tmp,x,y,z,0)) == Ggca_label ||
-                 Ggca_label < 0))
+            if (x == Ggca_x && y == Ggca_y && z == Ggca_z)
             {
               DiagBreak() ;
-
-              if (label != nint(MRIgetVoxVal(mri_dst, x, y, z,0)))
-                printf(
-                  "MLE (%d, %d, %d): old label %s (%d), "
-                  "new label %s (%d)\n",
-                  x, y, z,
-                  cma_label_to_name(nint(MRIgetVoxVal(mri_tmp,x,y,z,0))),
-                  nint(MRIgetVoxVal(mri_tmp,x,y,z,0)),
-                  cma_label_to_name(label),
-                  label) ;
             }
-            if (label != nint(MRIgetVoxVal(mri_dst, x, y, z,0)))
+            if (x == 99 && y == 129 && z == 127)
             {
-              nchanged++ ;
-              MRIsetVoxVal(mri_tmp, x, y, z, 0, label) ;
+              DiagBreak() ;  /* gray should be wm */
+            }
+            if (x == 98 && y == 124 && z == 127)
+            {
+              DiagBreak() ;  /* wm should be hippo */
+            }
+
+            if (borderVoxel(mri_dst,x,y,z))
+            {
+              label = GCAmaxLikelihoodBorderLabel(gca,
+                                                  mri_inputs,
+                                                  mri_dst,transform,
+                                                  x, y, z, min_ratio) ;
+              if (x == Ggca_x && y == Ggca_y && z == Ggca_z &&
+                  (label == Ggca_label
+                   || nint(MRIgetVoxVal(mri_tmp,x,y,z,0)) == Ggca_label ||
+                   Ggca_label < 0))
+              {
+                DiagBreak() ;
+
+                if (label != nint(MRIgetVoxVal(mri_dst, x, y, z,0)))
+                  printf(
+                    "MLE (%d, %d, %d): old label %s (%d), "
+                    "new label %s (%d)\n",
+                    x, y, z,
+                    cma_label_to_name(nint(MRIgetVoxVal(mri_tmp,x,y,z,0))),
+                    nint(MRIgetVoxVal(mri_tmp,x,y,z,0)),
+                    cma_label_to_name(label),
+                    label) ;
+              }
+              if (label != nint(MRIgetVoxVal(mri_dst, x, y, z,0)))
+              {
+                nchanged++ ;
+                MRIsetVoxVal(mri_tmp, x, y, z, 0, label) ;
+              }
             }
           }
         }
@@ -12407,6 +12539,10 @@ GCAmaxPosteriorBorders(GCA *gca, MRI *mri_inputs, MRI *mri_src,
     }
   }
 
+  if (cached)
+  {
+    GCAfreeDensityCache(gca) ;
+  }
   MRIfree(&mri_tmp) ;
   printf("%d border labels changed to MLE ...\n", total_changed) ;
   return(mri_dst) ;
@@ -16621,11 +16757,16 @@ GCAfindClosestValidGC(GCA *gca,
                       int check_var)
 {
   GC1D       *gc, *gc_min ;
-  int        x, y, z, n, wsize ;
+  int        x, y, z, n, wsize, tid ;
   double     dist, min_dist, det ;
   GCA_NODE   *gcan ;
-  static MATRIX     *m_cov_inv = NULL ;
+  static MATRIX     *m_cov_inv[_MAX_FS_THREADS] ;
 
+#ifdef HAVE_OPENMP
+  tid = omp_get_thread_num();
+#else
+  tid = 0;
+#endif
   min_dist = gca->node_width+gca->node_height+gca->node_depth ;
   wsize = 1 ;
   gc_min = NULL ;
@@ -16664,9 +16805,9 @@ GCAfindClosestValidGC(GCA *gca,
             }
             gc = &gcan->gcs[n] ;
             det = covariance_determinant(gc, gca->ninputs) ;
-            m_cov_inv =
-              load_inverse_covariance_matrix(gc, m_cov_inv, gca->ninputs) ;
-            if (m_cov_inv == NULL)
+            m_cov_inv[tid] =
+              load_inverse_covariance_matrix(gc, m_cov_inv[tid], gca->ninputs) ;
+            if (m_cov_inv[tid] == NULL)
             {
               det = -1 ;
             }
@@ -16931,8 +17072,15 @@ GCAcomputeConditionalLogDensity( const GC1D *gc,
   else   /* Gaussian distribution */
 #endif
   {
-    det = covariance_determinant(gc, ninputs) ;
-    log_p = -log(sqrt(det)) - .5*GCAmahDist(gc, vals, ninputs) ;
+    if (gc->inv_covars)   /* cached by GCAcacheDensities */
+    {
+      log_p = -gc->log_sqrt_det - .5*GCAmahDist(gc, vals, ninputs) ;
+    }
+    else
+    {
+      det = covariance_determinant(gc, ninputs) ;
+      log_p = -log(sqrt(det)) - .5*GCAmahDist(gc, vals, ninputs) ;
+    }
   }
   return(log_p) ;
 }
@@ -17433,6 +17581,13 @@ GCAfreeGibbs(GCA *gca)
         for (n = 0 ; n < gcan->nlabels ; n++)
         {
           gc = &gcan->gcs[n] ;
+          if (gca->flat)  /* owned by the .gcaf mapping */
+          {
+            gc->nlabels = NULL ;
+            gc->labels = NULL ;
+            gc->label_priors = NULL ;
+            continue ;
+          }
           for (i = 0 ; i < GIBBS_NEIGHBORS ; i++)
           {
             free(gc->label_priors[i]) ;
@@ -17594,9 +17749,9 @@ double
 GCAmahDist( const GC1D *gc,
             const float *vals, const int ninputs )
 {
-  static VECTOR *v_means = NULL, *v_vals = NULL ;
-  static MATRIX *m_cov = NULL, *m_cov_inv ;
-  int    i ;
+  static VECTOR *v_means[_MAX_FS_THREADS], *v_vals[_MAX_FS_THREADS] ;
+  static MATRIX *m_cov[_MAX_FS_THREADS], *m_cov_inv[_MAX_FS_THREADS] ;
+  int    i, tid ;
   double dsq ;
 
   if (ninputs == 1)
@@ -17606,46 +17761,68 @@ GCAmahDist( const GC1D *gc,
     dsq = v*v / gc->covars[0] ;
     return(dsq) ;
   }
+  if (gc->inv_covars)
+  {
+    /* same float arithmetic as the MatrixMultiply/VectorDot path below */
+    float  v[MAX_GCA_INPUTS], w, dot ;
+    int    j ;
+
+    for (i = 0 ; i < ninputs ; i++)
+    {
+      v[i] = gc->means[i] - vals[i] ;
+    }
+    for (dot = 0.0f, i = 0 ; i < ninputs ; i++)
+    {
+      for (w = 0.0f, j = 0 ; j < ninputs ; j++)
+      {
+        w += gc->inv_covars[i*ninputs+j] * v[j] ;
+      }
+      dot += v[i]*w ;
+    }
+    return(dot) ;
+  }
+#ifdef HAVE_OPENMP
+  tid = omp_get_thread_num();
+#else
+  tid = 0;
+#endif
   //printf("In GCAMahDist...ninputs = %d\n", ninputs);
-  if (v_vals && ninputs != v_vals->rows)
+  if (v_vals[tid] && ninputs != v_vals[tid]->rows)
   {
-    VectorFree(&v_vals) ;
+    VectorFree(&v_vals[tid]) ;
   }
-  if (v_means && ninputs != v_means->rows)
+  if (v_means[tid] && ninputs != v_means[tid]->rows)
   {
-    VectorFree(&v_means) ;
+    VectorFree(&v_means[tid]) ;
   }
-  if (m_cov && (ninputs != m_cov->rows || ninputs != m_cov->cols))
+  if (m_cov[tid] && (ninputs != m_cov[tid]->rows || ninputs != m_cov[tid]->cols))
   {
-    MatrixFree(&m_cov) ;
-    MatrixFree(&m_cov_inv) ;
+    MatrixFree(&m_cov[tid]) ;
+    MatrixFree(&m_cov_inv[tid]) ;
   }
-  v_means = load_mean_vector(gc, v_means, ninputs) ;
-  //  MatrixPrint(stdout,v_means); //lz
-  m_cov = load_covariance_matrix(gc, m_cov, ninputs) ;
-  //  MatrixPrint(stdout,m_cov); //lz
-  if (v_vals == NULL)
+  v_means[tid] = load_mean_vector(gc, v_means[tid], ninputs) ;
+  m_cov[tid] = load_covariance_matrix(gc, m_cov[tid], ninputs) ;
+  if (v_vals[tid] == NULL)
   {
-    v_vals = VectorClone(v_means) ;
+    v_vals[tid] = VectorClone(v_means[tid]) ;
   }
   for (i = 0 ; i < ninputs ; i++)
   {
-    VECTOR_ELT(v_vals, i+1) = vals[i] ;
+    VECTOR_ELT(v_vals[tid], i+1) = vals[i] ;
   }
 
-  VectorSubtract(v_means, v_vals, v_vals) ;  /* v_vals now has mean removed */
-  //MatrixPrint(stdout,v_vals); //lz
-  m_cov_inv = MatrixInverse(m_cov, m_cov_inv) ;
-  //MatrixPrint(stdout,m_cov_inv); //lz
-  if (!m_cov_inv)
+  /* v_vals now has mean removed */
+  VectorSubtract(v_means[tid], v_vals[tid], v_vals[tid]) ;
+  m_cov_inv[tid] = MatrixInverse(m_cov[tid], m_cov_inv[tid]) ;
+  if (!m_cov_inv[tid])
   {
     ErrorExit(ERROR_BADPARM, "singular covariance matrix!") ;
   }
-  MatrixSVDInverse(m_cov, m_cov_inv) ;
+  MatrixSVDInverse(m_cov[tid], m_cov_inv[tid]) ;
 
-  MatrixMultiply(m_cov_inv, v_vals, v_means) ;
+  MatrixMultiply(m_cov_inv[tid], v_vals[tid], v_means[tid]) ;
   /* v_means is now inverse(cov) * v_vals */
-  dsq = VectorDot(v_vals, v_means) ;
+  dsq = VectorDot(v_vals[tid], v_means[tid]) ;
 
   return(dsq);
 }
@@ -17847,6 +18024,140 @@ covariance_determinant( const GC1D *gc, const int ninputs)
   return(det) ;
 }
 
+/*-----------------------------------------------------
+  GCAcacheDensities() - compute the inverse covariance and
+  log(sqrt(det)) of every classifier once, so that
+  GCAcomputeConditionalLogDensity() and GCAmahDist() don't redo the
+  matrix work at every voxel they are evaluated at. The cached values
+  are computed exactly as the uncached path computes them, so results
+  don't change. Classifiers with singular covariances are left
+  uncached and take the original path (and its error reporting).
+  The cache must be freed with GCAfreeDensityCache() before any
+  covariance is modified.
+  ------------------------------------------------------*/
+int
+GCAcacheDensities(GCA *gca)
+{
+  int    x, ninputs, nsq ;
+  long   *x_offsets, ngcs ;
+  float  *cache ;
+
+  if (gca->density_cache)
+  {
+    return(NO_ERROR) ;
+  }
+
+  ninputs = gca->ninputs ;
+  nsq = ninputs*ninputs ;
+  x_offsets = (long *)calloc(gca->node_width+1, sizeof(long)) ;
+  if (!x_offsets)
+    ErrorReturn(ERROR_NOMEMORY,
+                (ERROR_NOMEMORY, "GCAcacheDensities: could not allocate offsets")) ;
+  for (ngcs = x = 0 ; x < gca->node_width ; x++)
+  {
+    int y, z ;
+
+    x_offsets[x] = ngcs ;
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        ngcs += gca->nodes[x][y][z].nlabels ;
+      }
+  }
+  x_offsets[gca->node_width] = ngcs ;
+
+  cache = (float *)calloc(ngcs*nsq+1, sizeof(float)) ;
+  if (!cache)
+  {
+    free(x_offsets) ;
+    ErrorReturn(ERROR_NOMEMORY,
+                (ERROR_NOMEMORY,
+                 "GCAcacheDensities: could not allocate cache for %ld gcs",
+                 ngcs)) ;
+  }
+  gca->density_cache = cache ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (x = 0 ; x < gca->node_width ; x++)
+  {
+    int      y, z, n, i, j ;
+    float    *inv_covars ;
+    GCA_NODE *gcan ;
+    GC1D     *gc ;
+    MATRIX   *m_cov = NULL, *m_inv = NULL ;
+
+    inv_covars = gca->density_cache + x_offsets[x]*nsq ;
+    if (ninputs > 1)
+    {
+      m_cov = MatrixAlloc(ninputs, ninputs, MATRIX_REAL) ;
+      m_inv = MatrixAlloc(ninputs, ninputs, MATRIX_REAL) ;
+    }
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        gcan = &gca->nodes[x][y][z] ;
+        for (n = 0 ; n < gcan->nlabels ; n++, inv_covars += nsq)
+        {
+          gc = &gcan->gcs[n] ;
+          if (ninputs == 1)
+          {
+            inv_covars[0] = 1.0f / gc->covars[0] ;
+          }
+          else
+          {
+            load_covariance_matrix(gc, m_cov, ninputs) ;
+            if (MatrixInverse(m_cov, m_inv) == NULL)
+            {
+              continue ;
+            }
+            MatrixSVDInverse(m_cov, m_inv) ;
+            for (i = 0 ; i < ninputs ; i++)
+              for (j = 0 ; j < ninputs ; j++)
+              {
+                inv_covars[i*ninputs+j] = *MATRIX_RELT(m_inv, i+1, j+1) ;
+              }
+          }
+          gc->log_sqrt_det = log(sqrt(covariance_determinant(gc, ninputs))) ;
+          gc->inv_covars = inv_covars ;
+        }
+      }
+    if (m_cov)
+    {
+      MatrixFree(&m_cov) ;
+      MatrixFree(&m_inv) ;
+    }
+  }
+
+  free(x_offsets) ;
+  return(NO_ERROR) ;
+}
+
+int
+GCAfreeDensityCache(GCA *gca)
+{
+  int  x, y, z, n ;
+
+  if (gca->density_cache == NULL)
+  {
+    return(NO_ERROR) ;
+  }
+  for (x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        GCA_NODE *gcan = &gca->nodes[x][y][z] ;
+        for (n = 0 ; n < gcan->nlabels ; n++)
+        {
+          gcan->gcs[n].inv_covars = NULL ;
+        }
+      }
+  free(gca->density_cache) ;
+  gca->density_cache = NULL ;
+  return(NO_ERROR) ;
+}
+
 static double
 gcaComputeSampleLogDensity(GCA_SAMPLE *gcas, float *vals, int ninputs)
 {
@@ -25580,6 +25891,10 @@ GCA *GCAcompactify(GCA *gca)
   int i,j, k;
   double byteSaved = 0.;
 
+  if (gca->flat)  // a mapped .gcaf is already packed
+  {
+    return(gca) ;
+  }
   width = gca->prior_width;
   height = gca->prior_height;
   depth = gca->prior_depth;
@@ -30212,6 +30527,7 @@ GCAinsertLabels(GCA *gca, MRI *mri, TRANSFORM *transform, int ninsertions,
   GCA_NODE  *gcan ;
   GCA_PRIOR *gcap ;
 
+  GCAunmap(gca) ;  // node arrays are reallocated below
   for (l = 0 ; l < ninsertions ; l++)
   {
     whalf = insert_whalf[l] ;
@@ -0,0 +1,952 @@
+/**
+ * @file  gcaflat.c
+ * @brief flat, mmap-able GCA atlas format
+ *
+ * GCAread() of a legacy .gca parses every node and prior and makes
+ * separate allocations for every labels, gcs, means, covars and
+ * neighbor array, which for the RB_all atlases costs tens of seconds
+ * and a few million small mallocs per process. A .gcaf file stores the
+ * same atlas as a header followed by flat arrays, indexed by offset
+ * tables the same way GCAlinearNode and GCAlinearPrior lay out their
+ * data (offsets into a per-GC1D array per node, and into a per-label
+ * array per GC1D neighbor direction), generalized to any ninputs.
+ *
+ * GCAreadFlat() maps the file MAP_PRIVATE and points the usual
+ * GCA_NODE/GCA_PRIOR/GC1D structures directly into it, so loading only
+ * allocates the node/prior grids and one GC1D array, and unmodified
+ * pages are shared through the page cache by every process using the
+ * same atlas. Values may be changed in place (copy-on-write); code that
+ * reallocates node or prior arrays calls GCAunmap() first, which moves
+ * the atlas back to ordinary heap allocations.
+ *
+ * Files are written in host byte order with a byte-order mark, and all
+ * arrays start on GCAF_ALIGN byte boundaries.
+ *
+ * Knobs: FS_GCA_NO_MMAP reads the file into memory instead of mapping
+ * it. FS_GCA_PREFER_FLAT makes GCAread(foo.gca) use foo.gcaf when that
+ * is at least as new.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "gca.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+#include "utils.h"
+#include "colortab.h"
+#include "znzlib.h"
+
+#define GCAF_ALIGN       64
+#define GCAF_BYTE_ORDER  0x01020304
+
+// sections, in file order
+#define GCAF_NODE_OFFSETS     0   // long long [nnodes+1]: first GC1D of node
+#define GCAF_NODE_TRAINING    1   // int       [nnodes]
+#define GCAF_NODE_LABELS      2   // ushort    [ngcs]
+#define GCAF_GC_MEANS         3   // float     [ngcs*ninputs]
+#define GCAF_GC_COVARS        4   // float     [ngcs*ncovars]
+#define GCAF_GC_NTRAINING     5   // int       [ngcs]
+#define GCAF_GC_NJUST_PRIORS  6   // short     [ngcs]
+#define GCAF_GC_REGULARIZED   7   // char      [ngcs]
+#define GCAF_GC_NBR_NLABELS   8   // short     [ngcs*GIBBS_NEIGHBORS]
+#define GCAF_NBR_OFFSETS      9   // long long [ngcs*GIBBS_NEIGHBORS+1]
+#define GCAF_NBR_LABELS      10   // ushort    [nnbrs]
+#define GCAF_NBR_PRIORS      11   // float     [nnbrs]
+#define GCAF_PRIOR_OFFSETS   12   // long long [npriors+1]
+#define GCAF_PRIOR_TRAINING  13   // int       [npriors]
+#define GCAF_PRIOR_LABELS    14   // ushort    [nprior_labels]
+#define GCAF_PRIOR_PRIORS    15   // float     [nprior_labels]
+#define GCAF_NSECTIONS       16
+
+typedef struct
+{
+  char      magic[8] ;
+  int       version ;
+  int       byte_order ;
+  int       header_bytes ;
+  int       ninputs ;
+  int       flags ;
+  int       type ;
+  int       max_label ;
+  int       total_training ;
+  float     prior_spacing ;
+  float     node_spacing ;
+  int       node_width, node_height, node_depth ;
+  int       prior_width, prior_height, prior_depth ;
+  int       width, height, depth ;
+  float     xsize, ysize, zsize ;
+  float     x_r, x_a, x_s, y_r, y_a, y_s, z_r, z_a, z_s, c_r, c_a, c_s ;
+  double    TRs[MAX_GCA_INPUTS] ;
+  double    FAs[MAX_GCA_INPUTS] ;
+  double    TEs[MAX_GCA_INPUTS] ;
+  long long ngcs ;
+  long long nnbrs ;
+  long long nprior_labels ;
+  long long section_offset[GCAF_NSECTIONS] ;
+  long long section_bytes[GCAF_NSECTIONS] ;
+  long long ct_offset ;     // 0 if there is no colortable
+  long long file_bytes ;
+} GCAF_HEADER ;
+
+// what a mapped GCA owns besides the node and prior grids
+typedef struct
+{
+  void           *base ;
+  size_t         bytes ;
+  int            mapped ;          // base is an mmap, not a malloc
+  GC1D           *gcs ;
+  unsigned short **nbr_labels ;    // [ngcs*GIBBS_NEIGHBORS]
+  float          **nbr_priors ;
+} GCAF_MAP ;
+
+static size_t
+gcafAlign(size_t off)
+{
+  return((off + GCAF_ALIGN-1) & ~(size_t)(GCAF_ALIGN-1)) ;
+}
+
+/*-----------------------------------------------------
+  GCAisFlatFile() - does fname start with the .gcaf magic
+  ------------------------------------------------------*/
+int
+GCAisFlatFile(const char *fname)
+{
+  FILE *fp ;
+  char magic[8] ;
+  int  is_flat ;
+
+  fp = fopen(fname, "rb") ;
+  if (fp == NULL)
+    return(0) ;
+  is_flat = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+            !memcmp(magic, GCA_FLAT_MAGIC, sizeof(magic)) ;
+  fclose(fp) ;
+  return(is_flat) ;
+}
+
+/*-----------------------------------------------------
+  GCAflatSidecar() - fill in the .gcaf name for a legacy
+  atlas (foo.gca -> foo.gcaf, foo.gcz -> foo.gcz.gcaf) and
+  return 1 if that file exists, is flat and is at least as
+  new as fname.
+  ------------------------------------------------------*/
+int
+GCAflatSidecar(const char *fname, char *flat_fname)
+{
+  struct stat st_src, st_flat ;
+  size_t      len = strlen(fname) ;
+
+  if (len > 4 && !strcmp(fname+len-4, ".gca"))
+    sprintf(flat_fname, "%sf", fname) ;
+  else
+    sprintf(flat_fname, "%s%s", fname, GCA_FLAT_EXTENSION) ;
+  if (stat(fname, &st_src) || stat(flat_fname, &st_flat))
+    return(0) ;
+  if (st_flat.st_mtime < st_src.st_mtime)
+    return(0) ;
+  return(GCAisFlatFile(flat_fname)) ;
+}
+
+// ======================================================
+// writing
+
+static int
+gcafWriteSection(znzFile file, GCAF_HEADER *hdr, int section,
+                 const void *data, size_t bytes)
+{
+  static const char zeros[GCAF_ALIGN] = { 0 } ;
+  long              pos = znztell(file) ;
+  size_t            pad = gcafAlign(pos) - pos ;
+
+  if (pad > 0 && znzwrite((void *)zeros, 1, pad, file) != pad)
+    return(ERROR_BADFILE) ;
+  hdr->section_offset[section] = pos + pad ;
+  hdr->section_bytes[section] = bytes ;
+  if (bytes > 0 && znzwrite((void *)data, 1, bytes, file) != bytes)
+    return(ERROR_BADFILE) ;
+  return(NO_ERROR) ;
+}
+
+#define GCAF_WRITE(sec, ptr, n)                                          \
+  if (gcafWriteSection(file, &hdr, sec, ptr, (n)*sizeof(*(ptr))) != NO_ERROR)\
+  {                                                                     \
+    znzclose(file) ;                                                    \
+    ErrorReturn(ERROR_BADFILE,                                          \
+                (ERROR_BADFILE, "GCAwriteFlat(%s): write failed", fname)) ;\
+  }
+
+/*-----------------------------------------------------
+  GCAwriteFlat() - write gca in the flat .gcaf format
+  ------------------------------------------------------*/
+int
+GCAwriteFlat(GCA *gca, const char *fname)
+{
+  znzFile     file ;
+  GCAF_HEADER hdr ;
+  int         x, y, z, n, d, ncovars, nmrf ;
+  long long   nnodes, npriors, ngcs, nnbrs, nplabels, i, j, g ;
+  long long   *offsets ;
+  int         *ibuf ;
+  short       *sbuf ;
+  char        *cbuf ;
+  float       *fbuf ;
+  unsigned short *ubuf ;
+
+  nmrf = !(gca->flags & GCA_NO_MRF) ;
+  ncovars = gca->ninputs*(gca->ninputs+1)/2 ;
+  nnodes = (long long)gca->node_width*gca->node_height*gca->node_depth ;
+  npriors = (long long)gca->prior_width*gca->prior_height*gca->prior_depth ;
+
+  ngcs = nnbrs = nplabels = 0 ;
+  for (x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        GCA_NODE *gcan = &gca->nodes[x][y][z] ;
+        ngcs += gcan->nlabels ;
+        if (nmrf)
+          for (n = 0 ; n < gcan->nlabels ; n++)
+            for (d = 0 ; d < GIBBS_NEIGHBORS ; d++)
+              nnbrs += gcan->gcs[n].nlabels[d] ;
+      }
+  for (x = 0 ; x < gca->prior_width ; x++)
+    for (y = 0 ; y < gca->prior_height ; y++)
+      for (z = 0 ; z < gca->prior_depth ; z++)
+        nplabels += gca->priors[x][y][z].nlabels ;
+
+  memset(&hdr, 0, sizeof(hdr)) ;
+  memcpy(hdr.magic, GCA_FLAT_MAGIC, sizeof(hdr.magic)) ;
+  hdr.version = GCA_FLAT_VERSION ;
+  hdr.byte_order = GCAF_BYTE_ORDER ;
+  hdr.header_bytes = sizeof(hdr) ;
+  hdr.ninputs = gca->ninputs ;
+  hdr.flags = gca->flags ;
+  hdr.type = gca->type ;
+  hdr.max_label = gca->max_label ;
+  hdr.total_training = gca->total_training ;
+  hdr.prior_spacing = gca->prior_spacing ;
+  hdr.node_spacing = gca->node_spacing ;
+  hdr.node_width = gca->node_width ;
+  hdr.node_height = gca->node_height ;
+  hdr.node_depth = gca->node_depth ;
+  hdr.prior_width = gca->prior_width ;
+  hdr.prior_height = gca->prior_height ;
+  hdr.prior_depth = gca->prior_depth ;
+  hdr.width = gca->width ;
+  hdr.height = gca->height ;
+  hdr.depth = gca->depth ;
+  hdr.xsize = gca->xsize ;
+  hdr.ysize = gca->ysize ;
+  hdr.zsize = gca->zsize ;
+  hdr.x_r = gca->x_r ;
+  hdr.x_a = gca->x_a ;
+  hdr.x_s = gca->x_s ;
+  hdr.y_r = gca->y_r ;
+  hdr.y_a = gca->y_a ;
+  hdr.y_s = gca->y_s ;
+  hdr.z_r = gca->z_r ;
+  hdr.z_a = gca->z_a ;
+  hdr.z_s = gca->z_s ;
+  hdr.c_r = gca->c_r ;
+  hdr.c_a = gca->c_a ;
+  hdr.c_s = gca->c_s ;
+  memmove(hdr.TRs, gca->TRs, sizeof(hdr.TRs)) ;
+  memmove(hdr.FAs, gca->FAs, sizeof(hdr.FAs)) ;
+  memmove(hdr.TEs, gca->TEs, sizeof(hdr.TEs)) ;
+  hdr.ngcs = ngcs ;
+  hdr.nnbrs = nnbrs ;
+  hdr.nprior_labels = nplabels ;
+
+  file = znzopen(fname, "wb", 0) ;
+  if (znz_isnull(file))
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "GCAwriteFlat(%s): could not open file",
+                 fname)) ;
+  // placeholder, rewritten once the section offsets are known
+  znzwrite(&hdr, sizeof(hdr), 1, file) ;
+
+  // nodes
+  offsets = (long long *)calloc(MAX(nnodes, npriors)+1, sizeof(long long)) ;
+  ibuf = (int *)calloc(MAX(nnodes, npriors)+1, sizeof(int)) ;
+  if (!offsets || !ibuf)
+    ErrorExit(ERROR_NOMEMORY, "GCAwriteFlat: could not allocate offsets") ;
+  for (i = g = x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++, i++)
+      {
+        offsets[i] = g ;
+        ibuf[i] = gca->nodes[x][y][z].total_training ;
+        g += gca->nodes[x][y][z].nlabels ;
+      }
+  offsets[nnodes] = g ;
+  GCAF_WRITE(GCAF_NODE_OFFSETS, offsets, nnodes+1) ;
+  GCAF_WRITE(GCAF_NODE_TRAINING, ibuf, nnodes) ;
+  free(offsets) ;
+  free(ibuf) ;
+
+  // per-GC1D arrays
+  ubuf = (unsigned short *)calloc(ngcs+1, sizeof(unsigned short)) ;
+  fbuf = (float *)calloc(ngcs*MAX(gca->ninputs, ncovars)+1, sizeof(float)) ;
+  ibuf = (int *)calloc(ngcs+1, sizeof(int)) ;
+  sbuf = (short *)calloc(ngcs*GIBBS_NEIGHBORS+1, sizeof(short)) ;
+  cbuf = (char *)calloc(ngcs+1, sizeof(char)) ;
+  if (!ubuf || !fbuf || !ibuf || !sbuf || !cbuf)
+    ErrorExit(ERROR_NOMEMORY, "GCAwriteFlat: could not allocate %lld gcs",
+              ngcs) ;
+#define FOR_ALL_NODE_LABELS(body)                                       \
+  for (g = x = 0 ; x < gca->node_width ; x++)                           \
+    for (y = 0 ; y < gca->node_height ; y++)                            \
+      for (z = 0 ; z < gca->node_depth ; z++)                           \
+      {                                                                 \
+        GCA_NODE *gcan = &gca->nodes[x][y][z] ;                         \
+        for (n = 0 ; n < gcan->nlabels ; n++, g++)                      \
+        {                                                               \
+          body ;                                                        \
+        }                                                               \
+      }
+#define FOR_ALL_GCS(body)                                               \
+  FOR_ALL_NODE_LABELS(GC1D *gc = &gcan->gcs[n] ; body)
+
+  FOR_ALL_NODE_LABELS(ubuf[g] = gcan->labels[n]) ;
+  GCAF_WRITE(GCAF_NODE_LABELS, ubuf, ngcs) ;
+  FOR_ALL_GCS(memmove(fbuf+g*gca->ninputs, gc->means,
+                      gca->ninputs*sizeof(float))) ;
+  GCAF_WRITE(GCAF_GC_MEANS, fbuf, ngcs*gca->ninputs) ;
+  FOR_ALL_GCS(memmove(fbuf+g*ncovars, gc->covars, ncovars*sizeof(float))) ;
+  GCAF_WRITE(GCAF_GC_COVARS, fbuf, ngcs*ncovars) ;
+  FOR_ALL_GCS(ibuf[g] = gc->ntraining) ;
+  GCAF_WRITE(GCAF_GC_NTRAINING, ibuf, ngcs) ;
+  FOR_ALL_GCS(sbuf[g] = gc->n_just_priors) ;
+  GCAF_WRITE(GCAF_GC_NJUST_PRIORS, sbuf, ngcs) ;
+  FOR_ALL_GCS(cbuf[g] = gc->regularized) ;
+  GCAF_WRITE(GCAF_GC_REGULARIZED, cbuf, ngcs) ;
+  free(ubuf) ;
+  free(fbuf) ;
+  free(ibuf) ;
+  free(cbuf) ;
+
+  // gibbs neighbor label priors
+  if (nmrf)
+  {
+    offsets = (long long *)calloc(ngcs*GIBBS_NEIGHBORS+1, sizeof(long long)) ;
+    ubuf = (unsigned short *)calloc(nnbrs+1, sizeof(unsigned short)) ;
+    fbuf = (float *)calloc(nnbrs+1, sizeof(float)) ;
+    if (!offsets || !ubuf || !fbuf)
+      ErrorExit(ERROR_NOMEMORY,
+                "GCAwriteFlat: could not allocate %lld neighbor labels",
+                nnbrs) ;
+    j = 0 ;
+    FOR_ALL_GCS(
+      for (d = 0 ; d < GIBBS_NEIGHBORS ; d++)
+      {
+        sbuf[g*GIBBS_NEIGHBORS+d] = gc->nlabels[d] ;
+        offsets[g*GIBBS_NEIGHBORS+d] = j ;
+        for (i = 0 ; i < gc->nlabels[d] ; i++, j++)
+        {
+          ubuf[j] = gc->labels[d][i] ;
+          fbuf[j] = gc->label_priors[d][i] ;
+        }
+      }) ;
+    offsets[ngcs*GIBBS_NEIGHBORS] = j ;
+    GCAF_WRITE(GCAF_GC_NBR_NLABELS, sbuf, ngcs*GIBBS_NEIGHBORS) ;
+    GCAF_WRITE(GCAF_NBR_OFFSETS, offsets, ngcs*GIBBS_NEIGHBORS+1) ;
+    GCAF_WRITE(GCAF_NBR_LABELS, ubuf, nnbrs) ;
+    GCAF_WRITE(GCAF_NBR_PRIORS, fbuf, nnbrs) ;
+    free(offsets) ;
+    free(ubuf) ;
+    free(fbuf) ;
+  }
+  free(sbuf) ;
+#undef FOR_ALL_GCS
+#undef FOR_ALL_NODE_LABELS
+
+  // priors
+  offsets = (long long *)calloc(npriors+1, sizeof(long long)) ;
+  ibuf = (int *)calloc(npriors+1, sizeof(int)) ;
+  ubuf = (unsigned short *)calloc(nplabels+1, sizeof(unsigned short)) ;
+  fbuf = (float *)calloc(nplabels+1, sizeof(float)) ;
+  if (!offsets || !ibuf || !ubuf || !fbuf)
+    ErrorExit(ERROR_NOMEMORY, "GCAwriteFlat: could not allocate priors") ;
+  for (i = j = x = 0 ; x < gca->prior_width ; x++)
+    for (y = 0 ; y < gca->prior_height ; y++)
+      for (z = 0 ; z < gca->prior_depth ; z++, i++)
+      {
+        GCA_PRIOR *gcap = &gca->priors[x][y][z] ;
+
+        offsets[i] = j ;
+        ibuf[i] = gcap->total_training ;
+        for (n = 0 ; n < gcap->nlabels ; n++, j++)
+        {
+          ubuf[j] = gcap->labels[n] ;
+          fbuf[j] = gcap->priors[n] ;
+        }
+      }
+  offsets[npriors] = j ;
+  GCAF_WRITE(GCAF_PRIOR_OFFSETS, offsets, npriors+1) ;
+  GCAF_WRITE(GCAF_PRIOR_TRAINING, ibuf, npriors) ;
+  GCAF_WRITE(GCAF_PRIOR_LABELS, ubuf, nplabels) ;
+  GCAF_WRITE(GCAF_PRIOR_PRIORS, fbuf, nplabels) ;
+  free(offsets) ;
+  free(ibuf) ;
+  free(ubuf) ;
+  free(fbuf) ;
+
+  if (gca->ct)
+  {
+    hdr.ct_offset = znztell(file) ;
+    znzCTABwriteIntoBinary(gca->ct, file) ;
+  }
+  hdr.file_bytes = znztell(file) ;
+  znzseek(file, 0, SEEK_SET) ;
+  if (znzwrite(&hdr, sizeof(hdr), 1, file) != 1)
+  {
+    znzclose(file) ;
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAwriteFlat(%s): write failed", fname)) ;
+  }
+  znzclose(file) ;
+  return(NO_ERROR) ;
+}
+
+// ======================================================
+// reading
+
+static void
+gcafFreeMap(GCAF_MAP *map)
+{
+  free(map->gcs) ;
+  free(map->nbr_labels) ;
+  free(map->nbr_priors) ;
+  if (map->mapped)
+    munmap(map->base, map->bytes) ;
+  else
+    free(map->base) ;
+  free(map) ;
+}
+
+/*-----------------------------------------------------
+  gcafCheckOffsets() - an offset table of n+1 entries must
+  start at 0, be non-decreasing with steps of at most
+  max_step and end at total, so that every entry indexes
+  within the (already size-checked) data section.
+  ------------------------------------------------------*/
+static int
+gcafCheckOffsets(const long long *offsets, long long n, long long total,
+                 long long max_step)
+{
+  long long i ;
+
+  if (offsets[0] != 0 || offsets[n] != total)
+    return(0) ;
+  for (i = 0 ; i < n ; i++)
+    if (offsets[i+1] < offsets[i] || offsets[i+1] - offsets[i] > max_step)
+      return(0) ;
+  return(1) ;
+}
+
+static int
+gcafCheckHeader(const GCAF_HEADER *hdr, size_t file_bytes, const char *fname)
+{
+  long long counts[GCAF_NSECTIONS], nnodes, npriors, ngcs ;
+  size_t    sizes[GCAF_NSECTIONS] =
+  {
+    sizeof(long long), sizeof(int), sizeof(unsigned short), sizeof(float),
+    sizeof(float), sizeof(int), sizeof(short), sizeof(char),
+    sizeof(short), sizeof(long long), sizeof(unsigned short), sizeof(float),
+    sizeof(long long), sizeof(int), sizeof(unsigned short), sizeof(float)
+  } ;
+  int       s, nmrf ;
+  long long i ;
+  const char *base = (const char *)hdr ;
+  const long long *offsets ;
+  const short *nbr_nlabels ;
+
+  if (memcmp(hdr->magic, GCA_FLAT_MAGIC, sizeof(hdr->magic)))
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): not a flat GCA", fname)) ;
+  if (hdr->byte_order != GCAF_BYTE_ORDER)
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): written on a host with a "
+                 "different byte order, regenerate it from the .gca", fname)) ;
+  if (hdr->version != GCA_FLAT_VERSION ||
+      hdr->header_bytes != (int)sizeof(GCAF_HEADER))
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): version %d found, "
+                 "%d expected", fname, hdr->version, GCA_FLAT_VERSION)) ;
+  if ((size_t)hdr->file_bytes != file_bytes)
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): truncated (%lld of %lld "
+                 "bytes)", fname, (long long)file_bytes, hdr->file_bytes)) ;
+  if (hdr->ninputs < 1 || hdr->ninputs > MAX_GCA_INPUTS)
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): bad ninputs %d",
+                 fname, hdr->ninputs)) ;
+
+  if (hdr->node_width <= 0 || hdr->node_height <= 0 || hdr->node_depth <= 0 ||
+      hdr->prior_width <= 0 || hdr->prior_height <= 0 ||
+      hdr->prior_depth <= 0 || hdr->ngcs < 0 || hdr->nnbrs < 0 ||
+      hdr->nprior_labels < 0)
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): bad dimensions or counts",
+                 fname)) ;
+
+  nmrf = !(hdr->flags & GCA_NO_MRF) ;
+  nnodes = (long long)hdr->node_width*hdr->node_height*hdr->node_depth ;
+  npriors = (long long)hdr->prior_width*hdr->prior_height*hdr->prior_depth ;
+  ngcs = hdr->ngcs ;
+  counts[GCAF_NODE_OFFSETS] = nnodes+1 ;
+  counts[GCAF_NODE_TRAINING] = nnodes ;
+  counts[GCAF_NODE_LABELS] = ngcs ;
+  counts[GCAF_GC_MEANS] = ngcs*hdr->ninputs ;
+  counts[GCAF_GC_COVARS] = ngcs*(hdr->ninputs*(hdr->ninputs+1)/2) ;
+  counts[GCAF_GC_NTRAINING] = ngcs ;
+  counts[GCAF_GC_NJUST_PRIORS] = ngcs ;
+  counts[GCAF_GC_REGULARIZED] = ngcs ;
+  counts[GCAF_GC_NBR_NLABELS] = nmrf ? ngcs*GIBBS_NEIGHBORS : 0 ;
+  counts[GCAF_NBR_OFFSETS] = nmrf ? ngcs*GIBBS_NEIGHBORS+1 : 0 ;
+  counts[GCAF_NBR_LABELS] = nmrf ? hdr->nnbrs : 0 ;
+  counts[GCAF_NBR_PRIORS] = nmrf ? hdr->nnbrs : 0 ;
+  counts[GCAF_PRIOR_OFFSETS] = npriors+1 ;
+  counts[GCAF_PRIOR_TRAINING] = npriors ;
+  counts[GCAF_PRIOR_LABELS] = hdr->nprior_labels ;
+  counts[GCAF_PRIOR_PRIORS] = hdr->nprior_labels ;
+  for (s = 0 ; s < GCAF_NSECTIONS ; s++)
+  {
+    if (counts[s] == 0)
+      continue ;
+    if (hdr->section_bytes[s] != counts[s]*(long long)sizes[s] ||
+        hdr->section_offset[s] % GCAF_ALIGN ||
+        hdr->section_offset[s] < (long long)sizeof(GCAF_HEADER) ||
+        hdr->section_offset[s]+hdr->section_bytes[s] > hdr->file_bytes)
+      ErrorReturn(ERROR_BADFILE,
+                  (ERROR_BADFILE, "GCAreadFlat(%s): section %d corrupt",
+                   fname, s)) ;
+  }
+
+  // the offset tables index the other sections directly
+  offsets = (const long long *)(base + hdr->section_offset[GCAF_NODE_OFFSETS]) ;
+  if (!gcafCheckOffsets(offsets, nnodes, ngcs, INT_MAX))
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): node offsets corrupt",
+                 fname)) ;
+  offsets = (const long long *)(base + hdr->section_offset[GCAF_PRIOR_OFFSETS]) ;
+  if (!gcafCheckOffsets(offsets, npriors, hdr->nprior_labels, SHRT_MAX))
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "GCAreadFlat(%s): prior offsets corrupt",
+                 fname)) ;
+  if (nmrf)
+  {
+    offsets = (const long long *)(base + hdr->section_offset[GCAF_NBR_OFFSETS]) ;
+    nbr_nlabels =
+      (const short *)(base + hdr->section_offset[GCAF_GC_NBR_NLABELS]) ;
+    if (!gcafCheckOffsets(offsets, ngcs*GIBBS_NEIGHBORS, hdr->nnbrs, SHRT_MAX))
+      ErrorReturn(ERROR_BADFILE,
+                  (ERROR_BADFILE, "GCAreadFlat(%s): neighbor offsets corrupt",
+                   fname)) ;
+    for (i = 0 ; i < ngcs*GIBBS_NEIGHBORS ; i++)
+      if (nbr_nlabels[i] != offsets[i+1] - offsets[i])
+        ErrorReturn(ERROR_BADFILE,
+                    (ERROR_BADFILE, "GCAreadFlat(%s): neighbor label counts "
+                     "do not match their offsets", fname)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  GCAreadFlat() - map a .gcaf file and build a GCA whose
+  node and prior arrays point into the mapping.
+  ------------------------------------------------------*/
+GCA *
+GCAreadFlat(const char *fname)
+{
+  GCA         *gca ;
+  GCAF_MAP    *map ;
+  GCAF_HEADER *hdr ;
+  struct stat st ;
+  int         fd, x, y, z, nmrf, ncovars ;
+  long long   i, ngcs ;
+  char        *base ;
+  long long   *node_offsets, *nbr_offsets, *prior_offsets ;
+  int         *node_training, *prior_training, *gc_ntraining ;
+  unsigned short *node_labels, *nbr_labels, *prior_labels ;
+  float       *means, *covars, *nbr_priors, *prior_priors ;
+  short       *gc_njust, *nbr_nlabels ;
+  char        *gc_regularized ;
+
+  fd = open(fname, O_RDONLY) ;
+  if (fd < 0)
+    ErrorReturn(NULL, (ERROR_NOFILE, "GCAreadFlat(%s): could not open file",
+                       fname)) ;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(GCAF_HEADER))
+  {
+    close(fd) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GCAreadFlat(%s): file too short",
+                       fname)) ;
+  }
+
+  map = (GCAF_MAP *)calloc(1, sizeof(GCAF_MAP)) ;
+  if (!map)
+    ErrorExit(ERROR_NOMEMORY, "GCAreadFlat: could not allocate map") ;
+  map->bytes = st.st_size ;
+  if (getenv("FS_GCA_NO_MMAP") == NULL)
+  {
+    map->base = mmap(NULL, map->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0) ;
+    if (map->base == MAP_FAILED)
+      map->base = NULL ;
+    else
+      map->mapped = 1 ;
+  }
+  if (map->base == NULL)
+  {
+    size_t nread = 0 ;
+    ssize_t n ;
+
+    map->base = malloc(map->bytes) ;
+    if (!map->base)
+      ErrorExit(ERROR_NOMEMORY, "GCAreadFlat(%s): could not allocate %lu",
+                fname, (unsigned long)map->bytes) ;
+    while (nread < map->bytes &&
+           (n = read(fd, (char *)map->base+nread, map->bytes-nread)) > 0)
+      nread += n ;
+    if (nread != map->bytes)
+    {
+      close(fd) ;
+      gcafFreeMap(map) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "GCAreadFlat(%s): read failed",
+                         fname)) ;
+    }
+  }
+  close(fd) ;
+
+  base = (char *)map->base ;
+  hdr = (GCAF_HEADER *)base ;
+  if (gcafCheckHeader(hdr, map->bytes, fname) != NO_ERROR)
+  {
+    gcafFreeMap(map) ;
+    return(NULL) ;
+  }
+
+  gca = gcaAllocMax(hdr->ninputs, hdr->prior_spacing, hdr->node_spacing,
+                    hdr->node_spacing*hdr->node_width,
+                    hdr->node_spacing*hdr->node_height,
+                    hdr->node_spacing*hdr->node_depth, 0, hdr->flags) ;
+  if (!gca)
+  {
+    gcafFreeMap(map) ;
+    ErrorReturn(NULL, (Gerror, NULL)) ;
+  }
+  if (gca->node_width != hdr->node_width ||
+      gca->node_height != hdr->node_height ||
+      gca->node_depth != hdr->node_depth ||
+      gca->prior_width != hdr->prior_width ||
+      gca->prior_height != hdr->prior_height ||
+      gca->prior_depth != hdr->prior_depth)
+  {
+    GCAfree(&gca) ;
+    gcafFreeMap(map) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GCAreadFlat(%s): inconsistent "
+                       "node/prior dimensions", fname)) ;
+  }
+  gca->type = hdr->type ;
+  gca->total_training = hdr->total_training ;
+  memmove(gca->TRs, hdr->TRs, sizeof(gca->TRs)) ;
+  memmove(gca->FAs, hdr->FAs, sizeof(gca->FAs)) ;
+  memmove(gca->TEs, hdr->TEs, sizeof(gca->TEs)) ;
+  gca->x_r = hdr->x_r ;
+  gca->x_a = hdr->x_a ;
+  gca->x_s = hdr->x_s ;
+  gca->y_r = hdr->y_r ;
+  gca->y_a = hdr->y_a ;
+  gca->y_s = hdr->y_s ;
+  gca->z_r = hdr->z_r ;
+  gca->z_a = hdr->z_a ;
+  gca->z_s = hdr->z_s ;
+  gca->c_r = hdr->c_r ;
+  gca->c_a = hdr->c_a ;
+  gca->c_s = hdr->c_s ;
+  gca->width = hdr->width ;
+  gca->height = hdr->height ;
+  gca->depth = hdr->depth ;
+  gca->xsize = hdr->xsize ;
+  gca->ysize = hdr->ysize ;
+  gca->zsize = hdr->zsize ;
+
+#define SECTION(type, s) ((type *)(base + hdr->section_offset[s]))
+  node_offsets = SECTION(long long, GCAF_NODE_OFFSETS) ;
+  node_training = SECTION(int, GCAF_NODE_TRAINING) ;
+  node_labels = SECTION(unsigned short, GCAF_NODE_LABELS) ;
+  means = SECTION(float, GCAF_GC_MEANS) ;
+  covars = SECTION(float, GCAF_GC_COVARS) ;
+  gc_ntraining = SECTION(int, GCAF_GC_NTRAINING) ;
+  gc_njust = SECTION(short, GCAF_GC_NJUST_PRIORS) ;
+  gc_regularized = SECTION(char, GCAF_GC_REGULARIZED) ;
+  nbr_nlabels = SECTION(short, GCAF_GC_NBR_NLABELS) ;
+  nbr_offsets = SECTION(long long, GCAF_NBR_OFFSETS) ;
+  nbr_labels = SECTION(unsigned short, GCAF_NBR_LABELS) ;
+  nbr_priors = SECTION(float, GCAF_NBR_PRIORS) ;
+  prior_offsets = SECTION(long long, GCAF_PRIOR_OFFSETS) ;
+  prior_training = SECTION(int, GCAF_PRIOR_TRAINING) ;
+  prior_labels = SECTION(unsigned short, GCAF_PRIOR_LABELS) ;
+  prior_priors = SECTION(float, GCAF_PRIOR_PRIORS) ;
+#undef SECTION
+
+  nmrf = !(hdr->flags & GCA_NO_MRF) ;
+  ncovars = hdr->ninputs*(hdr->ninputs+1)/2 ;
+  ngcs = hdr->ngcs ;
+  map->gcs = (GC1D *)calloc(ngcs+1, sizeof(GC1D)) ;
+  if (nmrf)
+  {
+    map->nbr_labels =
+      (unsigned short **)calloc(ngcs*GIBBS_NEIGHBORS+1,
+                                sizeof(unsigned short *)) ;
+    map->nbr_priors = (float **)calloc(ngcs*GIBBS_NEIGHBORS+1,
+                                       sizeof(float *)) ;
+  }
+  if (!map->gcs || (nmrf && (!map->nbr_labels || !map->nbr_priors)))
+    ErrorExit(ERROR_NOMEMORY, "GCAreadFlat(%s): could not allocate %lld gcs",
+              fname, ngcs) ;
+
+  for (i = x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++, i++)
+      {
+        GCA_NODE *gcan = &gca->nodes[x][y][z] ;
+
+        gcan->nlabels = gcan->max_labels =
+          (int)(node_offsets[i+1] - node_offsets[i]) ;
+        gcan->total_training = node_training[i] ;
+        if (gcan->nlabels > 0)
+        {
+          gcan->labels = node_labels + node_offsets[i] ;
+          gcan->gcs = map->gcs + node_offsets[i] ;
+        }
+        else
+        {
+          gcan->labels = NULL ;
+          gcan->gcs = NULL ;
+        }
+      }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (i = 0 ; i < ngcs ; i++)
+  {
+    GC1D *gc = &map->gcs[i] ;
+    int  d ;
+
+    gc->means = means + i*hdr->ninputs ;
+    gc->covars = covars + i*ncovars ;
+    gc->ntraining = gc_ntraining[i] ;
+    gc->n_just_priors = gc_njust[i] ;
+    gc->regularized = gc_regularized[i] ;
+    if (!nmrf)
+      continue ;
+    gc->nlabels = nbr_nlabels + i*GIBBS_NEIGHBORS ;
+    gc->labels = map->nbr_labels + i*GIBBS_NEIGHBORS ;
+    gc->label_priors = map->nbr_priors + i*GIBBS_NEIGHBORS ;
+    for (d = 0 ; d < GIBBS_NEIGHBORS ; d++)
+    {
+      long long off = nbr_offsets[i*GIBBS_NEIGHBORS+d] ;
+      gc->labels[d] = nbr_labels + off ;
+      gc->label_priors[d] = nbr_priors + off ;
+    }
+  }
+
+  for (i = x = 0 ; x < gca->prior_width ; x++)
+    for (y = 0 ; y < gca->prior_height ; y++)
+      for (z = 0 ; z < gca->prior_depth ; z++, i++)
+      {
+        GCA_PRIOR *gcap = &gca->priors[x][y][z] ;
+
+        gcap->nlabels = gcap->max_labels =
+          (short)(prior_offsets[i+1] - prior_offsets[i]) ;
+        gcap->total_training = prior_training[i] ;
+        if (gcap->nlabels > 0)
+        {
+          gcap->labels = prior_labels + prior_offsets[i] ;
+          gcap->priors = prior_priors + prior_offsets[i] ;
+        }
+        else
+        {
+          gcap->labels = NULL ;
+          gcap->priors = NULL ;
+        }
+      }
+
+  // max label over the node and prior labels, as GCAread computes it
+  gca->max_label = 0 ;
+  for (i = 0 ; i < ngcs ; i++)
+    if (node_labels[i] > gca->max_label)
+      gca->max_label = node_labels[i] ;
+  for (i = 0 ; i < hdr->nprior_labels ; i++)
+    if (prior_labels[i] > gca->max_label)
+      gca->max_label = prior_labels[i] ;
+
+  if (hdr->ct_offset > 0)
+  {
+    znzFile file = znzopen(fname, "rb", 0) ;
+
+    if (!znz_isnull(file))
+    {
+      znzseek(file, hdr->ct_offset, SEEK_SET) ;
+      gca->ct = znzCTABreadFromBinary(file) ;
+      znzclose(file) ;
+    }
+  }
+
+  gca->flat = map ;
+  GCAsetup(gca) ;
+  return(gca) ;
+}
+
+/*-----------------------------------------------------
+  GCAreleaseFlat() - drop a GCA's references into its
+  .gcaf mapping (leaving empty nodes and priors) and unmap
+  it. Called by GCAfree() before the grids are freed.
+  ------------------------------------------------------*/
+int
+GCAreleaseFlat(GCA *gca)
+{
+  int x, y, z ;
+
+  if (gca->flat == NULL)
+    return(NO_ERROR) ;
+  for (x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        GCA_NODE *gcan = &gca->nodes[x][y][z] ;
+        gcan->nlabels = 0 ;
+        gcan->labels = NULL ;
+        gcan->gcs = NULL ;
+      }
+  for (x = 0 ; x < gca->prior_width ; x++)
+    for (y = 0 ; y < gca->prior_height ; y++)
+      for (z = 0 ; z < gca->prior_depth ; z++)
+      {
+        GCA_PRIOR *gcap = &gca->priors[x][y][z] ;
+        gcap->nlabels = 0 ;
+        gcap->labels = NULL ;
+        gcap->priors = NULL ;
+      }
+  gcafFreeMap((GCAF_MAP *)gca->flat) ;
+  gca->flat = NULL ;
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  GCAunmap() - copy a mapped GCA's nodes and priors into
+  ordinary allocations (as GCAread() makes them) so that
+  they can be grown or freed individually, then release
+  the mapping. A no-op for GCAs not read from a .gcaf.
+  ------------------------------------------------------*/
+int
+GCAunmap(GCA *gca)
+{
+  int      x, y, z, n, d, ncovars ;
+  GCAF_MAP *map = (GCAF_MAP *)gca->flat ;
+
+  if (map == NULL)
+    return(NO_ERROR) ;
+
+  GCAfreeDensityCache(gca) ;
+  ncovars = gca->ninputs*(gca->ninputs+1)/2 ;
+  for (x = 0 ; x < gca->node_width ; x++)
+    for (y = 0 ; y < gca->node_height ; y++)
+      for (z = 0 ; z < gca->node_depth ; z++)
+      {
+        GCA_NODE       *gcan = &gca->nodes[x][y][z] ;
+        GC1D           *gcs ;
+        unsigned short *labels ;
+
+        if (gcan->nlabels == 0)
+          continue ;
+        labels = (unsigned short *)calloc(gcan->nlabels,
+                                          sizeof(unsigned short)) ;
+        if (!labels)
+          ErrorExit(ERROR_NOMEMORY, "GCAunmap: could not allocate labels") ;
+        memmove(labels, gcan->labels, gcan->nlabels*sizeof(unsigned short)) ;
+        gcs = alloc_gcs(gcan->nlabels, gca->flags, gca->ninputs) ;
+        for (n = 0 ; n < gcan->nlabels ; n++)
+        {
+          GC1D *gc_src = &gcan->gcs[n], *gc = &gcs[n] ;
+
+          memmove(gc->means, gc_src->means, gca->ninputs*sizeof(float)) ;
+          memmove(gc->covars, gc_src->covars, ncovars*sizeof(float)) ;
+          gc->ntraining = gc_src->ntraining ;
+          gc->n_just_priors = gc_src->n_just_priors ;
+          gc->regularized = gc_src->regularized ;
+          if (gca->flags & GCA_NO_MRF)
+            continue ;
+          for (d = 0 ; d < GIBBS_NEIGHBORS ; d++)
+          {
+            gc->nlabels[d] = gc_src->nlabels[d] ;
+            gc->labels[d] =
+              (unsigned short *)calloc(gc->nlabels[d],
+                                       sizeof(unsigned short)) ;
+            gc->label_priors[d] = (float *)calloc(gc->nlabels[d],
+                                                  sizeof(float)) ;
+            if (!gc->labels[d] || !gc->label_priors[d])
+              ErrorExit(ERROR_NOMEMORY,
+                        "GCAunmap: could not allocate neighbor labels") ;
+            memmove(gc->labels[d], gc_src->labels[d],
+                    gc->nlabels[d]*sizeof(unsigned short)) ;
+            memmove(gc->label_priors[d], gc_src->label_priors[d],
+                    gc->nlabels[d]*sizeof(float)) ;
+          }
+        }
+        gcan->labels = labels ;
+        gcan->gcs = gcs ;
+        gcan->max_labels = gcan->nlabels ;
+      }
+
+  for (x = 0 ; x < gca->prior_width ; x++)
+    for (y = 0 ; y < gca->prior_height ; y++)
+      for (z = 0 ; z < gca->prior_depth ; z++)
+      {
+        GCA_PRIOR      *gcap = &gca->priors[x][y][z] ;
+        unsigned short *labels ;
+        float          *priors ;
+
+        if (gcap->nlabels == 0)
+          continue ;
+        labels = (unsigned short *)calloc(gcap->nlabels,
+                                          sizeof(unsigned short)) ;
+        priors = (float *)calloc(gcap->nlabels, sizeof(float)) ;
+        if (!labels || !priors)
+          ErrorExit(ERROR_NOMEMORY, "GCAunmap: could not allocate priors") ;
+        memmove(labels, gcap->labels, gcap->nlabels*sizeof(unsigned short)) ;
+        memmove(priors, gcap->priors, gcap->nlabels*sizeof(float)) ;
+        gcap->labels = labels ;
+        gcap->priors = priors ;
+        gcap->max_labels = gcap->nlabels ;
+      }
+
+  gcafFreeMap(map) ;
+  gca->flat = NULL ;
+  return(NO_ERROR) ;
+}
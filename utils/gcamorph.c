@@ -66,6 +66,14 @@
 #endif
 #endif
 
+/* the log-likelihood, jacobian and smoothness terms are evaluated
+   together in one pass over the nodes unless one of them is on the GPU */
+#if !defined(GCAM_LLENERGY_GPU) && !defined(GCAM_JACOBENERGY_GPU) && \
+    !defined(GCAM_SMOOTHNESS_ENERGY_GPU) && !defined(GCAM_LL_TERM_GPU) && \
+    !defined(GCAM_SMOOTH_TERM_GPU)
+#define GCAM_FUSED_TERMS
+#endif
+
 
 #define MALLOC_CHECK_ 2
 
@@ -122,6 +130,17 @@ static int most_likely_label(GCA_MORPH *gcam, TRANSFORM *transform, int x, int y
 int dtrans_label_to_frame(GCA_MORPH_PARMS *mp, int label) ;
 MRI *MRIcomposeWarps(MRI *mri_warp1, MRI *mri_warp2, MRI *mri_dst) ;
 int fix_borders(GCA_MORPH *gcam)  ;
+#ifdef GCAM_FUSED_TERMS
+static int gcamUseFusedTerms(void) ;
+static void gcamInvalidateEnergyCache(const GCA_MORPH *gcam) ;
+static int gcamComputeFusedEnergy(const GCA_MORPH *gcam, const MRI *mri,
+                                  double l_ll, double l_jacobian,
+                                  double l_smoothness, double *pll_sse,
+                                  double *pj_sse, double *ps_sse) ;
+static int gcamFusedLogLikelihoodSmoothnessTerm(GCA_MORPH *gcam,
+    const MRI *mri, const MRI *mri_smooth,
+    double l_log_likelihood, double l_smoothness) ;
+#endif
 
 int gcam_write_grad = 0 ;
 int gcam_write_neg = 0 ;
@@ -2001,6 +2020,9 @@ GCAMfree(GCA_MORPH **pgcam)
   gcam = *pgcam ;
   *pgcam = NULL ;
 
+#ifdef GCAM_FUSED_TERMS
+  gcamInvalidateEnergyCache(gcam) ;
+#endif
   GCAMfreeContents(gcam) ;
   free(gcam) ;
   return(NO_ERROR) ;
@@ -2045,6 +2067,141 @@ GCAMfreeContents(GCA_MORPH *gcam)
 
 #define GCAM_LLT_OUTPUT 0
 
+/*
+  Log-likelihood gradient at a single node, added into gcamn->d[xyz].
+  The caller provides the scratch matrices so they can be per-thread.
+  Shared by gcamLogLikelihoodTerm() and the fused gradient pass.
+*/
+static void
+gcamLogLikelihoodTermAtNode( GCA_MORPH *gcam,
+                             const MRI *mri,
+                             const MRI *mri_smooth,
+                             double l_log_likelihood,
+                             int x, int y, int z,
+                             MATRIX *m_delI, MATRIX *m_inv_cov,
+                             VECTOR *v_means, VECTOR *v_grad )
+{
+  int             n ;
+  double          dx=0.0, dy=0.0, dz=0.0, norm ;
+  float           vals[MAX_GCA_INPUTS] ;
+  GCA_MORPH_NODE  *gcamn ;
+
+  gcamn = &gcam->nodes[x][y][z] ;
+
+  if (gcamn->invalid == GCAM_POSITION_INVALID)
+    return ;
+
+  if (fabs(gcamn->x-Gvx)<1 &&
+      fabs(gcamn->y-Gvy)<1  &&
+      fabs(gcamn->z-Gvz)<1)
+    DiagBreak() ;
+
+  if( gcamn->status &
+      (GCAM_IGNORE_LIKELIHOOD|GCAM_NEVER_USE_LIKELIHOOD) )
+    return ;
+
+  /* don't use unkown nodes unless they border
+     something that's not unknown */
+  if( IS_UNKNOWN(gcamn->label) &&
+      different_neighbor_labels(gcam, x,y,z,1) == 0 )
+    return ;
+
+  load_vals(mri, gcamn->x, gcamn->y, gcamn->z, vals, gcam->ninputs);
+
+  if (!gcamn->gc)
+  {
+    MatrixClear(v_means) ;
+    MatrixIdentity(gcam->ninputs, m_inv_cov) ;
+    MatrixScalarMul
+    (m_inv_cov, 1.0/(MIN_VAR), m_inv_cov) ; /* variance=4 is min */
+  }
+  else
+  {
+#if 0
+    if (parms->relabel)
+    {
+      label =
+        GCAcomputeMAPlabelAtLocation
+        (gcam->gca, x,y,z,vals,&n,&gcamn->log_p);
+      if (label == gcamn->label)  /* already correct label -
+                                     don't move anywhere */
+      {
+        continue ;
+      }
+    }
+#endif
+    load_mean_vector(gcamn->gc, v_means, gcam->ninputs) ;
+    load_inverse_covariance_matrix(gcamn->gc, m_inv_cov, gcam->ninputs) ;
+  }
+
+  for (n = 0 ; n < gcam->ninputs ; n++)
+  {
+    MRIsampleVolumeGradientFrame(mri_smooth,
+                                 gcamn->x, gcamn->y, gcamn->z,
+                                 &dx, &dy, &dz, n) ;
+    norm = sqrt(dx*dx+dy*dy+dz*dz) ;
+    if (!FZERO(norm))  /* don't worry about magnitude of gradient */
+    {
+      dx /= norm ;
+      dy /= norm ;
+      dz /= norm ;
+    }
+    *MATRIX_RELT(m_delI, 1, n+1) = dx ;
+    *MATRIX_RELT(m_delI, 2, n+1) = dy ;
+    *MATRIX_RELT(m_delI, 3, n+1) = dz ;
+    VECTOR_ELT(v_means, n+1) -= vals[n] ;
+#define MAX_ERROR 1000
+    if (fabs(VECTOR_ELT(v_means, n+1)) > MAX_ERROR)
+      VECTOR_ELT(v_means, n+1) =
+        MAX_ERROR * FSIGN(VECTOR_ELT(v_means, n+1)) ;
+  }
+
+  MatrixMultiply(m_inv_cov, v_means, v_means) ;
+
+  if (IS_UNKNOWN(gcamn->label))
+  {
+    if (zero_vals(vals, gcam->ninputs))
+    {
+      if (Gx == x && Gy == y && Gz == z)
+        printf("discounting unknown label at (%d, %d, %d) "
+               "due to skull strip difference\n",
+               x, y, z) ;
+      /* probably difference in skull stripping (vessels present or
+         absent) - don't let it dominate */
+      if (VECTOR_ELT(v_means,1) > .5)  /* don't let it be more
+                                          than 1/2 stds away */
+      {
+        VECTOR_ELT(v_means,1) = .5 ;
+      }
+    }
+#if 0
+    else if (VECTOR_ELT(v_means,1) > 2)  /* don't let it be more
+                                         than 2 stds away */
+    {
+      VECTOR_ELT(v_means,1) = 2 ;
+    }
+#endif
+  }
+  MatrixMultiply(m_delI, v_means, v_grad) ;
+
+  gcamn->dx += l_log_likelihood*V3_X(v_grad) ;
+  gcamn->dy += l_log_likelihood*V3_Y(v_grad) ;
+  gcamn->dz += l_log_likelihood*V3_Z(v_grad) ;
+
+  if (x == Gx && y == Gy && z == Gz)
+  {
+    printf
+    ("ll_like: node(%d,%d,%d)-->vox(%2.0f,%2.0f,%2.0F): dI=(%2.1f,%2.1f,%2.1f), "
+     "grad=(%2.2f,%2.2f,%2.2f), "
+     "node %2.2f+-%2.2f, MRI=%2.1f\n",
+     x, y, z, dx, dy, dz, gcamn->x, gcamn->y, gcamn->z, gcamn->dx, gcamn->dy, gcamn->dz,
+     gcamn->gc ? gcamn->gc->means[0] : 0.0,
+     gcamn->gc ? sqrt(covariance_determinant
+                      (gcamn->gc,
+                       gcam->ninputs)) : 0.0, vals[0]) ;
+  }
+}
+
 int
 gcamLogLikelihoodTerm( GCA_MORPH *gcam,
                        const MRI *mri,
@@ -2060,12 +2217,9 @@ gcamLogLikelihoodTerm( GCA_MORPH *gcam,
   printf( "%s: On GPU\n", __FUNCTION__ );
   gcamLogLikelihoodTermGPU( gcam, mri, mri_smooth, l_log_likelihood );
 #else
-  int             x=0, y=0, z=0, n=0 /*,label*/ ;
+  int             x=0, y=0, z=0 ;
   int             i;
   int             nthreads=1, tid=0;
-  double          dx=0.0, dy=0.0, dz=0.0, norm=0.0;
-  float           vals[_MAX_FS_THREADS][MAX_GCA_INPUTS] ;
-  GCA_MORPH_NODE  *gcamn=NULL ;
   MATRIX          *m_delI[_MAX_FS_THREADS], *m_inv_cov[_MAX_FS_THREADS] ;
   VECTOR          *v_means[_MAX_FS_THREADS], *v_grad[_MAX_FS_THREADS] ;
 
@@ -2115,7 +2269,7 @@ gcamLogLikelihoodTerm( GCA_MORPH *gcam,
   }
 
 #ifdef HAVE_OPENMP
-  #pragma omp parallel for firstprivate(tid,y,z,gcamn,n,norm,dx,dy,dz,vals,m_delI,m_inv_cov,v_means,v_grad) shared(gcam,mri,Gx,Gy,Gz,Gvx,Gvy,Gvz) schedule(static,1)
+  #pragma omp parallel for firstprivate(tid,y,z,m_delI,m_inv_cov,v_means,v_grad) shared(gcam,mri,Gx,Gy,Gz,Gvx,Gvy,Gvz) schedule(static,1)
 #endif
 
   for (x = 0 ; x < gcam->width ; x++)
@@ -2133,120 +2287,9 @@ gcamLogLikelihoodTerm( GCA_MORPH *gcam,
         if (x == Gx && y == Gy && z == Gz)
           DiagBreak() ;
 
-        gcamn = &gcam->nodes[x][y][z] ;
-
-        if (gcamn->invalid == GCAM_POSITION_INVALID)
-          continue;
-
-        if (fabs(gcamn->x-Gvx)<1 &&
-            fabs(gcamn->y-Gvy)<1  &&
-            fabs(gcamn->z-Gvz)<1)
-          DiagBreak() ;
-
-        if( gcamn->status &
-            (GCAM_IGNORE_LIKELIHOOD|GCAM_NEVER_USE_LIKELIHOOD) )
-          continue;
-
-        /* don't use unkown nodes unless they border
-           something that's not unknown */
-        if( IS_UNKNOWN(gcamn->label) &&
-            different_neighbor_labels(gcam, x,y,z,1) == 0 )
-          continue;
-
-        load_vals(mri, gcamn->x, gcamn->y, gcamn->z, vals[tid], gcam->ninputs);
-
-        if (!gcamn->gc)
-        {
-          MatrixClear(v_means[tid]) ;
-          MatrixIdentity(gcam->ninputs, m_inv_cov[tid]) ;
-          MatrixScalarMul
-          (m_inv_cov[tid], 1.0/(MIN_VAR), m_inv_cov[tid]) ; /* variance=4 is min */
-        }
-        else
-        {
-#if 0
-          if (parms->relabel)
-          {
-            label =
-              GCAcomputeMAPlabelAtLocation
-              (gcam->gca, x,y,z,vals,&n,&gcamn->log_p);
-            if (label == gcamn->label)  /* already correct label -
-                                           don't move anywhere */
-            {
-              continue ;
-            }
-          }
-#endif
-          load_mean_vector(gcamn->gc, v_means[tid], gcam->ninputs) ;
-          load_inverse_covariance_matrix(gcamn->gc, m_inv_cov[tid], gcam->ninputs) ;
-        }
-
-        for (n = 0 ; n < gcam->ninputs ; n++)
-        {
-          MRIsampleVolumeGradientFrame(mri_smooth,
-                                       gcamn->x, gcamn->y, gcamn->z,
-                                       &dx, &dy, &dz, n) ;
-          norm = sqrt(dx*dx+dy*dy+dz*dz) ;
-          if (!FZERO(norm))  /* don't worry about magnitude of gradient */
-          {
-            dx /= norm ;
-            dy /= norm ;
-            dz /= norm ;
-          }
-          *MATRIX_RELT(m_delI[tid], 1, n+1) = dx ;
-          *MATRIX_RELT(m_delI[tid], 2, n+1) = dy ;
-          *MATRIX_RELT(m_delI[tid], 3, n+1) = dz ;
-          VECTOR_ELT(v_means[tid], n+1) -= vals[tid][n] ;
-#define MAX_ERROR 1000
-          if (fabs(VECTOR_ELT(v_means[tid], n+1)) > MAX_ERROR)
-            VECTOR_ELT(v_means[tid], n+1) =
-              MAX_ERROR * FSIGN(VECTOR_ELT(v_means[tid], n+1)) ;
-        }
-
-        MatrixMultiply(m_inv_cov[tid], v_means[tid], v_means[tid]) ;
-
-        if (IS_UNKNOWN(gcamn->label))
-        {
-          if (zero_vals(vals[tid], gcam->ninputs))
-          {
-            if (Gx == x && Gy == y && Gz == z)
-              printf("discounting unknown label at (%d, %d, %d) "
-                     "due to skull strip difference\n",
-                     x, y, z) ;
-            /* probably difference in skull stripping (vessels present or
-               absent) - don't let it dominate */
-            if (VECTOR_ELT(v_means[tid],1) > .5)  /* don't let it be more
-                                                than 1/2 stds away */
-            {
-              VECTOR_ELT(v_means[tid],1) = .5 ;
-            }
-          }
-#if 0
-          else if (VECTOR_ELT(v_means,1) > 2)  /* don't let it be more
-                                               than 2 stds away */
-          {
-            VECTOR_ELT(v_means,1) = 2 ;
-          }
-#endif
-        }
-        MatrixMultiply(m_delI[tid], v_means[tid], v_grad[tid]) ;
-
-        gcamn->dx += l_log_likelihood*V3_X(v_grad[tid]) ;
-        gcamn->dy += l_log_likelihood*V3_Y(v_grad[tid]) ;
-        gcamn->dz += l_log_likelihood*V3_Z(v_grad[tid]) ;
-
-        if (x == Gx && y == Gy && z == Gz)
-        {
-          printf
-          ("ll_like: node(%d,%d,%d)-->vox(%2.0f,%2.0f,%2.0F): dI=(%2.1f,%2.1f,%2.1f), "
-           "grad=(%2.2f,%2.2f,%2.2f), "
-           "node %2.2f+-%2.2f, MRI=%2.1f\n",
-           x, y, z, dx, dy, dz, gcamn->x, gcamn->y, gcamn->z, gcamn->dx, gcamn->dy, gcamn->dz,
-           gcamn->gc ? gcamn->gc->means[0] : 0.0,
-           gcamn->gc ? sqrt(covariance_determinant
-                            (gcamn->gc,
-                             gcam->ninputs)) : 0.0, vals[tid][0]) ;
-        }
+        gcamLogLikelihoodTermAtNode(gcam, mri, mri_smooth, l_log_likelihood,
+                                    x, y, z, m_delI[tid], m_inv_cov[tid],
+                                    v_means[tid], v_grad[tid]) ;
       }
     }
   }
@@ -2389,6 +2432,70 @@ gcamLikelihoodTerm(GCA_MORPH *gcam, MRI *mri, MRI *mri_smooth,
 static float ***last_sse = NULL;
 #endif
 
+/*
+  Log-likelihood energy of a single node (0 if the node doesn't
+  contribute). Shared by gcamLogLikelihoodEnergy() and the fused
+  evaluator in gcamComputeSSE().
+*/
+static double
+gcamLogLikelihoodEnergyAtNode( const GCA_MORPH *gcam, const MRI *mri,
+                               int x, int y, int z )
+{
+  const GCA_MORPH_NODE *gcamn = &gcam->nodes[x][y][z] ;
+  float  vals[MAX_GCA_INPUTS] ;
+  double error ;
+
+  // Don't operate on invalid nodes
+  if (gcamn->invalid == GCAM_POSITION_INVALID)
+  {
+    return(0.0) ;
+  }
+
+  // Check for ignore
+  if ( gcamn->status &
+       (GCAM_IGNORE_LIKELIHOOD|GCAM_NEVER_USE_LIKELIHOOD) )
+  {
+    return(0.0) ;
+  }
+
+  /* don't use unkown nodes unless they border
+     something that's not unknown */
+  if (IS_UNKNOWN(gcamn->label) &&
+      (different_neighbor_labels(gcam, x,y,z,1) == 0) )
+  {
+    return(0.0) ;
+  }
+
+  // Load up the MRI values (which will do trilinear interpolation)
+  load_vals(mri, gcamn->x, gcamn->y, gcamn->z, vals, gcam->ninputs);
+
+  // Compute 'error' for this node
+  if( gcamn->gc )
+  {
+    error = GCAmahDist(gcamn->gc, vals, gcam->ninputs)
+            + log(covariance_determinant(gcamn->gc, gcam->ninputs));
+  }
+  else
+  {
+    int n ;
+    // Note that the for loop sets error=0 on the first iteration
+    for (n = 0, error = 0.0 ; n < gcam->ninputs ; n++)
+    {
+      error += (vals[n]*vals[n]/MIN_VAR) ;
+    }
+  }
+
+  if (x == Gx && y == Gy && z == Gz)
+    printf("E_like: node(%d,%d,%d) -> "
+           "(%2.1f,%2.1f,%2.1f), target=%2.1f+-%2.1f, val=%2.1f\n",
+           x, y, z, gcamn->x, gcamn->y, gcamn->z,
+           gcamn->gc ? gcamn->gc->means[0] : 0.0,
+           gcamn->gc ? sqrt(covariance_determinant
+                            (gcamn->gc, gcam->ninputs)) : 0.0, vals[0]) ;
+
+  return(error) ;
+}
+
 #define GCAM_LLENERGY_OUTPUT 0
 
 double
@@ -2467,7 +2574,6 @@ gcamLogLikelihoodEnergy( const GCA_MORPH *gcam, MRI *mri)
   {
     for (y = 0 ; y < gcam->height ; y++)
     {
-      float vals[MAX_GCA_INPUTS];
       for (z = 0 ; z < gcam->depth ; z++)
       {
 
@@ -2477,66 +2583,8 @@ gcamLogLikelihoodEnergy( const GCA_MORPH *gcam, MRI *mri)
           DiagBreak();
         }
 
-        // Shorthand way of accessing current node
-        const GCA_MORPH_NODE* /* const */ gcamn = &gcam->nodes[x][y][z] ;
-
-        // Don't operate on invalid nodes
-        if (gcamn->invalid == GCAM_POSITION_INVALID)
-        {
-          continue;
-        }
-        check_gcam(gcam) ;
-
-        // Check for ignore
-        if ( gcamn->status &
-             (GCAM_IGNORE_LIKELIHOOD|GCAM_NEVER_USE_LIKELIHOOD) )
-        {
-          continue ;
-        }
-
-        /* don't use unkown nodes unless they border
-           something that's not unknown */
-        if (IS_UNKNOWN(gcamn->label) &&
-            (different_neighbor_labels(gcam, x,y,z,1) == 0) )
-        {
-
-          continue ;
-        }
-
-        check_gcam(gcam) ;
-
-        // Load up the MRI values (which will do trilinear interpolation)
-        load_vals(mri, gcamn->x, gcamn->y, gcamn->z, vals, gcam->ninputs);
-        check_gcam(gcam);
-
-        // Compute 'error' for this node
-        if( gcamn->gc )
-        {
-          error = GCAmahDist(gcamn->gc, vals, gcam->ninputs)
-                  + log(covariance_determinant(gcamn->gc, gcam->ninputs));
-        }
-        else
-        {
-          int n ;
-          // Note that the for loop sets error=0 on the first iteration
-          for (n = 0, error = 0.0 ; n < gcam->ninputs ; n++)
-          {
-            error += (vals[n]*vals[n]/MIN_VAR) ;
-          }
-        }
-
-        check_gcam(gcam) ;
-
-        // Random output
-        if (x == Gx && y == Gy && z == Gz)
-          printf("E_like: node(%d,%d,%d) -> "
-                 "(%2.1f,%2.1f,%2.1f), target=%2.1f+-%2.1f, val=%2.1f\n",
-                 x, y, z, gcamn->x, gcamn->y, gcamn->z,
-                 gcamn->gc ? gcamn->gc->means[0] : 0.0,
-                 gcamn->gc ? sqrt(covariance_determinant
-                                  (gcamn->gc, gcam->ninputs)) : 0.0, vals[0]) ;
+        error = gcamLogLikelihoodEnergyAtNode(gcam, mri, x, y, z) ;
 
-        check_gcam(gcam) ;
 #if DEBUG_LL_SSE
         if (last_sse[x][y][z] < (.9*error) && !FZERO(last_sse[x][y][z]))
         {
@@ -4392,6 +4440,82 @@ gcamComputeMetricProperties(GCA_MORPH *gcam)
 #endif
 
 
+/*
+  Jacobian (folding) energy of a single node, already scaled by the
+  slice thickness. Shared by gcamJacobianEnergy() and the fused
+  evaluator in gcamComputeSSE().
+*/
+static double
+gcamJacobianEnergyAtNode( const GCA_MORPH *gcam, int i, int j, int k,
+                          double thick )
+{
+  const GCA_MORPH_NODE *gcamn = &gcam->nodes[i][j][k] ;
+  double delta, ratio, exponent, sse = 0.0 ;
+
+  if (gcamn->invalid)
+  {
+    return(0.0) ;
+  }
+
+  /* scale up the area coefficient if the area of the current node is
+    close to 0 or already negative */
+  if (!FZERO(gcamn->orig_area1))
+  {
+    ratio = gcamn->area1 / gcamn->orig_area1 ;
+    exponent = -gcam->exp_k*ratio ;
+    if (exponent > MAX_EXP)
+    {
+      delta = 0.0 ;
+    }
+    else
+    {
+      delta = log(1+exp(exponent)) /*   / gcam->exp_k */ ;
+    }
+
+    sse += delta * thick ;
+
+    if (!finitep(delta) || !finitep(sse))
+    {
+      DiagBreak() ;
+    }
+
+    if (i == Gx && j == Gy && k == Gz)
+    {
+      printf("E_jaco: node(%d,%d,%d): area1=%2.4f, error=%2.3f\n",
+             i, j, k, gcamn->area1,delta);
+    }
+  }
+
+  if (!FZERO(gcamn->orig_area2))
+  {
+    ratio = gcamn->area2 / gcamn->orig_area2 ;
+    exponent = -gcam->exp_k*ratio ;
+
+    if (exponent > MAX_EXP)
+    {
+      delta = MAX_EXP ;
+    }
+    else
+    {
+      delta = log(1+exp(exponent)) /*   / gcam->exp_k */ ;
+    }
+
+    sse += delta * thick ;
+
+    if (!finitep(delta) || !finitep(sse))
+    {
+      DiagBreak() ;
+    }
+
+    if (i == Gx && j == Gy && k == Gz)
+    {
+      printf("E_jaco: node(%d,%d,%d): area2=%2.4f, error=%2.3f\n",
+             i, j, k, gcamn->area2,delta);
+    }
+  }
+  return(sse) ;
+}
+
 #define GCAM_JACOBENERGY_OUTPUT 0
 
 double
@@ -4430,9 +4554,8 @@ gcamJacobianEnergy( const GCA_MORPH *gcam, MRI *mri)
 #if SHOW_EXEC_LOC
   printf( "%s: CPU call\n", __FUNCTION__ );
 #endif
-  double          delta=0.0, ratio=0.0, exponent=0.0, thick ;
+  double          thick ;
   int             i=0, j=0, k=0, width, height, depth ;
-  GCA_MORPH_NODE *gcamn=NULL ;
 
   thick = mri ? mri->thick : 1.0 ;
   width = gcam->width ;
@@ -4442,7 +4565,7 @@ gcamJacobianEnergy( const GCA_MORPH *gcam, MRI *mri)
   // Note sse initialised to zero here
   sse = 0.0f;
 #ifdef HAVE_OPENMP
-  #pragma omp parallel for firstprivate(j,k,gcamn,ratio,exponent,delta) shared(width,height,depth,gcam) reduction(+:sse) schedule(static,1)
+  #pragma omp parallel for firstprivate(j,k) shared(width,height,depth,gcam) reduction(+:sse) schedule(static,1)
 #endif
   for (i = 0 ; i < width ; i++)
   {
@@ -4450,98 +4573,30 @@ gcamJacobianEnergy( const GCA_MORPH *gcam, MRI *mri)
     {
       for (k = 0 ; k < depth ; k++)
       {
-        gcamn = &gcam->nodes[i][j][k] ;
-
-        if (gcamn->invalid)
+        sse += gcamJacobianEnergyAtNode(gcam, i, j, k, thick) ;
+        if (!finitep(sse))
         {
-          continue;
+          DiagBreak() ;
         }
+      }
+    }
+  }
+#endif
 
-        /* scale up the area coefficient if the area of the current node is
-          close to 0 or already negative */
-        if (!FZERO(gcamn->orig_area1))
-        {
-          ratio = gcamn->area1 / gcamn->orig_area1 ;
-          exponent = -gcam->exp_k*ratio ;
-          if (exponent > MAX_EXP)
-          {
-            delta = 0.0 ;
-          }
-          else
-          {
-            delta = log(1+exp(exponent)) /*   / gcam->exp_k */ ;
-          }
 
-          sse += delta * thick ;
+#if GCAM_JACOBENERGY_OUTPUT
+  nCalls++;
+#endif
 
-          if (!finitep(delta) || !finitep(sse))
-          {
-            DiagBreak() ;
-          }
+  return(sse) ;
+}
 
-          if (i == Gx && j == Gy && k == Gz)
-          {
-            printf("E_jaco: node(%d,%d,%d): area1=%2.4f, error=%2.3f\n",
-                   i, j, k, gcamn->area1,delta);
-          }
-
-          if (!FZERO(delta))
-          {
-            DiagBreak() ;
-          }
-        }
-
-        if (!FZERO(gcamn->orig_area2))
-        {
-          ratio = gcamn->area2 / gcamn->orig_area2 ;
-          exponent = -gcam->exp_k*ratio ;
-
-          if (exponent > MAX_EXP)
-          {
-            delta = MAX_EXP ;
-          }
-          else
-          {
-            delta = log(1+exp(exponent)) /*   / gcam->exp_k */ ;
-          }
-
-          sse += delta * thick ;
-
-          if (!finitep(delta) || !finitep(sse))
-          {
-            DiagBreak() ;
-          }
-
-          if (i == Gx && j == Gy && k == Gz)
-          {
-            printf("E_jaco: node(%d,%d,%d): area2=%2.4f, error=%2.3f\n",
-                   i, j, k, gcamn->area2,delta);
-          }
-
-          if (!FZERO(delta))
-          {
-            DiagBreak() ;
-          }
-        }
-      }
-    }
-  }
-#endif
-
-
-#if GCAM_JACOBENERGY_OUTPUT
-  nCalls++;
-#endif
-
-  return(sse) ;
-}
-
-double
-gcamAreaEnergy(GCA_MORPH *gcam)
-{
-  double          sse = 0.0, error ;
-  int             i, j, k, width, height, depth ;
-  GCA_MORPH_NODE *gcamn ;
+double
+gcamAreaEnergy(GCA_MORPH *gcam)
+{
+  double          sse = 0.0, error ;
+  int             i, j, k, width, height, depth ;
+  GCA_MORPH_NODE *gcamn ;
 
   width = gcam->width ;
   height = gcam->height ;
@@ -5651,6 +5706,9 @@ GCAMregisterLevel(GCA_MORPH *gcam, MRI *mri, MRI *mri_smooth,
   }
   max_small = parms->nsmall ;
   gcamClearMomentum(gcam) ;
+#ifdef GCAM_FUSED_TERMS
+  gcamInvalidateEnergyCache(NULL) ;  // the gca or labels may have changed
+#endif
   jacobian_parms = *parms ;
   jacobian_parms.l_likelihood =
     jacobian_parms.l_label = \
@@ -6777,6 +6835,7 @@ gcamComputeSSE(GCA_MORPH *gcam, MRI *mri, GCA_MORPH_PARMS *parms)
   double ms_sse, l_sse, s_sse, ls_sse, j_sse, d_sse, a_sse;
   double nvox, label_sse, map_sse, dtrans_sse;
   double binary_sse, area_intensity_sse, spring_sse, exp_sse;
+  int    fused = 0 ;
 
   if (!DZERO(parms->l_area_intensity))
   {
@@ -6791,7 +6850,19 @@ gcamComputeSSE(GCA_MORPH *gcam, MRI *mri, GCA_MORPH_PARMS *parms)
   check_gcam(gcam) ;
   gcamComputeMetricProperties(gcam) ;
   check_gcam(gcam) ;
-  if (!DZERO(parms->l_log_likelihood) || !DZERO(parms->l_likelihood))
+#ifdef GCAM_FUSED_TERMS
+  if (gcamUseFusedTerms())
+  {
+    fused = 1 ;
+    gcamComputeFusedEnergy
+    (gcam, mri,
+     (!DZERO(parms->l_log_likelihood) || !DZERO(parms->l_likelihood)) ?
+     MAX(parms->l_log_likelihood, parms->l_likelihood) : 0.0,
+     parms->l_jacobian, parms->l_smoothness, &l_sse, &j_sse, &s_sse) ;
+  }
+#endif
+  if (!fused &&
+      (!DZERO(parms->l_log_likelihood) || !DZERO(parms->l_likelihood)))
     l_sse = MAX(parms->l_log_likelihood, parms->l_likelihood) *
             gcamLogLikelihoodEnergy(gcam, mri) ;
   if (!DZERO(parms->l_multiscale))
@@ -6829,7 +6900,7 @@ gcamComputeSSE(GCA_MORPH *gcam, MRI *mri, GCA_MORPH_PARMS *parms)
   {
     d_sse = parms->l_distance * gcamDistanceEnergy(gcam, mri) ;
   }
-  if (!DZERO(parms->l_jacobian))
+  if (!fused && !DZERO(parms->l_jacobian))
   {
     j_sse = parms->l_jacobian * gcamJacobianEnergy(gcam, mri) ;
   }
@@ -6841,7 +6912,7 @@ gcamComputeSSE(GCA_MORPH *gcam, MRI *mri, GCA_MORPH_PARMS *parms)
   {
     a_sse = parms->l_area_smoothness * gcamAreaEnergy(gcam) ;
   }
-  if (!DZERO(parms->l_smoothness))
+  if (!fused && !DZERO(parms->l_smoothness))
   {
     s_sse = parms->l_smoothness * gcamSmoothnessEnergy(gcam, mri) ;
   }
@@ -6944,13 +7015,30 @@ gcamComputeGradient
   gcamExpansionTerm(gcam, mri, parms->l_expansion)  ;
   gcamLikelihoodTerm(gcam, mri, mri_smooth, parms->l_likelihood, parms)  ;
   gcamDistanceTransformTerm(gcam, mri, parms->mri_dist_map, parms->l_dtrans, parms)  ;
-  gcamLogLikelihoodTerm(gcam, mri, mri_smooth, parms->l_log_likelihood)  ;
-  gcamMultiscaleTerm(gcam, mri, mri_smooth, parms->l_multiscale)  ;
-  gcamDistanceTerm(gcam, mri, parms->l_distance)  ;
-  gcamElasticTerm(gcam, parms)  ;
-  gcamAreaSmoothnessTerm(gcam, mri_smooth, parms->l_area_smoothness)  ;
-  gcamAreaTerm(gcam, parms->l_area)  ;
-  gcamSmoothnessTerm(gcam, mri, parms->l_smoothness)  ;
+#ifdef GCAM_FUSED_TERMS
+  /* the terms in between add into the same gradient, so only fuse
+     when they are off to keep the per-node summation order */
+  if (gcamUseFusedTerms() &&
+      DZERO(parms->l_multiscale) && DZERO(parms->l_distance) &&
+      DZERO(parms->l_elastic) && DZERO(parms->l_area_smoothness) &&
+      DZERO(parms->l_area))
+  {
+    if (!DZERO(parms->l_log_likelihood) || !DZERO(parms->l_smoothness))
+      gcamFusedLogLikelihoodSmoothnessTerm(gcam, mri, mri_smooth,
+                                           parms->l_log_likelihood,
+                                           parms->l_smoothness) ;
+  }
+  else
+#endif
+  {
+    gcamLogLikelihoodTerm(gcam, mri, mri_smooth, parms->l_log_likelihood)  ;
+    gcamMultiscaleTerm(gcam, mri, mri_smooth, parms->l_multiscale)  ;
+    gcamDistanceTerm(gcam, mri, parms->l_distance)  ;
+    gcamElasticTerm(gcam, parms)  ;
+    gcamAreaSmoothnessTerm(gcam, mri_smooth, parms->l_area_smoothness)  ;
+    gcamAreaTerm(gcam, parms->l_area)  ;
+    gcamSmoothnessTerm(gcam, mri, parms->l_smoothness)  ;
+  }
   gcamLSmoothnessTerm(gcam, mri, parms->l_lsmoothness)  ;
   gcamSpringTerm(gcam, parms->l_spring, parms->ratio_thresh)  ;
   //  gcamInvalidSpringTerm(gcam, 1.0)  ;
@@ -7224,6 +7312,116 @@ gcamLimitGradientMagnitude(GCA_MORPH *gcam, GCA_MORPH_PARMS *parms, MRI *mri)
 }
 
 
+/*
+  Smoothness gradient at a single node, added into gcamn->d[xyz].
+  Shared by gcamSmoothnessTerm() and the fused gradient pass.
+*/
+static void
+gcamSmoothnessTermAtNode( GCA_MORPH *gcam, double l_smoothness,
+                          int x, int y, int z )
+{
+  double          vx, vy, vz, vnx, vny, vnz ;
+  double          dx, dy, dz ;
+  int             xk, yk, zk, xn, yn, zn, num ;
+  GCA_MORPH_NODE  *gcamn, *gcamn_nbr ;
+
+  if (x == Gx && y == Gy && z == Gz)
+  {
+    DiagBreak() ;
+  }
+  gcamn = &gcam->nodes[x][y][z] ;
+
+  if (gcamn->invalid == GCAM_POSITION_INVALID)
+  {
+    return ;
+  }
+
+  vx = gcamn->x - gcamn->origx ;
+  vy = gcamn->y - gcamn->origy ;
+  vz = gcamn->z - gcamn->origz ;
+  dx = dy = dz = 0.0f ;
+  if (x == Gx && y == Gy && z == Gz)
+    printf("l_smoo: node(%d,%d,%d): V=(%2.2f,%2.2f,%2.2f)\n",
+           x, y, z, vx, vy, vz) ;
+  num = 0 ;
+
+  for (xk = -1 ; xk <= 1 ; xk++)
+  {
+    xn = x+xk ;
+    xn = MAX(0,xn) ;
+    xn = MIN(gcam->width-1,xn) ;
+
+    for (yk = -1 ; yk <= 1 ; yk++)
+    {
+      yn = y+yk ;
+      yn = MAX(0,yn) ;
+      yn = MIN(gcam->height-1,yn) ;
+
+      for (zk = -1 ; zk <= 1 ; zk++)
+      {
+
+        if (!zk && !yk && !xk)
+        {
+          continue ;
+        }
+
+        zn = z+zk ;
+        zn = MAX(0,zn) ;
+        zn = MIN(gcam->depth-1,zn) ;
+
+        gcamn_nbr = &gcam->nodes[xn][yn][zn] ;
+
+        if (gcamn_nbr->invalid == GCAM_POSITION_INVALID)
+        {
+          continue ;
+        }
+
+#if 0
+        if (gcamn_nbr->label != gcamn->label)
+        {
+          continue ;
+        }
+#endif
+
+        vnx = gcamn_nbr->x - gcamn_nbr->origx ;
+        vny = gcamn_nbr->y - gcamn_nbr->origy ;
+        vnz = gcamn_nbr->z - gcamn_nbr->origz ;
+
+        dx += (vnx-vx) ;
+        dy += (vny-vy) ;
+        dz += (vnz-vz) ;
+
+        if ((x == Gx && y == Gy && z == Gz) &&
+            (Gdiag & DIAG_SHOW) && DIAG_VERBOSE_ON)
+        {
+          printf("\tnode(%d,%d,%d): V=(%2.2f,%2.2f,%2.2f), "
+                 "DX=(%2.2f,%2.2f,%2.2f)\n",
+                 xn, yn, zn, vnx, vny, vnz, vnx-vx, vny-vy, vnz-vz) ;
+        }
+
+        num++ ;
+      }
+    }
+  }
+  /*        num = 1 ;*/
+  if (num)
+  {
+    dx = dx * l_smoothness / num ;
+    dy = dy * l_smoothness / num ;
+    dz = dz * l_smoothness / num ;
+  }
+
+  if (x == Gx && y == Gy && z == Gz)
+  {
+    printf("l_smoo: node(%d,%d,%d): DX=(%2.2f,%2.2f,%2.2f)\n",
+           x, y, z, dx, dy, dz) ;
+  }
+
+  gcamn->dx += dx ;
+  gcamn->dy += dy ;
+  gcamn->dz += dz ;
+}
+
 int
 gcamSmoothnessTerm( GCA_MORPH *gcam,
                     const MRI *mri,
@@ -7234,21 +7432,14 @@ gcamSmoothnessTerm( GCA_MORPH *gcam,
   printf( "%s: On GPU\n", __FUNCTION__ );
   gcamSmoothnessTermGPU( gcam, l_smoothness );
 #else
-  double          vx=0.0, vy=0.0, vz=0.0, vnx=0.0, vny=0.0, vnz=0.0;
-  double          dx=0.0, dy=0.0, dz=0.0 ;
-  int             x=0, y=0, z=0, xk=0, yk=0, zk=0, xn=0, yn=0, zn=0 ;
-  int             width, height, depth, num=0 ;
-  GCA_MORPH_NODE  *gcamn=NULL, *gcamn_nbr=NULL ;
+  int             x=0, y=0, z=0 ;
 
   if (DZERO(l_smoothness))
   {
     return(NO_ERROR) ;
   }
-  width = gcam->width ;
-  height = gcam->height ;
-  depth = gcam->depth ;
 #ifdef HAVE_OPENMP
-  #pragma omp parallel for firstprivate (y,z,gcamn,vx,vy,vz,dx,dy,dz,num,xk,xn,yk,yn,zk,zn,gcamn_nbr,vnx,vny,vnz) shared(gcam,Gx,Gy,Gz) schedule(static,1)
+  #pragma omp parallel for firstprivate (y,z) shared(gcam,Gx,Gy,Gz) schedule(static,1)
 #endif
   for (x = 0 ; x < gcam->width ; x++)
   {
@@ -7256,110 +7447,104 @@ gcamSmoothnessTerm( GCA_MORPH *gcam,
     {
       for (z = 0 ; z < gcam->depth ; z++)
       {
-        if (x == Gx && y == Gy && z == Gz)
-        {
-          DiagBreak() ;
-        }
-        gcamn = &gcam->nodes[x][y][z] ;
+        gcamSmoothnessTermAtNode(gcam, l_smoothness, x, y, z) ;
 
-        if (gcamn->invalid == GCAM_POSITION_INVALID)
-        {
-          continue;
-        }
+      }
+    }
+  }
+#endif
+  return(NO_ERROR) ;
+}
 
-        vx = gcamn->x - gcamn->origx ;
-        vy = gcamn->y - gcamn->origy ;
-        vz = gcamn->z - gcamn->origz ;
-        dx = dy = dz = 0.0f ;
-        if (x == Gx && y == Gy && z == Gz)
-          printf("l_smoo: node(%d,%d,%d): V=(%2.2f,%2.2f,%2.2f)\n",
-                 x, y, z, vx, vy, vz) ;
-        num = 0 ;
 
-        for (xk = -1 ; xk <= 1 ; xk++)
-        {
-          xn = x+xk ;
-          xn = MAX(0,xn) ;
-          xn = MIN(width-1,xn) ;
 
-          for (yk = -1 ; yk <= 1 ; yk++)
-          {
-            yn = y+yk ;
-            yn = MAX(0,yn) ;
-            yn = MIN(height-1,yn) ;
+/*
+  Smoothness energy of a single node: mean squared difference between
+  its displacement and those of its 26 neighbors. Shared by
+  gcamSmoothnessEnergy() and the fused evaluator in gcamComputeSSE().
+*/
+static double
+gcamSmoothnessEnergyAtNode( const GCA_MORPH *gcam, int x, int y, int z )
+{
+  double vx, vy, vz, vnx, vny, vnz, error, node_sse, dx, dy, dz ;
+  int    xk, yk, zk, xn, yn, zn, num ;
+  const GCA_MORPH_NODE  *gcamn, *gcamn_nbr ;
 
-            for (zk = -1 ; zk <= 1 ; zk++)
-            {
+  gcamn = &gcam->nodes[x][y][z] ;
 
-              if (!zk && !yk && !xk)
-              {
-                continue ;
-              }
+  if (gcamn->invalid == GCAM_POSITION_INVALID)
+  {
+    return(0.0) ;
+  }
 
-              zn = z+zk ;
-              zn = MAX(0,zn) ;
-              zn = MIN(depth-1,zn) ;
+  // Compute differences from original
+  vx = gcamn->x - gcamn->origx ;
+  vy = gcamn->y - gcamn->origy ;
+  vz = gcamn->z - gcamn->origz ;
+  num = 0 ;
+  node_sse = 0.0 ;
 
-              gcamn_nbr = &gcam->nodes[xn][yn][zn] ;
+  // Loop over 3^3 voxels centred on current
+  for (xk = -1 ; xk <= 1 ; xk++)
+  {
+    xn = x+xk ;
+    xn = MAX(0,xn) ;
+    xn = MIN(gcam->width-1,xn) ;
 
-              if (gcamn_nbr->invalid == GCAM_POSITION_INVALID)
-              {
-                continue;
-              }
+    for (yk = -1 ; yk <= 1 ; yk++)
+    {
+      yn = y+yk ;
+      yn = MAX(0,yn) ;
+      yn = MIN(gcam->height-1,yn) ;
 
-#if 0
-              if (gcamn_nbr->label != gcamn->label)
-              {
-                continue ;
-              }
-#endif
+      for (zk = -1 ; zk <= 1 ; zk++)
+      {
 
-              vnx = gcamn_nbr->x - gcamn_nbr->origx ;
-              vny = gcamn_nbr->y - gcamn_nbr->origy ;
-              vnz = gcamn_nbr->z - gcamn_nbr->origz ;
+        // Don't use self
+        if (!xk && !yk && !zk)
+        {
+          continue ;
+        }
 
-              dx += (vnx-vx) ;
-              dy += (vny-vy) ;
-              dz += (vnz-vz) ;
+        zn = z+zk ;
+        zn = MAX(0,zn) ;
+        zn = MIN(gcam->depth-1,zn) ;
 
-              if ((x == Gx && y == Gy && z == Gz) &&
-                  (Gdiag & DIAG_SHOW) && DIAG_VERBOSE_ON)
-              {
-                printf("\tnode(%d,%d,%d): V=(%2.2f,%2.2f,%2.2f), "
-                       "DX=(%2.2f,%2.2f,%2.2f)\n",
-                       xn, yn, zn, vnx, vny, vnz, vnx-vx, vny-vy, vnz-vz) ;
-              }
+        gcamn_nbr = &gcam->nodes[xn][yn][zn] ;
 
-              num++ ;
-            }
-          }
-        }
-        /*        num = 1 ;*/
-        if (num)
+        if (gcamn_nbr->invalid == GCAM_POSITION_INVALID)
         {
-          dx = dx * l_smoothness / num ;
-          dy = dy * l_smoothness / num ;
-          dz = dz * l_smoothness / num ;
+          continue;
         }
+        vnx = gcamn_nbr->x - gcamn_nbr->origx ;
+        vny = gcamn_nbr->y - gcamn_nbr->origy ;
+        vnz = gcamn_nbr->z - gcamn_nbr->origz ;
 
-        if (x == Gx && y == Gy && z == Gz)
-        {
-          printf("l_smoo: node(%d,%d,%d): DX=(%2.2f,%2.2f,%2.2f)\n",
-                 x, y, z, dx, dy, dz) ;
-        }
+        dx = vnx-vx ;
+        dy = vny-vy ;
+        dz = vnz - vz ;
 
-        gcamn->dx += dx ;
-        gcamn->dy += dy ;
-        gcamn->dz += dz ;
+        error = dx*dx + dy*dy + dz*dz ;
 
+        num++ ;
+        node_sse += error ;
       }
     }
   }
-#endif
-  return(NO_ERROR) ;
-}
 
+  if (x == Gx && y == Gy && z == Gz)
+  {
+    printf("E_smoo: node(%d,%d,%d) smoothness sse %2.3f (%d nbrs)\n",
+           x, y, z, node_sse/num, num) ;
+  }
 
+  /*        num = 1 ;*/
+  if (num > 0)
+  {
+    return(node_sse/num) ;
+  }
+  return(0.0) ;
+}
 
 #define GCAM_SMOOTHNESS_OUTPUT 0
 
@@ -7501,18 +7686,10 @@ gcamSmoothnessEnergy( const GCA_MORPH *gcam, const MRI *mri )
 #if SHOW_EXEC_LOC
   printf( "%s: CPU call\n", __FUNCTION__ );
 #endif
-  double vx=0, vy=0, vz=0, vnx=0, vny=0, vnz=0, error=0, node_sse=0;
-  double dx=0, dy=0, dz=0 ;
-  int x=0, y=0, z=0, xk=0, yk=0, zk=0, xn=0, yn=0, zn=0 ;
-  int width=0, height=0, depth=0, num=0 ;
-  const GCA_MORPH_NODE  *gcamn=NULL, *gcamn_nbr=NULL ;
-
-  width = gcam->width ;
-  height = gcam->height ;
-  depth = gcam->depth ;
+  int x=0, y=0, z=0 ;
 
 #ifdef HAVE_OPENMP
-  #pragma omp parallel for firstprivate(y,z,vx,vy,vz,vnx,vny,vnz,error,node_sse,dx,dy,dz,xk,yk,zk,xn,yn,zn,num,gcamn,gcamn_nbr) reduction(+:sse) shared(gcam,Gx,Gy,Gz) schedule(static,1)
+  #pragma omp parallel for firstprivate(y,z) reduction(+:sse) shared(gcam,Gx,Gy,Gz) schedule(static,1)
 #endif
   // Loop over all voxels
   for (x = 0 ; x < gcam->width ; x++ )
@@ -7527,93 +7704,381 @@ gcamSmoothnessEnergy( const GCA_MORPH *gcam, const MRI *mri )
           DiagBreak() ;
         }
 
-        gcamn = &gcam->nodes[x][y][z] ;
+        sse += gcamSmoothnessEnergyAtNode(gcam, x, y, z) ;
+      }
+    }
+  }
+#endif
 
-        if (gcamn->invalid == GCAM_POSITION_INVALID)
-        {
-          continue;
-        }
+  return(sse) ;
+}
 
-        // Compute differences from original
-        vx = gcamn->x - gcamn->origx ;
-        vy = gcamn->y - gcamn->origy ;
-        vz = gcamn->z - gcamn->origz ;
-        num = 0 ;
-        node_sse = 0.0 ;
 
-        // Loop over 3^3 voxels centred on current
-        for (xk = -1 ; xk <= 1 ; xk++)
-        {
-          xn = x+xk ;
-          xn = MAX(0,xn) ;
-          xn = MIN(width-1,xn) ;
+#ifdef GCAM_FUSED_TERMS
+/*
+  Fused evaluation of the log-likelihood, jacobian and smoothness
+  terms. Each of them only looks at a node and its 26 neighbors, so
+  instead of sweeping the whole morph once per term they are all
+  evaluated while the node is in cache. Work is split into x slabs and
+  the per-slab partial sums are added in slab order, so the result
+  doesn't depend on the number of threads.
+
+  If FS_GCAM_INCREMENTAL_ENERGY is set the unweighted per-node energies
+  are cached, and on the next call only nodes with a node in their
+  3x3x3 neighborhood whose state changed are re-evaluated. The cache
+  is keyed on the morph, the input volume and exp_k, and is reset at
+  the start of every GCAMregisterLevel() call.
+*/
+#define GCAM_ENERGY_LL      0x01
+#define GCAM_ENERGY_JACOBIAN 0x02
+#define GCAM_ENERGY_SMOOTH  0x04
 
-          for (yk = -1 ; yk <= 1 ; yk++)
-          {
-            yn = y+yk ;
-            yn = MAX(0,yn) ;
-            yn = MIN(height-1,yn) ;
+typedef struct
+{
+  const GCA_MORPH    *gcam ;
+  const MRI          *mri ;
+  int                width, height, depth ;
+  double             exp_k ;
+  double             thick ;
+  int                which ;
+  unsigned long long *hash ;      // per-node state hash
+  unsigned char      *changed ;   // node state differs from last call
+  double             *energy ;    // 3 unweighted energies per node
+} GCAM_ENERGY_CACHE ;
+
+static GCAM_ENERGY_CACHE gcam_energy_cache ;
 
-            for (zk = -1 ; zk <= 1 ; zk++)
-            {
+static int
+gcamUseFusedTerms(void)
+{
+  static int use_fused = -1 ;
 
-              // Don't use self
-              if (!xk && !yk && !zk)
-              {
-                continue ;
-              }
+  if (use_fused < 0)
+  {
+    use_fused = (getenv("FS_GCAM_UNFUSED") == NULL) ;
+  }
+  return(use_fused) ;
+}
 
-              zn = z+zk ;
-              zn = MAX(0,zn) ;
-              zn = MIN(depth-1,zn) ;
+static void
+gcamInvalidateEnergyCache(const GCA_MORPH *gcam)
+{
+  if (gcam && gcam_energy_cache.gcam != gcam)
+  {
+    return ;
+  }
+  if (gcam_energy_cache.hash)
+  {
+    free(gcam_energy_cache.hash) ;
+  }
+  if (gcam_energy_cache.changed)
+  {
+    free(gcam_energy_cache.changed) ;
+  }
+  if (gcam_energy_cache.energy)
+  {
+    free(gcam_energy_cache.energy) ;
+  }
+  memset(&gcam_energy_cache, 0, sizeof(gcam_energy_cache)) ;
+}
 
-              gcamn_nbr = &gcam->nodes[xn][yn][zn] ;
+/* FNV-1a over everything the three energies read from a node */
+static unsigned long long
+gcamNodeStateHash(const GCA_MORPH_NODE *gcamn)
+{
+  unsigned char       buf[9*sizeof(double)+4*sizeof(float)+
+                          2*sizeof(int)+sizeof(GC1D *)+1] ;
+  unsigned char       *cp = buf ;
+  unsigned long long  h = 14695981039346656037ULL ;
+  size_t              i ;
+
+  memcpy(cp, &gcamn->x, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->y, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->z, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->origx, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->origy, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->origz, sizeof(double)) ;
+  cp += sizeof(double) ;
+  memcpy(cp, &gcamn->area1, sizeof(float)) ;
+  cp += sizeof(float) ;
+  memcpy(cp, &gcamn->area2, sizeof(float)) ;
+  cp += sizeof(float) ;
+  memcpy(cp, &gcamn->orig_area1, sizeof(float)) ;
+  cp += sizeof(float) ;
+  memcpy(cp, &gcamn->orig_area2, sizeof(float)) ;
+  cp += sizeof(float) ;
+  memcpy(cp, &gcamn->label, sizeof(int)) ;
+  cp += sizeof(int) ;
+  memcpy(cp, &gcamn->status, sizeof(int)) ;
+  cp += sizeof(int) ;
+  memcpy(cp, &gcamn->gc, sizeof(GC1D *)) ;
+  cp += sizeof(GC1D *) ;
+  *cp++ = (unsigned char)gcamn->invalid ;
+
+  for (i = 0 ; i < (size_t)(cp-buf) ; i++)
+  {
+    h ^= buf[i] ;
+    h *= 1099511628211ULL ;
+  }
+  return(h) ;
+}
 
-              if (gcamn_nbr->invalid == GCAM_POSITION_INVALID)
-              {
-                continue;
-              }
-#if 0
-              if (gcamn_nbr->label != gcamn->label)
-              {
-                continue ;
-              }
+/*
+  Returns the weighted log-likelihood, jacobian and smoothness
+  energies in *pll_sse, *pj_sse and *ps_sse. A zero weight skips the
+  corresponding term.
+*/
+static int
+gcamComputeFusedEnergy(const GCA_MORPH *gcam, const MRI *mri,
+                       double l_ll, double l_jacobian, double l_smoothness,
+                       double *pll_sse, double *pj_sse, double *ps_sse)
+{
+  double            *slab_sse, thick, ll_sse, j_sse, s_sse ;
+  int               x, which, wanted, incremental, width, height, depth ;
+  GCAM_ENERGY_CACHE *cache = &gcam_energy_cache ;
+
+  width = gcam->width ;
+  height = gcam->height ;
+  depth = gcam->depth ;
+  thick = mri ? mri->thick : 1.0 ;
+  which = (DZERO(l_ll) ? 0 : GCAM_ENERGY_LL) |
+          (DZERO(l_jacobian) ? 0 : GCAM_ENERGY_JACOBIAN) |
+          (DZERO(l_smoothness) ? 0 : GCAM_ENERGY_SMOOTH) ;
+  wanted = which ;
+
+  incremental = (getenv("FS_GCAM_INCREMENTAL_ENERGY") != NULL) ;
+  if (incremental)
+  {
+    int fresh = 0 ;
+
+    if (cache->gcam != gcam || cache->mri != mri ||
+        cache->width != width || cache->height != height ||
+        cache->depth != depth || cache->exp_k != gcam->exp_k ||
+        cache->thick != thick || (cache->which & which) != which)
+    {
+      gcamInvalidateEnergyCache(NULL) ;
+      cache->hash = (unsigned long long *)
+                    calloc((size_t)width*height*depth,
+                           sizeof(unsigned long long)) ;
+      cache->changed = (unsigned char *)
+                       calloc((size_t)width*height*depth, 1) ;
+      cache->energy = (double *)
+                      calloc((size_t)3*width*height*depth, sizeof(double)) ;
+      if (!cache->hash || !cache->changed || !cache->energy)
+      {
+        ErrorExit(ERROR_NOMEMORY,
+                  "gcamComputeFusedEnergy: could not allocate energy "
+                  "cache for %dx%dx%d morph", width, height, depth) ;
+      }
+      cache->gcam = gcam ;
+      cache->mri = mri ;
+      cache->width = width ;
+      cache->height = height ;
+      cache->depth = depth ;
+      cache->exp_k = gcam->exp_k ;
+      cache->thick = thick ;
+      cache->which = which ;
+      fresh = 1 ;
+    }
+    /* evaluate every cached term so the cache stays complete */
+    which = cache->which ;
+
+    /* pass 1: find the nodes whose state changed since the last call */
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(static)
 #endif
-              vnx = gcamn_nbr->x - gcamn_nbr->origx ;
-              vny = gcamn_nbr->y - gcamn_nbr->origy ;
-              vnz = gcamn_nbr->z - gcamn_nbr->origz ;
+    for (x = 0 ; x < width ; x++)
+    {
+      int                y, z ;
+      size_t             index ;
+      unsigned long long h ;
 
-              dx = vnx-vx ;
-              dy = vny-vy ;
-              dz = vnz - vz ;
+      for (y = 0 ; y < height ; y++)
+      {
+        for (z = 0 ; z < depth ; z++)
+        {
+          index = ((size_t)x*height + y)*depth + z ;
+          h = gcamNodeStateHash(&gcam->nodes[x][y][z]) ;
+          cache->changed[index] = fresh || (h != cache->hash[index]) ;
+          cache->hash[index] = h ;
+        }
+      }
+    }
+  }
 
-              error = dx*dx + dy*dy + dz*dz ;
+  slab_sse = (double *)calloc((size_t)3*width, sizeof(double)) ;
+  if (!slab_sse)
+  {
+    ErrorExit(ERROR_NOMEMORY,
+              "gcamComputeFusedEnergy: could not allocate %d slabs", width) ;
+  }
 
-              num++ ;
-              node_sse += error ;
-            }
-          }
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (x = 0 ; x < width ; x++)
+  {
+    int    y, z, xk, yk, zk, dirty ;
+    size_t index ;
+    double ll, jac, smooth, *e ;
+
+    for (y = 0 ; y < height ; y++)
+    {
+      for (z = 0 ; z < depth ; z++)
+      {
+        if (x == Gx && y == Gy && z == Gz)
+        {
+          DiagBreak() ;
         }
 
-        /*        num = 1 ;*/
-        if (num > 0)
+        index = ((size_t)x*height + y)*depth + z ;
+        if (incremental)
         {
-          sse += node_sse/num ;
+          /* the energies at a node only depend on its 3x3x3 neighborhood */
+          dirty = 0 ;
+          for (xk = MAX(0,x-1) ; !dirty && xk <= MIN(width-1,x+1) ; xk++)
+            for (yk = MAX(0,y-1) ; !dirty && yk <= MIN(height-1,y+1) ; yk++)
+              for (zk = MAX(0,z-1) ; zk <= MIN(depth-1,z+1) ; zk++)
+                if (cache->changed[((size_t)xk*height + yk)*depth + zk])
+                {
+                  dirty = 1 ;
+                  break ;
+                }
+          e = &cache->energy[3*index] ;
+          if (dirty)
+          {
+            e[0] = (which & GCAM_ENERGY_LL) ?
+                   gcamLogLikelihoodEnergyAtNode(gcam, mri, x, y, z) : 0.0 ;
+            e[1] = (which & GCAM_ENERGY_JACOBIAN) ?
+                   gcamJacobianEnergyAtNode(gcam, x, y, z, thick) : 0.0 ;
+            e[2] = (which & GCAM_ENERGY_SMOOTH) ?
+                   gcamSmoothnessEnergyAtNode(gcam, x, y, z) : 0.0 ;
+          }
+          ll = e[0] ;
+          jac = e[1] ;
+          smooth = e[2] ;
+        }
+        else
+        {
+          ll = (which & GCAM_ENERGY_LL) ?
+               gcamLogLikelihoodEnergyAtNode(gcam, mri, x, y, z) : 0.0 ;
+          jac = (which & GCAM_ENERGY_JACOBIAN) ?
+                gcamJacobianEnergyAtNode(gcam, x, y, z, thick) : 0.0 ;
+          smooth = (which & GCAM_ENERGY_SMOOTH) ?
+                   gcamSmoothnessEnergyAtNode(gcam, x, y, z) : 0.0 ;
         }
+        slab_sse[3*x] += ll ;
+        slab_sse[3*x+1] += jac ;
+        slab_sse[3*x+2] += smooth ;
+      }
+    }
+  }
 
+  ll_sse = j_sse = s_sse = 0.0 ;
+  for (x = 0 ; x < width ; x++)
+  {
+    ll_sse += slab_sse[3*x] ;
+    j_sse += slab_sse[3*x+1] ;
+    s_sse += slab_sse[3*x+2] ;
+  }
+  free(slab_sse) ;
+
+  if (!finitep(j_sse))
+  {
+    DiagBreak() ;
+  }
+  /* the cache may hold terms that weren't asked for this time (and a
+     folded morph has an infinite jacobian energy), so don't form 0*inf */
+  *pll_sse = (wanted & GCAM_ENERGY_LL) ? l_ll * ll_sse : 0.0 ;
+  *pj_sse = (wanted & GCAM_ENERGY_JACOBIAN) ? l_jacobian * j_sse : 0.0 ;
+  *ps_sse = (wanted & GCAM_ENERGY_SMOOTH) ? l_smoothness * s_sse : 0.0 ;
+  return(NO_ERROR) ;
+}
+
+/*
+  Adds the log-likelihood and smoothness gradients in a single pass
+  over the nodes. Each node's gradient only depends on the node
+  positions, never on the gradient of its neighbors, so the per-node
+  update is the same as calling gcamLogLikelihoodTerm() followed by
+  gcamSmoothnessTerm() as long as no other term adds in between.
+*/
+static int
+gcamFusedLogLikelihoodSmoothnessTerm(GCA_MORPH *gcam, const MRI *mri,
+                                     const MRI *mri_smooth,
+                                     double l_log_likelihood,
+                                     double l_smoothness)
+{
+  int    x, i, nthreads ;
+  MATRIX *m_delI[_MAX_FS_THREADS], *m_inv_cov[_MAX_FS_THREADS] ;
+  VECTOR *v_means[_MAX_FS_THREADS], *v_grad[_MAX_FS_THREADS] ;
+
+#ifdef HAVE_OPENMP
+  nthreads = omp_get_max_threads() ;
+#else
+  nthreads = 1 ;
+#endif
+  if (nthreads > _MAX_FS_THREADS)
+  {
+    nthreads = _MAX_FS_THREADS ;
+  }
+
+  for (i = 0 ; i < nthreads ; i++)
+  {
+    m_delI[i] = MatrixAlloc(3, gcam->ninputs, MATRIX_REAL) ;
+    m_inv_cov[i] = MatrixAlloc(gcam->ninputs, gcam->ninputs, MATRIX_REAL) ;
+    v_means[i] = VectorAlloc(gcam->ninputs, 1) ;
+    v_grad[i] = VectorAlloc(3, MATRIX_REAL) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for num_threads(nthreads) schedule(static,1)
+#endif
+  for (x = 0 ; x < gcam->width ; x++)
+  {
+    int y, z, tid ;
+
+#ifdef HAVE_OPENMP
+    tid = omp_get_thread_num();
+#else
+    tid = 0;
+#endif
+    for (y = 0 ; y < gcam->height ; y++)
+    {
+      for (z = 0 ; z < gcam->depth ; z++)
+      {
         if (x == Gx && y == Gy && z == Gz)
         {
-          printf("E_smoo: node(%d,%d,%d) smoothness sse %2.3f (%d nbrs)\n",
-                 x, y, z, node_sse/num, num) ;
+          DiagBreak() ;
+        }
+
+        if (!DZERO(l_log_likelihood))
+          gcamLogLikelihoodTermAtNode(gcam, mri, mri_smooth,
+                                      l_log_likelihood, x, y, z,
+                                      m_delI[tid], m_inv_cov[tid],
+                                      v_means[tid], v_grad[tid]) ;
+        if (!DZERO(l_smoothness))
+        {
+          gcamSmoothnessTermAtNode(gcam, l_smoothness, x, y, z) ;
         }
       }
     }
   }
-#endif
 
-  return(sse) ;
+  for (i = 0 ; i < nthreads ; i++)
+  {
+    MatrixFree(&m_delI[i]) ;
+    MatrixFree(&m_inv_cov[i]) ;
+    VectorFree(&v_means[i]) ;
+    VectorFree(&v_grad[i]) ;
+  }
+  return(NO_ERROR) ;
 }
-
+#endif
 
 int
 gcamLSmoothnessTerm(GCA_MORPH *gcam, MRI *mri, double l_smoothness)
@@ -0,0 +1,584 @@
+/**
+ * @file  gzindex.c
+ * @brief random access into gzip files through a seek index
+ *
+ * See gzindex.h. The index building and positioning follows zran.c
+ * from the zlib distribution (Copyright (C) 2005, 2012 Mark Adler).
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef HAVE_ZLIB
+#include "zlib.h"
+#endif
+
+#include "error.h"
+#include "diag.h"
+#include "gzindex.h"
+
+#define GZI_CHUNK   16384
+#define GZI_MAGIC   0x475a4931   // "GZI1"
+
+struct GZI_READER
+{
+  FILE           *fp ;
+#ifdef HAVE_ZLIB
+  z_stream       strm ;
+#endif
+  int            raw ;      // still in the member of the starting point
+  int            eof ;
+  unsigned char  input[GZI_CHUNK] ;
+} ;
+
+#ifdef HAVE_ZLIB
+
+static int
+gziAddPoint(GZ_INDEX *gzi, int bits, off_t in, off_t out, unsigned left,
+            unsigned char *window)
+{
+  GZI_POINT *point ;
+
+  if ((gzi->npoints % 8) == 0)
+  {
+    point = (GZI_POINT *)realloc(gzi->points,
+                                 (gzi->npoints+8)*sizeof(GZI_POINT)) ;
+    if (point == NULL)
+      return(ERROR_NOMEMORY) ;
+    gzi->points = point ;
+  }
+  point = &gzi->points[gzi->npoints++] ;
+  point->bits = bits ;
+  point->in = in ;
+  point->out = out ;
+  if (left)
+    memcpy(point->window, window + GZI_WINSIZE - left, left) ;
+  if (left < GZI_WINSIZE)
+    memcpy(point->window + left, window, GZI_WINSIZE - left) ;
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  GZIbuild() - decompress fname once, recording a restart
+  point about every span uncompressed bytes.
+  ------------------------------------------------------*/
+GZ_INDEX *
+GZIbuild(const char *fname, off_t span)
+{
+  GZ_INDEX      *gzi ;
+  FILE          *fp ;
+  z_stream      strm ;
+  off_t         totin, totout, last ;
+  int           ret, c, nmembers = 1 ;
+  unsigned char *input, *window ;
+  struct stat   st ;
+
+  if (stat(fname, &st) != 0)
+    ErrorReturn(NULL, (ERROR_NOFILE, "GZIbuild(%s): could not stat file",
+                       fname)) ;
+  fp = fopen(fname, "rb") ;
+  if (fp == NULL)
+    ErrorReturn(NULL, (ERROR_NOFILE, "GZIbuild(%s): could not open file",
+                       fname)) ;
+  if (span <= 0)
+    span = GZI_DEFAULT_SPAN ;
+
+  gzi = (GZ_INDEX *)calloc(1, sizeof(GZ_INDEX)) ;
+  input = (unsigned char *)calloc(GZI_CHUNK, 1) ;
+  window = (unsigned char *)calloc(GZI_WINSIZE, 1) ;
+  if (gzi == NULL || input == NULL || window == NULL)
+    ErrorExit(ERROR_NOMEMORY, "GZIbuild: could not allocate index") ;
+  gzi->file_size = st.st_size ;
+  gzi->file_mtime = (long)st.st_mtime ;
+
+  memset(&strm, 0, sizeof(strm)) ;
+  ret = inflateInit2(&strm, 47) ;  // 15 bit window, gzip or zlib header
+  if (ret != Z_OK)
+    ErrorExit(ERROR_NOMEMORY, "GZIbuild: inflateInit2 failed (%d)", ret) ;
+
+  // the first point is at the start of the deflate data after the
+  // header, the others are at deflate block boundaries. Concatenated
+  // members (e.g. BGZF, see bgzf.h) are decoded one after the other,
+  // so points can also fall at the start of a member's deflate data.
+  totin = totout = last = 0 ;
+  strm.avail_out = 0 ;
+  do
+  {
+    strm.avail_in = fread(input, 1, GZI_CHUNK, fp) ;
+    if (ferror(fp) || strm.avail_in == 0)
+    {
+      ret = Z_DATA_ERROR ;
+      break ;
+    }
+    strm.next_in = input ;
+
+    do
+    {
+      if (strm.avail_out == 0)
+      {
+        strm.avail_out = GZI_WINSIZE ;
+        strm.next_out = window ;
+      }
+      totin += strm.avail_in ;
+      totout += strm.avail_out ;
+      ret = inflate(&strm, Z_BLOCK) ;
+      totin -= strm.avail_in ;
+      totout -= strm.avail_out ;
+      if (ret == Z_NEED_DICT)
+        ret = Z_DATA_ERROR ;
+      if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+        break ;
+      if (ret == Z_STREAM_END)
+      {
+        if (strm.avail_in == 0)
+        {
+          c = getc(fp) ;
+          if (c == EOF)
+            break ;
+          ungetc(c, fp) ;
+        }
+        inflateReset(&strm) ;  // next member, same (gzip) header parsing
+        nmembers++ ;
+        ret = Z_OK ;
+        continue ;
+      }
+
+      if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+          (totout == 0 || totout - last > span))
+      {
+        if (gziAddPoint(gzi, strm.data_type & 7, totin, totout,
+                        strm.avail_out, window) != NO_ERROR)
+        {
+          ret = Z_MEM_ERROR ;
+          break ;
+        }
+        last = totout ;
+      }
+    }
+    while (strm.avail_in != 0) ;
+  }
+  while (ret != Z_STREAM_END && ret != Z_MEM_ERROR && ret != Z_DATA_ERROR) ;
+
+  inflateEnd(&strm) ;
+  fclose(fp) ;
+  free(input) ;
+  free(window) ;
+
+  if (ret != Z_STREAM_END || gzi->npoints == 0)
+  {
+    GZIfree(&gzi) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GZIbuild(%s): could not inflate file",
+                       fname)) ;
+  }
+  gzi->total_out = totout ;
+  if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
+    printf("GZIbuild(%s): %d points over %ld bytes in %d members\n",
+           fname, gzi->npoints, (long)totout, nmembers) ;
+  return(gzi) ;
+}
+
+/*-----------------------------------------------------
+  GZIopenReader() - position a reader at the given
+  uncompressed offset of fname, using the nearest point
+  of the index at or before it.
+  ------------------------------------------------------*/
+GZI_READER *
+GZIopenReader(GZ_INDEX *gzi, const char *fname, off_t offset)
+{
+  GZI_READER    *gzr ;
+  GZI_POINT     *here ;
+  int           ret, n ;
+  unsigned char discard[GZI_WINSIZE] ;
+
+  if (offset < 0 || offset > gzi->total_out)
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "GZIopenReader(%s): offset %ld out of range",
+                       fname, (long)offset)) ;
+
+  gzr = (GZI_READER *)calloc(1, sizeof(GZI_READER)) ;
+  if (gzr == NULL)
+    ErrorExit(ERROR_NOMEMORY, "GZIopenReader: could not allocate reader") ;
+  gzr->fp = fopen(fname, "rb") ;
+  if (gzr->fp == NULL)
+  {
+    free(gzr) ;
+    ErrorReturn(NULL, (ERROR_NOFILE, "GZIopenReader(%s): could not open file",
+                       fname)) ;
+  }
+
+  here = gzi->points ;
+  for (n = 1 ; n < gzi->npoints && gzi->points[n].out <= offset ; n++)
+    here = &gzi->points[n] ;
+
+  ret = inflateInit2(&gzr->strm, -15) ;  // raw inflate
+  gzr->raw = 1 ;
+  if (ret != Z_OK)
+    ErrorExit(ERROR_NOMEMORY, "GZIopenReader: inflateInit2 failed (%d)", ret) ;
+  if (fseeko(gzr->fp, here->in - (here->bits ? 1 : 0), SEEK_SET) != 0)
+  {
+    GZIcloseReader(&gzr) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GZIopenReader(%s): seek failed",
+                       fname)) ;
+  }
+  if (here->bits)
+  {
+    ret = getc(gzr->fp) ;
+    if (ret == EOF)
+    {
+      GZIcloseReader(&gzr) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "GZIopenReader(%s): read failed",
+                         fname)) ;
+    }
+    inflatePrime(&gzr->strm, here->bits, ret >> (8 - here->bits)) ;
+  }
+  inflateSetDictionary(&gzr->strm, here->window, GZI_WINSIZE) ;
+  gzr->strm.avail_in = 0 ;
+
+  // decode and throw away everything up to offset
+  offset -= here->out ;
+  while (offset > 0)
+  {
+    n = offset > GZI_WINSIZE ? GZI_WINSIZE : (int)offset ;
+    if ((int)GZIreaderRead(gzr, discard, n) != n)
+    {
+      GZIcloseReader(&gzr) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "GZIopenReader(%s): inflate failed",
+                         fname)) ;
+    }
+    offset -= n ;
+  }
+  return(gzr) ;
+}
+
+/*-----------------------------------------------------
+  gziFill() - refill the input buffer if it is empty.
+  Returns the number of bytes available.
+  ------------------------------------------------------*/
+static size_t
+gziFill(GZI_READER *gzr)
+{
+  if (gzr->strm.avail_in == 0)
+  {
+    gzr->strm.avail_in = fread(gzr->input, 1, GZI_CHUNK, gzr->fp) ;
+    gzr->strm.next_in = gzr->input ;
+    if (ferror(gzr->fp))
+      gzr->strm.avail_in = 0 ;
+  }
+  return(gzr->strm.avail_in) ;
+}
+
+/*-----------------------------------------------------
+  gziNextMember() - continue with the next gzip member
+  after the end of a deflate stream. The member of the
+  starting point was inflated raw, so its trailer still
+  has to be skipped and the next header parsed by zlib.
+  Returns 0, or -1 at the end of the file.
+  ------------------------------------------------------*/
+static int
+gziNextMember(GZI_READER *gzr)
+{
+  uInt skip = gzr->raw ? 8 : 0, n ;
+
+  while (skip > 0)
+  {
+    if (gziFill(gzr) == 0)
+      return(-1) ;
+    n = gzr->strm.avail_in < skip ? gzr->strm.avail_in : skip ;
+    gzr->strm.next_in += n ;
+    gzr->strm.avail_in -= n ;
+    skip -= n ;
+  }
+  if (gziFill(gzr) == 0)
+    return(-1) ;
+  if (gzr->raw)
+  {
+    if (inflateReset2(&gzr->strm, 31) != Z_OK)  // gzip header only
+      return(-1) ;
+    gzr->raw = 0 ;
+  }
+  else if (inflateReset(&gzr->strm) != Z_OK)
+    return(-1) ;
+  return(0) ;
+}
+
+/*-----------------------------------------------------
+  GZIreaderRead() - decode the next len bytes into buf.
+  Returns the number of bytes decoded.
+  ------------------------------------------------------*/
+size_t
+GZIreaderRead(GZI_READER *gzr, void *buf, size_t len)
+{
+  int  ret ;
+  uInt want ;
+  size_t nread = 0 ;
+
+  while (nread < len && !gzr->eof)
+  {
+    want = (len - nread) > 0x40000000 ? 0x40000000 : (uInt)(len - nread) ;
+    gzr->strm.next_out = (unsigned char *)buf + nread ;
+    gzr->strm.avail_out = want ;
+    do
+    {
+      if (gziFill(gzr) == 0)
+      {
+        gzr->eof = 1 ;
+        break ;
+      }
+      ret = inflate(&gzr->strm, Z_NO_FLUSH) ;
+      if (ret == Z_STREAM_END && gziNextMember(gzr) == 0)
+        continue ;
+      if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR ||
+          ret == Z_STREAM_END)
+      {
+        gzr->eof = 1 ;
+        break ;
+      }
+    }
+    while (gzr->strm.avail_out != 0) ;
+    nread += want - gzr->strm.avail_out ;
+  }
+  return(nread) ;
+}
+
+int
+GZIcloseReader(GZI_READER **pgzr)
+{
+  GZI_READER *gzr = *pgzr ;
+
+  if (gzr == NULL)
+    return(NO_ERROR) ;
+  inflateEnd(&gzr->strm) ;
+  if (gzr->fp)
+    fclose(gzr->fp) ;
+  free(gzr) ;
+  *pgzr = NULL ;
+  return(NO_ERROR) ;
+}
+
+#else
+
+GZ_INDEX *
+GZIbuild(const char *fname, off_t span)
+{
+  ErrorReturn(NULL, (ERROR_UNSUPPORTED, "GZIbuild: built without zlib")) ;
+}
+
+GZI_READER *
+GZIopenReader(GZ_INDEX *gzi, const char *fname, off_t offset)
+{
+  ErrorReturn(NULL, (ERROR_UNSUPPORTED, "GZIopenReader: built without zlib")) ;
+}
+
+size_t
+GZIreaderRead(GZI_READER *gzr, void *buf, size_t len)
+{
+  return(0) ;
+}
+
+int
+GZIcloseReader(GZI_READER **pgzr)
+{
+  return(NO_ERROR) ;
+}
+
+#endif
+
+/*-----------------------------------------------------
+  GZIextract() - decode len bytes at the given
+  uncompressed offset of fname into buf.
+  ------------------------------------------------------*/
+size_t
+GZIextract(GZ_INDEX *gzi, const char *fname, off_t offset,
+           void *buf, size_t len)
+{
+  GZI_READER *gzr ;
+  size_t     nread ;
+
+  gzr = GZIopenReader(gzi, fname, offset) ;
+  if (gzr == NULL)
+    return(0) ;
+  nread = GZIreaderRead(gzr, buf, len) ;
+  GZIcloseReader(&gzr) ;
+  return(nread) ;
+}
+
+/*-----------------------------------------------------
+  GZIwrite() - save an index. The file is in native byte
+  order since it is only a cache of the gzip file.
+  ------------------------------------------------------*/
+int
+GZIwrite(GZ_INDEX *gzi, const char *idx_fname)
+{
+  FILE      *fp ;
+  int       magic = GZI_MAGIC, n ;
+  long long vals[3] ;
+
+  fp = fopen(idx_fname, "wb") ;
+  if (fp == NULL)
+    ErrorReturn(ERROR_NOFILE, (ERROR_NOFILE,
+                               "GZIwrite(%s): could not open file",
+                               idx_fname)) ;
+  vals[0] = gzi->total_out ;
+  vals[1] = gzi->file_size ;
+  vals[2] = gzi->file_mtime ;
+  fwrite(&magic, sizeof(int), 1, fp) ;
+  fwrite(vals, sizeof(long long), 3, fp) ;
+  fwrite(&gzi->npoints, sizeof(int), 1, fp) ;
+  for (n = 0 ; n < gzi->npoints ; n++)
+  {
+    vals[0] = gzi->points[n].out ;
+    vals[1] = gzi->points[n].in ;
+    vals[2] = gzi->points[n].bits ;
+    fwrite(vals, sizeof(long long), 3, fp) ;
+    fwrite(gzi->points[n].window, 1, GZI_WINSIZE, fp) ;
+  }
+  if (ferror(fp))
+  {
+    fclose(fp) ;
+    unlink(idx_fname) ;
+    ErrorReturn(ERROR_BADFILE, (ERROR_BADFILE,
+                                "GZIwrite(%s): write failed", idx_fname)) ;
+  }
+  fclose(fp) ;
+  return(NO_ERROR) ;
+}
+
+GZ_INDEX *
+GZIread(const char *idx_fname)
+{
+  FILE      *fp ;
+  GZ_INDEX  *gzi ;
+  int       magic, n ;
+  long long vals[3] ;
+
+  fp = fopen(idx_fname, "rb") ;
+  if (fp == NULL)
+    return(NULL) ;
+  if (fread(&magic, sizeof(int), 1, fp) != 1 || magic != GZI_MAGIC)
+  {
+    fclose(fp) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GZIread(%s): not a gzip index",
+                       idx_fname)) ;
+  }
+  gzi = (GZ_INDEX *)calloc(1, sizeof(GZ_INDEX)) ;
+  if (gzi == NULL)
+    ErrorExit(ERROR_NOMEMORY, "GZIread: could not allocate index") ;
+  if (fread(vals, sizeof(long long), 3, fp) != 3 ||
+      fread(&gzi->npoints, sizeof(int), 1, fp) != 1 || gzi->npoints <= 0)
+  {
+    fclose(fp) ;
+    free(gzi) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "GZIread(%s): truncated header",
+                       idx_fname)) ;
+  }
+  gzi->total_out = vals[0] ;
+  gzi->file_size = vals[1] ;
+  gzi->file_mtime = vals[2] ;
+  gzi->points = (GZI_POINT *)calloc(gzi->npoints, sizeof(GZI_POINT)) ;
+  if (gzi->points == NULL)
+    ErrorExit(ERROR_NOMEMORY, "GZIread: could not allocate %d points",
+              gzi->npoints) ;
+  for (n = 0 ; n < gzi->npoints ; n++)
+  {
+    if (fread(vals, sizeof(long long), 3, fp) != 3 ||
+        fread(gzi->points[n].window, 1, GZI_WINSIZE, fp) != GZI_WINSIZE)
+    {
+      fclose(fp) ;
+      GZIfree(&gzi) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "GZIread(%s): truncated point %d",
+                         idx_fname, n)) ;
+    }
+    gzi->points[n].out = vals[0] ;
+    gzi->points[n].in = vals[1] ;
+    gzi->points[n].bits = (int)vals[2] ;
+  }
+  fclose(fp) ;
+  return(gzi) ;
+}
+
+/*-----------------------------------------------------
+  GZIisCurrent() - returns 1 if the index was built from
+  the current contents of fname (same size and mtime).
+  ------------------------------------------------------*/
+int
+GZIisCurrent(GZ_INDEX *gzi, const char *fname)
+{
+  struct stat st ;
+
+  if (stat(fname, &st) != 0)
+    return(0) ;
+  return(gzi->file_size == st.st_size && gzi->file_mtime == (long)st.st_mtime) ;
+}
+
+/*-----------------------------------------------------
+  GZIload() - returns the index of fname from its sidecar
+  file (fname.gzidx) if that is current. Otherwise, if
+  build is set, indexes the file and tries to save the
+  sidecar, else returns NULL.
+  ------------------------------------------------------*/
+GZ_INDEX *
+GZIload(const char *fname, int build)
+{
+  GZ_INDEX *gzi ;
+  char     *idx_fname ;
+
+  idx_fname = (char *)calloc(strlen(fname)+8, sizeof(char)) ;
+  sprintf(idx_fname, "%s.gzidx", fname) ;
+
+  gzi = GZIread(idx_fname) ;
+  if (gzi && !GZIisCurrent(gzi, fname))
+  {
+    if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
+      printf("GZIload: %s is stale\n", idx_fname) ;
+    GZIfree(&gzi) ;
+  }
+  if (gzi == NULL && build)
+  {
+    gzi = GZIbuild(fname, GZI_DEFAULT_SPAN) ;
+    if (gzi)
+    {
+      int old_errno = errno ;
+      // the sidecar is only a cache, so a read-only dir is not an error
+      FILE *fp = fopen(idx_fname, "ab") ;
+      if (fp)
+      {
+        fclose(fp) ;
+        GZIwrite(gzi, idx_fname) ;
+      }
+      errno = old_errno ;
+    }
+  }
+  free(idx_fname) ;
+  return(gzi) ;
+}
+
+int
+GZIfree(GZ_INDEX **pgzi)
+{
+  GZ_INDEX *gzi = *pgzi ;
+
+  if (gzi == NULL)
+    return(NO_ERROR) ;
+  if (gzi->points)
+    free(gzi->points) ;
+  free(gzi) ;
+  *pgzi = NULL ;
+  return(NO_ERROR) ;
+}
@@ -2562,6 +2562,95 @@ LabelDilate(LABEL *area, MRI_SURFACE *mris, int num_times)
 }
 
 
+/*
+  add every vertex within dist mm of the label along the surface, as
+  measured by fast marching from all of the label's vertices at once
+  (see mrisgeodesic.c), rather than a number of rings of neighbors.
+*/
+int
+LabelDilateGeodesic(LABEL *area, MRI_SURFACE *mris, float dist)
+{
+  int    n, num_new_lvs, vno, *vnos, nvnos ;
+  float  *vdist ;
+  LV     *new_lv;
+  VERTEX *v ;
+
+  if (NULL == area)
+  {
+    ErrorReturn(ERROR_BADPARM,(ERROR_BADPARM,"LabelDilateGeodesic: NULL label"));
+  }
+  if (NULL == mris)
+  {
+    ErrorReturn(ERROR_BADPARM,(ERROR_BADPARM,"LabelDilateGeodesic: NULL mris"));
+  }
+  if (dist <= 0)
+  {
+    ErrorReturn(ERROR_BADPARM,(ERROR_BADPARM,"LabelDilateGeodesic: dist <= 0"));
+  }
+
+  vnos = (int *)calloc(area->n_points+1, sizeof(int)) ;
+  if (NULL == vnos)
+    ErrorReturn(ERROR_NOMEMORY,(ERROR_NOMEMORY,
+                                "LabelDilateGeodesic: couldn't allocate vnos"));
+  for (nvnos = n = 0 ; n < area->n_points ; n++)
+    if (area->lv[n].vno >= 0 && area->lv[n].vno < mris->nvertices &&
+        !area->lv[n].deleted)
+    {
+      vnos[nvnos++] = area->lv[n].vno ;
+    }
+  vdist = MRISgeodesicDistances(mris, vnos, nvnos, dist,
+                                GEODESIC_FAST_MARCH, NULL) ;
+  free(vnos) ;
+  if (NULL == vdist)
+  {
+    return(Gerror) ;
+  }
+
+  MRISclearMarks(mris) ;
+  LabelMarkStats(area, mris) ; // all vertices in label now have v->marked==1
+
+  /* Allocate an LV array the size of the surface. */
+  new_lv = (LV*) calloc( area->n_points+mris->nvertices, sizeof(LV) );
+  if (NULL == new_lv)
+    ErrorReturn(ERROR_NOMEMORY,(ERROR_NOMEMORY,
+                                "LabelDilateGeodesic: couldn't allocate new_lv"));
+
+  /* Copy the existing lvs over first and increment our count. */
+  memmove (new_lv, area->lv, area->n_points * sizeof(LV));
+  num_new_lvs = area->n_points;
+
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    v = &mris->vertices[vno] ;
+    if (v->marked == 1 || vdist[vno] > dist) // in label or too far
+    {
+      continue ;
+    }
+    if (vno == Gdiag_no)
+    {
+      DiagBreak() ;
+    }
+    new_lv[num_new_lvs].vno = vno ;
+    new_lv[num_new_lvs].x = v->x;
+    new_lv[num_new_lvs].y = v->y;
+    new_lv[num_new_lvs].z = v->z;
+    new_lv[num_new_lvs].stat = v->stat;
+    num_new_lvs++;
+  }
+  free(vdist) ;
+  MRISclearMarks(mris) ;
+
+  /* Point the label's lv to the new one and update the number of
+    points. */
+  free (area->lv);
+  area->lv = (LV*) realloc (new_lv, num_new_lvs * sizeof(LV));
+  area->n_points = num_new_lvs;
+  area->max_points = num_new_lvs;
+
+  return (NO_ERROR);
+}
+
+
 static LABEL_VERTEX *
 labelFindVertexNumber(LABEL *area, int vno)
 {
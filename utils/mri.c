@@ -38,6 +38,7 @@ const char *MRI_C_VERSION = "$Revision: 1.569 $";
 #include <memory.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #ifdef HAVE_OPENMP
 #include <omp.h>
 #endif
@@ -1220,7 +1221,7 @@ inline float MRIgetVoxVal(const MRI *mri, int c, int r, int s, int f)
   if (r < 0) return mri->outside_val;
   if (s < 0) return mri->outside_val;
 
-  if (mri->ischunked)
+  if (mri->ischunked && !mri->brick_size)
   {
     void *p;
     p = mri->chunk + c*mri->bytes_per_vox   + r*mri->bytes_per_row + 
@@ -1300,7 +1301,7 @@ inline int MRIsetVoxVal(MRI *mri, int c, int r, int s, int f, float voxval)
     break;
   }  
   
-  if (mri->ischunked)
+  if (mri->ischunked && !mri->brick_size)
   {
     void *p;
     p = mri->chunk + c*mri->bytes_per_vox   + r*mri->bytes_per_row + 
@@ -1467,43 +1468,6 @@ MRImatchDimensions(MRI *mri1, MRI *mri2)
           (FEQUAL(mri1->zsize, mri2->zsize))
     ) ;
 }
-MRI *
-MRIlinearScale(MRI *mri_src, MRI *mri_dst, float scale, float offset, 
-               int only_nonzero) 
-{
-  int     width, height, depth, x, y, z, frame ;
-  float   val ;
-
-  width = mri_src->width ; height = mri_src->height ; depth = mri_src->depth ;
-  if (!mri_dst)
-    mri_dst = MRIclone(mri_src, NULL) ;
-
-  for (frame = 0 ; frame < mri_src->nframes ; frame++)
-  {
-    for (z = 0 ; z < depth ; z++)
-    {
-      for (y = 0 ; y < height ; y++)
-      {
-        for (x = 0 ; x < width ; x++)
-        {
-          val = MRIgetVoxVal(mri_src, x, y, z, frame) ;
-          if (!only_nonzero || !DZERO(val))
-            val = val*scale+offset ;
-          if (mri_dst->type == MRI_UCHAR)
-          {
-            if (val > 255)
-              val = 255 ;
-            else if (val < 0) 
-              val = 0 ;
-          }
-          /*printf(" %d %d %d %d %f \n",x,y,z,frame,val);*/
-          MRIsetVoxVal(mri_dst, x, y, z, frame, val) ;
-        }
-      }
-    }
-  }
-  return(mri_dst) ;
-}
 double 
 MRIrmsDifferenceNonzero(MRI *mri1, MRI *mri2) 
 {
@@ -4964,101 +4928,6 @@ MRIinvertContrast(MRI *mri_src, MRI *mri_dst, float threshold)
   return(mri_dst) ;
 }
 
-/*-----------------------------------------------------
-  Parameters:
-
-  Returns value:
-
-  Description
-  threshold an MRI.
-  ------------------------------------------------------*/
-MRI *
-MRIbinarizeNoThreshold(MRI *mri_src, MRI *mri_dst)
-{
-  int     width, height, depth, f, z ;
-
-  if (!mri_dst)
-    mri_dst = MRIclone(mri_src, NULL) ;
-
-  width = mri_src->width ; height = mri_src->height ; depth = mri_src->depth ;
-
-  for (f = 0 ; f < mri_src->nframes ; f++)
-  {
-#ifdef HAVE_OPENMP
-#pragma omp parallel for
-#endif
-    for (z = 0 ; z < depth ; z++)
-    {
-    double    val ;
-    int       x, y ;
-
-      for (y = 0 ; y < height ; y++)
-      {
-        for (x = 0 ; x < width ; x++)
-        {
-          val = MRIgetVoxVal(mri_src, x, y, z, f) ;
-          if (val > 0)
-            val = 1 ;
-	  MRIsetVoxVal(mri_dst, x, y, z, f, val) ;
-        }
-      }
-    }
-  }
-
-  return(mri_dst) ;
-}
-
-/*-----------------------------------------------------
-  Parameters:
-
-  Returns value:
-
-  Description
-  threshold an MRI.
-  ------------------------------------------------------*/
-MRI *
-MRIbinarize(MRI *mri_src, MRI *mri_dst, float threshold, float low_val,
-            float hi_val)
-{
-  int     width, height, depth, f, z ;
-
-  if (!mri_dst)
-    mri_dst = MRIclone(mri_src, NULL) ;
-
-  width = mri_src->width ; height = mri_src->height ; depth = mri_src->depth ;
-
-  for (f = 0 ; f < mri_src->nframes ; f++)
-  {
-#ifdef HAVE_OPENMP
-#pragma omp parallel for
-#endif
-    for (z = 0 ; z < depth ; z++)
-    {
-    double    val ;
-    int       x, y ;
-
-      for (y = 0 ; y < height ; y++)
-      {
-        for (x = 0 ; x < width ; x++)
-        {
-          val = MRIgetVoxVal(mri_src, x, y, z, f) ;
-#if 0
-          MRIsampleVolumeFrameType
-          (mri_src, x, y, z, f, SAMPLE_NEAREST, &val) ;
-#endif
-          if (val < threshold)
-            val = low_val ;
-          else
-            val = hi_val ;
-          MRIsetVoxVal(mri_dst, x, y, z, f, val) ;
-        }
-      }
-    }
-  }
-
-  return(mri_dst) ;
-}
-
 /*-----------------------------------------------------*/
 MRI *MRIsubtract(MRI *mri1, MRI *mri2, MRI *mri_dst)
 {
@@ -5885,6 +5754,28 @@ int MRIchunk(MRI **pmri)
 }
 
 
+/*----------------------------------------------------------*/
+/*!
+  \fn int MRIbrick(MRI **pmri, int brick_size)
+  \brief Change input MRI memory allocation to the bricked chunk
+  layout (see MRIallocBricked()).
+  \return 0 on success, 1 if error
+  Has no effect if input is already bricked with the same brick size.
+*/
+int MRIbrick(MRI **pmri, int brick_size)
+{
+  MRI *mritmp;
+  if ((*pmri)->ischunked && (*pmri)->brick_size == brick_size) return(0);
+  mritmp = MRIallocBricked((*pmri)->width, (*pmri)->height, (*pmri)->depth,
+                           (*pmri)->type, (*pmri)->nframes, brick_size);
+  if (mritmp == NULL) return(1);
+  MRIcopy(*pmri, mritmp);
+  MRIfree(pmri);
+  *pmri = mritmp;
+  return(0);
+}
+
+
 /*----------------------------------------------------------
   Copy one MRI into another (including header info and data)
   -----------------------------------------------------------*/
@@ -6248,11 +6139,174 @@ MRI *MRIallocChunk(int width, int height, int depth, int type, int nframes)
   }
   return(mri) ;
 }
+/*-----------------------------------------------------*/
+/*!
+\fn MRI *MRIallocChunkMapped(int width, int height, int depth, int type,
+                             int nframes, void *mmap_base, size_t mmap_bytes,
+                             size_t offset)
+\brief Build a chunked MRI whose pixel data is already in memory at
+ mmap_base+offset (normally a file mapping made with mmap()). The data
+ must be in native byte order with the standard chunk layout. The MRI
+ takes ownership of the mapping and MRIfree() calls munmap() on it.
+*/
+MRI *MRIallocChunkMapped(int width, int height, int depth, int type,
+                         int nframes, void *mmap_base, size_t mmap_bytes,
+                         size_t offset)
+{
+  MRI *mri ;
+  int  slice, row;
+  BUFTYPE *p;
+
+  if ((width <= 0) || (height <= 0) || (depth <= 0) ||
+      MRIsizeof(type) == (size_t)-1)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM,
+                 "MRIallocChunkMapped(%d, %d, %d, type=%d): bad parm",
+                 width, height, depth, type)) ;
+
+  mris_alloced++ ;
+  mri = MRIallocHeader(width, height, depth, type, nframes) ;
+  mri->nframes = nframes ;
+  MRIinitHeader(mri) ;
+
+  mri->ischunked = 1;
+  mri->bytes_per_row   = mri->bytes_per_vox   * mri->width;
+  mri->bytes_per_slice = mri->bytes_per_row   * mri->height;
+  mri->bytes_per_vol   = mri->bytes_per_slice * mri->depth;
+  mri->bytes_total     = mri->bytes_per_vol   * mri->nframes;
+  if (offset + mri->bytes_total > mmap_bytes)
+  {
+    mris_alloced-- ;
+    ErrorReturn(NULL,
+                (ERROR_BADPARM,
+                 "MRIallocChunkMapped: %lu bytes at offset %lu exceed "
+                 "mapping of %lu bytes", (unsigned long)mri->bytes_total,
+                 (unsigned long)offset, (unsigned long)mmap_bytes)) ;
+  }
+  mri->mmap_base  = mmap_base;
+  mri->mmap_bytes = mmap_bytes;
+  mri->chunk = (BUFTYPE *)mmap_base + offset;
+
+  MRIallocIndices(mri) ;
+  mri->outside_val = 0 ;
+  mri->slices = (BUFTYPE ***)calloc(depth*nframes, sizeof(BUFTYPE **)) ;
+  if (!mri->slices)
+    ErrorExit(ERROR_NO_MEMORY,
+              "MRIallocChunkMapped: could not allocate %d slices\n",
+              mri->depth) ;
+
+  p = (BUFTYPE *)mri->chunk;
+  for (slice = 0 ; slice < depth*nframes ; slice++)
+  {
+    mri->slices[slice] = (BUFTYPE **)calloc(mri->height, sizeof(BUFTYPE *)) ;
+    if (!mri->slices[slice])
+      ErrorExit
+      (ERROR_NO_MEMORY,
+       "MRIallocChunkMapped(%d, %d, %d): could not allocate "
+       "%d bytes for %dth slice\n",
+       height, width, depth, mri->height*sizeof(BUFTYPE *), slice) ;
+    for (row = 0 ; row < mri->height ; row++)
+    {
+      mri->slices[slice][row] = p;
+      p += mri->bytes_per_row;
+    }
+  }
+  return(mri) ;
+}
+/*-----------------------------------------------------*/
+/*!
+\fn MRI *MRIallocBricked(int width, int height, int depth, int type,
+                         int nframes, int brick_size)
+\brief Alloc pixel data in MRI struct as one big buffer in which the
+ rows are tiled in brick_size x brick_size (row,slice) bricks.
+
+ Rows stay contiguous along x, so anything going through
+ mri->slices[z][y] (MRIvox(), MRIFseq_vox(), MRIgetVoxVal(), etc) is
+ unaffected, but the rows making up a brick_size^3 neighborhood all
+ live within one tile instead of being spread over brick_size slices.
+ This helps neighborhood operators (convolution, morphology, sampling)
+ on large hires volumes. The tiles are padded to full size at the
+ edges. Do not index the chunk with bytes_per_slice/bytes_per_vol
+ when brick_size is non-zero.
+*/
+MRI *MRIallocBricked(int width, int height, int depth, int type, int nframes,
+                     int brick_size)
+{
+  MRI    *mri ;
+  int    slice, row, frame, z, nybricks, nzbricks ;
+  size_t rows_per_brick, rows_per_frame, rowno ;
+
+  if (brick_size <= 1)
+    return(MRIallocChunk(width, height, depth, type, nframes)) ;
+
+  if ((width <= 0) || (height <= 0) || (depth <= 0) ||
+      MRIsizeof(type) == (size_t)-1)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIallocBricked(%d, %d, %d, type=%d): bad parm",
+                 width, height, depth, type)) ;
+
+  mris_alloced++ ;
+  mri = MRIallocHeader(width, height, depth, type, nframes) ;
+  mri->nframes = nframes ;
+  MRIinitHeader(mri) ;
+
+  nybricks = (height + brick_size - 1) / brick_size ;
+  nzbricks = (depth  + brick_size - 1) / brick_size ;
+  rows_per_brick = (size_t)brick_size * brick_size ;
+  rows_per_frame = rows_per_brick * nybricks * nzbricks ;
+
+  mri->ischunked = 1;
+  mri->brick_size = brick_size ;
+  mri->bytes_per_row   = mri->bytes_per_vox   * mri->width;
+  // slices and volumes are not contiguous in this layout
+  mri->bytes_per_slice = 0 ;
+  mri->bytes_per_vol   = mri->bytes_per_row   * rows_per_frame ;
+  mri->bytes_total     = mri->bytes_per_vol   * mri->nframes;
+  mri->chunk = calloc(mri->bytes_total,1);
+  if (mri->chunk == NULL)
+  {
+    printf("ERROR: MRIallocBricked(): could not alloc %lu\n",
+	   (unsigned long)mri->bytes_total);
+    return(NULL);
+  }
+
+  MRIallocIndices(mri) ;
+  mri->outside_val = 0 ;
+  mri->slices = (BUFTYPE ***)calloc(depth*nframes, sizeof(BUFTYPE **)) ;
+  if (!mri->slices)
+    ErrorExit(ERROR_NO_MEMORY,
+              "MRIallocBricked: could not allocate %d slices\n", mri->depth) ;
+
+  for (slice = 0 ; slice < depth*nframes ; slice++)
+  {
+    mri->slices[slice] = (BUFTYPE **)calloc(mri->height, sizeof(BUFTYPE *)) ;
+    if (!mri->slices[slice])
+      ErrorExit
+      (ERROR_NO_MEMORY,
+       "MRIallocBricked(%d, %d, %d): could not allocate "
+       "%d bytes for %dth slice\n",
+       height, width, depth, mri->height*sizeof(BUFTYPE *), slice) ;
+    frame = slice / depth ;
+    z = slice % depth ;
+    for (row = 0 ; row < mri->height ; row++)
+    {
+      rowno = frame * rows_per_frame +
+              ((size_t)(z/brick_size) * nybricks + row/brick_size) *
+              rows_per_brick +
+              (z%brick_size) * brick_size + (row%brick_size) ;
+      mri->slices[slice][row] =
+        (BUFTYPE *)mri->chunk + rowno*mri->bytes_per_row ;
+    }
+  }
+  return(mri) ;
+}
 /*-------------------------------------------------------------*/
 /*!
   \fn MRI *MRIallocSequence(int width, int height, int depth, int type, int nframes)
   \brief Allocate header and buffer for MRI struct. Maybe chunked or not
-   depending on the FS_USE_MRI_CHUNK environment variable.
+   depending on the FS_USE_MRI_CHUNK environment variable, or bricked
+   (see MRIallocBricked()) if FS_MRI_BRICK is set to the brick size
+   (eg, setenv FS_MRI_BRICK 8).
 */
 /*-------------------------------------------------------------*/
 MRI *MRIallocSequence(int width, int height, int depth, int type, int nframes)
@@ -6261,6 +6315,12 @@ MRI *MRIallocSequence(int width, int height, int depth, int type, int nframes)
   int     slice, row, bpp;
   BUFTYPE *buf ;
 
+  // Bricked layout is allocated directly, not copied from the row layout
+  if (getenv("FS_MRI_BRICK") != NULL && atoi(getenv("FS_MRI_BRICK")) > 1 &&
+      MRIsizeof(type) != (size_t)-1)
+    return(MRIallocBricked(width, height, depth, type, nframes,
+                           atoi(getenv("FS_MRI_BRICK")))) ;
+
   mris_alloced++ ;
 
   if ((width <= 0) || (height <= 0) || (depth <= 0))
@@ -6472,6 +6532,9 @@ MRI *MRIallocHeader(int width, int height, int depth, int type, int nframes)
   // Chunking memory management
   mri->ischunked = 0;
   mri->chunk = NULL;
+  mri->brick_size = 0;
+  mri->mmap_base = NULL;
+  mri->mmap_bytes = 0;
   mri->bytes_per_vox   = MRIsizeof(type);
 
   // These things are explicitly set to 0 here because we
@@ -6553,7 +6616,13 @@ MRIfree(MRI **pmri)
   else
   {
     //printf("Freeing MRI Chunk\n");
-    free(mri->chunk);
+    if (mri->mmap_base)
+    {
+      munmap(mri->mmap_base, mri->mmap_bytes) ;
+      mri->mmap_base = NULL ;
+    }
+    else
+      free(mri->chunk);
     mri->chunk = NULL;
     for(slice = 0 ; slice < mri->depth*mri->nframes ; slice++)
         if(mri->slices[slice]) free(mri->slices[slice]) ;
@@ -6941,11 +7010,15 @@ MRIcopyHeader( const MRI *mri_src, MRI *mri_dst )
   mri_dst->c_s = mri_src->c_s;
   mri_dst->ras_good_flag = mri_src->ras_good_flag;
 
-  mri_dst->bytes_per_vox   = MRIsizeof(mri_dst->type);
-  mri_dst->bytes_per_row   = mri_dst->bytes_per_vox   * mri_dst->width;
-  mri_dst->bytes_per_slice = mri_dst->bytes_per_row   * mri_dst->height;
-  mri_dst->bytes_per_vol   = mri_dst->bytes_per_slice * mri_dst->depth;
-  mri_dst->bytes_total     = mri_dst->bytes_per_vol   * mri_dst->nframes;
+  // a bricked destination keeps its own layout (bytes_per_slice == 0)
+  if (mri_dst->brick_size == 0)
+  {
+    mri_dst->bytes_per_vox   = MRIsizeof(mri_dst->type);
+    mri_dst->bytes_per_row   = mri_dst->bytes_per_vox   * mri_dst->width;
+    mri_dst->bytes_per_slice = mri_dst->bytes_per_row   * mri_dst->height;
+    mri_dst->bytes_per_vol   = mri_dst->bytes_per_slice * mri_dst->depth;
+    mri_dst->bytes_total     = mri_dst->bytes_per_vol   * mri_dst->nframes;
+  }
 
   mri_dst->brightness = mri_src->brightness;
   if (mri_src->register_mat != NULL)
@@ -12398,7 +12471,19 @@ MRIlinearTransformInterp(MRI *mri_src, MRI *mri_dst, MATRIX *mA,
     MRIsetValues(mri_dst, mri_src->outside_val) ;
     mri_dst->outside_val = mri_src->outside_val ;
   }
-    
+
+  // row-walking engine in mriresample.c; FS_RESAMPLE_LEGACY for the loop below
+  if (getenv("FS_RESAMPLE_LEGACY") == NULL &&
+      MRIresampleAffineSupported(mri_src, mri_dst, InterpMethod,
+                                 RESAMPLE_LIKE_TRANSFORM))
+  {
+    MRIresampleAffine(mri_src, mri_dst, mAinv, InterpMethod,
+                      RESAMPLE_LIKE_TRANSFORM, 0) ;
+    MatrixFree(&mAinv) ;
+    mri_dst->ras_good_flag = 1;
+    return(mri_dst) ;
+  }
+
   MRI_BSPLINE * bspline = NULL;
   if (InterpMethod == SAMPLE_CUBIC_BSPLINE)
     bspline = MRItoBSpline(mri_src,NULL,3);
@@ -13222,6 +13307,7 @@ MRI *MRIresampleFill
   int i_good_flag, i1_good_flag;
   int j_good_flag, j1_good_flag;
   int k_good_flag, k1_good_flag;
+  int use_engine;
 
   /* ----- keep the compiler quiet ----- */
   val = 0.0;
@@ -13273,8 +13359,13 @@ MRI *MRIresampleFill
   *MATRIX_RELT(dp, 4, 1) = 1.0;
   *MATRIX_RELT(sp, 4, 1) = 1.0;
 
+  // row-walking engine in mriresample.c; FS_RESAMPLE_LEGACY for the loops below
+  use_engine = (getenv("FS_RESAMPLE_LEGACY") == NULL &&
+                MRIresampleAffineSupported(src, dest, resample_type,
+                                           RESAMPLE_LIKE_FILL)) ;
+
   MRI_BSPLINE * bspline = NULL;
-  if (resample_type == SAMPLE_CUBIC_BSPLINE)
+  if (resample_type == SAMPLE_CUBIC_BSPLINE && !use_engine)
     bspline = MRItoBSpline(src,NULL,3);
 
   if (resample_type == SAMPLE_VOTE)
@@ -13367,6 +13458,8 @@ MRI *MRIresampleFill
     }
     MRIfree(&mri_votes) ;
   }
+  else if (use_engine)
+    MRIresampleAffine(src, dest, m, resample_type, RESAMPLE_LIKE_FILL, 0) ;
   else
   for (nframe = 0; nframe < template_vol->nframes; nframe++)
   {
@@ -15705,35 +15798,6 @@ MRImeanInLabelMultispectral(MRI *mri_src, MRI *mri_labeled, int label)
   }
   return(v_means) ;
 }
-double
-MRImeanInLabel(MRI *mri_src, MRI *mri_labeled, int label)
-{
-  int  x, y, z, nvox, l ;
-  double mean = 0.0 ;
-  float  val ;
-
-  nvox = 0 ;
-  for (x = 0 ; x < mri_src->width ; x++)
-  {
-    for (y = 0 ; y < mri_src->height ; y++)
-    {
-      for (z = 0 ; z < mri_src->depth ; z++)
-      {
-        l = nint(MRIgetVoxVal(mri_labeled, x, y, z, 0)) ;
-        if (l == label)
-        {
-          val = MRIgetVoxVal(mri_src, x, y, z, 0) ;
-          mean += val ;
-          nvox++ ;
-        }
-      }
-    }
-  }
-  if (!nvox)
-    nvox = 1 ;
-  return(mean/nvox) ;
-}
-
 double
 MRImeanAndStdInLabel(MRI *mri_src, MRI *mri_labeled, int label, double *pstd)
 {
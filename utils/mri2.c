@@ -794,70 +794,78 @@ int MRIvol2Vol(MRI *src, MRI *targ, MATRIX *Vt2s,
   }
 #else
 
-  if (InterpCode == SAMPLE_CUBIC_BSPLINE)
-    bspline = MRItoBSpline(src,NULL,3);
-
-  for (ct=0; ct < targ->width; ct++)
+  // row-walking engine in mriresample.c; FS_RESAMPLE_LEGACY for the loop below
+  if (getenv("FS_RESAMPLE_LEGACY") == NULL &&
+      MRIresampleAffineSupported(src, targ, InterpCode, RESAMPLE_LIKE_VOL2VOL))
+    MRIresampleAffine(src, targ, Vt2s, InterpCode, RESAMPLE_LIKE_VOL2VOL,
+                      RESAMPLE_PROGRESS) ;
+  else
   {
-    for (rt=0; rt < targ->height; rt++)
+    if (InterpCode == SAMPLE_CUBIC_BSPLINE)
+      bspline = MRItoBSpline(src,NULL,3);
+
+    for (ct=0; ct < targ->width; ct++)
     {
-      for (st=0; st < targ->depth; st++)
+      for (rt=0; rt < targ->height; rt++)
       {
+        for (st=0; st < targ->depth; st++)
+        {
 
-        /* Column in source corresponding to CRS in Target */
-        fcs = Vt2s->rptr[1][1] * ct + Vt2s->rptr[1][2] * rt +
-              Vt2s->rptr[1][3] * st + Vt2s->rptr[1][4] ;
-        ics = nint(fcs);
-        if (ics < 0 || ics >= src->width) continue;
-
-        /* Row in source corresponding to CRS in Target */
-        frs = Vt2s->rptr[2][1] * ct + Vt2s->rptr[2][2] * rt +
-              Vt2s->rptr[2][3] * st + Vt2s->rptr[2][4] ;
-        irs = nint(frs);
-        if (irs < 0 || irs >= src->height) continue;
+          /* Column in source corresponding to CRS in Target */
+          fcs = Vt2s->rptr[1][1] * ct + Vt2s->rptr[1][2] * rt +
+                Vt2s->rptr[1][3] * st + Vt2s->rptr[1][4] ;
+          ics = nint(fcs);
+          if (ics < 0 || ics >= src->width) continue;
 
-        /* Slice in source corresponding to CRS in Target */
-        fss = Vt2s->rptr[3][1] * ct + Vt2s->rptr[3][2] * rt +
-              Vt2s->rptr[3][3] * st + Vt2s->rptr[3][4] ;
-        iss = nint(fss);
-        if (iss < 0 || iss >= src->depth) continue;
+          /* Row in source corresponding to CRS in Target */
+          frs = Vt2s->rptr[2][1] * ct + Vt2s->rptr[2][2] * rt +
+                Vt2s->rptr[2][3] * st + Vt2s->rptr[2][4] ;
+          irs = nint(frs);
+          if (irs < 0 || irs >= src->height) continue;
 
-        /* Assign output volume values */
-        if (InterpCode == SAMPLE_TRILINEAR)
-          MRIsampleSeqVolume(src, fcs, frs, fss, valvect,
-                             0, src->nframes-1) ;
-        else
-        {
-          for (f=0; f < src->nframes ; f++)
+          /* Slice in source corresponding to CRS in Target */
+          fss = Vt2s->rptr[3][1] * ct + Vt2s->rptr[3][2] * rt +
+                Vt2s->rptr[3][3] * st + Vt2s->rptr[3][4] ;
+          iss = nint(fss);
+          if (iss < 0 || iss >= src->depth) continue;
+
+          /* Assign output volume values */
+          if (InterpCode == SAMPLE_TRILINEAR)
+            MRIsampleSeqVolume(src, fcs, frs, fss, valvect,
+                               0, src->nframes-1) ;
+          else
           {
-            switch (InterpCode)
+            for (f=0; f < src->nframes ; f++)
             {
-            case SAMPLE_NEAREST:
-              valvect[f] = MRIgetVoxVal(src,ics,irs,iss,f);
-              break ;
-            case SAMPLE_CUBIC_BSPLINE:
-              MRIsampleBSpline(bspline, fcs, frs, fss, f, &rval);
-              valvect[f] = rval;
-              break ;
-            case SAMPLE_SINC:      /* no multi-frame */
-              MRIsincSampleVolume(src, fcs, frs, fss, sinchw, &rval) ;
-              valvect[f] = rval;
-              break ;
-            default:
-              printf("ERROR: MRIvol2vol: interpolation method %i unknown\n",InterpCode);
-              exit(1);
+              switch (InterpCode)
+              {
+              case SAMPLE_NEAREST:
+                valvect[f] = MRIgetVoxVal(src,ics,irs,iss,f);
+                break ;
+              case SAMPLE_CUBIC_BSPLINE:
+                MRIsampleBSpline(bspline, fcs, frs, fss, f, &rval);
+                valvect[f] = rval;
+                break ;
+              case SAMPLE_SINC:      /* no multi-frame */
+                MRIsincSampleVolume(src, fcs, frs, fss, sinchw, &rval) ;
+                valvect[f] = rval;
+                break ;
+              default:
+                printf("ERROR: MRIvol2vol: interpolation method %i unknown\n",InterpCode);
+                exit(1);
 
+              }
             }
           }
-        }
 
-        for (f=0; f < src->nframes; f++)
-          MRIsetVoxVal(targ,ct,rt,st,f,valvect[f]);
+          for (f=0; f < src->nframes; f++)
+            MRIsetVoxVal(targ,ct,rt,st,f,valvect[f]);
 
-      } /* target col */
-    } /* target row */
-    exec_progress_callback(ct, targ->width, 0, 1);
-  } /* target slice */
+        } /* target col */
+      } /* target row */
+      exec_progress_callback(ct, targ->width, 0, 1);
+    } /* target slice */
+  }
 #endif
 
 #ifdef VERBOSE_MODE
@@ -3821,206 +3829,6 @@ MRI *MRIcrs(MRI *in, MRI *out)
   return(out);
 }
 
-/*---------------------------------------------------------
-  MRIsegStats() - computes statistics within a given
-  segmentation. Returns the number of voxels in the
-  segmentation.
-  ---------------------------------------------------------*/
-int MRIsegStats(MRI *seg, int segid, MRI *mri,int frame,
-                float *min, float *max, float *range,
-                float *mean, float *std)
-{
-  int id,nvoxels,r,c,s;
-  double val, sum, sum2;
-
-  *min = 0;
-  *max = 0;
-  sum  = 0;
-  sum2 = 0;
-  nvoxels = 0;
-  for (c=0; c < seg->width; c++)
-  {
-    for (r=0; r < seg->height; r++)
-    {
-      for (s=0; s < seg->depth; s++)
-      {
-        id = (int) MRIgetVoxVal(seg,c,r,s,0);
-        if (id != segid)
-        {
-          continue;
-        }
-        val =  MRIgetVoxVal(mri,c,r,s,frame);
-        nvoxels++;
-        if ( nvoxels == 1 )
-        {
-          *min = val;
-          *max = val;
-        }
-        if (*min > val)
-        {
-          *min = val;
-        }
-        if (*max < val)
-        {
-          *max = val;
-        }
-        sum  += val;
-        sum2 += (val*val);
-      }
-    }
-  }
-
-  *range = *max - *min;
-
-  if (nvoxels != 0)
-  {
-    *mean = sum/nvoxels;
-  }
-  else
-  {
-    *mean = 0.0;
-  }
-
-  if (nvoxels > 1)
-    *std = sqrt(((nvoxels)*(*mean)*(*mean) - 2*(*mean)*sum + sum2)/
-                (nvoxels-1));
-  else
-  {
-    *std = 0.0;
-  }
-
-  return(nvoxels);
-}
-/*------------------------------------------------------------*/
-/*!
-  \fn int MRIsegStatsRobust(MRI *seg, int segid, MRI *mri,int frame,
-		      float *min, float *max, float *range,
-		      float *mean, float *std, float Pct)
-  \brief Computes stats based on the the middle 100-2*Pct values, ie,
-         it trims Pct off the ends.
-*/
-int MRIsegStatsRobust(MRI *seg, int segid, MRI *mri,int frame,
-		      float *min, float *max, float *range,
-		      float *mean, float *std, float Pct)
-{
-  int id,nvoxels,r,c,s,k,m;
-  double val, sum, sum2;
-  float *vlist;
-
-  *min = 0;
-  *max = 0;
-  *range = 0;
-  *mean = 0;
-  *std = 0;
-
-  // Count number of voxels
-  nvoxels = 0;
-  for (c=0; c < seg->width; c++) {
-    for (r=0; r < seg->height; r++)  {
-      for (s=0; s < seg->depth; s++)  {
-        id = (int) MRIgetVoxVal(seg,c,r,s,0);
-        if (id != segid) continue;
-        nvoxels++;
-      }
-    }
-  }
-  if(nvoxels == 0) return(nvoxels);
-
-  // Load voxels into an array
-  vlist = (float *) calloc(sizeof(float),nvoxels);
-  nvoxels = 0;
-  for (c=0; c < seg->width; c++) {
-    for (r=0; r < seg->height; r++)  {
-      for (s=0; s < seg->depth; s++)  {
-        id = (int) MRIgetVoxVal(seg,c,r,s,0);
-        if (id != segid) continue;
-	vlist[nvoxels] = MRIgetVoxVal(mri,c,r,s,frame);
-        nvoxels++;
-      }
-    }
-  }
-  // Sort the array
-  qsort((void *) vlist, nvoxels, sizeof(float), compare_floats);
-
-  // Compute stats excluding Pct of the values from each end
-  sum  = 0;
-  sum2 = 0;
-  m = 0;
-  //printf("Robust Indices: %d %d\n",(int)nint(Pct*nvoxels/100.0),(int)nint((100-Pct)*nvoxels/100.0));
-  for(k=0; k < nvoxels; k++){
-    if(k < Pct*nvoxels/100.0)       continue;
-    if(k > (100-Pct)*nvoxels/100.0) continue;
-    val = vlist[k];
-    if(m == 0){
-      *min = val;
-      *max = val;
-    }
-    if (*min > val) *min = val;
-    if (*max < val) *max = val;
-    sum  += val;
-    sum2 += (val*val);
-    m = m + 1;
-  }
-
-  *range = *max - *min;
-  *mean = sum/m;
-  if(m > 1)
-    *std = sqrt(((m)*(*mean)*(*mean) - 2*(*mean)*sum + sum2)/
-                (m-1));
-  else *std = 0.0;
-
-  free(vlist);
-  vlist = NULL;
-  return(m);
-}
-/*---------------------------------------------------------
-  MRIsegFrameAvg() - computes the average time course withing the
-  given segmentation. Returns the number of voxels in the
-  segmentation. favg must be preallocated to number of
-  frames. favg = (double *) calloc(sizeof(double),mri->nframes);
-  ---------------------------------------------------------*/
-int MRIsegFrameAvg(MRI *seg, int segid, MRI *mri, double *favg)
-{
-  int id,nvoxels,r,c,s,f;
-  double val;
-
-  /* zero it out */
-  for (f=0; f<mri->nframes; f++)
-  {
-    favg[f] = 0;
-  }
-
-  nvoxels = 0;
-  for (c=0; c < seg->width; c++)
-  {
-    for (r=0; r < seg->height; r++)
-    {
-      for (s=0; s < seg->depth; s++)
-      {
-        id = (int) MRIgetVoxVal(seg,c,r,s,0);
-        if (id != segid)
-        {
-          continue;
-        }
-        for (f=0; f<mri->nframes; f++)
-        {
-          val =  MRIgetVoxVal(mri,c,r,s,f);
-          favg[f] += val;
-        }
-        nvoxels++;
-      }
-    }
-  }
-
-  if (nvoxels != 0)
-    for (f=0; f<mri->nframes; f++)
-    {
-      favg[f] /= nvoxels;
-    }
-
-  return(nvoxels);
-}
-
 MRI *
 MRImask_with_T2_and_aparc_aseg(MRI *mri_src, MRI *mri_dst, MRI *mri_T2, MRI *mri_aparc_aseg, float T2_thresh, int mm_from_exterior)
 {
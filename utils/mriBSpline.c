@@ -2167,9 +2167,12 @@ extern int MRIsampleSeqBSpline(const MRI_BSPLINE *bspline,double x, double y, do
 	    for (j = 0; j <= sdj; j++)
       {
 		    w = 0.0;
+        // coeff is always float and the mirrored indices are in range
+        const float *coeff_row =
+          &MRIFseq_vox(bspline->coeff, 0, yIndex[j], zIndex[k], f);
 		    for (i = 0; i <= sdi; i++)
         {
-          w+= xWeight[i] * MRIgetVoxVal(bspline->coeff,xIndex[i],yIndex[j],zIndex[k],f);
+          w+= xWeight[i] * coeff_row[xIndex[i]];
 		    }
         w2 += yWeight[j] * w;
       }
@@ -0,0 +1,596 @@
+/**
+ * @file  mriconvolve.c
+ * @brief separable Gaussian convolution engine on float rows
+ *
+ * MRIconvolveGaussian() used to make three MRIconvolve1d() passes per
+ * frame, each a scalar loop over the kernel per voxel. Here every pass
+ * is reduced to out[x] += k[i] * in[x] over whole contiguous rows (x is
+ * padded at the borders, y and z pick clamped source rows), which runs
+ * in SSE or AVX2 with a scalar fallback. The products are summed in
+ * the same order and without fused multiply-adds, so float results are
+ * identical to the MRIconvolve1d() path, and integer types are rounded
+ * after every pass just as before.
+ *
+ * MRIconvolveGaussianIIR() is a recursive (Young & van Vliet 1995)
+ * approximation whose cost does not depend on sigma, for very wide
+ * kernels.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVOLVE_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "mri.h"
+#include "error.h"
+#include "macros.h"
+#include "utils.h"
+#include "diag.h"
+
+typedef void (*ROW_AXPY_FUNC)(float *out, const float *in, float k, int n) ;
+
+static ROW_AXPY_FUNC row_axpy = NULL ;
+
+static void
+rowAxpyScalar(float *out, const float *in, float k, int n)
+{
+  int x ;
+
+  for (x = 0 ; x < n ; x++)
+    out[x] += k * in[x] ;
+}
+
+#ifdef __SSE2__
+static void
+rowAxpySSE(float *out, const float *in, float k, int n)
+{
+  int    x ;
+  __m128 vk = _mm_set1_ps(k) ;
+
+  for (x = 0 ; x+4 <= n ; x += 4)
+    _mm_storeu_ps(out+x, _mm_add_ps(_mm_loadu_ps(out+x),
+                                    _mm_mul_ps(vk, _mm_loadu_ps(in+x)))) ;
+  for ( ; x < n ; x++)
+    out[x] += k * in[x] ;
+}
+#endif
+
+#ifdef CONVOLVE_HAVE_AVX2
+// multiply and add separately (no FMA) to match the scalar sums exactly
+__attribute__((target("avx2")))
+static void
+rowAxpyAVX2(float *out, const float *in, float k, int n)
+{
+  int    x ;
+  __m256 vk = _mm256_set1_ps(k) ;
+
+  for (x = 0 ; x+8 <= n ; x += 8)
+    _mm256_storeu_ps(out+x,
+                     _mm256_add_ps(_mm256_loadu_ps(out+x),
+                                   _mm256_mul_ps(vk, _mm256_loadu_ps(in+x)))) ;
+  for ( ; x < n ; x++)
+    out[x] += k * in[x] ;
+}
+#endif
+
+static ROW_AXPY_FUNC
+rowAxpySelect(void)
+{
+  if (row_axpy == NULL)
+  {
+    ROW_AXPY_FUNC func = rowAxpyScalar ;
+#ifdef __SSE2__
+    func = rowAxpySSE ;
+#endif
+#ifdef CONVOLVE_HAVE_AVX2
+    __builtin_cpu_init() ;
+    if (__builtin_cpu_supports("avx2"))
+      func = rowAxpyAVX2 ;
+#endif
+    if (getenv("FS_CONVOLVE_SCALAR"))
+      func = rowAxpyScalar ;
+    row_axpy = func ;
+  }
+  return(row_axpy) ;
+}
+
+/*-----------------------------------------------------
+  MRIconvolveRowAxpy() - out[x] += k*in[x] for x < n,
+  using the widest vector unit the cpu supports.
+  ------------------------------------------------------*/
+void
+MRIconvolveRowAxpy(float *out, const float *in, float k, int n)
+{
+  rowAxpySelect()(out, in, k, n) ;
+}
+
+// (T)nint(v) and back, as the integer MRIconvolve1d*() variants store
+static void
+convolveRound(float *buf, size_t n, int type)
+{
+  long i ;
+
+  switch (type)
+  {
+  case MRI_UCHAR:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (i = 0 ; i < (long)n ; i++)
+      buf[i] = (float)(BUFTYPE)nint(buf[i]) ;
+    break ;
+  case MRI_SHORT:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (i = 0 ; i < (long)n ; i++)
+      buf[i] = (float)(short)nint(buf[i]) ;
+    break ;
+  case MRI_INT:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (i = 0 ; i < (long)n ; i++)
+      buf[i] = (float)nint(buf[i]) ;
+    break ;
+  default:
+    break ;
+  }
+}
+
+/*-----------------------------------------------------
+  MRIframeToFloat()/MRIfloatToFrame() - copy one frame
+  of an MRI to/from a packed float buffer (x fastest).
+  ------------------------------------------------------*/
+int
+MRIframeToFloat(MRI *mri, int frame, float *buf)
+{
+  int width = mri->width, height = mri->height, depth = mri->depth ;
+  int z ;
+
+  if (mri->type != MRI_UCHAR && mri->type != MRI_SHORT &&
+      mri->type != MRI_INT && mri->type != MRI_FLOAT)
+    ErrorReturn(ERROR_UNSUPPORTED,
+                (ERROR_UNSUPPORTED, "MRIframeToFloat: unsupported type %d",
+                 mri->type)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (z = 0 ; z < depth ; z++)
+  {
+    int   x, y ;
+    float *out = buf + (size_t)z*width*height ;
+
+    for (y = 0 ; y < height ; y++, out += width)
+    {
+      switch (mri->type)
+      {
+      case MRI_UCHAR:
+      {
+        BUFTYPE *in = &MRIseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = in[x] ;
+        break ;
+      }
+      case MRI_SHORT:
+      {
+        short *in = &MRISseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = in[x] ;
+        break ;
+      }
+      case MRI_INT:
+      {
+        int *in = &MRIIseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = in[x] ;
+        break ;
+      }
+      case MRI_FLOAT:
+        memcpy(out, &MRIFseq_vox(mri, 0, y, z, frame), width*sizeof(float)) ;
+        break ;
+      }
+    }
+  }
+  return(NO_ERROR) ;
+}
+
+int
+MRIfloatToFrame(float *buf, MRI *mri, int frame)
+{
+  int width = mri->width, height = mri->height, depth = mri->depth ;
+  int z ;
+
+  if (mri->type != MRI_UCHAR && mri->type != MRI_SHORT &&
+      mri->type != MRI_INT && mri->type != MRI_FLOAT)
+    ErrorReturn(ERROR_UNSUPPORTED,
+                (ERROR_UNSUPPORTED, "MRIfloatToFrame: unsupported type %d",
+                 mri->type)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (z = 0 ; z < depth ; z++)
+  {
+    int   x, y ;
+    float *in = buf + (size_t)z*width*height ;
+
+    for (y = 0 ; y < height ; y++, in += width)
+    {
+      switch (mri->type)
+      {
+      case MRI_UCHAR:
+      {
+        BUFTYPE *out = &MRIseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = (BUFTYPE)nint(in[x]) ;
+        break ;
+      }
+      case MRI_SHORT:
+      {
+        short *out = &MRISseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = (short)nint(in[x]) ;
+        break ;
+      }
+      case MRI_INT:
+      {
+        int *out = &MRIIseq_vox(mri, 0, y, z, frame) ;
+        for (x = 0 ; x < width ; x++)
+          out[x] = nint(in[x]) ;
+        break ;
+      }
+      case MRI_FLOAT:
+        memcpy(&MRIFseq_vox(mri, 0, y, z, frame), in, width*sizeof(float)) ;
+        break ;
+      }
+    }
+  }
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  MRIconvolveFloat1d() - convolve a packed float volume
+  along one axis with clamped borders. src and dst must
+  not overlap.
+  ------------------------------------------------------*/
+int
+MRIconvolveFloat1d(const float *src, float *dst, int width, int height,
+                   int depth, const float *k, int len, int axis)
+{
+  int           z, halflen = len/2 ;
+  size_t        slice = (size_t)width*height ;
+  ROW_AXPY_FUNC axpy = rowAxpySelect() ;
+
+  switch (axis)
+  {
+  case MRI_WIDTH:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (z = 0 ; z < depth ; z++)
+    {
+      int   x, y, i ;
+      float *pad = (float *)malloc((width+2*halflen)*sizeof(float)) ;
+
+      for (y = 0 ; y < height ; y++)
+      {
+        const float *in = src + z*slice + (size_t)y*width ;
+        float       *out = dst + z*slice + (size_t)y*width ;
+
+        for (x = 0 ; x < halflen ; x++)
+        {
+          pad[x] = in[0] ;
+          pad[halflen+width+x] = in[width-1] ;
+        }
+        memcpy(pad+halflen, in, width*sizeof(float)) ;
+        memset(out, 0, width*sizeof(float)) ;
+        for (i = 0 ; i < len ; i++)
+          axpy(out, pad+i, k[i], width) ;
+      }
+      free(pad) ;
+    }
+    break ;
+  case MRI_HEIGHT:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (z = 0 ; z < depth ; z++)
+    {
+      int y, yi, i ;
+
+      for (y = 0 ; y < height ; y++)
+      {
+        float *out = dst + z*slice + (size_t)y*width ;
+
+        memset(out, 0, width*sizeof(float)) ;
+        for (i = 0 ; i < len ; i++)
+        {
+          yi = MIN(MAX(y+i-halflen, 0), height-1) ;
+          axpy(out, src + z*slice + (size_t)yi*width, k[i],
+                             width) ;
+        }
+      }
+    }
+    break ;
+  case MRI_DEPTH:
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (z = 0 ; z < depth ; z++)
+    {
+      int y, zi, i ;
+
+      for (y = 0 ; y < height ; y++)
+      {
+        float *out = dst + z*slice + (size_t)y*width ;
+
+        memset(out, 0, width*sizeof(float)) ;
+        for (i = 0 ; i < len ; i++)
+        {
+          zi = MIN(MAX(z+i-halflen, 0), depth-1) ;
+          axpy(out, src + zi*slice + (size_t)y*width, k[i],
+                             width) ;
+        }
+      }
+    }
+    break ;
+  default:
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRIconvolveFloat1d: bad axis %d", axis)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  convolveGaussianFrame() - x, y and z passes over the
+  packed frame in a, using b as scratch. Axes of size 1
+  are skipped as in MRIconvolve1d(). Returns the buffer
+  holding the result.
+  ------------------------------------------------------*/
+static float *
+convolveGaussianFrame(float *a, float *b, int width, int height, int depth,
+                      const float *k, int len, int type)
+{
+  int    axis, dims[3], axes[3] = { MRI_WIDTH, MRI_HEIGHT, MRI_DEPTH } ;
+  float  *tmp ;
+  size_t nvox = (size_t)width*height*depth ;
+
+  dims[0] = width ;
+  dims[1] = height ;
+  dims[2] = depth ;
+  for (axis = 0 ; axis < 3 ; axis++)
+  {
+    if (dims[axis] == 1)
+      continue ;
+    MRIconvolveFloat1d(a, b, width, height, depth, k, len, axes[axis]) ;
+    convolveRound(b, nvox, type) ;
+    tmp = a ; a = b ; b = tmp ;
+  }
+  return(a) ;
+}
+
+/*-----------------------------------------------------
+  MRIconvolveGaussianSeparable() - the MRIconvolveGaussian()
+  engine: uchar, short, int and float volumes, any number
+  of frames, mri_dst may be mri_src. Frames are processed
+  in parallel when there are at least as many frames as
+  threads, otherwise the rows of each pass are.
+  ------------------------------------------------------*/
+MRI *
+MRIconvolveGaussianSeparable(MRI *mri_src, MRI *mri_dst, float *kernel,
+                             int klen)
+{
+  int    frame, nframes = mri_src->nframes, frame_parallel = 0 ;
+  size_t nvox ;
+
+  if (!mri_dst)
+    mri_dst = MRIclone(mri_src, NULL) ;
+  if (mri_src->type != mri_dst->type)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM,
+                 "MRIconvolveGaussianSeparable: src and dst types differ")) ;
+
+  nvox = (size_t)mri_src->width*mri_src->height*mri_src->depth ;
+#ifdef HAVE_OPENMP
+  frame_parallel = nframes > 1 && nframes >= omp_get_max_threads() ;
+  #pragma omp parallel for if(frame_parallel)
+#endif
+  for (frame = 0 ; frame < nframes ; frame++)
+  {
+    float *a, *b, *result ;
+
+    a = (float *)malloc(nvox*sizeof(float)) ;
+    b = (float *)malloc(nvox*sizeof(float)) ;
+    if (!a || !b)
+      ErrorExit(ERROR_NOMEMORY,
+                "MRIconvolveGaussianSeparable: could not allocate %lu voxels",
+                (unsigned long)nvox) ;
+    MRIframeToFloat(mri_src, frame, a) ;
+    result = convolveGaussianFrame(a, b, mri_src->width, mri_src->height,
+                                   mri_src->depth, kernel, klen,
+                                   mri_src->type) ;
+    MRIfloatToFrame(result, mri_dst, frame) ;
+    free(a) ;
+    free(b) ;
+    if (!frame_parallel)
+      exec_progress_callback(frame, nframes, 0, 1) ;
+  }
+
+  if (mri_dst != mri_src)
+    MRIcopyHeader(mri_src, mri_dst) ;
+  return(mri_dst) ;
+}
+
+// ======================================================
+// Recursive Gaussian (Young & van Vliet 1995)
+
+typedef struct
+{
+  double B, b1, b2, b3 ;    // normalized: w[n] = B x[n] + b1 w[n-1] + ...
+} IIR_COEFS ;
+
+static void
+iirCoefs(double sigma, IIR_COEFS *c)
+{
+  double q, b0, b1, b2, b3 ;
+
+  if (sigma >= 2.5)
+    q = 0.98711*sigma - 0.96330 ;
+  else
+    q = 3.97156 - 4.14554*sqrt(1.0 - 0.26891*sigma) ;
+  b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q ;
+  b1 = 2.44413*q + 2.85619*q*q + 1.26661*q*q*q ;
+  b2 = -(1.4281*q*q + 1.26661*q*q*q) ;
+  b3 = 0.422205*q*q*q ;
+  c->b1 = b1/b0 ;
+  c->b2 = b2/b0 ;
+  c->b3 = b3/b0 ;
+  c->B = 1.0 - (c->b1 + c->b2 + c->b3) ;
+}
+
+/*-----------------------------------------------------
+  iirRows() - causal then anti-causal recursion along a
+  sequence of n rows of width floats, stride apart. Each
+  step updates a whole row so the inner loops vectorize.
+  The borders start from the steady state of a constant
+  signal (clamped edges).
+  ------------------------------------------------------*/
+static void
+iirRows(float *base, size_t stride, int n, int width, const IIR_COEFS *c)
+{
+  int   x, i ;
+  float *w0, *w1, *w2, *w3 ;
+  float B = c->B, b1 = c->b1, b2 = c->b2, b3 = c->b3 ;
+
+  if (n < 2)
+    return ;
+  for (i = 0 ; i < n ; i++)
+  {
+    w0 = base + (size_t)i*stride ;
+    w1 = base + (size_t)MAX(i-1, 0)*stride ;
+    w2 = base + (size_t)MAX(i-2, 0)*stride ;
+    w3 = base + (size_t)MAX(i-3, 0)*stride ;
+    for (x = 0 ; x < width ; x++)
+      w0[x] = B*w0[x] + b1*w1[x] + b2*w2[x] + b3*w3[x] ;
+  }
+  for (i = n-1 ; i >= 0 ; i--)
+  {
+    w0 = base + (size_t)i*stride ;
+    w1 = base + (size_t)MIN(i+1, n-1)*stride ;
+    w2 = base + (size_t)MIN(i+2, n-1)*stride ;
+    w3 = base + (size_t)MIN(i+3, n-1)*stride ;
+    for (x = 0 ; x < width ; x++)
+      w0[x] = B*w0[x] + b1*w1[x] + b2*w2[x] + b3*w3[x] ;
+  }
+}
+
+/*-----------------------------------------------------
+  MRIconvolveGaussianIIR() - recursive approximation of
+  Gaussian smoothing with the given sigma (in voxels) in
+  each direction. The cost per voxel is independent of
+  sigma; accuracy is best for sigma >= 2.5. Works in
+  place on the float frame buffer, handles all frames.
+  ------------------------------------------------------*/
+MRI *
+MRIconvolveGaussianIIR(MRI *mri_src, MRI *mri_dst, float sigma)
+{
+  int       frame, width, height, depth ;
+  size_t    slice ;
+  float     *buf ;
+  IIR_COEFS c ;
+
+  if (sigma < 0.5)
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "MRIconvolveGaussianIIR: sigma %2.2f < 0.5", sigma)) ;
+  if (!mri_dst)
+    mri_dst = MRIclone(mri_src, NULL) ;
+  if (mri_src->type != mri_dst->type)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM,
+                 "MRIconvolveGaussianIIR: src and dst types differ")) ;
+
+  iirCoefs(sigma, &c) ;
+  width = mri_src->width ;
+  height = mri_src->height ;
+  depth = mri_src->depth ;
+  slice = (size_t)width*height ;
+  buf = (float *)malloc(slice*depth*sizeof(float)) ;
+  if (!buf)
+    ErrorExit(ERROR_NOMEMORY, "MRIconvolveGaussianIIR: could not allocate") ;
+
+  for (frame = 0 ; frame < mri_src->nframes ; frame++)
+  {
+    int z, y ;
+
+    MRIframeToFloat(mri_src, frame, buf) ;
+    // x: recursion along each row, one row at a time
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (z = 0 ; z < depth ; z++)
+      for (y = 0 ; y < height ; y++)
+        iirRows(buf + z*slice + (size_t)y*width, 1, width, 1, &c) ;
+    // y: rows of each slice
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (z = 0 ; z < depth ; z++)
+      iirRows(buf + z*slice, width, height, width, &c) ;
+    // z: rows of each coronal plane
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (y = 0 ; y < height ; y++)
+      iirRows(buf + (size_t)y*width, slice, depth, width, &c) ;
+    MRIfloatToFrame(buf, mri_dst, frame) ;
+  }
+  free(buf) ;
+
+  if (mri_dst != mri_src)
+    MRIcopyHeader(mri_src, mri_dst) ;
+  return(mri_dst) ;
+}
+
+/*-----------------------------------------------------
+  MRIkernelSigma() - standard deviation (in voxels) of a
+  normalized 1D kernel such as MRIgaussian1d() returns.
+  ------------------------------------------------------*/
+float
+MRIkernelSigma(float *kernel, int klen)
+{
+  int    i, half = klen/2 ;
+  double var = 0, norm = 0 ;
+
+  for (i = 0 ; i < klen ; i++)
+  {
+    var += kernel[i] * (double)(i-half)*(i-half) ;
+    norm += kernel[i] ;
+  }
+  if (norm <= 0)
+    return(0) ;
+  return((float)sqrt(var/norm)) ;
+}
@@ -3019,6 +3019,18 @@ MRIconvolveGaussian(MRI *mri_src, MRI *mri_dst, MRI *mri_gaussian)
 
   mri_dst = MRIconvolveGaussian_cuda( mri_src, mri_dst, kernel, klen );
 #else
+  /* FS_GAUSSIAN_IIR=<sigma>: recursive approximation for kernels at least
+     that wide (in voxels). FS_CONVOLVE_LEGACY: per-voxel MRIconvolve1d path */
+  if (getenv("FS_GAUSSIAN_IIR") &&
+      MRIkernelSigma(kernel, klen) >= atof(getenv("FS_GAUSSIAN_IIR")) &&
+      MRIkernelSigma(kernel, klen) >= 0.5)
+    return(MRIconvolveGaussianIIR(mri_src, mri_dst,
+                                  MRIkernelSigma(kernel, klen))) ;
+  if (getenv("FS_CONVOLVE_LEGACY") == NULL &&
+      (mri_src->type == MRI_UCHAR || mri_src->type == MRI_SHORT ||
+       mri_src->type == MRI_INT || mri_src->type == MRI_FLOAT))
+    return(MRIconvolveGaussianSeparable(mri_src, mri_dst, kernel, klen)) ;
+
   if (mri_dst == mri_src)
   {
     mri_tmp = mri_dst = MRIclone(mri_src, NULL) ;
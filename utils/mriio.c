@@ -45,6 +45,7 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "utils.h"
 #include "error.h"
@@ -77,6 +78,7 @@
 #include "nifti1.h"
 #include "nifti1_io.h"
 #include "znzlib.h"
+#include "gzindex.h"
 #include "mri_circulars.h"
 #include "dti.h"
 #include "gifti_local.h"
@@ -195,6 +197,8 @@ static void local_buffer_to_image
 
 static MRI *sdtRead(const char *fname, int read_volume);
 static MRI *mghRead(const char *fname, int read_volume, int frame) ;
+static MRI *mghReadFrames(const char *fname, int read_volume,
+                          int start_frame, int end_frame) ;
 static int mghWrite(MRI *mri,const  char *fname, int frame) ;
 static int mghAppend(MRI *mri,const  char *fname, int frame) ;
 
@@ -784,7 +788,14 @@ MRI *mri_read( const char *fname,
   }
   else if (type == MRI_MGH_FILE)
   {
-    mri = mghRead(fname_copy, volume_flag, -1);
+    if (start_frame >= 0 && volume_flag)
+    {
+      // only the requested frames are mapped or decompressed
+      mri = mghReadFrames(fname_copy, volume_flag, start_frame, end_frame);
+      start_frame = -1;
+    }
+    else
+      mri = mghRead(fname_copy, volume_flag, -1);
   }
   else if (type == MGH_MORPH)
   {
@@ -12497,13 +12508,195 @@ znzTAGreadMRIframes(znzFile fp, MRI *mri, long len)
 // declare function pointer
 //static int (*myclose)(FILE *stream);
 
+#define MGH_SKIP_BUFSIZE  (1024*1024)
+
+/*-----------------------------------------------------
+  mghSkipBytes() - advance fp by nbytes. A gzipped stream
+  is decompressed in large chunks rather than seeked
+  (pipes cannot seek).
+  ------------------------------------------------------*/
+static int
+mghSkipBytes(znzFile fp, long nbytes, int gzipped)
+{
+  char *buf ;
+  long n ;
+
+  if (nbytes <= 0)
+    return(NO_ERROR) ;
+  if (!gzipped)
+  {
+    znzseek(fp, nbytes, SEEK_CUR) ;
+    return(NO_ERROR) ;
+  }
+  buf = (char *)malloc(MGH_SKIP_BUFSIZE) ;
+  if (buf == NULL)
+    ErrorExit(ERROR_NOMEMORY, "mghSkipBytes: could not allocate buffer") ;
+  while (nbytes > 0)
+  {
+    n = nbytes > MGH_SKIP_BUFSIZE ? MGH_SKIP_BUFSIZE : nbytes ;
+    if ((long)znzread(buf, sizeof(char), n, fp) != n)
+    {
+      free(buf) ;
+      ErrorReturn(ERROR_BADFILE,
+                  (ERROR_BADFILE, "mghSkipBytes: unexpected end of file")) ;
+    }
+    nbytes -= n ;
+  }
+  free(buf) ;
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  mghMapFrames() - map nframes frames of an uncompressed
+  .mgh file, starting at byte offset, directly into a
+  chunked MRI instead of reading them. The mapping is
+  private, so on little-endian hosts the big-endian voxels
+  are swapped in place (only the swapped pages get copied;
+  uchar volumes are never copied). Returns NULL if the file
+  cannot be mapped so the caller can read it instead.
+  ------------------------------------------------------*/
+static MRI *
+mghMapFrames(const char *fname, int width, int height, int depth, int type,
+             int nframes, off_t offset)
+{
+  MRI         *mri ;
+  int         fd ;
+  off_t       map_offset ;
+  size_t      lead, nbytes ;
+  void        *base ;
+  struct stat st ;
+
+  nbytes = (size_t)width*height*depth*nframes*MRIsizeof(type) ;
+  map_offset = offset - offset % sysconf(_SC_PAGESIZE) ;
+  lead = (size_t)(offset - map_offset) ;
+
+  fd = open(fname, O_RDONLY) ;
+  if (fd < 0)
+  {
+    errno = 0 ;
+    return(NULL) ;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < offset + (off_t)nbytes)
+  {
+    close(fd) ;
+    errno = 0 ;
+    return(NULL) ;
+  }
+  base = mmap(NULL, lead+nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+              fd, map_offset) ;
+  close(fd) ;
+  if (base == MAP_FAILED)
+  {
+    errno = 0 ;
+    return(NULL) ;
+  }
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+  {
+    long i, nvox = (long)(nbytes / MRIsizeof(type)) ;
+
+    switch (type)
+    {
+    case MRI_SHORT:
+    {
+      short *p = (short *)((char *)base + lead) ;
+#ifdef HAVE_OPENMP
+      #pragma omp parallel for
+#endif
+      for (i = 0 ; i < nvox ; i++)
+        p[i] = orderShortBytes(p[i]) ;
+      break ;
+    }
+    case MRI_INT:
+    case MRI_FLOAT:
+    {
+      // floats are swapped as ints so that NaN bit patterns survive
+      int *p = (int *)((char *)base + lead) ;
+#ifdef HAVE_OPENMP
+      #pragma omp parallel for
+#endif
+      for (i = 0 ; i < nvox ; i++)
+        p[i] = orderIntBytes(p[i]) ;
+      break ;
+    }
+    default:
+      break ;
+    }
+  }
+#endif
+
+  mri = MRIallocChunkMapped(width, height, depth, type, nframes,
+                            base, lead+nbytes, lead) ;
+  if (mri == NULL)
+    munmap(base, lead+nbytes) ;
+  return(mri) ;
+}
+
+/*-----------------------------------------------------
+  mghOpenMemory() - wrap len bytes of buf in a znzFile so
+  the tag readers can parse a tail extracted through a
+  gzip index. buf must outlive the znzFile.
+  ------------------------------------------------------*/
+static znzFile
+mghOpenMemory(char *buf, size_t len)
+{
+  znzFile fp ;
+
+  fp = (znzFile)calloc(1, sizeof(struct znzptr)) ;
+  if (fp == NULL)
+    return(NULL) ;
+  fp->withz = 0 ;
+  fp->nzfptr = fmemopen(buf, len > 0 ? len : 1, "rb") ;
+  if (fp->nzfptr == NULL)
+  {
+    free(fp) ;
+    return(NULL) ;
+  }
+  return(fp) ;
+}
+
+/*-----------------------------------------------------
+  mghRead() - frame >= 0 reads that frame only, -1 reads
+  all frames and < -1 reads the first -frame frames.
+  ------------------------------------------------------*/
 static MRI *
 mghRead(const char *fname, int read_volume, int frame)
+{
+  if (frame >= 0)
+    return(mghReadFrames(fname, read_volume, frame, frame)) ;
+  if (frame < -1)
+    return(mghReadFrames(fname, read_volume, 0, -frame-1)) ;
+  return(mghReadFrames(fname, read_volume, 0, -1)) ;
+}
+
+/*-----------------------------------------------------
+  mghReadFrames() - read frames start_frame through
+  end_frame (end_frame < 0 means the last frame) of an
+  .mgh/.mgz file.
+
+  Uncompressed files are mapped rather than read if
+  FS_MGH_MMAP is set. The mapped MRI is chunked and, for
+  uchar volumes (and any type on big-endian hosts), still
+  backed by the file, so it must not be written back to
+  the same path. For compressed files a
+  sidecar gzip index (fname.gzidx, see gzindex.h) is used
+  if present to decode only the requested frames and the
+  trailing tags; set FS_MGZ_INDEX to build the index on
+  first use.
+  ------------------------------------------------------*/
+static MRI *
+mghReadFrames(const char *fname, int read_volume, int start_frame,
+              int end_frame)
 {
   MRI  *mri ;
   znzFile fp;
-  int   start_frame, end_frame, width, height, depth, nframes, type, x, y, z,
+  int   frame, width, height, depth, nframes, type, x, y, z,
   bpv, dof, bytes, version, ival, unused_space_size, good_ras_flag, i ;
+  int   nframes_file ;
+  long  data_offset, tags_offset, pos, vol_bytes ;
+  GZ_INDEX   *gzi = NULL ;
+  GZI_READER *gzr = NULL ;
+  char  *tail = NULL ;
   BUFTYPE *buf ;
   char   unused_buf[UNUSED_SPACE_SIZE+1] ;
   float  fval, xsize, ysize, zsize, x_r, x_a, x_s, y_r, y_a, y_s,
@@ -12542,7 +12735,7 @@ mghRead(const char *fname, int read_volume, int frame)
           (NULL,
            (ERROR_BADPARM,
             "mghRead(%s, %d): could not open file",
-            fname, frame)) ;
+            fname, start_frame)) ;
     }
   }
   else
@@ -12550,7 +12743,7 @@ mghRead(const char *fname, int read_volume, int frame)
     ErrorReturn(NULL,(ERROR_BADPARM,
                       "mghRead(%s, %d): could not open file.\n"
                       "Filename extension must be .mgh, .mgh.gz or .mgz",
-                      fname, frame));
+                      fname, start_frame));
   }
 
   /* keep the compiler quiet */
@@ -12563,7 +12756,7 @@ mghRead(const char *fname, int read_volume, int frame)
   nread = znzreadIntEx(&version, fp) ;
   if (!nread)
     ErrorReturn(NULL, (ERROR_BADPARM,"mghRead(%s, %d): read error",
-                       fname, frame)) ;
+                       fname, start_frame)) ;
 
   width = znzreadInt(fp) ;
   height = znzreadInt(fp) ;
@@ -12620,117 +12813,165 @@ mghRead(const char *fname, int read_volume, int frame)
     break ;
   }
   bytes = width * height * bpv ;  /* bytes per slice */
+  vol_bytes = (long)bytes * depth ;
+  nframes_file = nframes ;
+  data_offset = pos = znztell(fp) ;
+  tags_offset = data_offset + nframes_file * vol_bytes ;
+  if (end_frame < 0)
+    end_frame = nframes_file-1 ;
+  if (start_frame < 0 || start_frame > end_frame || end_frame >= nframes_file)
+  {
+    znzclose(fp);
+    errno = 0;
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "mghRead(%s): frames %d-%d out of range (%d frames)",
+                       fname, start_frame, end_frame, nframes_file)) ;
+  }
+
+  // a gzip index lets us skip decompressing unwanted frames
+  if (gzipped && (!read_volume || start_frame > 0 ||
+                  end_frame < nframes_file-1))
+  {
+    gzi = GZIload(fname, getenv("FS_MGZ_INDEX") != NULL) ;
+    if (gzi && gzi->total_out < tags_offset)
+      GZIfree(&gzi) ;
+  }
+
   if (!read_volume)
   {
     mri = MRIallocHeader(width, height, depth, type, nframes) ;
     mri->dof = dof ;
     mri->nframes = nframes ;
-    if (gzipped)
-    { // pipe cannot seek
-      long count, total_bytes;
-      uchar buf[STRLEN] ;
-
-      total_bytes = (long)mri->nframes*width*height*depth*bpv ;
-      for (count=0; count < total_bytes-STRLEN; count += STRLEN)
-        znzread(buf, STRLEN, 1, fp);
-      znzread(buf, total_bytes-count, 1, fp) ;
-    }
-    else
-      znzseek(fp, (long)mri->nframes*width*height*depth*bpv, SEEK_CUR) ;
   }
   else
   {
-    if (frame >= 0)
-    {
-      start_frame = end_frame = frame ;
-      if (gzipped)
-      { // pipe cannot seek
-        long count;
-        for (count=0; count < (long)frame*width*height*depth*bpv; count++)
-          znzgetc(fp);
-      }
-      else
-        znzseek(fp, (long)frame*width*height*depth*bpv, SEEK_CUR) ;
-      nframes = 1 ;
-    }
-    else
-    {  /* hack - # of frames < -1 means to only read in that
-          many frames. Otherwise I would have had to change the whole
-          MRIread interface and that was too much of a pain. Sorry.
-       */
-      if (frame < -1)
-        nframes = frame*-1 ;
-
-      start_frame = 0 ;
-      end_frame = nframes-1 ;
-      if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
-        fprintf(stderr, "read %d frames\n", nframes);
-    }
-    buf = (BUFTYPE *)calloc(bytes, sizeof(BUFTYPE)) ;
-    mri = MRIallocSequence(width, height, depth, type, nframes) ;
-    mri->dof = dof ;
-    for (frame = start_frame ; frame <= end_frame ; frame++)
+    nframes = end_frame - start_frame + 1 ;
+    if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
+      fprintf(stderr, "read frames %d-%d\n", start_frame, end_frame);
+
+    mri = NULL ;
+    if (!gzipped && type != MRI_TENSOR && getenv("FS_MGH_MMAP") != NULL)
+      mri = mghMapFrames(fname, width, height, depth, type, nframes,
+                         data_offset + start_frame*vol_bytes) ;
+    if (mri == NULL)
     {
-      for (z = 0 ; z < depth ; z++)
+      if (gzi)
+        gzr = GZIopenReader(gzi, fname, data_offset + start_frame*vol_bytes) ;
+      if (gzr == NULL)
       {
-        if ((int)znzread(buf, sizeof(char), bytes, fp) != bytes)
+        if (mghSkipBytes(fp, start_frame*vol_bytes, gzipped) != NO_ERROR)
         {
-          // fclose(fp) ;
           znzclose(fp);
-          free(buf) ;
-          ErrorReturn
-          (NULL,
-           (ERROR_BADFILE,
-            "mghRead(%s): could not read %d bytes at slice %d",
-            fname, bytes, z)) ;
+          GZIfree(&gzi) ;
+          return(NULL) ;
         }
-        switch (type)
+        pos = data_offset + (end_frame+1)*vol_bytes ;
+      }
+      buf = (BUFTYPE *)calloc(bytes, sizeof(BUFTYPE)) ;
+      mri = MRIallocSequence(width, height, depth, type, nframes) ;
+      for (frame = start_frame ; frame <= end_frame ; frame++)
+      {
+        for (z = 0 ; z < depth ; z++)
         {
-        case MRI_INT:
-          for (i = y = 0 ; y < height ; y++)
+          if (gzr)
+            nread = (int)GZIreaderRead(gzr, buf, bytes) ;
+          else
+            nread = (int)znzread(buf, sizeof(char), bytes, fp) ;
+          if (nread != bytes)
           {
-            for (x = 0 ; x < width ; x++, i++)
-            {
-              ival = orderIntBytes(((int *)buf)[i]) ;
-              MRIIseq_vox(mri,x,y,z,frame-start_frame) = ival ;
-            }
+            // fclose(fp) ;
+            znzclose(fp);
+            GZIcloseReader(&gzr) ;
+            GZIfree(&gzi) ;
+            free(buf) ;
+            ErrorReturn
+            (NULL,
+             (ERROR_BADFILE,
+              "mghRead(%s): could not read %d bytes at slice %d",
+              fname, bytes, z)) ;
           }
-          break ;
-        case MRI_SHORT:
-          for (i = y = 0 ; y < height ; y++)
+          switch (type)
           {
-            for (x = 0 ; x < width ; x++, i++)
+          case MRI_INT:
+            for (i = y = 0 ; y < height ; y++)
             {
-              sval = orderShortBytes(((short *)buf)[i]) ;
-              MRISseq_vox(mri,x,y,z,frame-start_frame) = sval ;
+              for (x = 0 ; x < width ; x++, i++)
+              {
+                ival = orderIntBytes(((int *)buf)[i]) ;
+                MRIIseq_vox(mri,x,y,z,frame-start_frame) = ival ;
+              }
             }
-          }
-          break ;
-        case MRI_TENSOR:
-        case MRI_FLOAT:
-          for (i = y = 0 ; y < height ; y++)
-          {
-            for (x = 0 ; x < width ; x++, i++)
+            break ;
+          case MRI_SHORT:
+            for (i = y = 0 ; y < height ; y++)
             {
-              fval = orderFloatBytes(((float *)buf)[i]) ;
-              MRIFseq_vox(mri,x,y,z,frame-start_frame) = fval ;
+              for (x = 0 ; x < width ; x++, i++)
+              {
+                sval = orderShortBytes(((short *)buf)[i]) ;
+                MRISseq_vox(mri,x,y,z,frame-start_frame) = sval ;
+              }
             }
+            break ;
+          case MRI_TENSOR:
+          case MRI_FLOAT:
+            for (i = y = 0 ; y < height ; y++)
+            {
+              for (x = 0 ; x < width ; x++, i++)
+              {
+                fval = orderFloatBytes(((float *)buf)[i]) ;
+                MRIFseq_vox(mri,x,y,z,frame-start_frame) = fval ;
+              }
+            }
+            break ;
+          case MRI_UCHAR:
+            local_buffer_to_image(buf, mri, z, frame-start_frame) ;
+            break ;
+          default:
+            errno = 0;
+            ErrorReturn(NULL,
+                        (ERROR_UNSUPPORTED, "mghRead: unsupported type %d",
+                         mri->type)) ;
+            break ;
           }
-          break ;
-        case MRI_UCHAR:
-          local_buffer_to_image(buf, mri, z, frame-start_frame) ;
-          break ;
-        default:
-          errno = 0;
-          ErrorReturn(NULL,
-                      (ERROR_UNSUPPORTED, "mghRead: unsupported type %d",
-                       mri->type)) ;
-          break ;
+          exec_progress_callback(z, depth, frame-start_frame,
+                                 end_frame-start_frame+1);
         }
-        exec_progress_callback(z, depth, frame-start_frame, end_frame-start_frame+1);
       }
+      if (buf) free(buf) ;
+      GZIcloseReader(&gzr) ;
     }
-    if (buf) free(buf) ;
+    mri->dof = dof ;
+  }
+
+  // position fp at the TR/flip/TE/TI/FOV and tags after the last frame
+  if (gzi)
+  {
+    size_t tail_len = (size_t)(gzi->total_out - tags_offset) ;
+
+    tail = (char *)calloc(tail_len+1, sizeof(char)) ;
+    if (GZIextract(gzi, fname, tags_offset, tail, tail_len) == tail_len)
+    {
+      znzclose(fp);
+      fp = mghOpenMemory(tail, tail_len) ;
+    }
+    else
+    {
+      free(tail) ;
+      tail = NULL ;
+      mghSkipBytes(fp, tags_offset - pos, gzipped) ;
+    }
+    GZIfree(&gzi) ;
+  }
+  else if (gzipped)
+    mghSkipBytes(fp, tags_offset - pos, gzipped) ;
+  else
+    znzseek(fp, tags_offset, SEEK_SET) ;
+  if (znz_isnull(fp))
+  {
+    if (tail) free(tail) ;
+    MRIfree(&mri) ;
+    ErrorReturn(NULL, (ERROR_NOMEMORY,
+                       "mghRead(%s): could not open tag buffer", fname)) ;
   }
 
   if (good_ras_flag > 0)
@@ -12802,7 +13043,10 @@ mghRead(const char *fname, int read_volume, int frame)
       switch (tag)      {
 
       case TAG_MRI_FRAME:
-        if (znzTAGreadMRIframes(fp, mri, len) != NO_ERROR)
+        // the tag describes frames 0..nframes_file-1 in order
+        if (start_frame > 0)
+          znzTAGskip(fp, tag, (long long)len) ;
+        else if (znzTAGreadMRIframes(fp, mri, len) != NO_ERROR)
           fprintf(stderr, "couldn't read frame structure from file\n") ;
         break ;
 
@@ -12889,6 +13133,7 @@ mghRead(const char *fname, int read_volume, int frame)
 
   // fclose(fp) ;
   znzclose(fp);
+  if (tail) free(tail) ;
 
   // xstart, xend, ystart, yend, zstart, zend are not stored
   mri->xstart = - mri->width/2.*mri->xsize;
@@ -0,0 +1,678 @@
+/**
+ * @file  mriresample.c
+ * @brief row-walking affine resampling engine
+ *
+ * MRIlinearTransformInterp(), MRIvol2Vol() and MRIresampleFill() all map
+ * every target voxel back into the source with a matrix-vector product
+ * and then sample each frame through the general MRIsample*() and
+ * MRIsetVoxVal() dispatch. MRIresampleAffine() does the same work a row
+ * at a time: it generates the source coordinates of a whole target row
+ * (SSE2 when available), classifies each voxel once (outside, nearest
+ * neighbor, or the 8 corners and weights of a trilinear sample), and then
+ * runs a kernel specialized for the source type over the row for every
+ * frame, so the geometry is shared by all frames. Slabs of slices are
+ * spread over threads.
+ *
+ * Each caller's semantics are reproduced exactly (mode): how the volume
+ * border is handled, which voxels are written at all, and the order of
+ * the floating point operations. By default the row coordinates come
+ * from the legacy float matrix products, so the output is bit-identical
+ * to the old code. With RESAMPLE_INCREMENTAL or FS_RESAMPLE_INCREMENTAL
+ * set they are instead computed incrementally in double precision (the
+ * row start plus a multiple of the column step), which is cheaper and
+ * more accurate but can move a trilinear or B-spline sample in the last
+ * bits. Nearest neighbor sampling, where that could change which label
+ * is picked, always uses the float coordinates.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mri.h"
+#include "mriBSpline.h"
+#include "error.h"
+#include "macros.h"
+#include "utils.h"
+#include "diag.h"
+
+// the clipping limits MRIsetVoxVal() uses (see mri.c)
+#ifndef UCHAR_MIN
+#define UCHAR_MIN  0.0
+#endif
+#ifndef UCHAR_MAX
+#define UCHAR_MAX  255.0
+#endif
+#ifndef SHORT_MIN
+#define SHORT_MIN  -32768.0
+#endif
+#ifndef SHORT_MAX
+#define SHORT_MAX  32767.0
+#endif
+#ifndef INT_MIN
+#define INT_MIN    -2147483648.0
+#endif
+#ifndef INT_MAX
+#define INT_MAX    2147483647.0
+#endif
+#ifndef LONG_MIN
+#define LONG_MIN   -2147483648.0
+#endif
+#ifndef LONG_MAX
+#define LONG_MAX   2147483647.0
+#endif
+
+// how a target voxel is filled
+#define RS_SKIP      0   // left alone (MRIvol2Vol() outside the source)
+#define RS_OUTSIDE   1   // src->outside_val
+#define RS_ZERO      2
+#define RS_NEAREST   3   // voxel (xm, ym, zm)
+#define RS_LINEAR    4   // 8 corners, clamped to the volume
+#define RS_LINEAR0   5   // 8 corners, the ones not in mask read as 0
+#define RS_BSPLINE   6
+
+typedef struct
+{
+  float  m[3][4] ;      // target voxel -> source voxel
+  double base[3][3] ;   // row start = base[r][0] + base[r][1]*y + base[r][2]*z
+  float  zero ;         // what the legacy float sums start from
+  int    exact ;
+}
+RESAMPLE_GEOM ;
+
+typedef struct
+{
+  int           width ;
+  double        *x, *y, *z ;       // source coordinates along the row
+  unsigned char *kind ;
+  unsigned char *mask ;            // corners inside the volume (RS_LINEAR0)
+  int           *xm, *ym, *zm ;    // nearest voxel, or the lower corner
+  int           *xp, *yp, *zp ;    // upper corner
+  double        *w ;               // 8 trilinear weights per voxel
+  float         *val ;             // one frame of the row, or all frames
+                                   // of one voxel for RS_BSPLINE
+}
+RESAMPLE_ROW ;
+
+typedef void (*RESAMPLE_KERNEL)(const MRI *src, const RESAMPLE_ROW *row,
+                                int frame, float *val) ;
+
+static RESAMPLE_ROW *
+resampleRowAlloc(int width, int nframes)
+{
+  RESAMPLE_ROW *row ;
+
+  row = (RESAMPLE_ROW *)calloc(1, sizeof(RESAMPLE_ROW)) ;
+  if (row == NULL)
+    ErrorExit(ERROR_NOMEMORY, "MRIresampleAffine: could not allocate row") ;
+  row->width = width ;
+  row->x = (double *)calloc(3*width, sizeof(double)) ;
+  row->kind = (unsigned char *)calloc(2*width, sizeof(unsigned char)) ;
+  row->xm = (int *)calloc(6*width, sizeof(int)) ;
+  row->w = (double *)calloc(8*width, sizeof(double)) ;
+  row->val = (float *)calloc(MAX(width, nframes), sizeof(float)) ;
+  if (!row->x || !row->kind || !row->xm || !row->w || !row->val)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRIresampleAffine: could not allocate %d voxel row", width) ;
+  row->y = row->x + width ;
+  row->z = row->y + width ;
+  row->mask = row->kind + width ;
+  row->ym = row->xm + width ;
+  row->zm = row->ym + width ;
+  row->xp = row->zm + width ;
+  row->yp = row->xp + width ;
+  row->zp = row->yp + width ;
+  return(row) ;
+}
+
+static void
+resampleRowFree(RESAMPLE_ROW **prow)
+{
+  RESAMPLE_ROW *row = *prow ;
+
+  *prow = NULL ;
+  free(row->x) ;
+  free(row->kind) ;
+  free(row->xm) ;
+  free(row->w) ;
+  free(row->val) ;
+  free(row) ;
+}
+
+/* same rounding as nint() in utils.c, inlined for the store loops */
+static inline int
+resampleNint(double f)
+{
+  return(f < 0 ? (int)(f-0.5) : (int)(f+0.5)) ;
+}
+
+/*-----------------------------------------------------------------------
+  resampleCoords() - source coordinates of target row (y, z). Exact mode
+  is the float sum ((zero + m0*x) + m1*y + m2*z) + m3 that MatrixMultiply()
+  and MRIvol2Vol() compute, rounded the same way at every step.
+  -----------------------------------------------------------------------*/
+static void
+resampleCoords(const RESAMPLE_GEOM *g, int y, int z, RESAMPLE_ROW *row)
+{
+  int    x, r, width = row->width ;
+  double *c[3] ;
+
+  c[0] = row->x ;
+  c[1] = row->y ;
+  c[2] = row->z ;
+  for (r = 0 ; r < 3 ; r++)
+  {
+    double *cr = c[r] ;
+
+    x = 0 ;
+    if (g->exact)
+    {
+      float fy = (float)y, fz = (float)z, v ;
+#ifdef __SSE2__
+      __m128 m0 = _mm_set1_ps(g->m[r][0]), m1y = _mm_set1_ps(g->m[r][1]*fy),
+             m2z = _mm_set1_ps(g->m[r][2]*fz), m3 = _mm_set1_ps(g->m[r][3]),
+             vzero = _mm_set1_ps(g->zero), vx, vc ;
+
+      for ( ; x+4 <= width ; x += 4)
+      {
+        vx = _mm_setr_ps((float)x, (float)(x+1), (float)(x+2), (float)(x+3));
+        vc = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(vzero,
+                                                         _mm_mul_ps(m0, vx)),
+                                              m1y), m2z), m3) ;
+        _mm_storeu_pd(cr+x, _mm_cvtps_pd(vc)) ;
+        _mm_storeu_pd(cr+x+2, _mm_cvtps_pd(_mm_movehl_ps(vc, vc))) ;
+      }
+#endif
+      for ( ; x < width ; x++)
+      {
+        v = g->zero + g->m[r][0] * (float)x ;
+        v = v + g->m[r][1] * fy ;
+        v = v + g->m[r][2] * fz ;
+        v = v + g->m[r][3] ;
+        cr[x] = v ;
+      }
+    }
+    else
+    {
+      double start = g->base[r][0] + g->base[r][1]*y + g->base[r][2]*z ;
+      double step = g->m[r][0] ;
+#ifdef __SSE2__
+      __m128d vstart = _mm_set1_pd(start), vstep = _mm_set1_pd(step),
+              vx = _mm_setr_pd(0.0, 1.0), two = _mm_set1_pd(2.0) ;
+
+      for ( ; x+2 <= width ; x += 2)
+      {
+        _mm_storeu_pd(cr+x, _mm_add_pd(vstart, _mm_mul_pd(vstep, vx))) ;
+        vx = _mm_add_pd(vx, two) ;
+      }
+#endif
+      for ( ; x < width ; x++)
+        cr[x] = start + step*x ;
+    }
+  }
+}
+
+static inline void
+resampleNearest(const MRI *src, RESAMPLE_ROW *row, int x)
+{
+  int xv, yv, zv ;
+
+  if (MRIindexNotInVolume(src, row->x[x], row->y[x], row->z[x]) == 1)
+  {
+    row->kind[x] = RS_OUTSIDE ;
+    return ;
+  }
+  xv = resampleNint(row->x[x]) ;
+  yv = resampleNint(row->y[x]) ;
+  zv = resampleNint(row->z[x]) ;
+  row->xm[x] = MIN(MAX(xv, 0), src->width-1) ;
+  row->ym[x] = MIN(MAX(yv, 0), src->height-1) ;
+  row->zm[x] = MIN(MAX(zv, 0), src->depth-1) ;
+  row->kind[x] = RS_NEAREST ;
+}
+
+/* the border clamping and weights of MRIsampleVolumeFrame() */
+static inline void
+resampleLinear(const MRI *src, RESAMPLE_ROW *row, int x)
+{
+  double xs = row->x[x], ys = row->y[x], zs = row->z[x], *w ;
+  double xmd, ymd, zmd, xpd, ypd, zpd ;
+  int    xm, ym, zm ;
+
+  if (MRIindexNotInVolume(src, xs, ys, zs) == 1)
+  {
+    row->kind[x] = RS_OUTSIDE ;
+    return ;
+  }
+  if (xs >= src->width)  xs = src->width - 1.0 ;
+  if (ys >= src->height) ys = src->height - 1.0 ;
+  if (zs >= src->depth)  zs = src->depth - 1.0 ;
+  if (xs < 0.0)          xs = 0.0 ;
+  if (ys < 0.0)          ys = 0.0 ;
+  if (zs < 0.0)          zs = 0.0 ;
+
+  row->xm[x] = xm = MAX((int)xs, 0) ;
+  row->xp[x] = MIN(src->width-1, xm+1) ;
+  row->ym[x] = ym = MAX((int)ys, 0) ;
+  row->yp[x] = MIN(src->height-1, ym+1) ;
+  row->zm[x] = zm = MAX((int)zs, 0) ;
+  row->zp[x] = MIN(src->depth-1, zm+1) ;
+
+  xmd = xs - (float)xm ;
+  ymd = ys - (float)ym ;
+  zmd = zs - (float)zm ;
+  xpd = (1.0f - xmd) ;
+  ypd = (1.0f - ymd) ;
+  zpd = (1.0f - zmd) ;
+
+  w = row->w + 8*x ;
+  w[0] = xpd * ypd * zpd ;
+  w[1] = xpd * ypd * zmd ;
+  w[2] = xpd * ymd * zpd ;
+  w[3] = xpd * ymd * zmd ;
+  w[4] = xmd * ypd * zpd ;
+  w[5] = xmd * ypd * zmd ;
+  w[6] = xmd * ymd * zpd ;
+  w[7] = xmd * ymd * zmd ;
+  row->kind[x] = RS_LINEAR ;
+}
+
+/* the zero padded corners of MRIresampleFill() */
+static inline void
+resampleFill(const MRI *src, RESAMPLE_ROW *row, int x, int InterpCode)
+{
+  int    si, sj, sk, good_i[2], good_j[2], good_k[2], k, c ;
+  float  si_f, sj_f, sk_f ;
+  double *w ;
+
+  si = (int)floor(row->x[x]) ;
+  sj = (int)floor(row->y[x]) ;
+  sk = (int)floor(row->z[x]) ;
+  // float like the legacy fractions
+  si_f = row->x[x] - si ;
+  sj_f = row->y[x] - sj ;
+  sk_f = row->z[x] - sk ;
+
+  good_i[0] = (si >= 0 && si < src->width) ;
+  good_i[1] = (si+1 >= 0 && si+1 < src->width) ;
+  good_j[0] = (sj >= 0 && sj < src->height) ;
+  good_j[1] = (sj+1 >= 0 && sj+1 < src->height) ;
+  good_k[0] = (sk >= 0 && sk < src->depth) ;
+  good_k[1] = (sk+1 >= 0 && sk+1 < src->depth) ;
+
+  row->xm[x] = MIN(MAX(si, 0), src->width-1) ;
+  row->xp[x] = MIN(MAX(si+1, 0), src->width-1) ;
+  row->ym[x] = MIN(MAX(sj, 0), src->height-1) ;
+  row->yp[x] = MIN(MAX(sj+1, 0), src->height-1) ;
+  row->zm[x] = MIN(MAX(sk, 0), src->depth-1) ;
+  row->zp[x] = MIN(MAX(sk+1, 0), src->depth-1) ;
+
+  if (InterpCode == SAMPLE_NEAREST)
+  {
+    int ci = (si_f >= 0.5), cj = (sj_f >= 0.5), ck = (sk_f >= 0.5) ;
+
+    if (!good_i[ci] || !good_j[cj] || !good_k[ck])
+    {
+      row->kind[x] = RS_ZERO ;
+      return ;
+    }
+    if (ci)
+      row->xm[x] = row->xp[x] ;
+    if (cj)
+      row->ym[x] = row->yp[x] ;
+    if (ck)
+      row->zm[x] = row->zp[x] ;
+    row->kind[x] = RS_NEAREST ;
+    return ;
+  }
+
+  for (row->mask[x] = 0, k = 0 ; k < 8 ; k++)
+  {
+    c = 0x80 >> k ;   // corner k is (k>>2, (k>>1)&1, k&1)
+    if (good_i[k>>2] && good_j[(k>>1)&1] && good_k[k&1])
+      row->mask[x] |= c ;
+  }
+  // same association as the legacy sum, where si_f*sj_f is a float product
+  // and the whole w[7] term is float arithmetic
+  w = row->w + 8*x ;
+  w[0] = (1.0-si_f) * (1.0-sj_f) * (1.0-sk_f) ;
+  w[1] = (1.0-si_f) * (1.0-sj_f) * (    sk_f) ;
+  w[2] = (1.0-si_f) * (    sj_f) * (1.0-sk_f) ;
+  w[3] = (1.0-si_f) * (    sj_f) * (    sk_f) ;
+  w[4] = (    si_f) * (1.0-sj_f) * (1.0-sk_f) ;
+  w[5] = (    si_f) * (1.0-sj_f) * (    sk_f) ;
+  w[6] = (    si_f) * (    sj_f) * (1.0-sk_f) ;
+  w[7] = (    si_f) * (    sj_f) * (    sk_f) ;
+  row->kind[x] = RS_LINEAR0 ;
+}
+
+/*-----------------------------------------------------------------------
+  resampleClassify() - decide once per voxel, for all frames, what the
+  caller named by mode would have sampled there.
+  -----------------------------------------------------------------------*/
+static void
+resampleClassify(const MRI *src, RESAMPLE_ROW *row, int InterpCode, int mode)
+{
+  int x ;
+
+  for (x = 0 ; x < row->width ; x++)
+  {
+    double xs = row->x[x], ys = row->y[x], zs = row->z[x] ;
+
+    switch (mode)
+    {
+    case RESAMPLE_LIKE_TRANSFORM:  // MRIsampleVolumeFrameType()
+      if (InterpCode == SAMPLE_CUBIC_BSPLINE)
+        row->kind[x] = RS_BSPLINE ;
+      else if (InterpCode == SAMPLE_NEAREST ||
+               (FEQUAL((int)xs,xs) && FEQUAL((int)ys,ys) &&
+                FEQUAL((int)zs,zs)))
+        resampleNearest(src, row, x) ;
+      else
+        resampleLinear(src, row, x) ;
+      break ;
+    case RESAMPLE_LIKE_VOL2VOL:
+    {
+      int ics = resampleNint(xs), irs = resampleNint(ys),
+          iss = resampleNint(zs) ;
+
+      if (ics < 0 || ics >= src->width || irs < 0 || irs >= src->height ||
+          iss < 0 || iss >= src->depth)
+        row->kind[x] = RS_SKIP ;
+      else if (InterpCode == SAMPLE_CUBIC_BSPLINE)
+        row->kind[x] = RS_BSPLINE ;
+      else if (InterpCode == SAMPLE_NEAREST)
+      {
+        row->xm[x] = ics ;
+        row->ym[x] = irs ;
+        row->zm[x] = iss ;
+        row->kind[x] = RS_NEAREST ;
+      }
+      else
+        resampleLinear(src, row, x) ;   // MRIsampleSeqVolume()
+      break ;
+    }
+    case RESAMPLE_LIKE_FILL:
+      if (InterpCode == SAMPLE_CUBIC_BSPLINE)
+        row->kind[x] = RS_BSPLINE ;
+      else
+        resampleFill(src, row, x, InterpCode) ;
+      break ;
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------
+  One kernel per source type. The trilinear sum is the one in
+  MRIsampleVolumeFrame(), term by term and in the same order.
+  -----------------------------------------------------------------------*/
+#define RESAMPLE_KERNEL_FOR(NAME, TYPE)                                       \
+static void                                                                   \
+NAME(const MRI *src, const RESAMPLE_ROW *row, int frame, float *val)          \
+{                                                                             \
+  int          x, xm, xp, m, z0 = frame*src->depth ;                          \
+  const TYPE   *rmm, *rmp, *rpm, *rpp ;                                       \
+  const double *w ;                                                           \
+  float        outside = src->outside_val ;                                   \
+                                                                              \
+  for (x = 0 ; x < row->width ; x++)                                          \
+  {                                                                           \
+    switch (row->kind[x])                                                     \
+    {                                                                         \
+    case RS_OUTSIDE:                                                          \
+      val[x] = outside ;                                                      \
+      break ;                                                                 \
+    case RS_ZERO:                                                             \
+      val[x] = 0 ;                                                            \
+      break ;                                                                 \
+    case RS_NEAREST:                                                          \
+      val[x] = (float)((const TYPE *)                                         \
+                       src->slices[row->zm[x]+z0][row->ym[x]])[row->xm[x]] ;  \
+      break ;                                                                 \
+    case RS_LINEAR:                                                           \
+      rmm = (const TYPE *)src->slices[row->zm[x]+z0][row->ym[x]] ;            \
+      rmp = (const TYPE *)src->slices[row->zp[x]+z0][row->ym[x]] ;            \
+      rpm = (const TYPE *)src->slices[row->zm[x]+z0][row->yp[x]] ;            \
+      rpp = (const TYPE *)src->slices[row->zp[x]+z0][row->yp[x]] ;            \
+      xm = row->xm[x] ;                                                       \
+      xp = row->xp[x] ;                                                       \
+      w = row->w + 8*x ;                                                      \
+      val[x] =                                                                \
+        w[0] * (double)rmm[xm] + w[1] * (double)rmp[xm] +                     \
+        w[2] * (double)rpm[xm] + w[3] * (double)rpp[xm] +                     \
+        w[4] * (double)rmm[xp] + w[5] * (double)rmp[xp] +                     \
+        w[6] * (double)rpm[xp] + w[7] * (double)rpp[xp] ;                     \
+      break ;                                                                 \
+    case RS_LINEAR0:                                                          \
+      rmm = (const TYPE *)src->slices[row->zm[x]+z0][row->ym[x]] ;            \
+      rmp = (const TYPE *)src->slices[row->zp[x]+z0][row->ym[x]] ;            \
+      rpm = (const TYPE *)src->slices[row->zm[x]+z0][row->yp[x]] ;            \
+      rpp = (const TYPE *)src->slices[row->zp[x]+z0][row->yp[x]] ;            \
+      xm = row->xm[x] ;                                                       \
+      xp = row->xp[x] ;                                                       \
+      m = row->mask[x] ;                                                      \
+      w = row->w + 8*x ;                                                      \
+      val[x] =                                                                \
+        w[0] * (m & 0x80 ? (float)rmm[xm] : 0.0f) +                           \
+        w[1] * (m & 0x40 ? (float)rmp[xm] : 0.0f) +                           \
+        w[2] * (m & 0x20 ? (float)rpm[xm] : 0.0f) +                           \
+        w[3] * (m & 0x10 ? (float)rpp[xm] : 0.0f) +                           \
+        w[4] * (m & 0x08 ? (float)rmm[xp] : 0.0f) +                           \
+        w[5] * (m & 0x04 ? (float)rmp[xp] : 0.0f) +                           \
+        w[6] * (m & 0x02 ? (float)rpm[xp] : 0.0f) +                           \
+        (float)w[7] * (m & 0x01 ? (float)rpp[xp] : 0.0f) ;                    \
+      break ;                                                                 \
+    }                                                                         \
+  }                                                                           \
+}
+
+RESAMPLE_KERNEL_FOR(resampleRowUchar, BUFTYPE)
+RESAMPLE_KERNEL_FOR(resampleRowShort, short)
+RESAMPLE_KERNEL_FOR(resampleRowInt, int)
+RESAMPLE_KERNEL_FOR(resampleRowLong, long32)
+RESAMPLE_KERNEL_FOR(resampleRowFloat, float)
+
+static RESAMPLE_KERNEL
+resampleKernel(int type)
+{
+  switch (type)
+  {
+  case MRI_UCHAR:
+    return(resampleRowUchar) ;
+  case MRI_SHORT:
+    return(resampleRowShort) ;
+  case MRI_INT:
+    return(resampleRowInt) ;
+  case MRI_LONG:
+    return(resampleRowLong) ;
+  case MRI_FLOAT:
+    return(resampleRowFloat) ;
+  }
+  return(NULL) ;
+}
+
+/* the clipping and rounding of MRIsetVoxVal() */
+#define RESAMPLE_STORE_INT(TYPE, LO, HI)                                      \
+  {                                                                           \
+    TYPE *p = (TYPE *)dst->slices[z+frame*dst->depth][y] ;                    \
+    for (x = 0 ; x < dst->width ; x++)                                        \
+    {                                                                         \
+      if (kind[x] == RS_SKIP)                                                 \
+        continue ;                                                            \
+      v = val[x] ;                                                            \
+      if (v < LO) v = LO ;                                                    \
+      if (v > HI) v = HI ;                                                    \
+      p[x] = resampleNint(v) ;                                                \
+    }                                                                         \
+  }
+
+static void
+resampleStore(MRI *dst, int y, int z, int frame,
+              const unsigned char *kind, const float *val)
+{
+  int   x ;
+  float v ;
+
+  switch (dst->type)
+  {
+  case MRI_UCHAR:
+    RESAMPLE_STORE_INT(BUFTYPE, UCHAR_MIN, UCHAR_MAX) ;
+    break ;
+  case MRI_SHORT:
+    RESAMPLE_STORE_INT(short, SHORT_MIN, SHORT_MAX) ;
+    break ;
+  case MRI_INT:
+    RESAMPLE_STORE_INT(int, INT_MIN, INT_MAX) ;
+    break ;
+  case MRI_LONG:
+    RESAMPLE_STORE_INT(long32, LONG_MIN, LONG_MAX) ;
+    break ;
+  case MRI_FLOAT:
+  {
+    float *p = (float *)dst->slices[z+frame*dst->depth][y] ;
+
+    for (x = 0 ; x < dst->width ; x++)
+      if (kind[x] != RS_SKIP)
+        p[x] = val[x] ;
+    break ;
+  }
+  }
+}
+
+/*-----------------------------------------------------------------------
+  MRIresampleAffineSupported() - whether MRIresampleAffine() can stand in
+  for the caller named by mode with these volumes and interpolation.
+  -----------------------------------------------------------------------*/
+int
+MRIresampleAffineSupported(const MRI *src, const MRI *dst, int InterpCode,
+                           int mode)
+{
+  if (InterpCode != SAMPLE_NEAREST && InterpCode != SAMPLE_TRILINEAR &&
+      InterpCode != SAMPLE_CUBIC_BSPLINE)
+    return(0) ;
+  if (resampleKernel(src->type) == NULL || resampleKernel(dst->type) == NULL)
+    return(0) ;
+  // MRIsampleVolumeFrameType() has no nearest neighbor case for longs
+  if (mode == RESAMPLE_LIKE_TRANSFORM && src->type == MRI_LONG)
+    return(0) ;
+  return(mode == RESAMPLE_LIKE_TRANSFORM || mode == RESAMPLE_LIKE_VOL2VOL ||
+         mode == RESAMPLE_LIKE_FILL) ;
+}
+
+/*-----------------------------------------------------------------------
+  MRIresampleAffine() - fill dst by sampling src at Vd2s * (c, r, s) for
+  every target voxel (c, r, s) and frame, the way the function named by
+  mode does (see RESAMPLE_LIKE_* in mri.h). dst is not cleared first;
+  RESAMPLE_LIKE_VOL2VOL leaves the voxels that map outside src alone.
+  ------------------------------------------------------------------------*/
+int
+MRIresampleAffine(MRI *src, MRI *dst, MATRIX *Vd2s, int InterpCode,
+                  int mode, int flags)
+{
+  RESAMPLE_GEOM   g ;
+  RESAMPLE_KERNEL kernel ;
+  MRI_BSPLINE     *bspline = NULL ;
+  int             r, c, z, nframes ;
+
+  if (!MRIresampleAffineSupported(src, dst, InterpCode, mode))
+    ErrorReturn(ERROR_UNSUPPORTED,
+                (ERROR_UNSUPPORTED,
+                 "MRIresampleAffine: unsupported interpolation %d or "
+                 "types %d -> %d", InterpCode, src->type, dst->type)) ;
+  if (Vd2s->rows != 4 || Vd2s->cols != 4)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRIresampleAffine: %dx%d matrix, not 4x4",
+                 Vd2s->rows, Vd2s->cols)) ;
+
+  for (r = 0 ; r < 3 ; r++)
+  {
+    for (c = 0 ; c < 4 ; c++)
+      g.m[r][c] = *MATRIX_RELT(Vd2s, r+1, c+1) ;
+    g.base[r][0] = g.m[r][3] ;
+    g.base[r][1] = g.m[r][1] ;
+    g.base[r][2] = g.m[r][2] ;
+  }
+  // MatrixMultiply() sums from 0, MRIvol2Vol() from its first product
+  g.zero = (mode == RESAMPLE_LIKE_VOL2VOL) ? -0.0f : 0.0f ;
+  g.exact = !(flags & RESAMPLE_INCREMENTAL) &&
+            getenv("FS_RESAMPLE_INCREMENTAL") == NULL ;
+  if (InterpCode == SAMPLE_NEAREST)
+    g.exact = 1 ;
+
+  kernel = resampleKernel(src->type) ;
+  if (InterpCode == SAMPLE_CUBIC_BSPLINE)
+    bspline = MRItoBSpline(src, NULL, 3) ;
+  nframes = MIN(src->nframes, dst->nframes) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
+#endif
+  {
+    RESAMPLE_ROW *row ;
+    int          x, y, f ;
+
+    row = resampleRowAlloc(dst->width, nframes) ;
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 1)
+#endif
+    for (z = 0 ; z < dst->depth ; z++)
+    {
+      for (y = 0 ; y < dst->height ; y++)
+      {
+        resampleCoords(&g, y, z, row) ;
+        resampleClassify(src, row, InterpCode, mode) ;
+        if (bspline)
+        {
+          for (x = 0 ; x < dst->width ; x++)
+          {
+            if (row->kind[x] != RS_BSPLINE)
+              continue ;
+            MRIsampleSeqBSpline(bspline, row->x[x], row->y[x], row->z[x],
+                                row->val, 0, nframes-1) ;
+            for (f = 0 ; f < nframes ; f++)
+              MRIsetVoxVal(dst, x, y, z, f, row->val[f]) ;
+          }
+          continue ;
+        }
+        for (f = 0 ; f < nframes ; f++)
+        {
+          (*kernel)(src, row, f, row->val) ;
+          resampleStore(dst, y, z, f, row->kind, row->val) ;
+        }
+      }
+#ifdef HAVE_OPENMP
+      if (omp_get_thread_num() != 0)
+        continue ;
+#endif
+      if (flags & RESAMPLE_PROGRESS)
+        exec_progress_callback(z, dst->depth, 0, 1) ;
+    }
+    resampleRowFree(&row) ;
+  }
+
+  if (bspline)
+    MRIfreeBSpline(&bspline) ;
+  return(NO_ERROR) ;
+}
@@ -0,0 +1,521 @@
+/**
+ * @file  mrisbvh.c
+ * @brief bounding volume hierarchy over surface faces
+ *
+ * Self-intersection checks used to hash every face into an
+ * MRIS_HASH_TABLE, sample each face into a voxel list and run
+ * tri_tri_intersect() against everything sharing a voxel, rebuilding
+ * the table after every move. An MRIS_BVH is a binary tree of axis
+ * aligned boxes over the faces instead: it is built once per topology
+ * (median split of the face centroids on the widest axis, a few faces
+ * per leaf), and when vertices move only the boxes of their faces and
+ * of the nodes above them are refit. A face is tested against exactly
+ * the faces whose boxes overlap its own, so the answer does not depend
+ * on a hash resolution, and the all-faces query is split across
+ * threads with each face writing only its own result.
+ *
+ * Nodes are allocated in pairs as they are split, so children always
+ * come after their parent and a refit is one reverse pass over the
+ * nodes. Faces that share a vertex or have linked vertices (see
+ * VERTEX_INFO) are not tested against each other, as in
+ * MHTdoesFaceIntersect(). Ripped faces stay in the tree and are skipped
+ * by the queries, so ripping does not need a rebuild; changing the
+ * faces themselves does. The tree keeps its own copy of the vertex
+ * coordinates, so queries see the positions as of the last build or
+ * refit.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "mrisurf.h"
+#include "tritri.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+
+#define BVH_LEAF_FACES  4
+#define BVH_MAX_DEPTH   256
+
+static void bvhVertexXYZ(MRIS_BVH *bvh, MRI_SURFACE *mris, int vno) ;
+static void bvhFaceBox(MRIS_BVH *bvh, MRI_SURFACE *mris, int fno) ;
+static void bvhNodeBox(MRIS_BVH *bvh, int node) ;
+static void bvhSelect(int *fnos, const float *key, int n, int k) ;
+static int  bvhSplit(MRIS_BVH *bvh, const float *cen, float *key, int node) ;
+static int  bvhFacesIntersect(const MRIS_BVH *bvh, MRI_SURFACE *mris,
+                              int fno, int fno2, double v[3][3]) ;
+
+/*-------------------------------------------------------------------
+  bvhVertexXYZ() - copy the coordinates of vertex vno in the vertex set
+  the tree was built for into bvh->xyz.
+  -------------------------------------------------------------------*/
+static void
+bvhVertexXYZ(MRIS_BVH *bvh, MRI_SURFACE *mris, int vno)
+{
+  float *xyz = &bvh->xyz[3*vno] ;
+
+  MRISvertexCoord2XYZ_float(&mris->vertices[vno], bvh->which,
+                            &xyz[0], &xyz[1], &xyz[2]) ;
+}
+
+/*-------------------------------------------------------------------
+  bvhFaceBox() - recompute the bounding box of face fno from bvh->xyz.
+  -------------------------------------------------------------------*/
+static void
+bvhFaceBox(MRIS_BVH *bvh, MRI_SURFACE *mris, int fno)
+{
+  FACE  *f = &mris->faces[fno] ;
+  float *box = &bvh->box[6*fno], x, y, z ;
+  int   n ;
+
+  for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+  {
+    x = bvh->xyz[3*f->v[n]] ;
+    y = bvh->xyz[3*f->v[n]+1] ;
+    z = bvh->xyz[3*f->v[n]+2] ;
+    if (n == 0)
+    {
+      box[0] = box[3] = x ;
+      box[1] = box[4] = y ;
+      box[2] = box[5] = z ;
+      continue ;
+    }
+    box[0] = MIN(box[0], x) ;
+    box[3] = MAX(box[3], x) ;
+    box[1] = MIN(box[1], y) ;
+    box[4] = MAX(box[4], y) ;
+    box[2] = MIN(box[2], z) ;
+    box[5] = MAX(box[5], z) ;
+  }
+}
+
+/*-------------------------------------------------------------------
+  bvhNodeBox() - recompute the box of a node from its faces (leaf) or
+  its two children, which must be up to date.
+  -------------------------------------------------------------------*/
+static void
+bvhNodeBox(MRIS_BVH *bvh, int node)
+{
+  MRIS_BVH_NODE *bn = &bvh->nodes[node] ;
+  const float   *box ;
+  int           i, k, n ;
+
+  if (bn->count > 0)
+    n = bn->count ;
+  else
+    n = 2 ;
+  for (i = 0 ; i < n ; i++)
+  {
+    if (bn->count > 0)
+      box = &bvh->box[6*bvh->fnos[bn->start+i]] ;
+    else
+      box = bvh->nodes[bn->start+i].box ;
+    for (k = 0 ; k < 3 ; k++)
+    {
+      if (i == 0 || box[k] < bn->box[k])
+        bn->box[k] = box[k] ;
+      if (i == 0 || box[k+3] > bn->box[k+3])
+        bn->box[k+3] = box[k+3] ;
+    }
+  }
+}
+
+/*-------------------------------------------------------------------
+  bvhSelect() - partially order fnos[0..n-1] so that fnos[k] holds the
+  face with the k-th smallest key, those before it are not larger and
+  those after it not smaller. Ties are broken on the face number so
+  the tree does not depend on the input order.
+  -------------------------------------------------------------------*/
+#define BVH_LESS(a, b) \
+  (key[a] < key[b] || (key[a] == key[b] && (a) < (b)))
+
+static void
+bvhSelect(int *fnos, const float *key, int n, int k)
+{
+  int lo = 0, hi = n-1, i, j, pivot, tmp ;
+
+  while (hi > lo)
+  {
+    pivot = fnos[(lo+hi)/2] ;
+    i = lo ;
+    j = hi ;
+    while (i <= j)
+    {
+      while (BVH_LESS(fnos[i], pivot))
+        i++ ;
+      while (BVH_LESS(pivot, fnos[j]))
+        j-- ;
+      if (i <= j)
+      {
+        tmp = fnos[i] ;
+        fnos[i] = fnos[j] ;
+        fnos[j] = tmp ;
+        i++ ;
+        j-- ;
+      }
+    }
+    if (k <= j)
+      hi = j ;
+    else if (k >= i)
+      lo = i ;
+    else
+      break ;
+  }
+}
+
+/*-------------------------------------------------------------------
+  bvhSplit() - split a node's faces at the median centroid along the
+  axis of largest centroid extent. Returns 1 if split, 0 if the node
+  stays a leaf.
+  -------------------------------------------------------------------*/
+static int
+bvhSplit(MRIS_BVH *bvh, const float *cen, float *key, int node)
+{
+  MRIS_BVH_NODE *bn = &bvh->nodes[node], *left, *right ;
+  int           i, k, axis, fno, *fnos = &bvh->fnos[bn->start] ;
+  float         lo[3], hi[3] ;
+
+  if (bn->count <= BVH_LEAF_FACES)
+    return(0) ;
+
+  for (i = 0 ; i < bn->count ; i++)
+    for (k = 0 ; k < 3 ; k++)
+    {
+      if (i == 0 || cen[3*fnos[i]+k] < lo[k])
+        lo[k] = cen[3*fnos[i]+k] ;
+      if (i == 0 || cen[3*fnos[i]+k] > hi[k])
+        hi[k] = cen[3*fnos[i]+k] ;
+    }
+  axis = 0 ;
+  for (k = 1 ; k < 3 ; k++)
+    if (hi[k]-lo[k] > hi[axis]-lo[axis])
+      axis = k ;
+  for (i = 0 ; i < bn->count ; i++)
+  {
+    fno = fnos[i] ;
+    key[fno] = cen[3*fno+axis] ;
+  }
+  bvhSelect(fnos, key, bn->count, bn->count/2) ;
+
+  left = &bvh->nodes[bvh->nnodes] ;
+  right = &bvh->nodes[bvh->nnodes+1] ;
+  left->start = bn->start ;
+  left->count = bn->count/2 ;
+  right->start = bn->start + left->count ;
+  right->count = bn->count - left->count ;
+  bvh->parent[bvh->nnodes] = bvh->parent[bvh->nnodes+1] = node ;
+  bn->start = bvh->nnodes ;
+  bn->count = 0 ;
+  bvh->nnodes += 2 ;
+  return(1) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISbvhBuild() - build a face BVH over the given vertex set
+  (CURRENT_VERTICES, ORIGINAL_VERTICES, ...).
+  -------------------------------------------------------------------*/
+MRIS_BVH *
+MRISbvhBuild(MRI_SURFACE *mris, int which)
+{
+  MRIS_BVH *bvh ;
+  float    *cen, *key, *box ;
+  int      fno, vno, node, n, max_nodes ;
+
+  bvh = (MRIS_BVH *)calloc(1, sizeof(MRIS_BVH)) ;
+  if (!bvh)
+    ErrorExit(ERROR_NOMEMORY, "MRISbvhBuild: could not allocate BVH") ;
+  bvh->nvertices = mris->nvertices ;
+  bvh->nfaces = mris->nfaces ;
+  bvh->which = which ;
+  max_nodes = MAX(1, 2*mris->nfaces-1) ;
+  bvh->nodes = (MRIS_BVH_NODE *)calloc(max_nodes, sizeof(MRIS_BVH_NODE)) ;
+  bvh->parent = (int *)calloc(max_nodes, sizeof(int)) ;
+  bvh->dirty = (unsigned char *)calloc(max_nodes, sizeof(unsigned char)) ;
+  bvh->fnos = (int *)calloc(MAX(1, mris->nfaces), sizeof(int)) ;
+  bvh->leaf = (int *)calloc(MAX(1, mris->nfaces), sizeof(int)) ;
+  bvh->box = (float *)calloc(6*MAX(1, mris->nfaces), sizeof(float)) ;
+  bvh->xyz = (float *)calloc(3*MAX(1, mris->nvertices), sizeof(float)) ;
+  cen = (float *)calloc(3*MAX(1, mris->nfaces), sizeof(float)) ;
+  key = (float *)calloc(MAX(1, mris->nfaces), sizeof(float)) ;
+  if (!bvh->nodes || !bvh->parent || !bvh->dirty || !bvh->fnos ||
+      !bvh->leaf || !bvh->box || !bvh->xyz || !cen || !key)
+    ErrorExit(ERROR_NOMEMORY, "MRISbvhBuild: could not allocate BVH "
+              "for %d faces", mris->nfaces) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+    bvhVertexXYZ(bvh, mris, vno) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for private(box)
+#endif
+  for (fno = 0 ; fno < mris->nfaces ; fno++)
+  {
+    bvhFaceBox(bvh, mris, fno) ;
+    box = &bvh->box[6*fno] ;
+    cen[3*fno]   = 0.5f*(box[0]+box[3]) ;
+    cen[3*fno+1] = 0.5f*(box[1]+box[4]) ;
+    cen[3*fno+2] = 0.5f*(box[2]+box[5]) ;
+    bvh->fnos[fno] = fno ;
+  }
+
+  // breadth first: nodes[node] is split after all nodes before it
+  bvh->nodes[0].start = 0 ;
+  bvh->nodes[0].count = mris->nfaces ;
+  bvh->parent[0] = -1 ;
+  bvh->nnodes = mris->nfaces > 0 ? 1 : 0 ;
+  for (node = 0 ; node < bvh->nnodes ; node++)
+    bvhSplit(bvh, cen, key, node) ;
+
+  for (node = 0 ; node < bvh->nnodes ; node++)
+    if (bvh->nodes[node].count > 0)
+      for (n = 0 ; n < bvh->nodes[node].count ; n++)
+        bvh->leaf[bvh->fnos[bvh->nodes[node].start+n]] = node ;
+  for (node = bvh->nnodes-1 ; node >= 0 ; node--)
+    bvhNodeBox(bvh, node) ;
+
+  free(cen) ;
+  free(key) ;
+  return(bvh) ;
+}
+
+int
+MRISbvhFree(MRIS_BVH **pbvh)
+{
+  MRIS_BVH *bvh = *pbvh ;
+
+  if (!bvh)
+    return(NO_ERROR) ;
+  *pbvh = NULL ;
+  free(bvh->nodes) ;
+  free(bvh->parent) ;
+  free(bvh->dirty) ;
+  free(bvh->fnos) ;
+  free(bvh->leaf) ;
+  free(bvh->box) ;
+  free(bvh->xyz) ;
+  free(bvh) ;
+  return(NO_ERROR) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISbvhRefit() - update every box after the vertices have moved. The
+  tree structure is kept, so this is cheaper than a rebuild but the
+  boxes may overlap more than a fresh build would after large moves.
+  -------------------------------------------------------------------*/
+int
+MRISbvhRefit(MRIS_BVH *bvh, MRI_SURFACE *mris)
+{
+  int fno, vno, node ;
+
+  if (bvh->nfaces != mris->nfaces || bvh->nvertices != mris->nvertices)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISbvhRefit: BVH built for %d faces, "
+                 "surface has %d", bvh->nfaces, mris->nfaces)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+    bvhVertexXYZ(bvh, mris, vno) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for
+#endif
+  for (fno = 0 ; fno < mris->nfaces ; fno++)
+    bvhFaceBox(bvh, mris, fno) ;
+  for (node = bvh->nnodes-1 ; node >= 0 ; node--)
+  {
+    bvhNodeBox(bvh, node) ;
+    bvh->dirty[node] = 0 ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISbvhRefitVertices() - update the boxes of the faces around the
+  nvnos vertices in vnos[] and of the nodes above them, after only
+  those vertices have moved.
+  -------------------------------------------------------------------*/
+int
+MRISbvhRefitVertices(MRIS_BVH *bvh, MRI_SURFACE *mris,
+                     const int *vnos, int nvnos)
+{
+  VERTEX *v ;
+  int    i, n, fno, node ;
+
+  if (bvh->nfaces != mris->nfaces || bvh->nvertices != mris->nvertices)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISbvhRefitVertices: BVH built for %d "
+                 "faces, surface has %d", bvh->nfaces, mris->nfaces)) ;
+  for (i = 0 ; i < nvnos ; i++)
+    bvhVertexXYZ(bvh, mris, vnos[i]) ;
+  for (i = 0 ; i < nvnos ; i++)
+  {
+    v = &mris->vertices[vnos[i]] ;
+    for (n = 0 ; n < v->num ; n++)
+    {
+      fno = v->f[n] ;
+      bvhFaceBox(bvh, mris, fno) ;
+      for (node = bvh->leaf[fno] ; node >= 0 && !bvh->dirty[node] ;
+           node = bvh->parent[node])
+        bvh->dirty[node] = 1 ;
+    }
+  }
+  for (node = bvh->nnodes-1 ; node >= 0 ; node--)
+    if (bvh->dirty[node])
+    {
+      bvhNodeBox(bvh, node) ;
+      bvh->dirty[node] = 0 ;
+    }
+  return(NO_ERROR) ;
+}
+
+/*-------------------------------------------------------------------
+  bvhFacesIntersect() - test face fno (vertices in v) against fno2,
+  skipping faces that share or are linked through a vertex.
+  -------------------------------------------------------------------*/
+static int
+bvhFacesIntersect(const MRIS_BVH *bvh, MRI_SURFACE *mris,
+                  int fno, int fno2, double v[3][3])
+{
+  FACE        *f = &mris->faces[fno], *f2 = &mris->faces[fno2] ;
+  VERTEX_INFO *vi, *vtxinfos = (VERTEX_INFO *)mris->user_parms ;
+  double      u[3][3] ;
+  int         n, m, l ;
+
+  if (fno2 == fno || f2->ripflag)
+    return(0) ;
+  for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+    for (m = 0 ; m < VERTICES_PER_FACE ; m++)
+    {
+      if (f->v[n] == f2->v[m])
+        return(0) ;
+      if (mris->vertices[f->v[n]].linked > 0)
+      {
+        vi = &vtxinfos[f->v[n]] ;
+        for (l = 0 ; l < vi->nlinks ; l++)
+          if (vi->linked_vno[l] == f2->v[m])
+            return(0) ;
+      }
+      if (mris->vertices[f2->v[m]].linked > 0)
+      {
+        vi = &vtxinfos[f2->v[m]] ;
+        for (l = 0 ; l < vi->nlinks ; l++)
+          if (vi->linked_vno[l] == f->v[n])
+            return(0) ;
+      }
+    }
+
+  for (m = 0 ; m < VERTICES_PER_FACE ; m++)
+    for (l = 0 ; l < 3 ; l++)
+      u[m][l] = bvh->xyz[3*f2->v[m]+l] ;
+  return(tri_tri_intersect(v[0], v[1], v[2], u[0], u[1], u[2])) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISbvhDoesFaceIntersect() - does face fno intersect any other
+  (unripped, non-adjacent) face? Returns 1 if so, else 0.
+  -------------------------------------------------------------------*/
+int
+MRISbvhDoesFaceIntersect(const MRIS_BVH *bvh, MRI_SURFACE *mris, int fno)
+{
+  FACE          *f = &mris->faces[fno] ;
+  const float   *box = &bvh->box[6*fno] ;
+  const float   *box2 ;
+  MRIS_BVH_NODE *bn ;
+  double        v[3][3] ;
+  int           stack[BVH_MAX_DEPTH], nstack, n, k, fno2, node ;
+
+  if (f->ripflag || bvh->nnodes == 0)
+    return(0) ;
+  if (fno == Gdiag_no)
+    DiagBreak() ;
+  for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+    for (k = 0 ; k < 3 ; k++)
+      v[n][k] = bvh->xyz[3*f->v[n]+k] ;
+
+  stack[0] = 0 ;
+  nstack = 1 ;
+  while (nstack > 0)
+  {
+    node = stack[--nstack] ;
+    bn = &bvh->nodes[node] ;
+    if (bn->box[0] > box[3] || bn->box[3] < box[0] ||
+        bn->box[1] > box[4] || bn->box[4] < box[1] ||
+        bn->box[2] > box[5] || bn->box[5] < box[2])
+      continue ;
+    if (bn->count > 0)
+    {
+      for (n = 0 ; n < bn->count ; n++)
+      {
+        fno2 = bvh->fnos[bn->start+n] ;
+        box2 = &bvh->box[6*fno2] ;
+        if (box2[0] > box[3] || box2[3] < box[0] ||
+            box2[1] > box[4] || box2[4] < box[1] ||
+            box2[2] > box[5] || box2[5] < box[2])
+          continue ;
+        if (bvhFacesIntersect(bvh, mris, fno, fno2, v))
+          return(1) ;
+      }
+      continue ;
+    }
+    if (nstack+2 > BVH_MAX_DEPTH)
+      ErrorExit(ERROR_BADPARM, "MRISbvhDoesFaceIntersect: BVH too deep") ;
+    stack[nstack++] = bn->start+1 ;
+    stack[nstack++] = bn->start ;
+  }
+  return(0) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISbvhIntersectingFaces() - find every face that intersects another
+  one. Returns the number found and, if fnos is not NULL, stores them
+  in increasing order in fnos (which must hold mris->nfaces entries).
+  -------------------------------------------------------------------*/
+int
+MRISbvhIntersectingFaces(const MRIS_BVH *bvh, MRI_SURFACE *mris, int *fnos)
+{
+  unsigned char *hit ;
+  int           fno, num ;
+
+  if (bvh->nfaces != mris->nfaces)
+    ErrorReturn(-1, (ERROR_BADPARM, "MRISbvhIntersectingFaces: BVH built "
+                     "for %d faces, surface has %d",
+                     bvh->nfaces, mris->nfaces)) ;
+  hit = (unsigned char *)calloc(MAX(1, mris->nfaces), sizeof(unsigned char)) ;
+  if (!hit)
+    ErrorExit(ERROR_NOMEMORY, "MRISbvhIntersectingFaces: could not "
+              "allocate %d flags", mris->nfaces) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 256)
+#endif
+  for (fno = 0 ; fno < mris->nfaces ; fno++)
+    hit[fno] = MRISbvhDoesFaceIntersect(bvh, mris, fno) ;
+
+  for (num = fno = 0 ; fno < mris->nfaces ; fno++)
+    if (hit[fno])
+    {
+      if (fnos)
+        fnos[num] = fno ;
+      num++ ;
+    }
+  free(hit) ;
+  return(num) ;
+}
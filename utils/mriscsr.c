@@ -0,0 +1,852 @@
+/**
+ * @file  mriscsr.c
+ * @brief compressed sparse row operators on surface vertices
+ *
+ * MRISsmoothMRI and friends used to walk v->v/v->vnum (and check rips
+ * and the mask through MRIgetVoxVal) for every frame and every step.
+ * An MRIS_CSR precompiles that walk into one row per output vertex
+ * holding the input vertices it sums, so each step is a plain sparse
+ * matrix times dense matrix product. Data is laid out vertex-major with
+ * the frames as columns (x[vno*nframes + frame]), so a 4D surface
+ * overlay is smoothed in one sweep per step with a contiguous, SIMD
+ * friendly inner loop over frames, and the rows are split across
+ * threads.
+ *
+ * A row either averages its columns (w == NULL: sum in float, divide
+ * by the row length, exactly what MRISsmoothMRIFast() does, so results
+ * are bit-identical to it) or is a weighted sum accumulated in double
+ * and optionally divided by den[row]. A row with no columns yields 0.
+ *
+ * MRIScsrPower() folds n steps into one weighted operator, and
+ * MRIScsrWrite()/MRIScsrRead() store an operator in host byte order
+ * with a byte-order mark, tagged with a 64-bit key identifying what it
+ * was built from. MRISsmoothMRICSR() uses both when FS_SURF_SMOOTH_CACHE
+ * names a directory: the n-step operator for a given mesh, rip and mask
+ * pattern is built once and reused by every later run. Note that the
+ * power of a 1-ring average has about 3n^2 entries per row against 7n
+ * for n separate steps, so this only pays off for few steps or when
+ * the same operator is applied to very many frames; by default the
+ * steps are applied one at a time. FS_SURF_SMOOTH_MAX_NNZ caps the size
+ * of a power (default 64M entries); larger ones fall back to steps.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "mrisurf.h"
+#include "mri.h"
+#include "mri2.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+#include "timer.h"
+
+#define MRIS_CSR_MAGIC       0x52534343   // "CCSR"
+#define MRIS_CSR_BYTE_ORDER  0x01020304
+#define MRIS_CSR_VERSION     1
+#define MRIS_CSR_MAX_NNZ     (64L*1024L*1024L)
+
+typedef struct
+{
+  int                magic ;
+  int                byte_order ;
+  int                version ;
+  int                nrows, ncols, nnz ;
+  int                nsteps ;
+  int                has_w, has_den ;
+  int                pad ;
+  unsigned long long key ;
+}
+MRIS_CSR_HEADER ;
+
+/*---------------------------------------------------------------
+  MRIScsrAlloc() - allocate an nrows x ncols operator with room for
+  nnz entries, with weights if weighted is set
+  ---------------------------------------------------------------*/
+MRIS_CSR *
+MRIScsrAlloc(int nrows, int ncols, int nnz, int weighted)
+{
+  MRIS_CSR *csr ;
+
+  csr = (MRIS_CSR *)calloc(1, sizeof(MRIS_CSR)) ;
+  if (!csr)
+    ErrorExit(ERROR_NOMEMORY, "MRIScsrAlloc: could not allocate MRIS_CSR") ;
+  csr->nrows = nrows ;
+  csr->ncols = ncols ;
+  csr->nnz = nnz ;
+  csr->row_start = (int *)calloc(nrows+1, sizeof(int)) ;
+  csr->col = (int *)calloc(nnz > 0 ? nnz : 1, sizeof(int)) ;
+  if (weighted)
+    csr->w = (float *)calloc(nnz > 0 ? nnz : 1, sizeof(float)) ;
+  if (!csr->row_start || !csr->col || (weighted && !csr->w))
+    ErrorExit(ERROR_NOMEMORY,
+              "MRIScsrAlloc: could not allocate %dx%d operator with %d "
+              "entries", nrows, ncols, nnz) ;
+  return(csr) ;
+}
+
+int
+MRIScsrFree(MRIS_CSR **pcsr)
+{
+  MRIS_CSR *csr = *pcsr ;
+
+  *pcsr = NULL ;
+  if (csr)
+  {
+    free(csr->row_start) ;
+    free(csr->col) ;
+    free(csr->w) ;
+    free(csr->den) ;
+    free(csr) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrHashBytes() - fold nbytes of buf into the 64 bit FNV-1a hash
+  h (start from MRIS_CSR_HASH_INIT). Used to key cached operators on
+  whatever they were built from.
+  ---------------------------------------------------------------*/
+unsigned long long
+MRIScsrHashBytes(unsigned long long h, const void *buf, size_t nbytes)
+{
+  const unsigned char *cp = (const unsigned char *)buf ;
+
+  while (nbytes-- > 0)
+  {
+    h ^= *cp++ ;
+    h *= 0x100000001b3ULL ;
+  }
+  return(h) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrHash() - hash of the shape, pattern and values of csr
+  ---------------------------------------------------------------*/
+unsigned long long
+MRIScsrHash(const MRIS_CSR *csr)
+{
+  unsigned long long h = MRIS_CSR_HASH_INIT ;
+
+  h = MRIScsrHashBytes(h, &csr->nrows, sizeof(int)) ;
+  h = MRIScsrHashBytes(h, &csr->ncols, sizeof(int)) ;
+  h = MRIScsrHashBytes(h, csr->row_start, (csr->nrows+1)*sizeof(int)) ;
+  h = MRIScsrHashBytes(h, csr->col, csr->nnz*sizeof(int)) ;
+  if (csr->w)
+    h = MRIScsrHashBytes(h, csr->w, csr->nnz*sizeof(float)) ;
+  if (csr->den)
+    h = MRIScsrHashBytes(h, csr->den, csr->nrows*sizeof(double)) ;
+  return(h) ;
+}
+
+/* maps a vertex number to a voxel of an MRI whose width*height*depth
+   is nvertices, columns fastest (same order as MRIScrsLUT) */
+static float
+csrVertexVal(MRI *mri, int vno, int frame)
+{
+  int c, r, s ;
+
+  c = vno % mri->width ;
+  r = (vno / mri->width) % mri->height ;
+  s = vno / (mri->width*mri->height) ;
+  return(MRIgetVoxVal(mri, c, r, s, frame)) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrSmoothOp() - the one-step nearest-neighbor average used by
+  MRISsmoothMRI(): each vertex in IncMask (or all if it is NULL)
+  averages itself and its unripped, in-mask 1-ring neighbors, and
+  vertices outside the mask get an empty row (value 0). IncMask may
+  have any shape whose number of voxels is nvertices.
+  ---------------------------------------------------------------*/
+MRIS_CSR *
+MRIScsrSmoothOp(MRI_SURFACE *mris, MRI *IncMask)
+{
+  MRIS_CSR *csr ;
+  char     *keep ;
+  int      vno, nnz ;
+
+  if (IncMask &&
+      IncMask->width*IncMask->height*IncMask->depth != mris->nvertices)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIScsrSmoothOp: mask has %d voxels but "
+                 "surface has %d vertices",
+                 IncMask->width*IncMask->height*IncMask->depth,
+                 mris->nvertices)) ;
+
+  // 1: in the mask and usable as a neighbor, 2: in the mask but ripped
+  keep = (char *)calloc(mris->nvertices, sizeof(char)) ;
+  for (nnz = vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    if (IncMask && csrVertexVal(IncMask, vno, 0) < 0.5)
+      continue ;
+    keep[vno] = mris->vertices[vno].ripflag ? 2 : 1 ;
+  }
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+    int          n ;
+
+    if (!keep[vno])
+      continue ;
+    nnz++ ;
+    for (n = 0 ; n < v->vnum ; n++)
+      if (keep[v->v[n]] == 1)
+        nnz++ ;
+  }
+
+  csr = MRIScsrAlloc(mris->nvertices, mris->nvertices, nnz, 0) ;
+  csr->nsteps = 1 ;
+  for (nnz = vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+    int          n ;
+
+    csr->row_start[vno] = nnz ;
+    if (!keep[vno])
+      continue ;
+    csr->col[nnz++] = vno ;   // self first, as MRISsmoothMRI sums it
+    for (n = 0 ; n < v->vnum ; n++)
+      if (keep[v->v[n]] == 1)
+        csr->col[nnz++] = v->v[n] ;
+  }
+  csr->row_start[mris->nvertices] = nnz ;
+  csr->key = MRIScsrHash(csr) ;
+  free(keep) ;
+  return(csr) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrApply() - y = csr * x for nframes columns stored
+  vertex-major (x[col*nframes+frame], y[row*nframes+frame]). x and y
+  must not overlap.
+  ---------------------------------------------------------------*/
+int
+MRIScsrApply(const MRIS_CSR *csr, const float *x, float *y, int nframes)
+{
+  int row ;
+
+  if (nframes < 1)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRIScsrApply: nframes=%d", nframes)) ;
+
+  if (!csr->w)
+  {
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(static, 256)
+#endif
+    for (row = 0 ; row < csr->nrows ; row++)
+    {
+      float       *yr = &y[(size_t)row*nframes] ;
+      const float *xc ;
+      int         j, f, start = csr->row_start[row],
+                  end = csr->row_start[row+1], n = end - start ;
+
+      if (n == 0)
+      {
+        memset(yr, 0, nframes*sizeof(float)) ;
+        continue ;
+      }
+      xc = &x[(size_t)csr->col[start]*nframes] ;
+      for (f = 0 ; f < nframes ; f++)
+        yr[f] = xc[f] ;
+      for (j = start+1 ; j < end ; j++)
+      {
+        xc = &x[(size_t)csr->col[j]*nframes] ;
+        for (f = 0 ; f < nframes ; f++)
+          yr[f] += xc[f] ;
+      }
+      for (f = 0 ; f < nframes ; f++)
+        yr[f] = yr[f] / n ;
+    }
+    return(NO_ERROR) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
+#endif
+  {
+    double *acc = (double *)malloc(nframes*sizeof(double)) ;
+
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(static, 256)
+#endif
+    for (row = 0 ; row < csr->nrows ; row++)
+    {
+      float       *yr = &y[(size_t)row*nframes] ;
+      const float *xc ;
+      double      w ;
+      int         j, f ;
+
+      memset(acc, 0, nframes*sizeof(double)) ;
+      for (j = csr->row_start[row] ; j < csr->row_start[row+1] ; j++)
+      {
+        xc = &x[(size_t)csr->col[j]*nframes] ;
+        w = csr->w[j] ;
+        for (f = 0 ; f < nframes ; f++)
+          acc[f] += w * xc[f] ;
+      }
+      if (csr->den)
+        for (f = 0 ; f < nframes ; f++)
+          yr[f] = acc[f] / csr->den[row] ;
+      else
+        for (f = 0 ; f < nframes ; f++)
+          yr[f] = acc[f] ;
+    }
+    free(acc) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrApplySteps() - apply a square operator nsteps times,
+  ping-ponging between x and tmp (both nrows*nframes). Returns the
+  buffer that holds the result.
+  ---------------------------------------------------------------*/
+float *
+MRIScsrApplySteps(const MRIS_CSR *csr, float *x, float *tmp,
+                  int nframes, int nsteps)
+{
+  float *src = x, *dst = tmp, *swap ;
+  int   n ;
+
+  if (csr->nrows != csr->ncols)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIScsrApplySteps: %dx%d is not square",
+                 csr->nrows, csr->ncols)) ;
+  for (n = 0 ; n < nsteps ; n++)
+  {
+    MRIScsrApply(csr, src, dst, nframes) ;
+    swap = src ;
+    src = dst ;
+    dst = swap ;
+  }
+  return(src) ;
+}
+
+static double
+csrValue(const MRIS_CSR *csr, int row, int j)
+{
+  double val ;
+
+  if (csr->w)
+    val = csr->w[j] ;
+  else
+    val = 1.0 / (csr->row_start[row+1] - csr->row_start[row]) ;
+  if (csr->den)
+    val /= csr->den[row] ;
+  return(val) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrMultiply() - the weighted operator a*b, or NULL if it would
+  have more than max_nnz entries (max_nnz <= 0 means no limit). Each
+  row keeps its columns in the order they are first reached.
+  ---------------------------------------------------------------*/
+MRIS_CSR *
+MRIScsrMultiply(const MRIS_CSR *a, const MRIS_CSR *b, long max_nnz)
+{
+  MRIS_CSR *c ;
+  int      *row_nnz, row ;
+  long     nnz ;
+
+  if (a->ncols != b->nrows)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIScsrMultiply: %dx%d times %dx%d",
+                 a->nrows, a->ncols, b->nrows, b->ncols)) ;
+
+  // symbolic pass: count the entries of each row of c
+  row_nnz = (int *)calloc(a->nrows, sizeof(int)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
+#endif
+  {
+    int *mark = (int *)malloc(b->ncols*sizeof(int)) ;
+    int i ;
+
+    for (i = 0 ; i < b->ncols ; i++)
+      mark[i] = -1 ;
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 256)
+#endif
+    for (row = 0 ; row < a->nrows ; row++)
+    {
+      int j, k, n = 0 ;
+
+      for (j = a->row_start[row] ; j < a->row_start[row+1] ; j++)
+        for (k = b->row_start[a->col[j]] ; k < b->row_start[a->col[j]+1] ; k++)
+          if (mark[b->col[k]] != row)
+          {
+            mark[b->col[k]] = row ;
+            n++ ;
+          }
+      row_nnz[row] = n ;
+    }
+    free(mark) ;
+  }
+  for (nnz = 0, row = 0 ; row < a->nrows ; row++)
+    nnz += row_nnz[row] ;
+  if ((max_nnz > 0 && nnz > max_nnz) || nnz > 0x7fffffffL)
+  {
+    free(row_nnz) ;
+    return(NULL) ;
+  }
+
+  c = MRIScsrAlloc(a->nrows, b->ncols, (int)nnz, 1) ;
+  for (row = 0 ; row < a->nrows ; row++)
+    c->row_start[row+1] = c->row_start[row] + row_nnz[row] ;
+  free(row_nnz) ;
+
+  // numeric pass
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
+#endif
+  {
+    int    *pos = (int *)malloc(b->ncols*sizeof(int)) ;
+    double *acc = (double *)malloc(b->ncols*sizeof(double)) ;
+    int    i ;
+
+    for (i = 0 ; i < b->ncols ; i++)
+      pos[i] = -1 ;
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 256)
+#endif
+    for (row = 0 ; row < a->nrows ; row++)
+    {
+      int    j, k, n, bc, out = c->row_start[row] ;
+      double aval ;
+
+      for (j = a->row_start[row] ; j < a->row_start[row+1] ; j++)
+      {
+        aval = csrValue(a, row, j) ;
+        for (k = b->row_start[a->col[j]] ; k < b->row_start[a->col[j]+1] ; k++)
+        {
+          bc = b->col[k] ;
+          if (pos[bc] < 0)
+          {
+            pos[bc] = out ;
+            c->col[out++] = bc ;
+            acc[bc] = 0.0 ;
+          }
+          acc[bc] += aval * csrValue(b, a->col[j], k) ;
+        }
+      }
+      for (n = c->row_start[row] ; n < out ; n++)
+      {
+        c->w[n] = acc[c->col[n]] ;
+        pos[c->col[n]] = -1 ;
+      }
+    }
+    free(pos) ;
+    free(acc) ;
+  }
+  return(c) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrPower() - the weighted operator csr^n, or NULL if any
+  intermediate power would have more than max_nnz entries
+  ---------------------------------------------------------------*/
+MRIS_CSR *
+MRIScsrPower(const MRIS_CSR *csr, int n, long max_nnz)
+{
+  MRIS_CSR *p, *next ;
+  int      i ;
+
+  if (n < 1)
+    ErrorReturn(NULL, (ERROR_BADPARM, "MRIScsrPower: n=%d", n)) ;
+
+  // start from csr times the identity so p is always weighted
+  p = MRIScsrAlloc(csr->nrows, csr->ncols, csr->nnz, 1) ;
+  memmove(p->row_start, csr->row_start, (csr->nrows+1)*sizeof(int)) ;
+  memmove(p->col, csr->col, csr->nnz*sizeof(int)) ;
+  for (i = 0 ; i < csr->nrows ; i++)
+  {
+    int j ;
+    for (j = csr->row_start[i] ; j < csr->row_start[i+1] ; j++)
+      p->w[j] = csrValue(csr, i, j) ;
+  }
+  for (i = 1 ; i < n ; i++)
+  {
+    next = MRIScsrMultiply(csr, p, max_nnz) ;
+    MRIScsrFree(&p) ;
+    if (!next)
+      return(NULL) ;
+    p = next ;
+  }
+  p->nsteps = n * (csr->nsteps > 0 ? csr->nsteps : 1) ;
+  p->key = csr->key ;
+  return(p) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrWrite() - write csr to fname
+  ---------------------------------------------------------------*/
+int
+MRIScsrWrite(const MRIS_CSR *csr, const char *fname)
+{
+  MRIS_CSR_HEADER hdr ;
+  FILE            *fp ;
+  int             ok ;
+
+  memset(&hdr, 0, sizeof(hdr)) ;
+  hdr.magic = MRIS_CSR_MAGIC ;
+  hdr.byte_order = MRIS_CSR_BYTE_ORDER ;
+  hdr.version = MRIS_CSR_VERSION ;
+  hdr.nrows = csr->nrows ;
+  hdr.ncols = csr->ncols ;
+  hdr.nnz = csr->nnz ;
+  hdr.nsteps = csr->nsteps ;
+  hdr.has_w = csr->w != NULL ;
+  hdr.has_den = csr->den != NULL ;
+  hdr.key = csr->key ;
+
+  fp = fopen(fname, "wb") ;
+  if (!fp)
+    ErrorReturn(ERROR_NOFILE,
+                (ERROR_NOFILE, "MRIScsrWrite: could not open %s", fname)) ;
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+       fwrite(csr->row_start, sizeof(int), csr->nrows+1, fp) ==
+       (size_t)csr->nrows+1 &&
+       fwrite(csr->col, sizeof(int), csr->nnz, fp) == (size_t)csr->nnz ;
+  if (ok && csr->w)
+    ok = fwrite(csr->w, sizeof(float), csr->nnz, fp) == (size_t)csr->nnz ;
+  if (ok && csr->den)
+    ok = fwrite(csr->den, sizeof(double), csr->nrows, fp) ==
+         (size_t)csr->nrows ;
+  if (fclose(fp) != 0)
+    ok = 0 ;
+  if (!ok)
+  {
+    unlink(fname) ;
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "MRIScsrWrite: could not write %s", fname)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRIScsrRead() - read an operator written by MRIScsrWrite()
+  ---------------------------------------------------------------*/
+MRIS_CSR *
+MRIScsrRead(const char *fname)
+{
+  MRIS_CSR_HEADER hdr ;
+  MRIS_CSR        *csr ;
+  FILE            *fp ;
+  int             ok ;
+
+  fp = fopen(fname, "rb") ;
+  if (!fp)
+    ErrorReturn(NULL,
+                (ERROR_NOFILE, "MRIScsrRead: could not open %s", fname)) ;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != MRIS_CSR_MAGIC ||
+      hdr.byte_order != MRIS_CSR_BYTE_ORDER ||
+      hdr.version != MRIS_CSR_VERSION ||
+      hdr.nrows < 0 || hdr.ncols < 0 || hdr.nnz < 0)
+  {
+    fclose(fp) ;
+    ErrorReturn(NULL,
+                (ERROR_BADFILE, "MRIScsrRead: %s is not a CSR operator "
+                 "written on this kind of host", fname)) ;
+  }
+
+  csr = MRIScsrAlloc(hdr.nrows, hdr.ncols, hdr.nnz, hdr.has_w) ;
+  csr->nsteps = hdr.nsteps ;
+  csr->key = hdr.key ;
+  if (hdr.has_den)
+    csr->den = (double *)calloc(hdr.nrows > 0 ? hdr.nrows : 1,
+                                sizeof(double)) ;
+  ok = fread(csr->row_start, sizeof(int), hdr.nrows+1, fp) ==
+       (size_t)hdr.nrows+1 &&
+       fread(csr->col, sizeof(int), hdr.nnz, fp) == (size_t)hdr.nnz ;
+  if (ok && csr->w)
+    ok = fread(csr->w, sizeof(float), hdr.nnz, fp) == (size_t)hdr.nnz ;
+  if (ok && csr->den)
+    ok = fread(csr->den, sizeof(double), hdr.nrows, fp) ==
+         (size_t)hdr.nrows ;
+  fclose(fp) ;
+  if (!ok || csr->row_start[0] != 0 || csr->row_start[hdr.nrows] != hdr.nnz)
+  {
+    MRIScsrFree(&csr) ;
+    ErrorReturn(NULL,
+                (ERROR_BADFILE, "MRIScsrRead: %s is truncated or corrupt",
+                 fname)) ;
+  }
+  return(csr) ;
+}
+
+/*
+  Loads the nsteps power of op from the FS_SURF_SMOOTH_CACHE directory,
+  or builds and stores it there. Returns NULL if it is too big.
+*/
+static MRIS_CSR *
+csrCachedPower(const MRIS_CSR *op, int nsteps, const char *cachedir)
+{
+  char     fname[STRLEN] ;
+  MRIS_CSR *p ;
+  long     max_nnz = MRIS_CSR_MAX_NNZ ;
+  char     *cp ;
+  FILE     *fp ;
+
+  sprintf(fname, "%s/smooth.%016llx.%d.csr", cachedir, op->key, nsteps) ;
+  fp = fopen(fname, "rb") ;
+  if (fp)
+  {
+    fclose(fp) ;
+    p = MRIScsrRead(fname) ;
+    if (p && p->key == op->key && p->nsteps == nsteps &&
+        p->nrows == op->nrows && p->ncols == op->ncols)
+      return(p) ;
+    printf("MRISsmoothMRICSR: ignoring stale cache file %s\n", fname) ;
+    if (p)
+      MRIScsrFree(&p) ;
+  }
+
+  cp = getenv("FS_SURF_SMOOTH_MAX_NNZ") ;
+  if (cp)
+    max_nnz = atol(cp) ;
+  p = MRIScsrPower(op, nsteps, max_nnz) ;
+  if (!p)
+  {
+    printf("MRISsmoothMRICSR: %d-step operator has more than %ld entries, "
+           "smoothing step by step\n", nsteps, max_nnz) ;
+    return(NULL) ;
+  }
+  if (MRIScsrWrite(p, fname) == NO_ERROR && Gdiag_no > 0)
+    printf("MRISsmoothMRICSR: cached %d-step operator (%d entries) in %s\n",
+           nsteps, p->nnz, fname) ;
+  return(p) ;
+}
+
+/* copies the frames of mri into a new vertex-major array, voxels in
+   column-fastest order */
+static float *
+csrGather(MRI *mri)
+{
+  float *x ;
+  int   nvox, nframes, vno, frame ;
+
+  nvox = mri->width * mri->height * mri->depth ;
+  nframes = mri->nframes ;
+  x = (float *)malloc((size_t)nvox*nframes*sizeof(float)) ;
+  if (!x)
+    ErrorExit(ERROR_NOMEMORY,
+              "csrGather: could not allocate %d x %d frames", nvox, nframes) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) private(vno)
+#endif
+  for (frame = 0 ; frame < nframes ; frame++)
+  {
+    int c = 0, r = 0, s = 0 ;
+    for (vno = 0 ; vno < nvox ; vno++)
+    {
+      x[(size_t)vno*nframes+frame] = (mri->type == MRI_FLOAT) ?
+        MRIFseq_vox(mri, c, r, s, frame) : MRIgetVoxVal(mri, c, r, s, frame) ;
+      if (++c == mri->width)
+      {
+        c = 0 ;
+        if (++r == mri->height)
+        {
+          r = 0 ;
+          s++ ;
+        }
+      }
+    }
+  }
+  return(x) ;
+}
+
+/* inverse of csrGather() into an MRI_FLOAT */
+static void
+csrScatter(const float *y, MRI *mri)
+{
+  int nvox, nframes, vno, frame ;
+
+  nvox = mri->width * mri->height * mri->depth ;
+  nframes = mri->nframes ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) private(vno)
+#endif
+  for (frame = 0 ; frame < nframes ; frame++)
+  {
+    int c = 0, r = 0, s = 0 ;
+    for (vno = 0 ; vno < nvox ; vno++)
+    {
+      MRIFseq_vox(mri, c, r, s, frame) = y[(size_t)vno*nframes+frame] ;
+      if (++c == mri->width)
+      {
+        c = 0 ;
+        if (++r == mri->height)
+        {
+          r = 0 ;
+          s++ ;
+        }
+      }
+    }
+  }
+}
+
+/*-------------------------------------------------------------------
+  MRIScsrApplyMRI() - dst = csr * src for every frame, where src has
+  csr->ncols voxels and dst csr->nrows (any shape, column-fastest
+  order). If dst is NULL it is allocated as nrows x 1 x 1 x nframes
+  float with the header of src. Returns dst or NULL on error.
+  -------------------------------------------------------------------*/
+MRI *
+MRIScsrApplyMRI(const MRIS_CSR *csr, MRI *src, MRI *dst)
+{
+  float *x, *y ;
+
+  if (src->width*src->height*src->depth != csr->ncols)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIScsrApplyMRI: source has %d voxels, "
+                 "operator has %d columns",
+                 src->width*src->height*src->depth, csr->ncols)) ;
+  if (dst == NULL)
+  {
+    dst = MRIallocSequence(csr->nrows, 1, 1, MRI_FLOAT, src->nframes) ;
+    if (dst == NULL)
+      ErrorReturn(NULL,
+                  (ERROR_NOMEMORY, "MRIScsrApplyMRI: could not alloc")) ;
+    MRIcopyHeader(src, dst) ;
+  }
+  else if (dst->type != MRI_FLOAT || dst->nframes != src->nframes ||
+           dst->width*dst->height*dst->depth != csr->nrows)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM, "MRIScsrApplyMRI: output must be float "
+                 "with %d voxels and %d frames", csr->nrows, src->nframes)) ;
+
+  x = csrGather(src) ;
+  y = (float *)malloc((size_t)csr->nrows*src->nframes*sizeof(float)) ;
+  if (!y)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRIScsrApplyMRI: could not allocate %d x %d frames",
+              csr->nrows, src->nframes) ;
+  MRIScsrApply(csr, x, y, src->nframes) ;
+  csrScatter(y, dst) ;
+  free(x) ;
+  free(y) ;
+  return(dst) ;
+}
+
+/*-------------------------------------------------------------------
+  MRISsmoothMRICSR() - MRISsmoothMRIFast() on a precompiled CSR
+  operator, all frames at once. Same arguments and results (bit for
+  bit unless FS_SURF_SMOOTH_CACHE is set, see top of file); Src may
+  be any type, Targ is float.
+  -------------------------------------------------------------------*/
+MRI *
+MRISsmoothMRICSR(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask,
+                 MRI *Targ)
+{
+  MRIS_CSR     *op, *p = NULL ;
+  float        *x, *tmp, *y ;
+  int          nvox, nframes, vno ;
+  char         *cachedir ;
+  struct timeb mytimer ;
+
+  TimerStart(&mytimer) ;
+  nvox = Src->width * Src->height * Src->depth ;
+  nframes = Src->nframes ;
+  if (Surf->nvertices != nvox)
+  {
+    printf("ERROR: MRISsmoothMRICSR(): Surf/Src dimension mismatch\n") ;
+    return(NULL) ;
+  }
+  if (Targ != NULL)
+  {
+    if (MRIdimMismatch(Src, Targ, 1))
+    {
+      printf("ERROR: MRISsmoothMRICSR(): output dimension mismatch\n") ;
+      return(NULL) ;
+    }
+    if (Targ->type != MRI_FLOAT)
+    {
+      printf("ERROR: MRISsmoothMRICSR(): structure passed is not "
+             "MRI_FLOAT\n") ;
+      return(NULL) ;
+    }
+  }
+
+  op = MRIScsrSmoothOp(Surf, IncMask) ;
+  if (!op)
+  {
+    return(NULL) ;
+  }
+
+  // gather, vertex-major with frames as columns
+  x = csrGather(Src) ;
+  tmp = (float *)malloc((size_t)nvox*nframes*sizeof(float)) ;
+  if (!tmp)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISsmoothMRICSR: could not allocate %d x %d frames",
+              nvox, nframes) ;
+
+  cachedir = getenv("FS_SURF_SMOOTH_CACHE") ;
+  if (cachedir && nSmoothSteps > 1)
+  {
+    p = csrCachedPower(op, nSmoothSteps, cachedir) ;
+  }
+  if (p)
+  {
+    MRIScsrApply(p, x, tmp, nframes) ;
+    y = tmp ;
+    MRIScsrFree(&p) ;
+  }
+  else
+  {
+    y = MRIScsrApplySteps(op, x, tmp, nframes, nSmoothSteps) ;
+  }
+  if (nSmoothSteps < 1)  // still zero what is outside the mask
+  {
+    for (vno = 0 ; vno < nvox ; vno++)
+      if (op->row_start[vno] == op->row_start[vno+1])
+        memset(&y[(size_t)vno*nframes], 0, nframes*sizeof(float)) ;
+  }
+
+  // scatter
+  if (Targ == NULL)
+  {
+    Targ = MRIallocSequence(Src->width, Src->height, Src->depth,
+                            MRI_FLOAT, nframes) ;
+    if (Targ == NULL)
+    {
+      printf("ERROR: MRISsmoothMRICSR(): could not alloc\n") ;
+      free(x) ;
+      free(tmp) ;
+      MRIScsrFree(&op) ;
+      return(NULL) ;
+    }
+    MRIcopyHeader(Src, Targ) ;
+  }
+  csrScatter(y, Targ) ;
+
+  if (Gdiag_no > 0)
+  {
+    printf("MRISsmoothMRICSR() nsteps = %d, nframes = %d, tsec = %g\n",
+           nSmoothSteps, nframes, TimerStop(&mytimer)/1000.0) ;
+    fflush(stdout) ;
+  }
+  free(x) ;
+  free(tmp) ;
+  MRIScsrFree(&op) ;
+  return(Targ) ;
+}
@@ -0,0 +1,457 @@
+/**
+ * @file  mrisgeodesic.c
+ * @brief geodesic distances on a surface from one or many sources
+ *
+ * One engine for the distance computations that used to each carry
+ * their own: a heap ordered front is grown from the sources, settling
+ * the closest unsettled vertex each step, as in both Dijkstra's method
+ * and fast marching. With GEODESIC_DIJKSTRA a vertex is updated from its
+ * settled neighbor along their edge. With GEODESIC_FAST_MARCH it is also
+ * updated across every face whose other two vertices are settled, using
+ * ReCompute() from fmarchmesh.c (Kimmel and Sethian, unfolding obtuse
+ * triangles), so distances are no longer restricted to paths along the
+ * edges; the edge update stays in as well, so a vertex is never further
+ * than its Dijkstra distance. With geo->cost set the edges are weighted
+ * by the caller instead (eg mris_pmake) and ripflags are left to it.
+ *
+ * An MRIS_GEODESIC holds the heap and the per-vertex state of one query.
+ * It remembers which vertices a query touched and resets only those, so
+ * a query limited to a radius or to a set of targets costs what it
+ * reaches, not the size of the surface. The bulk queries give each
+ * thread its own workspace and split the sources across threads.
+ *
+ * Ripped vertices and faces are never entered by the geometric methods.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mrisurf.h"
+#include "fmarchmesh.h"
+#include "heap.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+
+static void  geoTouch(MRIS_GEODESIC *geo, int vno, float dist, int pred) ;
+static float geoEdge(MRI_SURFACE *mris, int vno0, int vno1) ;
+static float geoMarch(MRIS_GEODESIC *geo, MRI_SURFACE *mris, int vno) ;
+
+/*---------------------------------------------------------------
+  MRISgeodesicAlloc() - a workspace for queries on mris (or any
+  surface with the same vertices) with GEODESIC_DIJKSTRA or
+  GEODESIC_FAST_MARCH.
+  ---------------------------------------------------------------*/
+MRIS_GEODESIC *
+MRISgeodesicAlloc(MRI_SURFACE *mris, int method)
+{
+  MRIS_GEODESIC *geo ;
+  int           vno, nvertices = mris->nvertices ;
+
+  if (method != GEODESIC_DIJKSTRA && method != GEODESIC_FAST_MARCH)
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "MRISgeodesicAlloc: unknown method %d", method)) ;
+
+  geo = (MRIS_GEODESIC *)calloc(1, sizeof(MRIS_GEODESIC)) ;
+  if (!geo)
+    ErrorExit(ERROR_NOMEMORY, "MRISgeodesicAlloc: could not allocate") ;
+  geo->nvertices = nvertices ;
+  geo->method = method ;
+  geo->dist = (float *)calloc(nvertices, sizeof(float)) ;
+  geo->pred = (int *)calloc(nvertices, sizeof(int)) ;
+  geo->label = (unsigned char *)calloc(nvertices, sizeof(unsigned char)) ;
+  geo->target = (unsigned char *)calloc(nvertices, sizeof(unsigned char)) ;
+  geo->heap_index = (int *)calloc(nvertices, sizeof(int)) ;
+  geo->settled = (int *)calloc(nvertices, sizeof(int)) ;
+  geo->touched = (int *)calloc(nvertices, sizeof(int)) ;
+  if (!geo->dist || !geo->pred || !geo->label || !geo->target ||
+      !geo->heap_index || !geo->settled || !geo->touched)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISgeodesicAlloc: could not allocate %d vertex workspace",
+              nvertices) ;
+  for (vno = 0 ; vno < nvertices ; vno++)
+  {
+    geo->dist[vno] = GEODESIC_UNREACHED ;
+    geo->pred[vno] = -1 ;
+  }
+  geo->heap = xhInitEmpty() ;
+  return(geo) ;
+}
+
+int
+MRISgeodesicFree(MRIS_GEODESIC **pgeo)
+{
+  MRIS_GEODESIC *geo = *pgeo ;
+
+  *pgeo = NULL ;
+  if (!geo)
+  {
+    return(NO_ERROR) ;
+  }
+  xhDestroy((Xheap)geo->heap) ;
+  free(geo->dist) ;
+  free(geo->pred) ;
+  free(geo->label) ;
+  free(geo->target) ;
+  free(geo->heap_index) ;
+  free(geo->settled) ;
+  free(geo->touched) ;
+  free(geo) ;
+  return(NO_ERROR) ;
+}
+
+static void
+geoTouch(MRIS_GEODESIC *geo, int vno, float dist, int pred)
+{
+  geo->touched[geo->ntouched++] = vno ;
+  geo->label[vno] = NBAND ;
+  geo->dist[vno] = dist ;
+  geo->pred[vno] = pred ;
+  xhInsert(dist, vno, &geo->heap_index[vno], (Xheap)geo->heap) ;
+}
+
+static float
+geoEdge(MRI_SURFACE *mris, int vno0, int vno1)
+{
+  VERTEX *v0 = &mris->vertices[vno0], *v1 = &mris->vertices[vno1] ;
+  double dx = v1->x - v0->x, dy = v1->y - v0->y, dz = v1->z - v0->z ;
+
+  return((float)sqrt(dx*dx + dy*dy + dz*dz)) ;
+}
+
+/* the smallest fast marching update of vno across its unripped faces */
+static float
+geoMarch(MRIS_GEODESIC *geo, MRI_SURFACE *mris, int vno)
+{
+  VERTEX *v = &mris->vertices[vno] ;
+  FACE   *f ;
+  float  t, tmin = GEODESIC_UNREACHED ;
+  int    n, i ;
+
+  for (n = 0 ; n < v->num ; n++)
+  {
+    f = &mris->faces[v->f[n]] ;
+    if (f->ripflag)
+    {
+      continue ;
+    }
+    i = v->n[n] ;
+    t = ReCompute(vno, f->v[(i+VERTICES_PER_FACE-1)%VERTICES_PER_FACE],
+                  f->v[(i+1)%VERTICES_PER_FACE], mris, geo->dist,
+                  geo->label) ;
+    if (t < tmin)
+    {
+      tmin = t ;
+    }
+  }
+  return(tmin) ;
+}
+
+/*---------------------------------------------------------------
+  MRISgeodesicRun() - distances from the nearest of the sources.
+
+  Vertices further than max_dist (if > 0) are not reached. If targets
+  are given the query stops as soon as all of them are settled. On
+  return geo->dist of every settled vertex (geo->label == ALIVE, listed
+  in geo->settled in order of distance) is final, the vertices on the
+  front have an upper bound and all others GEODESIC_UNREACHED.
+  geo->pred links each vertex back towards its source.
+
+  Returns the number of settled vertices.
+  ---------------------------------------------------------------*/
+int
+MRISgeodesicRun(MRIS_GEODESIC *geo, MRI_SURFACE *mris,
+                const int *sources, int nsources, float max_dist,
+                const int *targets, int ntargets)
+{
+  Xheap        heap = (Xheap)geo->heap ;
+  XheapElement he ;
+  VERTEX       *v ;
+  int          i, n, vno, vno_nbr, nleft, geometric ;
+  float        d, d_nbr ;
+
+  if (mris->nvertices != geo->nvertices)
+    ErrorReturn(-1, (ERROR_BADPARM,
+                     "MRISgeodesicRun: workspace for %d vertices, "
+                     "surface has %d", geo->nvertices, mris->nvertices)) ;
+
+  // forget the previous query
+  for (i = 0 ; i < geo->ntouched ; i++)
+  {
+    vno = geo->touched[i] ;
+    geo->dist[vno] = GEODESIC_UNREACHED ;
+    geo->pred[vno] = -1 ;
+    geo->label[vno] = 0 ;
+  }
+  geo->ntouched = geo->nsettled = 0 ;
+  pgListSetSize(heap, 1) ;   // just the sentinel
+
+  geometric = (geo->cost == NULL) ;
+  for (i = 0 ; i < nsources ; i++)
+  {
+    vno = sources[i] ;
+    if (vno < 0 || vno >= mris->nvertices || geo->label[vno] ||
+        (geometric && mris->vertices[vno].ripflag))
+    {
+      continue ;
+    }
+    geoTouch(geo, vno, 0.0f, -1) ;
+  }
+  for (nleft = i = 0 ; i < ntargets ; i++)
+    if (targets[i] >= 0 && targets[i] < mris->nvertices &&
+        !geo->target[targets[i]])
+    {
+      geo->target[targets[i]] = 1 ;
+      nleft++ ;
+    }
+
+  while (!xhIsEmpty(heap))
+  {
+    he = xhRemove(heap) ;
+    vno = he.id ;
+    d = geo->dist[vno] ;
+    geo->label[vno] = ALIVE ;
+    geo->settled[geo->nsettled++] = vno ;
+    if (geo->target[vno] && --nleft == 0)
+    {
+      break ;
+    }
+
+    v = &mris->vertices[vno] ;
+    for (n = 0 ; n < v->vnum ; n++)
+    {
+      vno_nbr = v->v[n] ;
+      if (geo->label[vno_nbr] == ALIVE)
+      {
+        continue ;
+      }
+      if (!geometric)
+      {
+        d_nbr = (*geo->cost)(geo->cost_parm, vno, vno_nbr) ;
+        if (d_nbr < 0)
+        {
+          continue ;
+        }
+        d_nbr += d ;
+      }
+      else
+      {
+        if (mris->vertices[vno_nbr].ripflag)
+        {
+          continue ;
+        }
+        d_nbr = d + geoEdge(mris, vno, vno_nbr) ;
+        if (geo->method == GEODESIC_FAST_MARCH)
+        {
+          float t = geoMarch(geo, mris, vno_nbr) ;
+          if (t < d_nbr)
+          {
+            d_nbr = t ;
+          }
+        }
+      }
+      if (max_dist > 0 && d_nbr > max_dist)
+      {
+        continue ;
+      }
+      if (geo->label[vno_nbr] == NBAND)
+      {
+        if (d_nbr < geo->dist[vno_nbr])
+        {
+          geo->dist[vno_nbr] = d_nbr ;
+          geo->pred[vno_nbr] = vno ;
+          xhChangeValue(geo->heap_index[vno_nbr], d_nbr, heap) ;
+        }
+      }
+      else
+      {
+        geoTouch(geo, vno_nbr, d_nbr, vno) ;
+      }
+    }
+  }
+
+  for (i = 0 ; i < ntargets ; i++)
+    if (targets[i] >= 0 && targets[i] < mris->nvertices)
+    {
+      geo->target[targets[i]] = 0 ;
+    }
+  return(geo->nsettled) ;
+}
+
+/*---------------------------------------------------------------
+  MRISgeodesicDistances() - distance of every vertex from the nearest
+  of the sources, GEODESIC_UNREACHED beyond max_dist (if > 0). Fills
+  and returns dist, allocating it if NULL.
+  ---------------------------------------------------------------*/
+float *
+MRISgeodesicDistances(MRI_SURFACE *mris, const int *sources, int nsources,
+                      float max_dist, int method, float *dist)
+{
+  MRIS_GEODESIC *geo ;
+  int           i, vno ;
+
+  geo = MRISgeodesicAlloc(mris, method) ;
+  if (!geo)
+  {
+    return(NULL) ;
+  }
+  if (!dist)
+  {
+    dist = (float *)calloc(mris->nvertices, sizeof(float)) ;
+    if (!dist)
+      ErrorExit(ERROR_NOMEMORY,
+                "MRISgeodesicDistances: could not allocate %d distances",
+                mris->nvertices) ;
+  }
+  MRISgeodesicRun(geo, mris, sources, nsources, max_dist, NULL, 0) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    dist[vno] = GEODESIC_UNREACHED ;
+  }
+  for (i = 0 ; i < geo->nsettled ; i++)
+  {
+    vno = geo->settled[i] ;
+    dist[vno] = geo->dist[vno] ;
+  }
+  MRISgeodesicFree(&geo) ;
+  return(dist) ;
+}
+
+/*---------------------------------------------------------------
+  MRISgeodesicNeighborhoods() - for each of vnos (every unripped vertex
+  if vnos is NULL) the vertices within radius of it (all it can reach
+  if radius <= 0) and their distances, by increasing distance. The
+  queries are independent and run in parallel.
+  ---------------------------------------------------------------*/
+MRIS_GEODESIC_NBHD *
+MRISgeodesicNeighborhoods(MRI_SURFACE *mris, const int *vnos, int nvnos,
+                          float radius, int method)
+{
+  MRIS_GEODESIC_NBHD *nbhd ;
+  int                i, vno, **nbrs, *nnbrs ;
+  float              **dists ;
+
+  if (method != GEODESIC_DIJKSTRA && method != GEODESIC_FAST_MARCH)
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "MRISgeodesicNeighborhoods: unknown method %d",
+                       method)) ;
+
+  nbhd = (MRIS_GEODESIC_NBHD *)calloc(1, sizeof(MRIS_GEODESIC_NBHD)) ;
+  if (!nbhd)
+    ErrorExit(ERROR_NOMEMORY, "MRISgeodesicNeighborhoods: could not allocate");
+  if (!vnos)
+  {
+    nvnos = MRISvalidVertices(mris) ;
+  }
+  nbhd->nvnos = nvnos ;
+  nbhd->vnos = (int *)calloc(nvnos+1, sizeof(int)) ;
+  nbhd->start = (int *)calloc(nvnos+1, sizeof(int)) ;
+  nnbrs = (int *)calloc(nvnos+1, sizeof(int)) ;
+  nbrs = (int **)calloc(nvnos+1, sizeof(int *)) ;
+  dists = (float **)calloc(nvnos+1, sizeof(float *)) ;
+  if (!nbhd->vnos || !nbhd->start || !nnbrs || !nbrs || !dists)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISgeodesicNeighborhoods: could not allocate %d queries",
+              nvnos) ;
+  if (vnos)
+  {
+    memmove(nbhd->vnos, vnos, nvnos*sizeof(int)) ;
+  }
+  else
+    for (i = vno = 0 ; vno < mris->nvertices ; vno++)
+      if (!mris->vertices[vno].ripflag)
+      {
+        nbhd->vnos[i++] = vno ;
+      }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
+#endif
+  {
+    MRIS_GEODESIC *geo = MRISgeodesicAlloc(mris, method) ;
+    int           j, k ;
+
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 64)
+#endif
+    for (j = 0 ; j < nvnos ; j++)
+    {
+      MRISgeodesicRun(geo, mris, &nbhd->vnos[j], 1, radius, NULL, 0) ;
+      if (geo->nsettled <= 1)
+      {
+        continue ;
+      }
+      // settled[0] is the query vertex itself
+      nnbrs[j] = geo->nsettled-1 ;
+      nbrs[j] = (int *)malloc(nnbrs[j]*sizeof(int)) ;
+      dists[j] = (float *)malloc(nnbrs[j]*sizeof(float)) ;
+      if (!nbrs[j] || !dists[j])
+        ErrorExit(ERROR_NOMEMORY,
+                  "MRISgeodesicNeighborhoods: could not allocate %d nbrs",
+                  nnbrs[j]) ;
+      for (k = 0 ; k < nnbrs[j] ; k++)
+      {
+        nbrs[j][k] = geo->settled[k+1] ;
+        dists[j][k] = geo->dist[nbrs[j][k]] ;
+      }
+    }
+    MRISgeodesicFree(&geo) ;
+  }
+
+  for (i = 0 ; i < nvnos ; i++)
+  {
+    nbhd->start[i+1] = nbhd->start[i] + nnbrs[i] ;
+  }
+  nbhd->nbrs = (int *)calloc(nbhd->start[nvnos]+1, sizeof(int)) ;
+  nbhd->dist = (float *)calloc(nbhd->start[nvnos]+1, sizeof(float)) ;
+  if (!nbhd->nbrs || !nbhd->dist)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISgeodesicNeighborhoods: could not allocate %d nbrs",
+              nbhd->start[nvnos]) ;
+  for (i = 0 ; i < nvnos ; i++)
+  {
+    if (nnbrs[i] > 0)
+    {
+      memmove(nbhd->nbrs+nbhd->start[i], nbrs[i], nnbrs[i]*sizeof(int)) ;
+      memmove(nbhd->dist+nbhd->start[i], dists[i], nnbrs[i]*sizeof(float)) ;
+    }
+    free(nbrs[i]) ;
+    free(dists[i]) ;
+  }
+  free(nbrs) ;
+  free(dists) ;
+  free(nnbrs) ;
+  return(nbhd) ;
+}
+
+int
+MRISgeodesicFreeNeighborhoods(MRIS_GEODESIC_NBHD **pnbhd)
+{
+  MRIS_GEODESIC_NBHD *nbhd = *pnbhd ;
+
+  *pnbhd = NULL ;
+  if (!nbhd)
+  {
+    return(NO_ERROR) ;
+  }
+  free(nbhd->vnos) ;
+  free(nbhd->start) ;
+  free(nbhd->nbrs) ;
+  free(nbhd->dist) ;
+  free(nbhd) ;
+  return(NO_ERROR) ;
+}
@@ -27,6 +27,9 @@
 
 #include <math.h>
 #include <stdlib.h>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
 
 //----------------------------------------------------
 // Includes that differ for linux vs GW BC compile
@@ -184,6 +187,327 @@ int mhtBruteForceClosestVertex(MRI_SURFACE *mris,
 //--------- test -----------
 static int checkFace(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris, int fno1);
 
+//=============================================================================
+// Bulk (CSR) construction
+//=============================================================================
+// MHTfillTable* first collect a (voxel, face-or-vertex number) pair for
+// every entry, in parallel, then sort the pairs by voxel and lay out all
+// buckets and bins in two contiguous pools. Within each bucket the
+// numbers come out in increasing order, which is the order the one-at-a-
+// time mhtAddFaceOrVertexAtVoxIx() inserts produced, so lookups see
+// identical buckets.
+
+typedef struct
+{
+  int xv ;
+  int yzv ;       // yv*TABLE_SIZE + zv
+  int forvnum ;
+} MHT_PAIR ;
+
+typedef struct
+{
+  MHT_PAIR *pairs ;
+  size_t    npairs ;
+  size_t    max_pairs ;
+} MHT_PAIR_LIST ;
+
+static void mhtPairListAdd(MHT_PAIR_LIST *list,
+                           int xv, int yv, int zv, int forvnum)
+{
+  MHT_PAIR *pair ;
+
+  // same coercion as mhtAddFaceOrVertexAtVoxIx
+  xv = MAX(0, MIN(TABLE_SIZE-1, xv)) ;
+  yv = MAX(0, MIN(TABLE_SIZE-1, yv)) ;
+  zv = MAX(0, MIN(TABLE_SIZE-1, zv)) ;
+
+  if (list->npairs >= list->max_pairs)
+  {
+    list->max_pairs = list->max_pairs ? 2*list->max_pairs : 1024 ;
+    list->pairs = (MHT_PAIR *)realloc(list->pairs,
+                                      list->max_pairs*sizeof(MHT_PAIR)) ;
+    if (!list->pairs)
+      ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d pairs.\n",
+                __MYFUNCTION__, (int)list->max_pairs) ;
+  }
+  pair = &list->pairs[list->npairs++] ;
+  pair->xv = xv ;
+  pair->yzv = yv*TABLE_SIZE + zv ;
+  pair->forvnum = forvnum ;
+}
+
+static int mhtComparePairs(const void *a, const void *b)
+{
+  const MHT_PAIR *p1 = (const MHT_PAIR *)a, *p2 = (const MHT_PAIR *)b ;
+
+  if (p1->yzv != p2->yzv)
+    return(p1->yzv < p2->yzv ? -1 : 1) ;
+  if (p1->forvnum != p2->forvnum)
+    return(p1->forvnum < p2->forvnum ? -1 : 1) ;
+  return(0) ;
+}
+
+/*------------------------------------------------------------
+  mhtBuildFromPairs
+  Fills the (empty) mht from the per-thread pair lists, which are
+  freed. Pairs are bucketed by xv with a counting sort, and each xv
+  slab is sorted and laid out independently.
+  -------------------------------------------------------------*/
+static int mhtBuildFromPairs(MRIS_HASH_TABLE *mht,
+                             MHT_PAIR_LIST *lists, int nlists)
+{
+  size_t   npairs, *slab_start, *slab_fill ;
+  int      *slab_nbuckets, *slab_nbins, *bucket_start, *bin_start ;
+  int      t, xv, nbuckets, nbins ;
+  MHT_PAIR *pairs ;
+
+  for (npairs = 0, t = 0 ; t < nlists ; t++)
+    npairs += lists[t].npairs ;
+
+  slab_start = (size_t *)calloc(TABLE_SIZE+1, sizeof(size_t)) ;
+  slab_fill = (size_t *)calloc(TABLE_SIZE, sizeof(size_t)) ;
+  slab_nbuckets = (int *)calloc(TABLE_SIZE, sizeof(int)) ;
+  slab_nbins = (int *)calloc(TABLE_SIZE, sizeof(int)) ;
+  bucket_start = (int *)calloc(TABLE_SIZE, sizeof(int)) ;
+  bin_start = (int *)calloc(TABLE_SIZE, sizeof(int)) ;
+  pairs = (MHT_PAIR *)malloc((npairs ? npairs : 1)*sizeof(MHT_PAIR)) ;
+  if (!slab_start || !slab_fill || !slab_nbuckets || !slab_nbins ||
+      !bucket_start || !bin_start || !pairs)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d pairs.\n",
+              __MYFUNCTION__, (int)npairs) ;
+
+  //------ counting sort on xv ------
+  for (t = 0 ; t < nlists ; t++)
+  {
+    size_t i ;
+    for (i = 0 ; i < lists[t].npairs ; i++)
+      slab_start[lists[t].pairs[i].xv+1]++ ;
+  }
+  for (xv = 0 ; xv < TABLE_SIZE ; xv++)
+    slab_start[xv+1] += slab_start[xv] ;
+  for (t = 0 ; t < nlists ; t++)
+  {
+    size_t i ;
+    MHT_PAIR *pair ;
+    for (i = 0 ; i < lists[t].npairs ; i++)
+    {
+      pair = &lists[t].pairs[i] ;
+      pairs[slab_start[pair->xv] + slab_fill[pair->xv]++] = *pair ;
+    }
+    free(lists[t].pairs) ;
+    lists[t].pairs = NULL ;
+    lists[t].npairs = lists[t].max_pairs = 0 ;
+  }
+
+  //------ sort and dedup each slab, count its buckets ------
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 4)
+#endif
+  for (xv = 0 ; xv < TABLE_SIZE ; xv++)
+  {
+    MHT_PAIR *slab = pairs + slab_start[xv] ;
+    size_t   i, n = slab_start[xv+1] - slab_start[xv], nkept ;
+
+    if (!n)
+      continue ;
+    qsort(slab, n, sizeof(MHT_PAIR), mhtComparePairs) ;
+    for (nkept = 1, i = 1 ; i < n ; i++)
+      if (mhtComparePairs(&slab[i], &slab[nkept-1]))
+        slab[nkept++] = slab[i] ;
+    slab_fill[xv] = nkept ;
+    slab_nbins[xv] = nkept ;
+    slab_nbuckets[xv] = 1 ;
+    for (i = 1 ; i < nkept ; i++)
+      if (slab[i].yzv != slab[i-1].yzv)
+        slab_nbuckets[xv]++ ;
+  }
+
+  for (nbuckets = nbins = 0, xv = 0 ; xv < TABLE_SIZE ; xv++)
+  {
+    bucket_start[xv] = nbuckets ;
+    bin_start[xv] = nbins ;
+    nbuckets += slab_nbuckets[xv] ;
+    nbins += slab_nbins[xv] ;
+  }
+  mht->bucket_pool = (MHBT *)calloc(nbuckets ? nbuckets : 1, sizeof(MHBT)) ;
+  mht->bin_pool = (MHB *)calloc(nbins ? nbins : 1, sizeof(MHB)) ;
+  if (!mht->bucket_pool || !mht->bin_pool)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d buckets.\n",
+              __MYFUNCTION__, nbuckets) ;
+  mht->nbins_pool = nbins ;
+  mht->nbuckets = nbuckets ;
+
+  //------ lay out buckets and bins ------
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 4)
+#endif
+  for (xv = 0 ; xv < TABLE_SIZE ; xv++)
+  {
+    MHT_PAIR *slab = pairs + slab_start[xv] ;
+    size_t   i, n = slab_fill[xv] ;
+    MHBT     *bucket = NULL ;
+    MHB      *bin = mht->bin_pool + bin_start[xv] ;
+    int      b = bucket_start[xv], yv, zv ;
+
+    for (i = 0 ; i < n ; i++, bin++)
+    {
+      if (i == 0 || slab[i].yzv != slab[i-1].yzv)
+      {
+        yv = slab[i].yzv / TABLE_SIZE ;
+        zv = slab[i].yzv % TABLE_SIZE ;
+        if (!mht->buckets[xv][yv])
+        {
+          mht->buckets[xv][yv] = (MHBT **)calloc(TABLE_SIZE, sizeof(MHBT *)) ;
+          if (!mht->buckets[xv][yv])
+            ErrorExit(ERROR_NO_MEMORY,
+                      "%s: could not allocate slice.",  __MYFUNCTION__) ;
+        }
+        bucket = &mht->bucket_pool[b++] ;
+        bucket->bins = bin ;
+        mht->buckets[xv][yv][zv] = bucket ;
+      }
+      bin->fno = slab[i].forvnum ;
+      bucket->nused++ ;
+      bucket->max_bins++ ;
+    }
+  }
+
+  free(pairs) ;
+  free(slab_start) ;
+  free(slab_fill) ;
+  free(slab_nbuckets) ;
+  free(slab_nbins) ;
+  free(bucket_start) ;
+  free(bin_start) ;
+  return(NO_ERROR) ;
+}
+
+// non-zero if the bins/bucket live in the pools (so mustn't be freed)
+static int mhtBinsInPool(MRIS_HASH_TABLE *mht, MHB *bins)
+{
+  return(mht->bin_pool &&
+         bins >= mht->bin_pool && bins < mht->bin_pool + mht->nbins_pool) ;
+}
+
+static int mhtBucketInPool(MRIS_HASH_TABLE *mht, MHBT *bucket)
+{
+  return(mht->bucket_pool &&
+         bucket >= mht->bucket_pool &&
+         bucket < mht->bucket_pool + mht->nbuckets) ;
+}
+
+static int mhtNumLists(void)
+{
+#ifdef HAVE_OPENMP
+  return(omp_get_max_threads()) ;
+#else
+  return(1) ;
+#endif
+}
+
+static int mhtThreadNum(void)
+{
+#ifdef HAVE_OPENMP
+  return(omp_get_thread_num()) ;
+#else
+  return(0) ;
+#endif
+}
+
+/*------------------------------------------------------------
+  mhtFillFacePairs / mhtFillVertexPairs
+  Collect the pairs that mhtFaceToMHT(..., on=1) and
+  mhtAddFaceOrVertexAtCoords would have added for every unripped
+  face/vertex, and build the table from them.
+  -------------------------------------------------------------*/
+static int mhtFillFaces(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris)
+{
+  int           nlists = mhtNumLists(), fno ;
+  MHT_PAIR_LIST *lists ;
+
+  lists = (MHT_PAIR_LIST *)calloc(nlists, sizeof(MHT_PAIR_LIST)) ;
+  if (!lists)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate lists.\n",
+              __MYFUNCTION__) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel num_threads(nlists)
+#endif
+  {
+    MHT_PAIR_LIST *list = &lists[mhtThreadNum()] ;
+    VOXEL_LISTgw  *voxlist ;
+
+    // too big for the stack of a worker thread
+    voxlist = (VOXEL_LISTgw *)malloc(sizeof(VOXEL_LISTgw)) ;
+    if (!voxlist)
+      ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate voxel list.\n",
+                __MYFUNCTION__) ;
+
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 1024)
+#endif
+    for (fno = 0 ; fno < mris->nfaces ; fno++)
+    {
+      FACE    *face = &mris->faces[fno] ;
+      Ptdbl_t vpt0, vpt1, vpt2 ;
+      int     vlix ;
+
+      if (face->ripflag)
+        continue ;
+      mhtVertex2Ptxyz_double(&mris->vertices[face->v[0]],
+                             mht->which_vertices, &vpt0);
+      mhtVertex2Ptxyz_double(&mris->vertices[face->v[1]],
+                             mht->which_vertices, &vpt1);
+      mhtVertex2Ptxyz_double(&mris->vertices[face->v[2]],
+                             mht->which_vertices, &vpt2);
+      mhtVoxelList_Init(voxlist);
+      mhtVoxelList_SampleFace(mht->vres, &vpt0, &vpt1, &vpt2, fno, voxlist);
+      for (vlix = 0; vlix < voxlist->nused; vlix++)
+        mhtPairListAdd(list,
+                       voxlist->voxels[vlix][0],
+                       voxlist->voxels[vlix][1],
+                       voxlist->voxels[vlix][2], fno) ;
+    }
+    free(voxlist) ;
+  }
+
+  mhtBuildFromPairs(mht, lists, nlists) ;
+  free(lists) ;
+  return(NO_ERROR) ;
+}
+
+static int mhtFillVertices(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris)
+{
+  int           nlists = mhtNumLists(), vno ;
+  MHT_PAIR_LIST *lists ;
+
+  lists = (MHT_PAIR_LIST *)calloc(nlists, sizeof(MHT_PAIR_LIST)) ;
+  if (!lists)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate lists.\n",
+              __MYFUNCTION__) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for num_threads(nlists) schedule(static)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+    float  x = 0.0, y = 0.0, z = 0.0 ;
+
+    if (v->ripflag)
+      continue ;
+    mhtVertex2xyz_float(v, mht->which_vertices, &x, &y, &z);
+    mhtPairListAdd(&lists[mhtThreadNum()],
+                   WORLD_TO_VOXEL(mht, x),
+                   WORLD_TO_VOXEL(mht, y),
+                   WORLD_TO_VOXEL(mht, z), vno) ;
+  }
+
+  mhtBuildFromPairs(mht, lists, nlists) ;
+  free(lists) ;
+  return(NO_ERROR) ;
+}
+
 //=============================================================================
 // Surface --> MHT, store Face Numbers
 //=============================================================================
@@ -209,8 +533,6 @@ MRIS_HASH_TABLE * MHTfillTableAtResolution(
   int which, float res)
 //------------------------------------
 {
-  int     fno ;
-  FACE    *f ;
   int     xv, yv, zv ;
   MHBT    *bucket ;
   static int ncalls = 0 ;
@@ -244,15 +566,7 @@ MRIS_HASH_TABLE * MHTfillTableAtResolution(
   mht->which_vertices  = which ;
   mht->fno_usage       = MHTFNO_FACE ;
 
-  for (fno = 0 ; fno < mris->nfaces ; fno++)
-  {
-    f = &mris->faces[fno] ;
-    if (f->ripflag)
-      continue ;
-    if (fno == Gdiag_no)
-      DiagBreak() ;
-    mhtFaceToMHT(mht, mris, fno, 1) ;
-  }
+  mhtFillFaces(mht, mris) ;
 
   //-------------------------------------------
   // Diagnostics
@@ -615,11 +929,8 @@ MRIS_HASH_TABLE *MHTfillVertexTableRes(
   MRI_SURFACE *mris,MRIS_HASH_TABLE *mht, int which, float res)
 //---------------------------------------------------------
 {
-  int     vno ;
   int     xv, yv, zv ;
-  float   x=0.0, y=0.0, z=0.0;
   MHBT    *bucket ;
-  VERTEX  *v ;
   static int ncalls = 0 ;
 
   mhtStoreFaceCentroids(mris, which) ;
@@ -648,17 +959,7 @@ MRIS_HASH_TABLE *MHTfillVertexTableRes(
   mht->which_vertices  = which ;
   mht->fno_usage       = MHTFNO_VERTEX ;
 
-  for (vno = 0 ; vno < mris->nvertices ; vno++)
-  {
-    v = &mris->vertices[vno] ;
-    if (vno == Gdiag_no)
-      DiagBreak() ;
-    if (v->ripflag)
-      continue ;
-
-    mhtVertex2xyz_float(v, mht->which_vertices, &x, &y, &z);
-    mhtAddFaceOrVertexAtCoords(mht, x, y, z, vno);
-  }
+  mhtFillVertices(mht, mris) ;
 
   //-------------------------------------------
   // Diagnostics
@@ -810,7 +1111,8 @@ static int mhtAddFaceOrVertexAtVoxIx(MRIS_HASH_TABLE *mht,
                   "%s: could not allocate %d bins.\n",
                   __MYFUNCTION__,  bucket->max_bins) ;
       memmove(bucket->bins, bin, bucket->nused*sizeof(MHB)) ;
-      free(bin) ;
+      if (!mhtBinsInPool(mht, bin))
+        free(bin) ;
       bin = &bucket->bins[i] ;
     }
     //----- add this face-position to this bucket ------
@@ -2252,28 +2554,313 @@ VERTEX * MHTfindClosestVertexInTable(MRIS_HASH_TABLE *mht,
   return vtx;
 }
 
-#define MAX_VERTICES 50000
+//=============================================================================
+// Batched queries (vertex tables)
+//=============================================================================
+
+// table-coords of every vertex, so the inner loops don't switch on which
+static float *mhtVertexCoords(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris)
+{
+  float *vxyz ;
+  int   vno ;
+
+  vxyz = (float *)malloc(3*(size_t)(mris->nvertices ? mris->nvertices : 1)*
+                         sizeof(float)) ;
+  if (!vxyz)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d coords.\n",
+              __MYFUNCTION__, mris->nvertices) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+    mhtVertex2xyz_float(&mris->vertices[vno], mht->which_vertices,
+                        &vxyz[3*vno], &vxyz[3*vno+1], &vxyz[3*vno+2]) ;
+  return(vxyz) ;
+}
+
+static int mhtCheckBatchArgs(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris,
+                             int *pnpoints, const float *xyz)
+{
+  if (!mht || mht->fno_usage != MHTFNO_VERTEX)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "%s: mht not initialized for vertices",
+                 __MYFUNCTION__)) ;
+  if (!xyz)
+    *pnpoints = mris->nvertices ;
+  return(NO_ERROR) ;
+}
+
+/*-------------------------------------------------------------
+  mhtKNearestAtPoint
+  Searches cubic shells of buckets around (x,y,z) outwards. Anything
+  in shell r+1 is at least r*vres away, so once k hits are closer than
+  that (or r*vres passes max_dist) the search is done. Ties are broken
+  by vertex number so the result doesn't depend on bucket order.
+  -------------------------------------------------------------*/
+static void mhtKNearestAtPoint(MRIS_HASH_TABLE *mht, const float *vxyz,
+                               float x, float y, float z,
+                               int k, double max_dist,
+                               int *vnos, float *dists)
+{
+  int    xc, yc, zc, r, xk, yk, zk, nfound = 0, i, j, vno ;
+  double max_dsq = max_dist*max_dist ;
+  float  dx, dy, dz, dsq ;
+  MHBT   *bucket ;
+
+  for (i = 0 ; i < k ; i++)
+  {
+    vnos[i] = -1 ;
+    dists[i] = -1 ;
+  }
+
+  xc = MAX(0, MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, x))) ;
+  yc = MAX(0, MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, y))) ;
+  zc = MAX(0, MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, z))) ;
+
+  for (r = 0 ; r < TABLE_SIZE ; r++)
+  {
+    for (xk = -r ; xk <= r ; xk++)
+    {
+      if (xc+xk < 0 || xc+xk >= TABLE_SIZE)
+        continue ;
+      for (yk = -r ; yk <= r ; yk++)
+      {
+        int zstep ;
+
+        if (yc+yk < 0 || yc+yk >= TABLE_SIZE ||
+            !mht->buckets[xc+xk][yc+yk])
+          continue ;
+        // interior of the shell is done, only its two z faces are new
+        zstep = (abs(xk) == r || abs(yk) == r || r == 0) ? 1 : 2*r ;
+        for (zk = -r ; zk <= r ; zk += zstep)
+        {
+          if (zc+zk < 0 || zc+zk >= TABLE_SIZE)
+            continue ;
+          bucket = mht->buckets[xc+xk][yc+yk][zc+zk] ;
+          if (!bucket)
+            continue ;
+          for (j = 0 ; j < bucket->nused ; j++)
+          {
+            vno = bucket->bins[j].fno ;
+            dx = vxyz[3*vno] - x ;
+            dy = vxyz[3*vno+1] - y ;
+            dz = vxyz[3*vno+2] - z ;
+            dsq = dx*dx + dy*dy + dz*dz ;
+            if (dsq > max_dsq)
+              continue ;
+            if (nfound == k &&
+                (dsq > dists[k-1] ||
+                 (dsq == dists[k-1] && vno > vnos[k-1])))
+              continue ;
+            // insertion into the sorted list (dists holds squares here)
+            i = (nfound < k) ? nfound++ : k-1 ;
+            while (i > 0 &&
+                   (dists[i-1] > dsq ||
+                    (dists[i-1] == dsq && vnos[i-1] > vno)))
+            {
+              dists[i] = dists[i-1] ;
+              vnos[i] = vnos[i-1] ;
+              i-- ;
+            }
+            dists[i] = dsq ;
+            vnos[i] = vno ;
+          }
+        }
+      }
+    }
+    if (nfound == k && dists[k-1] <= SQR((double)r*mht->vres))
+      break ;
+    if ((double)r*mht->vres > max_dist)
+      break ;
+  }
+  for (i = 0 ; i < nfound ; i++)
+    dists[i] = sqrt(dists[i]) ;
+}
+
+/*-------------------------------------------------------------
+  MHTfindKNearestVertices
+  See mrishash.h. Returns NO_ERROR, or an error for a face table.
+  -------------------------------------------------------------*/
+int MHTfindKNearestVertices(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris,
+                            int npoints, const float *xyz,
+                            int k, double max_dist,
+                            int *vnos, float *dists)
+{
+  float *vxyz ;
+  int   n ;
+
+  if (mhtCheckBatchArgs(mht, mris, &npoints, xyz) != NO_ERROR)
+    return(Gerror) ;
+  if (k <= 0)
+    return(NO_ERROR) ;
+
+  vxyz = mhtVertexCoords(mht, mris) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 256)
+#endif
+  for (n = 0 ; n < npoints ; n++)
+  {
+    const float *p = xyz ? &xyz[3*n] : &vxyz[3*n] ;
+    mhtKNearestAtPoint(mht, vxyz, p[0], p[1], p[2], k, max_dist,
+                       &vnos[(size_t)n*k], &dists[(size_t)n*k]) ;
+  }
+  free(vxyz) ;
+  return(NO_ERROR) ;
+}
+
+/*-------------------------------------------------------------
+  mhtRadiusAtPoint
+  Counts (vnos == NULL) or lists the vertices within radius of
+  (x,y,z), scanning every bucket the search cube overlaps. Vertex
+  coords come from the vxyz table, or from mris if vxyz is NULL.
+  -------------------------------------------------------------*/
+static int mhtRadiusAtPoint(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris,
+                            const float *vxyz,
+                            float x, float y, float z, double radius,
+                            int *vnos)
+{
+  int    x0, x1, y0, y1, z0, z1, xv, yv, zv, j, vno, n = 0 ;
+  double rsq = radius*radius ;
+  float  dx, dy, dz, vx = 0.0, vy = 0.0, vz = 0.0 ;
+  MHBT   *bucket ;
+
+  x0 = MAX(0, WORLD_TO_VOXEL(mht, x-radius)) ;
+  y0 = MAX(0, WORLD_TO_VOXEL(mht, y-radius)) ;
+  z0 = MAX(0, WORLD_TO_VOXEL(mht, z-radius)) ;
+  x1 = MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, x+radius)) ;
+  y1 = MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, y+radius)) ;
+  z1 = MIN(TABLE_SIZE-1, WORLD_TO_VOXEL(mht, z+radius)) ;
+
+  for (xv = x0 ; xv <= x1 ; xv++)
+    for (yv = y0 ; yv <= y1 ; yv++)
+    {
+      if (!mht->buckets[xv][yv])
+        continue ;
+      for (zv = z0 ; zv <= z1 ; zv++)
+      {
+        bucket = mht->buckets[xv][yv][zv] ;
+        if (!bucket)
+          continue ;
+        for (j = 0 ; j < bucket->nused ; j++)
+        {
+          vno = bucket->bins[j].fno ;
+          if (vxyz)
+          {
+            vx = vxyz[3*vno] ;
+            vy = vxyz[3*vno+1] ;
+            vz = vxyz[3*vno+2] ;
+          }
+          else
+            mhtVertex2xyz_float(&mris->vertices[vno], mht->which_vertices,
+                                &vx, &vy, &vz) ;
+          dx = vx - x ;
+          dy = vy - y ;
+          dz = vz - z ;
+          if (dx*dx + dy*dy + dz*dz <= rsq)
+          {
+            if (vnos)
+              vnos[n] = vno ;
+            n++ ;
+          }
+        }
+      }
+    }
+  return(n) ;
+}
+
+/*-------------------------------------------------------------
+  MHTfindVerticesWithinRadius
+  See mrishash.h. Two parallel passes: count, then fill.
+  -------------------------------------------------------------*/
+int MHTfindVerticesWithinRadius(MRIS_HASH_TABLE *mht, MRI_SURFACE *mris,
+                                int npoints, const float *xyz,
+                                double radius,
+                                int **poffsets, int **pvnos)
+{
+  float *vxyz ;
+  int   n, *offsets, *vnos ;
+
+  *poffsets = *pvnos = NULL ;
+  if (mhtCheckBatchArgs(mht, mris, &npoints, xyz) != NO_ERROR)
+    return(Gerror) ;
+
+  offsets = (int *)calloc(npoints+1, sizeof(int)) ;
+  if (!offsets)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d offsets.\n",
+              __MYFUNCTION__, npoints+1) ;
+  vxyz = mhtVertexCoords(mht, mris) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 256)
+#endif
+  for (n = 0 ; n < npoints ; n++)
+  {
+    const float *p = xyz ? &xyz[3*n] : &vxyz[3*n] ;
+    offsets[n+1] = mhtRadiusAtPoint(mht, mris, vxyz, p[0], p[1], p[2],
+                                    radius, NULL) ;
+  }
+  for (n = 0 ; n < npoints ; n++)
+    offsets[n+1] += offsets[n] ;
+
+  vnos = (int *)malloc((offsets[npoints] ? offsets[npoints] : 1)*sizeof(int)) ;
+  if (!vnos)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d hits.\n",
+              __MYFUNCTION__, offsets[npoints]) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 256)
+#endif
+  for (n = 0 ; n < npoints ; n++)
+  {
+    const float *p = xyz ? &xyz[3*n] : &vxyz[3*n] ;
+    mhtRadiusAtPoint(mht, mris, vxyz, p[0], p[1], p[2], radius,
+                     &vnos[offsets[n]]) ;
+  }
+
+  free(vxyz) ;
+  *poffsets = offsets ;
+  *pvnos = vnos ;
+  return(NO_ERROR) ;
+}
+
 /*------------------------------------------------------------
   MHTgetAllVerticesWithinDistance
   Returns a list of vertex numbers from mris & mht that are within
-  max_dist of vertex vno.
+  max_dist of vertex vno (not including vno itself), and their number
+  in *pvnum.
 
   Allocates separate list pvnum which must be freed by caller.
-
-  As of 2007-03-20, there don't appear to be any callers of this function
-  in all the FS source code, so I'm not bothering to implement its
-  functionality in the generic Find function, however it would be easy to do.
+  Uses the same bucket scan as MHTfindVerticesWithinRadius, but reads
+  the coords of the vertices in the visited buckets only.
   ------------------------------------------------------------*/
 int * MHTgetAllVerticesWithinDistance(MRIS_HASH_TABLE *mht,
                                       MRI_SURFACE *mris,
                                       int vno, float max_dist, int *pvnum)
 {
 //------------------------------------------------------
-  ErrorExit(ERROR_UNSUPPORTED,  "%s: not implemented.\n", __MYFUNCTION__);
-
-  return NULL;
+  float x = 0.0, y = 0.0, z = 0.0 ;
+  int   *vnos, n, i, nkept ;
+
+  *pvnum = 0 ;
+  if (!mht || mht->fno_usage != MHTFNO_VERTEX)
+    ErrorReturn(NULL, (ERROR_BADPARM, "%s: mht not initialized for vertices",
+                       __MYFUNCTION__)) ;
+
+  mhtVertex2xyz_float(&mris->vertices[vno], mht->which_vertices, &x, &y, &z);
+  n = mhtRadiusAtPoint(mht, mris, NULL, x, y, z, max_dist, NULL) ;
+  vnos = (int *)calloc(n ? n : 1, sizeof(int)) ;
+  if (!vnos)
+    ErrorExit(ERROR_NO_MEMORY, "%s: could not allocate %d vertices.\n",
+              __MYFUNCTION__, n) ;
+  mhtRadiusAtPoint(mht, mris, NULL, x, y, z, max_dist, vnos) ;
+
+  for (nkept = i = 0 ; i < n ; i++)
+    if (vnos[i] != vno)
+      vnos[nkept++] = vnos[i] ;
+  *pvnum = nkept ;
+  return vnos;
 }
 
+
 /*------------------------------------------------------------
   mhtBruteForceClosestVertex
   Finds closest vertex by exhaustive search of surface. This is
@@ -2435,14 +3022,20 @@ int MHTfree(MRIS_HASH_TABLE **pmht)
       {
         if (mht->buckets[xv][yv][zv])
         {
-          if (mht->buckets[xv][yv][zv]->bins)
+          if (mht->buckets[xv][yv][zv]->bins &&
+              !mhtBinsInPool(mht, mht->buckets[xv][yv][zv]->bins))
             free(mht->buckets[xv][yv][zv]->bins) ;
-          free(mht->buckets[xv][yv][zv]) ;
+          if (!mhtBucketInPool(mht, mht->buckets[xv][yv][zv]))
+            free(mht->buckets[xv][yv][zv]) ;
         }
       }
       free(mht->buckets[xv][yv]) ;
     }
   }
+  if (mht->bucket_pool)
+    free(mht->bucket_pool) ;
+  if (mht->bin_pool)
+    free(mht->bin_pool) ;
   free(mht) ;
   return(NO_ERROR) ;
 }
@@ -394,9 +394,8 @@ MRIStoParameterization(MRI_SURFACE *mris, MRI_SP *mrisp, float scale,int fno)
 MRI_SP *
 MRIStoParameterization(MRI_SURFACE *mris, MRI_SP *mrisp, float scale,int fno)
 {
-  float     a, b, c, phi, theta, x, y, z, uf, vf, d, total_d,
-  **distances, *fp ;
-  int       vno, u, v, unfilled, **filled, npasses, nfilled ;
+  float     a, b, c, total_d, **distances, *fp ;
+  int       vno, u, v, unfilled, **filled, npasses, nfilled, *vu, *vv ;
   VERTEX    *vertex ;
 
   if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
@@ -428,10 +427,22 @@ a = b = c = MRISaverageRadius(mris) ;
   }
 
   fp = IMAGEFseq_pix(mrisp->Ip, DEBUG_U, DEBUG_V,fno) ;
-  /* first calculate total distances to a point in parameter space */
+  /* the (u,v) of each vertex is independent of the others, so find them
+     in parallel; the sums below stay in vertex order */
+  vu = (int *)calloc(mris->nvertices, sizeof(int)) ;
+  vv = (int *)calloc(mris->nvertices, sizeof(int)) ;
+  if (!vu || !vv)
+    ErrorExit(ERROR_NOMEMORY, "MRIStoParameterization: could not allocate "
+              "%d vertex coordinates", mris->nvertices) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
-    vertex = &mris->vertices[vno] ;
+    VERTEX *vertex = &mris->vertices[vno] ;
+    float  x, y, z, theta, phi, d, uf, vf ;
+    int    u, v ;
+
     x = vertex->x ;
     y = vertex->y ;
     z = vertex->z ;
@@ -462,17 +473,22 @@ a = b = c = MRISaverageRadius(mris) ;
       v += V_DIM(mrisp) ;
     if (v >= V_DIM(mrisp))
       v -= V_DIM(mrisp) ;
+    vu[vno] = u ;
+    vv[vno] = v ;
+  }
 
-    if (u == 0 && v == 56)
-      DiagBreak() ;
-    if ((u == DEBUG_U) && (v == DEBUG_V))
-      DiagBreak() ;
-
+  /* first calculate total distances to a point in parameter space */
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    u = vu[vno] ;
+    v = vv[vno] ;
     filled[u][v] = vno ;
     distances[u][v] += 1 ;         /* keep track of total # of nodes */
     if ((u == DEBUG_U) && (v == DEBUG_V))
-      fprintf(stderr, "v = %6.6d (%2.1f, %2.1f, %2.1f), d = %2.3f, "
-              "curv = %2.3f\n", vno, x, y, z, d, vertex->curv) ;
+      fprintf(stderr, "v = %6.6d (%2.1f, %2.1f, %2.1f), "
+              "curv = %2.3f\n", vno, mris->vertices[vno].x,
+              mris->vertices[vno].y, mris->vertices[vno].z,
+              mris->vertices[vno].curv) ;
   }
 
   if (DEBUG_U >= 0)
@@ -484,30 +500,8 @@ a = b = c = MRISaverageRadius(mris) ;
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
     vertex = &mris->vertices[vno] ;
-    x = vertex->x ;
-    y = vertex->y ;
-    z = vertex->z ;
-    theta = atan2(y/b, x/a) ;
-    if (theta < 0.0f)
-      theta = 2 * M_PI + theta ;  /* make it 0 --> 2*PI */
-    d = c*c-z*z ;
-    if (d < 0.0) d = 0.0 ;
-    phi = atan2(sqrt(d), z) ;
-    uf = PHI_DIM(mrisp) * phi / PHI_MAX ;
-    vf = THETA_DIM(mrisp) * theta / THETA_MAX ;
-    u = nint(uf) ;
-    v = nint(vf) ;
-    if (u < 0)  /* enforce spherical topology  */
-      u = -u ;
-    if (u >= U_DIM(mrisp))
-      u = U_DIM(mrisp) - (u-U_DIM(mrisp)+1) ;
-    if (v < 0)  /* enforce spherical topology  */
-      v += V_DIM(mrisp) ;
-    if (v >= V_DIM(mrisp))
-      v -= V_DIM(mrisp) ;
-
-    if (u == 0 && v == 56)
-      DiagBreak() ;
+    u = vu[vno] ;
+    v = vv[vno] ;
 
     /* 0,0 */
     total_d = distances[u][v] ;
@@ -515,11 +509,9 @@ a = b = c = MRISaverageRadius(mris) ;
       DiagBreak() ;
     if (total_d > 0.0)
       *IMAGEFseq_pix(mrisp->Ip, u,v,fno) += vertex->curv/total_d ;
-    if ((u == DEBUG_U) && (v == DEBUG_V))
-      fprintf(stderr, "v = %6.6d (%2.1f, %2.1f, %2.1f), curv = %2.3f, "
-              "proportion = %2.3f\n", vno, x, y, z, vertex->curv, d) ;
-
   }
+  free(vu) ;
+  free(vv) ;
 
   if (DEBUG_U >= 0)
     fprintf(stderr,"curv[%d][%d] = %2.3f\n\n", DEBUG_U, DEBUG_V,
@@ -938,9 +930,8 @@ MRIScoordsToParameterization(MRI_SURFACE *mris, MRI_SP *mrisp, float scale, int
 MRI_SURFACE *
 MRISfromParameterization(MRI_SP *mrisp, MRI_SURFACE *mris, int fno)
 {
-  float     a, b, c, phi, theta, x, y, z, uf, vf, du, dv, curv, d ;
-  int       vno, u0, v0, u1, v1 ;
-  VERTEX    *vertex ;
+  float     a, b, c ;
+  int       vno ;
 
   if (!mris)
     mris = MRISclone(mrisp->mris) ;
@@ -954,8 +945,15 @@ MRISfromParameterization(MRI_SP *mrisp, MRI_SURFACE *mris, int fno)
   a = b = c = MRISaverageRadius(mris) ;
 #endif
 
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
+    VERTEX *vertex ;
+    float  phi, theta, x, y, z, uf, vf, du, dv, curv, d ;
+    int    u0, v0, u1, v1 ;
+
     vertex = &mris->vertices[vno] ;
     x = vertex->x ;
     y = vertex->y ;
@@ -1887,8 +1885,8 @@ MRISPconvolveGaussian(MRI_SP *mrisp_src, MRI_SP *mrisp_dst,
 MRI_SP *
 MRISPblur(MRI_SP *mrisp_src, MRI_SP *mrisp_dst, float sigma, int fno)
 {
-  int    u, v, cart_klen, klen, khalf, uk, vk, u1, v1, no_sphere, voff, f0, f1;
-  double k, total, ktotal, sigma_sq_inv, udiff, vdiff, sin_sq_u, phi ;
+  int    u, cart_klen, no_sphere, f0, f1, in_place ;
+  double sigma_sq_inv ;
   IMAGE  *Ip_src, *Ip_dst ;
 
   no_sphere = getenv("NO_SPHERE") != NULL ;
@@ -1915,6 +1913,9 @@ MRISPblur(MRI_SP *mrisp_src, MRI_SP *mrisp_dst, float sigma, int fno)
 
   Ip_src = mrisp_src->Ip ;
   Ip_dst = mrisp_dst->Ip ;
+  /* blurring in place reads rows that were already blurred, so it has
+     to go in order */
+  in_place = (Ip_src == Ip_dst) ;
   if (fno < 0)
   {
     f0 = 0 ;
@@ -1926,10 +1927,14 @@ MRISPblur(MRI_SP *mrisp_src, MRI_SP *mrisp_dst, float sigma, int fno)
   }
   for (fno = f0 ; fno <= f1 ; fno++)   /* for each frame */
   {
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for if (!in_place) schedule(dynamic)
+#endif
     for (u = 0 ; u < U_DIM(mrisp_src) ; u++)
     {
-      if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
-        fprintf(stderr, "\r%3.3d of %d     ", u, U_DIM(mrisp_src)-1) ;
+      int    v, klen, khalf, uk, vk, u1, v1, voff ;
+      double k, total, ktotal, udiff, vdiff, sin_sq_u, phi, *kernel, *kp ;
+
       phi = (double)u*PHI_MAX / PHI_DIM(mrisp_src) ;
       sin_sq_u = sin(phi) ;
       sin_sq_u *= sin_sq_u ;
@@ -1949,17 +1954,32 @@ MRISPblur(MRI_SP *mrisp_src, MRI_SP *mrisp_dst, float sigma, int fno)
       if (klen >= V_DIM(mrisp_src))
         klen = V_DIM(mrisp_src)-1 ;
       khalf = klen/2 ;
+
+      /* the weights only depend on the row, so compute them (and their
+         sum, in the same order as before) once per row, not per pixel */
+      kernel = (double *)malloc((2*khalf+1)*(2*khalf+1)*sizeof(double)) ;
+      if (!kernel)
+        ErrorExit(ERROR_NOMEMORY, "MRISPblur: could not allocate kernel") ;
+      ktotal = 0.0 ;
+      for (kp = kernel, uk = -khalf ; uk <= khalf ; uk++)
+      {
+        udiff = (double)(uk*uk) ;  /* distance squared in u */
+        for (vk = -khalf ; vk <= khalf ; vk++)
+        {
+          vdiff = (double)(vk*vk) ;
+          *kp = exp(-(udiff+sin_sq_u*vdiff)*sigma_sq_inv) ;
+          ktotal += *kp++ ;
+        }
+      }
+
       for (v = 0 ; v < V_DIM(mrisp_src) ; v++)
       {
-        /*      theta = (double)v*THETA_MAX / THETA_DIM(mrisp_src) ;*/
         if (u == DEBUG_U && v == DEBUG_V)
           DiagBreak() ;
 
-        total = ktotal = 0.0 ;
-        for (uk = -khalf ; uk <= khalf ; uk++)
+        total = 0.0 ;
+        for (kp = kernel, uk = -khalf ; uk <= khalf ; uk++)
         {
-          udiff = (double)(uk*uk) ;  /* distance squared in u */
-
           u1 = u + uk ;
           if (u1 < 0)  /* enforce spherical topology  */
           {
@@ -1974,32 +1994,21 @@ MRISPblur(MRI_SP *mrisp_src, MRI_SP *mrisp_dst, float sigma, int fno)
           else
             voff = 0 ;
 
-#if 0
-          phi = (double)u1*PHI_MAX / PHI_DIM(mrisp_src) ;
-          sin_sq_u = sin(phi) ;
-          sin_sq_u *= sin_sq_u ;
-          if (no_sphere)
-            sin_sq_u = 1.0f ;
-#endif
-
           for (vk = -khalf ; vk <= khalf ; vk++)
           {
-            vdiff = (double)(vk*vk) ;
-            k = exp(-(udiff+sin_sq_u*vdiff)*sigma_sq_inv) ;
+            k = *kp++ ;
             v1 = v + vk + voff ;
             while (v1 < 0)  /* enforce spherical topology */
               v1 += V_DIM(mrisp_src) ;
             while (v1 >= V_DIM(mrisp_src))
               v1 -= V_DIM(mrisp_src) ;
-            ktotal += k ;
             total += k**IMAGEFseq_pix(Ip_src, u1, v1, fno) ;
           }
         }
-        if (u == DEBUG_U && v == DEBUG_V)
-          DiagBreak() ;
         total /= ktotal ;   /* normalize weights to 1 */
-        *IMAGEFseq_pix(mrisp_dst->Ip, u, v, fno) = total ;
+        *IMAGEFseq_pix(Ip_dst, u, v, fno) = total ;
       }
+      free(kernel) ;
     }
   }
 
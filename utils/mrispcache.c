@@ -0,0 +1,248 @@
+/**
+ * @file  mrispcache.c
+ * @brief on-disk memo of blurred atlas parameterizations
+ *
+ * MRISregister() blurs the mean and variance frames of the atlas
+ * parameterization at every sigma of every surface it aligns, for every
+ * subject, although the atlas (eg folding.atlas.acfb40.noaparc.i12.tif)
+ * and the sigmas are fixed. MRISPblurCached() returns what MRISPblur()
+ * would, and if a cache directory is set (MRISPsetCacheDir(), or
+ * FS_MRISP_CACHE_DIR) it stores the blurred frames there keyed by a hash
+ * of the unblurred frames, the sigma and the frame numbers, so only the
+ * first registration against an atlas pays for the blurring.
+ *
+ * A cache file holds a fixed header followed by the blurred frames as
+ * host-order floats. Files are written under a temporary name and
+ * renamed, so concurrent registrations sharing a directory never see a
+ * partial file; one with the other byte order, or that does not match
+ * the key in its header, is ignored and rewritten.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mrisurf.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+#include "utils.h"
+
+#define MRISP_CACHE_MAGIC       "FSMRISP"
+#define MRISP_CACHE_BYTE_ORDER  0x01020304
+#define MRISP_CACHE_VERSION     1
+#define MRISP_CACHE_EXTENSION   ".mrispc"
+
+typedef struct
+{
+  char               magic[8] ;
+  int                byte_order ;
+  int                version ;
+  int                cols, rows ;   // of each frame, as stored in the IMAGE
+  int                fno, nframes ; // frames fno..fno+nframes-1 follow
+  float              sigma ;
+  int                pad ;
+  unsigned long long key ;
+}
+MRISP_CACHE_HEADER ;
+
+static char *cache_dir = NULL ;
+static int  cache_dir_set = 0 ;
+
+/*---------------------------------------------------------------
+  MRISPsetCacheDir() - where MRISPblurCached() keeps blurred frames.
+  NULL goes back to $FS_MRISP_CACHE_DIR; "" turns the cache off.
+  ---------------------------------------------------------------*/
+int
+MRISPsetCacheDir(const char *dir)
+{
+  free(cache_dir) ;
+  cache_dir = dir ? strcpyalloc(dir) : NULL ;
+  cache_dir_set = (dir != NULL) ;
+  return(NO_ERROR) ;
+}
+
+static const char *
+mrispCacheDir(void)
+{
+  const char *dir ;
+
+  dir = cache_dir_set ? cache_dir : getenv("FS_MRISP_CACHE_DIR") ;
+  if (!dir || !*dir)
+  {
+    return(NULL) ;
+  }
+  return(dir) ;
+}
+
+static unsigned long long
+mrispHash(unsigned long long h, const void *buf, size_t nbytes)
+{
+  const unsigned char *cp = (const unsigned char *)buf ;
+
+  while (nbytes-- > 0)   // 64 bit FNV-1a
+  {
+    h ^= *cp++ ;
+    h *= 0x100000001b3ULL ;
+  }
+  return(h) ;
+}
+
+static unsigned long long
+mrispCacheKey(MRI_SP *mrisp, float sigma, int fno, int nframes)
+{
+  IMAGE              *Ip = mrisp->Ip ;
+  unsigned long long h = 0xcbf29ce484222325ULL ;
+  int                hdr[5] ;
+
+  hdr[0] = MRISP_CACHE_VERSION ;
+  hdr[1] = Ip->ocols ;
+  hdr[2] = Ip->orows ;
+  hdr[3] = fno ;
+  hdr[4] = nframes ;
+  h = mrispHash(h, hdr, sizeof(hdr)) ;
+  h = mrispHash(h, &sigma, sizeof(sigma)) ;
+  return(mrispHash(h, IMAGEFseq(Ip, fno),
+                   (size_t)nframes*Ip->ocols*Ip->orows*sizeof(float))) ;
+}
+
+static int
+mrispCacheRead(const char *fname, MRI_SP *mrisp, unsigned long long key,
+               float sigma, int fno, int nframes)
+{
+  MRISP_CACHE_HEADER hdr ;
+  IMAGE              *Ip = mrisp->Ip ;
+  size_t             n ;
+  FILE               *fp ;
+
+  fp = fopen(fname, "rb") ;
+  if (!fp)
+  {
+    return(ERROR_NOFILE) ;
+  }
+  n = (size_t)nframes*Ip->ocols*Ip->orows ;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, MRISP_CACHE_MAGIC, sizeof(hdr.magic)) ||
+      hdr.byte_order != MRISP_CACHE_BYTE_ORDER ||
+      hdr.version != MRISP_CACHE_VERSION || hdr.key != key ||
+      hdr.cols != Ip->ocols || hdr.rows != Ip->orows || hdr.fno != fno ||
+      hdr.nframes != nframes || hdr.sigma != sigma ||
+      fread(IMAGEFseq(Ip, fno), sizeof(float), n, fp) != n)
+  {
+    fclose(fp) ;
+    return(ERROR_BADFILE) ;
+  }
+  fclose(fp) ;
+  return(NO_ERROR) ;
+}
+
+static int
+mrispCacheWrite(const char *fname, MRI_SP *mrisp, unsigned long long key,
+                float sigma, int fno, int nframes)
+{
+  MRISP_CACHE_HEADER hdr ;
+  IMAGE              *Ip = mrisp->Ip ;
+  char               tmp_fname[STRLEN] ;
+  size_t             n ;
+  FILE               *fp ;
+  int                ok ;
+
+  sprintf(tmp_fname, "%s.%d", fname, (int)getpid()) ;
+  fp = fopen(tmp_fname, "wb") ;
+  if (!fp)
+    ErrorReturn(ERROR_NOFILE,
+                (ERROR_NOFILE, "MRISPblurCached: could not write %s",
+                 tmp_fname)) ;
+
+  memset(&hdr, 0, sizeof(hdr)) ;
+  strcpy(hdr.magic, MRISP_CACHE_MAGIC) ;
+  hdr.byte_order = MRISP_CACHE_BYTE_ORDER ;
+  hdr.version = MRISP_CACHE_VERSION ;
+  hdr.cols = Ip->ocols ;
+  hdr.rows = Ip->orows ;
+  hdr.fno = fno ;
+  hdr.nframes = nframes ;
+  hdr.sigma = sigma ;
+  hdr.key = key ;
+  n = (size_t)nframes*Ip->ocols*Ip->orows ;
+  ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+        fwrite(IMAGEFseq(Ip, fno), sizeof(float), n, fp) == n) ;
+  if (fclose(fp) != 0)
+  {
+    ok = 0 ;
+  }
+  if (!ok || rename(tmp_fname, fname) != 0)
+  {
+    unlink(tmp_fname) ;
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "MRISPblurCached: could not write %s",
+                 fname)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISPblurCached() - a copy of mrisp_src with frames
+  fno..fno+nframes-1 blurred by sigma, the same as MRISPblur(src,
+  NULL, sigma, fno) followed by MRISPblur(src, dst, sigma, f) for the
+  other frames. The blurred frames come from the cache directory if
+  they are there and are added to it if not.
+  ---------------------------------------------------------------*/
+MRI_SP *
+MRISPblurCached(MRI_SP *mrisp_src, float sigma, int fno, int nframes)
+{
+  MRI_SP             *mrisp_dst ;
+  const char         *dir ;
+  char               fname[STRLEN] ;
+  unsigned long long key = 0 ;
+  int                f ;
+
+  if (fno < 0 || nframes < 1 || fno+nframes > mrisp_src->Ip->num_frame)
+    ErrorReturn(NULL,
+                (ERROR_BADPARM,
+                 "MRISPblurCached: frames %d..%d out of range (%d frames)",
+                 fno, fno+nframes-1, mrisp_src->Ip->num_frame)) ;
+
+  mrisp_dst = MRISPclone(mrisp_src) ;
+  mrisp_dst->sigma = sigma ;
+  // NO_SPHERE changes what MRISPblur() computes, so it bypasses the cache
+  dir = getenv("NO_SPHERE") ? NULL : mrispCacheDir() ;
+  if (dir)
+  {
+    key = mrispCacheKey(mrisp_src, sigma, fno, nframes) ;
+    sprintf(fname, "%s/%016llx%s", dir, key, MRISP_CACHE_EXTENSION) ;
+    if (mrispCacheRead(fname, mrisp_dst, key, sigma, fno, nframes)
+        == NO_ERROR)
+    {
+      if (Gdiag & DIAG_SHOW)
+        printf("read blurred template (sigma=%2.2f) from %s\n",
+               sigma, fname) ;
+      return(mrisp_dst) ;
+    }
+  }
+
+  for (f = fno ; f < fno+nframes ; f++)
+  {
+    MRISPblur(mrisp_src, mrisp_dst, sigma, f) ;
+  }
+  if (dir)
+  {
+    if (mrispCacheWrite(fname, mrisp_dst, key, sigma, fno, nframes)
+        == NO_ERROR && (Gdiag & DIAG_SHOW))
+      printf("cached blurred template (sigma=%2.2f) in %s\n", sigma, fname) ;
+  }
+  return(mrisp_dst) ;
+}
@@ -269,7 +269,7 @@ static double mrisComputeSSE_MEF(MRI_SURFACE *mris,
                                  double weight30,
                                  double weight5,
                                  MHT *mht) ;
-static int mrisMarkIntersections(MRI_SURFACE *mris) ;
+static int mrisMarkIntersections(MRI_SURFACE *mris, MRIS_BVH *bvh) ;
 static int mrisAverageSignedGradients(MRI_SURFACE *mris, int num_avgs) ;
 #if 0
 static int mrisAverageWeightedGradients(MRI_SURFACE *mris, int num_avgs) ;
@@ -458,6 +458,10 @@ static double mrisComputeError(MRI_SURFACE *mris, INTEGRATION_PARMS *parms,
                                float *pcorr_rms);
 static int   mrisIntegrationEpoch(MRI_SURFACE *mris, INTEGRATION_PARMS *parms,
                                   int n_avgs);
+typedef struct MRIS_SSE_CACHE MRIS_SSE_CACHE ;
+static MRIS_SSE_CACHE *mrisSSECacheBegin(MRI_SURFACE *mris,
+                                         INTEGRATION_PARMS *parms) ;
+static void  mrisSSECacheEnd(MRIS_SSE_CACHE *old_cache) ;
 static int   mrisRemoveNegativeArea(MRI_SURFACE *mris,INTEGRATION_PARMS *parms,
                                     int n_avgs, float min_area_pct,
                                     int max_passes);
@@ -1956,6 +1960,7 @@ MRISfree(MRI_SURFACE **pmris)
   {
     CTABfree(&mris->ct) ;
   }
+  MRISfreeSoA(mris) ;
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
     if (mris->vertices[vno].f)
@@ -2265,6 +2270,27 @@ MRISsampleAtEachDistance(MRI_SURFACE *mris,int nbhd_size,int nbrs_per_distance)
 }
 
 
+/*-----------------------------------------------------
+  MRISsetGeodesicSampling() - if method is GEODESIC_DIJKSTRA or
+  GEODESIC_FAST_MARCH, MRISsampleDistances() still picks the long
+  range neighbors ring by ring but measures their dist_orig with the
+  geodesic engine instead of the corrected ring distances. < 0 goes
+  back to the ring distances (the default).
+  ------------------------------------------------------*/
+static int sample_geodesic = -1 ;
+
+int
+MRISsetGeodesicSampling(int method)
+{
+  if (method >= 0 && method != GEODESIC_DIJKSTRA &&
+      method != GEODESIC_FAST_MARCH)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISsetGeodesicSampling: unknown method %d",
+                 method)) ;
+  sample_geodesic = method ;
+  return(NO_ERROR) ;
+}
+
 /*-----------------------------------------------------
   Parameters:
 
@@ -2780,6 +2806,63 @@ MRISsampleDistances(MRI_SURFACE *mris, int *nbrs, int max_nbhd)
     total_nbrs += v->vtotal ;
   }
 
+  /*
+   replace the sampled distances with geodesic ones, running one query
+   per vertex that stops once all of its sampled neighbors are settled
+  */
+  if (sample_geodesic >= 0)
+  {
+    if (Gdiag & DIAG_HEARTBEAT)
+    {
+      fprintf(stdout, "measuring sampled distances on the surface\n") ;
+    }
+#ifdef HAVE_OPENMP
+    #pragma omp parallel
+#endif
+    {
+      MRIS_GEODESIC *geo = MRISgeodesicAlloc(mris, sample_geodesic) ;
+      int           vno, n, nfixed ;
+      VERTEX        *v ;
+
+#ifdef HAVE_OPENMP
+      #pragma omp for schedule(dynamic, 64)
+#endif
+      for (vno = 0 ; vno < mris->nvertices ; vno++)
+      {
+        v = &mris->vertices[vno] ;
+        if (v->ripflag)
+        {
+          continue ;
+        }
+        if (v->nsize == 3)
+        {
+          nfixed = v->v3num ;
+        }
+        else if (v->nsize == 2)
+        {
+          nfixed = v->v2num ;
+        }
+        else
+        {
+          nfixed = v->vnum ;
+        }
+        if (v->vtotal <= nfixed)
+        {
+          continue ;
+        }
+        // every target that can be reached is settled on return
+        MRISgeodesicRun(geo, mris, &vno, 1, 0, v->v+nfixed,
+                        v->vtotal-nfixed) ;
+        for (n = nfixed ; n < v->vtotal ; n++)
+          if (geo->dist[v->v[n]] < GEODESIC_UNREACHED)
+          {
+            v->dist_orig[n] = geo->dist[v->v[n]] ;
+          }
+      }
+      MRISgeodesicFree(&geo) ;
+    }
+  }
+
   /* now fill in immediate neighborhood(Euclidean) distances */
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
@@ -4775,6 +4858,34 @@ MRISreadCurvatureFile(MRI_SURFACE *mris, const char *sname)
   {
     strcpy(fname, sname) ;  /* path specified explicitly */
   }
+  if (MRISvpackOverlayName(fname, NULL, NULL))   /* column of a .vpack */
+  {
+    float *cvec ;
+
+    if (MRISreadCurvatureIntoArray(fname, mris->nvertices, &cvec) !=
+        NO_ERROR)
+    {
+      return(ERROR_BADFILE) ;
+    }
+    curvmin = curvmax = cvec[0] ;
+    for (k=0; k<mris->nvertices; k++)
+    {
+      curv = cvec[k] ;
+      if (curv>curvmax)
+      {
+        curvmax=curv;
+      }
+      if (curv<curvmin)
+      {
+        curvmin=curv;
+      }
+      mris->vertices[k].curv = curv;
+    }
+    free(cvec) ;
+    mris->max_curv = curvmax ;
+    mris->min_curv = curvmin ;
+    return(NO_ERROR) ;
+  }
   mritype = mri_identify(sname);
   if (mritype == GIFTI_FILE)
   {
@@ -4983,12 +5094,30 @@ MRISreadCurvatureIntoArray(const char *sname,
   int    k,i,vnum,fnum;
   float  *cvec ;
   FILE   *fp;
+  long long nbytes ;
 
   if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
   {
     fprintf(stdout, "reading curvature file...") ;
   }
 
+  if (MRISvpackOverlayName(sname, NULL, NULL))
+  {
+    if (MRISvpackReadOverlay(sname, NULL, MRIS_VPACK_FLOAT, (void **)&cvec,
+                             &nbytes) != NO_ERROR)
+      ErrorReturn(ERROR_BADFILE,
+                  (ERROR_BADFILE,
+                   "MRISreadCurvatureIntoArray(%s): no such float column",
+                   sname)) ;
+    if (nbytes != (long long)in_array_size*sizeof(float))
+    {
+      free(cvec) ;
+      return(ERROR_BADFILE);
+    }
+    *out_array = cvec;
+    return (ERROR_NONE);
+  }
+
   fp = fopen(sname,"r");
   if (fp==NULL)
     ErrorReturn(ERROR_BADFILE,
@@ -6737,11 +6866,9 @@ MRISregister(MRI_SURFACE *mris, MRI_SP *mrisp_template,
       mrisp = MRIStoParameterization(mris, NULL, 1, 0) ;
 #if 1
       parms->mrisp = MRISPblur(mrisp, NULL, sigma, 0) ;
-      parms->mrisp_template = MRISPblur(mrisp_template, NULL, sigma, ino) ;
-      MRISPblur(mrisp_template,
-                parms->mrisp_template,
-                sigma,
-                ino+1) ; /* variances */
+      /* means and variances - the atlas is the same for every subject, so
+         these come from the blur cache if one is set up */
+      parms->mrisp_template = MRISPblurCached(mrisp_template, sigma, ino, 2) ;
 #else
       dof = *IMAGEFseq_pix(mrisp_template->Ip, 0, 0, 2)  ;
       if (dof < 1)
@@ -8663,6 +8790,7 @@ MRISintegrate(MRI_SURFACE *mris, INTEGRATION_PARMS *parms, int n_averages)
   double  sse_thresh, pct_neg, pct_neg_area, total_vertices, tol;
   /*, scale, last_neg_area */ ;
   MHT     *mht_v_current = NULL ;
+  MRIS_SSE_CACHE *old_sse_cache ;
 
   if (Gdiag & DIAG_WRITE && parms->fp == NULL)
   {
@@ -8706,6 +8834,7 @@ MRISintegrate(MRI_SURFACE *mris, INTEGRATION_PARMS *parms, int n_averages)
 
   mrisProjectSurface(mris) ;
   MRIScomputeMetricProperties(mris) ;
+  old_sse_cache = mrisSSECacheBegin(mris, parms) ;
 
 #if AVERAGE_AREAS
   MRISreadTriangleProperties(mris, mris->fname) ;
@@ -8968,6 +9097,7 @@ MRISintegrate(MRI_SURFACE *mris, INTEGRATION_PARMS *parms, int n_averages)
   }
 
   parms->ending_sse = MRIScomputeSSE(mris, parms) ;
+  mrisSSECacheEnd(old_sse_cache) ;
   /*  mrisProjectSurface(mris) ;*/
 
   return(parms->t-parms->start_t) ;  /* return actual # of steps taken */
@@ -9639,6 +9769,416 @@ mrisComputeSSE_MEF(MRI_SURFACE *mris,
 
   return(sse) ;
 }
+
+/*-----------------------------------------------------
+  Fused evaluation of the local terms of MRIScomputeSSE().
+
+  The area, angle and nonlinear area terms are summed in one pass over
+  the faces, and the distance, spring, tangential spring and
+  correlation terms in one pass over the vertices, instead of one
+  pass per term. Faces and vertices are cut into fixed blocks of
+  MRIS_SSE_BLOCK elements; each block sums its elements in order and
+  the block sums are added in order, so the sse does not depend on
+  the number of threads (an omp reduction does).
+
+  The correlation error of a vertex only depends on its position and
+  curv (for a given template), and MRISintegrate() evaluates the sse
+  several times at the same positions (end of a step, logging, start
+  of the next line search) and at vertices whose gradient is zero. So
+  while an MRIS_SSE_CACHE is active (see mrisSSECacheBegin()) each
+  vertex keeps its last correlation error with the x, y, z and curv
+  it was computed at, and reuses it as long as they are unchanged.
+
+  setenv FS_MRIS_NO_FUSED_SSE to use the per-term code.
+  ------------------------------------------------------*/
+#define MRIS_SSE_BLOCK  1024
+
+enum { SSE_AREA, SSE_NEG_AREA, SSE_ANGLE, SSE_NLAREA, SSE_NFACE_TERMS } ;
+enum { SSE_DIST, SSE_SPRING, SSE_TSPRING, SSE_CORR, SSE_NVERTEX_TERMS } ;
+
+struct MRIS_SSE_CACHE
+{
+  MRI_SURFACE                  *mris ;
+  INTEGRATION_PARMS            *parms ;
+  MRI_SURFACE_PARAMETERIZATION *mrisp_template ;
+  int                          frame_no ;
+  float                        radius ;
+  int                          nvertices ;
+  float                        *x, *y, *z, *curv ;
+  double                       *delta ;
+  char                         *valid ;
+} ;
+
+static MRIS_SSE_CACHE *sse_cache = NULL ;
+#ifdef HAVE_OPENMP
+#pragma omp threadprivate(sse_cache)
+#endif
+
+/*
+  Starts caching correlation errors for mris/parms, returns the cache
+  that was active so mrisSSECacheEnd() can put it back (MRISintegrate
+  may be nested).
+*/
+static MRIS_SSE_CACHE *
+mrisSSECacheBegin(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
+{
+  MRIS_SSE_CACHE *old_cache = sse_cache, *cache ;
+
+  sse_cache = NULL ;
+  if (FZERO(parms->l_corr + parms->l_pcorr) || !parms->mrisp_template ||
+      getenv("FS_MRIS_NO_FUSED_SSE"))
+  {
+    return(old_cache) ;
+  }
+
+  cache = (MRIS_SSE_CACHE *)calloc(1, sizeof(MRIS_SSE_CACHE)) ;
+  cache->mris = mris ;
+  cache->parms = parms ;
+  cache->nvertices = mris->nvertices ;
+  cache->x = (float *)calloc(4*mris->nvertices, sizeof(float)) ;
+  cache->delta = (double *)calloc(mris->nvertices, sizeof(double)) ;
+  cache->valid = (char *)calloc(mris->nvertices, sizeof(char)) ;
+  if (!cache->x || !cache->delta || !cache->valid)
+    ErrorExit(ERROR_NOMEMORY,
+              "mrisSSECacheBegin: could not allocate %d vertex cache",
+              mris->nvertices) ;
+  cache->y = cache->x + mris->nvertices ;
+  cache->z = cache->y + mris->nvertices ;
+  cache->curv = cache->z + mris->nvertices ;
+  sse_cache = cache ;
+  return(old_cache) ;
+}
+
+static void
+mrisSSECacheEnd(MRIS_SSE_CACHE *old_cache)
+{
+  if (sse_cache)
+  {
+    free(sse_cache->x) ;
+    free(sse_cache->delta) ;
+    free(sse_cache->valid) ;
+    free(sse_cache) ;
+  }
+  sse_cache = old_cache ;
+}
+
+static void
+mrisSumSSEBlocks(const double *part, int nblocks, int nterms, double *sse)
+{
+  int b, t ;
+
+  for (t = 0 ; t < nterms ; t++)
+    sse[t] = 0.0 ;
+  for (b = 0 ; b < nblocks ; b++)
+    for (t = 0 ; t < nterms ; t++)
+      sse[t] += part[b*nterms+t] ;
+}
+
+/*
+  sse[SSE_AREA], [SSE_NEG_AREA] and [SSE_ANGLE] as computed in
+  MRIScomputeSSE() and sse[SSE_NLAREA] as mrisComputeNonlinearAreaSSE(),
+  each only if its weight is non-zero.
+*/
+static void
+mrisComputeFaceSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms,
+                   double area_scale, double *sse)
+{
+  double nl_area_scale, *part ;
+  int    nblocks, b, do_area, do_nlarea ;
+
+  do_area = !FZERO(parms->l_angle) || !FZERO(parms->l_area) ||
+            !FZERO(parms->l_parea) ;
+  do_nlarea = !FZERO(parms->l_nlarea) ;
+  memset(sse, 0, SSE_NFACE_TERMS*sizeof(double)) ;
+  if (!do_area && !do_nlarea)
+  {
+    return ;
+  }
+
+#if METRIC_SCALE
+  nl_area_scale = mris->patch ? 1.0 : mris->orig_area / mris->total_area ;
+#else
+  nl_area_scale = 1.0 ;
+#endif
+
+  nblocks = (mris->nfaces + MRIS_SSE_BLOCK - 1) / MRIS_SSE_BLOCK ;
+  part = (double *)calloc(nblocks*SSE_NFACE_TERMS+1, sizeof(double)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (b = 0 ; b < nblocks ; b++)
+  {
+    double *p = &part[b*SSE_NFACE_TERMS], delta, ratio, error ;
+    int    fno, ano, end ;
+
+    end = MIN(mris->nfaces, (b+1)*MRIS_SSE_BLOCK) ;
+    for (fno = b*MRIS_SSE_BLOCK ; fno < end ; fno++)
+    {
+      FACE *face = &mris->faces[fno] ;
+
+      if (face->ripflag)
+      {
+        continue ;
+      }
+      if (do_area)
+      {
+        delta = (double)(area_scale*face->area - face->orig_area) ;
+#if ONLY_NEG_AREA_TERM
+        if (face->area < 0.0f)
+        {
+          p[SSE_NEG_AREA] += delta*delta ;
+        }
+#endif
+        p[SSE_AREA] += delta*delta ;
+        for (ano = 0 ; ano < ANGLES_PER_TRIANGLE ; ano++)
+        {
+          delta = deltaAngle(face->angle[ano],face->orig_angle[ano]);
+#if ONLY_NEG_AREA_TERM
+          if (face->angle[ano] >= 0.0f)
+          {
+            delta = 0.0f ;
+          }
+#endif
+          p[SSE_ANGLE] += delta*delta ;
+        }
+        if (!isfinite(p[SSE_AREA]) || !isfinite(p[SSE_ANGLE]))
+        {
+          ErrorExit(ERROR_BADPARM, "sse not finite at face %d!\n",fno);
+        }
+      }
+      if (do_nlarea)
+      {
+        ratio = nl_area_scale*face->area ;
+        if (ratio > MAX_NEG_RATIO)
+        {
+          ratio = MAX_NEG_RATIO ;
+        }
+        else if (ratio < -MAX_NEG_RATIO)
+        {
+          ratio = -MAX_NEG_RATIO ;
+        }
+        error = (log(1.0+exp(NEG_AREA_K*ratio)) / NEG_AREA_K) - ratio ;
+        p[SSE_NLAREA] += error ;
+        if (!isfinite(p[SSE_NLAREA]) || !isfinite(error))
+        {
+          ErrorExit(ERROR_BADPARM, "nlin area sse not finite at face %d!\n",
+                    fno);
+        }
+      }
+    }
+  }
+  mrisSumSSEBlocks(part, nblocks, SSE_NFACE_TERMS, sse) ;
+  free(part) ;
+}
+
+/*
+  The correlation error of v against parms->mrisp_template, as in
+  mrisComputeCorrelationError() with use_stds set.
+*/
+static double
+mrisVertexCorrelationDelta(MRI_SURFACE *mris, INTEGRATION_PARMS *parms,
+                           VERTEX *v)
+{
+  double src, target, std ;
+
+  src = v->curv ;
+  target = MRISPfunctionVal(parms->mrisp_template, mris, v->x, v->y, v->z,
+                            parms->frame_no) ;
+  std = MRISPfunctionVal(parms->mrisp_template, mris, v->x, v->y, v->z,
+                         parms->frame_no+1) ;
+  std = sqrt(std) ;
+  if (FZERO(std))
+  {
+    std = 4.0f ;  // DEFAULT_STD
+  }
+  return((src - target) / std) ;
+}
+
+/*
+  sse[SSE_DIST], [SSE_SPRING], [SSE_TSPRING] and [SSE_CORR] as
+  mrisComputeDistanceError(), mrisComputeSpringEnergy(),
+  mrisComputeTangentialSpringEnergy() and mrisComputeCorrelationError()
+  (with stds), each only if its weight is non-zero.
+*/
+static void
+mrisComputeVertexSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms,
+                     double *sse)
+{
+  MRIS_SSE_CACHE *cache = NULL ;
+  double         dist_scale, area_scale, tarea_scale, *part ;
+  int            nblocks, b, do_dist, do_spring, do_tspring, do_corr ;
+  static int     first = 1 ;
+
+  do_dist = !DZERO(parms->l_dist) ;
+  do_spring = !DZERO(parms->l_spring) ;
+  do_tspring = !DZERO(parms->l_tspring) ;
+  do_corr = !FZERO(parms->l_corr + parms->l_pcorr) ;
+  memset(sse, 0, SSE_NVERTEX_TERMS*sizeof(double)) ;
+  if (!do_dist && !do_spring && !do_tspring && !do_corr)
+  {
+    return ;
+  }
+
+#if METRIC_SCALE
+  if (mris->patch)
+  {
+    dist_scale = area_scale = tarea_scale = 1.0 ;
+  }
+  else
+  {
+    if (mris->status == MRIS_PARAMETERIZED_SPHERE)
+      dist_scale = sqrt(mris->orig_area / mris->total_area) ;
+    else
+      dist_scale = mris->neg_area < mris->total_area ?
+                   sqrt(mris->orig_area / (mris->total_area-mris->neg_area)) :
+                   sqrt(mris->orig_area / mris->total_area) ;
+    area_scale = mris->orig_area / mris->total_area ;
+    tarea_scale = FZERO(mris->total_area) ? 1.0 :
+                  mris->orig_area / mris->total_area ;
+  }
+#else
+  dist_scale = area_scale = tarea_scale = 1.0 ;
+#endif
+
+  if (do_corr && sse_cache && sse_cache->mris == mris &&
+      sse_cache->parms == parms && sse_cache->nvertices == mris->nvertices)
+  {
+    cache = sse_cache ;
+    if (cache->mrisp_template != parms->mrisp_template ||
+        cache->frame_no != parms->frame_no || cache->radius != mris->radius)
+    {
+      memset(cache->valid, 0, mris->nvertices) ;
+      cache->mrisp_template = parms->mrisp_template ;
+      cache->frame_no = parms->frame_no ;
+      cache->radius = mris->radius ;
+    }
+  }
+
+  nblocks = (mris->nvertices + MRIS_SSE_BLOCK - 1) / MRIS_SSE_BLOCK ;
+  part = (double *)calloc(nblocks*SSE_NVERTEX_TERMS+1, sizeof(double)) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for (b = 0 ; b < nblocks ; b++)
+  {
+    double *p = &part[b*SSE_NVERTEX_TERMS], delta, v_sse ;
+    int    vno, n, end ;
+
+    end = MIN(mris->nvertices, (b+1)*MRIS_SSE_BLOCK) ;
+    for (vno = b*MRIS_SSE_BLOCK ; vno < end ; vno++)
+    {
+      VERTEX *v = &mris->vertices[vno], *vn ;
+
+      if (v->ripflag)
+      {
+        continue ;
+      }
+
+      if (do_dist
+#if NO_NEG_DISTANCE_TERM
+          && !v->neg
+#endif
+         )
+      {
+        for (v_sse = 0.0, n = 0 ; n < v->vtotal ; n++)
+        {
+          vn = &mris->vertices[v->v[n]] ;
+          if (vn->ripflag)
+          {
+            continue ;
+          }
+#if NO_NEG_DISTANCE_TERM
+          if (vn->neg)
+          {
+            continue ;
+          }
+#endif
+          if (v->dist_orig[n] >= UNFOUND_DIST)
+          {
+            continue ;
+          }
+          if (DZERO(v->dist_orig[n]) && first)
+          {
+            first = 0 ;
+            fprintf(stderr, "v[%d]->dist_orig[%d] = %f!!!!\n",
+                    vno, n, v->dist_orig[n]) ;
+            fflush(stderr);
+            DiagBreak() ;
+          }
+          delta = dist_scale*v->dist[n] - v->dist_orig[n] ;
+          if (parms->vsmoothness)
+            v_sse += (1.0-parms->vsmoothness[vno])*(delta*delta) ;
+          else
+            v_sse += delta*delta ;
+        }
+        if (parms->dist_error)
+        {
+          parms->dist_error[vno] = v_sse ;
+        }
+        p[SSE_DIST] += v_sse ;
+      }
+
+      if (do_spring)
+      {
+        for (v_sse = 0.0, n = 0 ; n < v->vnum ; n++)
+        {
+          v_sse += (v->dist[n]*v->dist[n]) ;
+        }
+        p[SSE_SPRING] += area_scale * v_sse ;
+      }
+
+      if (do_tspring)
+      {
+        float dx, dy, dz, nc, dist_sq ;
+
+        for (v_sse = 0.0, n = 0 ; n < v->vnum ; n++)
+        {
+          vn = &mris->vertices[v->v[n]] ;
+          dx = vn->x - v->x ;
+          dy = vn->y - v->y ;
+          dz = vn->z - v->z ;
+          nc = dx * v->nx + dy*v->ny + dz*v->nz ;
+          dx -= nc*v->nx ;
+          dy -= nc*v->ny ;
+          dz -= nc*v->nz ;
+          dist_sq = dx*dx+dy*dy+dz*dz ;
+          v_sse += dist_sq ;
+        }
+        p[SSE_TSPRING] += tarea_scale * v_sse ;
+      }
+
+      if (do_corr)
+      {
+        if (cache && cache->valid[vno] && cache->x[vno] == v->x &&
+            cache->y[vno] == v->y && cache->z[vno] == v->z &&
+            cache->curv[vno] == v->curv)
+        {
+          delta = cache->delta[vno] ;
+        }
+        else
+        {
+          delta = mrisVertexCorrelationDelta(mris, parms, v) ;
+          if (cache)
+          {
+            cache->x[vno] = v->x ;
+            cache->y[vno] = v->y ;
+            cache->z[vno] = v->z ;
+            cache->curv[vno] = v->curv ;
+            cache->delta[vno] = delta ;
+            cache->valid[vno] = 1 ;
+          }
+        }
+        if (parms->geometry_error)
+        {
+          parms->geometry_error[vno] = (delta*delta) ;
+        }
+        p[SSE_CORR] += parms->abs_norm ? fabs(delta) : delta*delta ;
+      }
+    }
+  }
+  mrisSumSSEBlocks(part, nblocks, SSE_NVERTEX_TERMS, sse) ;
+  free(part) ;
+}
 /*-----------------------------------------------------
   Parameters:
 
@@ -9660,9 +10200,10 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
     sse_repulse, sse_tsmooth, sse_loc, sse_thick_spring,
     sse_repulsive_ratio, sse_shrinkwrap, sse_expandwrap,
     sse_lap, sse_dura, sse_nlspring, sse_thick_normal, sse_histo, sse_map, sse_map2d ;
-  int     ano, fno ;
+  int     ano, fno, fused ;
   MHT     *mht_v_current = NULL ;
   MHT     *mht_f_current = NULL ;
+  double  face_sse[SSE_NFACE_TERMS], vertex_sse[SSE_NVERTEX_TERMS] ;
 
 
 #if METRIC_SCALE
@@ -9714,7 +10255,22 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
     mht_f_current = MHTfillTable(mris, mht_f_current);
   }
 
-  if (!FZERO(parms->l_angle)||!FZERO(parms->l_area)||(!FZERO(parms->l_parea)))
+  fused = (getenv("FS_MRIS_NO_FUSED_SSE") == NULL) ;
+  if (fused)
+  {
+    mrisComputeFaceSSE(mris, parms, area_scale, face_sse) ;
+    mrisComputeVertexSSE(mris, parms, vertex_sse) ;
+    sse_area = face_sse[SSE_AREA] ;
+    sse_neg_area = face_sse[SSE_NEG_AREA] ;
+    sse_angle = face_sse[SSE_ANGLE] ;
+    sse_nl_area = face_sse[SSE_NLAREA] ;
+    sse_dist = vertex_sse[SSE_DIST] ;
+    sse_spring = vertex_sse[SSE_SPRING] ;
+    sse_tspring = vertex_sse[SSE_TSPRING] ;
+    sse_corr = vertex_sse[SSE_CORR] ;
+  }
+  else if (!FZERO(parms->l_angle)||!FZERO(parms->l_area)||
+           (!FZERO(parms->l_parea)))
   {
 #ifdef HAVE_OPENMP
 #pragma omp parallel for reduction(+:sse_angle,sse_neg_area, sse_area)
@@ -9771,7 +10327,7 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
   if (parms->l_thick_min > 0 && DIAG_VERBOSE_ON)
     printf("min=%2.0f, parallel=%2.0f, normal=%2.0f, spring=%2.0f, ashburner=%2.0f\n", 
 	   sse_thick_min, sse_thick_parallel, sse_thick_normal, sse_thick_spring, sse_ashburner_triangle);
-  if (!FZERO(parms->l_nlarea))
+  if (!fused && !FZERO(parms->l_nlarea))
   {
     sse_nl_area = mrisComputeNonlinearAreaSSE(mris) ;
   }
@@ -9779,11 +10335,11 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
   {
     sse_nl_dist = mrisComputeNonlinearDistanceSSE(mris) ;
   }
-  if (!DZERO(parms->l_dist))
+  if (!fused && !DZERO(parms->l_dist))
   {
     sse_dist = mrisComputeDistanceError(mris, parms) ;
   }
-  if (!DZERO(parms->l_spring))
+  if (!fused && !DZERO(parms->l_spring))
   {
     sse_spring = mrisComputeSpringEnergy(mris) ;
   }
@@ -9791,7 +10347,7 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
   {
     sse_lap = mrisComputeLaplacianEnergy(mris) ;
   }
-  if (!DZERO(parms->l_tspring))
+  if (!fused && !DZERO(parms->l_tspring))
   {
     sse_tspring = mrisComputeTangentialSpringEnergy(mris) ;
   }
@@ -9804,7 +10360,7 @@ MRIScomputeSSE(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
     sse_curv = mrisComputeQuadraticCurvatureSSE(mris, parms->l_curv) ;
   }
   l_corr = (double)(parms->l_corr + parms->l_pcorr) ;
-  if (!DZERO(l_corr))
+  if (!fused && !DZERO(l_corr))
   {
     sse_corr = mrisComputeCorrelationError(mris, parms, 1) ;
   }
@@ -10707,7 +11263,11 @@ int MRISaverageGradients(MRI_SURFACE *mris, int num_avgs)
     MRISPfree(&mrisp) ;
     MRISPfree(&mrisp_blur) ;
   }
-  else 
+  else if (mris->soa)  // same averages, done in the SoA mirror
+  {
+    MRISsoaAverageGradients(mris, num_avgs) ;
+  }
+  else
     for (i = 0 ; i < num_avgs ; i++)
     {
 #ifdef HAVE_OPENMP
@@ -13929,64 +14489,82 @@ MRISreadAnnotation(MRI_SURFACE *mris, const char *sname)
   char  histfname[STRLEN], freqfname[STRLEN];
 #endif
 
-  // first attempt to read as gifti file
-  int mritype = mri_identify(sname);
-  if (mritype == GIFTI_FILE)
+  // a column of a .vpack named explicitly (<pack>.vpack:<name>), without
+  // a path the pack is next to the surface, as for the overlay readers
+  if (strstr(sname, MRIS_VPACK_EXTENSION ":"))
   {
-    mris = mrisReadGIFTIfile(sname, mris);
-    if (mris)
+    if (strchr(sname, '/'))
     {
-      return (NO_ERROR);
+      strcpy(fname, sname) ;
     }
     else
     {
-      return (ERROR_BADFILE);
+      FileNamePath(mris->fname, path) ;
+      sprintf(fname, "%s/%s", path, sname) ;
     }
   }
-  // else fall-thru with default .annot processing...
-
-  cp = strchr(sname, '/') ;
-  if (!cp)                 /* no path - use same one as mris was read from */
+  else
   {
-    FileNameOnly(sname, fname_no_path) ;
-    cp = strstr(fname_no_path, ".annot") ;
-    if (!cp)
+    // first attempt to read as gifti file
+    int mritype = mri_identify(sname);
+    if (mritype == GIFTI_FILE)
     {
-      strcat(fname_no_path, ".annot") ;
+      mris = mrisReadGIFTIfile(sname, mris);
+      if (mris)
+      {
+        return (NO_ERROR);
+      }
+      else
+      {
+        return (ERROR_BADFILE);
+      }
     }
+    // else fall-thru with default .annot processing...
 
-    need_hemi =
-      stricmp
-      (fname_no_path, mris->hemisphere == LEFT_HEMISPHERE ? "lh" : "rh") ;
-
-    FileNamePath(mris->fname, path) ;
-    if (!need_hemi)
+    cp = strchr(sname, '/') ;
+    if (!cp)                 /* no path - use same one as mris was read from */
     {
-      sprintf(fname, "%s/../label/%s", path, fname_no_path) ;
+      FileNameOnly(sname, fname_no_path) ;
+      cp = strstr(fname_no_path, ".annot") ;
+      if (!cp)
+      {
+        strcat(fname_no_path, ".annot") ;
+      }
+
+      need_hemi =
+        stricmp
+        (fname_no_path, mris->hemisphere == LEFT_HEMISPHERE ? "lh" : "rh") ;
+
+      FileNamePath(mris->fname, path) ;
+      if (!need_hemi)
+      {
+        sprintf(fname, "%s/../label/%s", path, fname_no_path) ;
+      }
+      else   /* no hemisphere specified */
+        sprintf
+        (fname, "%s/../label/%s.%s", path,
+         mris->hemisphere == LEFT_HEMISPHERE ? "lh" : "rh",fname_no_path);
     }
-    else   /* no hemisphere specified */
-      sprintf
-      (fname, "%s/../label/%s.%s", path,
-       mris->hemisphere == LEFT_HEMISPHERE ? "lh" : "rh",fname_no_path);
-  }
-  else
-  {
-    strcpy(fname, sname) ;  /* full path specified */
-    cp = strstr(fname, ".annot") ;
-    if (!cp)
+    else
     {
-      strcat(fname, ".annot") ;
+      strcpy(fname, sname) ;  /* full path specified */
+      cp = strstr(fname, ".annot") ;
+      if (!cp)
+      {
+        strcat(fname, ".annot") ;
+      }
     }
-  }
 
-  // As a last resort, just assume the sname is the path
-  if(! fio_FileExistsReadable(fname) && fio_FileExistsReadable(sname))
-  {
-    sprintf(fname,"%s",sname);
+    // As a last resort, just assume the sname is the path
+    if(! fio_FileExistsReadable(fname) && fio_FileExistsReadable(sname))
+    {
+      sprintf(fname,"%s",sname);
+    }
   }
 
-
-  /* Try to read it into an array. */
+  /* Try to read it into an array. A file that does not exist is read
+     from the column of the same name in the hemisphere's .vpack, if
+     there is one (see MRISvpackOverlayName()). */
   return_code = MRISreadAnnotationIntoArray (fname, mris->nvertices, &array);
   if (NO_ERROR != return_code)
   {
@@ -14110,6 +14688,7 @@ MRISreadAnnotationIntoArray(const char* fname,
   int   i,j,vno,num;
   FILE  *fp;
   int* array = NULL;
+  long long nbytes ;
 
   if (fname == NULL || out_array == NULL)
     ErrorReturn( ERROR_BADPARM,
@@ -14118,6 +14697,24 @@ MRISreadAnnotationIntoArray(const char* fname,
     ErrorReturn( ERROR_BADPARM,
                  (ERROR_BADPARM, "in_array_size was negative.") );
 
+  /* A .vpack column holds one annotation value per vertex. */
+  if (MRISvpackOverlayName(fname, NULL, NULL))
+  {
+    if (MRISvpackReadOverlay(fname, NULL, MRIS_VPACK_INT, (void **)&array,
+                             &nbytes) != NO_ERROR)
+      ErrorReturn(ERROR_NOFILE, (ERROR_NOFILE, "could not read annot %s",
+                                 fname)) ;
+    if (nbytes != (long long)in_array_size*sizeof(int))
+    {
+      free(array) ;
+      ErrorReturn(ERROR_BADFILE,
+                  (ERROR_BADFILE, "annot %s has %lld vertices, expected %d",
+                   fname, nbytes/(long long)sizeof(int), in_array_size)) ;
+    }
+    *out_array = array;
+    return(NO_ERROR) ;
+  }
+
   /* Initialize our array. Note that we do it to the size that we got
      passed in, which might be different than the number of values in
      the file. */
@@ -14201,19 +14798,42 @@ int MRISreadCTABFromAnnotationIfPresent(const char *fname,
   FILE  *fp;
   COLOR_TABLE* ctab = NULL;
   int tag;
+  void *tags = NULL;
+  long long nbytes ;
 
   if (fname == NULL || out_table == NULL)
     ErrorReturn( ERROR_BADPARM,
                  (ERROR_BADPARM, "Parameter was NULL.") );
 
-  /* Open the file. */
-  fp = fopen(fname,"r");
+  if (MRISvpackOverlayName(fname, NULL, NULL))
+  {
+    /* A .vpack keeps the tag section of the annotation as a separate
+       column; read the same tags from it in memory. */
+    if (MRISvpackReadOverlay(fname, ".ctab", MRIS_VPACK_BYTES, &tags,
+                             &nbytes) != NO_ERROR || nbytes == 0)
+    {
+      free(tags) ;
+      return ERROR_NONE;
+    }
+    fp = fmemopen(tags, nbytes, "r");
+    num = 0;
+  }
+  else
+  {
+    /* Open the file. */
+    fp = fopen(fname,"r");
+    if (fp != NULL)
+    {
+      /* First int is the number of elements. */
+      num = freadInt(fp) ;
+    }
+  }
   if (fp==NULL)
+  {
+    free(tags) ;
     ErrorReturn(ERROR_NOFILE, (ERROR_NOFILE, "could not read annot file %s",
                                fname)) ;
-
-  /* First int is the number of elements. */
-  num = freadInt(fp) ;
+  }
 
   /* Skip two ints per num, to the end of the values section, where
      the tags are. */
@@ -14232,6 +14852,7 @@ int MRISreadCTABFromAnnotationIfPresent(const char *fname,
   if (feof(fp))
   {
     fclose (fp);
+    free(tags) ;
     return ERROR_NONE;
   }
 
@@ -14247,6 +14868,7 @@ int MRISreadCTABFromAnnotationIfPresent(const char *fname,
   }
 
   fclose (fp);
+  free(tags) ;
 
   /* Return the table if we got one. */
   if( NULL != ctab )
@@ -14281,6 +14903,19 @@ int MRISisCTABPresentInAnnotation(const char *fname, int* present)
     ErrorReturn( ERROR_BADPARM,
                  (ERROR_BADPARM, "Parameter was NULL.") );
 
+  if (MRISvpackOverlayName(fname, NULL, NULL))
+  {
+    COLOR_TABLE *ctab = NULL ;
+
+    MRISreadCTABFromAnnotationIfPresent(fname, &ctab) ;
+    *present = (ctab != NULL) ;
+    if (ctab)
+    {
+      CTABfree(&ctab) ;
+    }
+    return ERROR_NONE;
+  }
+
   /* Open the file. */
   fp = fopen(fname,"r");
   if (fp==NULL)
@@ -14464,6 +15099,12 @@ MRISreadValuesIntoArray(const char* sname,
     ErrorReturn( ERROR_BADPARM,
                  (ERROR_BADPARM, "in_array_size was negative.") );
 
+  /* A column of a .vpack is stored as a float curvature */
+  if (MRISvpackOverlayName(sname, NULL, NULL))
+  {
+    return(MRISreadCurvatureIntoArray(sname, in_array_size, out_array)) ;
+  }
+
   /* First try to load it as a volume */
   strncpy( fname, sname, sizeof(fname) );
   type = mri_identify(fname);
@@ -18592,7 +19233,7 @@ MRISaverageCanonicalRadius(MRI_SURFACE *mris)
 int
 MRISinflateBrain(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
 {
-  int     n_averages, n, write_iterations, niterations ;
+  int     n_averages, n, write_iterations, niterations, own_soa = 0 ;
   double  delta_t = 0.0, rms_height, desired_rms_height, sse, l_dist ;
 
   write_iterations = parms->write_iterations ;
@@ -18601,6 +19242,11 @@ MRISinflateBrain(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
   {
     MRISremoveTriangleLinks(mris) ;
   }
+  if (!mris->soa && getenv("FS_MRIS_NO_SOA") == NULL)
+  {
+    MRISallocSoA(mris) ;  // SoA mirror for the neighborhood kernels
+    own_soa = 1 ;
+  }
   if (Gdiag & DIAG_WRITE)
   {
     char fname[STRLEN] ;
@@ -18758,6 +19404,10 @@ MRISinflateBrain(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
     fclose(parms->fp) ;
     parms->fp = NULL ;
   }
+  if (own_soa)
+  {
+    MRISfreeSoA(mris) ;
+  }
 
   return(NO_ERROR) ;
 }
@@ -19907,47 +20557,107 @@ static float kernel[] =
 int
 MRISsmoothCurvatures(MRI_SURFACE *mris, int niterations)
 {
-  int     vno, i, vn ;
-  double  g, H, norm ;
-  VERTEX  *vertex ;
+  int      vno, vn, nnz, i ;
+  VERTEX   *vertex ;
+  MRIS_CSR *csr ;
+  float    *H, *tmp, *swap ;
+
+  if (niterations <= 0)
+  {
+    return(NO_ERROR) ;
+  }
+
+  /* one weighted row per vertex: kernel[0] for itself, kernel[1] for
+     the 1-ring and kernel[2] for the rest of the 2-ring, normalized.
+     Ripped vertices keep their value. */
+  for (nnz = vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    vertex = &mris->vertices[vno] ;
+    nnz += vertex->ripflag ? 1 : 1 + MAX(vertex->vnum, vertex->v2num) ;
+  }
+  csr = MRIScsrAlloc(mris->nvertices, mris->nvertices, nnz, 1) ;
+  csr->den = (double *)calloc(mris->nvertices, sizeof(double)) ;
+  if (!csr->den)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISsmoothCurvatures: could not allocate %d normalizers",
+              mris->nvertices) ;
+  for (nnz = vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    vertex = &mris->vertices[vno] ;
+    csr->row_start[vno] = nnz ;
+    csr->col[nnz] = vno ;
+    if (vertex->ripflag)
+    {
+      csr->w[nnz++] = 1.0f ;
+      csr->den[vno] = 1.0 ;
+      continue ;
+    }
+    csr->w[nnz++] = kernel[0] ;
+    for (vn = 0 ; vn < vertex->vnum ; vn++)
+    {
+      csr->col[nnz] = vertex->v[vn] ;
+      csr->w[nnz++] = kernel[1] ;
+    }
+    for ( ; vn < vertex->v2num ; vn++)
+    {
+      csr->col[nnz] = vertex->v[vn] ;
+      csr->w[nnz++] = kernel[2] ;
+    }
+    csr->den[vno] =
+      kernel[0] +
+      vertex->vnum*kernel[1] +
+      (vertex->v2num-vertex->vnum) * kernel[2] ;
+  }
+  csr->row_start[mris->nvertices] = nnz ;
+
+  H = (float *)calloc(mris->nvertices, sizeof(float)) ;
+  tmp = (float *)calloc(mris->nvertices, sizeof(float)) ;
+  if (!H || !tmp)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISsmoothCurvatures: could not allocate %d curvatures",
+              mris->nvertices) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    H[vno] = mris->vertices[vno].H ;
+  }
 
+  /* same arithmetic as the VERTEX loop this replaces: the self term is
+     a float product, the neighbors are summed in double in v[] order
+     and the normalizer is the float kernel sum, so H is unchanged. */
   for (i = 0 ; i < niterations ; i++)
   {
+#ifdef HAVE_OPENMP
+#pragma omp parallel for
+#endif
     for (vno = 0 ; vno < mris->nvertices ; vno++)
     {
-      vertex = &mris->vertices[vno] ;
-      if (vertex->ripflag)
-      {
-        continue ;
-      }
-      H = kernel[0]*vertex->H ;
-      g = kernel[1] ;
-      for (vn = 0 ; vn < vertex->vnum ; vn++)
-      {
-        H += g * mris->vertices[vertex->v[vn]].H ;
-      }
-      g = kernel[2] ;
-      for ( ; vn < vertex->v2num ; vn++)
+      int    j, start = csr->row_start[vno], end = csr->row_start[vno+1] ;
+      double h ;
+
+      h = csr->w[start] * H[csr->col[start]] ;
+      for (j = start+1 ; j < end ; j++)
       {
-        H += g * mris->vertices[vertex->v[vn]].H ;
+        h += (double)csr->w[j] * H[csr->col[j]] ;
       }
-      norm =
-        kernel[0] +
-        vertex->vnum*kernel[1] +
-        (vertex->v2num-vertex->vnum) * kernel[2] ;
-      vertex->d = H/norm ;
+      tmp[vno] = h / csr->den[vno] ;
     }
-    for (vno = 0 ; vno < mris->nvertices ; vno++)
+    swap = H ;
+    H = tmp ;
+    tmp = swap ;
+  }
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    vertex = &mris->vertices[vno] ;
+    if (vertex->ripflag)
     {
-      vertex = &mris->vertices[vno] ;
-      if (vertex->ripflag)
-      {
-        continue ;
-      }
-      vertex->H = vertex->d ;
+      continue ;
     }
+    vertex->H = vertex->d = H[vno] ;
   }
 
+  free(H) ;
+  free(tmp) ;
+  MRIScsrFree(&csr) ;
   return(NO_ERROR) ;
 }
 
@@ -22066,6 +22776,10 @@ mrisComputeSpringTerm(MRI_SURFACE *mris, double l_spring)
 #else
   dist_scale = 1.0 ;
 #endif
+  if (mris->soa)
+  {
+    return(MRISsoaSpringTerm(mris, l_spring, dist_scale)) ;
+  }
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
     v = &mris->vertices[vno] ;
@@ -27340,10 +28054,22 @@ MRISreadVertexPositions(MRI_SURFACE *mris, const char *name)
 int
 MRIScomputeMetricProperties(MRI_SURFACE *mris)
 {
-  MRIScomputeNormals(mris);
-  mrisComputeVertexDistances(mris);
-  mrisComputeSurfaceDimensions(mris);
-  MRIScomputeTriangleProperties(mris);  /* compute areas and normals */
+  // with an SoA mirror attached the normals, distances and face geometry
+  // come from the flat kernel in mrisurfsoa.c, unless it finds a
+  // degenerate normal (setenv FS_MRIS_NO_SOA_METRIC to always skip it)
+  if (mris->soa && getenv("FS_MRIS_NO_SOA_METRIC") == NULL &&
+      MRISsoaComputeMetricProperties(mris, mris->soa->metric_incremental)
+      == NO_ERROR)
+  {
+    mrisComputeSurfaceDimensions(mris);
+  }
+  else
+  {
+    MRIScomputeNormals(mris);
+    mrisComputeVertexDistances(mris);
+    mrisComputeSurfaceDimensions(mris);
+    MRIScomputeTriangleProperties(mris);  /* compute areas and normals */
+  }
   mris->avg_vertex_area = mris->total_area/mris->nvertices;
   mris->avg_vertex_dist = MRISavgInterVertexDist(mris, &mris->std_vertex_dist);
   mrisOrientSurface(mris);
@@ -30119,11 +30845,9 @@ mrisComputeVectorCorrelationError(MRI_SURFACE *mris,
 static int
 mrisComputeCorrelationTerm(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
 {
-  double   du, dv, up1, um1, vp1, vm1, delta, src, target, mag, max_mag,l_corr;
+  double   mag, max_mag, l_corr;
   VERTEX   *v ;
   int      vno, fno ;
-  float    x, y, z, e1x, e1y, e1z, e2x, e2y, e2z, ux, uy, uz, vx, vy, vz,
-           std, coef, vsmooth = 1.0 ;
 
   l_corr = parms->l_corr ;
   if (FZERO(l_corr))
@@ -30132,14 +30856,22 @@ mrisComputeCorrelationTerm(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
   }
   fno = parms->frame_no ;
   mrisComputeTangentPlanes(mris) ;
-  max_mag = 0.0f ;
   if (Gdiag & DIAG_WRITE && DIAG_VERBOSE_ON)
   {
     MRISPwrite(parms->mrisp_template, "temp.hipl") ;
     MRISPwrite(parms->mrisp, "srf.hipl") ;
   }
+  // each vertex only samples the template and writes its own gradient
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
   for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
+    VERTEX   *v ;
+    double   du, dv, up1, um1, vp1, vm1, delta, src, target ;
+    float    x, y, z, e1x, e1y, e1z, e2x, e2y, e2z, ux, uy, uz, vx, vy, vz,
+             std, coef, vsmooth = 1.0 ;
+
     v = &mris->vertices[vno] ;
     if (v->ripflag)
     {
@@ -30215,11 +30947,6 @@ mrisComputeCorrelationTerm(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
     v->dy -= coef * (du*e1y + dv*e2y) ;
     v->dz -= coef * (du*e1z + dv*e2z) ;
 
-    mag = sqrt(v->dx*v->dx + v->dy*v->dy + v->dz*v->dz) ;
-    if (mag > max_mag)
-    {
-      max_mag = mag ;
-    }
     if (!isfinite(v->dx) || !isfinite(v->dy) || !isfinite(v->dz))
     {
       DiagBreak() ;
@@ -30234,6 +30961,19 @@ mrisComputeCorrelationTerm(MRI_SURFACE *mris, INTEGRATION_PARMS *parms)
 
   if (Gdiag & DIAG_SHOW && DIAG_VERBOSE_ON)
   {
+    for (max_mag = 0.0, vno = 0 ; vno < mris->nvertices ; vno++)
+    {
+      v = &mris->vertices[vno] ;
+      if (v->ripflag)
+      {
+        continue ;
+      }
+      mag = sqrt(v->dx*v->dx + v->dy*v->dy + v->dz*v->dz) ;
+      if (mag > max_mag)
+      {
+        max_mag = mag ;
+      }
+    }
     fprintf(stdout, "max gradient magnitude = %2.5f\n", max_mag) ;
   }
 
@@ -34307,6 +35047,7 @@ MRISpositionSurface(MRI_SURFACE *mris, MRI *mri_brain, MRI *mri_smooth,
 {
   /*  char   *cp ;*/
   int    avgs, niterations, n, write_iterations, nreductions = 0, done ;
+  int    own_soa = 0 ;
   double sse, delta_t = 0.0, rms, dt,
               l_intensity, base_dt, last_sse,last_rms, max_mm;
   MHT    *mht = NULL, *mht_v_orig = NULL, *mht_v_current = NULL,
@@ -34331,6 +35072,12 @@ MRISpositionSurface(MRI_SURFACE *mris, MRI *mri_brain, MRI *mri_smooth,
   {
     MRISremoveTriangleLinks(mris) ;
   }
+  if (!mris->soa && getenv("FS_MRIS_NO_SOA") == NULL)
+  {
+    MRISallocSoA(mris) ;  // SoA mirror for the neighborhood kernels
+    mris->soa->metric_incremental = 1 ;  // only moved vertices need metrics
+    own_soa = 1 ;
+  }
   TimerStart(&then) ;
   parms->mri_brain = mri_brain ;
   parms->mri_smooth = mri_smooth ;
@@ -34779,6 +35526,10 @@ MRISpositionSurface(MRI_SURFACE *mris, MRI *mri_brain, MRI *mri_smooth,
   {
     MHTfree(&mht_v_orig) ;
   }
+  if (own_soa)
+  {
+    MRISfreeSoA(mris) ;
+  }
   return(NO_ERROR) ;
 }
 
@@ -47340,6 +48091,23 @@ typedef struct
 }
 RANDOM_PATCH, RP ;
 
+/* what the threads evaluating the patches of one defect work on */
+typedef struct
+{
+  int                 nworkers ;
+  DEFECT_VERTEX_STATE *dvs ;
+  MRI_SURFACE         **mris ;   /* [0] is mris_corrected itself, the
+                                    others are private copies of it */
+  EDGE_TABLE          *etables ; /* private used flags */
+  MRI                 **mri_defect_sign ;
+  VERTEX              *vertices ; /* dvs vertices before the batch */
+  int                 nfaces ;
+  int                 *fno ;
+  FACE                *faces ;   /* and the original faces around them */
+  float               *vertex_fitness ; /* one row per patch of a batch */
+}
+PATCH_EVALUATOR, PE ;
+
 typedef struct
 {
   float c_x,c_y,c_z; /* canonical coordinates */
@@ -47590,13 +48358,14 @@ static void computeDefectSecondFundamentalForm(MRIS *mris,TP *tp);
 //static void computeDefectMetricProperties(MRIS *mris,TP * tp);
 static void printDefectStatistics(DP *dp);
 static void computeDisplacement(MRI_SURFACE *mris,DP *dp);
-static void updateVertexStatistics(MRIS *mris,
-                                   MRIS* mris_corrected,
-                                   DVS *dvs,
-                                   RP *rp,
-                                   DP *dp,
-                                   int *vertex_trans,
-                                   float fitness);
+static void computeVertexStatistics(MRIS* mris_corrected,
+                                    DP *dp,
+                                    int *vertex_trans,
+                                    float fitness,
+                                    float *vertex_fitness);
+static void accumulateVertexStatistics(RP *rp,
+                                       DEFECT *defect,
+                                       float *vertex_fitness);
 static int deleteWorstVertices(MRIS *mris,
                                RP *rp,
                                DEFECT *defect,
@@ -47619,6 +48388,23 @@ static double mrisDefectPatchFitness(MRI_SURFACE *mris,
                                      MRI *mri_gray_white,
                                      HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms
                                     ) ;
+static void mrisEvaluateDefectPatch(MRI_SURFACE *mris,
+                                    MRI_SURFACE *mris_corrected,
+                                    MRI *mri,
+                                    DEFECT_PATCH *dp,
+                                    int *vertex_trans,
+                                    DEFECT_VERTEX_STATE *dvs,
+                                    float *vertex_fitness,
+                                    HISTOGRAM *h_k1,
+                                    HISTOGRAM *h_k2,
+                                    MRI *mri_k1_k2,
+                                    HISTOGRAM *h_white,
+                                    HISTOGRAM *h_gray,
+                                    HISTOGRAM *h_border,
+                                    HISTOGRAM *h_grad,
+                                    MRI *mri_gray_white,
+                                    HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms
+                                   ) ;
 static double mrisComputeDefectLogLikelihood
 (MRI_SURFACE *mris,
  MRI *mri, DEFECT_PATCH *dp,HISTOGRAM *h_k1,HISTOGRAM *h_k2,
@@ -47654,6 +48440,20 @@ static int    mrisMutateDefectPatch
 static int    mrisCrossoverDefectPatches
 (DEFECT_PATCH *dp1, DEFECT_PATCH *dp2,
  DEFECT_PATCH *dp_dst, EDGE_TABLE *etable) ;
+static PE   *PEalloc(MRI_SURFACE *mris, DEFECT_VERTEX_STATE *dvs,
+                     EDGE_TABLE *etable, MRI *mri_defect_sign,
+                     int max_patches) ;
+static void PEfree(PE **ppe) ;
+static void PEsnapshot(PE *pe) ;
+static void PEsync(PE *pe, int w) ;
+static void mrisDefectPatchesFitness
+(PE *pe, DEFECT_PATCH **dps, int npatches,
+ MRI_SURFACE *mris, MRI *mri, int *vertex_trans,
+ DEFECT_VERTEX_STATE *dvs, RP *rp,
+ HISTOGRAM *h_k1, HISTOGRAM *h_k2, MRI *mri_k1_k2,
+ HISTOGRAM *h_white, HISTOGRAM *h_gray,
+ HISTOGRAM *h_border, HISTOGRAM *h_grad,
+ MRI *mri_gray_white, HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms) ;
 static int defectPatchRank(DEFECT_PATCH *dps, int index, int npatches) ;
 static int mrisCopyDefectPatch(DEFECT_PATCH *dp_src, DEFECT_PATCH *dp_dst) ;
 static int    mrisComputeOptimalRetessellation
@@ -48911,7 +49711,16 @@ void MRISprintInfo(TOPOFIX_PARMS *parms)
 int IsMRISselfIntersecting(MRI_SURFACE *mris)
 {
   MRIS_HASH_TABLE  *mht ;
-  int fno ;
+  MRIS_BVH *bvh ;
+  int fno, num ;
+
+  if (getenv("FS_MRIS_NO_BVH") == NULL)
+  {
+    bvh = MRISbvhBuild(mris, CURRENT_VERTICES) ;
+    num = MRISbvhIntersectingFaces(bvh, mris, NULL) ;
+    MRISbvhFree(&bvh) ;
+    return(num > 0) ;
+  }
 
   mht = MHTfillTable(mris, NULL) ;
 
@@ -50248,26 +51057,22 @@ static void savePatch(MRI *mri,
   TPfree(&dp->tp);
 }
 
-static void updateVertexStatistics(MRIS *mris,
-                                   MRIS* mris_corrected,
-                                   DVS *dvs,
-                                   RP *rp,
-                                   DP *dp,
-                                   int *vertex_trans,
-                                   float fitness)
+/* computes the share of the fitness of the patch that goes to each
+   defect vertex used in the retessellation (-1 for the others) and
+   resets the marks. The shares are added to the statistics separately by
+   accumulateVertexStatistics so that patches evaluated concurrently
+   update them in a fixed order */
+static void computeVertexStatistics(MRIS* mris_corrected,
+                                    DP *dp,
+                                    int *vertex_trans,
+                                    float fitness,
+                                    float *vertex_fitness)
 {
   DEFECT *defect;
   EDGE_TABLE *etable;
   int i,nedges;
-  float total_vertex_fitness=0.f,new_fitness;
+  float total_vertex_fitness=0.f;
   VERTEX *v;
-  static int first_time=1;
-
-  //TO UPDATE TO BE CHECKED
-  if (first_time)
-  {
-    first_time=0;
-  };
 
   fitness = 1.0f; //to be updated ...
 
@@ -50313,9 +51118,10 @@ static void updateVertexStatistics(MRIS *mris,
   total_vertex_fitness/=100.0f;
   total_vertex_fitness=1.0f; //TO BE CHECKED
 
-  /* finally update statistics and reset marks to zero */
+  /* finally record the shares and reset marks to zero */
   for (i = 0 ; i < defect->nvertices ; i++)
   {
+    vertex_fitness[i]=-1.0f;
     if (defect->status[i]==DISCARD_VERTEX)
     {
       continue;
@@ -50323,15 +51129,34 @@ static void updateVertexStatistics(MRIS *mris,
     v = &mris_corrected->vertices[vertex_trans[defect->vertices[i]]];
     if (v->marked==FINAL_VERTEX)
     {
-      new_fitness=(v->curvbak*fitness/total_vertex_fitness) +
-                  (float)rp->nused[i]*rp->vertex_fitness[i];
-      rp->vertex_fitness[i]=new_fitness/((float)rp->nused[i]+1.0f);
-      rp->nused[i]++;
+      /* curvbak is a displacement, so a used vertex never gets a
+         negative share */
+      vertex_fitness[i]=v->curvbak*fitness/total_vertex_fitness;
     }
     v->marked=0;
   }
 }
 
+static void accumulateVertexStatistics(RP *rp,
+                                       DEFECT *defect,
+                                       float *vertex_fitness)
+{
+  int i;
+  float new_fitness;
+
+  for (i = 0 ; i < defect->nvertices ; i++)
+  {
+    if (vertex_fitness[i] < 0)
+    {
+      continue;  /* discarded or not used in this patch */
+    }
+    new_fitness=vertex_fitness[i] +
+                (float)rp->nused[i]*rp->vertex_fitness[i];
+    rp->vertex_fitness[i]=new_fitness/((float)rp->nused[i]+1.0f);
+    rp->nused[i]++;
+  }
+}
+
 static int deleteWorstVertices(MRIS *mris,
                                RP *rp,
                                DEFECT *defect,
@@ -53216,13 +54041,51 @@ mrisDefectPatchFitness(MRI_SURFACE *mris, MRI_SURFACE *mris_corrected, MRI *mri,
                        HISTOGRAM *h_border, HISTOGRAM *h_grad, MRI *mri_gray_white,
                        HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms)
 {
-  int i,euler ;
-  VERTEX *v;
   DEFECT *defect=dp->defect;
+  float  *vertex_fitness ;
 
   defect->vertex_trans=vertex_trans;
   dp->verbose_mode=parms->verbose;
 
+  vertex_fitness=(float *)calloc(defect->nvertices, sizeof(float)) ;
+  if (!vertex_fitness)
+    ErrorExit(ERROR_NOMEMORY,
+              "mrisDefectPatchFitness: could not allocate %d vertex fitness",
+              defect->nvertices) ;
+
+  mrisEvaluateDefectPatch(mris, mris_corrected, mri, dp, vertex_trans, dvs,
+                          vertex_fitness, h_k1, h_k2, mri_k1_k2, h_white,
+                          h_gray, h_border, h_grad, mri_gray_white, h_dot,
+                          parms) ;
+
+  /* update statistics */
+  accumulateVertexStatistics(rp, defect, vertex_fitness) ;
+  free(vertex_fitness) ;
+
+  return(dp->fitness) ;
+}
+
+/*-----------------------------------------------------
+  mrisEvaluateDefectPatch() - retessellate the defect
+  with the ordering of dp, compute its fitness and
+  restore mris_corrected. The share of each defect vertex
+  is written into vertex_fitness instead of rp, and
+  nothing outside of mris_corrected, dp, dp->etable and
+  dp->mri_defect_sign is modified, so that patches can
+  be evaluated concurrently on private copies of these.
+  ------------------------------------------------------*/
+static void
+mrisEvaluateDefectPatch(MRI_SURFACE *mris, MRI_SURFACE *mris_corrected, MRI *mri,
+                        DEFECT_PATCH *dp, int *vertex_trans, DEFECT_VERTEX_STATE *dvs,
+                        float *vertex_fitness,
+                        HISTOGRAM *h_k1, HISTOGRAM *h_k2, MRI *mri_k1_k2,HISTOGRAM *h_white, HISTOGRAM *h_gray,
+                        HISTOGRAM *h_border, HISTOGRAM *h_grad, MRI *mri_gray_white,
+                        HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms)
+{
+  int i,euler ;
+  VERTEX *v;
+  DEFECT *defect=dp->defect;
+
   while (1)
   {
 
@@ -53315,8 +54178,13 @@ mrisDefectPatchFitness(MRI_SURFACE *mris, MRI_SURFACE *mris_corrected, MRI *mri,
   /* compute the patch fitness */
   dp->fitness = mrisComputeDefectLogLikelihood(mris_corrected, mri, dp, h_k1, h_k2, mri_k1_k2,h_white, h_gray, h_border, h_grad, mri_gray_white, h_dot, parms) ;
 
-  /* update statistics */
-  updateVertexStatistics(mris,mris_corrected,dvs,rp,dp,vertex_trans,dp->fitness);
+  computeVertexStatistics(mris_corrected,dp,vertex_trans,dp->fitness,
+                          vertex_fitness);
+
+  /* clear the faces of the patch so that the next one starts from the
+     same state whichever surface it is evaluated on */
+  memset(&mris_corrected->faces[dvs->nfaces], 0,
+         (mris_corrected->nfaces-dvs->nfaces)*sizeof(FACE)) ;
 
   /* restore the vertex state */
   mrisRestoreVertexState(mris_corrected, dvs);
@@ -53335,8 +54203,276 @@ mrisDefectPatchFitness(MRI_SURFACE *mris, MRI_SURFACE *mris_corrected, MRI *mri,
   }
   /* free vertices,edges,faces tables */
   TPfree(&dp->tp);
+}
 
-  return(dp->fitness) ;
+/*-----------------------------------------------------
+  PEalloc() - set up one surface per thread to evaluate
+  the patches of a defect on. The copies of mris share
+  everything with it except the vertex and face arrays
+  and the neighbor lists of the dvs vertices, which are
+  all that a patch evaluation modifies.
+  ------------------------------------------------------*/
+static PE *
+PEalloc(MRI_SURFACE *mris, DEFECT_VERTEX_STATE *dvs, EDGE_TABLE *etable,
+        MRI *mri_defect_sign, int max_patches)
+{
+  PE           *pe ;
+  VERTEX_STATE *vs ;
+  int          i, n, w ;
+
+  pe = (PE *)calloc(1, sizeof(PE)) ;
+  if (!pe)
+  {
+    ErrorExit(ERROR_NOMEMORY, "PEalloc: could not allocate evaluator") ;
+  }
+  pe->dvs = dvs ;
+  pe->nworkers = 1 ;
+#ifdef HAVE_OPENMP
+  pe->nworkers = MAX(1, MIN(omp_get_max_threads(), max_patches)) ;
+#endif
+
+  pe->mris = (MRI_SURFACE **)calloc(pe->nworkers, sizeof(MRI_SURFACE *)) ;
+  pe->etables = (EDGE_TABLE *)calloc(pe->nworkers, sizeof(EDGE_TABLE)) ;
+  pe->mri_defect_sign = (MRI **)calloc(pe->nworkers, sizeof(MRI *)) ;
+  pe->vertices = (VERTEX *)calloc(dvs->nvertices, sizeof(VERTEX)) ;
+  pe->vertex_fitness =
+    (float *)calloc(max_patches*dvs->defect->nvertices, sizeof(float)) ;
+  if (!pe->mris || !pe->etables || !pe->mri_defect_sign ||
+      !pe->vertices || !pe->vertex_fitness)
+    ErrorExit(ERROR_NOMEMORY, "PEalloc: could not allocate %d workers",
+              pe->nworkers) ;
+
+  /* the original faces around the dvs vertices, which the patches
+     recompute the normals of */
+  for (pe->nfaces = i = 0 ; i < dvs->nvertices ; i++)
+    if (dvs->vs[i].vno >= 0)
+    {
+      pe->nfaces += dvs->vs[i].num ;
+    }
+  pe->fno = (int *)calloc(pe->nfaces+1, sizeof(int)) ;
+  pe->faces = (FACE *)calloc(pe->nfaces+1, sizeof(FACE)) ;
+  if (!pe->fno || !pe->faces)
+    ErrorExit(ERROR_NOMEMORY, "PEalloc: could not allocate %d faces",
+              pe->nfaces) ;
+  for (pe->nfaces = i = 0 ; i < dvs->nvertices ; i++)
+  {
+    vs = &dvs->vs[i] ;
+    if (vs->vno < 0)
+    {
+      continue ;
+    }
+    for (n = 0 ; n < vs->num ; n++)
+    {
+      pe->fno[pe->nfaces++] = vs->f[n] ;
+    }
+  }
+
+  pe->mris[0] = mris ;
+  pe->etables[0] = *etable ;
+  pe->mri_defect_sign[0] = mri_defect_sign ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static, 1) private(i)
+#endif
+  for (w = 1 ; w < pe->nworkers ; w++)
+  {
+    MRI_SURFACE *mris_copy ;
+
+    mris_copy = (MRI_SURFACE *)calloc(1, sizeof(MRI_SURFACE)) ;
+    if (!mris_copy)
+    {
+      ErrorExit(ERROR_NOMEMORY, "PEalloc: could not allocate surface") ;
+    }
+    *mris_copy = *mris ;
+    mris_copy->vertices = (VERTEX *)calloc(mris->max_vertices, sizeof(VERTEX)) ;
+    mris_copy->faces = (FACE *)calloc(mris->max_faces, sizeof(FACE)) ;
+    if (!mris_copy->vertices || !mris_copy->faces)
+      ErrorExit(ERROR_NOMEMORY,
+                "PEalloc: could not copy surface with %d vertices and "
+                "%d faces", mris->max_vertices, mris->max_faces) ;
+    memmove(mris_copy->vertices, mris->vertices,
+            mris->nvertices*sizeof(VERTEX)) ;
+    memmove(mris_copy->faces, mris->faces, mris->nfaces*sizeof(FACE)) ;
+    for (i = 0 ; i < dvs->nvertices ; i++)
+    {
+      if (dvs->vs[i].vno < 0)
+      {
+        continue ;
+      }
+      mris_copy->vertices[dvs->vs[i].vno].v = NULL ;
+      mris_copy->vertices[dvs->vs[i].vno].f = NULL ;
+      mris_copy->vertices[dvs->vs[i].vno].n = NULL ;
+    }
+    mrisRestoreVertexState(mris_copy, dvs) ;  /* own neighbor lists */
+    pe->mris[w] = mris_copy ;
+
+    pe->etables[w] = *etable ;
+    pe->etables[w].edges = (EDGE *)calloc(etable->nedges, sizeof(EDGE)) ;
+    if (!pe->etables[w].edges)
+      ErrorExit(ERROR_NOMEMORY, "PEalloc: could not allocate %d edges",
+                etable->nedges) ;
+    memmove(pe->etables[w].edges, etable->edges,
+            etable->nedges*sizeof(EDGE)) ;
+
+    if (mri_defect_sign)
+    {
+      pe->mri_defect_sign[w] = MRIcopy(mri_defect_sign, NULL) ;
+    }
+  }
+
+  return(pe) ;
+}
+
+static void
+PEfree(PE **ppe)
+{
+  PE          *pe ;
+  MRI_SURFACE *mris ;
+  VERTEX      *v ;
+  int         i, w ;
+
+  pe = *ppe ;
+  *ppe = NULL ;
+  for (w = 1 ; w < pe->nworkers ; w++)
+  {
+    mris = pe->mris[w] ;
+    for (i = 0 ; i < pe->dvs->nvertices ; i++)
+    {
+      if (pe->dvs->vs[i].vno < 0)
+      {
+        continue ;
+      }
+      v = &mris->vertices[pe->dvs->vs[i].vno] ;
+      free(v->v) ;
+      free(v->f) ;
+      free(v->n) ;
+    }
+    free(mris->vertices) ;
+    free(mris->faces) ;
+    free(mris) ;
+    free(pe->etables[w].edges) ;
+    if (pe->mri_defect_sign[w])
+    {
+      MRIfree(&pe->mri_defect_sign[w]) ;
+    }
+  }
+  free(pe->mris) ;
+  free(pe->etables) ;
+  free(pe->mri_defect_sign) ;
+  free(pe->vertices) ;
+  free(pe->fno) ;
+  free(pe->faces) ;
+  free(pe->vertex_fitness) ;
+  free(pe) ;
+}
+
+/* record the dvs vertices and their faces as they are in
+   mris_corrected before a batch of patches */
+static void
+PEsnapshot(PE *pe)
+{
+  MRI_SURFACE *mris = pe->mris[0] ;
+  int         i ;
+
+  for (i = 0 ; i < pe->dvs->nvertices ; i++)
+    if (pe->dvs->vs[i].vno >= 0)
+    {
+      pe->vertices[i] = mris->vertices[pe->dvs->vs[i].vno] ;
+    }
+  for (i = 0 ; i < pe->nfaces ; i++)
+  {
+    pe->faces[i] = mris->faces[pe->fno[i]] ;
+  }
+}
+
+/* reset surface w to the snapshot, keeping its own neighbor lists */
+static void
+PEsync(PE *pe, int w)
+{
+  MRI_SURFACE *mris = pe->mris[w] ;
+  VERTEX      *v ;
+  int         i, *vlist, *flist ;
+  uchar       *nlist ;
+
+  for (i = 0 ; i < pe->dvs->nvertices ; i++)
+  {
+    if (pe->dvs->vs[i].vno < 0)
+    {
+      continue ;
+    }
+    v = &mris->vertices[pe->dvs->vs[i].vno] ;
+    vlist = v->v ;
+    flist = v->f ;
+    nlist = v->n ;
+    *v = pe->vertices[i] ;
+    v->v = vlist ;
+    v->f = flist ;
+    v->n = nlist ;
+  }
+  for (i = 0 ; i < pe->nfaces ; i++)
+  {
+    mris->faces[pe->fno[i]] = pe->faces[i] ;
+  }
+}
+
+/*-----------------------------------------------------
+  mrisDefectPatchesFitness() - compute the fitness of
+  npatches patches of a defect, in parallel when there
+  is more than one worker. Every patch starts from the
+  same state of mris_corrected and the vertex statistics
+  are accumulated in patch order, so the results do not
+  depend on the number of threads.
+  ------------------------------------------------------*/
+static void
+mrisDefectPatchesFitness(PE *pe, DEFECT_PATCH **dps, int npatches,
+                         MRI_SURFACE *mris, MRI *mri, int *vertex_trans,
+                         DEFECT_VERTEX_STATE *dvs, RP *rp,
+                         HISTOGRAM *h_k1, HISTOGRAM *h_k2, MRI *mri_k1_k2,
+                         HISTOGRAM *h_white, HISTOGRAM *h_gray,
+                         HISTOGRAM *h_border, HISTOGRAM *h_grad,
+                         MRI *mri_gray_white, HISTOGRAM *h_dot,
+                         TOPOLOGY_PARMS *parms)
+{
+  DEFECT *defect = dvs->defect ;
+  int    i ;
+
+  if (npatches <= 0)
+  {
+    return ;
+  }
+
+  defect->vertex_trans = vertex_trans ;
+  PEsnapshot(pe) ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for num_threads(pe->nworkers) schedule(dynamic, 1)
+#endif
+  for (i = 0 ; i < npatches ; i++)
+  {
+    DEFECT_PATCH dp ;
+#ifdef HAVE_OPENMP
+    int tid = omp_get_thread_num();
+#else
+    int tid = 0;
+#endif
+
+    /* evaluate a copy pointing at the tables of this thread */
+    dps[i]->verbose_mode = parms->verbose ;
+    dp = *dps[i] ;
+    dp.etable = &pe->etables[tid] ;
+    dp.mri_defect_sign = pe->mri_defect_sign[tid] ;
+    PEsync(pe, tid) ;
+    mrisEvaluateDefectPatch(mris, pe->mris[tid], mri, &dp, vertex_trans, dvs,
+                            &pe->vertex_fitness[i*defect->nvertices],
+                            h_k1, h_k2, mri_k1_k2, h_white, h_gray,
+                            h_border, h_grad, mri_gray_white, h_dot, parms) ;
+    dps[i]->fitness = dp.fitness ;
+    dps[i]->tp = dp.tp ;
+  }
+
+  for (i = 0 ; i < npatches ; i++)
+    accumulateVertexStatistics(rp, defect,
+                               &pe->vertex_fitness[i*defect->nvertices]) ;
 }
 
 static int
@@ -62228,7 +63364,7 @@ mrisComputeDefectLogLikelihood
  HISTOGRAM *h_dot, TOPOLOGY_PARMS *parms)
 {
   static int first_time = 1 ;
-  double ll = 0.0 ;
+  double ll = 0.0, unmri = parms->l_unmri ;
 
   dp->tp.face_ll=0.0f;
   dp->tp.vertex_ll=0.0f;
@@ -62237,6 +63373,11 @@ mrisComputeDefectLogLikelihood
   dp->tp.unmri_ll=0.0f;
 
 
+  /* patches are evaluated concurrently, so only one thread latches
+     the weights */
+#ifdef HAVE_OPENMP
+  #pragma omp critical (mrisComputeDefectLogLikelihood)
+#endif
   if (first_time)
   {
     l_mri = parms->l_mri ;
@@ -62257,12 +63398,12 @@ mrisComputeDefectLogLikelihood
             fprintf(WHICH_OUTPUT,"\n") ;*/
   }
 
-  if (!FZERO(l_unmri) &&
+  if (!FZERO(unmri) &&
       (dp->mri_defect->width <=5 ||
        dp->mri_defect->height <= 5 ||
        dp->mri_defect->depth <= 5))
   {
-    l_unmri=0;
+    unmri=0;
   }
 
   if (!FZERO(l_mri))
@@ -62270,9 +63411,9 @@ mrisComputeDefectLogLikelihood
     ll += l_mri * mrisComputeDefectMRILogLikelihood
           (mris, mri, &dp->tp, h_white, h_gray,h_grad, mri_gray_white) ;
   }
-  if (!FZERO(l_unmri))
+  if (!FZERO(unmri))
   {
-    ll+= l_unmri * mrisComputeDefectMRILogUnlikelihood( mris, dp, h_border) ;
+    ll+= unmri * mrisComputeDefectMRILogUnlikelihood( mris, dp, h_border) ;
   }
   if (!FZERO(l_qcurv))
   {
@@ -62287,8 +63428,6 @@ mrisComputeDefectLogLikelihood
          (mris, &dp->tp, h_dot) ;
   }
 
-  l_unmri = parms->l_unmri ;
-
   return(ll) ;
 }
 
@@ -63431,15 +64570,17 @@ mrisTessellateDefect
   static int dno = 0 ;
   double    x, y, z, xv, yv, zv, val0, val,
             total, dx, dy, dz, d, wval, gval, Ix, Iy, Iz ;
-  float   norm1[3], norm2[3], nx, ny, nz ;
+  float   *norm1, *norm2, *norms, nx, ny, nz ;
   int nes; /* number of edges present in original tessellation */
   ES *es;  /* list of edges present in original tessellation */
   /*generate an initial ordering*/
   int *ordering=NULL;
+  struct timeb then ;
 
   /* first build table of all possible edges among vertices in the defect
      and on its border.
   */
+  TimerStart(&then) ;
   fprintf(stderr,"\nCORRECTING DEFECT %d (vertices=%d, convex hull=%d)\n",
           defect->defect_number, defect->nvertices, defect->nchull);
 
@@ -63487,8 +64628,31 @@ mrisTessellateDefect
      "Excessive topologic defect encountered: "
      "could not allocate %d edges for retessellation", nedges) ;
 
-  for (n = i = 0 ; i < nvertices ; i++)
+  /* the original normals only depend on the vertex, not on the pair */
+  norms = (float *)calloc(3*nvertices, sizeof(float)) ;
+  if (!norms)
+    ErrorExit(ERROR_NOMEMORY,
+              "mrisTessellateDefect: could not allocate %d normals",
+              nvertices) ;
+  for (i = 0 ; i < nvertices ; i++)
+  {
+    mrisComputeOrigNormal(mris, vlist[i], &norms[3*i]) ;
+  }
+#if !MATRIX_ALLOCATION
+  /* build the cached surface RAS to voxel transform before going parallel */
+  MRISsurfaceRASToVoxelCached(mris, mri, 0, 0, 0, &xv, &yv, &zv) ;
+#endif
+
+  /* every pair is independent and writes its own slot of the table, so
+     the rows can be done in parallel with the same result as serially */
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1) \
+  private(j, n, v, v2, norm1, norm2, nx, ny, nz, total, x, y, z, xv, yv, zv, \
+          Ix, Iy, Iz, val0, wval, gval, val, dx, dy, dz, d)
+#endif
+  for (i = 0 ; i < nvertices ; i++)
   {
+    n = i*nvertices - (i*(i+1))/2 ;  /* index of the pair (i, i+1) */
     v = &mris->vertices[vlist[i]] ;
     if (vlist[i] == Gdiag_no)
     {
@@ -63513,8 +64677,8 @@ mrisTessellateDefect
       {
         DiagBreak() ;
       }
-      mrisComputeOrigNormal(mris, vlist[i], norm1) ;
-      mrisComputeOrigNormal(mris, vlist[j], norm2) ;
+      norm1 = &norms[3*i] ;
+      norm2 = &norms[3*j] ;
       nx = (norm1[0] + norm2[0]) / 2 ;
       ny = (norm1[1] + norm2[1]) / 2 ;
       nz = (norm1[2] + norm2[2]) / 2 ;
@@ -63697,10 +64861,15 @@ mrisTessellateDefect
         }
         et[n].used = USED_IN_ORIGINAL_TESSELLATION ; /* to list
                                                         the original edges */
-        nes++;
       }
     }
   }
+  free(norms) ;
+  for (n = 0 ; n < nedges ; n++)
+    if (et[n].used == USED_IN_ORIGINAL_TESSELLATION)
+    {
+      nes++ ;
+    }
 
 
   /* find and discard all edges that intersect one that is already in the
@@ -63829,6 +64998,8 @@ mrisTessellateDefect
     free(ordering);
   }
   free(et) ;
+  fprintf(WHICH_OUTPUT, "defect %d (%d edges) retessellated in %2.3f sec\n",
+          defect->defect_number, nedges, (float)TimerStop(&then)/1000.0f) ;
   defect_no++ ;     /* for diagnostics */
   return(NO_ERROR) ;
 }
@@ -64492,7 +65663,7 @@ static int mrisComputeOptimalRetessellation
   *dps, *dp, *dps_next_generation ;
   int i, best_i, j, g, nselected, nreplacements,rank, nunchanged = 0,
                                                       nelite, ncrossovers, k, l, noverlap ;
-  int *overlap ,ngenerations,nbests,last_euthanasia,
+  int ngenerations,nbests,last_euthanasia,
       nremovedvertices,nfinalvertices;
   double fitness, best_fitness, last_best, fitness_mean,
          fitness_sigma, fitness_norm, pfitness,two_sigma_sq ,last_fitness;
@@ -64511,6 +65682,11 @@ static int mrisComputeOptimalRetessellation
   int ncross_overs , ntotalcross_overs , ntotalmutations , nmutations ;
   int nintersections;
   static int first_time=1;
+  PATCH_EVALUATOR *pe ;
+  DEFECT_PATCH *batch[MAX_PATCHES], *mutants[MAX_PATCHES] ;
+  int parents1[MAX_PATCHES], parents2[MAX_PATCHES], nmutants ;
+  char mutated[MAX_PATCHES] ;
+  double crossover_fitness[MAX_PATCHES] ;
 
   nbestpatch = number_of_patches = 0;
   ncross_overs=nmutations=0;
@@ -64653,18 +65829,26 @@ static int mrisComputeOptimalRetessellation
     etable.overlapping_edges = (int **)calloc(nedges, sizeof(int *)) ;
     etable.noverlap = (int *)calloc(nedges, sizeof(int)) ;
     etable.flags = (unsigned char *)calloc(nedges, sizeof(unsigned char)) ;
-    overlap = (int *)calloc(nedges, sizeof(int)) ;
     if (!etable.edges ||
         !etable.overlapping_edges ||
         !etable.noverlap ||
-        !overlap)
+        !etable.flags)
       ErrorExit(ERROR_NOMEMORY, "mrisComputeOptimalRetessellation: Excessive "
                 "topologic defect encountered: could not allocate %d "
                 "edge table",nedges) ;
 
-    for (nzero = i = 0 ; i < nedges ; i++)  /* compute overlapping
+    /* each edge only fills in its own overlap list, so the
+       O(nedges^2) intersection tests can be split across threads */
+    nzero = 0 ;
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 16) private(j, noverlap) \
+    reduction(+:nzero)
+#endif
+    for (i = 0 ; i < nedges ; i++)  /* compute overlapping
                                                            for each edge */
     {
+      int overlap[MAX_EDGES+1] ;
+
       if (nedges > 50000 && !(i % 25000))
       {
         fprintf(WHICH_OUTPUT,"%d of %d edges processed\n", i, nedges) ;
@@ -64714,8 +65898,6 @@ static int mrisComputeOptimalRetessellation
         nzero++ ;
       }
     }
-
-    free(overlap) ;
   }
 
 
@@ -64751,6 +65933,7 @@ static int mrisComputeOptimalRetessellation
   }
 
   dvs = mrisRecordVertexState(mris_corrected, defect, vertex_trans) ;
+  pe = PEalloc(mris_corrected, dvs, &etable, mri_defect_sign, max_patches) ;
   dps = dps1 ;
 
   ngenerations=0;
@@ -64852,12 +66035,19 @@ static int mrisComputeOptimalRetessellation
 
       /* generate ordering from edge segmentation */
       generateOrdering(dp,segmentation,i);
+      batch[i] = dp ;
+    }
 
-      fitness =
-        mrisDefectPatchFitness
-        (mris, mris_corrected, mri, dp, vertex_trans, dvs, &rp,
-         h_k1,h_k2,mri_k1_k2,h_white,h_gray,h_border,h_grad,mri_gray_white,
-         h_dot, parms) ;
+    /* evaluate the whole initial population at once */
+    mrisDefectPatchesFitness
+    (pe, batch, max_patches, mris, mri, vertex_trans, dvs, &rp,
+     h_k1,h_k2,mri_k1_k2,h_white,h_gray,h_border,h_grad,mri_gray_white,
+     h_dot, parms) ;
+
+    for (i = 0 ; i < max_patches ; i++)
+    {
+      dp = &dps1[i] ;
+      fitness = dp->fitness ;
 
 #if SAVE_FIT_VALS
       fitness_values[number_of_patches]=fitness;
@@ -65045,13 +66235,20 @@ static int mrisComputeOptimalRetessellation
       {
         mrisMutateDefectPatch(dp, &etable, MUTATION_PCT_INIT) ;
       }
+      batch[i] = dp ;
+    }
 
-      fitness =
-        mrisDefectPatchFitness
-        (mris, mris_corrected, mri, dp, vertex_trans, dvs, &rp,
-         h_k1,h_k2,mri_k1_k2,h_white,h_gray,
-         h_border,h_grad,mri_gray_white,
-         h_dot, parms) ;
+    /* evaluate the whole initial population at once */
+    mrisDefectPatchesFitness
+    (pe, batch, max_patches, mris, mri, vertex_trans, dvs, &rp,
+     h_k1,h_k2,mri_k1_k2,h_white,h_gray,
+     h_border,h_grad,mri_gray_white,
+     h_dot, parms) ;
+
+    for (i = 0 ; i < max_patches ; i++)
+    {
+      dp = &dps1[i] ;
+      fitness = dp->fitness ;
 #if SAVE_FIT_VALS
       fitness_values[number_of_patches]=fitness;
       if (number_of_patches)
@@ -65269,11 +66466,17 @@ static int mrisComputeOptimalRetessellation
       dp = &dps_next_generation[next_gen_index++] ;
       mrisCopyDefectPatch(&dps[ranks[i]], dp) ;
       mrisMutateDefectPatch(dp, &etable, MUTATION_PCT) ;
-      fitness =
-        mrisDefectPatchFitness
-        (mris, mris_corrected, mri, dp, vertex_trans, dvs, &rp,
-         h_k1,h_k2,mri_k1_k2,h_white,h_gray,
-         h_border,h_grad, mri_gray_white, h_dot, parms) ;
+      batch[i] = dp ;
+    }
+    mrisDefectPatchesFitness
+    (pe, batch, nreplacements, mris, mri, vertex_trans, dvs, &rp,
+     h_k1,h_k2,mri_k1_k2,h_white,h_gray,
+     h_border,h_grad, mri_gray_white, h_dot, parms) ;
+
+    for (i = 0 ; i < nreplacements ; i++)
+    {
+      dp = batch[i] ;
+      fitness = dp->fitness ;
 #if SAVE_FIT_VALS
       fitness_values[number_of_patches]=fitness;
       if (number_of_patches)
@@ -65291,7 +66494,7 @@ static int mrisComputeOptimalRetessellation
         nmutations++;
         nunchanged = 0 ;
         best_fitness = fitness ;
-        best_i = next_gen_index-1 ;
+        best_i = dp - dps_next_generation ;
 
         nfinalvertices=nremovedvertices;
         nbestpatch=number_of_patches;
@@ -65441,6 +66644,9 @@ static int mrisComputeOptimalRetessellation
       selected[l] = i ;
     }
 
+    /* breed all the children before evaluating them together. The ones
+       that do not improve on the crossovers before them are mutated, and
+       the mutants are evaluated together as well */
     for (i = 0 ; i < ncrossovers ; i++)
     {
       int   p1, p2 ;
@@ -65455,10 +66661,44 @@ static int mrisComputeOptimalRetessellation
 
       dp = &dps_next_generation[next_gen_index++] ;
       mrisCrossoverDefectPatches(&dps[p1], &dps[p2], dp, &etable) ;
-      fitness = mrisDefectPatchFitness
-                (mris, mris_corrected, mri, dp, vertex_trans, dvs, &rp,
-                 h_k1,h_k2,mri_k1_k2,h_white,h_gray,
-                 h_border,h_grad, mri_gray_white, h_dot, parms) ;
+      parents1[i] = p1 ;
+      parents2[i] = p2 ;
+      batch[i] = dp ;
+    }
+    mrisDefectPatchesFitness
+    (pe, batch, ncrossovers, mris, mri, vertex_trans, dvs, &rp,
+     h_k1,h_k2,mri_k1_k2,h_white,h_gray,
+     h_border,h_grad, mri_gray_white, h_dot, parms) ;
+
+    for (nmutants = 0, fitness = best_fitness, i = 0 ; i < ncrossovers ; i++)
+    {
+      dp = batch[i] ;
+      crossover_fitness[i] = dp->fitness ;
+      if (dp->fitness > fitness)
+      {
+        fitness = dp->fitness ;
+        mutated[i] = 0 ;
+      }
+      else   /* mutate it also */
+      {
+        mrisMutateDefectPatch(dp, &etable, MUTATION_PCT) ;
+        mutated[i] = 1 ;
+        mutants[nmutants++] = dp ;
+      }
+    }
+    mrisDefectPatchesFitness
+    (pe, mutants, nmutants, mris, mri, vertex_trans, dvs, &rp,
+     h_k1,h_k2,mri_k1_k2,h_white,h_gray,
+     h_border, h_grad, mri_gray_white, h_dot, parms) ;
+
+    for (i = 0 ; i < ncrossovers ; i++)
+    {
+      int   p1, p2 ;
+
+      p1 = parents1[i] ;
+      p2 = parents2[i] ;
+      dp = batch[i] ;
+      fitness = crossover_fitness[i] ;
 #if SAVE_FIT_VALS
       fitness_values[number_of_patches]=fitness;
       if (number_of_patches)
@@ -65476,7 +66716,7 @@ static int mrisComputeOptimalRetessellation
         ncross_overs++;
         nunchanged = 0 ;
         best_fitness = fitness ;
-        best_i = next_gen_index-1 ;
+        best_i = dp - dps_next_generation ;
 
         nfinalvertices=nremovedvertices;
         nbestpatch=number_of_patches;
@@ -65530,14 +66770,9 @@ static int mrisComputeOptimalRetessellation
           goto debug_use_this_patch ;
         }
       }
-      else   /* mutate it also */
+      else if (mutated[i])   /* mutated it also */
       {
-        mrisMutateDefectPatch(dp, &etable, MUTATION_PCT) ;
-        fitness =
-          mrisDefectPatchFitness
-          (mris, mris_corrected, mri, dp, vertex_trans, dvs, &rp,
-           h_k1,h_k2,mri_k1_k2,h_white,h_gray,
-           h_border, h_grad, mri_gray_white, h_dot, parms) ;
+        fitness = dp->fitness ;
 #if SAVE_FIT_VALS
         fitness_values[number_of_patches]=fitness;
         if (number_of_patches)
@@ -65556,7 +66791,7 @@ static int mrisComputeOptimalRetessellation
           nmutations++;
           nunchanged = 0 ;
           best_fitness = fitness ;
-          best_i = next_gen_index-1 ;
+          best_i = dp - dps_next_generation ;
 
           nfinalvertices=nremovedvertices;
           nbestpatch=number_of_patches;
@@ -65745,6 +66980,7 @@ static int mrisComputeOptimalRetessellation
 
 debug_use_this_patch:
   dp = &dps[best_i] ;
+  PEfree(&pe) ;
 
   if (parms->save_fname && (parms->defect_number<0 ||
                             (parms->defect_number==defect->defect_number)))
@@ -73971,6 +75207,10 @@ MRI *MRISsmoothMRIFast(MRIS *Surf, MRI *Src, int nSmoothSteps, MRI *IncMask,  MR
 
   if(Gdiag_no > 0) printf("MRISsmoothMRIFast()\n");
 
+  // same result from a precompiled sparse operator, all frames at once
+  if(getenv("FS_SURF_SMOOTH_NO_CSR") == NULL)
+    return(MRISsmoothMRICSR(Surf, Src, nSmoothSteps, IncMask, Targ));
+
   nvox = Src->width * Src->height * Src->depth;
   if (Surf->nvertices != nvox){
     printf("ERROR: MRISsmoothMRIFast(): Surf/Src dimension mismatch\n");
@@ -77508,15 +78748,31 @@ int MRIScopyVolGeomFromMRI(MRI_SURFACE *mris, MRI *mri)
 int
 MRISremoveIntersections(MRI_SURFACE *mris)
 {
-  int     n, num, vno, writeit=0, old_num, nbrs, m ;
-  VERTEX  *v ;
+  int      n, num, vno, writeit=0, old_num, nbrs, m, nmoved, *moved ;
+  VERTEX   *v ;
+  MRIS_BVH *bvh ;
 
   n = 0 ;
 
   printf("removing intersecting faces\n") ;
+  // the faces don't change, so build the BVH once and refit the
+  // vertices the soap bubble moves (FS_MRIS_NO_BVH uses a hash table)
+  if (getenv("FS_MRIS_NO_BVH") == NULL)
+  {
+    bvh = MRISbvhBuild(mris, CURRENT_VERTICES) ;
+    moved = (int *)calloc(mris->nvertices, sizeof(int)) ;
+    if (!moved)
+      ErrorExit(ERROR_NOMEMORY, "MRISremoveIntersections: could not "
+                "allocate %d vertices", mris->nvertices) ;
+  }
+  else
+  {
+    bvh = NULL ;
+    moved = NULL ;
+  }
   old_num = mris->nvertices ;
   nbrs = 1 ;
-  while ((num = mrisMarkIntersections(mris)) > 0)
+  while ((num = mrisMarkIntersections(mris, bvh)) > 0)
   {
     if (num >= old_num)  // couldn't remove any
     {
@@ -77532,12 +78788,20 @@ MRISremoveIntersections(MRI_SURFACE *mris)
     old_num = num ;
 
     printf("%03d: %d intersecting\n", n, num) ;
-    for (vno = 0 ; vno < mris->nvertices ; vno++)
+    for (nmoved = vno = 0 ; vno < mris->nvertices ; vno++)
     {
       v = &mris->vertices[vno] ;
       v->marked = !v->marked ;  // soap bubble will fix the marked ones
+      if (moved && !v->marked && !v->ripflag)
+      {
+        moved[nmoved++] = vno ;
+      }
     }
     MRISsoapBubbleVertexPositions(mris, 5) ;
+    if (bvh)
+    {
+      MRISbvhRefitVertices(bvh, mris, moved, nmoved) ;
+    }
     if (writeit)
     {
       char fname[STRLEN] ;
@@ -77552,19 +78816,45 @@ MRISremoveIntersections(MRI_SURFACE *mris)
     }
   }
 
+  if (bvh)
+  {
+    MRISbvhFree(&bvh) ;
+    free(moved) ;
+  }
   return(NO_ERROR) ;
 }
 
+/* mark the vertices of every intersecting face, using bvh if given
+   (refit to the current positions) and a new hash table if not */
 static int
-mrisMarkIntersections(MRI_SURFACE *mris)
+mrisMarkIntersections(MRI_SURFACE *mris, MRIS_BVH *bvh)
 {
   MRIS_HASH_TABLE  *mht ;
   FACE             *f ;
-  int              fno, n, num = 0 ;
+  int              fno, n, num = 0, i, *fnos ;
+
+  MRISclearMarks(mris) ;
+  if (bvh)
+  {
+    fnos = (int *)calloc(mris->nfaces, sizeof(int)) ;
+    if (!fnos)
+      ErrorExit(ERROR_NOMEMORY, "mrisMarkIntersections: could not "
+                "allocate %d faces", mris->nfaces) ;
+    num = MRISbvhIntersectingFaces(bvh, mris, fnos) ;
+    for (i = 0 ; i < num ; i++)
+    {
+      f = &mris->faces[fnos[i]] ;
+      for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+      {
+        mris->vertices[f->v[n]].marked = 1;
+      }
+    }
+    free(fnos) ;
+    return(num) ;
+  }
 
   mht = MHTfillTable(mris, NULL) ;
 
-  MRISclearMarks(mris) ;
   for (num = fno = 0 ; fno < mris->nfaces ; fno++)
   {
     if (MHTdoesFaceIntersect(mht, mris, fno))
@@ -77655,7 +78945,7 @@ mrisSoapBubbleIntersectingDefects(MRI_SURFACE *mris)
   */
   MRIScopyMarkedToMarked2(mris) ;
   n = 0 ;
-  while ((num = mrisMarkIntersections(mris)) > 0)
+  while ((num = mrisMarkIntersections(mris, NULL)) > 0)
   {
     // mark all of each defect that has an intersection
     for (vno = 0 ; vno < mris->nvertices ; vno++)
@@ -81087,13 +82377,21 @@ MRIScomputeHausdorffDistance(MRI_SURFACE *mris, int mode)
 }
 
 
+/*-----------------------------------------------------
+  MRIScomputeAllDistances() - replace the neighbor list of every
+  vertex with all other unripped vertices and their distances along
+  the edges (the first vtotal keep their order), for
+  parms->complete_dist_mat. The single-source queries are independent,
+  so each thread runs its own with a geodesic workspace. The queries
+  walk the neighbor lists, so the new lists are built on the side and
+  only swapped in once all of them are done.
+  ------------------------------------------------------*/
 int
 MRIScomputeAllDistances(MRI_SURFACE *mris)
 {
   int    vno, done = 0, nvalid ;
-  LABEL  *area ;
-
-  area = LabelAlloc(1, NULL, NULL) ;
+  int    **new_v ;
+  float  **new_dist ;
 
   if (Gdiag & DIAG_SHOW)
   {
@@ -81102,98 +82400,131 @@ MRIScomputeAllDistances(MRI_SURFACE *mris)
 
   MRIScomputeMetricProperties(mris) ;
   nvalid = MRISvalidVertices(mris) ;
-#if 0
-  // this for loop can't be parallelized due to the use of MRISdistanceTransform
-//#pragma omp parallel for reduction(+:done)
+  new_v = (int **)calloc(mris->nvertices, sizeof(int *)) ;
+  new_dist = (float **)calloc(mris->nvertices, sizeof(float *)) ;
+  if (!new_v || !new_dist)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRIScomputeAllDistances: could not allocate %d lists",
+              mris->nvertices) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel
 #endif
-  for (vno = 0 ; vno < mris->nvertices ; vno++)
   {
-    VERTEX *v, *vn ;
-    int    n, *old_v, vno2 ;
+    MRIS_GEODESIC *geo ;
+    unsigned char *listed ;
 
-    v = &mris->vertices[vno] ;
-    if (v->ripflag)
-      continue ;
+    geo = MRISgeodesicAlloc(mris, GEODESIC_DIJKSTRA) ;
+    listed = (unsigned char *)calloc(mris->nvertices, sizeof(unsigned char)) ;
+    if (!listed)
+      ErrorExit(ERROR_NOMEMORY,
+                "MRIScomputeAllDistances: could not allocate marks") ;
+#ifdef HAVE_OPENMP
+    #pragma omp for schedule(dynamic, 16)
+#endif
+    for (vno = 0 ; vno < mris->nvertices ; vno++)
+    {
+      VERTEX *v ;
+      int    n, *vlist, vno2 ;
+      float  *dist ;
 
+      v = &mris->vertices[vno] ;
+      if (v->ripflag)
+        continue ;
 
-    if ((Gdiag & DIAG_SHOW) && (++done % (nvalid/20)) == 0)
-    {
-      fprintf(stdout, "%%%1.0f done\n",
-              100.0f*(float)done / (float)nvalid) ;
-      fflush(stdout) ;
-    }
-    if (vno == Gdiag_no)
-    {
-      DiagBreak() ;
+      if (Gdiag & DIAG_SHOW)
+      {
+#ifdef HAVE_OPENMP
+        #pragma omp critical
+#endif
+        if ((++done % (nvalid/20)) == 0)
+        {
+          fprintf(stdout, "%%%1.0f done\n",
+                  100.0f*(float)done / (float)nvalid) ;
+          fflush(stdout) ;
+        }
+      }
+      if (vno == Gdiag_no)
+      {
+        DiagBreak() ;
+      }
+      MRISgeodesicRun(geo, mris, &vno, 1, 0, NULL, 0) ;
+
+      vlist = (int *)calloc(nvalid-1, sizeof(int) );
+      dist = (float *)calloc(nvalid-1, sizeof(float)) ;
+      if (!vlist || !dist)
+        ErrorExit(ERROR_NOMEMORY,
+                  "MRIScomputeAllDistances: could not allocate %d-sized arrays",
+                  nvalid-1) ;
+      listed[vno] = 1 ;  // don't add self to list
+      // read out first vtotal nbrs
+      for (n = 0 ; n < v->vtotal ; n++)
+      {
+        vlist[n] = v->v[n] ;
+        dist[n] = geo->dist[v->v[n]];
+        listed[v->v[n]] = 1 ;
+      }
+      // now read out rest
+      for (vno2 = 0 ; vno2 < mris->nvertices ; vno2++)
+      {
+        if (mris->vertices[vno2].ripflag || listed[vno2])
+          continue ;
+
+        dist[n] = geo->dist[vno2];
+        vlist[n++] = vno2 ;
+      }
+      listed[vno] = 0 ;
+      for (n = 0 ; n < v->vtotal ; n++)
+      {
+        listed[v->v[n]] = 0 ;
+      }
+      new_v[vno] = vlist ;
+      new_dist[vno] = dist ;
+      if (vno == Gdiag_no)
+      {
+#ifdef HAVE_OPENMP
+        #pragma omp critical
+#endif
+        {
+          char fname[STRLEN] ;
+          sprintf(fname, "vno%d.mgz", vno) ;
+          for (vno2 = 0 ; vno2 < mris->nvertices ; vno2++)
+          {
+            mris->vertices[vno2].val = geo->dist[vno2] ;
+          }
+          MRISwriteValues(mris, fname) ;
+        }
+      }
     }
-    area->lv[0].vno = vno ;
-    area->n_points = 1 ;
-    MRISdistanceTransform(mris, area, DTRANS_MODE_UNSIGNED) ;
+    free(listed) ;
+    MRISgeodesicFree(&geo) ;
+  }
+
+  // no queries in flight, swap the new lists in
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+
+    if (!new_v[vno])
+      continue ;
     if (v->dist_orig)
       free(v->dist_orig) ;
-
     if (v->dist)
     {
       free(v->dist) ;
     }
-    old_v = v->v ;
+    free(v->v) ;
+    v->v = new_v[vno] ;
+    v->dist = new_dist[vno] ;  // v->dist will be restored by caller
     v->dist_orig = (float *)calloc(nvalid-1, sizeof(float)) ;
-    v->dist = (float *)calloc(nvalid-1, sizeof(float)) ;
-    v->v = (int *)calloc(nvalid-1, sizeof(int) );
-    if (!v->v || !v->dist || !v->dist_orig)
+    if (!v->dist_orig)
       ErrorExit(ERROR_NOMEMORY,
                 "MRIScomputeAllDistances: could not allocate %d-sized arrays",
                 nvalid-1) ;
-    memmove(v->v, old_v, v->vtotal*sizeof(v->v[0])) ;
-    free(old_v) ;
-    MRISclearMarks(mris) ;
-    v->marked = 1 ;  // don't add self to list
-    // read out first vtotal nbrs
-    for (n = 0 ; n < v->vtotal ; n++)
-    {
-      vn = &mris->vertices[v->v[n]] ;
-      v->dist[n] = v->dist_orig[n] = vn->val;  // v->dist will be restored by caller
-      vn->marked = 1 ;
-    }
-    // now read out rest
-    for (vno2 = 0 ; vno2 < mris->nvertices ; vno2++)
-    {
-      vn = &mris->vertices[vno2] ;
-      if (vn->ripflag || vn->marked)
-        continue ;
-
-      v->dist[n] = v->dist_orig[n] = vn->val;
-      v->v[n++] = vno2 ;
-      vn->marked = 1 ;
-    }
+    memmove(v->dist_orig, v->dist, (nvalid-1)*sizeof(float)) ;
     v->vtotal = nvalid-1 ;
-    if (vno == Gdiag_no)
-    {
-      char fname[STRLEN] ;
-      sprintf(fname, "vno%d.mgz", vno) ;
-      MRISwriteValues(mris, fname) ;
-
-      for (n = vno2 = 0 ; vno2 < mris->nvertices ; vno2++)
-      {
-        vn = &mris->vertices[vno2] ;
-        if (vn->marked)
-        {
-          int m, found ;
-          n++ ;
-          for (found = m = 0 ; m < v->vtotal ; m++)
-            if (v->v[m] == vno2)
-            {
-              found = 1 ;
-              break ;
-            }
-          if (found == 0 && vno2 != vno)
-            DiagBreak() ;
-
-        }
-      }
-    }
   }
-  LabelFree(&area) ;
+  free(new_v) ;
+  free(new_dist) ;
   return(NO_ERROR) ;
 }
 
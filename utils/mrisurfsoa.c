@@ -0,0 +1,1101 @@
+/**
+ * @file  mrisurfsoa.c
+ * @brief struct-of-arrays mirror of the hot MRI_SURFACE vertex fields
+ *
+ * A VERTEX is several hundred bytes, of which a neighborhood sweep like
+ * gradient averaging or the spring term only reads a position or a
+ * gradient and the ripflag, so every `for (vno...)` loop in mrisurf.c
+ * drags whole cache lines of curvature, stats, marks and pointers
+ * through the cache, and every neighbor access is a random jump into
+ * the big VERTEX array. MRISallocSoA() hangs an MRIS_SOA off the
+ * surface with the hot fields (current, original, normal, gradient,
+ * curv, area and the flags) each in its own aligned contiguous array,
+ * plus the 1-ring neighbor lists packed in CSR form, and the kernels
+ * here work on that.
+ *
+ * The VERTEX array remains the authoritative copy, so nothing else in
+ * the tree has to change and callers can be moved over one loop at a
+ * time: the kernels gather the fields they read from the vertices on
+ * entry and write their results back. MRISverticesToSoA() and
+ * MRISsoaToVertices() copy every mirrored field with its native type,
+ * so a round trip is lossless.
+ *
+ * The neighbor lists are checked against v->vnum on every gather and
+ * rebuilt if a count changed; callers that rewire neighbors without
+ * changing counts (retessellation) must call MRISsoaUpdateTopology()
+ * or free the mirror.
+ *
+ * The kernels visit the neighbors of each vertex in v->v[] order with
+ * the same arithmetic as the VERTEX code, so their results are
+ * bit-identical to it.
+ *
+ * MRISsoaComputeMetricProperties() does the same for the normals,
+ * areas, angles and distances of MRIScomputeMetricProperties(),
+ * caching flat face index buffers and face geometry in soa->metric so
+ * that it can recompute only around the vertices that moved.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
+
+#include "mrisurf.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+
+#define MRIS_SOA_ALIGN  64
+
+static size_t
+soaRound(size_t nbytes)
+{
+  return((nbytes + MRIS_SOA_ALIGN-1) & ~((size_t)MRIS_SOA_ALIGN-1)) ;
+}
+
+static void soaMetricFree(MRIS_SOA *soa) ;
+
+/*---------------------------------------------------------------
+  MRISallocSoA() - allocate (or return the existing) SoA mirror of
+  the vertices of mris and fill it from the vertices.
+  ---------------------------------------------------------------*/
+MRIS_SOA *
+MRISallocSoA(MRI_SURFACE *mris)
+{
+  MRIS_SOA *soa ;
+  size_t   n, fsize, isize, csize ;
+  char     *cp ;
+  void     *block ;
+
+  if (mris->soa)
+  {
+    if (mris->soa->nvertices == mris->nvertices)
+    {
+      MRISsoaUpdateTopology(mris, mris->soa) ;
+      MRISverticesToSoA(mris, mris->soa) ;
+      return(mris->soa) ;
+    }
+    MRISfreeSoA(mris) ;   // vertices were added or removed since
+  }
+
+  soa = (MRIS_SOA *)calloc(1, sizeof(MRIS_SOA)) ;
+  if (!soa)
+    ErrorExit(ERROR_NOMEMORY, "MRISallocSoA: could not allocate MRIS_SOA") ;
+
+  n = (size_t)mris->nvertices ;
+  fsize = soaRound(n*sizeof(float)) ;
+  isize = soaRound((n+1)*sizeof(int)) ;
+  csize = soaRound(n*sizeof(char)) ;
+  if (posix_memalign(&block, MRIS_SOA_ALIGN,
+                     18*fsize + isize + 3*csize) != 0)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISallocSoA: could not allocate %d vertex arrays",
+              mris->nvertices) ;
+
+  soa->nvertices = mris->nvertices ;
+  soa->block = block ;
+  cp = (char *)block ;
+  soa->x = (float *)cp ;
+  cp += fsize ;
+  soa->y = (float *)cp ;
+  cp += fsize ;
+  soa->z = (float *)cp ;
+  cp += fsize ;
+  soa->origx = (float *)cp ;
+  cp += fsize ;
+  soa->origy = (float *)cp ;
+  cp += fsize ;
+  soa->origz = (float *)cp ;
+  cp += fsize ;
+  soa->nx = (float *)cp ;
+  cp += fsize ;
+  soa->ny = (float *)cp ;
+  cp += fsize ;
+  soa->nz = (float *)cp ;
+  cp += fsize ;
+  soa->dx = (float *)cp ;
+  cp += fsize ;
+  soa->dy = (float *)cp ;
+  cp += fsize ;
+  soa->dz = (float *)cp ;
+  cp += fsize ;
+  soa->tdx = (float *)cp ;
+  cp += fsize ;
+  soa->tdy = (float *)cp ;
+  cp += fsize ;
+  soa->tdz = (float *)cp ;
+  cp += fsize ;
+  soa->curv = (float *)cp ;
+  cp += fsize ;
+  soa->area = (float *)cp ;
+  cp += fsize ;
+  soa->origarea = (float *)cp ;
+  cp += fsize ;
+  soa->nbr_start = (int *)cp ;
+  cp += isize ;
+  soa->ripflag = (char *)cp ;
+  cp += csize ;
+  soa->border = (char *)cp ;
+  cp += csize ;
+  soa->neg = (char *)cp ;
+
+  mris->soa = soa ;
+  MRISsoaUpdateTopology(mris, soa) ;
+  MRISverticesToSoA(mris, soa) ;
+  return(soa) ;
+}
+
+int
+MRISfreeSoA(MRI_SURFACE *mris)
+{
+  if (mris->soa)
+  {
+    soaMetricFree(mris->soa) ;
+    free(mris->soa->nbrs) ;
+    free(mris->soa->block) ;
+    free(mris->soa) ;
+    mris->soa = NULL ;
+  }
+  return(NO_ERROR) ;
+}
+
+static int
+soaCheckSize(const MRI_SURFACE *mris, const MRIS_SOA *soa, const char *who)
+{
+  if (soa->nvertices != mris->nvertices)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "%s: SoA has %d vertices but surface has %d",
+                 who, soa->nvertices, mris->nvertices)) ;
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaUpdateTopology() - repack the 1-ring neighbor lists
+  (v->v[0..vnum-1]) into soa->nbr_start/nbrs
+  ---------------------------------------------------------------*/
+int
+MRISsoaUpdateTopology(const MRI_SURFACE *mris, MRIS_SOA *soa)
+{
+  int vno, nnbrs ;
+
+  if (soaCheckSize(mris, soa, "MRISsoaUpdateTopology") != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+  soaMetricFree(soa) ;   // its face lists may be stale too
+  soa->nbr_start[0] = 0 ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    soa->nbr_start[vno+1] = soa->nbr_start[vno] + mris->vertices[vno].vnum ;
+  }
+  nnbrs = soa->nbr_start[mris->nvertices] ;
+  if (nnbrs > soa->max_nbrs || !soa->nbrs)
+  {
+    free(soa->nbrs) ;
+    soa->max_nbrs = nnbrs ;
+    soa->nbrs = (int *)malloc((nnbrs > 0 ? nnbrs : 1)*sizeof(int)) ;
+    if (!soa->nbrs)
+      ErrorExit(ERROR_NOMEMORY,
+                "MRISsoaUpdateTopology: could not allocate %d neighbors",
+                nnbrs) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+    if (v->vnum > 0)
+      memmove(&soa->nbrs[soa->nbr_start[vno]], v->v, v->vnum*sizeof(int)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISverticesToSoA() - copy every mirrored vertex field into soa
+  ---------------------------------------------------------------*/
+int
+MRISverticesToSoA(const MRI_SURFACE *mris, MRIS_SOA *soa)
+{
+  int vno ;
+
+  if (soaCheckSize(mris, soa, "MRISverticesToSoA") != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+
+    soa->x[vno] = v->x ;
+    soa->y[vno] = v->y ;
+    soa->z[vno] = v->z ;
+    soa->origx[vno] = v->origx ;
+    soa->origy[vno] = v->origy ;
+    soa->origz[vno] = v->origz ;
+    soa->nx[vno] = v->nx ;
+    soa->ny[vno] = v->ny ;
+    soa->nz[vno] = v->nz ;
+    soa->dx[vno] = v->dx ;
+    soa->dy[vno] = v->dy ;
+    soa->dz[vno] = v->dz ;
+    soa->curv[vno] = v->curv ;
+    soa->area[vno] = v->area ;
+    soa->origarea[vno] = v->origarea ;
+    soa->ripflag[vno] = v->ripflag ;
+    soa->border[vno] = v->border ;
+    soa->neg[vno] = v->neg ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaToVertices() - copy every mirrored field back into the
+  vertices (the tdx/tdy/tdz scratch arrays are not mirrored)
+  ---------------------------------------------------------------*/
+int
+MRISsoaToVertices(const MRIS_SOA *soa, MRI_SURFACE *mris)
+{
+  int vno ;
+
+  if (soaCheckSize(mris, soa, "MRISsoaToVertices") != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+
+    v->x = soa->x[vno] ;
+    v->y = soa->y[vno] ;
+    v->z = soa->z[vno] ;
+    v->origx = soa->origx[vno] ;
+    v->origy = soa->origy[vno] ;
+    v->origz = soa->origz[vno] ;
+    v->nx = soa->nx[vno] ;
+    v->ny = soa->ny[vno] ;
+    v->nz = soa->nz[vno] ;
+    v->dx = soa->dx[vno] ;
+    v->dy = soa->dy[vno] ;
+    v->dz = soa->dz[vno] ;
+    v->curv = soa->curv[vno] ;
+    v->area = soa->area[vno] ;
+    v->origarea = soa->origarea[vno] ;
+    v->ripflag = soa->ripflag[vno] ;
+    v->border = soa->border[vno] ;
+    v->neg = soa->neg[vno] ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*
+  Gathers the fields a kernel reads (positions, or gradients) and the
+  flags, and notes whether any neighbor count no longer matches the
+  packed lists.
+*/
+#define SOA_GATHER_POSITIONS  0x01
+#define SOA_GATHER_GRADIENTS  0x02
+
+static int
+soaGather(const MRI_SURFACE *mris, MRIS_SOA *soa, int which)
+{
+  int vno, changed = 0 ;
+
+  if (soaCheckSize(mris, soa, "soaGather") != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) reduction(|:changed)
+#endif
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+
+    if (which & SOA_GATHER_POSITIONS)
+    {
+      soa->x[vno] = v->x ;
+      soa->y[vno] = v->y ;
+      soa->z[vno] = v->z ;
+    }
+    if (which & SOA_GATHER_GRADIENTS)
+    {
+      soa->dx[vno] = v->dx ;
+      soa->dy[vno] = v->dy ;
+      soa->dz[vno] = v->dz ;
+    }
+    soa->ripflag[vno] = v->ripflag ;
+    soa->border[vno] = v->border ;
+    soa->neg[vno] = v->neg ;
+    if (v->vnum != soa->nbr_start[vno+1] - soa->nbr_start[vno])
+    {
+      changed = 1 ;
+    }
+  }
+  if (changed)
+  {
+    MRISsoaUpdateTopology(mris, soa) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaUpdatePositions() - refresh only the current positions and
+  flags from the vertices
+  ---------------------------------------------------------------*/
+int
+MRISsoaUpdatePositions(const MRI_SURFACE *mris, MRIS_SOA *soa)
+{
+  return(soaGather(mris, soa, SOA_GATHER_POSITIONS)) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaAverageGradients() - num_avgs nearest-neighbor averages of
+  the gradients, as in MRISaverageGradients(). The gradients are
+  gathered once, averaged num_avgs times in the mirror and scattered
+  back, so the per-iteration sweeps never touch the VERTEX array.
+  ---------------------------------------------------------------*/
+int
+MRISsoaAverageGradients(MRI_SURFACE *mris, int num_avgs)
+{
+  MRIS_SOA *soa = mris->soa ;
+  int      i, vno ;
+
+  if (!soa)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISsoaAverageGradients: no SoA attached")) ;
+  if (num_avgs <= 0)
+  {
+    return(NO_ERROR) ;
+  }
+  if (soaGather(mris, soa, SOA_GATHER_GRADIENTS) != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+  for (i = 0 ; i < num_avgs ; i++)
+  {
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (vno = 0 ; vno < soa->nvertices ; vno++)
+    {
+      float     dx, dy, dz, num ;
+      int       n, vn ;
+      const int *pnb ;
+
+      if (soa->ripflag[vno])
+        continue ;
+
+      dx = soa->dx[vno] ; dy = soa->dy[vno] ; dz = soa->dz[vno] ;
+      pnb = &soa->nbrs[soa->nbr_start[vno]] ;
+      for (num = 0.0f, n = soa->nbr_start[vno+1]-soa->nbr_start[vno] ;
+           n > 0 ; n--)
+      {
+        vn = *pnb++ ;
+        if (soa->ripflag[vn])
+          continue ;
+
+        num++ ;
+        dx += soa->dx[vn] ; dy += soa->dy[vn] ; dz += soa->dz[vn] ;
+      }
+      num++ ;
+      soa->tdx[vno] = dx / num ;
+      soa->tdy[vno] = dy / num ;
+      soa->tdz[vno] = dz / num ;
+    }
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (vno = 0 ; vno < soa->nvertices ; vno++)
+    {
+      if (soa->ripflag[vno])
+        continue ;
+
+      soa->dx[vno] = soa->tdx[vno] ;
+      soa->dy[vno] = soa->tdy[vno] ;
+      soa->dz[vno] = soa->tdz[vno] ;
+    }
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < soa->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+
+    if (soa->ripflag[vno])
+      continue ;
+
+    v->dx = v->tdx = soa->dx[vno] ;
+    v->dy = v->tdy = soa->dy[vno] ;
+    v->dz = v->tdz = soa->dz[vno] ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaSpringTerm() - add l_spring times the (dist_scale scaled)
+  mean offset to the unripped 1-ring neighbors to the gradient of
+  every unripped, non-border vertex, as mrisComputeSpringTerm() does
+  (dist_scale is a float there too, so the scaling rounds the same)
+  ---------------------------------------------------------------*/
+int
+MRISsoaSpringTerm(MRI_SURFACE *mris, double l_spring, float dist_scale)
+{
+  MRIS_SOA *soa = mris->soa ;
+  int      vno ;
+
+  if (!soa)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISsoaSpringTerm: no SoA attached")) ;
+  if (soaGather(mris, soa, SOA_GATHER_POSITIONS) != NO_ERROR)
+  {
+    return(Gerror) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < soa->nvertices ; vno++)
+  {
+    VERTEX    *v ;
+    float     sx, sy, sz, x, y, z ;
+    int       n, m, vn, nnbrs ;
+    const int *pnb ;
+
+    if (soa->ripflag[vno])
+      continue ;
+    if (soa->border[vno] && !soa->neg[vno])
+      continue ;
+
+    x = soa->x[vno] ; y = soa->y[vno] ; z = soa->z[vno] ;
+    sx = sy = sz = 0.0 ;
+    n = 0 ;
+    pnb = &soa->nbrs[soa->nbr_start[vno]] ;
+    nnbrs = soa->nbr_start[vno+1] - soa->nbr_start[vno] ;
+    for (m = 0 ; m < nnbrs ; m++)
+    {
+      vn = pnb[m] ;
+      if (!soa->ripflag[vn])
+      {
+        sx += soa->x[vn] - x ;
+        sy += soa->y[vn] - y ;
+        sz += soa->z[vn] - z ;
+        n++ ;
+      }
+    }
+    if (n > 0)
+    {
+      sx = dist_scale*sx/n ;
+      sy = dist_scale*sy/n ;
+      sz = dist_scale*sz/n ;
+    }
+
+    sx *= l_spring ;
+    sy *= l_spring ;
+    sz *= l_spring ;
+    v = &mris->vertices[vno] ;
+    v->dx += sx ;
+    v->dy += sy ;
+    v->dz += sz ;
+    if (vno == Gdiag_no)
+      fprintf(stdout, "v %d spring term:         (%2.3f, %2.3f, %2.3f)\n",
+              vno, sx, sy, sz) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*
+  Metric properties. The face pass reads only the flat position and
+  index buffers and writes the face area, the unit normal and the three
+  per-corner vertex normal terms of mrisNormalFace() into flat arrays,
+  so it vectorizes; the vertex pass then sums those over each vertex's
+  faces in v->f order. Every expression keeps the float/double types
+  of MRIScomputeNormals(), mrisComputeVertexDistances() and
+  MRIScomputeTriangleProperties(), so the results match theirs.
+
+  In incremental mode the positions and flags used last time are
+  compared with the current ones, and only the faces with a moved or
+  (un)ripped vertex, the vertices of those faces and the distances
+  from or to moved vertices are recomputed. That assumes nothing else
+  writes the normals, areas or distances between calls, which holds
+  inside MRISpositionSurface().
+*/
+#if defined(HAVE_OPENMP) && defined(_OPENMP) && _OPENMP >= 201307
+#define SOA_HAVE_OMP_SIMD  1
+#endif
+
+#define SOA_MOVED   0x01   // moved, (un)ripped or relinked since last time
+#define SOA_NEEDED  0x02   // on a face that has to be recomputed
+
+static void
+soaMetricFree(MRIS_SOA *soa)
+{
+  MRIS_SOA_METRIC *m = soa->metric ;
+
+  if (!m)
+  {
+    return ;
+  }
+  free(m->fv) ;
+  free(m->fripflag) ;
+  free(m->farea) ;
+  free(m->fnormal) ;
+  free(m->fcorner) ;
+  free(m->vf_start) ;
+  free(m->vf) ;
+  free(m->x) ;
+  free(m->y) ;
+  free(m->z) ;
+  free(m->ripflag) ;
+  free(m->vtotal) ;
+  free(m->dist) ;
+  free(m->vflags) ;
+  free(m->fflags) ;
+  free(m->list) ;
+  free(m) ;
+  soa->metric = NULL ;
+}
+
+static void *
+soaMetricArray(size_t n, size_t size)
+{
+  void *p ;
+
+  if (posix_memalign(&p, MRIS_SOA_ALIGN, soaRound((n > 0 ? n : 1)*size)))
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISsoaComputeMetricProperties: could not allocate %lu "
+              "elements of %lu bytes", (unsigned long)n, (unsigned long)size) ;
+  return(p) ;
+}
+
+/*
+  (Re)builds the face index buffers from f->v and the per-vertex face
+  lists from v->f/v->n. The geometry is left invalid, so the next
+  update is a full one.
+*/
+static MRIS_SOA_METRIC *
+soaMetricBuild(const MRI_SURFACE *mris, MRIS_SOA *soa)
+{
+  MRIS_SOA_METRIC *m ;
+  int             vno, fno, n, nv, nf ;
+
+  soaMetricFree(soa) ;
+  m = (MRIS_SOA_METRIC *)calloc(1, sizeof(MRIS_SOA_METRIC)) ;
+  if (!m)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRISsoaComputeMetricProperties: could not allocate metric") ;
+
+  m->nvertices = nv = mris->nvertices ;
+  m->nfaces = nf = mris->nfaces ;
+  m->vf_start = (int *)soaMetricArray(nv+1, sizeof(int)) ;
+  m->vf_start[0] = 0 ;
+  for (vno = 0 ; vno < nv ; vno++)
+  {
+    m->vf_start[vno+1] = m->vf_start[vno] + mris->vertices[vno].num ;
+  }
+  m->vf = (int *)soaMetricArray(m->vf_start[nv], sizeof(int)) ;
+  for (vno = 0 ; vno < nv ; vno++)
+  {
+    const VERTEX *v = &mris->vertices[vno] ;
+    for (n = 0 ; n < v->num ; n++)
+    {
+      m->vf[m->vf_start[vno]+n] = 4*v->f[n] + v->n[n] ;
+    }
+  }
+  m->fv = (int *)soaMetricArray(3*(size_t)nf, sizeof(int)) ;
+  for (fno = 0 ; fno < nf ; fno++)
+    for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+    {
+      m->fv[3*fno+n] = mris->faces[fno].v[n] ;
+    }
+
+  m->fripflag = (char *)soaMetricArray(nf, sizeof(char)) ;
+  m->farea = (float *)soaMetricArray(nf, sizeof(float)) ;
+  m->fnormal = (float *)soaMetricArray(3*(size_t)nf, sizeof(float)) ;
+  m->fcorner = (float *)soaMetricArray(9*(size_t)nf, sizeof(float)) ;
+  m->x = (float *)soaMetricArray(nv, sizeof(float)) ;
+  m->y = (float *)soaMetricArray(nv, sizeof(float)) ;
+  m->z = (float *)soaMetricArray(nv, sizeof(float)) ;
+  m->ripflag = (char *)soaMetricArray(nv, sizeof(char)) ;
+  m->vtotal = (int *)soaMetricArray(nv, sizeof(int)) ;
+  m->dist = (float **)soaMetricArray(nv, sizeof(float *)) ;
+  m->vflags = (unsigned char *)soaMetricArray(nv, sizeof(unsigned char)) ;
+  m->fflags = (unsigned char *)soaMetricArray(nf, sizeof(unsigned char)) ;
+  m->list = (int *)soaMetricArray(nv > nf ? nv : nf, sizeof(int)) ;
+  m->valid = 0 ;
+  soa->metric = m ;
+  return(m) ;
+}
+
+/*
+  Copies the positions and flags into m, marking the vertices and
+  faces that changed (all of them if full), and sets border on the
+  vertices of ripped faces as MRIScomputeNormals() does. Returns
+  ERROR_BADPARM if a face or a vertex face count was rewired.
+*/
+static int
+soaMetricGather(MRI_SURFACE *mris, MRIS_SOA_METRIC *m, int full)
+{
+  int vno, fno, changed = 0 ;
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) reduction(|:changed)
+#endif
+  for (vno = 0 ; vno < m->nvertices ; vno++)
+  {
+    const VERTEX  *v = &mris->vertices[vno] ;
+    unsigned char flags = full ? SOA_MOVED : 0 ;
+
+    if (v->num != m->vf_start[vno+1] - m->vf_start[vno])
+    {
+      changed = 1 ;
+    }
+    if (v->x != m->x[vno] || v->y != m->y[vno] || v->z != m->z[vno] ||
+        v->ripflag != m->ripflag[vno] || v->vtotal != m->vtotal[vno] ||
+        v->dist != m->dist[vno])
+    {
+      flags = SOA_MOVED ;
+    }
+    m->x[vno] = v->x ;
+    m->y[vno] = v->y ;
+    m->z[vno] = v->z ;
+    m->ripflag[vno] = v->ripflag ;
+    m->vtotal[vno] = v->vtotal ;
+    m->dist[vno] = v->dist ;
+    m->vflags[vno] = flags ;
+  }
+  if (changed)
+  {
+    return(ERROR_BADPARM) ;
+  }
+
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) reduction(|:changed)
+#endif
+  for (fno = 0 ; fno < m->nfaces ; fno++)
+  {
+    const FACE    *f = &mris->faces[fno] ;
+    const int     *fv = &m->fv[3*fno] ;
+    unsigned char flags = full ? SOA_MOVED : 0 ;
+    int           n ;
+
+    if (f->v[0] != fv[0] || f->v[1] != fv[1] || f->v[2] != fv[2])
+    {
+      changed = 1 ;
+    }
+    if (f->ripflag != m->fripflag[fno] ||
+        ((m->vflags[fv[0]] | m->vflags[fv[1]] | m->vflags[fv[2]]) &
+         SOA_MOVED))
+    {
+      flags = SOA_MOVED ;
+    }
+    m->fripflag[fno] = f->ripflag ;
+    m->fflags[fno] = flags ;
+    if (f->ripflag)
+      for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+      {
+        mris->vertices[fv[n]].border = TRUE ;
+      }
+  }
+  return(changed ? ERROR_BADPARM : NO_ERROR) ;
+}
+
+/* mrisTriangleArea() of corner c of the face with vertices fv */
+static float
+soaCornerArea(const MRIS_SOA_METRIC *m, const int *fv, int c)
+{
+  int   n0, n1, v, vn0, vn1 ;
+  float v0[3], v1[3], d1, d2, d3 ;
+
+  n0 = (c == 0) ? VERTICES_PER_FACE-1 : c-1 ;
+  n1 = (c == VERTICES_PER_FACE-1) ? 0 : c+1 ;
+  v = fv[c] ;
+  vn0 = fv[n0] ;
+  vn1 = fv[n1] ;
+  v0[0] = m->x[v] - m->x[vn0] ;
+  v0[1] = m->y[v] - m->y[vn0] ;
+  v0[2] = m->z[v] - m->z[vn0] ;
+  v1[0] = m->x[vn1] - m->x[v] ;
+  v1[1] = m->y[vn1] - m->y[v] ;
+  v1[2] = m->z[vn1] - m->z[v] ;
+  d1 = -v1[1]*v0[2] + v0[1]*v1[2] ;
+  d2 = v1[0]*v0[2] - v0[0]*v1[2] ;
+  d3 = -v1[0]*v0[1] + v0[0]*v1[1] ;
+  return sqrt(d1*d1+d2*d2+d3*d3)/2 ;
+}
+
+/* fabs(Vector3Angle()) between the radius vectors of vno and vn */
+static float
+soaSphereAngle(const MRIS_SOA_METRIC *m, int vno, int vn)
+{
+  double angle, l1, l2, dot, norm, x, y, z ;
+
+  x = m->x[vno] ;
+  y = m->y[vno] ;
+  z = m->z[vno] ;
+  l1 = sqrt(x*x+y*y+z*z) ;
+  x = m->x[vn] ;
+  y = m->y[vn] ;
+  z = m->z[vn] ;
+  l2 = sqrt(x*x+y*y+z*z) ;
+  norm = l1*l2 ;
+  if (FZERO(norm))
+  {
+    return(0.0f) ;
+  }
+  dot = m->x[vno]*m->x[vn] + m->y[vno]*m->y[vn] + m->z[vno]*m->z[vn] ;
+  if (fabs(dot) > fabs(norm))
+  {
+    norm = fabs(dot) ;
+  }
+  if (dot > norm)
+  {
+    angle = acos(1.0) ;
+  }
+  else
+  {
+    angle = acos(dot / norm) ;
+  }
+  return(fabs(angle)) ;
+}
+
+/*---------------------------------------------------------------
+  MRISsoaComputeMetricProperties() - the part of
+  MRIScomputeMetricProperties() that MRIScomputeNormals(),
+  mrisComputeVertexDistances() and MRIScomputeTriangleProperties()
+  do (vertex and face normals and areas, face angles, neighbor
+  distances and total_area), computed from flat buffers cached in
+  mris->soa. With incremental set only what moved vertices affect is
+  recomputed. Returns ERROR_BADPARM, without printing, if it finds a
+  degenerate vertex normal, which the caller has to leave to
+  MRIScomputeNormals() to jitter away.
+  ---------------------------------------------------------------*/
+int
+MRISsoaComputeMetricProperties(MRI_SURFACE *mris, int incremental)
+{
+  MRIS_SOA        *soa = mris->soa ;
+  MRIS_SOA_METRIC *m ;
+  const float     *x, *y, *z ;
+  const int       *fv, *list ;
+  float           *farea, *fnormal, *fcorner ;
+  int             full, fix, sphere, nfaces, nverts, fno, vno, i, n,
+                  ndegenerate ;
+  double          total_area ;
+
+  if (!soa)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM,
+                 "MRISsoaComputeMetricProperties: no SoA attached")) ;
+
+  fix = MRISgetFixVertexAreaValue() ;
+  m = soa->metric ;
+  if (!m || m->nvertices != mris->nvertices || m->nfaces != mris->nfaces)
+  {
+    m = soaMetricBuild(mris, soa) ;
+  }
+  full = !incremental || !m->valid || m->status != mris->status ||
+         m->fix_vertex_area != fix ;
+  if (soaMetricGather(mris, m, full) != NO_ERROR)
+  {
+    m = soaMetricBuild(mris, soa) ;   // faces were rewired
+    full = 1 ;
+    soaMetricGather(mris, m, full) ;
+  }
+  m->valid = 0 ;
+  m->status = mris->status ;
+  m->fix_vertex_area = fix ;
+
+  x = m->x ;
+  y = m->y ;
+  z = m->z ;
+  fv = m->fv ;
+  list = m->list ;
+  farea = m->farea ;
+  fnormal = m->fnormal ;
+  fcorner = m->fcorner ;
+
+  // faces to recompute, and the vertices whose sums they change
+  for (nfaces = fno = 0 ; fno < m->nfaces ; fno++)
+  {
+    if (!m->fflags[fno])
+    {
+      continue ;
+    }
+    for (n = 0 ; n < VERTICES_PER_FACE ; n++)
+    {
+      m->vflags[fv[3*fno+n]] |= SOA_NEEDED ;
+    }
+    if (!m->fripflag[fno])
+    {
+      m->list[nfaces++] = fno ;
+    }
+  }
+
+#ifdef SOA_HAVE_OMP_SIMD
+  #pragma omp parallel for simd schedule(static)
+#elif defined(HAVE_OPENMP)
+  #pragma omp parallel for schedule(static)
+#endif
+  for (i = 0 ; i < nfaces ; i++)
+  {
+    int   f = list[i], v0 = fv[3*f], v1 = fv[3*f+1], v2 = fv[3*f+2], c, cn ;
+    float ax, ay, az, bx, by, bz, nx, ny, nz, len, d, e[3][3] ;
+
+    // a = V1 - V0, b = V2 - V0, area and unit normal from a x b
+    ax = x[v1] - x[v0] ;
+    ay = y[v1] - y[v0] ;
+    az = z[v1] - z[v0] ;
+    bx = x[v2] - x[v0] ;
+    by = y[v2] - y[v0] ;
+    bz = z[v2] - z[v0] ;
+    nx = ay*bz - az*by ;
+    ny = az*bx - ax*bz ;
+    nz = ax*by - ay*bx ;
+    len = sqrt(nx*nx+ny*ny+nz*nz) ;
+    farea[f] = sqrt(nx*nx+ny*ny+nz*nz) * 0.5f ;
+    if (FZERO(len))
+    {
+      len = 1.0f ;
+    }
+    else
+    {
+      len = 1.0f / len ;
+    }
+    fnormal[3*f] = nx*len ;
+    fnormal[3*f+1] = ny*len ;
+    fnormal[3*f+2] = nz*len ;
+
+    // e[c] is the normalized edge into corner c, and the normal term
+    // of corner c is e[c] x e[c+1] as in mrisNormalFace()
+    e[0][0] = x[v0] - x[v2] ;
+    e[0][1] = y[v0] - y[v2] ;
+    e[0][2] = z[v0] - z[v2] ;
+    e[1][0] = x[v1] - x[v0] ;
+    e[1][1] = y[v1] - y[v0] ;
+    e[1][2] = z[v1] - z[v0] ;
+    e[2][0] = x[v2] - x[v1] ;
+    e[2][1] = y[v2] - y[v1] ;
+    e[2][2] = z[v2] - z[v1] ;
+    for (c = 0 ; c < VERTICES_PER_FACE ; c++)
+    {
+      d = sqrt(e[c][0]*e[c][0]+e[c][1]*e[c][1]+e[c][2]*e[c][2]) ;
+      if (d > 0)
+      {
+        e[c][0] /= d ;
+        e[c][1] /= d ;
+        e[c][2] /= d ;
+      }
+    }
+    for (c = 0 ; c < VERTICES_PER_FACE ; c++)
+    {
+      cn = (c == VERTICES_PER_FACE-1) ? 0 : c+1 ;
+      fcorner[9*f+3*c]   = -e[cn][1]*e[c][2] + e[c][1]*e[cn][2] ;
+      fcorner[9*f+3*c+1] = e[cn][0]*e[c][2] - e[c][0]*e[cn][2] ;
+      fcorner[9*f+3*c+2] = -e[cn][0]*e[c][1] + e[c][0]*e[cn][1] ;
+    }
+  }
+
+  // scatter into the faces, with the angles
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (i = 0 ; i < nfaces ; i++)
+  {
+    static const int corners[ANGLES_PER_TRIANGLE][3] =
+      { { 0, 2, 1 }, { 1, 0, 2 }, { 2, 1, 0 } } ;
+    int   f = list[i], ano, vo, va, vb ;
+    float ax, ay, az, bx, by, bz, nx, ny, nz, cross, dot ;
+    FACE  *face = &mris->faces[f] ;
+
+    face->area = farea[f] ;
+    face->nx = nx = fnormal[3*f] ;
+    face->ny = ny = fnormal[3*f+1] ;
+    face->nz = nz = fnormal[3*f+2] ;
+    for (ano = 0 ; ano < ANGLES_PER_TRIANGLE ; ano++)
+    {
+      vo = fv[3*f+corners[ano][0]] ;
+      va = fv[3*f+corners[ano][1]] ;
+      vb = fv[3*f+corners[ano][2]] ;
+      ax = x[va] - x[vo] ;
+      ay = y[va] - y[vo] ;
+      az = z[va] - z[vo] ;
+      bx = x[vb] - x[vo] ;
+      by = y[vb] - y[vo] ;
+      bz = z[vb] - z[vo] ;
+      cross = nx * (by*az - bz*ay) ;   // VectorTripleProduct(b, a, n)
+      cross += ny * (bz*ax - bx*az) ;
+      cross += nz * (bx*ay - by*ax) ;
+      dot = ax*bx + ay*by + az*bz ;
+      face->angle[ano] = atan2(cross, dot) ;
+    }
+  }
+
+  // summed in face order every time, so it doesn't depend on threads
+  for (total_area = 0.0, fno = 0 ; fno < m->nfaces ; fno++)
+    if (!m->fripflag[fno])
+    {
+      total_area += farea[fno] ;
+    }
+  mris->total_area = total_area ;
+
+  for (nverts = vno = 0 ; vno < m->nvertices ; vno++)
+    if (!m->ripflag[vno] && (full || (m->vflags[vno] & SOA_NEEDED)))
+    {
+      m->list[nverts++] = vno ;
+    }
+
+  ndegenerate = 0 ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static) reduction(+:ndegenerate)
+#endif
+  for (i = 0 ; i < nverts ; i++)
+  {
+    VERTEX *v = &mris->vertices[list[i]] ;
+    float  snorm[3], area, carea, d, len ;
+    int    k, f, c, num, start = m->vf_start[list[i]],
+           end = m->vf_start[list[i]+1] ;
+
+    snorm[0] = snorm[1] = snorm[2] = 0 ;
+    area = 0 ;
+    for (num = 0, k = start ; k < end ; k++)
+    {
+      f = m->vf[k] >> 2 ;
+      if (m->fripflag[f])
+      {
+        continue ;
+      }
+      c = m->vf[k] & 3 ;
+      num++ ;
+      snorm[0] += fcorner[9*f+3*c] ;
+      snorm[1] += fcorner[9*f+3*c+1] ;
+      snorm[2] += fcorner[9*f+3*c+2] ;
+      area += farea[f] ;
+    }
+    if (!num)
+    {
+      v->area = 0 ;
+      continue ;
+    }
+
+    if (v->origarea < 0)   // has never been set
+    {
+      for (carea = 0, k = start ; k < end ; k++)
+      {
+        f = m->vf[k] >> 2 ;
+        if (!m->fripflag[f])
+        {
+          carea += soaCornerArea(m, &fv[3*f], m->vf[k] & 3) ;
+        }
+      }
+      v->origarea = fix ? carea / 3.0 : carea / 2.0 ;
+    }
+
+    d = sqrt(snorm[0]*snorm[0]+snorm[1]*snorm[1]+snorm[2]*snorm[2]) ;
+    if (d > 0)
+    {
+      snorm[0] /= d ;
+      snorm[1] /= d ;
+      snorm[2] /= d ;
+    }
+    len = sqrt(snorm[0]*snorm[0] + snorm[1]*snorm[1] + snorm[2]*snorm[2]) ;
+    if (FZERO(len))
+    {
+      ndegenerate++ ;
+      continue ;
+    }
+    v->nx = snorm[0] ;
+    v->ny = snorm[1] ;
+    v->nz = snorm[2] ;
+    v->area = fix ? area / 3.0 : area / 2.0 ;
+  }
+  if (ndegenerate > 0)
+  {
+    return(ERROR_BADPARM) ;   // m->valid stays 0
+  }
+
+  sphere = (mris->status == MRIS_PARAMETERIZED_SPHERE ||
+            mris->status == MRIS_SPHERE) ;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (vno = 0 ; vno < m->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+    float  xd, yd, zd, d, circumference ;
+    int    n, vn ;
+
+    if (m->ripflag[vno] || m->dist[vno] == NULL)
+    {
+      continue ;
+    }
+    if (!full && !(m->vflags[vno] & SOA_MOVED))
+    {
+      for (n = 0 ; n < m->vtotal[vno] ; n++)
+        if (m->vflags[v->v[n]] & SOA_MOVED)
+        {
+          break ;
+        }
+      if (n == m->vtotal[vno])
+      {
+        continue ;
+      }
+    }
+
+    if (sphere)
+    {
+      circumference = M_PI * 2.0 *
+        sqrt(x[vno]*x[vno] + y[vno]*y[vno] + z[vno]*z[vno]) ;
+      for (n = 0 ; n < m->vtotal[vno] ; n++)
+      {
+        vn = v->v[n] ;
+        if (m->ripflag[vn])
+        {
+          continue ;
+        }
+        d = circumference * soaSphereAngle(m, vno, vn) / (2.0 * M_PI) ;
+        v->dist[n] = d ;
+      }
+    }
+    else
+      for (n = 0 ; n < m->vtotal[vno] ; n++)
+      {
+        vn = v->v[n] ;
+        xd = x[vno] - x[vn] ;
+        yd = y[vno] - y[vn] ;
+        zd = z[vno] - z[vn] ;
+        d = xd*xd + yd*yd + zd*zd ;
+        v->dist[n] = sqrt(d) ;
+      }
+  }
+
+  m->valid = 1 ;
+  return(NO_ERROR) ;
+}
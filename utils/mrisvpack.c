@@ -0,0 +1,628 @@
+/**
+ * @file  mrisvpack.c
+ * @brief columnar container of named per-vertex arrays
+ *
+ * A subject's surf/ and label/ directories hold one small file per
+ * measure and hemisphere (lh.thickness, lh.area, lh.sulc, ...,
+ * label/lh.aparc.annot), each opened, parsed a few bytes at a time
+ * with fread2/fread3 and copied, so group analyses and viewers that
+ * touch a dozen measures for hundreds of subjects spend most of their
+ * time in open() and small reads. A .vpack file stores all of them for
+ * one hemisphere as named columns: a header, the column data and an
+ * index sorted by name at the end. Float and int columns are
+ * nvertices long; byte columns are opaque (the colortable of an
+ * annotation is kept as "<annot>.ctab", holding the tag section of
+ * the .annot verbatim).
+ *
+ * MRISvpackRead() maps the file, so a column costs nothing until it is
+ * touched and is found by a binary search of the index.
+ * MRISreadCurvatureIntoArray(), MRISreadCurvatureFile(),
+ * MRISreadValuesIntoArray(), MRISreadAnnotationIntoArray() and
+ * MRISreadCTABFromAnnotationIfPresent() read a column when they are
+ * given "<pack>:<name>" (eg surf/lh.vpack:thickness), or when the file
+ * they are given does not exist and <dir>/<hemi>.vpack or
+ * <dir>/../surf/<hemi>.vpack has a column named like the file without
+ * its hemisphere prefix (label/lh.aparc.annot -> "aparc.annot"), so
+ * existing scripts keep working on subjects whose overlays were packed
+ * with mris_make_vpack. Those readers keep the last few packs they
+ * used mapped, and remap one when it is replaced on disk.
+ *
+ * Files are written in host byte order with a byte-order mark, all
+ * columns start on MRIS_VPACK_ALIGN byte boundaries, and a pack is
+ * written to a temporary file and renamed into place so processes that
+ * have the old one mapped are not disturbed.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mrisurf.h"
+#include "error.h"
+#include "diag.h"
+#include "macros.h"
+#include "utils.h"
+#include "fio.h"
+
+#define MRIS_VPACK_MAGIC       "FSVPACK"
+#define MRIS_VPACK_BYTE_ORDER  0x01020304
+#define MRIS_VPACK_VERSION     1
+#define MRIS_VPACK_ALIGN       64
+#define MRIS_VPACK_CACHE_SIZE  8
+
+typedef struct
+{
+  char      magic[8] ;
+  int       byte_order ;
+  int       version ;
+  int       nvertices ;
+  int       ncolumns ;
+  long long index_offset ;
+}
+MRIS_VPACK_HEADER ;
+
+// packs kept mapped by the overlay readers
+typedef struct
+{
+  MRIS_VPACK         *vp ;
+  dev_t              dev ;
+  ino_t              ino ;
+  time_t             mtime ;
+  off_t              size ;
+  unsigned long long used ;
+}
+MRIS_VPACK_CACHE ;
+
+static MRIS_VPACK_CACHE   vpack_cache[MRIS_VPACK_CACHE_SIZE] ;
+static unsigned long long vpack_clock = 0 ;
+
+static long long
+vpackAlign(long long off)
+{
+  return((off + MRIS_VPACK_ALIGN-1) & ~(long long)(MRIS_VPACK_ALIGN-1)) ;
+}
+
+static int
+vpackCompareColumns(const void *c1, const void *c2)
+{
+  return(strcmp(((const MRIS_VPACK_COLUMN *)c1)->name,
+                ((const MRIS_VPACK_COLUMN *)c2)->name)) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackAlloc() - start an empty pack for a surface
+  with nvertices vertices
+  ------------------------------------------------------*/
+MRIS_VPACK *
+MRISvpackAlloc(int nvertices)
+{
+  MRIS_VPACK *vp ;
+
+  if (nvertices <= 0)
+    ErrorReturn(NULL, (ERROR_BADPARM,
+                       "MRISvpackAlloc(%d): bad # of vertices", nvertices)) ;
+  vp = (MRIS_VPACK *)calloc(1, sizeof(MRIS_VPACK)) ;
+  if (!vp)
+    ErrorExit(ERROR_NOMEMORY, "MRISvpackAlloc: could not allocate pack") ;
+  vp->nvertices = nvertices ;
+  return(vp) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackFree() - free a pack being built or unmap
+  one that was read
+  ------------------------------------------------------*/
+int
+MRISvpackFree(MRIS_VPACK **pvp)
+{
+  MRIS_VPACK *vp = *pvp ;
+  int        i ;
+
+  if (!vp)
+    return(NO_ERROR) ;
+  *pvp = NULL ;
+  if (vp->data)
+  {
+    for (i = 0 ; i < vp->ncolumns ; i++)
+      free(vp->data[i]) ;
+    free(vp->data) ;
+  }
+  if (vp->base)
+  {
+    if (vp->mapped)
+      munmap(vp->base, vp->bytes) ;
+    else
+      free(vp->base) ;
+  }
+  free(vp->columns) ;
+  free(vp->fname) ;
+  free(vp) ;
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackAddColumn() - copy a column into a pack being
+  built. Float and int columns must hold nvertices values.
+  ------------------------------------------------------*/
+int
+MRISvpackAddColumn(MRIS_VPACK *vp, const char *name, int type,
+                   const void *data, long long nbytes)
+{
+  MRIS_VPACK_COLUMN *col ;
+  int               i ;
+
+  if (vp->base)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISvpackAddColumn(%s): pack %s is read-only",
+                 name, vp->fname)) ;
+  if (strlen(name) == 0 || strlen(name) >= MRIS_VPACK_NAME_LEN)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISvpackAddColumn(%s): bad column name",
+                 name)) ;
+  switch (type)
+  {
+  case MRIS_VPACK_FLOAT:
+  case MRIS_VPACK_INT:
+    if (nbytes != (long long)vp->nvertices*4)
+      ErrorReturn(ERROR_BADPARM,
+                  (ERROR_BADPARM, "MRISvpackAddColumn(%s): %lld bytes, "
+                   "expected %d values", name, nbytes, vp->nvertices)) ;
+    break ;
+  case MRIS_VPACK_BYTES:
+    if (nbytes < 0)
+      ErrorReturn(ERROR_BADPARM,
+                  (ERROR_BADPARM, "MRISvpackAddColumn(%s): %lld bytes",
+                   name, nbytes)) ;
+    break ;
+  default:
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISvpackAddColumn(%s): unknown type %d",
+                 name, type)) ;
+  }
+  for (i = 0 ; i < vp->ncolumns ; i++)
+    if (!strcmp(vp->columns[i].name, name))
+      ErrorReturn(ERROR_BADPARM,
+                  (ERROR_BADPARM, "MRISvpackAddColumn(%s): duplicate column",
+                   name)) ;
+
+  if (vp->ncolumns == vp->max_columns)
+  {
+    vp->max_columns = vp->max_columns ? 2*vp->max_columns : 16 ;
+    vp->columns = (MRIS_VPACK_COLUMN *)
+      realloc(vp->columns, vp->max_columns*sizeof(MRIS_VPACK_COLUMN)) ;
+    vp->data = (void **)realloc(vp->data, vp->max_columns*sizeof(void *)) ;
+    if (!vp->columns || !vp->data)
+      ErrorExit(ERROR_NOMEMORY, "MRISvpackAddColumn: could not grow to %d "
+                "columns", vp->max_columns) ;
+  }
+  col = &vp->columns[vp->ncolumns] ;
+  memset(col, 0, sizeof(*col)) ;
+  strcpy(col->name, name) ;
+  col->type = type ;
+  col->nbytes = nbytes ;
+  vp->data[vp->ncolumns] = malloc(nbytes > 0 ? nbytes : 1) ;
+  if (!vp->data[vp->ncolumns])
+    ErrorExit(ERROR_NOMEMORY, "MRISvpackAddColumn(%s): could not allocate "
+              "%lld bytes", name, nbytes) ;
+  if (nbytes > 0)
+    memmove(vp->data[vp->ncolumns], data, nbytes) ;
+  vp->ncolumns++ ;
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackWrite() - write the columns sorted by name,
+  then the index, through a temporary file renamed to
+  fname
+  ------------------------------------------------------*/
+int
+MRISvpackWrite(MRIS_VPACK *vp, const char *fname)
+{
+  static const char  zeros[MRIS_VPACK_ALIGN] = { 0 } ;
+  MRIS_VPACK_HEADER  hdr ;
+  MRIS_VPACK_COLUMN  *index ;
+  FILE               *fp ;
+  char               tmp_fname[STRLEN] ;
+  int                i, j, *order, ok ;
+  long long          pos, off ;
+
+  if (vp->base)
+    ErrorReturn(ERROR_BADPARM,
+                (ERROR_BADPARM, "MRISvpackWrite(%s): pack %s was read, not "
+                 "built", fname, vp->fname)) ;
+
+  // sort by name, leaving the columns in the order they were added
+  index = (MRIS_VPACK_COLUMN *)calloc(vp->ncolumns+1,
+                                      sizeof(MRIS_VPACK_COLUMN)) ;
+  order = (int *)calloc(vp->ncolumns+1, sizeof(int)) ;
+  if (!index || !order)
+    ErrorExit(ERROR_NOMEMORY, "MRISvpackWrite: could not allocate index") ;
+  memmove(index, vp->columns, vp->ncolumns*sizeof(MRIS_VPACK_COLUMN)) ;
+  for (i = 0 ; i < vp->ncolumns ; i++)
+    index[i].offset = i ;
+  qsort(index, vp->ncolumns, sizeof(MRIS_VPACK_COLUMN), vpackCompareColumns) ;
+  off = sizeof(hdr) ;
+  for (i = 0 ; i < vp->ncolumns ; i++)
+  {
+    order[i] = (int)index[i].offset ;
+    off = vpackAlign(off) ;
+    index[i].offset = off ;
+    off += index[i].nbytes ;
+  }
+
+  memset(&hdr, 0, sizeof(hdr)) ;
+  strcpy(hdr.magic, MRIS_VPACK_MAGIC) ;
+  hdr.byte_order = MRIS_VPACK_BYTE_ORDER ;
+  hdr.version = MRIS_VPACK_VERSION ;
+  hdr.nvertices = vp->nvertices ;
+  hdr.ncolumns = vp->ncolumns ;
+  hdr.index_offset = vpackAlign(off) ;
+
+  sprintf(tmp_fname, "%s.tmp.%d", fname, (int)getpid()) ;
+  fp = fopen(tmp_fname, "wb") ;
+  if (!fp)
+  {
+    free(index) ;
+    free(order) ;
+    ErrorReturn(ERROR_NOFILE,
+                (ERROR_NOFILE, "MRISvpackWrite: could not open %s",
+                 tmp_fname)) ;
+  }
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 ;
+  pos = sizeof(hdr) ;
+  for (i = 0 ; ok && i <= vp->ncolumns ; i++)
+  {
+    off = i < vp->ncolumns ? index[i].offset : hdr.index_offset ;
+    if (off > pos)
+      ok = fwrite(zeros, 1, off-pos, fp) == (size_t)(off-pos) ;
+    pos = off ;
+    if (!ok || i == vp->ncolumns)
+      break ;
+    j = order[i] ;
+    if (index[i].nbytes > 0)
+      ok = fwrite(vp->data[j], 1, index[i].nbytes, fp) ==
+           (size_t)index[i].nbytes ;
+    pos += index[i].nbytes ;
+  }
+  if (ok && vp->ncolumns > 0)
+    ok = fwrite(index, sizeof(MRIS_VPACK_COLUMN), vp->ncolumns, fp) ==
+         (size_t)vp->ncolumns ;
+  if (fclose(fp) != 0)
+    ok = 0 ;
+  free(index) ;
+  free(order) ;
+  if (!ok || rename(tmp_fname, fname) != 0)
+  {
+    unlink(tmp_fname) ;
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "MRISvpackWrite(%s): write failed", fname)) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackRead() - map a pack and check its header and
+  index. FS_VPACK_NO_MMAP reads it into memory instead.
+  ------------------------------------------------------*/
+MRIS_VPACK *
+MRISvpackRead(const char *fname)
+{
+  MRIS_VPACK        *vp ;
+  MRIS_VPACK_HEADER hdr ;
+  MRIS_VPACK_COLUMN *col ;
+  struct stat       st ;
+  int               fd, i ;
+  long long         index_end ;
+
+  fd = open(fname, O_RDONLY) ;
+  if (fd < 0)
+    ErrorReturn(NULL, (ERROR_NOFILE, "MRISvpackRead: could not open %s",
+                       fname)) ;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(hdr) ||
+      read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      memcmp(hdr.magic, MRIS_VPACK_MAGIC, sizeof(MRIS_VPACK_MAGIC)))
+  {
+    close(fd) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "MRISvpackRead(%s): not a vertex pack",
+                       fname)) ;
+  }
+  if (hdr.byte_order != MRIS_VPACK_BYTE_ORDER)
+  {
+    close(fd) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "MRISvpackRead(%s): written on a host "
+                       "with a different byte order, regenerate it with "
+                       "mris_make_vpack", fname)) ;
+  }
+  index_end = hdr.index_offset +
+              (long long)hdr.ncolumns*sizeof(MRIS_VPACK_COLUMN) ;
+  if (hdr.version != MRIS_VPACK_VERSION || hdr.nvertices <= 0 ||
+      hdr.ncolumns < 0 || hdr.index_offset < (long long)sizeof(hdr) ||
+      index_end > (long long)st.st_size)
+  {
+    close(fd) ;
+    ErrorReturn(NULL, (ERROR_BADFILE, "MRISvpackRead(%s): bad header "
+                       "(version %d, %d columns)", fname, hdr.version,
+                       hdr.ncolumns)) ;
+  }
+
+  vp = MRISvpackAlloc(hdr.nvertices) ;
+  vp->fname = strcpyalloc(fname) ;
+  vp->bytes = st.st_size ;
+  vp->ncolumns = vp->max_columns = hdr.ncolumns ;
+  if (getenv("FS_VPACK_NO_MMAP") == NULL)
+  {
+    vp->base = mmap(NULL, vp->bytes, PROT_READ, MAP_PRIVATE, fd, 0) ;
+    if (vp->base == MAP_FAILED)
+      vp->base = NULL ;
+    else
+      vp->mapped = 1 ;
+  }
+  if (vp->base == NULL)
+  {
+    vp->base = malloc(vp->bytes) ;
+    if (!vp->base ||
+        pread(fd, vp->base, vp->bytes, 0) != (ssize_t)vp->bytes)
+    {
+      close(fd) ;
+      MRISvpackFree(&vp) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "MRISvpackRead(%s): read failed",
+                         fname)) ;
+    }
+  }
+  close(fd) ;
+
+  // the index is small, keep a private, sorted copy of it
+  vp->columns = (MRIS_VPACK_COLUMN *)calloc(hdr.ncolumns+1,
+                                            sizeof(MRIS_VPACK_COLUMN)) ;
+  if (!vp->columns)
+    ErrorExit(ERROR_NOMEMORY, "MRISvpackRead(%s): could not allocate index",
+              fname) ;
+  memmove(vp->columns, (char *)vp->base + hdr.index_offset,
+          hdr.ncolumns*sizeof(MRIS_VPACK_COLUMN)) ;
+  for (i = 0 ; i < vp->ncolumns ; i++)
+  {
+    col = &vp->columns[i] ;
+    col->name[MRIS_VPACK_NAME_LEN-1] = 0 ;
+    if (col->offset < (long long)sizeof(hdr) || col->nbytes < 0 ||
+        col->offset + col->nbytes > hdr.index_offset ||
+        (col->type != MRIS_VPACK_BYTES &&
+         col->nbytes != (long long)vp->nvertices*4))
+    {
+      MRISvpackFree(&vp) ;
+      ErrorReturn(NULL, (ERROR_BADFILE, "MRISvpackRead(%s): bad index entry "
+                         "%d", fname, i)) ;
+    }
+  }
+  qsort(vp->columns, vp->ncolumns, sizeof(MRIS_VPACK_COLUMN),
+        vpackCompareColumns) ;
+  return(vp) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackFindColumn() - look a column up by name,
+  NULL if the pack does not have it
+  ------------------------------------------------------*/
+const MRIS_VPACK_COLUMN *
+MRISvpackFindColumn(const MRIS_VPACK *vp, const char *name)
+{
+  int lo, hi, mid, cmp ;
+
+  if (!vp->base)   // being built, not sorted yet
+  {
+    for (mid = 0 ; mid < vp->ncolumns ; mid++)
+      if (!strcmp(vp->columns[mid].name, name))
+        return(&vp->columns[mid]) ;
+    return(NULL) ;
+  }
+  lo = 0 ;
+  hi = vp->ncolumns-1 ;
+  while (lo <= hi)
+  {
+    mid = (lo+hi)/2 ;
+    cmp = strcmp(name, vp->columns[mid].name) ;
+    if (cmp == 0)
+      return(&vp->columns[mid]) ;
+    if (cmp < 0)
+      hi = mid-1 ;
+    else
+      lo = mid+1 ;
+  }
+  return(NULL) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackColumnData() - the data of a column, in place
+  ------------------------------------------------------*/
+const void *
+MRISvpackColumnData(const MRIS_VPACK *vp, const MRIS_VPACK_COLUMN *col)
+{
+  if (!vp->base)
+    return(vp->data[col - vp->columns]) ;
+  return((const char *)vp->base + col->offset) ;
+}
+
+/*-----------------------------------------------------
+  vpackCached() - the cached mapping of pack_fname,
+  (re)reading it if it is new or has changed on disk.
+  Callers hold the mris_vpack_cache critical section.
+  ------------------------------------------------------*/
+static MRIS_VPACK *
+vpackCached(const char *pack_fname)
+{
+  MRIS_VPACK_CACHE *entry, *lru ;
+  struct stat      st ;
+  int              n ;
+
+  if (stat(pack_fname, &st) != 0)
+    return(NULL) ;
+  lru = entry = NULL ;
+  for (n = 0 ; n < MRIS_VPACK_CACHE_SIZE ; n++)
+  {
+    if (vpack_cache[n].vp && !strcmp(vpack_cache[n].vp->fname, pack_fname))
+      entry = &vpack_cache[n] ;
+    if (!lru || vpack_cache[n].used < lru->used)
+      lru = &vpack_cache[n] ;
+  }
+  if (entry && (entry->dev != st.st_dev || entry->ino != st.st_ino ||
+                entry->mtime != st.st_mtime || entry->size != st.st_size))
+    MRISvpackFree(&entry->vp) ;   // replaced since it was mapped
+  if (!entry || !entry->vp)
+  {
+    if (!entry)
+    {
+      entry = lru ;
+      MRISvpackFree(&entry->vp) ;
+    }
+    entry->vp = MRISvpackRead(pack_fname) ;
+    if (!entry->vp)
+      return(NULL) ;
+    entry->dev = st.st_dev ;
+    entry->ino = st.st_ino ;
+    entry->mtime = st.st_mtime ;
+    entry->size = st.st_size ;
+  }
+  entry->used = ++vpack_clock ;
+  return(entry->vp) ;
+}
+
+/*-----------------------------------------------------
+  vpackCopyColumn() - copy column name of pack_fname into
+  a new array. Returns ERROR_NOFILE without a message if
+  there is no such pack or column. With pdata NULL only
+  checks that it is there. Callers hold the
+  mris_vpack_cache critical section.
+  ------------------------------------------------------*/
+static int
+vpackCopyColumn(const char *pack_fname, const char *name, int type,
+                void **pdata, long long *pnbytes)
+{
+  MRIS_VPACK              *vp ;
+  const MRIS_VPACK_COLUMN *col ;
+
+  vp = vpackCached(pack_fname) ;
+  if (!vp)
+    return(ERROR_NOFILE) ;
+  col = MRISvpackFindColumn(vp, name) ;
+  if (!col)
+    return(ERROR_NOFILE) ;
+  if (type && col->type != type)
+    ErrorReturn(ERROR_BADFILE,
+                (ERROR_BADFILE, "%s:%s is of type %d, not %d", pack_fname,
+                 name, col->type, type)) ;
+  if (pnbytes)
+    *pnbytes = col->nbytes ;
+  if (pdata)
+  {
+    *pdata = malloc(col->nbytes > 0 ? col->nbytes : 1) ;
+    if (!*pdata)
+      ErrorExit(ERROR_NOMEMORY, "%s:%s: could not allocate %lld bytes",
+                pack_fname, name, col->nbytes) ;
+    memmove(*pdata, MRISvpackColumnData(vp, col), col->nbytes) ;
+  }
+  return(NO_ERROR) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackOverlayName() - return 1 if fname names a
+  column of a pack, either as <pack>.vpack:<name> or as a
+  file that does not exist but whose <hemi>.vpack (in the
+  same directory or in ../surf) has a column named like
+  it without the hemisphere. pack_fname (STRLEN) and name
+  (MRIS_VPACK_NAME_LEN) may be NULL.
+  ------------------------------------------------------*/
+int
+MRISvpackOverlayName(const char *fname, char *pack_fname, char *name)
+{
+  char path[STRLEN], base[STRLEN], pname[STRLEN], *cp ;
+  int  found, i, ret ;
+
+  cp = strstr(fname, MRIS_VPACK_EXTENSION ":") ;
+  if (cp)
+  {
+    cp += strlen(MRIS_VPACK_EXTENSION) ;
+    if (cp - fname >= STRLEN || strlen(cp+1) >= MRIS_VPACK_NAME_LEN)
+      return(0) ;
+    if (pack_fname)
+    {
+      memmove(pack_fname, fname, cp-fname) ;
+      pack_fname[cp-fname] = 0 ;
+    }
+    if (name)
+      strcpy(name, cp+1) ;
+    return(1) ;
+  }
+
+  if (strlen(fname) >= STRLEN-32 || fio_FileExistsReadable(fname))
+    return(0) ;
+  FileNameOnly(fname, base) ;
+  if ((strncmp(base, "lh.", 3) && strncmp(base, "rh.", 3)) ||
+      strlen(base+3) == 0 || strlen(base+3) >= MRIS_VPACK_NAME_LEN)
+    return(0) ;
+  FileNamePath(fname, path) ;
+  for (found = i = 0 ; !found && i < 2 ; i++)
+  {
+    sprintf(pname, "%s/%s%2.2s%s", path, i == 0 ? "" : "../surf/", base,
+            MRIS_VPACK_EXTENSION) ;
+    if (!fio_FileExistsReadable(pname))
+      continue ;
+#ifdef HAVE_OPENMP
+    #pragma omp critical(mris_vpack_cache)
+#endif
+    ret = vpackCopyColumn(pname, base+3, 0, NULL, NULL) ;
+    found = (ret == NO_ERROR) ;
+  }
+  if (!found)
+    return(0) ;
+  if (pack_fname)
+    strcpy(pack_fname, pname) ;
+  if (name)
+    strcpy(name, base+3) ;
+  return(1) ;
+}
+
+/*-----------------------------------------------------
+  MRISvpackReadOverlay() - copy the column fname names
+  (see MRISvpackOverlayName()), with suffix appended to
+  its name if not NULL, into a new array. type is one of
+  MRIS_VPACK_FLOAT/INT/BYTES, or 0 for any. Returns
+  ERROR_NOFILE without a message if there is no such
+  column.
+  ------------------------------------------------------*/
+int
+MRISvpackReadOverlay(const char *fname, const char *suffix, int type,
+                     void **pdata, long long *pnbytes)
+{
+  char pack_fname[STRLEN], name[STRLEN] ;
+  int  ret ;
+
+  if (!MRISvpackOverlayName(fname, pack_fname, name))
+    return(ERROR_NOFILE) ;
+  if (suffix)
+  {
+    if (strlen(name) + strlen(suffix) >= MRIS_VPACK_NAME_LEN)
+      return(ERROR_NOFILE) ;
+    strcat(name, suffix) ;
+  }
+#ifdef HAVE_OPENMP
+  #pragma omp critical(mris_vpack_cache)
+#endif
+  ret = vpackCopyColumn(pack_fname, name, type, pdata, pnbytes) ;
+  return(ret) ;
+}
@@ -0,0 +1,518 @@
+/**
+ * @file  mrivoxeliter.cpp
+ * @brief whole-volume MRI routines built on the typed voxel iterators
+ *
+ * These are the C entry points (declared in mri.h and mri2.h) whose
+ * inner loops used to call MRIgetVoxVal()/MRIsetVoxVal() per voxel.
+ * See mrivoxeliter.hpp.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <math.h>
+
+#include <stdlib.h>
+
+extern "C"
+{
+#include "mri.h"
+#include "mri2.h"
+#include "macros.h"
+#include "error.h"
+#include "utils.h"
+}
+
+#include "mrivoxeliter.hpp"
+
+using namespace Freesurfer;
+
+// ======================================================
+// Visitors
+
+//! Accumulates count, sum, sum of squares, min and max
+class SegStatsVisitor
+{
+public:
+  SegStatsVisitor( void ) : nvoxels(0), sum(0), sum2(0), min(0), max(0) {};
+
+  template<typename T>
+  inline void operator()( const T v )
+  {
+    const double val = (float)v;
+    nvoxels++;
+    if( nvoxels == 1 )
+    {
+      min = max = val;
+    }
+    if( min > val )
+    {
+      min = val;
+    }
+    if( max < val )
+    {
+      max = val;
+    }
+    sum  += val;
+    sum2 += val*val;
+  }
+
+  int nvoxels;
+  double sum, sum2, min, max;
+};
+
+//! Counts visited voxels
+class CountVisitor
+{
+public:
+  CountVisitor( void ) : n(0) {};
+
+  template<typename T>
+  inline void operator()( const T )
+  {
+    n++;
+  }
+
+  int n;
+};
+
+//! Counts and sums visited voxels
+class MeanVisitor
+{
+public:
+  MeanVisitor( void ) : nvox(0), sum(0) {};
+
+  template<typename T>
+  inline void operator()( const T v )
+  {
+    sum += (float)v;
+    nvox++;
+  }
+
+  int nvox;
+  double sum;
+};
+
+//! Copies visited voxels into a preallocated list
+class GatherVisitor
+{
+public:
+  GatherVisitor( float *_vlist ) : vlist(_vlist), n(0) {};
+
+  template<typename T>
+  inline void operator()( const T v )
+  {
+    vlist[n++] = (float)v;
+  }
+
+  float *vlist;
+  int n;
+};
+
+// ======================================================
+// Dispatchers
+
+//! Runs a visitor over the voxels of mri in which seg has a label.
+//! With xyzOrder the voxels are visited in the order of the original
+//! x,y,z loops, which sums that must not change need.
+template<typename V, typename P>
+class InMaskDispatch
+{
+public:
+  InMaskDispatch( const MRI *_mri, const int _frame,
+                  const MRI *_seg, const int _segFrame,
+                  const P& _pred, V& _v, const bool _xyzOrder = false ) :
+    mri(_mri), frame(_frame), seg(_seg), segFrame(_segFrame),
+    pred(_pred), v(_v), xyzOrder(_xyzOrder) {};
+
+  template<typename T, typename M>
+  void apply( void )
+  {
+    if( xyzOrder )
+    {
+      MRIvisitInMaskXYZ<T,M>( mri, frame, seg, segFrame, pred, v );
+    }
+    else
+    {
+      MRIvisitInMask<T,M>( mri, frame, seg, segFrame, pred, v );
+    }
+  }
+
+private:
+  const MRI *mri;
+  const int frame;
+  const MRI *seg;
+  const int segFrame;
+  const P& pred;
+  V& v;
+  const bool xyzOrder;
+};
+
+//! Sums every frame of mri over the voxels in which seg has a label,
+//! in the x,y,z order of the original loop
+class FrameAvgDispatch
+{
+public:
+  FrameAvgDispatch( const MRI *_mri, const MRI *_seg, const int _segid,
+                    double *_favg ) :
+    nvoxels(0), mri(_mri), seg(_seg), isLabel(_segid), favg(_favg) {};
+
+  template<typename T, typename M>
+  void apply( void )
+  {
+    for( int x=0; x<seg->width; x++ )
+    {
+      for( int y=0; y<seg->height; y++ )
+      {
+        for( int z=0; z<seg->depth; z++ )
+        {
+          if( !isLabel( MRItypedRow<M>( seg, y, z, 0 )[x] ) )
+          {
+            continue;
+          }
+          for( int f=0; f<mri->nframes; f++ )
+          {
+            favg[f] += (float)MRItypedRow<T>( mri, y, z, f )[x];
+          }
+          nvoxels++;
+        }
+      }
+    }
+  }
+
+  int nvoxels;
+
+private:
+  const MRI *mri;
+  const MRI *seg;
+  const MRImaskIsLabel isLabel;
+  double *favg;
+};
+
+//! Runs MRItransformVoxels with the given operation
+template<typename Op>
+class TransformDispatch
+{
+public:
+  TransformDispatch( const MRI *_src, MRI *_dst, const Op& _op ) :
+    src(_src), dst(_dst), op(_op) {};
+
+  template<typename T1, typename T2>
+  void apply( void )
+  {
+    MRItransformVoxels<T1,T2>( src, dst, op );
+  }
+
+private:
+  const MRI *src;
+  MRI *dst;
+  const Op& op;
+};
+
+// ======================================================
+// Voxel operations
+
+//! val < threshold ? low : high
+class BinarizeOp
+{
+public:
+  BinarizeOp( const float _thresh, const float _low, const float _high ) :
+    thresh(_thresh), low(_low), high(_high) {};
+
+  inline float operator()( const float val ) const
+  {
+    return( val < thresh ? low : high );
+  }
+
+private:
+  const float thresh, low, high;
+};
+
+//! val > 0 ? 1 : val
+class BinarizeNoThresholdOp
+{
+public:
+  inline float operator()( const float val ) const
+  {
+    return( val > 0 ? 1 : val );
+  }
+};
+
+//! val*scale+offset, optionally leaving zeros alone
+class LinearScaleOp
+{
+public:
+  LinearScaleOp( const float _scale, const float _offset,
+                 const int _onlyNonzero, const int _clipUchar ) :
+    scale(_scale), offset(_offset),
+    onlyNonzero(_onlyNonzero), clipUchar(_clipUchar) {};
+
+  inline float operator()( float val ) const
+  {
+    if( !onlyNonzero || !DZERO(val) )
+    {
+      val = val*scale+offset;
+    }
+    if( clipUchar )
+    {
+      if( val > 255 )
+      {
+        val = 255;
+      }
+      else if( val < 0 )
+      {
+        val = 0;
+      }
+    }
+    return( val );
+  }
+
+private:
+  const float scale, offset;
+  const int onlyNonzero, clipUchar;
+};
+
+// ======================================================
+// C entry points
+
+/*---------------------------------------------------------
+  MRIsegStats() - computes statistics within a given
+  segmentation. Returns the number of voxels in the
+  segmentation.
+  ---------------------------------------------------------*/
+extern "C" int
+MRIsegStats(MRI *seg, int segid, MRI *mri,int frame,
+            float *min, float *max, float *range,
+            float *mean, float *std)
+{
+  SegStatsVisitor stats;
+  MRImaskIsLabel isLabel( segid );
+  InMaskDispatch<SegStatsVisitor,MRImaskIsLabel>
+    dispatch( mri, frame, seg, 0, isLabel, stats, true );
+  MRIdispatchType2( mri, seg, dispatch );
+
+  const int nvoxels = stats.nvoxels;
+  const double sum = stats.sum;
+
+  *min = stats.min;
+  *max = stats.max;
+  *range = *max - *min;
+
+  if (nvoxels != 0)
+  {
+    *mean = sum/nvoxels;
+  }
+  else
+  {
+    *mean = 0.0;
+  }
+
+  if (nvoxels > 1)
+    *std = sqrt(((nvoxels)*(*mean)*(*mean) - 2*(*mean)*sum + stats.sum2)/
+                (nvoxels-1));
+  else
+  {
+    *std = 0.0;
+  }
+
+  return(nvoxels);
+}
+
+/*------------------------------------------------------------*/
+/*!
+  \fn int MRIsegStatsRobust(MRI *seg, int segid, MRI *mri,int frame,
+		      float *min, float *max, float *range,
+		      float *mean, float *std, float Pct)
+  \brief Computes stats based on the the middle 100-2*Pct values, ie,
+         it trims Pct off the ends.
+*/
+extern "C" int
+MRIsegStatsRobust(MRI *seg, int segid, MRI *mri,int frame,
+                  float *min, float *max, float *range,
+                  float *mean, float *std, float Pct)
+{
+  int nvoxels,k,m;
+  double val, sum, sum2;
+  float *vlist;
+
+  *min = 0;
+  *max = 0;
+  *range = 0;
+  *mean = 0;
+  *std = 0;
+
+  // Count number of voxels
+  CountVisitor count;
+  MRImaskIsLabel isLabel( segid );
+  InMaskDispatch<CountVisitor,MRImaskIsLabel>
+    countDispatch( mri, frame, seg, 0, isLabel, count );
+  MRIdispatchType2( mri, seg, countDispatch );
+  nvoxels = count.n;
+  if(nvoxels == 0) return(nvoxels);
+
+  // Load voxels into an array
+  vlist = (float *) calloc(sizeof(float),nvoxels);
+  if (!vlist)
+    ErrorExit(ERROR_NOMEMORY,
+              "MRIsegStatsRobust: could not allocate %d values", nvoxels);
+  GatherVisitor gather( vlist );
+  InMaskDispatch<GatherVisitor,MRImaskIsLabel>
+    gatherDispatch( mri, frame, seg, 0, isLabel, gather, true );
+  MRIdispatchType2( mri, seg, gatherDispatch );
+
+  // Sort the array
+  qsort((void *) vlist, nvoxels, sizeof(float), compare_floats);
+
+  // Compute stats excluding Pct of the values from each end
+  sum  = 0;
+  sum2 = 0;
+  m = 0;
+  for(k=0; k < nvoxels; k++){
+    if(k < Pct*nvoxels/100.0)       continue;
+    if(k > (100-Pct)*nvoxels/100.0) continue;
+    val = vlist[k];
+    if(m == 0){
+      *min = val;
+      *max = val;
+    }
+    if (*min > val) *min = val;
+    if (*max < val) *max = val;
+    sum  += val;
+    sum2 += (val*val);
+    m = m + 1;
+  }
+
+  *range = *max - *min;
+  *mean = sum/m;
+  if(m > 1)
+    *std = sqrt(((m)*(*mean)*(*mean) - 2*(*mean)*sum + sum2)/
+                (m-1));
+  else *std = 0.0;
+
+  free(vlist);
+  vlist = NULL;
+  return(m);
+}
+
+/*---------------------------------------------------------
+  MRIsegFrameAvg() - computes the average time course withing the
+  given segmentation. Returns the number of voxels in the
+  segmentation. favg must be preallocated to number of
+  frames. favg = (double *) calloc(sizeof(double),mri->nframes);
+  ---------------------------------------------------------*/
+extern "C" int
+MRIsegFrameAvg(MRI *seg, int segid, MRI *mri, double *favg)
+{
+  int f;
+
+  /* zero it out */
+  for (f=0; f<mri->nframes; f++)
+  {
+    favg[f] = 0;
+  }
+
+  FrameAvgDispatch dispatch( mri, seg, segid, favg );
+  MRIdispatchType2( mri, seg, dispatch );
+
+  if (dispatch.nvoxels != 0)
+    for (f=0; f<mri->nframes; f++)
+    {
+      favg[f] /= dispatch.nvoxels;
+    }
+
+  return(dispatch.nvoxels);
+}
+
+/* ----------------------------------------------------------
+   MRIsegCount() - returns the number of times the given
+   segmentation id appears in the volume.
+   --------------------------------------------------------- */
+extern "C" int
+MRIsegCount(MRI *seg, int id, int frame)
+{
+  CountVisitor count;
+  MRImaskIsLabel isLabel( id );
+  InMaskDispatch<CountVisitor,MRImaskIsLabel>
+    dispatch( seg, frame, seg, frame, isLabel, count );
+  MRIdispatchType2( seg, seg, dispatch );
+  return(count.n);
+}
+
+/*-----------------------------------------------------
+  MRImeanInLabel() - mean of frame 0 of mri_src over the
+  voxels of mri_labeled whose (rounded) value is label.
+  ------------------------------------------------------*/
+extern "C" double
+MRImeanInLabel(MRI *mri_src, MRI *mri_labeled, int label)
+{
+  MeanVisitor mean;
+  MRImaskIsLabelRounded isLabel( label );
+  InMaskDispatch<MeanVisitor,MRImaskIsLabelRounded>
+    dispatch( mri_src, 0, mri_labeled, 0, isLabel, mean, true );
+  MRIdispatchType2( mri_src, mri_labeled, dispatch );
+
+  if (!mean.nvox)
+    mean.nvox = 1 ;
+  return(mean.sum/mean.nvox) ;
+}
+
+/*-----------------------------------------------------
+  MRIbinarize() - threshold an MRI: voxels below threshold
+  get low_val, the rest hi_val.
+  ------------------------------------------------------*/
+extern "C" MRI *
+MRIbinarize(MRI *mri_src, MRI *mri_dst, float threshold, float low_val,
+            float hi_val)
+{
+  if (!mri_dst)
+    mri_dst = MRIclone(mri_src, NULL) ;
+
+  BinarizeOp op( threshold, low_val, hi_val );
+  TransformDispatch<BinarizeOp> dispatch( mri_src, mri_dst, op );
+  MRIdispatchType2( mri_src, mri_dst, dispatch );
+
+  return(mri_dst) ;
+}
+
+/*-----------------------------------------------------
+  MRIbinarizeNoThreshold() - set all positive voxels to 1
+  ------------------------------------------------------*/
+extern "C" MRI *
+MRIbinarizeNoThreshold(MRI *mri_src, MRI *mri_dst)
+{
+  if (!mri_dst)
+    mri_dst = MRIclone(mri_src, NULL) ;
+
+  BinarizeNoThresholdOp op;
+  TransformDispatch<BinarizeNoThresholdOp> dispatch( mri_src, mri_dst, op );
+  MRIdispatchType2( mri_src, mri_dst, dispatch );
+
+  return(mri_dst) ;
+}
+
+/*-----------------------------------------------------
+  MRIlinearScale() - dst = src*scale+offset over all
+  frames. If only_nonzero, zero voxels are left alone.
+  ------------------------------------------------------*/
+extern "C" MRI *
+MRIlinearScale(MRI *mri_src, MRI *mri_dst, float scale, float offset,
+               int only_nonzero)
+{
+  if (!mri_dst)
+    mri_dst = MRIclone(mri_src, NULL) ;
+
+  LinearScaleOp op( scale, offset, only_nonzero, mri_dst->type == MRI_UCHAR );
+  TransformDispatch<LinearScaleOp> dispatch( mri_src, mri_dst, op );
+  MRIdispatchType2( mri_src, mri_dst, dispatch );
+
+  return(mri_dst) ;
+}
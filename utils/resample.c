@@ -62,6 +62,7 @@
 #include <string.h>
 #include <math.h>
 #include "diag.h"
+#include "error.h"
 #include "matrix.h"
 #include "mri.h"
 #include "mri2.h"
@@ -892,7 +893,10 @@ MRI *vol2surf_linear(MRI *SrcVol,
 		  int ReverseMapFlag, int DoJac, int UseHash)
 \brief Applies one or more surface registrations with or without jacobian correction. 
 This should be used as a replacement for surf2surf_nnfr and surf2surf_nnfr_jac
-(it gives identical results).
+(it gives identical results). The mapping is built with MRISapplyRegMap() and
+applied to all frames as one sparse multiply. If FS_SURFREG_MAP_CACHE names a
+directory, the map is kept there (see MRISapplyRegMapCached()) so that later
+runs with the same surfaces skip the search.
 \param MRI *SrcSurfVals - Inputs
 \param MRIS **SurfReg - array of surface reg pairs, src1-trg1:src2-trg2:... where 
 trg1 and src2 are from the same anatomy.
@@ -904,29 +908,90 @@ trg1 and src2 are from the same anatomy.
 MRI *MRISapplyReg(MRI *SrcSurfVals, MRI_SURFACE **SurfReg, int nsurfs,
 		  int ReverseMapFlag, int DoJac, int UseHash)
 {
-  MRI *TrgSurfVals = NULL;
-  MRI_SURFACE *SrcSurfReg, *TrgSurfReg;
-  int svtx=0, tvtx, tvtxN, svtxN=0, f, n, nrevhits,nSrcLost;
-  int npairs, kS, kT, nhits, nunmapped;
-  VERTEX *v;
-  float dmin;
-  MHT **Hash=NULL;
-  MRI *SrcHits, *TrgHits;
+  MRI *TrgSurfVals;
+  MRIS_CSR *map;
+  char *cachedir, mapfile[STRLEN];
 
-  npairs = nsurfs/2;
   printf("MRISapplyReg: nsurfs = %d, revmap=%d, jac=%d,  hash=%d\n",
 	 nsurfs,ReverseMapFlag,DoJac,UseHash);
 
-  SrcSurfReg = SurfReg[0];
-  TrgSurfReg = SurfReg[nsurfs-1];
-
   /* check dimension consistency */
-  if (SrcSurfVals->width != SrcSurfReg->nvertices){
+  if (SrcSurfVals->width != SurfReg[0]->nvertices){
     printf("MRISapplyReg: Vals and Reg dimension mismatch\n");
     printf("nVals = %d, nReg %d\n",SrcSurfVals->width,
-            SrcSurfReg->nvertices);
+            SurfReg[0]->nvertices);
     return(NULL);
   }
+
+  cachedir = getenv("FS_SURFREG_MAP_CACHE");
+  if(cachedir){
+    sprintf(mapfile,"%s/surfreg.%016llx.csr",cachedir,
+	    MRISapplyRegKey(SurfReg,nsurfs,ReverseMapFlag,DoJac));
+    map = MRISapplyRegMapCached(SurfReg,nsurfs,ReverseMapFlag,DoJac,UseHash,mapfile);
+  }
+  else map = MRISapplyRegMap(SurfReg,nsurfs,ReverseMapFlag,DoJac,UseHash);
+  if(map == NULL) return(NULL);
+
+  TrgSurfVals = MRIScsrApplyMRI(map, SrcSurfVals, NULL);
+  MRIScsrFree(&map);
+  return(TrgSurfVals);
+}
+
+/* follows the chain of closest-vertex lookups from vertex vno of
+   SurfReg[first] to the last surface of the chain, forward (pairs
+   npairs-1..0, target to source) or reverse (0..npairs-1) */
+static int applyRegChain(MRI_SURFACE **SurfReg, MHT **Hash, int npairs,
+			 int vno, int reverse)
+{
+  int n, kS, kT, kFrom, kTo, vnoN = vno;
+  VERTEX *v;
+  float dmin;
+
+  for(n=0; n < npairs; n++){
+    kS = reverse ? 2*n : 2*(npairs-1-n);
+    kT = kS + 1;
+    kFrom = reverse ? kS : kT;
+    kTo   = reverse ? kT : kS;
+    v = &(SurfReg[kFrom]->vertices[vnoN]);
+    vno = -1;
+    if(Hash) vno = MHTfindClosestVertexNo(Hash[kTo],SurfReg[kTo],v,&dmin);
+    if(!Hash || vno < 0){
+      if(Hash) printf("%s vertex %d of pair %d unmapped in hash, using brute force\n",
+		      reverse ? "Source" : "Target",vnoN,kS/2);
+      vno = MRISfindClosestVertex(SurfReg[kTo],v->x,v->y,v->z,&dmin);
+    }
+    vnoN = vno;
+  }
+  return(vnoN);
+}
+
+/*!
+\fn MRIS_CSR *MRISapplyRegMap(MRI_SURFACE **SurfReg, int nsurfs,
+		  int ReverseMapFlag, int DoJac, int UseHash)
+\brief Builds the resampling done by MRISapplyReg() as a sparse
+ntrg x nsrc operator (see mriscsr.c): each target vertex row holds the
+source vertex the forward loop maps to it followed by the source
+vertices the reverse loop adds, in source vertex order. Without
+jacobian correction the rows are plain averages, so applying the map
+is bit-identical to the old accumulate-and-divide loops; with it each
+forward entry is weighted by 1/(number of targets sharing its source).
+The closest-vertex searches run in parallel. csr->key is set to
+MRISapplyRegKey().
+*/
+MRIS_CSR *MRISapplyRegMap(MRI_SURFACE **SurfReg, int nsurfs,
+			  int ReverseMapFlag, int DoJac, int UseHash)
+{
+  MRI_SURFACE *SrcSurfReg, *TrgSurfReg;
+  MRIS_CSR *map;
+  MHT **Hash=NULL;
+  int npairs, n, kS, kT, svtx, tvtx, nrevhits, nSrcLost, k;
+  int *fwd, *rev, *SrcHits, *TrgHits;
+  struct timeb mytimer;
+
+  TimerStart(&mytimer);
+  npairs = nsurfs/2;
+  SrcSurfReg = SurfReg[0];
+  TrgSurfReg = SurfReg[nsurfs-1];
   for(n=0; n < npairs-1; n++){
     kS = 2*n+1;
     kT = kS+1;
@@ -937,154 +1002,158 @@ MRI *MRISapplyReg(MRI *SrcSurfVals, MRI_SURFACE **SurfReg, int nsurfs,
     }
   }
 
-  /* allocate a "volume" to hold the output */
-  TrgSurfVals = MRIallocSequence(TrgSurfReg->nvertices,1,1,
-                                 MRI_FLOAT,SrcSurfVals->nframes);
-  if(TrgSurfVals == NULL) return(NULL);
-  MRIcopyHeader(SrcSurfVals,TrgSurfVals);
-
-  /* number of source vertices mapped to each target vertex */
-  TrgHits = MRIallocSequence(TrgSurfReg->nvertices,1,1,MRI_FLOAT,1);
-  if(TrgHits == NULL) return(NULL);
-  MRIcopyHeader(SrcSurfVals,TrgHits);
-
-  /* number of target vertices mapped to by each source vertex */
-  SrcHits = MRIallocSequence(SrcSurfReg->nvertices,1,1,MRI_FLOAT,1);
-  if (SrcHits == NULL) return(NULL);
-  MRIcopyHeader(SrcSurfVals,SrcHits);
-
   if(UseHash){
     printf("MRISapplyReg: building hash tables (res=16).\n");
     Hash = (MHT **)calloc(sizeof(MHT*),nsurfs);
-    for(n=0; n < nsurfs; n++){
-      Hash[n] = (MHT *)calloc(sizeof(MHT),1);
+    for(n=0; n < nsurfs; n++)
       Hash[n] = MHTfillVertexTableRes(SurfReg[n], NULL,CURRENT_VERTICES,16);
-    }
   }
 
-  if(DoJac){
-    // If using jacobian correction, get a list of the number of times
-    // that a give source vertex gets sampled.
-    for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++){
-      // Compute the source vertex that corresponds to this target vertex
-      tvtxN = tvtx;
-      for(n=npairs-1; n >= 0; n--){
-	kS = 2*n;
-	kT = kS + 1;
-	v = &(SurfReg[kT]->vertices[tvtxN]);
-	/* find closest source vertex */
-	if (UseHash) svtx = MHTfindClosestVertexNo(Hash[kS],SurfReg[kS],v,&dmin);
-	else         svtx = MRISfindClosestVertex(SurfReg[kS],v->x,v->y,v->z,&dmin);
-	tvtxN = svtx;
-      }
-      /* update the number of hits and distance */
-      MRIFseq_vox((SrcHits),svtx,0,0,0) ++;
-      MRIFseq_vox((TrgHits),tvtx,0,0,0) ++;
-    }
-  }
+  fwd = (int *)calloc(TrgSurfReg->nvertices,sizeof(int));
+  rev = (int *)calloc(SrcSurfReg->nvertices,sizeof(int));
+  SrcHits = (int *)calloc(SrcSurfReg->nvertices,sizeof(int));
+  TrgHits = (int *)calloc(TrgSurfReg->nvertices+1,sizeof(int));
 
   /* Go through the forwad loop (finding closest srcvtx to each trgvtx).
   This maps each target vertex to a source vertex */
   printf("MRISapplyReg: Forward Loop (%d)\n",TrgSurfReg->nvertices);
-  nunmapped = 0;
+#ifdef HAVE_OPENMP
+  #pragma omp parallel for schedule(dynamic, 1024)
+#endif
+  for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++)
+    fwd[tvtx] = applyRegChain(SurfReg,Hash,npairs,tvtx,0);
   for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++){
-    if (!UseHash){
-      if (tvtx%100 == 0){printf("%5d ",tvtx);fflush(stdout);}
-      if(tvtx%1000 == 999){printf("\n");fflush(stdout);}
-    }
-
-    // Compute the source vertex that corresponds to this target vertex
-    tvtxN = tvtx;
-    for(n=npairs-1; n >= 0; n--){
-      kS = 2*n;
-      kT = kS + 1;
-      //printf("%5d %5d %d %d %d\n",tvtx,tvtxN,n,kS,kT);
-      v = &(SurfReg[kT]->vertices[tvtxN]);
-      /* find closest source vertex */
-      if(UseHash) svtx = MHTfindClosestVertexNo(Hash[kS],SurfReg[kS],v,&dmin);
-      if(!UseHash || svtx < 0){
-	if(svtx < 0) printf("Target vertex %d of pair %d unmapped in hash, using brute force\n",tvtxN,n);
-	svtx = MRISfindClosestVertex(SurfReg[kS],v->x,v->y,v->z,&dmin);
-      }
-      tvtxN = svtx;
-    }
-
-    if(! DoJac){
-      /* update the number of hits */
-      MRIFseq_vox(SrcHits,svtx,0,0,0) ++;
-      MRIFseq_vox(TrgHits,tvtx,0,0,0) ++;
-      nhits = 1;
-    } 
-    else nhits = MRIgetVoxVal(SrcHits,svtx,0,0,0);
-
-    /* accumulate mapped values for each frame */
-    for (f=0; f < SrcSurfVals->nframes; f++)
-      MRIFseq_vox(TrgSurfVals,tvtx,0,0,f) += (MRIFseq_vox(SrcSurfVals,svtx,0,0,f)/nhits);
+    SrcHits[fwd[tvtx]] ++;
+    TrgHits[tvtx] ++;
   }
 
   /*---------------------------------------------------------------
   Go through the reverse loop (finding closest trgvtx to each srcvtx
   unmapped by the forward loop). This assures that each source vertex
   is represented in the map */
+  for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++) rev[svtx] = -1;
   if(ReverseMapFlag){
     printf("MRISapplyReg: Reverse Loop (%d)\n",SrcSurfReg->nvertices);
+#ifdef HAVE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 1024)
+#endif
+    for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++)
+      if(SrcHits[svtx] == 0) rev[svtx] = applyRegChain(SurfReg,Hash,npairs,svtx,1);
     nrevhits = 0;
-    for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++) {
-      if(MRIFseq_vox((SrcHits),svtx,0,0,0) != 0) continue;
+    for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++){
+      if(rev[svtx] < 0) continue;
       nrevhits ++;
-
-      // Compute the target vertex that corresponds to this source vertex
-      svtxN = svtx;
-      for(n=0; n < npairs; n++){
-	kS = 2*n;
-	kT = kS + 1;
-	//printf("%5d %5d %d %d %d\n",svtx,svtxN,n,kS,kT);
-	v = &(SurfReg[kS]->vertices[svtxN]);
-	/* find closest target vertex */
-	if (UseHash) tvtx = MHTfindClosestVertexNo(Hash[kT],SurfReg[kT],v,&dmin);
-	if(!UseHash || tvtx < 0){
-	  if(tvtx < 0) printf("Source vertex %d of pair %d unmapped in hash, using brute force\n",svtxN,n);
-	  tvtx = MRISfindClosestVertex(SurfReg[kT],v->x,v->y,v->z,&dmin);
-	}
-	svtxN = tvtx;
-      }
-      
-      /* update the number of hits */
-      MRIFseq_vox((SrcHits),svtx,0,0,0) ++;
-      MRIFseq_vox((TrgHits),tvtx,0,0,0) ++;
-      /* accumulate mapped values for each frame */
-      for (f=0; f < SrcSurfVals->nframes; f++)
-	MRIFseq_vox(TrgSurfVals,tvtx,0,0,f) += MRIFseq_vox(SrcSurfVals,svtx,0,0,f);
+      TrgHits[rev[svtx]] ++;
     }
     printf("  Reverse Loop had %d hits\n",nrevhits);
   }
-  
-  /*---------------------------------------------------------------
-  Finally, divide the value at each target vertex by the number
-  of source vertices mapping into it */
-  if(! DoJac){
-    printf("MRISapplyReg: Dividing by number of hits (%d)\n",TrgSurfReg->nvertices);
-    for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++) {
-      n = MRIFseq_vox((TrgHits),tvtx,0,0,0);
-      if (n > 1){
-	for (f=0; f < SrcSurfVals->nframes; f++)
-	  MRIFseq_vox(TrgSurfVals,tvtx,0,0,f) /= n;
-      }
-    }
-  }
 
   /* Count lost sources */
   nSrcLost = 0;
+  for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++)
+    if(SrcHits[svtx] == 0 && rev[svtx] < 0) nSrcLost ++;
+  printf("MRISapplyReg: nSrcLost = %d\n",nSrcLost);
+
+  /* Fill the rows: the forward source first, then the reverse ones.
+  TrgHits becomes the next free slot of each row. */
+  n = 0;
+  for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++) n += TrgHits[tvtx];
+  map = MRIScsrAlloc(TrgSurfReg->nvertices,SrcSurfReg->nvertices,n,DoJac);
+  for (tvtx = 0; tvtx < TrgSurfReg->nvertices; tvtx++){
+    map->row_start[tvtx+1] = map->row_start[tvtx] + TrgHits[tvtx];
+    k = map->row_start[tvtx];
+    map->col[k] = fwd[tvtx];
+    if(DoJac) map->w[k] = 1.0/SrcHits[fwd[tvtx]];
+    TrgHits[tvtx] = k+1;
+  }
   for (svtx = 0; svtx < SrcSurfReg->nvertices; svtx++){
-    n = MRIFseq_vox((SrcHits),svtx,0,0,0);
-    if (n == 0)nSrcLost ++;
+    if(rev[svtx] < 0) continue;
+    k = TrgHits[rev[svtx]]++;
+    map->col[k] = svtx;
+    if(DoJac) map->w[k] = 1.0;
+  }
+  map->key = MRISapplyRegKey(SurfReg,nsurfs,ReverseMapFlag,DoJac);
+
+  if(Gdiag_no > 0)
+    printf("MRISapplyRegMap: %d entries, tsec = %g\n",map->nnz,
+	   TimerStop(&mytimer)/1000.0);
+  free(fwd);
+  free(rev);
+  free(SrcHits);
+  free(TrgHits);
+  if (UseHash) {
+    for(n=0; n < nsurfs; n++) MHTfree(&Hash[n]);
+    free(Hash);
   }
-  printf("MRISapplyReg: nSrcLost = %d\n",nSrcLost);
+  return(map);
+}
 
-  MRIfree(&SrcHits);
-  MRIfree(&TrgHits);
-  if (UseHash) for(n=0; n < nsurfs; n++) MHTfree(&Hash[n]);
-  return(TrgSurfVals);
+/*!
+\fn unsigned long long MRISapplyRegKey(MRI_SURFACE **SurfReg, int nsurfs,
+		  int ReverseMapFlag, int DoJac)
+\brief 64 bit hash of the vertex coordinates of all the surfaces and of the
+options that change the map built by MRISapplyRegMap(). A stored map whose
+key differs was built from other surfaces.
+*/
+unsigned long long MRISapplyRegKey(MRI_SURFACE **SurfReg, int nsurfs,
+				   int ReverseMapFlag, int DoJac)
+{
+  unsigned long long h = MRIS_CSR_HASH_INIT;
+  int n, vno, flags[3];
+  VERTEX *v;
+
+  flags[0] = nsurfs;
+  flags[1] = ReverseMapFlag;
+  flags[2] = DoJac;
+  h = MRIScsrHashBytes(h, flags, sizeof(flags));
+  for(n=0; n < nsurfs; n++){
+    h = MRIScsrHashBytes(h, &SurfReg[n]->nvertices, sizeof(int));
+    for(vno=0; vno < SurfReg[n]->nvertices; vno++){
+      v = &SurfReg[n]->vertices[vno];
+      h = MRIScsrHashBytes(h, &v->x, sizeof(float));
+      h = MRIScsrHashBytes(h, &v->y, sizeof(float));
+      h = MRIScsrHashBytes(h, &v->z, sizeof(float));
+      h = MRIScsrHashBytes(h, &v->ripflag, sizeof(v->ripflag));
+    }
+  }
+  return(h);
+}
+
+/*!
+\fn MRIS_CSR *MRISapplyRegMapCached(MRI_SURFACE **SurfReg, int nsurfs,
+		  int ReverseMapFlag, int DoJac, int UseHash, const char *mapfile)
+\brief Reads the map from mapfile if it exists and was built from these
+surfaces with these options (same MRISapplyRegKey()), otherwise builds it
+with MRISapplyRegMap() and writes it to mapfile. A stale or unreadable
+mapfile is replaced.
+*/
+MRIS_CSR *MRISapplyRegMapCached(MRI_SURFACE **SurfReg, int nsurfs,
+				int ReverseMapFlag, int DoJac, int UseHash,
+				const char *mapfile)
+{
+  MRIS_CSR *map;
+  unsigned long long key;
+  FILE *fp;
+
+  key = MRISapplyRegKey(SurfReg,nsurfs,ReverseMapFlag,DoJac);
+  fp = fopen(mapfile,"rb");
+  if(fp){
+    fclose(fp);
+    map = MRIScsrRead(mapfile);
+    if(map && map->key == key && map->nrows == SurfReg[nsurfs-1]->nvertices &&
+       map->ncols == SurfReg[0]->nvertices){
+      printf("MRISapplyReg: using map %s\n",mapfile);
+      return(map);
+    }
+    printf("MRISapplyReg: %s is stale, rebuilding it\n",mapfile);
+    if(map) MRIScsrFree(&map);
+  }
+
+  map = MRISapplyRegMap(SurfReg,nsurfs,ReverseMapFlag,DoJac,UseHash);
+  if(map == NULL) return(NULL);
+  if(MRIScsrWrite(map,mapfile) == NO_ERROR)
+    printf("MRISapplyReg: wrote map %s\n",mapfile);
+  return(map);
 }
 
 /*----------------------------------------------------------------
@@ -0,0 +1,99 @@
+/**
+ * @file  bench.c
+ * @brief helpers shared by the utils/test timing programs
+ *
+ * See bench.h.
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "bench.h"
+#include "error.h"
+
+extern const char *Progname ;
+
+/*-----------------------------------------------------
+  BenchUsage() - exit with a usage line unless at least
+  nrequired arguments were given
+  ------------------------------------------------------*/
+void
+BenchUsage(int argc, int nrequired, const char *args)
+{
+  if (argc-1 < nrequired)
+  {
+    printf("usage: %s %s\n", Progname, args) ;
+    exit(1) ;
+  }
+}
+
+/*-----------------------------------------------------
+  BenchReadSurface() - read a surface or exit, and
+  print its size
+  ------------------------------------------------------*/
+MRI_SURFACE *
+BenchReadSurface(const char *fname)
+{
+  MRI_SURFACE *mris ;
+
+  mris = MRISread((char *)fname) ;
+  if (!mris)
+    ErrorExit(ERROR_NOFILE, "%s: could not read surface %s", Progname, fname) ;
+  printf("%s: %d vertices, %d faces\n", fname, mris->nvertices, mris->nfaces) ;
+  return(mris) ;
+}
+
+/*-----------------------------------------------------
+  BenchMaxAbsDiff() - largest absolute difference
+  between frame 0 of two volumes, and optionally the
+  mean difference
+  ------------------------------------------------------*/
+double
+BenchMaxAbsDiff(MRI *mri1, MRI *mri2, double *pmean)
+{
+  int    x, y, z ;
+  double diff, max_diff = 0, total = 0 ;
+
+  for (z = 0 ; z < mri1->depth ; z++)
+    for (y = 0 ; y < mri1->height ; y++)
+      for (x = 0 ; x < mri1->width ; x++)
+      {
+        diff = fabs(MRIgetVoxVal(mri1, x, y, z, 0) -
+                    MRIgetVoxVal(mri2, x, y, z, 0)) ;
+        total += diff ;
+        if (diff > max_diff)
+          max_diff = diff ;
+      }
+  if (pmean)
+    *pmean = total / ((double)mri1->width*mri1->height*mri1->depth) ;
+  return(max_diff) ;
+}
+
+/*-----------------------------------------------------
+  BenchExit() - print PASS, or FAIL with what went
+  wrong, and exit accordingly
+  ------------------------------------------------------*/
+void
+BenchExit(int bad, const char *what)
+{
+  if (bad)
+  {
+    printf("FAIL: %s\n", what) ;
+    exit(1) ;
+  }
+  printf("PASS\n") ;
+  exit(0) ;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file  bench.h
+ * @brief helpers shared by the utils/test timing programs
+ *
+ * Each bench defines Progname, times the old and new code paths with
+ * BENCH_TIME, checks that they agree and ends with BenchExit().
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "mri.h"
+#include "mrisurf.h"
+#include "timer.h"
+
+// runs the statements and puts their wall time in msec
+#define BENCH_TIME(msec, ...)                 \
+  {                                           \
+    struct timeb bench_start ;                \
+    TimerStart(&bench_start) ;                \
+    __VA_ARGS__ ;                             \
+    (msec) = TimerStop(&bench_start) ;        \
+  }
+
+void        BenchUsage(int argc, int nrequired, const char *args) ;
+MRI_SURFACE *BenchReadSurface(const char *fname) ;
+double      BenchMaxAbsDiff(MRI *mri1, MRI *mri2, double *pmean) ;
+void        BenchExit(int bad, const char *what) ;
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file  mri_brick_bench.c
+ * @brief compare the row and bricked MRI voxel layouts
+ *
+ * Times MRIconvolveGaussian, MRIdilate/MRIerode and MRIsampleVolume on a
+ * synthetic hires-sized volume allocated with the default row layout and
+ * with the bricked layout (FS_MRI_BRICK), and checks the results agree.
+ *
+ * usage: mri_brick_bench [dim [brick_size [sigma]]]
+ *   defaults are 366 (0.7mm over 256mm), 8 and 1.0
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mri.h"
+#include "error.h"
+#include "bench.h"
+
+const char *Progname = "mri_brick_bench" ;
+
+#define NSAMPLES 5000000
+
+typedef struct
+{
+  int    conv_msec, morph_msec, sample_msec ;
+  double sample_sum ;
+  MRI    *mri_conv, *mri_morph ;
+} BENCH_RESULT ;
+
+static MRI *
+make_volume(int dim, int type)
+{
+  MRI *mri ;
+  int x, y, z ;
+
+  mri = MRIalloc(dim, dim, dim, type) ;
+  srand(17) ;
+  for (z = 0 ; z < dim ; z++)
+    for (y = 0 ; y < dim ; y++)
+      for (x = 0 ; x < dim ; x++)
+      {
+        if (type == MRI_UCHAR)
+          MRIsetVoxVal(mri, x, y, z, 0, (rand() % 16) == 0 ? 1 : 0) ;
+        else
+          MRIsetVoxVal(mri, x, y, z, 0, (float)(rand() % 1000) / 10.0f) ;
+      }
+  return(mri) ;
+}
+
+static void
+run_bench(int dim, float sigma, BENCH_RESULT *br)
+{
+  MRI    *mri_float, *mri_uchar, *mri_kernel, *mri_tmp ;
+  int    n ;
+  double x, y, z, val ;
+
+  mri_float = make_volume(dim, MRI_FLOAT) ;
+  mri_uchar = make_volume(dim, MRI_UCHAR) ;
+  mri_kernel = MRIgaussian1d(sigma, -1) ;
+
+  BENCH_TIME(br->conv_msec,
+             br->mri_conv = MRIconvolveGaussian(mri_float, NULL, mri_kernel)) ;
+
+  BENCH_TIME(br->morph_msec,
+             mri_tmp = MRIdilate(mri_uchar, NULL) ;
+             br->mri_morph = MRIerode(mri_tmp, NULL)) ;
+  MRIfree(&mri_tmp) ;
+
+  srand(23) ;
+  br->sample_sum = 0 ;
+  BENCH_TIME(br->sample_msec,
+             for (n = 0 ; n < NSAMPLES ; n++)
+             {
+               x = (dim-1) * (double)rand() / RAND_MAX ;
+               y = (dim-1) * (double)rand() / RAND_MAX ;
+               z = (dim-1) * (double)rand() / RAND_MAX ;
+               MRIsampleVolume(mri_float, x, y, z, &val) ;
+               br->sample_sum += val ;
+             }) ;
+
+  MRIfree(&mri_kernel) ;
+  MRIfree(&mri_uchar) ;
+  MRIfree(&mri_float) ;
+}
+
+int
+main(int argc, char *argv[])
+{
+  BENCH_RESULT br_row, br_brick ;
+  int          dim = 366, brick_size = MRI_DEFAULT_BRICK_SIZE ;
+  float        sigma = 1.0 ;
+  char         str[STRLEN] ;
+  double       conv_diff, morph_diff ;
+
+  if (argc > 1) dim = atoi(argv[1]) ;
+  if (argc > 2) brick_size = atoi(argv[2]) ;
+  if (argc > 3) sigma = atof(argv[3]) ;
+
+  printf("volume %d^3, brick size %d, sigma %2.2f\n", dim, brick_size, sigma) ;
+
+  unsetenv("FS_MRI_BRICK") ;
+  run_bench(dim, sigma, &br_row) ;
+
+  sprintf(str, "%d", brick_size) ;
+  setenv("FS_MRI_BRICK", str, 1) ;
+  run_bench(dim, sigma, &br_brick) ;
+  if (br_brick.mri_conv->brick_size != brick_size)
+    ErrorExit(ERROR_BADPARM, "%s: bricked layout was not selected", Progname) ;
+
+  printf("%-28s %10s %10s\n", "", "row", "bricked") ;
+  printf("%-28s %8dms %8dms\n", "MRIconvolveGaussian",
+         br_row.conv_msec, br_brick.conv_msec) ;
+  printf("%-28s %8dms %8dms\n", "MRIdilate+MRIerode",
+         br_row.morph_msec, br_brick.morph_msec) ;
+  printf("%-28s %8dms %8dms\n", "MRIsampleVolume",
+         br_row.sample_msec, br_brick.sample_msec) ;
+
+  conv_diff = BenchMaxAbsDiff(br_row.mri_conv, br_brick.mri_conv, NULL) ;
+  morph_diff = BenchMaxAbsDiff(br_row.mri_morph, br_brick.mri_morph, NULL) ;
+  printf("max diff: convolve %g, morphology %g, sample sums %g vs %g\n",
+         conv_diff, morph_diff, br_row.sample_sum, br_brick.sample_sum) ;
+
+  MRIfree(&br_row.mri_conv) ;
+  MRIfree(&br_row.mri_morph) ;
+  MRIfree(&br_brick.mri_conv) ;
+  MRIfree(&br_brick.mri_morph) ;
+
+  BenchExit(conv_diff > 0 || morph_diff > 0 ||
+            br_row.sample_sum != br_brick.sample_sum,
+            "layouts disagree") ;
+  return(0) ;
+}
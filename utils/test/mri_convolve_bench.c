@@ -0,0 +1,135 @@
+/**
+ * @file  mri_convolve_bench.c
+ * @brief compare the legacy and separable MRIconvolveGaussian paths
+ *
+ * Times MRIconvolveGaussian on synthetic float and uchar volumes with the
+ * per-voxel MRIconvolve1d path (FS_CONVOLVE_LEGACY) and with the
+ * row-vectorized engine in mriconvolve.c, and checks that they agree
+ * exactly. Also times the recursive MRIconvolveGaussianIIR for a wide
+ * kernel and reports how far it is from the FIR result.
+ *
+ * usage: mri_convolve_bench [dim [sigma [iir_sigma]]]
+ *   defaults are 256 (1mm) and 366 (0.7mm), 1.0 and 8.0
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mri.h"
+#include "error.h"
+#include "bench.h"
+
+const char *Progname = "mri_convolve_bench" ;
+
+static MRI *
+make_volume(int dim, int type)
+{
+  MRI *mri ;
+  int x, y, z ;
+
+  mri = MRIalloc(dim, dim, dim, type) ;
+  srand(17) ;
+  for (z = 0 ; z < dim ; z++)
+    for (y = 0 ; y < dim ; y++)
+      for (x = 0 ; x < dim ; x++)
+        MRIsetVoxVal(mri, x, y, z, 0, (float)(rand() % 256)) ;
+  return(mri) ;
+}
+
+// returns non-zero if the two paths disagree
+static int
+bench_fir(int dim, int type, float sigma)
+{
+  MRI    *mri_src, *mri_kernel, *mri_legacy, *mri_new ;
+  int    legacy_msec, new_msec ;
+  double diff ;
+
+  mri_src = make_volume(dim, type) ;
+  mri_kernel = MRIgaussian1d(sigma, -1) ;
+
+  setenv("FS_CONVOLVE_LEGACY", "1", 1) ;
+  BENCH_TIME(legacy_msec,
+             mri_legacy = MRIconvolveGaussian(mri_src, NULL, mri_kernel)) ;
+  unsetenv("FS_CONVOLVE_LEGACY") ;
+
+  BENCH_TIME(new_msec,
+             mri_new = MRIconvolveGaussian(mri_src, NULL, mri_kernel)) ;
+
+  diff = BenchMaxAbsDiff(mri_legacy, mri_new, NULL) ;
+  printf("%4d^3 %-6s sigma %4.1f: legacy %6dms  separable %6dms  "
+         "(%2.1fx)  max diff %g\n",
+         dim, type == MRI_UCHAR ? "uchar" : "float", sigma,
+         legacy_msec, new_msec,
+         new_msec > 0 ? (double)legacy_msec/new_msec : 0.0, diff) ;
+
+  MRIfree(&mri_legacy) ;
+  MRIfree(&mri_new) ;
+  MRIfree(&mri_kernel) ;
+  MRIfree(&mri_src) ;
+  return(diff > 0) ;
+}
+
+static void
+bench_iir(int dim, float sigma)
+{
+  MRI    *mri_src, *mri_kernel, *mri_fir, *mri_iir ;
+  int    fir_msec, iir_msec ;
+  double diff, mean_diff ;
+
+  mri_src = make_volume(dim, MRI_FLOAT) ;
+  mri_kernel = MRIgaussian1d(sigma, -1) ;
+
+  BENCH_TIME(fir_msec,
+             mri_fir = MRIconvolveGaussian(mri_src, NULL, mri_kernel)) ;
+
+  BENCH_TIME(iir_msec,
+             mri_iir = MRIconvolveGaussianIIR(mri_src, NULL, sigma)) ;
+
+  diff = BenchMaxAbsDiff(mri_fir, mri_iir, &mean_diff) ;
+  printf("%4d^3 float  sigma %4.1f: FIR %6dms  IIR %6dms  "
+         "max diff %2.3f mean %2.4f (of 0-255)\n",
+         dim, sigma, fir_msec, iir_msec, diff, mean_diff) ;
+
+  MRIfree(&mri_fir) ;
+  MRIfree(&mri_iir) ;
+  MRIfree(&mri_kernel) ;
+  MRIfree(&mri_src) ;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int   dims[2] = { 256, 366 }, ndims = 2, i, bad = 0 ;
+  float sigma = 1.0, iir_sigma = 8.0 ;
+
+  if (argc > 1)
+  {
+    dims[0] = atoi(argv[1]) ;
+    ndims = 1 ;
+  }
+  if (argc > 2) sigma = atof(argv[2]) ;
+  if (argc > 3) iir_sigma = atof(argv[3]) ;
+
+  unsetenv("FS_GAUSSIAN_IIR") ;
+  for (i = 0 ; i < ndims ; i++)
+  {
+    bad |= bench_fir(dims[i], MRI_FLOAT, sigma) ;
+    bad |= bench_fir(dims[i], MRI_UCHAR, sigma) ;
+    bench_iir(dims[i], iir_sigma) ;
+  }
+
+  BenchExit(bad, "separable path differs from MRIconvolve1d") ;
+  return(0) ;
+}
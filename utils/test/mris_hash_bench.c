@@ -0,0 +1,129 @@
+/**
+ * @file  mris_hash_bench.c
+ * @brief time MRIS_HASH_TABLE construction and queries on real surfaces
+ *
+ * For each surface (eg lh.white and lh.sphere) times MHTfillTable and
+ * MHTfillVertexTable, a self-intersection sweep with
+ * MHTdoesFaceIntersect, and nearest-vertex lookups for probes 0.5mm
+ * off every vertex, one at a time through MHTfindClosestVertexGeneric
+ * and all at once through MHTfindKNearestVertices, checking that the
+ * two agree. Also times a batched 2mm MHTfindVerticesWithinRadius.
+ *
+ * usage: mris_hash_bench <surf> [<surf> ...]
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "mrisurf.h"
+#include "error.h"
+#include "bench.h"
+
+const char *Progname = "mris_hash_bench" ;
+
+#define PROBE_OFFSET  0.5
+#define MAX_DIST      4.0
+#define RADIUS        2.0
+
+// returns non-zero if the batched and single lookups disagree
+static int
+bench_surface(const char *fname)
+{
+  MRI_SURFACE     *mris ;
+  MRIS_HASH_TABLE *mht ;
+  int             msec, vno, fno, nintersect, nbad, *vnos, *offsets, *hits ;
+  float           *probes, *dists ;
+  VERTEX          *v, *vtx ;
+  int             vtxnum ;
+  double          dist ;
+
+  mris = BenchReadSurface(fname) ;
+
+  //------ face table ------
+  BENCH_TIME(msec, mht = MHTfillTable(mris, NULL)) ;
+  printf("  MHTfillTable                 %6dms (%d buckets)\n",
+         msec, mht->nbuckets) ;
+
+  BENCH_TIME(msec,
+             for (nintersect = fno = 0 ; fno < mris->nfaces ; fno++)
+               nintersect += MHTdoesFaceIntersect(mht, mris, fno)) ;
+  printf("  MHTdoesFaceIntersect x%-7d %6dms (%d intersecting)\n",
+         mris->nfaces, msec, nintersect) ;
+  MHTfree(&mht) ;
+
+  //------ vertex table ------
+  BENCH_TIME(msec, mht = MHTfillVertexTable(mris, NULL, CURRENT_VERTICES)) ;
+  printf("  MHTfillVertexTable           %6dms (%d buckets)\n",
+         msec, mht->nbuckets) ;
+
+  probes = (float *)malloc(3*mris->nvertices*sizeof(float)) ;
+  vnos = (int *)malloc(mris->nvertices*sizeof(int)) ;
+  dists = (float *)malloc(mris->nvertices*sizeof(float)) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    v = &mris->vertices[vno] ;
+    probes[3*vno] = v->x + PROBE_OFFSET*v->nx ;
+    probes[3*vno+1] = v->y + PROBE_OFFSET*v->ny ;
+    probes[3*vno+2] = v->z + PROBE_OFFSET*v->nz ;
+  }
+
+  BENCH_TIME(msec,
+             MHTfindKNearestVertices(mht, mris, mris->nvertices, probes, 1,
+                                     MAX_DIST, vnos, dists)) ;
+  printf("  MHTfindKNearestVertices k=1  %6dms\n", msec) ;
+
+  BENCH_TIME(msec,
+             for (nbad = vno = 0 ; vno < mris->nvertices ; vno++)
+             {
+               MHTfindClosestVertexGeneric(mht, mris,
+                                           probes[3*vno], probes[3*vno+1],
+                                           probes[3*vno+2], MAX_DIST, -1,
+                                           &vtx, &vtxnum, &dist) ;
+               // ties may be broken differently, so compare distances
+               if ((vtxnum < 0) != (vnos[vno] < 0) ||
+                   (vtxnum >= 0 && fabs(dist - dists[vno]) > 1e-4))
+                 nbad++ ;
+             }) ;
+  printf("  MHTfindClosestVertexGeneric  %6dms (%d disagree)\n", msec, nbad) ;
+
+  BENCH_TIME(msec,
+             MHTfindVerticesWithinRadius(mht, mris, mris->nvertices, probes,
+                                         RADIUS, &offsets, &hits)) ;
+  printf("  MHTfindVerticesWithinRadius  %6dms (%2.1f per probe)\n",
+         msec, (double)offsets[mris->nvertices]/mris->nvertices) ;
+
+  free(offsets) ;
+  free(hits) ;
+  free(probes) ;
+  free(vnos) ;
+  free(dists) ;
+  MHTfree(&mht) ;
+  MRISfree(&mris) ;
+  return(nbad > 0) ;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, bad = 0 ;
+
+  BenchUsage(argc, 1, "<surf> [<surf> ...]") ;
+  for (i = 1 ; i < argc ; i++)
+    bad |= bench_surface(argv[i]) ;
+
+  BenchExit(bad, "batched and single nearest-vertex lookups differ") ;
+  return(0) ;
+}
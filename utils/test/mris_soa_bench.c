@@ -0,0 +1,96 @@
+/**
+ * @file  mris_soa_bench.c
+ * @brief time the SoA vertex mirror against the VERTEX array
+ *
+ * Reads a surface (eg a ~150k vertex lh.white), fills the gradients
+ * with a fixed pseudo-random field and times MRISaverageGradients()
+ * with and without an MRIS_SOA attached, checking that both give
+ * bit-identical gradients. Also reports the cost of building the
+ * mirror and of one position gather.
+ *
+ * usage: mris_soa_bench <surf> [navgs]
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mrisurf.h"
+#include "error.h"
+#include "bench.h"
+
+const char *Progname = "mris_soa_bench" ;
+
+static void
+fill_gradients(MRI_SURFACE *mris)
+{
+  int    vno ;
+  VERTEX *v ;
+
+  srand(17) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    v = &mris->vertices[vno] ;
+    v->dx = (float)rand()/RAND_MAX - 0.5f ;
+    v->dy = (float)rand()/RAND_MAX - 0.5f ;
+    v->dz = (float)rand()/RAND_MAX - 0.5f ;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  MRI_SURFACE *mris ;
+  int         msec_aos, msec_soa, msec, vno, nbad, navgs = 64 ;
+  float       *dx ;
+  char        str[STRLEN] ;
+
+  BenchUsage(argc, 1, "<surf> [navgs]") ;
+  if (argc > 2)
+    navgs = atoi(argv[2]) ;
+
+  mris = BenchReadSurface(argv[1]) ;
+  printf("  %d averages\n", navgs) ;
+
+  // VERTEX array
+  fill_gradients(mris) ;
+  BENCH_TIME(msec_aos, MRISaverageGradients(mris, navgs)) ;
+  dx = (float *)malloc(3*mris->nvertices*sizeof(float)) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+    memmove(&dx[3*vno], &mris->vertices[vno].dx, 3*sizeof(float)) ;
+
+  // SoA mirror
+  BENCH_TIME(msec, MRISallocSoA(mris)) ;
+  printf("  MRISallocSoA            %6dms\n", msec) ;
+  BENCH_TIME(msec, MRISsoaUpdatePositions(mris, mris->soa)) ;
+  printf("  MRISsoaUpdatePositions  %6dms\n", msec) ;
+
+  fill_gradients(mris) ;
+  BENCH_TIME(msec_soa, MRISaverageGradients(mris, navgs)) ;
+
+  for (nbad = vno = 0 ; vno < mris->nvertices ; vno++)
+    if (memcmp(&dx[3*vno], &mris->vertices[vno].dx, 3*sizeof(float)))
+      nbad++ ;
+
+  printf("  MRISaverageGradients    %6dms (VERTEX)  %6dms (SoA)  "
+         "%2.2fx\n", msec_aos, msec_soa,
+         (float)msec_aos/(msec_soa > 0 ? msec_soa : 1)) ;
+
+  free(dx) ;
+  MRISfree(&mris) ;
+  sprintf(str, "%d vertices differ", nbad) ;
+  BenchExit(nbad > 0, str) ;
+  return(0) ;
+}
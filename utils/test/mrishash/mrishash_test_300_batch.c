@@ -0,0 +1,251 @@
+/*--------------------------------------------
+  mrishash_test_300_batch.c
+
+  The test code has to test:
+
+  1. That MHTfindKNearestVertices returns the same k distances, in
+  order, as a brute force scan, and -1 where fewer than k vertices
+  lie within max_dist.
+  2. That MHTfindVerticesWithinRadius returns exactly the vertices a
+  brute force scan finds within the radius.
+  3. That both agree with the brute force when xyz is NULL (probes
+  are the surface's own vertices).
+
+  ----------------------------------------------*/
+
+#define TestRepetitions    10
+#define ProbeCount        200
+#define KNearest            6
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "macros.h"
+#include "error.h"
+#include "diag.h"
+#include "proto.h"
+#include "mrisurf.h"
+#include "mri.h"
+#include "version.h"
+
+#include "gw_utils.h"
+#include "icosahedron.h"
+
+char * Progname;
+char progver[] = "V1.00";
+char logfilepath[1000];
+
+//------------------------------
+void init_various(char * AProgname) {
+//------------------------------
+  int rslt;
+  sprintf( logfilepath, "%s_log.txt", Progname);
+
+  rslt = gw_log_init(Progname, progver, logfilepath, 1); // empty file
+  if (rslt) {
+    printf("Couldn't open log file %s", logfilepath);
+    exit(-1);
+  }
+}
+
+//---------------------------------------
+static int compare_dists(const void *a, const void *b) {
+//---------------------------------------
+  float fa = *(const float *)a, fb = *(const float *)b;
+  return (fa < fb) ? -1 : (fa > fb) ? 1 : 0;
+}
+
+//---------------------------------------
+// Check one probe's kNN and radius answers against brute force.
+// Returns errnum, 0 if OK.
+//---------------------------------------
+static int CheckProbe(MRI_SURFACE *mris, float *scratch,
+                      double probex, double probey, double probez,
+                      double maxdist, double radius,
+                      const int *knn_vnos, const float *knn_dists,
+                      const int *rad_vnos, int rad_count) {
+  int vno, n, nin, brute_rad;
+  VERTEX *v;
+  double dsq;
+
+  for (nin = brute_rad = vno = 0; vno < mris->nvertices; vno++) {
+    v = &mris->vertices[vno];
+    dsq = SQR(probex-v->x) + SQR(probey-v->y) + SQR(probez-v->z);
+    if (dsq <= radius*radius)
+      brute_rad++;
+    if (dsq <= maxdist*maxdist)
+      scratch[nin++] = sqrt(dsq);
+  }
+  qsort(scratch, nin, sizeof(float), compare_dists);
+
+  for (n = 0; n < KNearest; n++) {
+    if (n >= nin) {
+      if (knn_vnos[n] != -1) return 1;
+      continue;
+    }
+    if (knn_vnos[n] < 0) return 2;
+    if (fabs(knn_dists[n] - scratch[n]) > 0.001) return 3;
+    v = &mris->vertices[knn_vnos[n]];
+    dsq = SQR(probex-v->x) + SQR(probey-v->y) + SQR(probez-v->z);
+    if (fabs(sqrt(dsq) - knn_dists[n]) > 0.001) return 4;
+  }
+
+  if (rad_count != brute_rad) return 5;
+  for (n = 0; n < rad_count; n++) {
+    v = &mris->vertices[rad_vnos[n]];
+    dsq = SQR(probex-v->x) + SQR(probey-v->y) + SQR(probez-v->z);
+    if (dsq > radius*radius*1.0001) return 6;
+  }
+  return 0;
+}
+
+//---------------------------------------
+int TestBatchInConcentricIcos(int surfacenum) {
+//---------------------------------------
+  int errnum = 0, rslt = 0; // default OK
+  int pick, probeix, npoints, *knn_vnos, *offsets, *rad_vnos;
+  char msg[1000];
+  double radius1, radius2, mhtres = 0.0, maxdist, radius;
+  double vecx, vecy, vecz, veclen, probedistance;
+  float *xyz, *knn_dists, *scratch;
+  VERTEX *v;
+  MRI_SURFACE * mris = NULL;
+  MRIS_HASH_TABLE * mht = NULL;
+
+  //------------------------------------------
+  // pick some initial random dimensions
+  //------------------------------------------
+  pick = floor(4.9 * ((double) rand() / RAND_MAX));
+  switch(pick) {
+  case 0:
+  case 1: mhtres = 1.0;   break;
+  case 2: mhtres = 2.0;   break;
+  case 3: mhtres = 4.0;   break;
+  case 4: mhtres = 8.0;   break;
+  }
+
+  radius1 = 10 + 64 * ((double) rand() / RAND_MAX);
+  radius2 = radius1 + 1 + 4 * ((double) rand() / RAND_MAX);
+  maxdist = 0.5 + 8 * ((double) rand() / RAND_MAX);
+  radius  = 0.5 + 6 * ((double) rand() / RAND_MAX);
+
+  mris = ic2562_make_two_icos(0,0,0,radius1, 0,0,0, radius2);
+  mht  = MHTfillVertexTableRes(mris, NULL, CURRENT_VERTICES, mhtres);
+
+  //------------------------------------------
+  // random probes between and around the two shells
+  //------------------------------------------
+  npoints = ProbeCount;
+  xyz = (float *)calloc(3*npoints, sizeof(float));
+  for (probeix = 0; probeix < npoints; probeix++) {
+    probedistance = radius1 - 2 + (radius2 - radius1 + 4) *
+      ((double) rand() / RAND_MAX);
+    vecx = ((double) rand() / RAND_MAX) - 0.5;
+    vecy = ((double) rand() / RAND_MAX) - 0.5;
+    vecz = ((double) rand() / RAND_MAX) - 0.5;
+    veclen = sqrt(vecx*vecx + vecy*vecy + vecz*vecz);
+    xyz[3*probeix  ] = vecx / veclen * probedistance;
+    xyz[3*probeix+1] = vecy / veclen * probedistance;
+    xyz[3*probeix+2] = vecz / veclen * probedistance;
+  }
+
+  knn_vnos  = (int *)calloc(KNearest*mris->nvertices, sizeof(int));
+  knn_dists = (float *)calloc(KNearest*mris->nvertices, sizeof(float));
+  scratch   = (float *)calloc(mris->nvertices, sizeof(float));
+
+  //------------------------------------------
+  // explicit probes
+  //------------------------------------------
+  MHTfindKNearestVertices(mht, mris, npoints, xyz, KNearest, maxdist,
+                          knn_vnos, knn_dists);
+  MHTfindVerticesWithinRadius(mht, mris, npoints, xyz, radius,
+                              &offsets, &rad_vnos);
+  for (probeix = 0; probeix < npoints && !errnum; probeix++)
+    errnum = CheckProbe(mris, scratch,
+                        xyz[3*probeix], xyz[3*probeix+1], xyz[3*probeix+2],
+                        maxdist, radius,
+                        &knn_vnos[KNearest*probeix],
+                        &knn_dists[KNearest*probeix],
+                        &rad_vnos[offsets[probeix]],
+                        offsets[probeix+1] - offsets[probeix]);
+  free(offsets);
+  free(rad_vnos);
+
+  //------------------------------------------
+  // surface's own vertices (xyz == NULL)
+  //------------------------------------------
+  if (!errnum) {
+    MHTfindKNearestVertices(mht, mris, mris->nvertices, NULL, KNearest,
+                            maxdist, knn_vnos, knn_dists);
+    MHTfindVerticesWithinRadius(mht, mris, mris->nvertices, NULL, radius,
+                                &offsets, &rad_vnos);
+    for (probeix = 0; probeix < mris->nvertices && !errnum; probeix++) {
+      v = &mris->vertices[probeix];
+      if (knn_vnos[KNearest*probeix] < 0 || knn_dists[KNearest*probeix] > 0)
+        errnum = 20;  // nearest vertex to a vertex is itself
+      else
+        errnum = CheckProbe(mris, scratch, v->x, v->y, v->z,
+                            maxdist, radius,
+                            &knn_vnos[KNearest*probeix],
+                            &knn_dists[KNearest*probeix],
+                            &rad_vnos[offsets[probeix]],
+                            offsets[probeix+1] - offsets[probeix]);
+    }
+    if (errnum && errnum < 20)
+      errnum += 10;
+    free(offsets);
+    free(rad_vnos);
+  }
+
+  if (errnum)
+    rslt = 1;
+
+  sprintf(msg, "%5d  %8.4f %8.4f %8.4f %8.4f %8.4f %d %d",
+          surfacenum, radius1, radius2, mhtres, maxdist, radius,
+          errnum, rslt);
+  gw_log_message(msg);
+  printf("%s\n", msg);
+
+  free(xyz);
+  free(knn_vnos);
+  free(knn_dists);
+  free(scratch);
+  MHTfree(&mht);
+  MRISfree(&mris);
+  return rslt;
+}
+char testhead[] =
+"surface rad1 rad2 mhtres maxdist radius err rslt";
+
+//-----------------------------------
+int main(int argc, char *argv[]) {
+//-----------------------------------
+  int n;
+  int rslt = 0; // default to OK
+
+  if (getenv("SKIP_MRISHASH_TEST")) exit(77); // bypass
+
+  Progname = argv[0];
+  init_various(Progname);  // and gw_log_init
+
+  gw_log_begin();
+
+  printf("------------------------------\n");
+  printf("Program: %s\n", Progname);
+
+  gw_log_message(testhead); printf("%s\n", testhead);
+
+  srand((unsigned int) time((time_t *) NULL) );
+
+  for (n = 0; n < TestRepetitions; n++) {
+    rslt = TestBatchInConcentricIcos(n);
+    if (rslt) break;
+  }
+
+  gw_log_end();
+
+  return rslt;
+}
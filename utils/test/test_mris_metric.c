@@ -0,0 +1,190 @@
+/**
+ * @file  test_mris_metric.c
+ * @brief compare the SoA metric kernel with MRIScomputeMetricProperties()
+ *
+ * Builds two identical jittered ic2562 surfaces with 2-ring distances,
+ * attaches an MRIS_SOA with incremental metrics to one of them, and
+ * checks that MRIScomputeMetricProperties() gives the same vertex and
+ * face normals, areas, face angles, neighbor distances and total area
+ * on both to a relative tolerance: on a full update, after moving a
+ * subset of the vertices, after ripping and unripping faces and a
+ * vertex, and again with the surfaces projected onto a sphere.
+ *
+ * usage: test_mris_metric
+ */
+/*
+ * Copyright © 2011 The General Hospital Corporation (Boston, MA) "MGH"
+ *
+ * Terms and conditions for use, reproduction, distribution and contribution
+ * are found in the 'FreeSurfer Software License Agreement' contained
+ * in the file 'LICENSE' found in the FreeSurfer distribution, and here:
+ *
+ * https://surfer.nmr.mgh.harvard.edu/fswiki/FreeSurferSoftwareLicense
+ *
+ * Reporting: freesurfer@nmr.mgh.harvard.edu
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mrisurf.h"
+#include "icosahedron.h"
+#include "error.h"
+
+const char *Progname = "test_mris_metric" ;
+
+#define METRIC_TOL  1e-5
+
+static MRI_SURFACE *
+make_surface(void)
+{
+  MRI_SURFACE *mris ;
+  int         vno ;
+
+  mris = ic2562_make_surface(0, 0) ;
+  if (!mris)
+    ErrorExit(ERROR_NOMEMORY, "%s: could not build ic2562", Progname) ;
+  srand(17) ;
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *v = &mris->vertices[vno] ;
+    v->x += 2.0f*((float)rand()/RAND_MAX - 0.5f) ;
+    v->y += 2.0f*((float)rand()/RAND_MAX - 0.5f) ;
+    v->z += 2.0f*((float)rand()/RAND_MAX - 0.5f) ;
+    v->origarea = -1 ;
+  }
+  mris->status = MRIS_TRIANGULAR_SURFACE ;
+  MRISsetNeighborhoodSize(mris, 2) ;
+  return(mris) ;
+}
+
+static int
+differ(double a, double b)
+{
+  return(fabs(a-b) > METRIC_TOL*(1.0 + fabs(a))) ;
+}
+
+static int
+compare(MRI_SURFACE *mris_ref, MRI_SURFACE *mris, const char *what)
+{
+  int vno, fno, n, nbad = 0 ;
+
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *vr = &mris_ref->vertices[vno], *v = &mris->vertices[vno] ;
+
+    if (differ(vr->nx, v->nx) || differ(vr->ny, v->ny) ||
+        differ(vr->nz, v->nz) || differ(vr->area, v->area) ||
+        differ(vr->origarea, v->origarea) || vr->border != v->border)
+    {
+      if (nbad++ < 5)
+        printf("  v %d: (%f, %f, %f) area %f != (%f, %f, %f) area %f\n",
+               vno, vr->nx, vr->ny, vr->nz, vr->area,
+               v->nx, v->ny, v->nz, v->area) ;
+    }
+    for (n = 0 ; n < v->vtotal ; n++)
+      if (differ(vr->dist[n], v->dist[n]))
+      {
+        if (nbad++ < 5)
+          printf("  v %d: dist[%d] %f != %f\n",
+                 vno, n, vr->dist[n], v->dist[n]) ;
+      }
+  }
+  for (fno = 0 ; fno < mris->nfaces ; fno++)
+  {
+    FACE *fr = &mris_ref->faces[fno], *f = &mris->faces[fno] ;
+
+    if (differ(fr->area, f->area) || differ(fr->nx, f->nx) ||
+        differ(fr->ny, f->ny) || differ(fr->nz, f->nz) ||
+        differ(fr->angle[0], f->angle[0]) ||
+        differ(fr->angle[1], f->angle[1]) ||
+        differ(fr->angle[2], f->angle[2]))
+    {
+      if (nbad++ < 5)
+        printf("  f %d: area %f != %f\n", fno, fr->area, f->area) ;
+    }
+  }
+  if (differ(mris_ref->total_area, mris->total_area))
+  {
+    printf("  total area %f != %f\n", mris_ref->total_area, mris->total_area);
+    nbad++ ;
+  }
+  printf("%-32s %s\n", what, nbad ? "FAIL" : "ok") ;
+  return(nbad) ;
+}
+
+static void
+both(MRI_SURFACE *mris_ref, MRI_SURFACE *mris)
+{
+  MRIScomputeMetricProperties(mris_ref) ;
+  MRIScomputeMetricProperties(mris) ;
+}
+
+int
+main(int argc, char *argv[])
+{
+  MRI_SURFACE *mris_ref, *mris ;
+  int         vno, fno, nbad = 0 ;
+
+  mris_ref = make_surface() ;   // no SoA, so the VERTEX/FACE code
+  mris = make_surface() ;
+  MRISallocSoA(mris) ;
+  mris->soa->metric_incremental = 1 ;
+
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "full") ;
+
+  for (vno = 0 ; vno < mris->nvertices ; vno += 7)
+  {
+    mris_ref->vertices[vno].x += 0.5f ;
+    mris->vertices[vno].x += 0.5f ;
+  }
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "incremental, moved vertices") ;
+
+  for (fno = 0 ; fno < mris->nfaces ; fno += 97)
+    mris_ref->faces[fno].ripflag = mris->faces[fno].ripflag = 1 ;
+  mris_ref->vertices[11].ripflag = mris->vertices[11].ripflag = 1 ;
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "incremental, ripped faces") ;
+
+  mris_ref->faces[97].ripflag = mris->faces[97].ripflag = 0 ;
+  mris_ref->vertices[11].ripflag = mris->vertices[11].ripflag = 0 ;
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "incremental, unripped") ;
+
+  for (vno = 0 ; vno < mris->nvertices ; vno++)
+  {
+    VERTEX *vr = &mris_ref->vertices[vno], *v = &mris->vertices[vno] ;
+    float  len = sqrt(vr->x*vr->x + vr->y*vr->y + vr->z*vr->z) / 100.0f ;
+
+    v->x = vr->x = vr->x / len ;
+    v->y = vr->y = vr->y / len ;
+    v->z = vr->z = vr->z / len ;
+  }
+  mris_ref->status = mris->status = MRIS_SPHERE ;
+  mris_ref->radius = mris->radius = 100 ;
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "sphere") ;
+
+  for (vno = 3 ; vno < mris->nvertices ; vno += 13)
+  {
+    mris_ref->vertices[vno].y += 0.2f ;
+    mris->vertices[vno].y += 0.2f ;
+  }
+  both(mris_ref, mris) ;
+  nbad += compare(mris_ref, mris, "sphere, incremental") ;
+
+  MRISfree(&mris_ref) ;
+  MRISfree(&mris) ;
+  if (nbad)
+  {
+    printf("FAIL: %d differences\n", nbad) ;
+    exit(1) ;
+  }
+  printf("PASS\n") ;
+  exit(0) ;
+}
@@ -42,6 +42,9 @@
 #define _POSIX_C_SOURCE 1
 #endif
 #include "znzlib.h"
+#ifdef HAVE_ZLIB
+#include "bgzf.h"
+#endif
 
 /* Note extra argument (use_compression) where
    use_compression==0 is no compression
@@ -66,7 +69,15 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
   if (use_compression)
   {
     file->withz = 1;
-    if ((file->zfptr = gzopen(path,mode)) == NULL)
+    if (BGZFuseFor(path,mode))
+    {
+      if ((file->bgzfptr = BGZFopen(path,mode)) == NULL)
+      {
+        free(file);
+        file = NULL;
+      }
+    }
+    else if ((file->zfptr = gzopen(path,mode)) == NULL)
     {
       free(file);
       file = NULL;
@@ -132,6 +143,10 @@ int Xznzclose(znzFile * file)
     {
       retval = gzclose((*file)->zfptr);
     }
+    if ((*file)->bgzfptr!=NULL)
+    {
+      retval = BGZFclose((*file)->bgzfptr);
+    }
 #endif
     if ((*file)->nzfptr!=NULL)
     {
@@ -152,6 +167,8 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL)
+    return BGZFread(file->bgzfptr,buf,size*nmemb) / size;
   if (file->zfptr!=NULL)
     return (size_t) (gzread(file->zfptr,buf,((int) size)*((int) nmemb)) / size);
 #endif
@@ -165,6 +182,8 @@ size_t znzwrite(void* buf, size_t size, size_t nmemb, znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL)
+    return BGZFwrite(file->bgzfptr,buf,size*nmemb) / size;
   if (file->zfptr!=NULL)
     return (size_t) ( gzwrite(file->zfptr,buf,size*nmemb) / size );
 #endif
@@ -178,6 +197,7 @@ long znzseek(znzFile file, long offset, int whence)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFseek(file->bgzfptr,offset,whence);
   if (file->zfptr!=NULL) return (long) gzseek(file->zfptr,offset,whence);
 #endif
   return fseek(file->nzfptr,offset,whence);
@@ -190,6 +210,8 @@ int znzrewind(znzFile stream)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (stream->bgzfptr!=NULL)
+    return BGZFseek(stream->bgzfptr,0,SEEK_SET) < 0 ? -1 : 0;
   if (stream->zfptr!=NULL) return gzrewind(stream->zfptr);
 #endif
   rewind(stream->nzfptr);
@@ -203,6 +225,7 @@ long znztell(znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFtell(file->bgzfptr);
   if (file->zfptr!=NULL) return (long) gztell(file->zfptr);
 #endif
   return ftell(file->nzfptr);
@@ -215,6 +238,8 @@ int znzputs(char* str, znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL)
+    return (int) BGZFwrite(file->bgzfptr,str,strlen(str));
   if (file->zfptr!=NULL) return gzputs(file->zfptr,str);
 #endif
   return fputs(str,file->nzfptr);
@@ -228,6 +253,7 @@ char * znzgets(char* str, int size, znzFile file)
     return NULL;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFgets(file->bgzfptr,str,size);
   if (file->zfptr!=NULL) return gzgets(file->zfptr,str,size);
 #endif
   return fgets(str,size,file->nzfptr);
@@ -241,6 +267,7 @@ int znzflush(znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFflush(file->bgzfptr);
   if (file->zfptr!=NULL) return gzflush(file->zfptr,Z_SYNC_FLUSH);
 #endif
   return fflush(file->nzfptr);
@@ -254,6 +281,7 @@ int znzeof(znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFeof(file->bgzfptr);
   if (file->zfptr!=NULL) return gzeof(file->zfptr);
 #endif
   return feof(file->nzfptr);
@@ -267,6 +295,7 @@ int znzputc(int c, znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFputc(file->bgzfptr,c);
   if (file->zfptr!=NULL) return gzputc(file->zfptr,c);
 #endif
   return fputc(c,file->nzfptr);
@@ -280,6 +309,7 @@ int znzgetc(znzFile file)
     return 0;
   }
 #ifdef HAVE_ZLIB
+  if (file->bgzfptr!=NULL) return BGZFgetc(file->bgzfptr);
   if (file->zfptr!=NULL) return gzgetc(file->zfptr);
 #endif
   return fgetc(file->nzfptr);
@@ -299,7 +329,7 @@ int znzprintf(znzFile stream, const char *format, ...)
   }
   va_start(va, format);
 #ifdef HAVE_ZLIB
-  if (stream->zfptr!=NULL)
+  if (stream->zfptr!=NULL || stream->bgzfptr!=NULL)
   {
     int size;  /* local to HAVE_ZLIB block */
     size = strlen(format) + 1000000;  /* overkill I hope */
@@ -310,7 +340,10 @@ int znzprintf(znzFile stream, const char *format, ...)
       return retval;
     }
     vsprintf(tmpstr,format,va);
-    retval=gzprintf(stream->zfptr,"%s",tmpstr);
+    if (stream->bgzfptr!=NULL)
+      retval=(int)BGZFwrite(stream->bgzfptr,tmpstr,strlen(tmpstr));
+    else
+      retval=gzprintf(stream->zfptr,"%s",tmpstr);
     free(tmpstr);
   }
   else